@@ -0,0 +1,116 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "allocator.hh"
+
+#if defined(CCLS_ALLOCATOR_JEMALLOC)
+#include <jemalloc/jemalloc.h>
+#include <mutex>
+#include <stdio.h>
+#elif defined(CCLS_ALLOCATOR_MIMALLOC)
+#include <mimalloc.h>
+#endif
+
+namespace ccls {
+#if defined(CCLS_ALLOCATOR_JEMALLOC)
+namespace {
+const char *const kArenaNames[] = {"db", "indexer", "sema", "io"};
+constexpr int kNumArenas = sizeof(kArenaNames) / sizeof(kArenaNames[0]);
+unsigned arena_ids[kNumArenas];
+std::once_flag arenas_created;
+std::mutex node_mutex;
+// Indexer arenas of NUMA nodes other than 0, by node - 1.
+std::vector<unsigned> node_arenas;
+
+unsigned createArena() {
+  unsigned id;
+  size_t len = sizeof id;
+  return mallctl("arenas.create", &id, &len, nullptr, 0) ? 0 : id;
+}
+
+void createArenas() {
+  for (unsigned &id : arena_ids)
+    id = createArena();
+}
+
+int64_t readStat(unsigned id, const char *stat) {
+  char name[64];
+  snprintf(name, sizeof name, "stats.arenas.%u.%s", id, stat);
+  size_t value = 0, len = sizeof value;
+  mallctl(name, &value, &len, nullptr, 0);
+  return value;
+}
+} // namespace
+
+const char *allocatorName() { return "jemalloc"; }
+
+void setThreadArena(Arena arena, int node) {
+  std::call_once(arenas_created, createArenas);
+  unsigned id = arena_ids[int(arena)];
+  if (arena == Arena::Indexer && node > 0) {
+    std::lock_guard lock(node_mutex);
+    while (node_arenas.size() < size_t(node))
+      node_arenas.push_back(createArena());
+    id = node_arenas[node - 1];
+  }
+  mallctl("thread.arena", nullptr, nullptr, &id, sizeof id);
+}
+
+std::vector<ArenaStats> getArenaStats() {
+  std::call_once(arenas_created, createArenas);
+  // Statistics are snapshotted when the epoch advances.
+  uint64_t epoch = 1;
+  size_t len = sizeof epoch;
+  mallctl("epoch", &epoch, &len, &epoch, len);
+  size_t page = 4096;
+  len = sizeof page;
+  mallctl("arenas.page", &page, &len, nullptr, 0);
+  std::vector<ArenaStats> ret;
+  auto add = [&](std::string name, unsigned id) {
+    ret.push_back({std::move(name),
+                   readStat(id, "small.allocated") +
+                       readStat(id, "large.allocated"),
+                   readStat(id, "pactive") * int64_t(page)});
+  };
+  for (int i = 0; i < kNumArenas; i++)
+    add(kArenaNames[i], arena_ids[i]);
+  std::lock_guard lock(node_mutex);
+  for (size_t i = 0; i < node_arenas.size(); i++)
+    add("indexer@node" + std::to_string(i + 1), node_arenas[i]);
+  return ret;
+}
+
+bool purgeArenas() {
+  char name[64];
+  snprintf(name, sizeof name, "arena.%u.purge", unsigned(MALLCTL_ARENAS_ALL));
+  mallctl(name, nullptr, nullptr, nullptr, 0);
+  return true;
+}
+#elif defined(CCLS_ALLOCATOR_MIMALLOC)
+// mimalloc heaps are thread-local and cannot be shared by a subsystem, so
+// only process-wide numbers are reported.
+const char *allocatorName() { return "mimalloc"; }
+
+void setThreadArena(Arena, int) {}
+
+std::vector<ArenaStats> getArenaStats() {
+  size_t rss, peak_rss, commit, peak_commit, faults;
+  mi_process_info(nullptr, nullptr, nullptr, &rss, &peak_rss, &commit,
+                  &peak_commit, &faults);
+  return {{"process", int64_t(commit), int64_t(rss)}};
+}
+
+bool purgeArenas() {
+  mi_collect(true);
+  return true;
+}
+#else
+const char *allocatorName() { return "system"; }
+
+void setThreadArena(Arena, int) {}
+
+std::vector<ArenaStats> getArenaStats() { return {}; }
+
+bool purgeArenas() { return false; }
+#endif
+} // namespace ccls
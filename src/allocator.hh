@@ -0,0 +1,34 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace ccls {
+// Subsystems whose threads share an arena with the jemalloc build
+// (-DUSE_ALLOCATOR=jemalloc), so that their memory can be measured and purged
+// separately. The main thread and request threads use Arena::DB.
+enum class Arena { DB, Indexer, Sema, IO };
+
+struct ArenaStats {
+  std::string name;
+  // Bytes in live allocations and in pages backing them.
+  int64_t allocated, active;
+};
+
+// Name of the allocator ccls is linked with: jemalloc, mimalloc or system.
+const char *allocatorName();
+// Makes the calling thread allocate from |arena|. Indexer threads pinned to
+// NUMA node |node| get an arena per node, whose pages are first touched on
+// that node. A no-op unless built with jemalloc.
+void setThreadArena(Arena arena, int node = 0);
+// Returns the statistics of each arena, or of the whole process if the
+// allocator has no arenas. Empty with the system allocator.
+std::vector<ArenaStats> getArenaStats();
+// Returns unused pages of all arenas to the system. Returns false with the
+// system allocator, for which see freeUnusedMemory.
+bool purgeArenas();
+} // namespace ccls
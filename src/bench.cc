@@ -0,0 +1,492 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "bench.hh"
+
+#include "config.hh"
+#include "filesystem.hh"
+#include "fuzzy_match.hh"
+#include "indexer.hh"
+#include "query.hh"
+#include "serializer.hh"
+#include "utils.hh"
+#include "working_files.hh"
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <stdio.h>
+
+using namespace llvm;
+namespace chrono = std::chrono;
+
+namespace ccls {
+namespace {
+// Each benchmark is repeated until it has run for this long.
+constexpr chrono::milliseconds kMinTime(200);
+
+// Sink for results so that the compiler cannot drop the measured code.
+volatile int64_t sink;
+
+// Runs |n| iterations and returns the measured time. Bodies that need fresh
+// inputs per iteration prepare them outside timeLoop.
+using Body = std::function<chrono::nanoseconds(int64_t n)>;
+
+template <typename Fn> chrono::nanoseconds timeLoop(int64_t n, Fn &&fn) {
+  auto start = chrono::steady_clock::now();
+  for (int64_t i = 0; i < n; i++)
+    sink = sink + fn();
+  return chrono::steady_clock::now() - start;
+}
+
+struct Runner {
+  std::string filter;
+  int runs = 0;
+
+  // |items| is the number of operations (e.g. files or matches) in one
+  // iteration. Reports time per item.
+  void run(const std::string &name, int64_t items, const Body &body) {
+    if (name.find(filter) == std::string::npos || !items)
+      return;
+    int64_t n = 1;
+    chrono::nanoseconds t;
+    while ((t = body(n)) < kMinTime && n < (int64_t(1) << 30)) {
+      // Aim at 1.5x the minimum time, growing at most 10x at a time.
+      double ratio = t.count() ? 1.5 * chrono::nanoseconds(kMinTime).count() /
+                                     t.count()
+                               : 10;
+      n = std::max(n + 1, int64_t(n * std::min(ratio, 10.0)));
+    }
+    double per_item = double(t.count()) / n / items;
+    printf("%-44s %10lld %14.1f ns/item %8lld items\n", name.c_str(),
+           (long long)n, per_item, (long long)items);
+    fflush(stdout);
+    runs++;
+  }
+};
+
+// A deterministic file with |n| structs, variables and functions. Function i
+// calls function i*7%n and reads variable i*13%n.
+std::unique_ptr<IndexFile> makeSynthetic(int n) {
+  std::string contents;
+  auto file = std::make_unique<IndexFile>("/bench/synthetic.cc", "", false);
+  file->language = LanguageId::Cpp;
+  file->mtime = 1;
+  int line = 0;
+  auto range = [&](size_t col, size_t len) {
+    return Range{{uint16_t(line), int16_t(col)},
+                 {uint16_t(line), int16_t(col + len)}};
+  };
+  auto addLine = [&](const std::string &s) {
+    contents += s;
+    contents += '\n';
+  };
+  auto decl = [&](const std::string &s, const std::string &name) {
+    DeclRef d;
+    d.range = range(s.find(name), name.size());
+    d.extent = range(0, s.size());
+    d.role = Role::Definition;
+    return d;
+  };
+  auto use = [&](const std::string &s, const std::string &name, Role role) {
+    Use u;
+    u.range = range(s.rfind(name), name.size());
+    u.role = role;
+    return u;
+  };
+  auto usr = [](const char *prefix, int i) {
+    return hashUsr(prefix + std::to_string(i));
+  };
+  auto setName = [](auto &def, const std::string &detailed, int offset,
+                    int size) {
+    def.detailed_name = intern(detailed);
+    def.qual_name_offset = def.short_name_offset = offset;
+    def.short_name_size = size;
+  };
+
+  for (int i = 0; i < n; i++) {
+    std::string t = "T" + std::to_string(i), v = "v" + std::to_string(i),
+                f = "f" + std::to_string(i);
+    std::string s = "struct " + t + " { int m; };";
+    IndexType &type = file->toType(usr("T", i));
+    setName(type.def, "struct " + t, 7, t.size());
+    type.def.spell = decl(s, t);
+    type.def.kind = SymbolKind::Struct;
+    addLine(s);
+    line++;
+
+    s = "int " + v + " = " + std::to_string(i) + ";";
+    IndexVar &var = file->toVar(usr("v", i));
+    setName(var.def, "int " + v, 4, v.size());
+    var.def.spell = decl(s, v);
+    var.def.kind = SymbolKind::Variable;
+    var.def.type = usr("T", i);
+    addLine(s);
+    line++;
+
+    std::string callee = "f" + std::to_string(i * 7 % n),
+                read = "v" + std::to_string(i * 13 % n);
+    s = "int " + f + "(" + t + " a) { return " + callee + "(a) + " + read +
+        "; }";
+    IndexFunc &func = file->toFunc(usr("f", i));
+    setName(func.def, "int " + f + "(" + t + " a)", 4, f.size());
+    func.def.spell = decl(s, f);
+    func.def.kind = SymbolKind::Function;
+    type.uses.push_back(use(s, t, Role::Reference));
+    Use call = use(s, callee + "(", Role::Call);
+    call.range.end.column = call.range.start.column + callee.size();
+    func.def.callees.push_back(
+        {call.range, usr("f", i * 7 % n), Kind::Func, Role::Call});
+    file->toFunc(usr("f", i * 7 % n)).uses.push_back(call);
+    Use r = use(s, read + ";", Role::Read);
+    r.range.end.column = r.range.start.column + read.size();
+    file->toVar(usr("v", i * 13 % n)).uses.push_back(r);
+    addLine(s);
+    line++;
+  }
+  file->file_contents = contents;
+  return file;
+}
+
+// Loads cache files of both formats under |dir|.
+std::vector<std::unique_ptr<IndexFile>> loadRecorded(const std::string &dir) {
+  std::vector<std::unique_ptr<IndexFile>> ret;
+  getFilesInFolder(dir, true, true, [&](const std::string &path) {
+    StringRef p(path);
+    SerializeFormat format;
+    if (p.endswith(".blob"))
+      format = SerializeFormat::Binary;
+    else if (p.endswith(".json"))
+      format = SerializeFormat::Json;
+    else
+      return;
+    std::string base = p.drop_back(5).str();
+    std::optional<std::string> contents = readContent(base),
+                               serialized = readContent(path);
+    if (!contents || !serialized)
+      return;
+    if (auto file = deserialize(format, base, *serialized, *contents,
+                                IndexFile::kMajorVersion)) {
+      file->file_contents = *contents;
+      ret.push_back(std::move(file));
+    }
+  });
+  return ret;
+}
+
+// Buffer contents after typical edits: a line inserted every 50 lines and a
+// character appended to every 7th line.
+std::string editBuffer(const std::string &contents) {
+  std::string ret;
+  int line = 0;
+  for (StringRef rest = contents; rest.size();) {
+    auto [l, r] = rest.split('\n');
+    rest = r;
+    if (line % 50 == 25)
+      ret += "// inserted\n";
+    ret += l;
+    if (line % 7 == 3)
+      ret += ' ';
+    ret += '\n';
+    line++;
+  }
+  return ret;
+}
+
+void runSet(Runner &runner, const std::string &label,
+            std::vector<std::unique_ptr<IndexFile>> &files) {
+  int64_t nfiles = files.size();
+  for (SerializeFormat format : {SerializeFormat::Binary,
+                                 SerializeFormat::Json}) {
+    std::string suffix =
+        (format == SerializeFormat::Binary ? "binary/" : "json/") + label;
+    runner.run("serialize/" + suffix, nfiles, [&](int64_t n) {
+      return timeLoop(n, [&] {
+        int64_t size = 0;
+        for (auto &file : files)
+          size += serialize(format, *file).size();
+        return size;
+      });
+    });
+    std::vector<std::string> serialized;
+    for (auto &file : files)
+      serialized.push_back(serialize(format, *file));
+    runner.run("deserialize/" + suffix, nfiles, [&](int64_t n) {
+      return timeLoop(n, [&] {
+        int64_t count = 0;
+        for (size_t i = 0; i < files.size(); i++)
+          count += !!deserialize(format, files[i]->path, serialized[i],
+                                 files[i]->file_contents,
+                                 IndexFile::kMajorVersion);
+        return count;
+      });
+    });
+  }
+
+  std::vector<std::string> names;
+  for (auto &file : files) {
+    for (auto &[_, func] : file->usr2func)
+      names.push_back(func.def.detailed_name);
+    for (auto &[_, type] : file->usr2type)
+      names.push_back(type.def.detailed_name);
+    for (auto &[_, var] : file->usr2var)
+      names.push_back(var.def.detailed_name);
+  }
+  for (const char *pattern : {"f", "f12", "T1 a", "intf", "applyIdx"}) {
+    runner.run(std::string("fuzzyMatch/") + pattern + "/" + label,
+               names.size(), [&](int64_t n) {
+                 FuzzyMatcher matcher(pattern, 0);
+                 return timeLoop(n, [&] {
+                   int64_t score = 0;
+                   for (const std::string &name : names)
+                     score += matcher.match(name, false);
+                   return score;
+                 });
+               });
+  }
+
+  std::vector<std::unique_ptr<WorkingFile>> wfiles;
+  int64_t nlines = 0;
+  for (auto &file : files) {
+    auto &wf = wfiles.emplace_back(std::make_unique<WorkingFile>(
+        file->path, editBuffer(file->file_contents)));
+    wf->setIndexContent(file->file_contents);
+    nlines += wf->index_lines.size();
+  }
+  runner.run("lineMapping/compute/" + label, nlines, [&](int64_t n) {
+    return timeLoop(n, [&] {
+      int64_t ret = 0;
+      for (auto &wf : wfiles) {
+        wf->index_to_buffer.clear();
+        int column = 0;
+        ret += wf->getBufferPosFromIndexPos(0, &column, false).value_or(0);
+      }
+      return ret;
+    });
+  });
+  // Modified lines are resolved with myersDiff.
+  runner.run("lineMapping/match/" + label, nlines, [&](int64_t n) {
+    return timeLoop(n, [&] {
+      int64_t ret = 0;
+      for (auto &wf : wfiles)
+        for (int i = 0; i < (int)wf->index_lines.size(); i++) {
+          int column = 1;
+          ret += wf->getBufferPosFromIndexPos(i, &column, false).value_or(0);
+        }
+      return ret;
+    });
+  });
+
+  auto copies = [&] {
+    std::vector<IndexFile> ret;
+    for (auto &file : files)
+      ret.push_back(*file);
+    return ret;
+  };
+  runner.run("createDelta/" + label, nfiles, [&](int64_t n) {
+    chrono::nanoseconds t{};
+    for (int64_t i = 0; i < n; i++) {
+      // createDelta moves lid2path out of its arguments.
+      std::vector<IndexFile> prev = copies(), curr = copies();
+      t += timeLoop(1, [&] {
+        int64_t count = 0;
+        for (size_t j = 0; j < curr.size(); j++)
+          count += IndexUpdate::createDelta(&prev[j], &curr[j]).funcs_hint;
+        return count;
+      });
+    }
+    return t;
+  });
+  runner.run("applyIndexUpdate/" + label, nfiles, [&](int64_t n) {
+    chrono::nanoseconds t{};
+    DB db;
+    for (int64_t i = 0; i < n; i++) {
+      // Alternately add every file and remove it, so that the DB does not grow.
+      std::vector<IndexFile> curr = copies();
+      std::vector<IndexUpdate> adds, removes;
+      for (IndexFile &file : curr)
+        adds.push_back(IndexUpdate::createDelta(nullptr, &file));
+      t += timeLoop(1, [&] {
+        for (IndexUpdate &u : adds)
+          db.applyIndexUpdate(&u);
+        return 0;
+      });
+      curr = copies();
+      for (IndexFile &file : curr) {
+        IndexFile empty(file.path, "", false);
+        removes.push_back(IndexUpdate::createDelta(&file, &empty));
+      }
+      for (IndexUpdate &u : removes)
+        db.applyIndexUpdate(&u);
+    }
+    return t;
+  });
+
+  DB db;
+  {
+    std::vector<IndexFile> curr = copies();
+    for (IndexFile &file : curr) {
+      IndexUpdate u = IndexUpdate::createDelta(nullptr, &file);
+      db.applyIndexUpdate(&u);
+    }
+  }
+  std::vector<std::pair<QueryFile *, Position>> queries;
+  for (QueryFile &file : db.files)
+    for (auto &[sym, _] : file.symbol2refcnt)
+      queries.push_back(
+          {&file, {sym.range.start.line, sym.range.start.column}});
+  runner.run("findSymbolsAtLocation/" + label, queries.size(), [&](int64_t n) {
+    return timeLoop(n, [&] {
+      int64_t count = 0;
+      for (auto &[file, pos] : queries) {
+        Position ls_pos = pos;
+        count += findSymbolsAtLocation(nullptr, file, ls_pos).size();
+      }
+      return count;
+    });
+  });
+}
+} // namespace
+
+bool runMicroBenchmarks(const std::string &filter,
+                        const std::string &input_dir) {
+  if (!g_config)
+    g_config = new Config;
+  Runner runner{filter};
+  printf("%-44s %10s %22s\n", "benchmark", "iterations", "time");
+  for (int n : {100, 10000}) {
+    std::vector<std::unique_ptr<IndexFile>> files;
+    files.push_back(makeSynthetic(n));
+    runSet(runner, "synthetic" + std::to_string(n), files);
+  }
+  if (input_dir.size()) {
+    std::vector<std::unique_ptr<IndexFile>> files = loadRecorded(input_dir);
+    if (files.empty()) {
+      fprintf(stderr, "no cache files in %s\n", input_dir.c_str());
+      return false;
+    }
+    runSet(runner, "recorded", files);
+  }
+  return runner.runs > 0;
+}
+
+namespace {
+// Up to |fanout| distinct headers in [0, n), picked by a stride from |seed|.
+std::vector<int> pickHeaders(int seed, int n, int fanout, int stride) {
+  std::vector<int> ret;
+  for (int k = 0; k < fanout && n > 0; k++) {
+    int h = int((int64_t(seed) + int64_t(k) * stride) % n);
+    if (std::find(ret.begin(), ret.end(), h) == ret.end())
+      ret.push_back(h);
+  }
+  return ret;
+}
+
+// Header i includes headers with smaller indices, so the include graph is a
+// DAG whose depth grows with the number of headers. It declares a base class
+// deriving from that of its first include, |hierarchy_width| derived classes,
+// a chain of |template_depth| class templates and an inline function calling
+// those of its includes.
+std::string makeHeader(int i, const CorpusParams &p) {
+  std::vector<int> includes = pickHeaders(i * 7 + 1, i, p.fanout, 13);
+  std::string id = std::to_string(i), ret = "#pragma once\n";
+  for (int j : includes)
+    ret += "#include \"h" + std::to_string(j) + ".h\"\n";
+  ret += "\nnamespace gen {\n";
+  if (includes.empty())
+    ret += "struct Base" + id + " {\n  virtual ~Base" + id +
+           "() = default;\n  virtual int get() const { return " + id +
+           "; }\n};\n";
+  else
+    ret += "struct Base" + id + " : Base" + std::to_string(includes[0]) +
+           " {\n  int get() const override { return " + id + "; }\n};\n";
+  for (int w = 0; w < p.hierarchy_width; w++)
+    ret += "struct Derived" + id + "_" + std::to_string(w) + " : Base" + id +
+           " {\n  int get() const override { return Base" + id +
+           "::get() + " + std::to_string(w) + "; }\n};\n";
+  for (int k = 0; k < p.template_depth; k++) {
+    std::string name = "Chain" + id + "_" + std::to_string(k);
+    if (k == 0)
+      ret += "template <class T> struct " + name +
+             " {\n  T value{};\n  T get() const { return value; }\n};\n";
+    else
+      ret += "template <class T> struct " + name + " {\n  Chain" + id + "_" +
+             std::to_string(k - 1) +
+             "<T> inner;\n  T get() const { return inner.get(); }\n};\n";
+  }
+  ret += "inline int value" + id + "(int x) {\n  int r = x * " +
+         std::to_string(i + 1) + ";\n";
+  for (int j : includes)
+    ret += "  r += value" + std::to_string(j) + "(x - 1);\n";
+  ret += "  return r;\n}\n} // namespace gen\n";
+  return ret;
+}
+
+// Translation unit t instantiates the templates and derived classes of the
+// headers it includes.
+std::string makeTU(int t, const CorpusParams &p) {
+  std::vector<int> includes = pickHeaders(t * 31, p.headers, p.fanout, 17);
+  std::string id = std::to_string(t), ret;
+  for (int h : includes)
+    ret += "#include \"h" + std::to_string(h) + ".h\"\n";
+  ret += "\nnamespace gen {\nnamespace {\nint local" + id +
+         "(int x) { return x + " + id + "; }\n} // namespace\n\nint run" +
+         id + "() {\n  int sum = local" + id + "(0);\n";
+  for (int h : includes) {
+    std::string hid = std::to_string(h);
+    if (p.template_depth > 0)
+      ret += "  sum += Chain" + hid + "_" +
+             std::to_string(p.template_depth - 1) + "<int>().get();\n";
+    for (int w = 0; w < p.hierarchy_width; w++) {
+      std::string var = "d" + hid + "_" + std::to_string(w);
+      ret += "  Derived" + hid + "_" + std::to_string(w) + " " + var +
+             ";\n  sum += static_cast<const Base" + hid + " &>(" + var +
+             ").get();\n";
+    }
+    ret += "  sum += value" + hid + "(sum);\n";
+  }
+  ret += "  return sum;\n}\n} // namespace gen\n";
+  return ret;
+}
+} // namespace
+
+bool generateCorpus(const std::string &dir, const CorpusParams &params) {
+  SmallString<256> path(dir);
+  sys::fs::make_absolute(path);
+  std::string root(path.str()), src = root + "/src",
+      include = root + "/include";
+  for (const std::string &d : {src, include})
+    if (std::error_code ec = sys::fs::create_directories(d)) {
+      fprintf(stderr, "failed to create %s: %s\n", d.c_str(),
+              ec.message().c_str());
+      return false;
+    }
+  for (int i = 0; i < params.headers; i++)
+    writeToFile(include + "/h" + std::to_string(i) + ".h",
+                makeHeader(i, params));
+
+  std::string json;
+  raw_string_ostream os(json);
+  os << "[";
+  for (int t = 0; t < params.tus; t++) {
+    std::string file = "src/tu" + std::to_string(t) + ".cc";
+    writeToFile(root + "/" + file, makeTU(t, params));
+    os << (t ? ",\n" : "\n") << "  {\"directory\": \"";
+    os.write_escaped(root);
+    os << "\", \"file\": \"" << file
+       << "\", \"arguments\": [\"clang++\", \"-std=c++17\", "
+          "\"-Iinclude\", \"-c\", \""
+       << file << "\"]}";
+  }
+  os << "\n]\n";
+  writeToFile(root + "/compile_commands.json", os.str());
+  printf("generated %d translation units and %d headers in %s\n", params.tus,
+         params.headers, root.c_str());
+  return true;
+}
+} // namespace ccls
@@ -0,0 +1,31 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <string>
+
+namespace ccls {
+// Runs micro-benchmarks whose names contain |filter| and prints ns/op. Inputs
+// are synthetic, plus the cache files under |input_dir| if it is non-empty.
+bool runMicroBenchmarks(const std::string &filter,
+                        const std::string &input_dir);
+
+// Shape of a project written by generateCorpus.
+struct CorpusParams {
+  // Translation units and headers.
+  int tus = 100, headers = 50;
+  // #include directives per file.
+  int fanout = 4;
+  // Length of the chain of class templates in each header, each member
+  // instantiating the previous one.
+  int template_depth = 4;
+  // Classes derived from the base class of each header.
+  int hierarchy_width = 4;
+};
+
+// Writes a deterministic C++ project with src/, include/ and
+// compile_commands.json under |dir|, to measure indexing and queries as the
+// project grows, e.g. with --bench-index.
+bool generateCorpus(const std::string &dir, const CorpusParams &params);
+}
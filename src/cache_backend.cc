@@ -0,0 +1,120 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "cache_backend.hh"
+
+#include "log.hh"
+#include "utils.hh"
+
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Process.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+using namespace llvm;
+
+namespace ccls {
+namespace {
+const char kMagic[8] = {'c', 'c', 'l', 's', 'b', 'n', 'd', 'l'};
+
+struct DirectoryBackend : CacheBackend {
+  std::string directory;
+
+  DirectoryBackend(std::string directory) : directory(std::move(directory)) {
+    if (this->directory.size() && this->directory.back() != '/')
+      this->directory += '/';
+  }
+
+  std::string objectPath(uint64_t key) {
+    char buf[32];
+    snprintf(buf, sizeof buf, "%02x/%014" PRIx64 ".bundle",
+             unsigned(key >> 56), key & ((uint64_t(1) << 56) - 1));
+    return directory + buf;
+  }
+
+  std::unique_ptr<MemoryBuffer> get(uint64_t key) override {
+    auto buf_or = MemoryBuffer::getFile(objectPath(key));
+    return buf_or ? std::move(*buf_or) : nullptr;
+  }
+
+  void put(uint64_t key, const std::string &data) override {
+    std::string path = objectPath(key);
+    // Another instance has published the same object.
+    if (sys::fs::exists(path))
+      return;
+    if (std::error_code ec = sys::fs::create_directories(
+            sys::path::parent_path(path, sys::path::Style::posix), true)) {
+      LOG_S(ERROR) << "failed to create directory for " << path << ": "
+                   << ec.message();
+      return;
+    }
+    // Writers on other machines may race on the same key. Their objects are
+    // identical, so the last rename wins harmlessly. Readers that have mapped
+    // the replaced file keep the old inode.
+    std::string tmp =
+        path + ".tmp" + std::to_string(sys::Process::getProcessId());
+    writeToFile(tmp, data);
+    if (std::error_code ec = sys::fs::rename(tmp, path))
+      LOG_S(ERROR) << "failed to rename " << tmp << ": " << ec.message();
+  }
+};
+
+void putU64(std::string &out, uint64_t n) {
+  out.append(reinterpret_cast<const char *>(&n), sizeof n);
+}
+
+bool getU64(std::string_view &data, uint64_t &n) {
+  if (data.size() < sizeof n)
+    return false;
+  memcpy(&n, data.data(), sizeof n);
+  data.remove_prefix(sizeof n);
+  return true;
+}
+
+bool getString(std::string_view &data, std::string &s) {
+  uint64_t n;
+  if (!getU64(data, n) || data.size() < n)
+    return false;
+  s.assign(data.data(), n);
+  data.remove_prefix(n);
+  return true;
+}
+} // namespace
+
+std::unique_ptr<CacheBackend> makeDirectoryBackend(std::string directory) {
+  return std::make_unique<DirectoryBackend>(std::move(directory));
+}
+
+// magic, u64 number of files, then for each file three strings (u64 size
+// followed by bytes): path, contents, index.
+std::string encodeBundle(const std::vector<BundleFile> &files) {
+  std::string out(kMagic, sizeof kMagic);
+  putU64(out, files.size());
+  for (auto &file : files)
+    for (const std::string *s : {&file.path, &file.contents, &file.index}) {
+      putU64(out, s->size());
+      out += *s;
+    }
+  return out;
+}
+
+bool decodeBundle(std::string_view data, std::vector<BundleFile> &files) {
+  uint64_t n;
+  if (data.size() < sizeof kMagic || memcmp(data.data(), kMagic, sizeof kMagic))
+    return false;
+  data.remove_prefix(sizeof kMagic);
+  if (!getU64(data, n))
+    return false;
+  files.clear();
+  for (; n; n--) {
+    BundleFile &file = files.emplace_back();
+    if (!getString(data, file.path) || !getString(data, file.contents) ||
+        !getString(data, file.index))
+      return false;
+  }
+  return data.empty();
+}
+} // namespace ccls
@@ -0,0 +1,39 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ccls {
+// A store of index results shared by several machines, e.g. filled by a CI
+// job which indexes the tree. Objects are immutable and addressed by a key
+// derived from everything that determines them, so get() never returns a
+// stale result. Implementations must be thread safe.
+struct CacheBackend {
+  virtual ~CacheBackend() = default;
+  // Returns nullptr if |key| is absent. The buffer may be memory-mapped.
+  virtual std::unique_ptr<llvm::MemoryBuffer> get(uint64_t key) = 0;
+  virtual void put(uint64_t key, const std::string &data) = 0;
+};
+
+// Stores objects as $directory/xx/xxxxxxxxxxxxxx.bundle, where the directory
+// may be on a network file system or be synchronized from a remote cache.
+// Objects are mapped rather than read, so several ccls instances on one
+// machine sharing a local directory share the page cache of its objects.
+std::unique_ptr<CacheBackend> makeDirectoryBackend(std::string directory);
+
+// The files indexed from one translation unit.
+struct BundleFile {
+  std::string path, contents, index;
+};
+std::string encodeBundle(const std::vector<BundleFile> &files);
+bool decodeBundle(std::string_view data, std::vector<BundleFile> &files);
+} // namespace ccls
@@ -0,0 +1,290 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "cache_pack.hh"
+
+#include "log.hh"
+#include "platform.hh"
+
+#include <llvm/Support/FileSystem.h>
+
+#include <errno.h>
+#include <string.h>
+
+using namespace llvm;
+
+namespace ccls {
+namespace {
+const char kMagic[8] = {'c', 'c', 'l', 's', 'p', 'a', 'c', 'k'};
+// Don't compact small packs.
+const uint64_t kMinCompactSize = 16 << 20;
+
+struct RecordHeader {
+  uint32_t path_size, flags;
+  uint64_t contents_size, index_size;
+};
+static_assert(sizeof(RecordHeader) == 24, "");
+
+bool seek(FILE *fp, uint64_t offset, int whence = SEEK_SET) {
+#ifdef _WIN32
+  return _fseeki64(fp, offset, whence) == 0;
+#else
+  return fseeko(fp, offset, whence) == 0;
+#endif
+}
+
+uint64_t tell(FILE *fp) {
+#ifdef _WIN32
+  return _ftelli64(fp);
+#else
+  return ftello(fp);
+#endif
+}
+
+uint64_t recordSize(size_t path_size, uint64_t contents_size,
+                    uint64_t index_size) {
+  return sizeof(RecordHeader) + path_size + contents_size + index_size;
+}
+} // namespace
+
+CachePack::~CachePack() {
+  if (fp)
+    fclose(fp);
+  if (lock_fp)
+    fclose(lock_fp);
+}
+
+bool CachePack::open(const std::string &path) {
+  std::lock_guard lock(mutex);
+  pack_path = path;
+  // Another process appending with its own table, or compacting and renaming
+  // over the pack, would corrupt it. Lock a separate file, as the pack itself
+  // is replaced by compaction.
+  std::string lock_path = path + ".lock";
+  if (!(lock_fp = fopen(lock_path.c_str(), "a+b"))) {
+    LOG_S(ERROR) << "failed to open " << lock_path << ' ' << strerror(errno);
+    return false;
+  }
+  if (!tryLockFile(lock_fp)) {
+    LOG_S(WARNING) << path << " is used by another process";
+    return false;
+  }
+  if (!(fp = fopen(path.c_str(), "a+b"))) {
+    LOG_S(ERROR) << "failed to open " << path << ' ' << strerror(errno);
+    return false;
+  }
+  seek(fp, 0, SEEK_END);
+  uint64_t file_size = tell(fp);
+  char magic[sizeof kMagic];
+  seek(fp, 0);
+  if (file_size < sizeof magic || fread(magic, sizeof magic, 1, fp) != 1 ||
+      memcmp(magic, kMagic, sizeof magic)) {
+    if (file_size)
+      LOG_S(WARNING) << "discard invalid cache pack " << path;
+    fclose(fp);
+    FILE *out = fopen(path.c_str(), "wb");
+    if (!out || fwrite(kMagic, sizeof kMagic, 1, out) != 1) {
+      LOG_S(ERROR) << "failed to write " << path << ' ' << strerror(errno);
+      if (out)
+        fclose(out);
+      fp = nullptr;
+      return false;
+    }
+    fclose(out);
+    fp = fopen(path.c_str(), "a+b");
+    size = sizeof kMagic;
+    return fp != nullptr;
+  }
+
+  // Rebuild the table from record headers. A torn record at the end (e.g.
+  // after a crash) is dropped by compacting.
+  uint64_t offset = sizeof kMagic;
+  std::string key;
+  while (offset + sizeof(RecordHeader) <= file_size) {
+    RecordHeader h;
+    if (!seek(fp, offset) || fread(&h, sizeof h, 1, fp) != 1)
+      break;
+    uint64_t n = recordSize(h.path_size, h.contents_size, h.index_size);
+    if (offset + n > file_size)
+      break;
+    key.resize(h.path_size);
+    if (h.path_size && fread(&key[0], h.path_size, 1, fp) != 1)
+      break;
+    auto it = entries.find(key);
+    if (it != entries.end()) {
+      live -= recordSize(key.size(), it->second.contents_size,
+                         it->second.index_size);
+      entries.erase(it);
+    }
+    if (!(h.flags & kRemoved)) {
+      entries[key] = {offset + sizeof h + h.path_size, h.contents_size,
+                      h.index_size};
+      live += n;
+    }
+    offset += n;
+  }
+  size = file_size;
+  bool torn = offset != file_size;
+  if (torn)
+    LOG_S(WARNING) << "truncated cache pack " << path;
+  maybeCompact(torn);
+  return fp != nullptr;
+}
+
+bool CachePack::append(FILE *out, uint64_t &out_size, const std::string &path,
+                       uint32_t flags, const std::string &contents,
+                       const std::string &index, Entry *entry) {
+  RecordHeader h{uint32_t(path.size()), flags, contents.size(), index.size()};
+  auto write = [&](const std::string &s) {
+    return s.empty() || fwrite(s.data(), s.size(), 1, out) == 1;
+  };
+  // Take the offset from the file rather than |out_size|, which a failed
+  // write may have left behind.
+  if (!seek(out, 0, SEEK_END))
+    return false;
+  uint64_t start = tell(out);
+  if (fwrite(&h, sizeof h, 1, out) != 1 || !write(path) || !write(contents) ||
+      !write(index) || fflush(out) != 0) {
+    // Drop the partial record. If that fails too, it would end the records
+    // read by the next open(), so rewrite the pack from |entries| instead.
+    int saved = errno;
+    if (!truncateFile(out, start) && out == fp)
+      torn = true;
+    errno = saved;
+    return false;
+  }
+  if (entry)
+    *entry = {start + sizeof h + path.size(), contents.size(), index.size()};
+  out_size = start + recordSize(path.size(), contents.size(), index.size());
+  return true;
+}
+
+bool CachePack::read(uint64_t offset, uint64_t n, std::string &out) {
+  out.resize(n);
+  return seek(fp, offset) && (!n || fread(&out[0], n, 1, fp) == 1);
+}
+
+void CachePack::put(const std::string &path, const std::string &contents,
+                    const std::string &index) {
+  std::lock_guard lock(mutex);
+  if (!fp)
+    return;
+  Entry entry;
+  if (!append(fp, size, path, 0, contents, index, &entry)) {
+    LOG_S(ERROR) << "failed to write " << pack_path << ' ' << strerror(errno);
+    maybeCompact();
+    return;
+  }
+  fflush(fp);
+  auto r = entries.try_emplace(path, entry);
+  if (!r.second) {
+    live -= recordSize(path.size(), r.first->second.contents_size,
+                       r.first->second.index_size);
+    r.first->second = entry;
+  }
+  live += recordSize(path.size(), contents.size(), index.size());
+  maybeCompact();
+}
+
+void CachePack::remove(const std::string &path) {
+  std::lock_guard lock(mutex);
+  auto it = entries.find(path);
+  if (!fp || it == entries.end())
+    return;
+  live -= recordSize(path.size(), it->second.contents_size,
+                     it->second.index_size);
+  entries.erase(it);
+  if (!append(fp, size, path, kRemoved, {}, {}, nullptr))
+    LOG_S(ERROR) << "failed to write " << pack_path << ' ' << strerror(errno);
+  fflush(fp);
+  maybeCompact();
+}
+
+uint64_t
+CachePack::removeUnless(const std::function<bool(llvm::StringRef)> &keep) {
+  std::lock_guard lock(mutex);
+  if (!fp)
+    return 0;
+  uint64_t removed = 0;
+  for (auto it = entries.begin(); it != entries.end();) {
+    auto cur = it++;
+    StringRef path = cur->first();
+    if (keep(path))
+      continue;
+    removed += recordSize(path.size(), cur->second.contents_size,
+                          cur->second.index_size);
+    if (!append(fp, size, path.str(), kRemoved, {}, {}, nullptr))
+      LOG_S(ERROR) << "failed to write " << pack_path << ' ' << strerror(errno);
+    entries.erase(cur);
+  }
+  live -= removed;
+  fflush(fp);
+  maybeCompact();
+  return removed;
+}
+
+std::optional<std::string> CachePack::getContents(const std::string &path) {
+  std::lock_guard lock(mutex);
+  auto it = entries.find(path);
+  std::string ret;
+  if (!fp || it == entries.end() ||
+      !read(it->second.offset, it->second.contents_size, ret))
+    return {};
+  return ret;
+}
+
+bool CachePack::get(const std::string &path, std::string &contents,
+                    std::string &index) {
+  std::lock_guard lock(mutex);
+  auto it = entries.find(path);
+  if (!fp || it == entries.end())
+    return false;
+  const Entry &e = it->second;
+  return read(e.offset, e.contents_size, contents) &&
+         read(e.offset + e.contents_size, e.index_size, index);
+}
+
+void CachePack::maybeCompact(bool force) {
+  if (!force && !torn &&
+      (size < kMinCompactSize || size - sizeof kMagic <= 2 * live))
+    return;
+
+  std::string tmp = pack_path + ".tmp";
+  FILE *out = fopen(tmp.c_str(), "wb");
+  bool ok = out && fwrite(kMagic, sizeof kMagic, 1, out) == 1;
+  uint64_t out_size = sizeof kMagic;
+  llvm::StringMap<Entry> entries1;
+  std::string contents, index;
+  for (auto &it : entries) {
+    const Entry &e = it.second;
+    ok = ok && read(e.offset, e.contents_size, contents) &&
+         read(e.offset + e.contents_size, e.index_size, index) &&
+         append(out, out_size, it.first().str(), 0, contents, index,
+                &entries1[it.first()]);
+    if (!ok)
+      break;
+  }
+  if (out)
+    ok = fclose(out) == 0 && ok;
+  if (!ok) {
+    LOG_S(ERROR) << "failed to compact " << pack_path;
+    (void)sys::fs::remove(tmp);
+    return;
+  }
+  // The pack has to be closed before it can be replaced on Windows.
+  fclose(fp);
+  std::error_code ec = sys::fs::rename(tmp, pack_path);
+  fp = fopen(pack_path.c_str(), "a+b");
+  if (ec) {
+    LOG_S(ERROR) << "failed to rename " << tmp << ": " << ec.message();
+    (void)sys::fs::remove(tmp);
+    return;
+  }
+  LOG_S(INFO) << "compact " << pack_path << " from " << size << " to "
+              << out_size << " bytes";
+  torn = false;
+  size = out_size;
+  live = out_size - sizeof kMagic;
+  entries = std::move(entries1);
+}
+} // namespace ccls
@@ -0,0 +1,65 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <llvm/ADT/StringMap.h>
+
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+namespace ccls {
+// An append-only file holding the cached contents and serialized indexes of
+// many source files, used instead of two files per source file if
+// cache.pack is true. After a header, each record is
+//
+//   u32 path size, u32 flags, u64 contents size, u64 index size,
+//   path, contents, index
+//
+// A later record of the same path supersedes earlier ones; a record with
+// kRemoved removes the path. The table from path to the latest record is
+// rebuilt on open by reading record headers only. When superseded records
+// take more than half of the file, live records are copied to a new file
+// which then replaces the old one.
+struct CachePack {
+  ~CachePack();
+
+  bool open(const std::string &path);
+  void put(const std::string &path, const std::string &contents,
+           const std::string &index);
+  void remove(const std::string &path);
+  // Removes the paths for which |keep| returns false and returns the number
+  // of live bytes removed.
+  uint64_t removeUnless(const std::function<bool(llvm::StringRef)> &keep);
+  std::optional<std::string> getContents(const std::string &path);
+  bool get(const std::string &path, std::string &contents, std::string &index);
+
+private:
+  enum : uint32_t { kRemoved = 1 };
+  struct Entry {
+    // Offset of the contents. The index follows the contents.
+    uint64_t offset;
+    uint64_t contents_size, index_size;
+  };
+
+  std::mutex mutex;
+  std::string pack_path;
+  // The pack, and $pack_path.lock, which is locked while the pack is open.
+  FILE *fp = nullptr, *lock_fp = nullptr;
+  // Size of the file and total size of live records.
+  uint64_t size = 0, live = 0;
+  // A failed append left a partial record that could not be truncated.
+  bool torn = false;
+  llvm::StringMap<Entry> entries;
+
+  bool append(FILE *out, uint64_t &out_size, const std::string &path,
+              uint32_t flags, const std::string &contents,
+              const std::string &index, Entry *entry);
+  bool read(uint64_t offset, uint64_t n, std::string &out);
+  void maybeCompact(bool force = false);
+};
+} // namespace ccls
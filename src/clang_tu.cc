@@ -5,35 +5,73 @@
 
 #include "config.hh"
 #include "platform.hh"
+#include "utils.hh"
 
 #include <clang/AST/Type.h>
+#include <clang/Basic/Version.h>
 #include <clang/Driver/Action.h>
 #include <clang/Driver/Compilation.h>
 #include <clang/Driver/Driver.h>
 #include <clang/Driver/Tool.h>
 #include <clang/Lex/Lexer.h>
 #include <clang/Lex/PreprocessorOptions.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/Support/Host.h>
 #include <llvm/Support/Path.h>
+#include <llvm/Support/Program.h>
 
 using namespace clang;
 using namespace llvm;
 
+#include <mutex>
+#include <shared_mutex>
+#include <stdio.h>
+#include <unordered_map>
+
 namespace ccls {
+namespace {
+// pathFromFileEntry by FileEntry::getName(). Resolving symlinks takes a system
+// call per path component, and indexers ask for each header several times
+// per translation unit.
+std::shared_mutex path_cache_mutex;
+StringMap<std::string> path_cache;
+} // namespace
+
 std::string pathFromFileEntry(const FileEntry &file) {
+  StringRef name = file.getName();
+  {
+    std::shared_lock lock(path_cache_mutex);
+    auto it = path_cache.find(name);
+    if (it != path_cache.end())
+      return it->second;
+  }
   // If getName() refers to a file within a workspace folder, we prefer it
-  // (which may be a symlink).
-  std::string ret = normalizePath(file.getName());
-  if (normalizeFolder(ret))
-    return ret;
-  // Resolve symlinks outside of working folders. This handles leading path
-  // components, e.g. (/lib -> /usr/lib) in
-  // /../lib/gcc/x86_64-linux-gnu/10/../../../../include/c++/10/utility
-  ret = realPath(ret);
-  normalizeFolder(ret);
+  // (which may be a symlink), unless index.canonicalPaths is set and the
+  // target is within a workspace folder as well.
+  std::string ret = normalizePath(name);
+  if (normalizeFolder(ret)) {
+    if (g_config->index.canonicalPaths) {
+      std::string real = realPath(ret);
+      if (real != ret && normalizeFolder(real))
+        ret = std::move(real);
+    }
+  } else {
+    // Resolve symlinks outside of working folders. This handles leading path
+    // components, e.g. (/lib -> /usr/lib) in
+    // /../lib/gcc/x86_64-linux-gnu/10/../../../../include/c++/10/utility
+    ret = realPath(ret);
+    normalizeFolder(ret);
+  }
+  std::lock_guard lock(path_cache_mutex);
+  path_cache.try_emplace(name, ret);
   return ret;
 }
 
+void clearPathCache() {
+  std::lock_guard lock(path_cache_mutex);
+  path_cache.clear();
+}
+
 bool isInsideMainFile(const SourceManager &sm, SourceLocation sl) {
   if (!sl.isValid())
     return false;
@@ -90,36 +128,165 @@ Range fromTokenRangeDefaulted(const SourceManager &sm, const LangOptions &lang,
   return range;
 }
 
-std::unique_ptr<CompilerInvocation>
-buildCompilerInvocation(const std::string &main, std::vector<const char *> args,
-                        IntrusiveRefCntPtr<llvm::vfs::FileSystem> vfs) {
-  std::string save = "-resource-dir=" + g_config->clang.resourceDir;
-  args.push_back(save.c_str());
-  args.push_back("-fsyntax-only");
+namespace {
+std::mutex invocations_mutex;
+LruCache<uint64_t, CompilerInvocation> invocations;
 
-  // Similar to clang/tools/driver/driver.cpp:insertTargetAndModeArgs but don't
-  // require llvm::InitializeAllTargetInfos().
-  auto target_and_mode =
-      driver::ToolChain::getTargetAndModeFromProgramName(args[0]);
-  if (target_and_mode.DriverMode)
-    args.insert(args.begin() + 1, target_and_mode.DriverMode);
-  if (!target_and_mode.TargetPrefix.empty()) {
-    const char *arr[] = {"-target", target_and_mode.TargetPrefix.c_str()};
-    args.insert(args.begin() + 1, std::begin(arr), std::end(arr));
+// Compile commands which differ only in the main file and the output are
+// parsed to the same invocation, apart from the main file input.
+uint64_t invocationKey(StringRef main, const std::vector<const char *> &args) {
+  std::string buf(sys::path::extension(main));
+  buf += '\0';
+  StringRef name = sys::path::filename(main);
+  for (size_t i = 0; i < args.size(); i++) {
+    StringRef arg = args[i];
+    if (arg == "-o")
+      i++;
+    else if (sys::path::filename(arg) != name)
+      buf.append(arg.data(), arg.size() + 1);
   }
+  return hashUsr(buf);
+}
 
-  IntrusiveRefCntPtr<DiagnosticsEngine> diags(
-      CompilerInstance::createDiagnostics(new DiagnosticOptions,
-                                          new IgnoringDiagConsumer, true));
+// Output of the clang driver saved in $cache.directory/ccls.driver, see
+// clang.driverCache. Each record is a line "key mtime n compiler" followed by
+// the n cc1 arguments, one per line.
+struct DriverCache {
+  struct Record {
+    std::string compiler;
+    int64_t mtime;
+    std::vector<std::string> args;
+  };
+  std::mutex mutex;
+  bool loaded = false;
+  std::unordered_map<uint64_t, Record> records;
+  // Modification times of compilers, -1 if missing. Stat'ed once per run.
+  std::unordered_map<std::string, int64_t> mtimes;
+
+  static std::string path() {
+    return g_config->cache.directory + "ccls.driver";
+  }
+
+  int64_t getMtime(const std::string &compiler) {
+    auto [it, inserted] = mtimes.try_emplace(compiler);
+    if (inserted)
+      it->second = lastWriteTime(compiler).value_or(-1);
+    return it->second;
+  }
+
+  static void append(std::string &out, uint64_t key, const Record &r) {
+    char buf[64];
+    snprintf(buf, sizeof buf, "%llx %lld %zu ", (unsigned long long)key,
+             (long long)r.mtime, r.args.size());
+    ((out += buf) += r.compiler) += '\n';
+    for (auto &arg : r.args)
+      (out += arg) += '\n';
+  }
+
+  // Requires |mutex|. Drops the records of changed compilers.
+  void load() {
+    loaded = true;
+    std::optional<std::string> content = readContent(path());
+    if (!content)
+      return;
+    SmallVector<StringRef, 0> lines;
+    StringRef(*content).split(lines, '\n');
+    bool stale = false;
+    for (size_t i = 0; i < lines.size();) {
+      StringRef line = lines[i++], key_s, mtime_s, n_s;
+      if (line.empty())
+        continue;
+      std::tie(key_s, line) = line.split(' ');
+      std::tie(mtime_s, line) = line.split(' ');
+      std::tie(n_s, line) = line.split(' ');
+      uint64_t key;
+      int64_t mtime;
+      size_t n;
+      if (key_s.getAsInteger(16, key) || mtime_s.getAsInteger(10, mtime) ||
+          n_s.getAsInteger(10, n) || n > lines.size() - i) {
+        // Truncated by a crash.
+        stale = true;
+        break;
+      }
+      Record r{line.str(), mtime, {}};
+      for (size_t j = 0; j < n; j++)
+        r.args.push_back(lines[i + j].str());
+      i += n;
+      if (getMtime(r.compiler) != mtime)
+        stale = true;
+      else
+        records[key] = std::move(r);
+    }
+    if (stale) {
+      std::string out;
+      for (auto &[key, r] : records)
+        append(out, key, r);
+      writeToFile(path(), out);
+    }
+  }
+
+  bool get(uint64_t key, const std::string &compiler,
+           std::vector<std::string> &args) {
+    std::lock_guard lock(mutex);
+    if (!loaded)
+      load();
+    auto it = records.find(key);
+    if (it == records.end() || it->second.compiler != compiler ||
+        it->second.mtime != getMtime(compiler))
+      return false;
+    args = it->second.args;
+    return true;
+  }
+
+  void put(uint64_t key, const std::string &compiler,
+           const std::vector<std::string> &args) {
+    for (auto &arg : args)
+      if (arg.find('\n') != std::string::npos)
+        return;
+    std::lock_guard lock(mutex);
+    Record &r = records[key];
+    r = {compiler, getMtime(compiler), args};
+    std::string out;
+    append(out, key, r);
+    if (FILE *f = fopen(path().c_str(), "ab")) {
+      fwrite(out.data(), out.size(), 1, f);
+      fclose(f);
+    }
+  }
+} driver_cache;
+
+// Returns the path of the compiler of |args|, which identifies the toolchain
+// together with the arguments.
+std::string resolveCompiler(const std::vector<const char *> &args) {
+  StringRef prog = args[0];
+  if (!sys::path::has_parent_path(prog)) {
+    if (ErrorOr<std::string> path = sys::findProgramByName(prog))
+      return *path;
+    return prog.str();
+  }
+  if (sys::path::is_relative(prog))
+    for (StringRef arg : args)
+      if (arg.consume_front("-working-directory=")) {
+        SmallString<256> path(arg);
+        sys::path::append(path, prog);
+        return normalizePath(path.str());
+      }
+  return prog.str();
+}
+
+// Runs the clang driver and returns the arguments of the cc1 job.
+bool runDriver(const std::vector<const char *> &args, DiagnosticsEngine &diags,
+               IntrusiveRefCntPtr<llvm::vfs::FileSystem> vfs,
+               std::vector<std::string> &out) {
 #if LLVM_VERSION_MAJOR < 12 // llvmorg-12-init-5498-g257b29715bb
-  driver::Driver d(args[0], llvm::sys::getDefaultTargetTriple(), *diags, vfs);
+  driver::Driver d(args[0], llvm::sys::getDefaultTargetTriple(), diags, vfs);
 #else
-  driver::Driver d(args[0], llvm::sys::getDefaultTargetTriple(), *diags, "ccls", vfs);
+  driver::Driver d(args[0], llvm::sys::getDefaultTargetTriple(), diags, "ccls", vfs);
 #endif
   d.setCheckInputsExist(false);
   std::unique_ptr<driver::Compilation> comp(d.BuildCompilation(args));
   if (!comp)
-    return nullptr;
+    return false;
   const driver::JobList &jobs = comp->getJobs();
   bool offload_compilation = false;
   if (jobs.size() > 1) {
@@ -133,15 +300,61 @@ buildCompilerInvocation(const std::string &main, std::vector<const char *> args,
       }
     }
     if (!offload_compilation)
-      return nullptr;
+      return false;
   }
   if (jobs.size() == 0 || !isa<driver::Command>(*jobs.begin()))
-    return nullptr;
+    return false;
 
   const driver::Command &cmd = cast<driver::Command>(*jobs.begin());
   if (StringRef(cmd.getCreator().getName()) != "clang")
-    return nullptr;
-  const llvm::opt::ArgStringList &cc_args = cmd.getArguments();
+    return false;
+  for (const char *arg : cmd.getArguments())
+    out.emplace_back(arg);
+  return true;
+}
+
+std::unique_ptr<CompilerInvocation>
+parseCompilerInvocation(std::vector<const char *> args,
+                        IntrusiveRefCntPtr<llvm::vfs::FileSystem> vfs,
+                        uint64_t key) {
+  std::string save = "-resource-dir=" + g_config->clang.resourceDir;
+  args.push_back(save.c_str());
+  args.push_back("-fsyntax-only");
+
+  // Similar to clang/tools/driver/driver.cpp:insertTargetAndModeArgs but don't
+  // require llvm::InitializeAllTargetInfos().
+  auto target_and_mode =
+      driver::ToolChain::getTargetAndModeFromProgramName(args[0]);
+  if (target_and_mode.DriverMode)
+    args.insert(args.begin() + 1, target_and_mode.DriverMode);
+  if (!target_and_mode.TargetPrefix.empty()) {
+    const char *arr[] = {"-target", target_and_mode.TargetPrefix.c_str()};
+    args.insert(args.begin() + 1, std::begin(arr), std::end(arr));
+  }
+
+  IntrusiveRefCntPtr<DiagnosticsEngine> diags(
+      CompilerInstance::createDiagnostics(new DiagnosticOptions,
+                                          new IgnoringDiagConsumer, true));
+  // The driver output depends on the toolchain (the compiler, the target,
+  // --sysroot, etc. in |args|) and on the clang ccls is built with.
+  bool persist = g_config->clang.driverCache &&
+                 g_config->cache.directory.size() && key;
+  std::string compiler;
+  std::vector<std::string> cc1;
+  if (persist) {
+    key = hashUsr(
+        (Twine(key) + " " + save + " " + CLANG_VERSION_STRING).str());
+    compiler = resolveCompiler(args);
+  }
+  if (!persist || !driver_cache.get(key, compiler, cc1)) {
+    if (!runDriver(args, *diags, vfs, cc1))
+      return nullptr;
+    if (persist)
+      driver_cache.put(key, compiler, cc1);
+  }
+  std::vector<const char *> cc_args;
+  for (auto &arg : cc1)
+    cc_args.push_back(arg.c_str());
   auto ci = std::make_unique<CompilerInvocation>();
 #if LLVM_VERSION_MAJOR >= 10 // rC370122
   if (!CompilerInvocation::CreateFromArgs(*ci, cc_args, *diags))
@@ -160,9 +373,6 @@ buildCompilerInvocation(const std::string &main, std::vector<const char *> args,
   ci->getLangOpts()->RecoveryAST = true;
   ci->getLangOpts()->RecoveryASTType = true;
 #endif
-  auto &isec = ci->getFrontendOpts().Inputs;
-  if (isec.size())
-    isec[0] = FrontendInputFile(main, isec[0].getKind(), isec[0].isSystem());
 #if LLVM_VERSION_MAJOR >= 10 // llvmorg-11-init-2414-g75f09b54429
   ci->getPreprocessorOpts().DisablePragmaDebugCrash = true;
 #endif
@@ -173,6 +383,44 @@ buildCompilerInvocation(const std::string &main, std::vector<const char *> args,
   ci->getPreprocessorOpts().PCHThroughHeader.clear();
   return ci;
 }
+} // namespace
+
+void clearCompilerInvocationCache() {
+  std::lock_guard lock(invocations_mutex);
+  invocations.clear();
+}
+
+std::unique_ptr<CompilerInvocation>
+buildCompilerInvocation(const std::string &main, std::vector<const char *> args,
+                        IntrusiveRefCntPtr<llvm::vfs::FileSystem> vfs) {
+  int capacity = g_config->clang.invocationCache;
+  uint64_t key = capacity > 0 || g_config->clang.driverCache
+                     ? invocationKey(main, args)
+                     : 0;
+  std::shared_ptr<CompilerInvocation> cached;
+  if (capacity > 0) {
+    std::lock_guard lock(invocations_mutex);
+    invocations.setCapacity(capacity);
+    cached = invocations.get(key);
+  }
+  std::unique_ptr<CompilerInvocation> ci;
+  if (cached) {
+    // The copy is deep. Callers modify it.
+    ci = std::make_unique<CompilerInvocation>(*cached);
+  } else {
+    ci = parseCompilerInvocation(std::move(args), vfs, key);
+    if (!ci)
+      return nullptr;
+    if (capacity > 0) {
+      std::lock_guard lock(invocations_mutex);
+      invocations.insert(key, std::make_shared<CompilerInvocation>(*ci));
+    }
+  }
+  auto &isec = ci->getFrontendOpts().Inputs;
+  if (isec.size())
+    isec[0] = FrontendInputFile(main, isec[0].getKind(), isec[0].isSystem());
+  return ci;
+}
 
 // clang::BuiltinType::getName without PrintingPolicy
 const char *clangBuiltinTypeName(int kind) {
@@ -19,6 +19,9 @@ namespace vfs = clang::vfs;
 
 namespace ccls {
 std::string pathFromFileEntry(const clang::FileEntry &file);
+// Forgets the paths memoized by pathFromFileEntry, e.g. when workspace folders
+// change.
+void clearPathCache();
 
 bool isInsideMainFile(const clang::SourceManager &sm, clang::SourceLocation sl);
 
@@ -36,9 +39,12 @@ Range fromTokenRangeDefaulted(const clang::SourceManager &sm,
                               clang::SourceRange sr, clang::FileID fid,
                               Range range);
 
+// Parses a compile command. Results are cached, see clang.invocationCache.
 std::unique_ptr<clang::CompilerInvocation>
 buildCompilerInvocation(const std::string &main, std::vector<const char *> args,
                         llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> VFS);
+// Called when compile commands may have changed.
+void clearCompilerInvocationCache();
 
 const char *clangBuiltinTypeName(int);
 } // namespace ccls
@@ -47,6 +47,29 @@ struct Config {
     // struct member has changed.
     SerializeFormat format = SerializeFormat::Binary;
 
+    // If positive, compress cache files of either format with zstd at this
+    // level (1 to 19). Headers repeat the same names and USRs, so caches
+    // shrink several times at a small CPU cost. Compressed and uncompressed
+    // files can be read regardless of this setting. Requires LLVM built with
+    // zstd.
+    int compress = 0;
+
+    // If positive, remove cache files which have not been written for this
+    // number of days and whose source files are no longer indexed, e.g.
+    // deleted files, headers no longer included, or files left by another
+    // hierarchicalPath setting. The cache directory is walked on a background
+    // thread once indexing settles, then at most once a day. Entries of
+    // cache.pack have no write time and are removed once their files are no
+    // longer indexed. Skipped with index.lazyLoad until the deferred caches
+    // are loaded.
+    int gcDays = 0;
+
+    // If true, store an xxHash64 of each indexed file and of its dependencies
+    // in the cache. A file whose mtime is newer than its cache, e.g. after a
+    // branch switch or a build step that rewrites identical headers, is then
+    // re-read and reused without re-indexing if its contents are unchanged.
+    bool contentHash = false;
+
     // If false, store cache files as $directory/@a@b/c.cc.blob
     //
     // If true, $directory/a/b/c.cc.blob. If cache.directory is absolute, make
@@ -54,6 +77,13 @@ struct Config {
     // conflicting cache files for system headers.
     bool hierarchicalPath = false;
 
+    // If true, store the contents and indexes of all files in one append-only
+    // file $directory/ccls.pack instead of two files per indexed file. The
+    // pack is compacted when more than half of it is stale. Only one ccls
+    // process uses the pack of a directory; others fall back to per-file
+    // caches.
+    bool pack = false;
+
     // After this number of loads, keep a copy of file index in memory (which
     // increases memory usage). During incremental updates, the index subtracted
     // will come from the in-memory copy, instead of the on-disk file.
@@ -62,6 +92,34 @@ struct Config {
     // 0: never retain; 1: retain after initial load; 2: retain after 2 loads
     // (initial load+first save)
     int retainInMemory = 2;
+
+    // If not empty, a directory of index results shared by a team, e.g. on a
+    // network file system or synchronized from a CI job which indexes the
+    // tree. Before indexing a translation unit, ccls looks
+    // up an entry keyed by its path, contents, arguments and the cache
+    // version, and uses it if every included file still has the same
+    // contents. The result is then stored in cache.directory like a local
+    // index. Paths must agree between machines or be mapped by
+    // clang.pathMappings. Several instances on one machine, e.g. one per
+    // worktree, may also share a local directory with sharedWrite so that
+    // each translation unit is indexed once; the entries are memory-mapped.
+    std::string sharedDirectory;
+
+    // If true, add the results of indexing to cache.sharedDirectory. Intended
+    // for the CI job, or for instances sharing a local directory.
+    bool sharedWrite = false;
+
+    // If true, save the whole in-memory database to $directory/ccls.snapshot
+    // on exit and periodically when idle, and load it on startup instead of
+    // replaying every cache file. Files changed since the snapshot are
+    // re-indexed as usual. Any later cache write discards the snapshot.
+    bool snapshot = false;
+
+    // If true, write a sorted table of the symbols declared in each indexed
+    // file to $directory/.../xxx.sym. With index.lazyLoad, workspace/symbol
+    // searches the tables of files whose caches are not loaded instead of
+    // loading all of them. Not used with cache.pack.
+    bool symbolTable = false;
   } cache;
 
   struct ServerCap {
@@ -73,6 +131,10 @@ struct Config {
     // Set to false if you don't want folding ranges.
     bool foldingRangeProvider = true;
 
+    // Set to false if you don't want textDocument/semanticTokens, e.g. if the
+    // client uses $ccls/publishSemanticHighlight instead.
+    bool semanticTokensProvider = true;
+
     struct Workspace {
       struct WorkspaceFolders {
         // Set to false if you don't want workspace folders.
@@ -108,6 +170,33 @@ struct Config {
     // This option defaults to clang -print-resource-dir and should not be
     // specified unless you are using an esoteric configuration.
     std::string resourceDir;
+
+    // If true, indexer and sema threads share a file system which caches the
+    // status of files outside workspace folders, e.g. system headers on a
+    // network file system. workspace/didChangeWatchedFiles drops the entry of
+    // the changed file; $ccls/reload drops all entries.
+    bool statCache = false;
+
+    // If true, each indexer thread keeps the FileManager of the translation
+    // unit it indexed last and reuses it for the next one, so that the file
+    // and directory entries of common headers are not looked up again. It is
+    // recreated whenever a file change is notified (see statCache) and is not
+    // used for files with unsaved buffers. A file modified on disk without a
+    // notification may be read with its old size.
+    bool reuseFileManager = false;
+
+    // Number of parsed compile commands (clang's CompilerInvocation) to keep,
+    // so that parsing a file again, e.g. for a preamble build, completion or
+    // diagnostics, skips the clang driver. Commands differing only in the
+    // main file and the output share one. Cleared when the project is loaded.
+    int invocationCache = 64;
+
+    // If true and cache.directory is set, the output of the clang driver for
+    // each distinct compile command (as in invocationCache) is saved in
+    // $cache.directory/ccls.driver and reused by later runs, skipping the
+    // driver's probing of the toolchain (system include directories, GCC
+    // installations) while the compiler executable is unchanged.
+    bool driverCache = true;
   } clang;
 
   struct ClientCapability {
@@ -196,6 +285,13 @@ struct Config {
     // false: foo($1)$0
     // true: foo(${1:int a}, ${2:int b})$0
     bool placeholder = true;
+
+    // If true, start completing when textDocument/didChange types a trigger
+    // character (., -> or ::), before the client sends the completion
+    // request. The request then waits for that parse or takes its cached
+    // result. A later edit elsewhere drops the speculative parse if
+    // dropOldRequests is true.
+    bool prefetch = false;
   } completion;
 
   struct Diagnostics {
@@ -210,6 +306,12 @@ struct Config {
     //     this period of time will only cause one computation.
     int onChange = 1000;
 
+    // If positive and onChange is positive, the wait for
+    // textDocument/didChange adapts to each file once its diagnostics have
+    // been computed: twice the moving average of its diagnostics time, at
+    // least onChangeMin and at most 4 * onChange milliseconds.
+    int onChangeMin = 100;
+
     // Time to wait before computing diagnostics for textDocument/didOpen.
     int onOpen = 0;
 
@@ -218,17 +320,30 @@ struct Config {
 
     bool spellChecking = true;
 
+    // Number of threads computing diagnostics. Files are handled when their
+    // debounce expires, the file last viewed first, so that a slow file does
+    // not hold back the others. At most threads - 1 of them work on files
+    // whose diagnostics take over a second.
+    int threads = 2;
+
     std::vector<std::string> whitelist;
   } diagnostics;
 
   // Semantic highlighting
   struct Highlight {
-    // Disable semantic highlighting for files larger than the size.
+    // Disable semantic highlighting for files larger than the size. Requests
+    // restricted to a range, e.g. textDocument/semanticTokens/range, are still
+    // answered.
     int64_t largeFileSize = 2 * 1024 * 1024;
 
     // true: LSP line/character; false: position
     bool lsRanges = false;
 
+    // When the project is loaded, highlight this many of the most recently
+    // opened or changed files in parallel. The others are highlighted when
+    // they are changed or re-indexed.
+    int refreshFiles = 16;
+
     // Like index.{whitelist,blacklist}, don't publish semantic highlighting to
     // blacklisted files.
     std::vector<std::string> blacklist;
@@ -245,25 +360,104 @@ struct Config {
     // Example: `ash/.*\.cc`
     std::vector<std::string> blacklist;
 
+    // If true, a file reached through a symlink whose target is in a
+    // workspace folder too (e.g. a symlinked include directory) is indexed
+    // under the target path, so that it has a single entry. Files opened
+    // through such symlinks then have no index of their own.
+    bool canonicalPaths = false;
+
     // 0: none, 1: Doxygen, 2: all comments
     // Plugin support for clients:
     // - https://github.com/emacs-lsp/lsp-ui
     // - https://github.com/autozimu/LanguageClient-neovim/issues/224
     int comments = 2;
 
+    // When indexing settles and at least this percentage of the funcs, types
+    // or vars of the database are unused (no definition, declaration, use or
+    // relation, e.g. after files were deleted or symbols renamed), that kind
+    // is compacted. One kind is compacted at a time so that requests are
+    // served in between. 0 disables compaction.
+    int compactPercent = 25;
+
+    // If true, a header whose content is identical to that of a header
+    // already indexed under another path in this session (e.g. copies of a
+    // vendored library) is not indexed again. References to its symbols
+    // resolve to the first copy.
+    bool dedupeHeaders = false;
+
     // If false, names of no linkage are not indexed in the background. They are
     // indexed after the files are opened.
     bool initialNoLinkage = false;
 
+    // If true, a translation unit without a cache is first indexed in the
+    // background for declarations and definitions only, without references
+    // or comments, and queued again for the full index. workspace/symbol and
+    // go to definition thus work across the project much earlier, at the cost
+    // of a second parse of each translation unit.
+    bool initialDeclarationsOnly = false;
+
     // Use the two options to exclude files that should not be indexed in the
     // background.
     std::vector<std::string> initialBlacklist;
     std::vector<std::string> initialWhitelist;
 
+    // If true, valid caches of files which are not open are not loaded into
+    // the database in the initial indexing. They are loaded when the files are
+    // opened, or all at once by the first request which needs the whole
+    // project, e.g. textDocument/references and workspace/symbol. Such
+    // requests wait until the caches are loaded, at most request.timeout. See
+    // also cache.symbolTable.
+    bool lazyLoad = false;
+
+    // Files larger than largeFileSize bytes (0: no limit), or whose paths
+    // match an EMCAScript regex in largeFiles, e.g. huge generated protobuf
+    // sources, keep their declarations and definitions but only the first
+    // reference in the file to each symbol. This bounds their share of the
+    // database. $ccls/fileInfo marks such files partial, and
+    // textDocument/references reports when they contributed.
+    int64_t largeFileSize = 0;
+    std::vector<std::string> largeFiles;
+
+    // If true, comments are not stored in the index. Hover reads the comment
+    // block above the declaration, or a trailing ///< comment, from the indexed
+    // content instead, honoring index.comments. This saves the memory of
+    // comments in caches and the database.
+    bool lazyComments = false;
+
+    // How macro expansions are recorded.
+    //   2: every expansion, and for symbols spelled in macro arguments or
+    //      bodies, a use at the spelling as well.
+    //   1: for macros defined outside workspace folders (e.g. logging or test
+    //      frameworks), only the first expansion in each file. Uses at the
+    //      spelling are only recorded in macro bodies in workspace folders.
+    //      References to such a macro are found by searching the indexed
+    //      content of the files having its first expansion.
+    int macroUses = 2;
+
     // If a variable initializer/macro replacement-list has fewer than this many
     // lines, include the initializer in detailed_name.
     int maxInitializerLines = 5;
 
+    // Indexer threads block while this many index updates (at most 1024) or
+    // updates of this many MiB in total are waiting to be applied to the
+    // database, so that a cold index cannot pile up updates faster than the
+    // main thread applies them. 0 means no limit. The time blocked is reported
+    // by $ccls/stats.
+    int maxPendingUpdates = 256;
+    int maxPendingUpdateMemory = 1024;
+
+    // If positive, the memory in MiB that indexer threads may use together.
+    // Each translation unit is admitted with the memory clang used for it last
+    // time, recorded in its cache, and waits while others would exceed the
+    // budget; one translation unit always runs. Large translation units are
+    // thus serialized while small ones continue in parallel. Translation
+    // units never indexed before count as 0.
+    int memoryBudget = 0;
+
+    // If positive, indexing of a translation unit is abandoned once the AST of
+    // clang exceeds this many MiB. See quarantine.
+    int memoryLimit = 0;
+
     // If not 0, a file will be indexed in each tranlation unit that includes
     // it.
     int multiVersion = 0;
@@ -273,11 +467,24 @@ struct Config {
     std::vector<std::string> multiVersionBlacklist;
     std::vector<std::string> multiVersionWhitelist;
 
+    // If positive, a multi-version file is indexed in at most this many
+    // translation units, each with a distinct set of macros defined where the
+    // file is included, e.g. for different #ifdef branches. Translation units
+    // including it in a context already recorded, or beyond the limit, index
+    // it once like other files.
+    int multiVersionMax = 0;
+
     struct Name {
       // Suppress inline and unnamed namespaces in identifier names.
       bool suppressUnwrittenScope = false;
     } name;
 
+    // If true and there are several NUMA nodes, indexer threads are split
+    // into contiguous groups pinned to the CPUs of each node, with an
+    // allocator arena per node in the jemalloc build. An idle indexer steals
+    // work from indexers of its own node first. Linux only.
+    bool numa = false;
+
     // Allow indexing on textDocument/didChange.
     // May be too slow for big projects, so it is off by default.
     bool onChange = false;
@@ -285,25 +492,164 @@ struct Config {
     // If true, index parameters in declarations.
     bool parametersInDeclarations = true;
 
+    // Number of preambles of open files kept by indexer threads. An open file
+    // is re-indexed on every save; if none of the headers in its preamble
+    // needs to be indexed again, they are loaded from the preamble of the
+    // last parse instead of being parsed. Building a preamble costs about one
+    // more parse of the headers. 0 disables it.
+    int preambleCache = 0;
+
+    // If positive, a translation unit abandoned because of timeout or
+    // memoryLimit this many times in a row is quarantined: it is listed in
+    // $cache.directory/ccls.quarantine and by $ccls/stats, and background
+    // indexing skips it until its content or compile arguments change. Saving
+    // it still indexes it.
+    int quarantine = 2;
+
+    // Remember this many recently opened files in
+    // $cache.directory/ccls.history. The initial index queues them first, then
+    // the other files in the directories of open and recently opened files.
+    // 0 keeps the order of the compilation database.
+    int recentFiles = 100;
+
+    // When a header is saved, reindex up to this many translation units that
+    // include it, directly or transitively, nearest first and open files
+    // before others. They are found from the includes of indexed files and
+    // are reparsed because of index.trackDependency. 0 reindexes only the
+    // header, with the translation unit it was last indexed with.
+    int reindexDependents = 0;
+
+    // If shards > 1, index only the translation units whose path hashes to
+    // shard, 0 <= shard < shards. To split a cold index of a large tree,
+    // machines run `ccls --index` with different shards, the same
+    // cache.sharedDirectory and cache.sharedWrite. Language servers using that
+    // directory then load the results instead of indexing.
+    int shard = 0;
+    int shards = 1;
+
+    // If false, only declarations, definitions and base classes are recorded
+    // in system headers (-isystem directories and the like); references and
+    // macro expansions there are dropped. References from project files to
+    // system symbols are kept. This shrinks the index of libstdc++ or Boost
+    // heavy code, at the cost of references inside those headers.
+    bool systemReferences = true;
+
+    // If true, background requests are only taken by as many indexer threads
+    // as there are cores not busy with other work (from the load average),
+    // and by one thread if less than 10% of memory is available. Re-evaluated
+    // every second.
+    bool adaptiveThreads = false;
+
+    // If positive, once this many requests of more urgent classes have been
+    // taken while a Normal or Background request was waiting, an indexer
+    // takes the waiting class first, so that a steady stream of saves and
+    // didOpen cannot starve the background index.
+    int aging = 32;
+
+    // If positive, no indexer thread starts a background request for this
+    // many milliseconds after a textDocument/didChange, so that a large
+    // background index leaves the cores to completion and diagnostics while
+    // the user is typing.
+    int pauseAfterEdit = 0;
+
     // Number of indexer threads. If 0, 80% of cores are used.
     int threads = 0;
 
+    // If positive, indexing of a translation unit is abandoned after this
+    // many seconds. clang is stopped at its next callback, by a fatal error
+    // which ends template instantiation and by skipping the remaining function
+    // bodies, and no cache is written.
+    int timeout = 0;
+
+    // Number of threads used by the main thread to apply index updates. If
+    // greater than 1, a batch of updates is merged and applied in parallel,
+    // sharded by USR (entities) and by file (symbol references). 0 or 1 applies
+    // updates one at a time.
+    int updateThreads = 0;
+
     // Whether to reparse a file if write times of its dependencies have
     // changed. The file will always be reparsed if its own write time changes.
     // 0: no, 1: only during initial load of project, 2: yes
     int trackDependency = 2;
 
+    // If true, watch the workspace folders with inotify (Linux only) and
+    // reindex changed files, for clients that do not send
+    // workspace/didChangeWatchedFiles. Changes made while ccls is not running
+    // are still found by trackDependency.
+    bool watch = false;
+
     std::vector<std::string> whitelist;
+
+    // If true, translation units indexed in the background are parsed by
+    // `ccls --index-worker` child processes, one per indexer thread, so that a
+    // clang crash fails only that translation unit and clang's memory does not
+    // stay in the server. A worker is replaced after workerMaxFiles
+    // translation units or once its peak memory reaches workerMaxMemory MiB.
+    // Not supported on Windows.
+    bool workers = false;
+    int workerMaxFiles = 64;
+    int workerMaxMemory = 4096;
   } index;
 
   struct Request {
+    // Number of threads running read-only requests such as $ccls/call and
+    // textDocument/references, so that a slow request does not delay the
+    // others. If 0, all requests run on the main thread.
+    int threads = 0;
     // If the document of a request has not been indexed, wait up to this many
     // milleseconds before reporting error.
     int64_t timeout = 5000;
+    // If true, requests received together run interactive ones (completion,
+    // hover, signatureHelp, definition) first and bulk ones (codeLens,
+    // documentSymbol, references, workspace/symbol, ...) last, never moving
+    // a request across a notification. A per-document request such as
+    // codeLens superseded by a later one for the same document is answered
+    // with ContentModified.
+    bool prioritize = true;
+    // If positive, the replies of up to this many distinct
+    // textDocument/references, $ccls/inheritance, $ccls/member and $ccls/vars
+    // requests are memoized and returned for identical requests until the
+    // index or an open document changes.
+    int cacheResults = 32;
   } request;
 
   struct Session {
     int maxNum = 10;
+    // If positive, least recently used sessions are also evicted while the
+    // memory of their preambles (the PCH if preambleInMemory, plus the stat
+    // cache) exceeds this many MiB in total. The most recently used one is
+    // kept. See "sema" of $ccls/stats.
+    int maxPreambleSize = 0;
+    // If false, preambles are written to temporary files instead of being
+    // kept in memory, so that a larger maxNum (and index.preambleCache) costs
+    // disk space rather than memory.
+    bool preambleInMemory = true;
+
+    // If true, opening a file also builds, in the background, the preambles
+    // of related files that are likely edited next: the header of the same
+    // name included by an opened source file, and the translation units of
+    // the same name for an opened header. A speculative build runs after the
+    // other preamble builds and is skipped if it would evict a session, i.e.
+    // with maxNum sessions or with maxPreambleSize used up.
+    bool prewarm = false;
+
+    // Number of threads building preambles. Builds of completion requests
+    // run first, then those of viewed and saved files, then diagnostics
+    // rebuilds and prewarming. Requests for a file whose preamble is being
+    // built are merged into a single build afterwards.
+    int preambleThreads = 2;
+
+    // If true, files with the same compile arguments (apart from the file
+    // name) in the same directory whose preamble (the leading #include
+    // block) is identical use one preamble, built once and counted once for
+    // each of them towards maxPreambleSize.
+    bool sharePreambles = true;
+
+    // If true, each session keeps the AST of its last diagnostics run, so
+    // that textDocument/signatureHelp, and textDocument/hover while the file
+    // differs from the indexed content, are answered from it while the
+    // buffer is unchanged. The AST counts towards maxPreambleSize.
+    bool retainAST = true;
   } session;
 
   struct WorkspaceSymbol {
@@ -321,17 +667,19 @@ struct Config {
     int maxNum = 2000;
   } xref;
 };
-REFLECT_STRUCT(Config::Cache, directory, format, hierarchicalPath,
-               retainInMemory);
+REFLECT_STRUCT(Config::Cache, compress, contentHash, directory, format, gcDays,
+               hierarchicalPath, pack, retainInMemory, sharedDirectory,
+               sharedWrite, snapshot, symbolTable);
 REFLECT_STRUCT(Config::ServerCap::DocumentOnTypeFormattingOptions,
                firstTriggerCharacter, moreTriggerCharacter);
 REFLECT_STRUCT(Config::ServerCap::Workspace::WorkspaceFolders, supported,
                changeNotifications);
 REFLECT_STRUCT(Config::ServerCap::Workspace, workspaceFolders);
 REFLECT_STRUCT(Config::ServerCap, documentOnTypeFormattingProvider,
-               foldingRangeProvider, workspace);
+               foldingRangeProvider, semanticTokensProvider, workspace);
 REFLECT_STRUCT(Config::Clang, excludeArgs, extraArgs, pathMappings,
-               resourceDir);
+               resourceDir, statCache, reuseFileManager, invocationCache,
+               driverCache);
 REFLECT_STRUCT(Config::ClientCapability, diagnosticsRelatedInformation,
                hierarchicalDocumentSymbolSupport, linkSupport, snippetSupport);
 REFLECT_STRUCT(Config::CodeLens, localVariables);
@@ -339,18 +687,27 @@ REFLECT_STRUCT(Config::Completion::Include, blacklist, maxPathSize,
                suffixWhitelist, whitelist);
 REFLECT_STRUCT(Config::Completion, caseSensitivity, detailedLabel,
                dropOldRequests, duplicateOptional, filterAndSort, include,
-               maxNum, placeholder);
-REFLECT_STRUCT(Config::Diagnostics, blacklist, onChange, onOpen, onSave,
-               spellChecking, whitelist)
-REFLECT_STRUCT(Config::Highlight, largeFileSize, lsRanges, blacklist, whitelist)
+               maxNum, placeholder, prefetch);
+REFLECT_STRUCT(Config::Diagnostics, blacklist, onChange, onChangeMin, onOpen,
+               onSave, spellChecking, threads, whitelist)
+REFLECT_STRUCT(Config::Highlight, largeFileSize, lsRanges, refreshFiles,
+               blacklist, whitelist)
 REFLECT_STRUCT(Config::Index::Name, suppressUnwrittenScope);
-REFLECT_STRUCT(Config::Index, blacklist, comments, initialNoLinkage,
-               initialBlacklist, initialWhitelist, maxInitializerLines,
-               multiVersion, multiVersionBlacklist, multiVersionWhitelist, name,
-               onChange, parametersInDeclarations, threads, trackDependency,
-               whitelist);
-REFLECT_STRUCT(Config::Request, timeout);
-REFLECT_STRUCT(Config::Session, maxNum);
+REFLECT_STRUCT(Config::Index, adaptiveThreads, aging, blacklist, canonicalPaths,
+               comments, compactPercent, dedupeHeaders, initialDeclarationsOnly,
+               initialNoLinkage, initialBlacklist, initialWhitelist,
+               largeFileSize, largeFiles, lazyComments, lazyLoad, macroUses,
+               maxInitializerLines, maxPendingUpdateMemory, maxPendingUpdates,
+               memoryBudget, memoryLimit, multiVersion, multiVersionBlacklist,
+               multiVersionMax, multiVersionWhitelist, name, numa, onChange,
+               parametersInDeclarations, pauseAfterEdit, preambleCache,
+               quarantine, recentFiles, reindexDependents, shard, shards,
+               systemReferences, threads, timeout, updateThreads,
+               trackDependency, watch, whitelist, workers, workerMaxFiles,
+               workerMaxMemory);
+REFLECT_STRUCT(Config::Request, cacheResults, prioritize, threads, timeout);
+REFLECT_STRUCT(Config::Session, maxNum, maxPreambleSize, preambleInMemory,
+               prewarm, preambleThreads, sharePreambles, retainAST);
 REFLECT_STRUCT(Config::WorkspaceSymbol, caseSensitivity, maxNum, sort);
 REFLECT_STRUCT(Config::Xref, maxNum);
 REFLECT_STRUCT(Config, compilationDatabaseCommand, compilationDatabaseDirectory,
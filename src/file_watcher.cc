@@ -0,0 +1,235 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "file_watcher.hh"
+
+#include "config.hh"
+#include "git.hh"
+#include "log.hh"
+#include "lsp.hh"
+#include "message_handler.hh"
+#include "pipeline.hh"
+
+#ifdef __linux__
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Threading.h>
+
+#include <rapidjson/writer.h>
+
+#include <errno.h>
+#include <mutex>
+#include <poll.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using namespace llvm;
+
+namespace ccls {
+namespace {
+const uint32_t kDirMask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                          IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+// Changes are reported after no event has arrived for this long, so that a
+// branch switch becomes one notification.
+const int kSettleMs = 200;
+
+std::mutex mutex;
+int inotify_fd = -1;
+std::unordered_map<int, std::string> wd2dir;
+// Watches of git directories, for checkouts which move HEAD.
+std::unordered_set<int> git_wds;
+bool limit_reported;
+
+bool skipDirectory(const std::string &path) {
+  return sys::path::filename(path).startswith(".") ||
+         (g_config->cache.directory.size() &&
+          StringRef(path + '/').startswith(g_config->cache.directory));
+}
+
+// Adds watches for |root| and its subdirectories. Hidden directories and the
+// cache directory are skipped. Called with |mutex| held.
+void addTree(const std::string &root) {
+  std::vector<std::string> stack{root};
+  while (stack.size()) {
+    std::string dir = std::move(stack.back());
+    stack.pop_back();
+    int wd = inotify_add_watch(inotify_fd, dir.c_str(), kDirMask);
+    if (wd < 0) {
+      if (errno == ENOSPC && !limit_reported) {
+        limit_reported = true;
+        LOG_S(WARNING) << "inotify watch limit reached at " << dir
+                       << "; raise fs.inotify.max_user_watches";
+      }
+      continue;
+    }
+    if (dir.back() != '/')
+      dir += '/';
+    wd2dir[wd] = dir;
+    std::error_code ec;
+    for (sys::fs::directory_iterator it(dir, ec, false), end; it != end && !ec;
+         it.increment(ec)) {
+      if (it->type() != sys::fs::file_type::directory_file)
+        continue;
+      if (!skipDirectory(it->path()))
+        stack.push_back(it->path());
+    }
+  }
+}
+
+void notifyChanges(const std::vector<std::pair<std::string, int>> &changes) {
+  rapidjson::StringBuffer output;
+  rapidjson::Writer<rapidjson::StringBuffer> w(output);
+  w.StartObject();
+  w.Key("jsonrpc");
+  w.String("2.0");
+  w.Key("method");
+  w.String("workspace/didChangeWatchedFiles");
+  w.Key("params");
+  w.StartObject();
+  w.Key("changes");
+  w.StartArray();
+  for (auto &[path, type] : changes) {
+    w.StartObject();
+    w.Key("uri");
+    std::string uri = DocumentUri::fromPath(path).raw_uri;
+    w.String(uri.c_str(), uri.size());
+    w.Key("type");
+    w.Int(type);
+    w.EndObject();
+  }
+  w.EndArray();
+  w.EndObject();
+  w.EndObject();
+  LOG_S(INFO) << "watcher reports " << changes.size() << " changed files";
+  pipeline::pushNotification({output.GetString(), output.GetSize()});
+}
+
+void watcherMain() {
+  set_thread_name("watcher");
+  std::vector<std::pair<std::string, int>> changes;
+  StringMap<size_t> path2change;
+  bool head_moved = false;
+  alignas(struct inotify_event) char buf[16384];
+  while (!pipeline::g_quit.load(std::memory_order_relaxed)) {
+    pollfd pfd{inotify_fd, POLLIN, 0};
+    int r = poll(&pfd, 1, kSettleMs);
+    if (r < 0 && errno != EINTR)
+      break;
+    if (r <= 0) {
+      if (changes.size()) {
+        notifyChanges(changes);
+        changes.clear();
+        path2change.clear();
+      }
+      if (head_moved) {
+        // Reindex the files changed by the checkout and their dependents.
+        head_moved = false;
+        pipeline::pushNotification(
+            "{\"jsonrpc\":\"2.0\",\"method\":\"$ccls/reload\","
+            "\"params\":{\"git\":true}}");
+      }
+      continue;
+    }
+    ssize_t len = read(inotify_fd, buf, sizeof buf);
+    if (len <= 0)
+      continue;
+    std::lock_guard lock(mutex);
+    for (char *p = buf; p < buf + len;) {
+      auto *ev = reinterpret_cast<struct inotify_event *>(p);
+      p += sizeof(struct inotify_event) + ev->len;
+      if (ev->mask & IN_IGNORED) {
+        wd2dir.erase(ev->wd);
+        git_wds.erase(ev->wd);
+        continue;
+      }
+      if (git_wds.count(ev->wd)) {
+        if (ev->len && strcmp(ev->name, "HEAD") == 0)
+          head_moved = true;
+        continue;
+      }
+      auto it = wd2dir.find(ev->wd);
+      if (it == wd2dir.end() || !ev->len)
+        continue;
+      std::string path = it->second + ev->name;
+      if (ev->mask & IN_ISDIR) {
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO) && !skipDirectory(path))
+          addTree(path);
+        continue;
+      }
+      FileChangeType type = ev->mask & (IN_DELETE | IN_MOVED_FROM)
+                                ? FileChangeType::Deleted
+                            : ev->mask & IN_CREATE ? FileChangeType::Created
+                                                   : FileChangeType::Changed;
+      // A created file is also reported by IN_CLOSE_WRITE. Keep it Created.
+      auto [it1, inserted] = path2change.try_emplace(path, changes.size());
+      if (inserted)
+        changes.emplace_back(path, int(type));
+      else if (!(changes[it1->second].second == int(FileChangeType::Created) &&
+                 type == FileChangeType::Changed))
+        changes[it1->second].second = int(type);
+    }
+  }
+  pipeline::threadLeave();
+}
+} // namespace
+
+void watchDirectory(const std::string &root) {
+  if (!g_config->index.watch)
+    return;
+  std::lock_guard lock(mutex);
+  if (inotify_fd < 0) {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+      LOG_S(WARNING) << "inotify_init1: " << strerror(errno);
+      return;
+    }
+    pipeline::threadEnter();
+    std::thread(watcherMain).detach();
+  }
+  // git replaces HEAD by renaming HEAD.lock.
+  if (std::optional<std::string> dir = gitDir(root)) {
+    int wd = inotify_add_watch(inotify_fd, dir->c_str(),
+                               IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR);
+    if (wd >= 0)
+      git_wds.insert(wd);
+  }
+  size_t before = wd2dir.size();
+  addTree(root);
+  LOG_S(INFO) << "watch " << wd2dir.size() - before << " directories in "
+              << root;
+}
+
+void unwatchDirectory(const std::string &root) {
+  std::lock_guard lock(mutex);
+  if (inotify_fd < 0)
+    return;
+  for (auto it = wd2dir.begin(); it != wd2dir.end();) {
+    StringRef dir = it->second;
+    if (dir.startswith(root) &&
+        llvm::none_of(g_config->workspaceFolders, [&](auto &folder) {
+          return dir.startswith(folder.first);
+        })) {
+      inotify_rm_watch(inotify_fd, it->first);
+      it = wd2dir.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+} // namespace ccls
+#else
+namespace ccls {
+void watchDirectory(const std::string &) {
+  if (g_config->index.watch)
+    LOG_S(WARNING) << "index.watch is not supported on this platform";
+}
+void unwatchDirectory(const std::string &) {}
+} // namespace ccls
+#endif
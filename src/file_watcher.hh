@@ -0,0 +1,18 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <string>
+
+namespace ccls {
+// Watches |root| recursively if index.watch is set and reports changes to the
+// main thread as workspace/didChangeWatchedFiles notifications. A checkout
+// which moves HEAD of its git repository is reported as $ccls/reload with
+// git: true. The first call starts the watcher thread. Only implemented with
+// inotify on Linux.
+void watchDirectory(const std::string &root);
+// Stops watching the directories of the removed workspace folder |root| which
+// are not in another workspace folder.
+void unwatchDirectory(const std::string &root);
+} // namespace ccls
@@ -4,9 +4,15 @@
 #include "filesystem.hh"
 using namespace llvm;
 
+#include "config.hh"
 #include "utils.hh"
 
+#include <llvm/ADT/StringMap.h>
+
+#include <algorithm>
+#include <atomic>
 #include <set>
+#include <shared_mutex>
 #include <vector>
 
 void getFilesInFolder(std::string folder, bool recursive, bool dir_prefix,
@@ -15,46 +21,236 @@ void getFilesInFolder(std::string folder, bool recursive, bool dir_prefix,
   sys::fs::file_status status;
   if (sys::fs::status(folder, status, true))
     return;
-  sys::fs::UniqueID id;
+  struct Subdir {
+    std::string path;
+    sys::fs::UniqueID id;
+    bool symlink;
+  };
+  struct Listing {
+    std::vector<std::string> files;
+    std::vector<Subdir> subdirs;
+  };
+  auto list = [&](const std::string &folder1, Listing &out) {
+    std::error_code ec;
+    sys::fs::file_status status;
+    for (sys::fs::directory_iterator i(folder1, ec, false), e; i != e && !ec;
+         i.increment(ec)) {
+      std::string path = i->path();
+      std::string filename(sys::path::filename(path));
+      if ((filename[0] == '.' && filename != ".ccls") ||
+          sys::fs::status(path, status, false))
+        continue;
+      if (sys::fs::is_symlink_file(status)) {
+        if (sys::fs::status(path, status, true))
+          continue;
+        if (sys::fs::is_directory(status)) {
+          if (recursive)
+            out.subdirs.push_back({path, status.getUniqueID(), true});
+          continue;
+        }
+      }
+      if (sys::fs::is_regular_file(status)) {
+        if (!dir_prefix)
+          path = path.substr(folder.size());
+        out.files.push_back(sys::path::convert_to_slash(path));
+      } else if (recursive && sys::fs::is_directory(status)) {
+        out.subdirs.push_back({path, status.getUniqueID(), false});
+      }
+    }
+  };
+
+  // Walk the tree level by level and list the directories of a level in
+  // parallel. |handler| is called on this thread. Directories reached through
+  // symlinks are deferred so that real paths are preferred.
+  const int n_threads = std::max(std::thread::hardware_concurrency(), 1u);
   std::vector<std::string> curr{folder};
-  std::vector<std::pair<std::string, sys::fs::file_status>> succ;
+  std::vector<Subdir> succ;
   std::set<sys::fs::UniqueID> seen{status.getUniqueID()};
   while (curr.size() || succ.size()) {
     if (curr.empty()) {
       for (auto &it : succ)
-        if (!seen.count(it.second.getUniqueID()))
-          curr.push_back(std::move(it.first));
+        if (seen.insert(it.id).second)
+          curr.push_back(std::move(it.path));
       succ.clear();
-    } else {
-      std::error_code ec;
-      std::string folder1 = curr.back();
-      curr.pop_back();
-      for (sys::fs::directory_iterator i(folder1, ec, false), e; i != e && !ec;
-           i.increment(ec)) {
-        std::string path = i->path();
-        std::string filename(sys::path::filename(path));
-        if ((filename[0] == '.' && filename != ".ccls") ||
-            sys::fs::status(path, status, false))
-          continue;
-        if (sys::fs::is_symlink_file(status)) {
-          if (sys::fs::status(path, status, true))
-            continue;
-          if (sys::fs::is_directory(status)) {
-            if (recursive)
-              succ.emplace_back(path, status);
-            continue;
-          }
-        }
-        if (sys::fs::is_regular_file(status)) {
-          if (!dir_prefix)
-            path = path.substr(folder.size());
-          handler(sys::path::convert_to_slash(path));
-        } else if (recursive && sys::fs::is_directory(status) &&
-                   !seen.count(id = status.getUniqueID())) {
-          curr.push_back(path);
-          seen.insert(id);
-        }
-      }
+      continue;
+    }
+    std::vector<Listing> listings(curr.size());
+    std::atomic<size_t> next{0};
+    ccls::runParallel(std::min<size_t>(n_threads, curr.size()), [&](int) {
+      for (size_t i; (i = next++) < curr.size();)
+        list(curr[i], listings[i]);
+    });
+    curr.clear();
+    for (Listing &listing : listings) {
+      for (const std::string &path : listing.files)
+        handler(path);
+      for (Subdir &subdir : listing.subdirs)
+        if (subdir.symlink)
+          succ.push_back(std::move(subdir));
+        else if (seen.insert(subdir.id).second)
+          curr.push_back(std::move(subdir.path));
     }
   }
 }
+
+namespace ccls {
+namespace {
+// System and third-party headers are stat'ed over and over again by every TU
+// and for every include directory searched. They rarely change, so cache
+// their status (including failures). Files in workspace folders are passed
+// through, as they are created and edited all the time.
+struct CachingFileSystem : vfs::ProxyFileSystem {
+  std::shared_mutex mutex;
+  StringMap<ErrorOr<vfs::Status>> cache;
+  std::vector<std::string> roots;
+
+  CachingFileSystem() : ProxyFileSystem(vfs::getRealFileSystem()) {}
+
+  bool cacheable(StringRef path) {
+    if (!sys::path::is_absolute(path))
+      return false;
+    for (const std::string &root : roots)
+      if (path.startswith(root))
+        return false;
+    return true;
+  }
+  void update(StringRef path, ErrorOr<vfs::Status> st) {
+    std::lock_guard lock(mutex);
+    if (cacheable(path))
+      cache.insert_or_assign(path, std::move(st));
+  }
+
+  ErrorOr<vfs::Status> status(const Twine &path) override {
+    SmallString<256> buf;
+    StringRef p = path.toStringRef(buf);
+    {
+      std::shared_lock lock(mutex);
+      auto it = cache.find(p);
+      if (it != cache.end())
+        return it->second;
+    }
+    auto st = getUnderlyingFS().status(p);
+    update(p, st);
+    return st;
+  }
+  // The status of an opened file is fresh. Use it for later status() calls so
+  // that they agree with the content that has been read.
+  ErrorOr<std::unique_ptr<vfs::File>>
+  openFileForRead(const Twine &path) override {
+    SmallString<256> buf;
+    StringRef p = path.toStringRef(buf);
+    auto file = getUnderlyingFS().openFileForRead(p);
+    if (file && *file)
+      update(p, (*file)->status());
+    else if (!file)
+      update(p, file.getError());
+    return file;
+  }
+};
+
+std::atomic<int64_t> generation{0};
+
+// Write times of the dependencies checked by the initial load, shared by all
+// translation units. See startupWriteTimes.
+std::shared_mutex startup_mutex;
+StringMap<std::optional<int64_t>> startup_mtimes;
+
+CachingFileSystem *cachingFileSystem() {
+  if (!g_config || !g_config->clang.statCache)
+    return nullptr;
+  static IntrusiveRefCntPtr<CachingFileSystem> fs(new CachingFileSystem);
+  return fs.get();
+}
+} // namespace
+
+IntrusiveRefCntPtr<vfs::FileSystem> getFileSystem() {
+  if (CachingFileSystem *fs = cachingFileSystem())
+    return fs;
+  return vfs::getRealFileSystem();
+}
+
+int64_t fileSystemGeneration() { return generation; }
+
+std::vector<std::optional<int64_t>>
+startupWriteTimes(const std::vector<std::string> &paths) {
+  std::vector<std::optional<int64_t>> ret(paths.size());
+  std::vector<size_t> missing;
+  {
+    std::shared_lock lock(startup_mutex);
+    for (size_t i = 0; i < paths.size(); i++) {
+      auto it = startup_mtimes.find(paths[i]);
+      if (it != startup_mtimes.end())
+        ret[i] = it->second;
+      else
+        missing.push_back(i);
+    }
+  }
+  if (missing.empty())
+    return ret;
+  std::vector<std::string> todo;
+  todo.reserve(missing.size());
+  for (size_t i : missing)
+    todo.push_back(paths[i]);
+  std::vector<std::optional<int64_t>> mtimes = lastWriteTimes(todo);
+  std::lock_guard lock(startup_mutex);
+  for (size_t j = 0; j < missing.size(); j++) {
+    ret[missing[j]] = mtimes[j];
+    startup_mtimes.try_emplace(todo[j], mtimes[j]);
+  }
+  return ret;
+}
+
+void resetFileSystem() {
+  generation++;
+  {
+    std::lock_guard lock(startup_mutex);
+    startup_mtimes.clear();
+  }
+  CachingFileSystem *fs = cachingFileSystem();
+  if (!fs)
+    return;
+  std::lock_guard lock(fs->mutex);
+  fs->cache.clear();
+  fs->roots.clear();
+  for (auto &[folder, real] : g_config->workspaceFolders) {
+    fs->roots.push_back(folder);
+    if (real.size())
+      fs->roots.push_back(real);
+  }
+}
+
+void updateFileSystemRoots() {
+  generation++;
+  {
+    std::lock_guard lock(startup_mutex);
+    startup_mtimes.clear();
+  }
+  CachingFileSystem *fs = cachingFileSystem();
+  if (!fs)
+    return;
+  std::lock_guard lock(fs->mutex);
+  fs->roots.clear();
+  for (auto &[folder, real] : g_config->workspaceFolders) {
+    fs->roots.push_back(folder);
+    if (real.size())
+      fs->roots.push_back(real);
+  }
+  for (auto it = fs->cache.begin(); it != fs->cache.end();) {
+    auto cur = it++;
+    if (!fs->cacheable(cur->first()))
+      fs->cache.erase(cur);
+  }
+}
+
+void invalidateFileSystem(StringRef path) {
+  generation++;
+  {
+    std::lock_guard lock(startup_mutex);
+    startup_mtimes.erase(path);
+  }
+  if (CachingFileSystem *fs = cachingFileSystem()) {
+    std::lock_guard lock(fs->mutex);
+    fs->cache.erase(path);
+  }
+}
+} // namespace ccls
@@ -5,10 +5,37 @@
 
 #include <llvm/Support/FileSystem.h>
 #include <llvm/Support/Path.h>
+#include <llvm/Support/VirtualFileSystem.h>
 
 #include <functional>
+#include <optional>
+#include <stdint.h>
 #include <string>
+#include <vector>
 
 void getFilesInFolder(std::string folder, bool recursive,
                       bool add_folder_to_path,
                       const std::function<void(const std::string &)> &handler);
+
+namespace ccls {
+// Returns the file system used by clang in indexer and sema threads. With
+// clang.statCache, it is shared and caches status() of files outside
+// workspace folders.
+llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> getFileSystem();
+// Like lastWriteTimes, for the dependency checks of the initial load. Every
+// translation unit checks its headers, so each path is stat'ed once and the
+// result is reused until invalidateFileSystem or resetFileSystem.
+std::vector<std::optional<int64_t>>
+startupWriteTimes(const std::vector<std::string> &paths);
+// Clears the caches and takes the current workspace folders. Call on the main
+// thread when they change.
+void resetFileSystem();
+// Like resetFileSystem, but keeps the cached status of files which are still
+// outside of workspace folders.
+void updateFileSystemRoots();
+// Drops the cached status of |path|.
+void invalidateFileSystem(llvm::StringRef path);
+// Incremented by the functions above. A FileManager reused across translation
+// units is stale once this has changed.
+int64_t fileSystemGeneration();
+} // namespace ccls
@@ -47,39 +47,6 @@ void calculateRoles(std::string_view s, int roles[], int *class_set) {
 }
 } // namespace
 
-int FuzzyMatcher::missScore(int j, bool last) {
-  int s = -3;
-  if (last)
-    s -= 10;
-  if (text_role[j] == Head)
-    s -= 10;
-  return s;
-}
-
-int FuzzyMatcher::matchScore(int i, int j, bool last) {
-  int s = 0;
-  // Case matching.
-  if (pat[i] == text[j]) {
-    s++;
-    // pat contains uppercase letters or prefix matching.
-    if ((pat_set & 1 << Upper) || i == j)
-      s++;
-  }
-  if (pat_role[i] == Head) {
-    if (text_role[j] == Head)
-      s += 30;
-    else if (text_role[j] == Tail)
-      s -= 10;
-  }
-  // Matching a tail while previous char wasn't matched.
-  if (text_role[j] == Tail && i && !last)
-    s -= 30;
-  // First char of pat matches a tail.
-  if (i == 0 && text_role[j] == Tail)
-    s -= 40;
-  return s;
-}
-
 FuzzyMatcher::FuzzyMatcher(std::string_view pattern, int sensitivity) {
   calculateRoles(pattern, pat_role, &pat_set);
   if (sensitivity == 1)
@@ -107,35 +74,54 @@ int FuzzyMatcher::match(std::string_view text, bool strict) {
   calculateRoles(text, text_role, &text_set);
   if (strict && n && !!pat_role[0] != !!text_role[0])
     return kMinScore;
-  dp[0][0][0] = dp[0][0][1] = 0;
+  for (int j = 0; j < n; j++)
+    text_miss[j] = text_role[j] == Head ? -13 : -3;
+  dp0[0][0] = dp1[0][0] = 0;
   for (int j = 0; j < n; j++) {
-    dp[0][j + 1][0] = dp[0][j][0] + missScore(j, false);
-    dp[0][j + 1][1] = kMinScore * 2;
+    dp0[0][j + 1] = dp0[0][j] + text_miss[j];
+    dp1[0][j + 1] = kMinScore * 2;
   }
+  const bool pat_upper = pat_set & 1 << Upper;
   for (int i = 0; i < int(pat.size()); i++) {
-    int(*pre)[2] = dp[i & 1];
-    int(*cur)[2] = dp[(i + 1) & 1];
-    cur[i][0] = cur[i][1] = kMinScore;
+    const int *pre0 = dp0[i & 1], *pre1 = dp1[i & 1];
+    int *cur0 = dp0[(i + 1) & 1], *cur1 = dp1[(i + 1) & 1];
+    const char pc = pat[i], low_pc = low_pat[i];
+    const bool pat_head = pat_role[i] == Head;
+    cur0[i] = cur1[i] = kMinScore;
+    // Matched states only depend on the previous row, so this loop has no
+    // loop-carried dependency and is vectorized by the compiler.
     for (int j = i; j < n; j++) {
-      cur[j + 1][0] = std::max(cur[j][0] + missScore(j, false),
-                               cur[j][1] + missScore(j, true));
+      const int role = text_role[j];
+      const bool exact = pc == text[j];
       // For the first char of pattern, apply extra restriction to filter bad
       // candidates (e.g. |int| in |PRINT|)
-      cur[j + 1][1] = (case_sensitivity ? pat[i] == text[j]
-                                        : low_pat[i] == low_text[j] &&
-                                              (i || text_role[j] != Tail ||
-                                               pat[i] == text[j]))
-                          ? std::max(pre[j][0] + matchScore(i, j, false),
-                                     pre[j][1] + matchScore(i, j, true))
-                          : kMinScore * 2;
+      const bool ok =
+          case_sensitivity
+              ? exact
+              : low_pc == low_text[j] && (i || role != Tail || exact);
+      // Case matching. pat contains uppercase letters or prefix matching.
+      int s = exact ? (pat_upper || i == j ? 2 : 1) : 0;
+      if (pat_head)
+        s += role == Head ? 30 : role == Tail ? -10 : 0;
+      // First char of pat matches a tail.
+      if (i == 0 && role == Tail)
+        s -= 40;
+      // Matching a tail while previous char wasn't matched.
+      const int tail = i && role == Tail ? -30 : 0;
+      cur1[j + 1] = ok ? s + std::max(pre0[j] + tail, pre1[j]) : kMinScore * 2;
     }
+    // Unmatched states are a running maximum along the row. A miss right
+    // after a match costs 10 more.
+    for (int j = i; j < n; j++)
+      cur0[j + 1] =
+          std::max(cur0[j] + text_miss[j], cur1[j] + text_miss[j] - 10);
   }
 
   // Enumerate the end position of the match in str. Each removed trailing
   // character has a penulty.
   int ret = kMinScore;
   for (int j = pat.size(); j <= n; j++)
-    ret = std::max(ret, dp[pat.size() & 1][j][1] - 2 * (n - j));
+    ret = std::max(ret, dp1[pat.size() & 1][j] - 2 * (n - j));
   return ret;
 }
 } // namespace ccls
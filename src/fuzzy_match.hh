@@ -26,9 +26,9 @@ private:
   int pat_set, text_set;
   char low_pat[kMaxPat], low_text[kMaxText];
   int pat_role[kMaxPat], text_role[kMaxText];
-  int dp[2][kMaxText + 1][2];
-
-  int matchScore(int i, int j, bool last);
-  int missScore(int j, bool last);
+  // Score of skipping text[j] when text[j-1] is not matched.
+  int text_miss[kMaxText];
+  // Two rolling rows. dp0: the last character is not matched; dp1: matched.
+  int dp0[2][kMaxText + 1], dp1[2][kMaxText + 1];
 };
 } // namespace ccls
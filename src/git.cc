@@ -0,0 +1,100 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "git.hh"
+
+#include "config.hh"
+#include "log.hh"
+#include "utils.hh"
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Program.h>
+
+#include <array>
+#include <mutex>
+
+using namespace llvm;
+
+namespace ccls {
+namespace {
+std::mutex mutex;
+// Workspace folder => HEAD when last recorded.
+StringMap<std::string> heads;
+
+// Runs git with |args| in |root| and returns its stdout, or std::nullopt if it
+// fails.
+std::optional<std::string> runGit(const std::string &root,
+                                  std::vector<StringRef> args) {
+  static ErrorOr<std::string> git = sys::findProgramByName("git");
+  if (!git)
+    return std::nullopt;
+  SmallString<128> out;
+  if (sys::fs::createTemporaryFile("ccls-git", "txt", out))
+    return std::nullopt;
+  args.insert(args.begin(), {*git, "-C", root});
+  std::array<Optional<StringRef>, 3> redir{StringRef(""), StringRef(out),
+                                           StringRef("")};
+  std::string err_msg;
+  int ret = sys::ExecuteAndWait(*git, args, llvm::None, redir, 0, 0, &err_msg);
+  std::optional<std::string> content =
+      ret == 0 ? readContent(std::string(out)) : std::nullopt;
+  sys::fs::remove(out);
+  if (ret != 0)
+    LOG_V(1) << "git " << (args.size() > 3 ? args[3].str() : "") << " in "
+             << root << " failed: " << err_msg;
+  return content;
+}
+
+std::string firstLine(const std::string &s) {
+  return s.substr(0, s.find('\n'));
+}
+} // namespace
+
+std::optional<std::string> gitHead(const std::string &root) {
+  if (auto out = runGit(root, {"rev-parse", "HEAD"}))
+    return firstLine(*out);
+  return std::nullopt;
+}
+
+std::optional<std::string> gitDir(const std::string &root) {
+  if (auto out = runGit(root, {"rev-parse", "--absolute-git-dir"}))
+    return firstLine(*out);
+  return std::nullopt;
+}
+
+void recordGitHeads() {
+  std::lock_guard lock(mutex);
+  heads.clear();
+  for (auto &[folder, _] : g_config->workspaceFolders)
+    if (auto head = gitHead(folder))
+      heads[folder] = *head;
+}
+
+std::vector<std::string> takeGitChanges() {
+  std::vector<std::string> ret;
+  std::lock_guard lock(mutex);
+  for (auto &[folder, _] : g_config->workspaceFolders) {
+    std::optional<std::string> head = gitHead(folder);
+    if (!head)
+      continue;
+    auto [it, inserted] = heads.try_emplace(folder, *head);
+    if (inserted || it->second == *head)
+      continue;
+    // --relative limits the diff to |folder| and makes the paths relative to
+    // it.
+    std::optional<std::string> out = runGit(
+        folder, {"diff", "--name-only", "-z", "--relative", it->second, *head});
+    if (!out)
+      continue;
+    LOG_S(INFO) << "HEAD of " << folder << " moved from " << it->second
+                << " to " << *head;
+    it->second = *head;
+    SmallVector<StringRef, 0> paths;
+    StringRef(*out).split(paths, '\0', -1, false);
+    for (StringRef path : paths)
+      ret.push_back(folder + path.str());
+  }
+  return ret;
+}
+} // namespace ccls
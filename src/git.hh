@@ -0,0 +1,23 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace ccls {
+// Returns the commit of HEAD of the git work tree containing |root|, or
+// std::nullopt if |root| is not in one or git is unavailable.
+std::optional<std::string> gitHead(const std::string &root);
+// Returns the absolute git directory of the work tree containing |root|.
+std::optional<std::string> gitDir(const std::string &root);
+
+// Records the HEAD of each workspace folder.
+void recordGitHeads();
+// Returns the files under the workspace folders that differ between the
+// recorded HEAD and the current one, and records the current one. A folder
+// whose HEAD is unknown or unchanged contributes nothing.
+std::vector<std::string> takeGitChanges();
+} // namespace ccls
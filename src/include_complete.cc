@@ -104,7 +104,7 @@ void IncludeComplete::rescan() {
         int kind = search_kind.second;
         assert(search.back() == '/');
         if (match_ && !match_->matches(search))
-          return;
+          continue;
         bool include_cpp = search.find("include/c++") != std::string::npos;
 
         std::vector<CompletionCandidate> results;
@@ -153,6 +153,10 @@ void IncludeComplete::insertCompletionItem(const std::string &absolute_path,
 }
 
 void IncludeComplete::addFile(const std::string &path) {
+  // Since LLVM 8, clang completes #include itself and |completion_items| is
+  // not read.
+  if (LLVM_VERSION_MAJOR >= 8)
+    return;
   bool ok = false;
   for (StringRef suffix : g_config->completion.include.suffixWhitelist)
     if (StringRef(path).endswith(suffix))
@@ -0,0 +1,294 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "index_worker.hh"
+
+#include "config.hh"
+#include "log.hh"
+#include "pipeline.hh"
+#include "platform.hh"
+#include "sema_manager.hh"
+#include "serializer.hh"
+#include "working_files.hh"
+
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <rapidjson/document.h>
+#include <rapidjson/writer.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace llvm;
+
+namespace ccls {
+namespace {
+struct WorkerRequest {
+  std::string directory, path;
+  std::vector<std::string> args;
+  bool noLinkage = false, declarationsOnly = false;
+};
+REFLECT_STRUCT(WorkerRequest, directory, path, args, noLinkage,
+               declarationsOnly);
+
+struct WorkerResponse {
+  bool ok = false;
+  int64_t memory = 0;
+  int nErrs = 0;
+  std::string firstError;
+  // See IndexResult::aborted.
+  std::string aborted;
+  // File of serialized IndexFiles, removed by the reader.
+  std::string output;
+  // The worker exits after this response.
+  bool recycle = false;
+};
+REFLECT_STRUCT(WorkerResponse, ok, memory, nErrs, firstError, aborted, output,
+               recycle);
+
+// Messages are framed as "<length>\n<payload>".
+void writeFrame(FILE *f, const std::string &payload) {
+  fprintf(f, "%zu\n", payload.size());
+  fwrite(payload.data(), 1, payload.size(), f);
+  fflush(f);
+}
+
+bool readFrame(FILE *f, std::string &payload) {
+  size_t n;
+  if (fscanf(f, "%zu", &n) != 1 || fgetc(f) != '\n')
+    return false;
+  payload.resize(n);
+  return fread(payload.data(), 1, n, f) == n;
+}
+
+template <typename T> std::string toJson(T &v) {
+  rapidjson::StringBuffer output;
+  rapidjson::Writer<rapidjson::StringBuffer> w(output);
+  JsonWriter writer(&w);
+  reflect(writer, v);
+  return {output.GetString(), output.GetSize()};
+}
+
+template <typename T> bool fromJson(const std::string &json, T &v) {
+  rapidjson::Document doc;
+  doc.Parse(json.data(), json.size());
+  if (doc.HasParseError())
+    return false;
+  JsonReader reader{&doc};
+  try {
+    reflect(reader, v);
+  } catch (std::invalid_argument &) {
+    return false;
+  }
+  return true;
+}
+
+// Each IndexFile is stored as its path, contents and serialized form, each
+// preceded by its 64-bit length.
+void appendString(std::string &out, StringRef s) {
+  uint64_t n = s.size();
+  out.append(reinterpret_cast<const char *>(&n), sizeof n);
+  out.append(s.data(), s.size());
+}
+
+bool takeString(StringRef &in, StringRef &s) {
+  uint64_t n;
+  if (in.size() < sizeof n)
+    return false;
+  memcpy(&n, in.data(), sizeof n);
+  in = in.drop_front(sizeof n);
+  if (in.size() < n)
+    return false;
+  s = in.take_front(n);
+  in = in.drop_front(n);
+  return true;
+}
+
+#ifndef _WIN32
+struct Worker {
+  pid_t pid = -1;
+  FILE *to = nullptr, *from = nullptr;
+
+  ~Worker() { stop(); }
+  bool start();
+  void stop() {
+    if (to)
+      fclose(to);
+    if (from)
+      fclose(from);
+    to = from = nullptr;
+    if (pid > 0)
+      waitpid(pid, nullptr, 0);
+    pid = -1;
+  }
+};
+
+bool Worker::start() {
+  static std::string exe = sys::fs::getMainExecutable(
+      nullptr, reinterpret_cast<void *>(&runIndexWorker));
+  int to_fds[2], from_fds[2];
+  if (pipe(to_fds))
+    return false;
+  if (pipe(from_fds)) {
+    close(to_fds[0]);
+    close(to_fds[1]);
+    return false;
+  }
+  // A crashed worker must not kill the server through a write to its pipe.
+  signal(SIGPIPE, SIG_IGN);
+  const char *argv[] = {exe.c_str(), "--index-worker", nullptr};
+  pid = fork();
+  if (pid == 0) {
+    dup2(to_fds[0], 0);
+    dup2(from_fds[1], 1);
+    for (int fd : {to_fds[0], to_fds[1], from_fds[0], from_fds[1]})
+      close(fd);
+    execv(argv[0], const_cast<char *const *>(argv));
+    _exit(127);
+  }
+  close(to_fds[0]);
+  close(from_fds[1]);
+  if (pid < 0) {
+    LOG_S(ERROR) << "failed to start index worker: " << strerror(errno);
+    close(to_fds[1]);
+    close(from_fds[0]);
+    return false;
+  }
+  to = fdopen(to_fds[1], "wb");
+  from = fdopen(from_fds[0], "rb");
+  writeFrame(to, toJson(*g_config));
+  return true;
+}
+#endif
+} // namespace
+
+bool indexInWorker(VFS *vfs, const std::string &directory,
+                   const std::string &main,
+                   const std::vector<const char *> &args, bool no_linkage,
+                   bool declarations_only, IndexResult &result, bool &ok) {
+#ifdef _WIN32
+  return false;
+#else
+  thread_local Worker worker;
+  if (!g_config->index.workers || (!worker.to && !worker.start()))
+    return false;
+
+  WorkerRequest req;
+  req.directory = directory;
+  req.path = main;
+  req.args.assign(args.begin(), args.end());
+  req.noLinkage = no_linkage;
+  req.declarationsOnly = declarations_only;
+  writeFrame(worker.to, toJson(req));
+  std::string frame;
+  WorkerResponse res;
+  ok = false;
+  if (!readFrame(worker.from, frame) || !fromJson(frame, res)) {
+    LOG_S(ERROR) << "index worker crashed for " << main;
+    worker.stop();
+    return true;
+  }
+  if (res.recycle)
+    worker.stop();
+  result.memory = res.memory;
+  result.n_errs = res.nErrs;
+  result.first_error = std::move(res.firstError);
+  result.aborted = std::move(res.aborted);
+  if (!res.ok)
+    return true;
+
+  auto buf = MemoryBuffer::getFile(res.output);
+  sys::fs::remove(res.output);
+  if (!buf) {
+    LOG_S(ERROR) << "failed to read " << res.output;
+    return true;
+  }
+  // The steps of IndexParam::seenFile.
+  int step = declarations_only ? -1 : no_linkage ? 3 : 1;
+  StringRef in = (*buf)->getBuffer(), path, contents, serialized;
+  while (takeString(in, path) && takeString(in, contents) &&
+         takeString(in, serialized)) {
+    auto file = deserialize(
+        SerializeFormat::Binary, path.str(),
+        std::string_view(serialized.data(), serialized.size()), contents.str(),
+        std::nullopt);
+    if (!file)
+      return true;
+    if (vfs->stamp(file->path, file->mtime, step) || file->path == main)
+      result.indexes.push_back(std::move(file));
+  }
+  ok = true;
+  return true;
+#endif
+}
+
+int runIndexWorker() {
+  std::string frame;
+  g_config = new Config;
+  if (!readFrame(stdin, frame) || !fromJson(frame, *g_config))
+    return 1;
+  g_config->index.workers = false;
+  // Files may change between the translation units of a worker.
+  g_config->clang.statCache = false;
+  idx::init();
+  VFS vfs;
+  WorkingFiles wfiles;
+  SemaManager manager(
+      nullptr, nullptr, [](std::string, std::vector<Diagnostic>) {},
+      [](RequestId) {});
+  for (int n = 1; readFrame(stdin, frame); n++) {
+    WorkerRequest req;
+    if (!fromJson(frame, req))
+      return 1;
+    std::vector<const char *> args;
+    for (auto &arg : req.args)
+      args.push_back(intern(arg));
+    bool ok;
+    IndexResult result =
+        idx::index(&manager, &wfiles, &vfs, req.directory, req.path, args, {},
+                   req.noLinkage, req.declarationsOnly, ok);
+    // The server decides which headers each translation unit owns.
+    vfs.clear();
+
+    WorkerResponse res;
+    res.ok = ok;
+    res.memory = result.memory;
+    res.nErrs = result.n_errs;
+    res.firstError = std::move(result.first_error);
+    res.aborted = std::move(result.aborted);
+    if (ok) {
+      std::string out;
+      for (auto &file : result.indexes) {
+        appendString(out, file->path);
+        appendString(out, file->file_contents);
+        appendString(out, serialize(SerializeFormat::Binary, *file));
+      }
+      SmallString<256> path;
+      int fd;
+      if (sys::fs::createTemporaryFile("ccls-index", "bin", fd, path)) {
+        res.ok = false;
+      } else {
+        raw_fd_ostream os(fd, true);
+        os << out;
+        res.output = std::string(path.str());
+      }
+    }
+    res.recycle = n >= g_config->index.workerMaxFiles ||
+                  getPeakMemory() >= int64_t(g_config->index.workerMaxMemory)
+                                         << 20;
+    writeFrame(stdout, toJson(res));
+    if (res.recycle)
+      break;
+  }
+  return 0;
+}
+} // namespace ccls
@@ -0,0 +1,28 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "indexer.hh"
+
+#include <string>
+#include <vector>
+
+namespace ccls {
+struct VFS;
+
+// With index.workers, indexes |main| in the worker process of the calling
+// indexer thread and loads the resulting IndexFiles. Like IndexParam, headers
+// stamped by another translation unit are left out. Returns false if there is
+// no worker, in which case the caller indexes in process. |ok| is false if the
+// worker failed or crashed.
+bool indexInWorker(VFS *vfs, const std::string &directory,
+                   const std::string &main,
+                   const std::vector<const char *> &args, bool no_linkage,
+                   bool declarations_only, IndexResult &result, bool &ok);
+
+// Main function of `ccls --index-worker`. Reads the configuration and then
+// index requests from stdin, writes responses to stdout, and returns when
+// stdin is closed or the worker should be replaced.
+int runIndexWorker();
+} // namespace ccls
@@ -4,27 +4,34 @@
 #include "indexer.hh"
 
 #include "clang_tu.hh"
+#include "filesystem.hh"
 #include "log.hh"
 #include "pipeline.hh"
 #include "platform.hh"
 #include "sema_manager.hh"
+#include "trace.hh"
 
 #include <clang/AST/AST.h>
 #include <clang/Basic/TargetInfo.h>
 #include <clang/Frontend/FrontendAction.h>
 #include <clang/Frontend/MultiplexConsumer.h>
+#include <clang/Frontend/PrecompiledPreamble.h>
 #include <clang/Index/IndexDataConsumer.h>
 #include <clang/Index/IndexingAction.h>
 #include <clang/Index/USRGeneration.h>
 #include <clang/Lex/PreprocessorOptions.h>
 #include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/Support/CrashRecoveryContext.h>
 #include <llvm/Support/Path.h>
+#include <llvm/Support/xxhash.h>
 
 #include <algorithm>
+#include <chrono>
+#include <deque>
 #include <inttypes.h>
 #include <map>
-#include <unordered_set>
+#include <mutex>
 
 using namespace clang;
 
@@ -32,10 +39,45 @@ namespace ccls {
 namespace {
 
 GroupMatch *multiVersionMatcher;
+// Matches the paths of index.largeFiles as a blacklist.
+GroupMatch *largeFileMatcher;
+
+// With index.multiVersionMax, the versions of each multi-version header
+// recorded by translation units, as (macro context, translation unit).
+std::mutex versions_mutex;
+std::unordered_map<std::string, std::vector<std::pair<uint64_t, std::string>>>
+    header_versions;
+
+// With index.dedupeHeaders, the path of the first header indexed with each
+// content hash, and the hash of each such path.
+std::mutex dedupe_mutex;
+std::unordered_map<uint64_t, std::string> hash2header;
+llvm::StringMap<uint64_t> header2hash;
+
+// Returns whether |path| has the content of a header indexed under another
+// path.
+bool isDuplicateHeader(const std::string &path, uint64_t hash) {
+  std::lock_guard lock(dedupe_mutex);
+  auto [it, inserted] = hash2header.try_emplace(hash, path);
+  if (!inserted && it->second != path)
+    return true;
+  // If the content of |path| has changed, its old content may be indexed
+  // under another path.
+  auto [it1, inserted1] = header2hash.try_emplace(path, hash);
+  if (!inserted1 && it1->second != hash) {
+    auto it2 = hash2header.find(it1->second);
+    if (it2 != hash2header.end() && it2->second == path)
+      hash2header.erase(it2);
+    it1->second = hash;
+  }
+  return false;
+}
 
 struct File {
   std::string path;
   int64_t mtime;
+  // xxHash64 of content if cache.contentHash, otherwise 0.
+  uint64_t hash = 0;
   std::string content;
   std::unique_ptr<IndexFile> db;
 };
@@ -43,17 +85,66 @@ struct File {
 struct IndexParam {
   std::unordered_map<FileID, File> uid2file;
   std::unordered_map<FileID, bool> uid2multi;
+  std::unordered_map<FileID, bool> uid2project;
+  // Symbols already referenced in each partial file. See index.largeFileSize.
+  llvm::DenseSet<std::pair<const IndexFile *, Usr>> sampled;
+  // With index.multiVersionMax, the XOR of the hashes of the macros defined
+  // so far, and its value when each file was entered.
+  uint64_t macro_context = 0;
+  llvm::StringMap<uint64_t> macro_hashes;
+  std::unordered_map<FileID, uint64_t> uid2version;
   struct DeclInfo {
     Usr usr;
     std::string short_name;
     std::string qualified;
   };
-  std::unordered_map<const Decl *, DeclInfo> decl2Info;
+  // Keyed by both the canonical decls and the redeclarations seen so far, so
+  // that repeated references are a single lookup. Values point into
+  // |decl_infos|, which never moves its elements.
+  llvm::DenseMap<const Decl *, DeclInfo *> decl2Info;
+  std::deque<DeclInfo> decl_infos;
 
   VFS &vfs;
   ASTContext *ctx;
+  std::string main;
   bool no_linkage;
-  IndexParam(VFS &vfs, bool no_linkage) : vfs(vfs), no_linkage(no_linkage) {}
+  // See index.initialDeclarationsOnly.
+  bool declarations_only;
+  // Time spent in IndexDataConsumer, for tracing.
+  int64_t consumer_us = 0;
+  // index.timeout and index.memoryLimit. If not null, why clang was asked to
+  // stop.
+  std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::time_point::max();
+  int64_t memory_limit = 0;
+  const char *aborted = nullptr;
+  DiagnosticsEngine *diags = nullptr;
+  unsigned checks = 0;
+  IndexParam(VFS &vfs, bool no_linkage, bool declarations_only)
+      : vfs(vfs), no_linkage(no_linkage),
+        declarations_only(declarations_only) {}
+
+  // Called from the callbacks of clang. Once a limit is exceeded, a fatal
+  // error stops Sema from instantiating templates and including files, and
+  // the callers skip the remaining work.
+  bool shouldAbort() {
+    if (aborted)
+      return true;
+    if (++checks % 256)
+      return false;
+    if (std::chrono::steady_clock::now() > deadline)
+      aborted = "timed out";
+    else if (memory_limit && ctx &&
+             int64_t(ctx->getASTAllocatedMemory() +
+                     ctx->getSideTableAllocatedMemory()) > memory_limit)
+      aborted = "memory limit exceeded";
+    else
+      return false;
+    if (diags)
+      diags->Report(diags->getCustomDiagID(DiagnosticsEngine::Fatal, "%0"))
+          << aborted;
+    return true;
+  }
 
   void seenFile(FileID fid) {
     // If this is the first time we have seen the file (ignoring if we are
@@ -71,11 +162,29 @@ struct IndexParam {
           it->second.mtime = *tim;
       if (std::optional<std::string> content = readContent(path))
         it->second.content = *content;
+      if (g_config->cache.contentHash ||
+          g_config->cache.sharedDirectory.size())
+        it->second.hash = llvm::xxHash64(it->second.content);
+      if (g_config->index.dedupeHeaders &&
+          fid != ctx->getSourceManager().getMainFileID() &&
+          isDuplicateHeader(path, it->second.hash
+                                      ? it->second.hash
+                                      : llvm::xxHash64(it->second.content)))
+        return;
 
-      if (!vfs.stamp(path, it->second.mtime, no_linkage ? 3 : 1))
+      // The full pass must not find the file up to date after the
+      // declarations pass.
+      if (!vfs.stamp(path, it->second.mtime,
+                     declarations_only ? -1 : no_linkage ? 3 : 1))
         return;
       it->second.db =
           std::make_unique<IndexFile>(path, it->second.content, no_linkage);
+      it->second.db->declarations_only = declarations_only;
+      it->second.db->partial =
+          (g_config->index.largeFileSize > 0 &&
+           int64_t(it->second.content.size()) >
+               g_config->index.largeFileSize) ||
+          !largeFileMatcher->matches(path);
     }
   }
 
@@ -84,13 +193,67 @@ struct IndexParam {
     return uid2file[fid].db.get();
   }
 
+  // Whether |fid| is a file in a workspace folder. See index.macroUses.
+  bool inProject(FileID fid) {
+    auto [it, inserted] = uid2project.try_emplace(fid);
+    if (inserted)
+      if (const FileEntry *fe =
+              ctx->getSourceManager().getFileEntryForID(fid)) {
+        std::string path = pathFromFileEntry(*fe);
+        it->second = normalizeFolder(path);
+      }
+    return it->second;
+  }
+
   bool useMultiVersion(FileID fid) {
     auto it = uid2multi.try_emplace(fid);
     if (it.second)
-      if (const FileEntry *fe = ctx->getSourceManager().getFileEntryForID(fid))
-        it.first->second = multiVersionMatcher->matches(pathFromFileEntry(*fe));
+      if (const FileEntry *fe =
+              ctx->getSourceManager().getFileEntryForID(fid)) {
+        std::string path = pathFromFileEntry(*fe);
+        it.first->second =
+            multiVersionMatcher->matches(path) && acceptVersion(path, fid);
+      }
     return it.first->second;
   }
+
+  // Returns whether this translation unit records its version of |path|: one
+  // not recorded by another translation unit, while there are fewer than
+  // index.multiVersionMax versions. Otherwise the header is indexed once.
+  bool acceptVersion(const std::string &path, FileID fid) {
+    int max = g_config->index.multiVersionMax;
+    if (max <= 0)
+      return true;
+    auto it = uid2version.find(fid);
+    uint64_t version = it == uid2version.end() ? 0 : it->second;
+    std::lock_guard lock(versions_mutex);
+    auto &versions = header_versions[path];
+    auto own = std::find_if(versions.begin(), versions.end(),
+                            [&](auto &v) { return v.second == main; });
+    for (auto &v : versions)
+      if (v.first == version && v.second != main) {
+        if (own != versions.end())
+          versions.erase(own);
+        return false;
+      }
+    if (own != versions.end()) {
+      own->first = version;
+      return true;
+    }
+    if ((int)versions.size() >= max)
+      return false;
+    versions.emplace_back(version, main);
+    return true;
+  }
+
+  // Tracks macro_context for index.multiVersionMax.
+  void defineMacro(StringRef name, StringRef definition) {
+    uint64_t &hash = macro_hashes[name];
+    macro_context ^= hash;
+    hash = definition.size() ? llvm::xxHash64((name + " " + definition).str())
+                             : 0;
+    macro_context ^= hash;
+  }
 };
 
 StringRef getSourceInRange(const SourceManager &sm, const LangOptions &langOpts,
@@ -465,23 +628,29 @@ public:
   }
 
   Usr getUsr(const Decl *d, IndexParam::DeclInfo **info = nullptr) const {
-    d = d->getCanonicalDecl();
-    auto [it, inserted] = param.decl2Info.try_emplace(d);
-    if (inserted) {
-      SmallString<256> usr;
-      index::generateUSRForDecl(d, usr);
-      auto &info = it->second;
-      info.usr = hashUsr(usr);
-      if (auto *nd = dyn_cast<NamedDecl>(d)) {
-        info.short_name = nd->getNameAsString();
-        llvm::raw_string_ostream os(info.qualified);
-        nd->printQualifiedName(os, getDefaultPolicy());
-        simplifyAnonymous(info.qualified);
+    IndexParam::DeclInfo *ret = param.decl2Info.lookup(d);
+    if (!ret) {
+      const Decl *canon = d->getCanonicalDecl();
+      IndexParam::DeclInfo *&slot = param.decl2Info[canon];
+      if (!slot) {
+        slot = &param.decl_infos.emplace_back();
+        SmallString<256> usr;
+        index::generateUSRForDecl(canon, usr);
+        slot->usr = hashUsr(usr);
+        if (auto *nd = dyn_cast<NamedDecl>(canon)) {
+          slot->short_name = nd->getNameAsString();
+          llvm::raw_string_ostream os(slot->qualified);
+          nd->printQualifiedName(os, getDefaultPolicy());
+          simplifyAnonymous(slot->qualified);
+        }
       }
+      ret = slot;
+      if (canon != d)
+        param.decl2Info[d] = ret;
     }
     if (info)
-      *info = &it->second;
-    return it->second.usr;
+      *info = ret;
+    return ret->usr;
   }
 
   PrintingPolicy getDefaultPolicy() const {
@@ -637,8 +806,12 @@ public:
   }
 
   void addMacroUse(IndexFile *db, SourceManager &sm, Usr usr, Kind kind,
-                   SourceLocation sl) const {
+                   SourceLocation src_loc, SourceLocation sl) const {
     FileID fid = sm.getFileID(sl);
+    // The use at a macro argument duplicates the use at the expansion.
+    if (g_config->index.macroUses < 2 &&
+        (sm.isMacroArgExpansion(src_loc) || !param.inProject(fid)))
+      return;
     int lid = getFileLID(db, sm, fid);
     if (lid < 0)
       return;
@@ -693,6 +866,9 @@ public:
                             ArrayRef<index::SymbolRelation> relations,
                             SourceLocation src_loc,
                             ASTNodeInfo ast_node) override {
+    trace::Accumulate acc(param.consumer_us);
+    if (param.shouldAbort())
+      return false;
     if (!param.no_linkage) {
       if (auto *nd = dyn_cast<NamedDecl>(d); nd && nd->hasLinkage())
         ;
@@ -701,16 +877,18 @@ public:
     }
     SourceManager &sm = ctx->getSourceManager();
     const LangOptions &lang = ctx->getLangOpts();
-    FileID fid;
     SourceLocation spell = sm.getSpellingLoc(src_loc);
-    Range loc;
     auto r = sm.isMacroArgExpansion(src_loc)
                  ? CharSourceRange::getTokenRange(spell)
                  : sm.getExpansionRange(src_loc);
-    loc = fromCharSourceRange(sm, lang, r);
-    fid = sm.getFileID(r.getBegin());
+    FileID fid = sm.getFileID(r.getBegin());
     if (fid.isInvalid())
       return true;
+    if (!(roles & (uint32_t(index::SymbolRole::Declaration) |
+                   uint32_t(index::SymbolRole::RelationBaseOf))) &&
+        (param.declarations_only || (!g_config->index.systemReferences &&
+                                     sm.isInSystemHeader(r.getBegin()))))
+      return true;
     int lid = -1;
     IndexFile *db;
     if (g_config->index.multiVersion && param.useMultiVersion(fid)) {
@@ -725,6 +903,7 @@ public:
       if (!db)
         return true;
     }
+    Range loc = fromCharSourceRange(sm, lang, r);
 
     // spell, extent, comments use OrigD while most others use adjusted |D|.
     const Decl *origD = ast_node.OrigD;
@@ -777,6 +956,9 @@ public:
 
     IndexParam::DeclInfo *info;
     Usr usr = getUsr(d, &info);
+    if (db->partial && !is_def && !is_decl &&
+        !param.sampled.insert({db, usr}).second)
+      return true;
 
     auto do_def_decl = [&](auto *entity) {
       Use use{{loc, role}, lid};
@@ -794,7 +976,8 @@ public:
         entity->uses.push_back(use);
         return;
       }
-      if (entity->def.comments[0] == '\0' && g_config->index.comments)
+      if (entity->def.comments[0] == '\0' && g_config->index.comments &&
+          !g_config->index.lazyComments && !param.declarations_only)
         entity->def.comments = intern(getComment(origD));
     };
     switch (kind) {
@@ -816,7 +999,7 @@ public:
         role = Role(role | Role::Implicit);
       do_def_decl(func);
       if (spell != src_loc)
-        addMacroUse(db, sm, usr, Kind::Func, spell);
+        addMacroUse(db, sm, usr, Kind::Func, src_loc, spell);
       if (func->def.detailed_name[0] == '\0')
         setName(d, info->short_name, info->qualified, func->def);
       if (is_def || is_decl) {
@@ -835,7 +1018,7 @@ public:
       type->def.kind = ls_kind;
       do_def_decl(type);
       if (spell != src_loc)
-        addMacroUse(db, sm, usr, Kind::Type, spell);
+        addMacroUse(db, sm, usr, Kind::Type, src_loc, spell);
       if ((is_def || type->def.detailed_name[0] == '\0') &&
           info->short_name.size()) {
         if (d->getKind() == Decl::TemplateTypeParm)
@@ -855,7 +1038,7 @@ public:
       var->def.kind = ls_kind;
       do_def_decl(var);
       if (spell != src_loc)
-        addMacroUse(db, sm, usr, Kind::Var, spell);
+        addMacroUse(db, sm, usr, Kind::Var, src_loc, spell);
       if (var->def.detailed_name[0] == '\0')
         setVarName(d, info->short_name, info->qualified, var->def);
       QualType t;
@@ -1076,6 +1259,10 @@ class IndexPPCallbacks : public PPCallbacks {
   SourceManager &sm;
   IndexParam &param;
 
+  static bool trackMacros() {
+    return g_config->index.multiVersion && g_config->index.multiVersionMax > 0;
+  }
+
   std::pair<StringRef, Usr> getMacro(const Token &tok) const {
     StringRef name = tok.getIdentifierInfo()->getName();
     SmallString<256> usr("@macro@");
@@ -1088,8 +1275,12 @@ public:
       : sm(sm), param(param) {}
   void FileChanged(SourceLocation sl, FileChangeReason reason,
                    SrcMgr::CharacteristicKind, FileID) override {
-    if (reason == FileChangeReason::EnterFile)
-      (void)param.consumeFile(sm.getFileID(sl));
+    if (reason == FileChangeReason::EnterFile && !param.shouldAbort()) {
+      FileID fid = sm.getFileID(sl);
+      if (trackMacros())
+        param.uid2version.try_emplace(fid, param.macro_context);
+      (void)param.consumeFile(fid);
+    }
   }
   void InclusionDirective(SourceLocation hashLoc, const Token &tok,
                           StringRef included, bool isAngled,
@@ -1111,6 +1302,15 @@ public:
   void MacroDefined(const Token &tok, const MacroDirective *md) override {
     const LangOptions &lang = param.ctx->getLangOpts();
     SourceLocation sl = md->getLocation();
+    if (trackMacros()) {
+      const MacroInfo *mi = md->getMacroInfo();
+      // Non-empty even for an empty replacement list.
+      param.defineMacro(
+          tok.getIdentifierInfo()->getName(),
+          getSourceInRange(
+              sm, lang,
+              SourceRange(mi->getDefinitionLoc(), mi->getDefinitionEndLoc())));
+    }
     FileID fid = sm.getFileID(sl);
     if (IndexFile *db = param.consumeFile(fid)) {
       auto [name, usr] = getMacro(tok);
@@ -1135,12 +1335,25 @@ public:
       }
     }
   }
-  void MacroExpands(const Token &tok, const MacroDefinition &, SourceRange sr,
-                    const MacroArgs *) override {
+  void MacroExpands(const Token &tok, const MacroDefinition &md,
+                    SourceRange sr, const MacroArgs *) override {
     SourceLocation sl = sm.getSpellingLoc(sr.getBegin());
+    if (param.shouldAbort() || param.declarations_only ||
+        (!g_config->index.systemReferences && sm.isInSystemHeader(sl)))
+      return;
     FileID fid = sm.getFileID(sl);
     if (IndexFile *db = param.consumeFile(fid)) {
-      IndexVar &var = db->toVar(getMacro(tok).second);
+      Usr usr = getMacro(tok).second;
+      if (db->partial && !param.sampled.insert({db, usr}).second)
+        return;
+      IndexVar &var = db->toVar(usr);
+      // Only the first expansion in the file of a macro from outside the
+      // workspace folders, see index.macroUses.
+      if (g_config->index.macroUses < 2 && var.uses.size()) {
+        const MacroInfo *mi = md.getMacroInfo();
+        if (!mi || !param.inProject(sm.getFileID(mi->getDefinitionLoc())))
+          return;
+      }
       var.uses.push_back(
           {{fromTokenRange(sm, param.ctx->getLangOpts(), {sl, sl}, nullptr),
             Role::Dynamic}});
@@ -1148,6 +1361,8 @@ public:
   }
   void MacroUndefined(const Token &tok, const MacroDefinition &md,
                       const MacroDirective *ud) override {
+    if (trackMacros())
+      param.defineMacro(tok.getIdentifierInfo()->getName(), "");
     if (ud) {
       SourceLocation sl = ud->getLocation();
       MacroExpands(tok, md, {sl, sl}, nullptr);
@@ -1184,6 +1399,9 @@ public:
       SkipProcessed(IndexParam &param) : param(param) {}
       void Initialize(ASTContext &ctx) override { this->ctx = &ctx; }
       bool shouldSkipFunctionBody(Decl *d) override {
+        // Bodies only contain references and names of no linkage.
+        if (param.declarations_only || param.shouldAbort())
+          return true;
         const SourceManager &sm = ctx->getSourceManager();
         FileID fid = sm.getFileID(sm.getExpansionLoc(d->getLocation()));
         return !(g_config->index.multiVersion && param.useMultiVersion(fid)) &&
@@ -1204,6 +1422,107 @@ public:
   }
 };
 
+// The preamble of an open file from its last parse. Open files are re-indexed
+// on every save; if no header in the preamble would be indexed again, the
+// headers are loaded from the preamble instead of being parsed.
+struct IndexPreamble {
+  IndexPreamble(PrecompiledPreamble preamble) : preamble(std::move(preamble)) {}
+  PrecompiledPreamble preamble;
+  std::vector<std::string> args;
+  // Files entered in the preamble and their mtimes.
+  std::vector<std::pair<std::string, int64_t>> headers;
+};
+std::mutex preambles_mutex;
+LruCache<std::string, IndexPreamble> preambles;
+
+// The FileManager of the last translation unit indexed on this thread, with
+// the state it is valid for. See clang.reuseFileManager.
+struct ReusedFileManager {
+  IntrusiveRefCntPtr<FileManager> fm;
+  llvm::vfs::FileSystem *fs = nullptr;
+  std::string working_dir;
+  int64_t generation = -1;
+};
+thread_local ReusedFileManager reused_fm;
+
+class StoreHeaders : public PreambleCallbacks {
+  class Callbacks : public PPCallbacks {
+    const SourceManager &sm;
+    std::vector<std::pair<std::string, int64_t>> &headers;
+
+  public:
+    Callbacks(const SourceManager &sm,
+              std::vector<std::pair<std::string, int64_t>> &headers)
+        : sm(sm), headers(headers) {}
+    void FileChanged(SourceLocation sl, FileChangeReason reason,
+                     SrcMgr::CharacteristicKind, FileID) override {
+      FileID fid = sm.getFileID(sl);
+      if (reason != FileChangeReason::EnterFile || fid == sm.getMainFileID())
+        return;
+      if (const FileEntry *fe = sm.getFileEntryForID(fid)) {
+        std::string path = pathFromFileEntry(*fe);
+        int64_t mtime = fe->getModificationTime();
+        if (!mtime)
+          if (auto tim = lastWriteTime(path))
+            mtime = *tim;
+        headers.emplace_back(std::move(path), mtime);
+      }
+    }
+  };
+
+public:
+  void BeforeExecute(CompilerInstance &ci) override {
+    sm = &ci.getSourceManager();
+  }
+  std::unique_ptr<PPCallbacks> createPPCallbacks() override {
+    return std::make_unique<Callbacks>(*sm, headers);
+  }
+  SourceManager *sm = nullptr;
+  std::vector<std::pair<std::string, int64_t>> headers;
+};
+
+bool sameArgs(const std::vector<std::string> &l,
+              const std::vector<const char *> &r) {
+  if (l.size() != r.size())
+    return false;
+  for (size_t i = 0; i < l.size(); i++)
+    if (l[i] != r[i])
+      return false;
+  return true;
+}
+
+// Whether a full parse would consume none of the headers of |p|, i.e. all of
+// them have been indexed with at least |step| and have not changed since.
+bool headersIndexed(VFS &vfs, const IndexPreamble &p, int step) {
+  std::lock_guard lock(vfs.mutex);
+  for (auto &[path, mtime] : p.headers) {
+    auto it = vfs.state.find(path);
+    if (it == vfs.state.end() || it->second.timestamp < mtime ||
+        (it->second.timestamp == mtime && it->second.step < step))
+      return false;
+  }
+  return true;
+}
+
+// Bytes held by the AST, the preprocessor and the source buffers of |clang|
+// after parsing, an estimate of the memory needed to index the TU again.
+int64_t clangMemory(CompilerInstance &clang) {
+  int64_t n = 0;
+  if (clang.hasASTContext()) {
+    ASTContext &ctx = clang.getASTContext();
+    n += ctx.getASTAllocatedMemory() + ctx.getSideTableAllocatedMemory();
+  }
+  if (clang.hasPreprocessor())
+    n += clang.getPreprocessor().getTotalMemory();
+  if (clang.hasSourceManager()) {
+    SourceManager &sm = clang.getSourceManager();
+    SourceManager::MemoryBufferSizes sizes = sm.getMemoryBufferSizes();
+    n += sm.getContentCacheSize() + sm.getDataStructureSizes() +
+         sizes.malloc_bytes + sizes.mmap_bytes;
+  }
+  return n;
+}
+
 class IndexDiags : public DiagnosticConsumer {
 public:
   llvm::SmallString<64> message;
@@ -1216,8 +1535,20 @@ public:
 };
 } // namespace
 
+// USR hashes differ between hashUsr implementations, so their cache files
+// must not be mixed.
+#if CCLS_USR_XXHASH && LLVM_VERSION_MAJOR >= 17
+const int IndexFile::kMajorVersion = 2021; // XXH3
+#elif CCLS_USR_XXHASH
+const int IndexFile::kMajorVersion = 1021; // xxHash64
+#else
 const int IndexFile::kMajorVersion = 21;
-const int IndexFile::kMinorVersion = 0;
+#endif
+const int IndexFile::kMinorVersion = 7;
+// 1: column encoded reference arrays. 2: content_hash, dependency_hashes.
+// 3: memory. 4: declarations_only. 5: Range ends relative to starts. 6: cost.
+// 7: partial.
+const int IndexFile::kOldestMinorVersion = 0;
 
 IndexFile::IndexFile(const std::string &path, const std::string &contents,
                      bool no_linkage)
@@ -1248,19 +1579,48 @@ std::string IndexFile::toString() {
   return ccls::serialize(SerializeFormat::Json, *this);
 }
 
+// Keys consistent with operator== of the element types.
+Usr uniquifyKey(Usr usr) { return usr; }
+std::pair<Range, int> uniquifyKey(const Use &use) {
+  return {use.range, use.file_id};
+}
+
+// Remove duplicates, keeping the first occurrence of each element. This is
+// called for every entity of every IndexFile, so sort a per-thread index
+// buffer instead of allocating a hash set node per element.
 template <typename T> void uniquify(std::vector<T> &a) {
-  std::unordered_set<T> seen;
-  size_t n = 0;
-  for (size_t i = 0; i < a.size(); i++)
-    if (seen.insert(a[i]).second)
-      a[n++] = a[i];
-  a.resize(n);
+  size_t n = a.size();
+  if (n <= 1)
+    return;
+  static thread_local std::vector<uint32_t> order;
+  static thread_local std::vector<uint8_t> keep;
+  order.resize(n);
+  for (size_t i = 0; i < n; i++)
+    order[i] = i;
+  std::sort(order.begin(), order.end(), [&](uint32_t l, uint32_t r) {
+    auto kl = uniquifyKey(a[l]), kr = uniquifyKey(a[r]);
+    return kl < kr || (kl == kr && l < r);
+  });
+  keep.assign(n, 0);
+  keep[order[0]] = 1;
+  for (size_t i = 1; i < n; i++)
+    if (!(uniquifyKey(a[order[i]]) == uniquifyKey(a[order[i - 1]])))
+      keep[order[i]] = 1;
+  size_t m = 0;
+  for (size_t i = 0; i < n; i++)
+    if (keep[i])
+      a[m++] = a[i];
+  a.resize(m);
 }
 
 namespace idx {
 void init() {
   multiVersionMatcher = new GroupMatch(g_config->index.multiVersionWhitelist,
                                        g_config->index.multiVersionBlacklist);
+  largeFileMatcher = new GroupMatch({}, g_config->index.largeFiles);
+  std::lock_guard lock(preambles_mutex);
+  preambles.clear();
+  preambles.setCapacity(g_config->index.preambleCache);
 }
 
 IndexResult
@@ -1268,11 +1628,10 @@ index(SemaManager *manager, WorkingFiles *wfiles, VFS *vfs,
       const std::string &opt_wdir, const std::string &main,
       const std::vector<const char *> &args,
       const std::vector<std::pair<std::string, std::string>> &remapped,
-      bool no_linkage, bool &ok) {
+      bool no_linkage, bool declarations_only, bool &ok) {
   ok = true;
-  auto pch = std::make_shared<PCHContainerOperations>();
-  llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs =
-      llvm::vfs::getRealFileSystem();
+  static auto pch = std::make_shared<PCHContainerOperations>();
+  llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs = getFileSystem();
   std::shared_ptr<CompilerInvocation> ci =
       buildCompilerInvocation(main, args, fs);
   // e.g. .s
@@ -1286,11 +1645,49 @@ index(SemaManager *manager, WorkingFiles *wfiles, VFS *vfs,
   ci->getLangOpts()->RetainCommentsFromSystemHeaders = true;
   std::string buf = wfiles->getContent(main);
   std::vector<std::unique_ptr<llvm::MemoryBuffer>> bufs;
-  if (buf.size())
-    for (auto &[filename, content] : remapped) {
-      bufs.push_back(llvm::MemoryBuffer::getMemBuffer(content));
-      ci->getPreprocessorOpts().addRemappedFile(filename, bufs.back().get());
+  // |remapped| may have a header without the main file, which is not open.
+  for (auto &[filename, content] : remapped) {
+    bufs.push_back(llvm::MemoryBuffer::getMemBuffer(content));
+    ci->getPreprocessorOpts().addRemappedFile(filename, bufs.back().get());
+  }
+
+  std::unique_ptr<llvm::MemoryBuffer> main_buf;
+  std::shared_ptr<IndexPreamble> preamble;
+  std::shared_ptr<CompilerInvocation> preamble_ci;
+  // Headers of a multi-version file may be indexed again in every TU.
+  if (g_config->index.preambleCache > 0 && !g_config->index.multiVersion &&
+      wfiles->getFile(main)) {
+    auto it = std::find_if(remapped.begin(), remapped.end(),
+                           [&](auto &x) { return x.first == main; });
+    if (buf.size() && it != remapped.end()) {
+      main_buf = llvm::MemoryBuffer::getMemBufferCopy(it->second, main);
+    } else if (auto file = fs->getBufferForFile(main)) {
+      main_buf = std::move(*file);
+      // Parse the bytes that the bounds are computed from.
+      ci->getPreprocessorOpts().addRemappedFile(main, main_buf.get());
     }
+  }
+  PreambleBounds bounds(0, false);
+  if (main_buf) {
+    bounds = ComputePreambleBounds(*ci->getLangOpts(), main_buf.get(), 0);
+    {
+      std::lock_guard lock(preambles_mutex);
+      preamble = preambles.get(main);
+    }
+    if (preamble && !(sameArgs(preamble->args, args) &&
+                      preamble->preamble.CanReuse(*ci, main_buf.get(), bounds,
+                                                  fs.get()) &&
+                      headersIndexed(*vfs, *preamble, no_linkage ? 3 : 1)))
+      preamble.reset();
+    if (preamble) {
+      preamble->preamble.OverridePreamble(*ci, fs, main_buf.get());
+    } else {
+      // Build a preamble for the next parse after this one has indexed the
+      // headers.
+      preamble_ci = std::make_shared<CompilerInvocation>(*ci);
+      preamble_ci->getPreprocessorOpts().RetainRemappedFileBuffers = true;
+    }
+  }
 
   IndexDiags dc;
   auto clang = std::make_unique<CompilerInstance>(pch);
@@ -1302,16 +1699,43 @@ index(SemaManager *manager, WorkingFiles *wfiles, VFS *vfs,
   if (!clang->hasTarget())
     return {};
   clang->getPreprocessorOpts().RetainRemappedFileBuffers = true;
+  // Remapped buffers may add virtual files to the FileManager, so only plain
+  // parses of files on disk share it.
+  auto &ppOpts = clang->getPreprocessorOpts();
+  if (g_config->clang.reuseFileManager && !preamble &&
+      ppOpts.RemappedFiles.empty() && ppOpts.RemappedFileBuffers.empty()) {
+    const std::string &working_dir = clang->getFileSystemOpts().WorkingDir;
+    int64_t generation = fileSystemGeneration();
+    if (!reused_fm.fm || reused_fm.fs != fs.get() ||
+        reused_fm.working_dir != working_dir ||
+        reused_fm.generation != generation) {
+      reused_fm.fm = new FileManager(clang->getFileSystemOpts(), fs);
+      reused_fm.fs = fs.get();
+      reused_fm.working_dir = working_dir;
+      reused_fm.generation = generation;
+    }
+#if LLVM_VERSION_MAJOR < 9
+    clang->setVirtualFileSystem(fs);
+#endif
+    clang->setFileManager(reused_fm.fm.get());
+  } else {
 #if LLVM_VERSION_MAJOR >= 9 // rC357037
-  clang->createFileManager(fs);
+    clang->createFileManager(fs);
 #else
-  clang->setVirtualFileSystem(fs);
-  clang->createFileManager();
+    clang->setVirtualFileSystem(fs);
+    clang->createFileManager();
 #endif
+  }
   clang->setSourceManager(new SourceManager(clang->getDiagnostics(),
                                             clang->getFileManager(), true));
 
-  IndexParam param(*vfs, no_linkage);
+  IndexParam param(*vfs, no_linkage, declarations_only);
+  param.main = main;
+  param.diags = &clang->getDiagnostics();
+  if (g_config->index.timeout > 0)
+    param.deadline = std::chrono::steady_clock::now() +
+                     std::chrono::seconds(g_config->index.timeout);
+  param.memory_limit = int64_t(g_config->index.memoryLimit) << 20;
 
   index::IndexingOptions indexOpts;
   indexOpts.SystemSymbolFilter =
@@ -1326,6 +1750,21 @@ index(SemaManager *manager, WorkingFiles *wfiles, VFS *vfs,
     indexOpts.IndexTemplateParameters = true;
 #endif
   }
+#if LLVM_VERSION_MAJOR >= 12
+  // Don't traverse declarations in files that are not consumed, e.g. headers
+  // indexed by another TU. Namespaces and linkage specifications may contain
+  // #include, so their children are checked one by one.
+  indexOpts.ShouldTraverseDecl = [&param](const Decl *d) {
+    if (isa<NamespaceDecl>(d) || isa<LinkageSpecDecl>(d))
+      return true;
+    const SourceManager &sm = d->getASTContext().getSourceManager();
+    FileID fid = sm.getFileID(sm.getExpansionLoc(d->getLocation()));
+    if (fid.isInvalid() ||
+        (g_config->index.multiVersion && param.useMultiVersion(fid)))
+      return true;
+    return param.consumeFile(fid) != nullptr;
+  };
+#endif
 
 #if LLVM_VERSION_MAJOR >= 10 // rC370337
   auto action = std::make_unique<IndexFrontendAction>(
@@ -1338,7 +1777,11 @@ index(SemaManager *manager, WorkingFiles *wfiles, VFS *vfs,
 #endif
 
   std::string reason;
+  int64_t memory = 0;
+  IndexCost cost;
   {
+    trace::Span span("index.parse");
+    auto start = std::chrono::steady_clock::now();
     llvm::CrashRecoveryContext crc;
     auto parse = [&]() {
       if (!action->BeginSourceFile(*clang, clang->getFrontendOpts().Inputs[0]))
@@ -1352,6 +1795,7 @@ index(SemaManager *manager, WorkingFiles *wfiles, VFS *vfs,
       if (!action->Execute())
         return;
 #endif
+      memory = clangMemory(*clang);
       action->EndSourceFile();
       ok = true;
     };
@@ -1359,6 +1803,20 @@ index(SemaManager *manager, WorkingFiles *wfiles, VFS *vfs,
       LOG_S(ERROR) << "clang crashed for " << main;
       return {};
     }
+    // IndexDataConsumer runs interleaved with parsing.
+    span.setArg("consumer_us", param.consumer_us);
+    cost.parse_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    cost.consumer_us = param.consumer_us;
+  }
+  if (param.aborted) {
+    // The index is incomplete and must not be cached.
+    LOG_S(WARNING) << "abandoned indexing " << main << ": " << param.aborted;
+    ok = false;
+    IndexResult result;
+    result.aborted = param.aborted;
+    return result;
   }
   if (!ok) {
     LOG_S(ERROR) << "failed to index " << main
@@ -1366,10 +1824,33 @@ index(SemaManager *manager, WorkingFiles *wfiles, VFS *vfs,
     return {};
   }
 
+  if (preamble_ci) {
+    trace::Span span("index.preamble");
+    IgnoringDiagConsumer ignore;
+    IntrusiveRefCntPtr<DiagnosticsEngine> de =
+        CompilerInstance::createDiagnostics(&preamble_ci->getDiagnosticOpts(),
+                                            &ignore, false);
+    StoreHeaders sh;
+    if (auto p = PrecompiledPreamble::Build(
+            *preamble_ci, main_buf.get(), bounds, *de, fs, pch,
+            g_config->session.preambleInMemory, sh)) {
+      auto entry = std::make_shared<IndexPreamble>(std::move(*p));
+      entry->args.assign(args.begin(), args.end());
+      entry->headers = std::move(sh.headers);
+      std::lock_guard lock(preambles_mutex);
+      preambles.insert(main, std::move(entry));
+    }
+  }
+
+  trace::Span span("index.finalize");
   IndexResult result;
+  result.memory = memory;
   result.n_errs = (int)dc.getNumErrors();
   // clang 7 does not implement operator std::string.
   result.first_error = std::string(dc.message.data(), dc.message.size());
+  for (auto &it : param.uid2file)
+    if (it.second.db && it.second.db->path != main)
+      cost.headers++;
   for (auto &it : param.uid2file) {
     if (!it.second.db)
       continue;
@@ -1400,12 +1881,26 @@ index(SemaManager *manager, WorkingFiles *wfiles, VFS *vfs,
       const std::string &path = file.path;
       if (path.empty())
         continue;
-      if (path == entry->path)
+      if (path == entry->path) {
         entry->mtime = file.mtime;
-      else if (path != entry->import_file)
-        entry->dependencies[llvm::CachedHashStringRef(intern(path))] =
-            file.mtime;
+        entry->content_hash = file.hash;
+        if (path == main) {
+          entry->memory = memory;
+          entry->cost = cost;
+        }
+      } else if (path != entry->import_file) {
+        llvm::CachedHashStringRef key(intern(path));
+        entry->dependencies[key] = file.mtime;
+        if (file.hash)
+          entry->dependency_hashes[key] = file.hash;
+      }
     }
+    // Headers loaded from the preamble have not been seen.
+    if (preamble)
+      for (auto &[path, mtime] : preamble->headers)
+        if (path != entry->path)
+          entry->dependencies.try_emplace(
+              llvm::CachedHashStringRef(intern(path)), mtime);
     result.indexes.push_back(std::move(entry));
   }
 
@@ -1413,26 +1908,24 @@ index(SemaManager *manager, WorkingFiles *wfiles, VFS *vfs,
 }
 } // namespace idx
 
-void reflect(JsonReader &vis, SymbolRef &v) {
-  std::string t = vis.getString();
-  char *s = const_cast<char *>(t.c_str());
+namespace {
+void parse(const char *t, SymbolRef &v) {
+  char *s = const_cast<char *>(t);
   v.range = Range::fromString(s);
   s = strchr(s, '|');
   v.usr = strtoull(s + 1, &s, 10);
   v.kind = static_cast<Kind>(strtol(s + 1, &s, 10));
   v.role = static_cast<Role>(strtol(s + 1, &s, 10));
 }
-void reflect(JsonReader &vis, Use &v) {
-  std::string t = vis.getString();
-  char *s = const_cast<char *>(t.c_str());
+void parse(const char *t, Use &v) {
+  char *s = const_cast<char *>(t);
   v.range = Range::fromString(s);
   s = strchr(s, '|');
   v.role = static_cast<Role>(strtol(s + 1, &s, 10));
   v.file_id = static_cast<int>(strtol(s + 1, &s, 10));
 }
-void reflect(JsonReader &vis, DeclRef &v) {
-  std::string t = vis.getString();
-  char *s = const_cast<char *>(t.c_str());
+void parse(const char *t, DeclRef &v) {
+  char *s = const_cast<char *>(t);
   v.range = Range::fromString(s);
   s = strchr(s, '|') + 1;
   v.extent = Range::fromString(s);
@@ -1440,6 +1933,23 @@ void reflect(JsonReader &vis, DeclRef &v) {
   v.role = static_cast<Role>(strtol(s + 1, &s, 10));
   v.file_id = static_cast<int>(strtol(s + 1, &s, 10));
 }
+} // namespace
+
+void reflect(JsonReader &vis, SymbolRef &v) {
+  parse(vis.getString().c_str(), v);
+}
+void reflect(JsonReader &vis, Use &v) { parse(vis.getString().c_str(), v); }
+void reflect(JsonReader &vis, DeclRef &v) {
+  parse(vis.getString().c_str(), v);
+}
+// Strings of JsonSaxReader are null terminated.
+void reflect(JsonSaxReader &vis, SymbolRef &v) {
+  parse(vis.getString().data(), v);
+}
+void reflect(JsonSaxReader &vis, Use &v) { parse(vis.getString().data(), v); }
+void reflect(JsonSaxReader &vis, DeclRef &v) {
+  parse(vis.getString().data(), v);
+}
 
 void reflect(JsonWriter &vis, SymbolRef &v) {
   char buf[99];
@@ -1494,4 +2004,114 @@ void reflect(BinaryWriter &vis, DeclRef &v) {
   reflect(vis, static_cast<Use &>(v));
   reflect(vis, v.extent);
 }
+
+// Arrays of references are stored column by column: all start lines, then all
+// start columns, etc. Start lines are deltas from the previous element and
+// ends are relative to starts, so most values fit in one byte and each column
+// is decoded by a tight loop.
+namespace {
+template <typename T, typename Get>
+void writeRanges(BinaryWriter &vis, std::vector<T> &v, Get get) {
+  int prev = 0;
+  for (T &x : v) {
+    vis.varInt(get(x).start.line - prev);
+    prev = get(x).start.line;
+  }
+  for (T &x : v)
+    vis.varInt(get(x).start.column);
+  for (T &x : v)
+    vis.varInt(get(x).end.line - get(x).start.line);
+  for (T &x : v)
+    vis.varInt(get(x).end.column - get(x).start.column);
+}
+
+template <typename T, typename Get>
+void readRanges(BinaryReader &vis, T *v, size_t n, Get get) {
+  int prev = 0;
+  for (size_t i = 0; i < n; i++)
+    get(v[i]).start.line = uint16_t(prev += int(vis.varInt()));
+  for (size_t i = 0; i < n; i++)
+    get(v[i]).start.column = int16_t(vis.varInt());
+  for (size_t i = 0; i < n; i++)
+    get(v[i]).end.line = uint16_t(get(v[i]).start.line + vis.varInt());
+  for (size_t i = 0; i < n; i++)
+    get(v[i]).end.column = int16_t(get(v[i]).start.column + vis.varInt());
+}
+
+template <typename T> T *grow(std::vector<T> &v, size_t n) {
+  size_t i = v.size();
+  v.resize(i + n);
+  return v.data() + i;
+}
+
+template <typename T> void readUses(BinaryReader &vis, T *v, size_t n) {
+  readRanges(vis, v, n, [](T &x) -> Range & { return x.range; });
+  for (size_t i = 0; i < n; i++)
+    v[i].role = Role(vis.varUInt());
+  for (size_t i = 0; i < n; i++)
+    v[i].file_id = int(vis.varInt());
+}
+
+template <typename T> void writeUses(BinaryWriter &vis, std::vector<T> &v) {
+  vis.varUInt(v.size());
+  writeRanges(vis, v, [](T &x) -> Range & { return x.range; });
+  for (T &x : v)
+    vis.varUInt(uint16_t(x.role));
+  for (T &x : v)
+    vis.varInt(x.file_id);
+}
+
+// Before minor version 1, arrays were stored element by element.
+template <typename T> bool readElements(BinaryReader &vis, std::vector<T> &v) {
+  if (vis.minor >= 1)
+    return false;
+  for (auto n = vis.varUInt(); n; n--)
+    reflect(vis, v.emplace_back());
+  return true;
+}
+} // namespace
+
+void reflect(BinaryReader &vis, std::vector<SymbolRef> &v) {
+  if (readElements(vis, v))
+    return;
+  size_t n = vis.varUInt();
+  SymbolRef *p = grow(v, n);
+  readRanges(vis, p, n, [](SymbolRef &x) -> Range & { return x.range; });
+  for (size_t i = 0; i < n; i++)
+    p[i].usr = vis.get<Usr>();
+  for (size_t i = 0; i < n; i++)
+    p[i].kind = Kind(vis.get<uint8_t>());
+  for (size_t i = 0; i < n; i++)
+    p[i].role = Role(vis.varUInt());
+}
+void reflect(BinaryReader &vis, std::vector<Use> &v) {
+  if (readElements(vis, v))
+    return;
+  size_t n = vis.varUInt();
+  readUses(vis, grow(v, n), n);
+}
+void reflect(BinaryReader &vis, std::vector<DeclRef> &v) {
+  if (readElements(vis, v))
+    return;
+  size_t n = vis.varUInt();
+  DeclRef *p = grow(v, n);
+  readUses(vis, p, n);
+  readRanges(vis, p, n, [](DeclRef &x) -> Range & { return x.extent; });
+}
+
+void reflect(BinaryWriter &vis, std::vector<SymbolRef> &v) {
+  vis.varUInt(v.size());
+  writeRanges(vis, v, [](SymbolRef &x) -> Range & { return x.range; });
+  for (SymbolRef &x : v)
+    vis.pack(x.usr);
+  for (SymbolRef &x : v)
+    vis.pack(uint8_t(x.kind));
+  for (SymbolRef &x : v)
+    vis.varUInt(uint16_t(x.role));
+}
+void reflect(BinaryWriter &vis, std::vector<Use> &v) { writeUses(vis, v); }
+void reflect(BinaryWriter &vis, std::vector<DeclRef> &v) {
+  writeUses(vis, v);
+  writeRanges(vis, v, [](DeclRef &x) -> Range & { return x.extent; });
+}
 } // namespace ccls
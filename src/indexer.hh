@@ -117,6 +117,9 @@ struct DeclRef : Use {
 void reflect(JsonReader &visitor, SymbolRef &value);
 void reflect(JsonReader &visitor, Use &value);
 void reflect(JsonReader &visitor, DeclRef &value);
+void reflect(JsonSaxReader &visitor, SymbolRef &value);
+void reflect(JsonSaxReader &visitor, Use &value);
+void reflect(JsonSaxReader &visitor, DeclRef &value);
 void reflect(JsonWriter &visitor, SymbolRef &value);
 void reflect(JsonWriter &visitor, Use &value);
 void reflect(JsonWriter &visitor, DeclRef &value);
@@ -126,6 +129,13 @@ void reflect(BinaryReader &visitor, DeclRef &value);
 void reflect(BinaryWriter &visitor, SymbolRef &value);
 void reflect(BinaryWriter &visitor, Use &value);
 void reflect(BinaryWriter &visitor, DeclRef &value);
+// Column encodings for arrays of the above.
+void reflect(BinaryReader &visitor, std::vector<SymbolRef> &value);
+void reflect(BinaryReader &visitor, std::vector<Use> &value);
+void reflect(BinaryReader &visitor, std::vector<DeclRef> &value);
+void reflect(BinaryWriter &visitor, std::vector<SymbolRef> &value);
+void reflect(BinaryWriter &visitor, std::vector<Use> &value);
+void reflect(BinaryWriter &visitor, std::vector<DeclRef> &value);
 
 template <typename T> using VectorAdapter = std::vector<T, std::allocator<T>>;
 
@@ -265,6 +275,17 @@ struct IndexVar {
   std::vector<Use> uses;
 };
 
+// What it took to index a translation unit, stored in the cache of its main
+// file and reported by $ccls/indexReport.
+struct IndexCost {
+  // Microseconds of idx::index, of the clang parse, and of IndexDataConsumer
+  // during the parse.
+  int64_t wall_us = 0, parse_us = 0, consumer_us = 0;
+  // Headers indexed with the translation unit.
+  int headers = 0;
+};
+REFLECT_STRUCT(IndexCost, wall_us, parse_us, consumer_us, headers);
+
 struct IndexInclude {
   // Line that has the include directive. We don't have complete range
   // information - a line is good enough for clicking.
@@ -278,16 +299,37 @@ struct IndexFile {
   static const int kMajorVersion;
   // For MessagePack cache files.
   // JSON has good forward compatibility because field addition/deletion do not
-  // harm but currently no efforts have been made to make old MessagePack cache
-  // files accepted by newer ccls.
+  // harm. Binary cache files of minor versions since kOldestMinorVersion are
+  // read by checking BinaryReader::minor and rewritten in the current layout
+  // when loaded.
   static const int kMinorVersion;
+  static const int kOldestMinorVersion;
 
   std::string path;
   std::vector<const char *> args;
   // This is unfortunately time_t as used by clang::FileEntry
   int64_t mtime = 0;
+  // xxHash64 of the file contents at the time of index, or 0 if neither
+  // cache.contentHash nor cache.sharedDirectory is set.
+  uint64_t content_hash = 0;
+  // For a translation unit, the estimated bytes used by clang to index it,
+  // used by index.memoryBudget. 0 for headers.
+  int64_t memory = 0;
+  // For a translation unit, see IndexCost. Zero for headers.
+  IndexCost cost;
   LanguageId language = LanguageId::C;
   bool no_linkage;
+  // Only declarations and definitions were recorded, by the first pass of
+  // index.initialDeclarationsOnly. The cache is not considered up to date.
+  bool declarations_only = false;
+  // Only the first reference to each symbol was recorded. See
+  // index.largeFileSize.
+  bool partial = false;
+  // Not serialized. Set by deserialize if the binary cache file has an older
+  // minor version.
+  bool migrated = false;
+  // Not serialized. Bytes of the cache file it was read from.
+  int64_t blob_size = 0;
 
   // uid2lid_and_path is used to generate lid2path, but not serialized.
   std::unordered_map<clang::FileID, std::pair<int, std::string>>
@@ -305,6 +347,9 @@ struct IndexFile {
 
   std::vector<IndexInclude> includes;
   llvm::DenseMap<llvm::CachedHashStringRef, int64_t> dependencies;
+  // Content hashes of the dependencies seen by the indexer (preamble headers
+  // have none), used to keep the cache when only mtimes have changed.
+  llvm::DenseMap<llvm::CachedHashStringRef, uint64_t> dependency_hashes;
   std::unordered_map<Usr, IndexFunc> usr2func;
   std::unordered_map<Usr, IndexType> usr2type;
   std::unordered_map<Usr, IndexVar> usr2var;
@@ -324,8 +369,13 @@ struct IndexFile {
 
 struct IndexResult {
   std::vector<std::unique_ptr<IndexFile>> indexes;
+  // Estimated bytes used by clang for the translation unit.
+  int64_t memory = 0;
   int n_errs = 0;
   std::string first_error;
+  // If not empty, why indexing was abandoned because of index.timeout or
+  // index.memoryLimit.
+  std::string aborted;
 };
 
 struct SemaManager;
@@ -339,11 +389,30 @@ index(SemaManager *complete, WorkingFiles *wfiles, VFS *vfs,
       const std::string &opt_wdir, const std::string &file,
       const std::vector<const char *> &args,
       const std::vector<std::pair<std::string, std::string>> &remapped,
-      bool all_linkages, bool &ok);
+      bool all_linkages, bool declarations_only, bool &ok);
 } // namespace idx
 } // namespace ccls
 
-MAKE_HASHABLE(ccls::SymbolRef, t.range, t.usr, t.kind, t.role);
-MAKE_HASHABLE(ccls::ExtentRef, t.range, t.usr, t.kind, t.role, t.extent);
+namespace ccls {
+// Hashes packed 64-bit words, cheaper than hash_combine of each field.
+inline uint64_t hashMix(uint64_t h, uint64_t x) {
+  h = (h ^ x) * 0x9e3779b97f4a7c15;
+  return h ^ h >> 32;
+}
+} // namespace ccls
+
+namespace std {
+template <> struct hash<ccls::SymbolRef> {
+  std::size_t operator()(const ccls::SymbolRef &t) const {
+    return ccls::hashMix(ccls::hashMix(t.usr, t.range.key()),
+                         uint64_t(t.kind) << 16 | uint64_t(t.role));
+  }
+};
+template <> struct hash<ccls::ExtentRef> {
+  std::size_t operator()(const ccls::ExtentRef &t) const {
+    return ccls::hashMix(hash<ccls::SymbolRef>()(t), t.extent.key());
+  }
+};
+} // namespace std
 MAKE_HASHABLE(ccls::Use, t.range, t.file_id)
 MAKE_HASHABLE(ccls::DeclRef, t.range, t.file_id)
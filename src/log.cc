@@ -4,64 +4,195 @@
 #include "log.hh"
 
 #include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/Twine.h>
 #include <llvm/Support/Threading.h>
 
-#include <iomanip>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <stdlib.h>
 #include <string.h>
+#include <thread>
 #include <time.h>
+#include <vector>
 
 namespace ccls::log {
 static std::mutex mtx;
 FILE *file;
+Format format;
 Verbosity verbosity;
 
-Message::Message(Verbosity verbosity, const char *file, int line)
-    : verbosity_(verbosity) {
-  using namespace llvm;
-  time_t tim = time(NULL);
-  struct tm t;
-  {
-    std::lock_guard<std::mutex> lock(mtx);
-    t = *localtime(&tim);
+namespace {
+std::atomic<bool> async;
+std::condition_variable cv;
+
+struct Buffer {
+  std::mutex mutex;
+  std::string data;
+};
+// Guarded by mtx, which also serializes writes to |file|.
+std::vector<std::shared_ptr<Buffer>> buffers;
+
+// Buffered bytes that wake up the writer before its period.
+constexpr size_t kFlushSize = 64 << 10;
+
+Buffer &threadBuffer() {
+  thread_local std::shared_ptr<Buffer> buf = [] {
+    auto buf = std::make_shared<Buffer>();
+    std::lock_guard lock(mtx);
+    buffers.push_back(buf);
+    return buf;
+  }();
+  return *buf;
+}
+
+// Requires mtx.
+void drainLocked() {
+  std::string data;
+  for (size_t i = 0; i < buffers.size();) {
+    data.clear();
+    {
+      std::lock_guard lock(buffers[i]->mutex);
+      data.swap(buffers[i]->data);
+    }
+    fwrite(data.data(), data.size(), 1, file);
+    // Drop buffers of exited threads.
+    if (buffers[i].use_count() == 1 && data.empty()) {
+      buffers[i] = std::move(buffers.back());
+      buffers.pop_back();
+    } else {
+      i++;
+    }
   }
-  char buf[16];
-  snprintf(buf, sizeof buf, "%02d:%02d:%02d ", t.tm_hour, t.tm_min, t.tm_sec);
-  stream_ << buf;
-  {
-    SmallString<32> name;
-    get_thread_name(name);
-    stream_ << std::left << std::setw(13) << name.c_str();
+  fflush(file);
+}
+
+void writer() {
+  llvm::set_thread_name("log");
+  std::unique_lock lock(mtx);
+  while (true) {
+    cv.wait_for(lock, std::chrono::milliseconds(100));
+    if (!async)
+      break;
+    if (file)
+      drainLocked();
   }
-  {
-    const char *p = strrchr(file, '/');
-    if (p)
-      file = p + 1;
-    stream_ << std::right << std::setw(15) << file << ':' << std::left
-            << std::setw(3) << line;
+}
+
+// Formats the time of day, once per second and thread.
+const char *timeOfDay() {
+  thread_local time_t last = -1;
+  thread_local char buf[16];
+  time_t tim = time(NULL);
+  if (tim != last) {
+    last = tim;
+    struct tm t;
+#ifdef _WIN32
+    localtime_s(&t, &tim);
+#else
+    localtime_r(&tim, &t);
+#endif
+    snprintf(buf, sizeof buf, "%02d:%02d:%02d", t.tm_hour, t.tm_min,
+             t.tm_sec);
   }
-  stream_ << ' ';
-  // clang-format off
-  switch (verbosity_) {
-    case Verbosity_FATAL: stream_ << 'F'; break;
-    case Verbosity_ERROR: stream_ << 'E'; break;
-    case Verbosity_WARNING: stream_ << 'W'; break;
-    case Verbosity_INFO: stream_ << 'I'; break;
-    default: stream_ << "V(" << int(verbosity_) << ')';
+  return buf;
+}
+
+void appendJsonString(std::string &out, const char *s, size_t n) {
+  out += '"';
+  for (size_t i = 0; i < n; i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof buf, "\\u%04x", c);
+      out += buf;
+    } else {
+      out += c;
+    }
   }
-  // clang-format on
-  stream_ << ' ';
+  out += '"';
+}
+} // namespace
+
+Message::Message(Verbosity verbosity, const char *file, int line)
+    : verbosity_(verbosity), file_(file), line_(line) {
+  if (const char *p = strrchr(file_, '/'))
+    file_ = p + 1;
 }
 
 Message::~Message() {
   if (!file)
     return;
-  std::lock_guard<std::mutex> lock(mtx);
-  stream_ << '\n';
-  fputs(stream_.str().c_str(), file);
+  llvm::SmallString<32> name;
+  llvm::get_thread_name(name);
+  char level[16];
+  // clang-format off
+  switch (verbosity_) {
+    case Verbosity_FATAL: strcpy(level, "F"); break;
+    case Verbosity_ERROR: strcpy(level, "E"); break;
+    case Verbosity_WARNING: strcpy(level, "W"); break;
+    case Verbosity_INFO: strcpy(level, "I"); break;
+    default: snprintf(level, sizeof level, "V(%d)", verbosity_);
+  }
+  // clang-format on
+
+  std::string message = stream_.str(), line;
+  if (format == Format::Json) {
+    line = "{\"time\":\"";
+    line += timeOfDay();
+    line += "\",\"thread\":";
+    appendJsonString(line, name.data(), name.size());
+    line += ",\"file\":";
+    appendJsonString(line, file_, strlen(file_));
+    line += ",\"line\":" + std::to_string(line_) + ",\"level\":\"";
+    line += level;
+    line += "\",\"message\":";
+    appendJsonString(line, message.data(), message.size());
+    line += "}\n";
+  } else {
+    char buf[128];
+    snprintf(buf, sizeof buf, "%s %-13s%15s:%-3d %s ", timeOfDay(),
+             name.c_str(), file_, line_, level);
+    line = buf;
+    line += message;
+    line += '\n';
+  }
+
+  if (async.load(std::memory_order_relaxed) && verbosity_ != Verbosity_FATAL) {
+    Buffer &buf = threadBuffer();
+    size_t size;
+    {
+      std::lock_guard lock(buf.mutex);
+      buf.data += line;
+      size = buf.data.size();
+    }
+    if (size >= kFlushSize)
+      cv.notify_one();
+    return;
+  }
+  std::lock_guard lock(mtx);
+  // Keep the order with buffered messages.
+  if (async)
+    drainLocked();
+  fputs(line.c_str(), file);
   fflush(file);
   if (verbosity_ == Verbosity_FATAL)
     abort();
 }
+
+void startAsync() {
+  if (!async.exchange(true))
+    std::thread(writer).detach();
+}
+
+void stopAsync() {
+  std::lock_guard lock(mtx);
+  if (async.exchange(false) && file)
+    drainLocked();
+}
 } // namespace ccls::log
@@ -9,6 +9,11 @@
 namespace ccls::log {
 extern FILE *file;
 
+enum class Format { Text, Json };
+// Json writes one object per line with time, thread, file, line, level and
+// message.
+extern Format format;
+
 struct Voidify {
   void operator&(const std::ostream &) {}
 };
@@ -24,10 +29,18 @@ extern Verbosity verbosity;
 struct Message {
   std::stringstream stream_;
   int verbosity_;
+  const char *file_;
+  int line_;
 
   Message(Verbosity verbosity, const char *file, int line);
   ~Message();
 };
+
+// Makes messages go to a per-thread buffer, written to |file| by a background
+// thread. FATAL messages are written synchronously.
+void startAsync();
+// Writes buffered messages and makes later ones synchronous. Called at exit.
+void stopAsync();
 } // namespace ccls::log
 
 #define LOG_IF(v, cond)                                                        \
@@ -8,9 +8,87 @@
 #include <rapidjson/document.h>
 
 #include <algorithm>
+#include <mutex>
 #include <stdio.h>
+#include <vector>
 
 namespace ccls {
+namespace {
+// Most messages fit. Larger ones, e.g. didOpen of a big file, are allocated
+// and freed as before.
+constexpr size_t kPooledMessageSize = 8192;
+// Bounds the memory kept by each free list.
+constexpr size_t kMaxPooled = 256;
+
+std::mutex pool_mtx;
+std::vector<char *> free_messages;
+std::vector<PooledDocument *> free_documents;
+} // namespace
+
+// Values of a message are allocated from |buffer| until it is exhausted.
+// Clearing the allocator keeps the buffer for the next message.
+struct PooledDocument {
+  char buffer[16384];
+  rapidjson::MemoryPoolAllocator<> allocator{buffer, sizeof buffer};
+  rapidjson::Document document{&allocator};
+};
+
+void MessageDeleter::operator()(char *message) const {
+  if (pooled) {
+    std::lock_guard lock(pool_mtx);
+    if (free_messages.size() < kMaxPooled) {
+      free_messages.push_back(message);
+      return;
+    }
+  }
+  delete[] message;
+}
+
+void DocumentDeleter::operator()(rapidjson::Document *document) const {
+  if (!pooled) {
+    delete document;
+    return;
+  }
+  pooled->document.SetNull();
+  pooled->allocator.Clear();
+  {
+    std::lock_guard lock(pool_mtx);
+    if (free_documents.size() < kMaxPooled) {
+      free_documents.push_back(pooled);
+      return;
+    }
+  }
+  delete pooled;
+}
+
+MessagePtr allocMessage(size_t size) {
+  if (size > kPooledMessageSize)
+    return MessagePtr(new char[size]);
+  {
+    std::lock_guard lock(pool_mtx);
+    if (free_messages.size()) {
+      char *message = free_messages.back();
+      free_messages.pop_back();
+      return MessagePtr(message, MessageDeleter{true});
+    }
+  }
+  return MessagePtr(new char[kPooledMessageSize], MessageDeleter{true});
+}
+
+DocumentPtr allocDocument() {
+  PooledDocument *pooled = nullptr;
+  {
+    std::lock_guard lock(pool_mtx);
+    if (free_documents.size()) {
+      pooled = free_documents.back();
+      free_documents.pop_back();
+    }
+  }
+  if (!pooled)
+    pooled = new PooledDocument;
+  return DocumentPtr(&pooled->document, DocumentDeleter{pooled});
+}
+
 void reflect(JsonReader &vis, RequestId &v) {
   if (vis.m->IsInt64()) {
     v.type = RequestId::kInt;
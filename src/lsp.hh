@@ -11,6 +11,7 @@
 
 #include <chrono>
 #include <iosfwd>
+#include <memory>
 #include <string>
 
 namespace ccls {
@@ -27,12 +28,34 @@ struct RequestId {
 void reflect(JsonReader &visitor, RequestId &value);
 void reflect(JsonWriter &visitor, RequestId &value);
 
+// The buffers and documents of messages from the client are recycled through
+// free lists, so that thousands of small messages per second, freed on other
+// threads than the reader's, do not churn the heap.
+struct MessageDeleter {
+  // Whether the buffer has the pooled size.
+  bool pooled = false;
+  void operator()(char *message) const;
+};
+struct PooledDocument;
+struct DocumentDeleter {
+  PooledDocument *pooled = nullptr;
+  void operator()(rapidjson::Document *document) const;
+};
+using MessagePtr = std::unique_ptr<char[], MessageDeleter>;
+using DocumentPtr = std::unique_ptr<rapidjson::Document, DocumentDeleter>;
+// Returns a buffer of at least |size| bytes.
+MessagePtr allocMessage(size_t size);
+// Returns an empty document.
+DocumentPtr allocDocument();
+
 struct InMessage {
   RequestId id;
   std::string method;
-  std::unique_ptr<char[]> message;
-  std::unique_ptr<rapidjson::Document> document;
+  MessagePtr message;
+  DocumentPtr document;
   std::chrono::steady_clock::time_point deadline;
+  // When the message was read.
+  std::chrono::steady_clock::time_point received;
   std::string backlog_path;
 };
 
@@ -50,6 +73,7 @@ enum class ErrorCode {
 
   // Defined by the protocol.
   RequestCancelled = -32800,
+  ContentModified = -32801,
 };
 
 struct ResponseError {
@@ -1,11 +1,15 @@
 // Copyright 2017-2018 ccls Authors
 // SPDX-License-Identifier: Apache-2.0
 
+#include "bench.hh"
+#include "index_worker.hh"
 #include "log.hh"
 #include "pipeline.hh"
 #include "platform.hh"
+#include "replay.hh"
 #include "serializer.hh"
 #include "test.hh"
+#include "trace.hh"
 #include "working_files.hh"
 
 #include <clang/Basic/Version.h>
@@ -19,6 +23,7 @@
 #include <rapidjson/document.h>
 #include <rapidjson/error/en.h>
 
+#include <algorithm>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
@@ -41,16 +46,112 @@ opt<int> opt_verbose("v", desc("verbosity, from -3 (fatal) to 2 (verbose)"),
                      init(0), cat(C));
 opt<std::string> opt_test_index("test-index", ValueOptional, init("!"),
                                 desc("run index tests"), cat(C));
+opt<bool> opt_test_bench("bench",
+                          desc("with --test-index, print the indexing time "
+                               "of each test as JSON"),
+                          cat(C));
+opt<std::string> opt_microbench(
+    "microbench", ValueOptional, init("!"),
+    desc("run micro-benchmarks whose names contain the filter"), cat(C));
+opt<std::string> opt_microbench_input(
+    "microbench-input", desc("cache directory with recorded inputs"),
+    value_desc("dir"), cat(C));
+opt<std::string> opt_generate_corpus(
+    "generate-corpus",
+    desc("write a synthetic project for benchmarks, e.g. --bench-index, and "
+         "exit"),
+    value_desc("dir"), cat(C));
+opt<int> opt_corpus_tus("corpus-tus",
+                        desc("translation units for --generate-corpus"),
+                        init(100), cat(C));
+opt<int> opt_corpus_headers("corpus-headers",
+                            desc("headers for --generate-corpus"), init(50),
+                            cat(C));
+opt<int> opt_corpus_fanout("corpus-fanout",
+                           desc("#include directives per file for "
+                                "--generate-corpus"),
+                           init(4), cat(C));
+opt<int> opt_corpus_template_depth(
+    "corpus-template-depth",
+    desc("length of the template chain in each header for --generate-corpus"),
+    init(4), cat(C));
+opt<int> opt_corpus_hierarchy_width(
+    "corpus-hierarchy-width",
+    desc("derived classes per header for --generate-corpus"), init(4), cat(C));
 
+opt<bool> opt_index_worker("index-worker",
+                           desc("index translation units for a ccls server"),
+                           Hidden, cat(C));
 opt<std::string> opt_index("index",
                            desc("standalone mode: index a project and exit"),
                            value_desc("root"), cat(C));
+opt<std::string> opt_index_only(
+    "index-only",
+    desc("update the cache of a project without building a database and exit"),
+    value_desc("root"), cat(C));
+opt<std::string> opt_bench_index(
+    "bench-index", desc("index a project, print timings as JSON and exit"),
+    value_desc("root"), cat(C));
+opt<std::string> opt_bench_cache(
+    "bench-cache",
+    desc("cache for --bench-index: cold (empty), disk or memory (warm)"),
+    init("cold"), cat(C));
+opt<int> opt_bench_threads("bench-threads",
+                           desc("index.threads for --bench-index"), init(0),
+                           cat(C));
+opt<std::string> opt_bench_format("bench-format",
+                                  desc("cache.format for --bench-index"),
+                                  init("binary"), cat(C));
+opt<std::string> opt_bench_sema(
+    "bench-sema",
+    desc("edit and complete in files of a project, print preamble, "
+         "diagnostics and completion latencies as JSON and exit"),
+    value_desc("root"), cat(C));
+opt<int> opt_bench_sema_files("bench-sema-files",
+                              desc("files opened by --bench-sema"), init(10),
+                              cat(C));
+opt<int> opt_bench_sema_edits("bench-sema-edits",
+                              desc("edits per file for --bench-sema"),
+                              init(20), cat(C));
 list<std::string> opt_init("init", desc("extra initialization options in JSON"),
                            cat(C));
 opt<std::string> opt_log_file("log-file", desc("stderr or log file"),
                               value_desc("file"), init("stderr"), cat(C));
 opt<bool> opt_log_file_append("log-file-append", desc("append to log file"),
                               cat(C));
+opt<bool> opt_log_async("log-async",
+                        desc("write the log from a background thread"),
+                        cat(C));
+opt<std::string> opt_log_format("log-format", desc("log format: text or json"),
+                                init("text"), cat(C));
+opt<std::string> opt_record("record",
+                            desc("record client messages with timing"),
+                            value_desc("file"), cat(C));
+opt<std::string> opt_replay(
+    "replay",
+    desc("replay recorded client messages and print latencies as JSON"),
+    value_desc("file"), cat(C));
+opt<std::string> opt_listen(
+    "listen",
+    desc("serve LSP clients connecting to this UNIX domain socket instead of "
+         "stdin, sharing one index between them"),
+    value_desc("socket"), cat(C));
+opt<std::string> opt_connect(
+    "connect",
+    desc("relay stdin and stdout to a server started with --listen"),
+    value_desc("socket"), cat(C));
+opt<std::string> opt_serve_snapshot(
+    "serve-snapshot",
+    desc("answer read-only requests from the snapshot in this cache directory "
+         "without indexing"),
+    value_desc("directory"), cat(C));
+opt<std::string> opt_trace("trace",
+                           desc("record pipeline spans as Chrome trace events"),
+                           value_desc("file"), cat(C));
+opt<bool> opt_perf_counters(
+    "perf-counters",
+    desc("aggregate hardware counters of pipeline spans in $ccls/stats"),
+    cat(C));
 
 void closeLog() { fclose(ccls::log::file); }
 
@@ -76,6 +177,12 @@ int main(int argc, char **argv) {
   }
   ccls::log::verbosity = ccls::log::Verbosity(opt_verbose.getValue());
 
+  if (opt_trace.size()) {
+    trace::start(opt_trace);
+    atexit(trace::stop);
+  }
+  if (opt_perf_counters)
+    trace::startCounters();
   pipeline::init();
   const char *env = getenv("CCLS_CRASH_RECOVERY");
   if (!env || strcmp(env, "0") != 0)
@@ -94,12 +201,46 @@ int main(int argc, char **argv) {
     }
     setbuf(ccls::log::file, NULL);
     atexit(closeLog);
+    if (opt_log_format == "json")
+      ccls::log::format = ccls::log::Format::Json;
+    if (opt_log_async) {
+      ccls::log::startAsync();
+      atexit(ccls::log::stopAsync);
+    }
+  }
+
+  if (opt_index_worker) {
+    sys::ChangeStdinToBinary();
+    sys::ChangeStdoutToBinary();
+    return runIndexWorker();
   }
 
+  if (opt_connect.size())
+    return pipeline::relay(opt_connect);
+
   if (opt_test_index != "!") {
     language_server = false;
     if (!ccls::runIndexTests(opt_test_index,
-                             sys::Process::StandardInIsUserInput()))
+                             sys::Process::StandardInIsUserInput(),
+                             opt_test_bench))
+      return 1;
+  }
+
+  if (opt_microbench != "!") {
+    language_server = false;
+    if (!runMicroBenchmarks(opt_microbench, opt_microbench_input))
+      return 1;
+  }
+
+  if (opt_generate_corpus.size()) {
+    language_server = false;
+    CorpusParams params;
+    params.tus = std::max(opt_corpus_tus.getValue(), 0);
+    params.headers = std::max(opt_corpus_headers.getValue(), 0);
+    params.fanout = std::max(opt_corpus_fanout.getValue(), 0);
+    params.template_depth = std::max(opt_corpus_template_depth.getValue(), 0);
+    params.hierarchy_width = std::max(opt_corpus_hierarchy_width.getValue(), 0);
+    if (!generateCorpus(opt_generate_corpus, params))
       return 1;
   }
 
@@ -131,21 +272,98 @@ int main(int argc, char **argv) {
 
     sys::ChangeStdinToBinary();
     sys::ChangeStdoutToBinary();
-    if (opt_index.size()) {
+    if (opt_bench_index.size()) {
+      if (opt_bench_cache != "cold" && opt_bench_cache != "disk" &&
+          opt_bench_cache != "memory") {
+        fprintf(stderr, "unknown --bench-cache=%s\n",
+                opt_bench_cache.c_str());
+        return 1;
+      }
+      if (opt_bench_format != "binary" && opt_bench_format != "json") {
+        fprintf(stderr, "unknown --bench-format=%s\n",
+                opt_bench_format.c_str());
+        return 1;
+      }
+      // cold and disk use a fresh cache directory which is removed
+      // afterwards. memory keeps the cache in memory only.
+      SmallString<256> cache_dir;
+      if (opt_bench_cache != "memory")
+        if (std::error_code ec =
+                sys::fs::createUniqueDirectory("ccls-bench", cache_dir)) {
+          fprintf(stderr, "failed to create cache directory: %s\n",
+                  ec.message().c_str());
+          return 1;
+        }
+      std::string init;
+      raw_string_ostream os(init);
+      os << "{\"index\":{\"threads\":" << opt_bench_threads.getValue()
+         << "},\"cache\":{\"directory\":\"";
+      os.write_escaped(cache_dir);
+      os << "\",\"format\":\"" << opt_bench_format
+         << "\",\"retainInMemory\":" << (opt_bench_cache == "disk" ? 0 : 1)
+         << "}}";
+      g_init_options.push_back(os.str());
+
+      SmallString<256> root(opt_bench_index);
+      sys::fs::make_absolute(root);
+      pipeline::benchIndex(std::string(root.data(), root.size()),
+                           opt_bench_cache, opt_bench_cache != "cold");
+      if (cache_dir.size())
+        (void)sys::fs::remove_directories(cache_dir);
+    } else if (opt_bench_sema.size()) {
+      // Diagnostics right after opening and editing, none after saving, so
+      // that each phase is waited for separately. Nothing is indexed.
+      // --init can override these, e.g. session.sharePreambles.
+      g_init_options.insert(
+          g_init_options.begin(),
+          "{\"diagnostics\":{\"onChange\":0,\"onOpen\":0,\"onSave\":-1},"
+          "\"index\":{\"initialBlacklist\":[\".\"]}}");
+      SmallString<256> root(opt_bench_sema);
+      sys::fs::make_absolute(root);
+      pipeline::benchSema(std::string(root.data(), root.size()),
+                          opt_bench_sema_files, opt_bench_sema_edits);
+    } else if (opt_index_only.size()) {
+      // Defaults suited to bulk indexing, which --init can override.
+      g_init_options.insert(g_init_options.begin(),
+                            "{\"cache\":{\"pack\":true,"
+                            "\"retainInMemory\":0}}");
+      SmallString<256> root(opt_index_only);
+      sys::fs::make_absolute(root);
+      pipeline::indexOnly(std::string(root.data(), root.size()));
+    } else if (opt_index.size()) {
       SmallString<256> root(opt_index);
       sys::fs::make_absolute(root);
       pipeline::standalone(std::string(root.data(), root.size()));
     } else {
-      // The thread that reads from stdin and dispatchs commands to the main
-      // thread.
-      pipeline::launchStdin();
-      // The thread that writes responses from the main thread to stdout.
+      if (opt_replay.size() ? !replay::startReplay(opt_replay)
+                            : opt_record.size() &&
+                                  !replay::startRecording(opt_record))
+        return 1;
+      if (opt_serve_snapshot.size()) {
+        SmallString<256> dir(opt_serve_snapshot);
+        sys::fs::make_absolute(dir);
+        pipeline::serve_snapshot = normalizePath(dir.str());
+        ensureEndsInSlash(pipeline::serve_snapshot);
+      }
+      // The thread that reads from stdin, or the clients of --listen, and
+      // dispatchs commands to the main thread.
+      if (opt_listen.empty()) {
+        pipeline::launchStdin();
+      } else if (!pipeline::launchSocket(opt_listen)) {
+        fprintf(stderr, "failed to listen on %s\n", opt_listen.c_str());
+        return 1;
+      }
+      // The thread that writes responses from the main thread to stdout, or
+      // to the clients.
       pipeline::launchStdout();
       // Main thread which also spawns indexer threads upon the "initialize"
       // request.
       pipeline::mainLoop();
+      if (replay::replaying)
+        replay::report();
     }
   }
+  trace::stop();
 
   return 0;
 }
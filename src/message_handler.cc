@@ -7,12 +7,17 @@
 #include "pipeline.hh"
 #include "project.hh"
 #include "query.hh"
+#include "trace.hh"
+#include "working_files.hh"
 
 #include <rapidjson/document.h>
 #include <rapidjson/reader.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
 
 #include <algorithm>
 #include <stdexcept>
+#include <string.h>
 
 using namespace clang;
 
@@ -26,6 +31,7 @@ REFLECT_STRUCT(TextDocumentParam, textDocument);
 REFLECT_STRUCT(DidOpenTextDocumentParam, textDocument);
 REFLECT_STRUCT(TextDocumentContentChangeEvent, range, rangeLength, text);
 REFLECT_STRUCT(TextDocumentDidChangeParam, textDocument, contentChanges);
+REFLECT_STRUCT(TextDocumentViewParam, textDocument, range);
 REFLECT_STRUCT(TextDocumentPositionParam, textDocument, position);
 REFLECT_STRUCT(RenameParam, textDocument, position, newName);
 
@@ -50,17 +56,6 @@ REFLECT_STRUCT(DidChangeWorkspaceFoldersParam, event);
 REFLECT_STRUCT(WorkspaceSymbolParam, query, folders);
 
 namespace {
-struct CclsSemanticHighlightSymbol {
-  int id = 0;
-  SymbolKind parentKind;
-  SymbolKind kind;
-  uint8_t storage;
-  std::vector<std::pair<int, int>> ranges;
-
-  // `lsRanges` is used to compute `ranges`.
-  std::vector<lsRange> lsRanges;
-};
-
 struct CclsSemanticHighlight {
   DocumentUri uri;
   std::vector<CclsSemanticHighlightSymbol> symbols;
@@ -95,8 +90,91 @@ struct ScanLineEvent {
     return symbol->id < o.symbol->id;
   }
 };
+
+// Requests whose results may come from any file. With index.lazyLoad, they
+// load the deferred caches and wait for them first. workspace/symbol is not
+// one of them as it may read symbol tables instead.
+bool isProjectWide(std::string_view method) {
+  static const char *const methods[] = {
+      "$ccls/batch",
+      "$ccls/call",
+      "$ccls/dependents",
+      "$ccls/inheritance",
+      "$ccls/member",
+      "$ccls/symbols",
+      "$ccls/vars",
+      "textDocument/definition",
+      "textDocument/implementation",
+      "textDocument/references",
+      "textDocument/rename",
+  };
+  for (const char *m : methods)
+    if (method == m)
+      return true;
+  return false;
+}
+
+// Requests whose replies are memoized by request.cacheResults. Editors
+// re-issue them with the same params as panels refresh.
+bool isCacheable(std::string_view method) {
+  static const char *const methods[] = {
+      "$ccls/inheritance",
+      "$ccls/member",
+      "$ccls/vars",
+      "textDocument/references",
+  };
+  for (const char *m : methods)
+    if (method == m)
+      return true;
+  return false;
+}
+
+// Serialized results keyed by method and params. Entries are only valid for
+// one DB::generation and one state of the working files (WorkingFiles::views
+// and generation), so a change of any of them clears the cache.
+struct ResultCache {
+  std::mutex mutex;
+  uint64_t db_generation = 0;
+  int64_t views = 0;
+  uint32_t wfiles_generation = 0;
+  // Most recently used last.
+  std::vector<std::pair<std::string, std::string>> entries;
+  size_t bytes = 0;
+} result_cache;
+constexpr size_t kMaxResultCacheBytes = 64 << 20;
 } // namespace
 
+bool isReadOnly(std::string_view method) {
+  static const char *const methods[] = {
+      "$ccls/batch",
+      "$ccls/call",
+      "$ccls/inheritance",
+      "$ccls/member",
+      "$ccls/symbols",
+      "$ccls/vars",
+      "textDocument/definition",
+      "textDocument/documentHighlight",
+      "textDocument/hover",
+      "textDocument/implementation",
+      "textDocument/references",
+      "textDocument/typeDefinition",
+      "workspace/symbol",
+  };
+  for (const char *m : methods)
+    if (method == m)
+      return true;
+  return false;
+}
+
+thread_local bool MessageHandler::overdue;
+
+void LatencyHistogram::add(double ms) {
+  buckets[std::lower_bound(std::begin(kBounds), std::end(kBounds), ms) -
+          std::begin(kBounds)]++;
+  count++;
+  sum += ms;
+}
+
 void ReplyOnce::notOpened(std::string_view path) {
   error(ErrorCode::InvalidRequest, std::string(path) + " is not opened");
 }
@@ -114,6 +192,14 @@ void ReplyOnce::replyLocationLink(std::vector<LocationLink> &result) {
   }
 }
 
+void ReplyOnce::rawArray(const std::string &json) const {
+  if (id.valid()) {
+    pipeline::beginReply(id, "result")
+        .m->RawValue(json.data(), json.size(), rapidjson::kArrayType);
+    pipeline::endMessage();
+  }
+}
+
 void MessageHandler::bind(const char *method,
                           void (MessageHandler::*handler)(JsonReader &)) {
   method2notification[method] = [this, handler](JsonReader &reader) {
@@ -154,14 +240,22 @@ void MessageHandler::bind(const char *method,
 
 MessageHandler::MessageHandler() {
   // clang-format off
+  bind("$ccls/batch", &MessageHandler::ccls_batch);
   bind("$ccls/call", &MessageHandler::ccls_call);
+  bind("$ccls/dependents", &MessageHandler::ccls_dependents);
   bind("$ccls/fileInfo", &MessageHandler::ccls_fileInfo);
+  bind("$ccls/indexReport", &MessageHandler::ccls_indexReport);
   bind("$ccls/info", &MessageHandler::ccls_info);
   bind("$ccls/inheritance", &MessageHandler::ccls_inheritance);
   bind("$ccls/member", &MessageHandler::ccls_member);
+  bind("$ccls/memory", &MessageHandler::ccls_memory);
   bind("$ccls/navigate", &MessageHandler::ccls_navigate);
   bind("$ccls/reload", &MessageHandler::ccls_reload);
+  bind("$ccls/stats", &MessageHandler::ccls_stats);
+  bind("$ccls/symbols", &MessageHandler::ccls_symbols);
   bind("$ccls/vars", &MessageHandler::ccls_vars);
+  bind("callHierarchy/incomingCalls", &MessageHandler::callHierarchy_incomingCalls);
+  bind("callHierarchy/outgoingCalls", &MessageHandler::callHierarchy_outgoingCalls);
   bind("exit", &MessageHandler::exit);
   bind("initialize", &MessageHandler::initialize);
   bind("initialized", &MessageHandler::initialized);
@@ -183,9 +277,13 @@ MessageHandler::MessageHandler() {
   bind("textDocument/hover", &MessageHandler::textDocument_hover);
   bind("textDocument/implementation", &MessageHandler::textDocument_implementation);
   bind("textDocument/onTypeFormatting", &MessageHandler::textDocument_onTypeFormatting);
+  bind("textDocument/prepareCallHierarchy", &MessageHandler::textDocument_prepareCallHierarchy);
   bind("textDocument/rangeFormatting", &MessageHandler::textDocument_rangeFormatting);
   bind("textDocument/references", &MessageHandler::textDocument_references);
   bind("textDocument/rename", &MessageHandler::textDocument_rename);
+  bind("textDocument/semanticTokens/full", &MessageHandler::textDocument_semanticTokensFull);
+  bind("textDocument/semanticTokens/full/delta", &MessageHandler::textDocument_semanticTokensFullDelta);
+  bind("textDocument/semanticTokens/range", &MessageHandler::textDocument_semanticTokensRange);
   bind("textDocument/signatureHelp", &MessageHandler::textDocument_signatureHelp);
   bind("textDocument/typeDefinition", &MessageHandler::textDocument_typeDefinition);
   bind("workspace/didChangeConfiguration", &MessageHandler::workspace_didChangeConfiguration);
@@ -196,7 +294,97 @@ MessageHandler::MessageHandler() {
   // clang-format on
 }
 
+void MessageHandler::runCached(
+    const std::string &method,
+    const std::function<void(JsonReader &, ReplyOnce &)> &fn,
+    JsonReader &reader, ReplyOnce &reply) {
+  // Partial results are sent as notifications, which are not captured.
+  if (reader.m->IsObject() && reader.m->HasMember("partialResultToken")) {
+    fn(reader, reply);
+    return;
+  }
+  rapidjson::StringBuffer buf;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(buf);
+  reader.m->Accept(writer);
+  std::string key = method + '\n' + buf.GetString();
+  int64_t views;
+  uint32_t wfiles_generation;
+  {
+    std::lock_guard lock(wfiles->mutex);
+    views = wfiles->views;
+    wfiles_generation = wfiles->generation;
+  }
+  uint64_t db_generation = db->generation;
+  ResultCache &c = result_cache;
+  auto current = [&]() {
+    return c.db_generation == db_generation && c.views == views &&
+           c.wfiles_generation == wfiles_generation;
+  };
+  {
+    std::lock_guard lock(c.mutex);
+    if (!current()) {
+      c.entries.clear();
+      c.bytes = 0;
+      c.db_generation = db_generation;
+      c.views = views;
+      c.wfiles_generation = wfiles_generation;
+    }
+    auto it = std::find_if(c.entries.begin(), c.entries.end(),
+                           [&](const auto &e) { return e.first == key; });
+    if (it != c.entries.end()) {
+      std::rotate(it, it + 1, c.entries.end());
+      const std::string &json = c.entries.back().second;
+      pipeline::beginReply(reply.id, "result")
+          .m->RawValue(json.data(), json.size(), rapidjson::kObjectType);
+      pipeline::endMessage();
+      return;
+    }
+  }
+
+  std::string out;
+  pipeline::captureReplies(&out);
+  try {
+    fn(reader, reply);
+  } catch (...) {
+    pipeline::captureReplies(nullptr);
+    throw;
+  }
+  pipeline::captureReplies(nullptr);
+  // Replay the captured {"jsonrpc":"2.0","id":...,"result"|"error":...}.
+  for (const char *name : {"result", "error"}) {
+    size_t pos = out.find(std::string(",\"") + name + "\":");
+    if (pos == std::string::npos)
+      continue;
+    pos += strlen(name) + 4;
+    std::string json = out.substr(pos, out.size() - pos - 1);
+    pipeline::beginReply(reply.id, name)
+        .m->RawValue(json.data(), json.size(), rapidjson::kObjectType);
+    pipeline::endMessage();
+    if (name[0] != 'r' || json.size() > kMaxResultCacheBytes / 4)
+      break;
+    std::lock_guard lock(c.mutex);
+    // Another request may have moved the cache to a newer state.
+    if (!current())
+      break;
+    c.bytes += key.size() + json.size();
+    c.entries.emplace_back(std::move(key), std::move(json));
+    while (c.entries.size() > size_t(g_config->request.cacheResults) ||
+           c.bytes > kMaxResultCacheBytes) {
+      c.bytes -= c.entries[0].first.size() + c.entries[0].second.size();
+      c.entries.erase(c.entries.begin());
+    }
+    break;
+  }
+}
+
 void MessageHandler::run(InMessage &msg) {
+  // Wait in the backlog until the deferred caches are in DB. Once overdue,
+  // reply with what DB has.
+  if (g_config && g_config->index.lazyLoad && isProjectWide(msg.method) &&
+      pipeline::loadDeferred() && !overdue && msg.id.valid())
+    throw NotIndexed{NotIndexed::kDeferred};
+  auto start = std::chrono::steady_clock::now();
+  trace::Span span(trace::enabled ? intern(msg.method) : nullptr);
   rapidjson::Document &doc = *msg.document;
   rapidjson::Value null;
   auto it = doc.FindMember("params");
@@ -204,9 +392,15 @@ void MessageHandler::run(InMessage &msg) {
   if (msg.id.valid()) {
     ReplyOnce reply{*this, msg.id};
     auto it = method2request.find(msg.method);
-    if (it != method2request.end()) {
+    if (pipeline::isCancelled(msg.id)) {
+      reply.error(ErrorCode::RequestCancelled, "cancelled " + msg.method);
+    } else if (it != method2request.end()) {
       try {
-        it->second(reader, reply);
+        if (g_config && g_config->request.cacheResults > 0 &&
+            isCacheable(msg.method))
+          runCached(msg.method, it->second, reader, reply);
+        else
+          it->second(reader, reply);
       } catch (std::invalid_argument &ex) {
         reply.error(ErrorCode::InvalidParams,
                     "invalid params of " + msg.method + ": expected " +
@@ -231,6 +425,14 @@ void MessageHandler::run(InMessage &msg) {
         pipeline::notify(window_showMessage, param);
       }
   }
+
+  // Not reached if the message is put into the backlog by NotIndexed.
+  auto end = std::chrono::steady_clock::now();
+  using ms = std::chrono::duration<double, std::milli>;
+  std::lock_guard lock(method_stats_mutex);
+  MethodStats &st = method_stats[msg.method];
+  st.wait.add(ms(start - msg.received).count());
+  st.handle.add(ms(end - start).count());
 }
 
 QueryFile *MessageHandler::findFile(const std::string &path, int *out_file_id) {
@@ -260,7 +462,8 @@ MessageHandler::findOrFail(const std::string &path, ReplyOnce &reply,
   }
   QueryFile *file = findFile(path, out_file_id);
   if (!file) {
-    if (!overdue)
+    // Nothing is indexed when serving a snapshot.
+    if (!overdue && pipeline::serve_snapshot.empty())
       throw NotIndexed{path};
     reply.error(ErrorCode::InvalidRequest, "not indexed");
     return {nullptr, nullptr};
@@ -268,28 +471,51 @@ MessageHandler::findOrFail(const std::string &path, ReplyOnce &reply,
   return {file, wf};
 }
 
-void emitSkippedRanges(WorkingFile *wfile, QueryFile &file) {
+void emitSkippedRanges(DB *db, WorkingFile *wfile, QueryFile &file) {
+  // Nothing the ranges depend on has changed since they were last sent.
+  if (wfile->skipped_ranges_generation == db->generation)
+    return;
+  wfile->skipped_ranges_generation = db->generation;
   CclsSetSkippedRanges params;
   params.uri = DocumentUri::fromPath(wfile->filename);
   for (Range skipped : file.def->skipped_ranges)
     if (auto ls_skipped = getLsRange(wfile, skipped))
       params.skippedRanges.push_back(*ls_skipped);
-  pipeline::notify("$ccls/publishSkippedRanges", params);
+  // Re-indexing rarely changes the skipped ranges.
+  rapidjson::StringBuffer output;
+  JsonWriter::W w(output);
+  JsonWriter writer(&w);
+  reflect(writer, params);
+  if (wfile->skipped_ranges == output.GetString())
+    return;
+  wfile->skipped_ranges = output.GetString();
+  pipeline::notifyOrRequest(
+      "$ccls/publishSkippedRanges", false, [&](JsonWriter &json) {
+        json.m->RawValue(wfile->skipped_ranges.data(),
+                         wfile->skipped_ranges.size(), rapidjson::kObjectType);
+      });
 }
 
-void emitSemanticHighlight(DB *db, WorkingFile *wfile, QueryFile &file) {
+bool computeSemanticHighlight(DB *db, WorkingFile *wfile, QueryFile &file,
+                              std::vector<CclsSemanticHighlightSymbol> &out,
+                              const lsRange *range) {
   static GroupMatch match(g_config->highlight.whitelist,
                           g_config->highlight.blacklist);
   assert(file.def);
-  if (wfile->buffer_content.size() > g_config->highlight.largeFileSize ||
+  if ((!range &&
+       wfile->buffer_content.size() > g_config->highlight.largeFileSize) ||
       !match.matches(file.def->path))
-    return;
+    return false;
 
+  // Files may be highlighted on several threads, so look up the USR maps
+  // without inserting.
+  auto find = [](auto &entity_usr, Usr usr) {
+    auto it = entity_usr.find(usr);
+    return it == entity_usr.end() ? -1 : it->second;
+  };
   // Group symbols together.
   std::unordered_map<SymbolIdx, CclsSemanticHighlightSymbol> grouped_symbols;
-  for (auto [sym, refcnt] : file.symbol2refcnt) {
-    if (refcnt <= 0)
-      continue;
+  for (ExtentRef sym : findSymbolsInRange(wfile, &file, range)) {
     std::string_view detailed_name;
     SymbolKind parent_kind = SymbolKind::Unknown;
     SymbolKind kind = SymbolKind::Unknown;
@@ -298,7 +524,8 @@ void emitSemanticHighlight(DB *db, WorkingFile *wfile, QueryFile &file) {
     // This switch statement also filters out symbols that are not highlighted.
     switch (sym.kind) {
     case Kind::Func: {
-      idx = db->func_usr[sym.usr];
+      if ((idx = find(db->func_usr, sym.usr)) < 0)
+        continue;
       const QueryFunc &func = db->funcs[idx];
       const QueryFunc::Def *def = func.anyDef();
       if (!def)
@@ -332,7 +559,8 @@ void emitSemanticHighlight(DB *db, WorkingFile *wfile, QueryFile &file) {
       break;
     }
     case Kind::Type: {
-      idx = db->type_usr[sym.usr];
+      if ((idx = find(db->type_usr, sym.usr)) < 0)
+        continue;
       const QueryType &type = db->types[idx];
       for (auto &def : type.def) {
         kind = def.kind;
@@ -345,7 +573,8 @@ void emitSemanticHighlight(DB *db, WorkingFile *wfile, QueryFile &file) {
       break;
     }
     case Kind::Var: {
-      idx = db->var_usr[sym.usr];
+      if ((idx = find(db->var_usr, sym.usr)) < 0)
+        continue;
       const QueryVar &var = db->vars[idx];
       for (auto &def : var.def) {
         kind = def.kind;
@@ -417,15 +646,30 @@ void emitSemanticHighlight(DB *db, WorkingFile *wfile, QueryFile &file) {
       deleted[~events[i].id] = 1;
   }
 
+  for (auto &entry : grouped_symbols)
+    if (entry.second.lsRanges.size())
+      out.push_back(std::move(entry.second));
+  return true;
+}
+
+void emitSemanticHighlight(DB *db, WorkingFile *wfile, QueryFile &file) {
+  trace::Span span("emitSemanticHighlight");
+  wfile->highlight_deferred = false;
+  // Nothing the highlight depends on has changed since it was last sent.
+  if (wfile->highlight_generation == db->generation)
+    return;
+  wfile->highlight_generation = db->generation;
   CclsSemanticHighlight params;
+  if (!computeSemanticHighlight(db, wfile, file, params.symbols))
+    return;
   params.uri = DocumentUri::fromPath(wfile->filename);
   // Transform lsRange into pair<int, int> (offset pairs)
   if (!g_config->highlight.lsRanges) {
     std::vector<std::pair<lsRange, CclsSemanticHighlightSymbol *>> scratch;
-    for (auto &entry : grouped_symbols) {
-      for (auto &range : entry.second.lsRanges)
-        scratch.emplace_back(range, &entry.second);
-      entry.second.lsRanges.clear();
+    for (auto &symbol : params.symbols) {
+      for (auto &range : symbol.lsRanges)
+        scratch.emplace_back(range, &symbol);
+      symbol.lsRanges.clear();
     }
     std::sort(scratch.begin(), scratch.end(),
               [](auto &l, auto &r) { return l.first.start < r.first.start; });
@@ -459,11 +703,33 @@ void emitSemanticHighlight(DB *db, WorkingFile *wfile, QueryFile &file) {
         continue;
       entry.second->ranges.emplace_back(beg, p);
     }
+    params.symbols.erase(
+        std::remove_if(params.symbols.begin(), params.symbols.end(),
+                       [](auto &symbol) { return symbol.ranges.empty(); }),
+        params.symbols.end());
   }
 
-  for (auto &entry : grouped_symbols)
-    if (entry.second.ranges.size() || entry.second.lsRanges.size())
-      params.symbols.push_back(std::move(entry.second));
-  pipeline::notify("$ccls/publishSemanticHighlight", params);
+  // Symbols are grouped in a hash map, so sort them by their first range to
+  // compare with the last params. Ranges do not overlap after the scan line.
+  // Re-indexing often leaves the highlight of a file unchanged.
+  auto first = [](const CclsSemanticHighlightSymbol &s) {
+    return s.ranges.size() ? std::make_pair(s.ranges[0].first, 0)
+                           : std::make_pair(s.lsRanges[0].start.line,
+                                            s.lsRanges[0].start.character);
+  };
+  std::sort(params.symbols.begin(), params.symbols.end(),
+            [&](auto &l, auto &r) { return first(l) < first(r); });
+  rapidjson::StringBuffer output;
+  JsonWriter::W w(output);
+  JsonWriter writer(&w);
+  reflect(writer, params);
+  if (wfile->highlight == output.GetString())
+    return;
+  wfile->highlight = output.GetString();
+  pipeline::notifyOrRequest(
+      "$ccls/publishSemanticHighlight", false, [&](JsonWriter &json) {
+        json.m->RawValue(wfile->highlight.data(), wfile->highlight.size(),
+                         rapidjson::kObjectType);
+      });
 }
 } // namespace ccls
@@ -7,8 +7,11 @@
 #include "query.hh"
 
 #include <functional>
+#include <iterator>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <string_view>
 #include <vector>
 
 namespace ccls {
@@ -20,9 +23,8 @@ struct WorkingFile;
 struct WorkingFiles;
 
 namespace pipeline {
-void reply(const RequestId &id, const std::function<void(JsonWriter &)> &fn);
-void replyError(const RequestId &id,
-                const std::function<void(JsonWriter &)> &fn);
+JsonWriter &beginReply(const RequestId &id, const char *key);
+void endMessage();
 } // namespace pipeline
 
 struct CodeActionParam {
@@ -44,6 +46,11 @@ struct RenameParam {
 struct TextDocumentParam {
   TextDocumentIdentifier textDocument;
 };
+// ccls extension: if range is set, the response only covers symbols
+// intersecting it, e.g. the viewport of a large file.
+struct TextDocumentViewParam : TextDocumentParam {
+  std::optional<lsRange> range;
+};
 struct TextDocumentPositionParam {
   TextDocumentIdentifier textDocument;
   Position position;
@@ -200,6 +207,8 @@ REFLECT_STRUCT(ShowMessageParam, type, message);
 REFLECT_UNDERLYING_B(LanguageId);
 
 struct NotIndexed {
+  // Requests waiting for pipeline::loadDeferred use this as |path|.
+  static constexpr const char kDeferred[] = "<deferred caches>";
   std::string path;
 };
 struct MessageHandler;
@@ -208,16 +217,41 @@ struct ReplyOnce {
   MessageHandler &handler;
   RequestId id;
   template <typename Res> void operator()(Res &&result) const {
-    if (id.valid())
-      pipeline::reply(id, [&](JsonWriter &w) { reflect(w, result); });
+    if (id.valid()) {
+      reflect(pipeline::beginReply(id, "result"), result);
+      pipeline::endMessage();
+    }
   }
   void error(ErrorCode code, std::string message) const {
     ResponseError err{code, std::move(message)};
-    if (id.valid())
-      pipeline::replyError(id, [&](JsonWriter &w) { reflect(w, err); });
+    if (id.valid()) {
+      reflect(pipeline::beginReply(id, "error"), err);
+      pipeline::endMessage();
+    }
   }
   void notOpened(std::string_view path);
   void replyLocationLink(std::vector<LocationLink> &result);
+  // Replies with an already serialized JSON array.
+  void rawArray(const std::string &json) const;
+};
+
+// A latency histogram in milliseconds. buckets[i] counts samples in
+// (kBounds[i-1], kBounds[i]]; the last bucket counts the rest.
+struct LatencyHistogram {
+  static constexpr int kBounds[] = {1,   2,   5,    10,   20,   50,
+                                    100, 200, 500, 1000, 2000, 5000};
+  static constexpr int kNumBuckets = std::size(kBounds) + 1;
+  int64_t buckets[kNumBuckets] = {};
+  int64_t count = 0;
+  double sum = 0;
+
+  void add(double ms);
+};
+
+// Time a method spent waiting in on_request and in its handler. See
+// $ccls/stats.
+struct MethodStats {
+  LatencyHistogram wait, handle;
 };
 
 struct MessageHandler {
@@ -231,10 +265,19 @@ struct MessageHandler {
   llvm::StringMap<std::function<void(JsonReader &)>> method2notification;
   llvm::StringMap<std::function<void(JsonReader &, ReplyOnce &)>>
       method2request;
-  bool overdue = false;
+  std::mutex method_stats_mutex;
+  llvm::StringMap<MethodStats> method_stats;
+  // Set by the main thread while it runs the backlog. Request threads never
+  // see it and throw NotIndexed instead.
+  static thread_local bool overdue;
 
   MessageHandler();
   void run(InMessage &msg);
+  // Runs |fn| for a request of |method|, replying from or filling the cache
+  // of request.cacheResults.
+  void runCached(const std::string &method,
+                 const std::function<void(JsonReader &, ReplyOnce &)> &fn,
+                 JsonReader &reader, ReplyOnce &reply);
   QueryFile *findFile(const std::string &path, int *out_file_id = nullptr);
   std::pair<QueryFile *, WorkingFile *> findOrFail(const std::string &path,
                                                    ReplyOnce &reply,
@@ -251,20 +294,28 @@ private:
   void bind(const char *method,
             void (MessageHandler::*handler)(Param &, ReplyOnce &));
 
+  void callHierarchy_incomingCalls(JsonReader &, ReplyOnce &);
+  void callHierarchy_outgoingCalls(JsonReader &, ReplyOnce &);
+  void ccls_batch(JsonReader &, ReplyOnce &);
   void ccls_call(JsonReader &, ReplyOnce &);
+  void ccls_dependents(JsonReader &, ReplyOnce &);
   void ccls_fileInfo(JsonReader &, ReplyOnce &);
+  void ccls_indexReport(JsonReader &, ReplyOnce &);
   void ccls_info(EmptyParam &, ReplyOnce &);
   void ccls_inheritance(JsonReader &, ReplyOnce &);
   void ccls_member(JsonReader &, ReplyOnce &);
+  void ccls_memory(JsonReader &, ReplyOnce &);
   void ccls_navigate(JsonReader &, ReplyOnce &);
   void ccls_reload(JsonReader &);
+  void ccls_stats(JsonReader &, ReplyOnce &);
+  void ccls_symbols(JsonReader &, ReplyOnce &);
   void ccls_vars(JsonReader &, ReplyOnce &);
   void exit(EmptyParam &);
   void initialize(JsonReader &, ReplyOnce &);
   void initialized(EmptyParam &);
   void shutdown(EmptyParam &, ReplyOnce &);
   void textDocument_codeAction(CodeActionParam &, ReplyOnce &);
-  void textDocument_codeLens(TextDocumentParam &, ReplyOnce &);
+  void textDocument_codeLens(TextDocumentViewParam &, ReplyOnce &);
   void textDocument_completion(CompletionParam &, ReplyOnce &);
   void textDocument_declaration(TextDocumentPositionParam &, ReplyOnce &);
   void textDocument_definition(TextDocumentPositionParam &, ReplyOnce &);
@@ -275,7 +326,7 @@ private:
   void textDocument_documentHighlight(TextDocumentPositionParam &, ReplyOnce &);
   void textDocument_documentLink(TextDocumentParam &, ReplyOnce &);
   void textDocument_documentSymbol(JsonReader &, ReplyOnce &);
-  void textDocument_foldingRange(TextDocumentParam &, ReplyOnce &);
+  void textDocument_foldingRange(TextDocumentViewParam &, ReplyOnce &);
   void textDocument_formatting(DocumentFormattingParam &, ReplyOnce &);
   void textDocument_hover(TextDocumentPositionParam &, ReplyOnce &);
   void textDocument_implementation(TextDocumentPositionParam &, ReplyOnce &);
@@ -283,8 +334,13 @@ private:
                                      ReplyOnce &);
   void textDocument_rangeFormatting(DocumentRangeFormattingParam &,
                                     ReplyOnce &);
+  void textDocument_prepareCallHierarchy(TextDocumentPositionParam &,
+                                         ReplyOnce &);
   void textDocument_references(JsonReader &, ReplyOnce &);
   void textDocument_rename(RenameParam &, ReplyOnce &);
+  void textDocument_semanticTokensFull(TextDocumentParam &, ReplyOnce &);
+  void textDocument_semanticTokensFullDelta(JsonReader &, ReplyOnce &);
+  void textDocument_semanticTokensRange(JsonReader &, ReplyOnce &);
   void textDocument_signatureHelp(TextDocumentPositionParam &, ReplyOnce &);
   void textDocument_typeDefinition(TextDocumentPositionParam &, ReplyOnce &);
   void workspace_didChangeConfiguration(EmptyParam &);
@@ -294,7 +350,40 @@ private:
   void workspace_symbol(WorkspaceSymbolParam &, ReplyOnce &);
 };
 
-void emitSkippedRanges(WorkingFile *wfile, QueryFile &file);
+// Whether |method| only reads DB and WorkingFiles, so that it can run on a
+// request thread. See request.threads.
+bool isReadOnly(std::string_view method);
 
+void emitSkippedRanges(DB *db, WorkingFile *wfile, QueryFile &file);
+
+// If |change| typed a trigger character (., -> or ::), starts completing at
+// the end of it so that the completion request likely to follow is answered
+// from the cache. See completion.prefetch.
+void prefetchCompletion(SemaManager *manager, WorkingFile *wf,
+                        const TextDocumentContentChangeEvent &change);
+
+struct CclsSemanticHighlightSymbol {
+  int id = 0;
+  SymbolKind parentKind;
+  SymbolKind kind;
+  uint8_t storage;
+  std::vector<std::pair<int, int>> ranges;
+
+  // `lsRanges` is used to compute `ranges`.
+  std::vector<lsRange> lsRanges;
+};
+
+// Appends the highlighted symbols of |file| to |out|, each with lsRanges that
+// do not overlap those of the others. If |range| is not null, only symbols
+// intersecting it are considered and largeFileSize does not apply. Returns
+// false if highlighting is disabled for the file.
+bool computeSemanticHighlight(DB *db, WorkingFile *wfile, QueryFile &file,
+                              std::vector<CclsSemanticHighlightSymbol> &out,
+                              const lsRange *range = nullptr);
 void emitSemanticHighlight(DB *db, WorkingFile *wfile, QueryFile &file);
+
+// The legend of textDocument/semanticTokens: token types by index and token
+// modifiers by bit.
+extern const std::vector<const char *> kSemanticTokenTypes,
+    kSemanticTokenModifiers;
 } // namespace ccls
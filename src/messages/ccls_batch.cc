@@ -0,0 +1,142 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "message_handler.hh"
+#include "pipeline.hh"
+
+#include <rapidjson/document.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+namespace ccls {
+namespace {
+// Replies per partial result.
+constexpr size_t kPartialResultSize = 64;
+} // namespace
+
+// Runs many read-only requests in one round trip, e.g. definitions and
+// references at thousands of positions for a code review bot:
+//
+//   {"requests": [{"method": "textDocument/definition", "params": {...}}, ...],
+//    "partialResultToken": ...}
+//
+// The sub-requests run in parallel while the DB is locked for this request, so
+// they see the same index state. The result is an array of JSON-RPC responses
+// whose ids are the indices of the sub-requests. If partialResultToken is set,
+// the responses are streamed as $/progress notifications in completion order
+// and the final result is empty.
+void MessageHandler::ccls_batch(JsonReader &reader, ReplyOnce &reply) {
+  rapidjson::Value *requests = reader.findMember("requests");
+  if (!requests || !requests->IsArray()) {
+    reply.error(ErrorCode::InvalidParams,
+                "invalid params of $ccls/batch: expected array for requests");
+    return;
+  }
+  RequestId token;
+  reader.member("partialResultToken", [&] { reflect(reader, token); });
+
+  size_t n = requests->Size();
+  std::vector<std::string> replies(n);
+  std::atomic<size_t> next{0};
+  std::atomic<bool> cancelled{false};
+  // Responses not yet streamed, joined by commas.
+  std::mutex pending_mutex;
+  std::string pending;
+  size_t num_pending = 0;
+  auto flush = [&]() {
+    std::string json = '[' + pending + ']';
+    pipeline::notifyOrRequest("$/progress", false, [&](JsonWriter &w) {
+      w.startObject();
+      w.key("token");
+      reflect(w, token);
+      w.key("value");
+      w.m->RawValue(json.data(), json.size(), rapidjson::kArrayType);
+      w.endObject();
+    });
+    pending.clear();
+    num_pending = 0;
+  };
+
+  int threads = std::clamp(
+      int(n / 16 + 1), 1,
+      int(std::max(std::thread::hardware_concurrency(), 1u)));
+  runPooled(threads, [&](int) {
+    // Reply "not indexed" instead of putting the whole batch in the backlog.
+    bool saved_overdue = overdue;
+    overdue = true;
+    std::string out;
+    pipeline::captureReplies(&out);
+    rapidjson::Value null;
+    for (size_t i; !cancelled && (i = next++) < n;) {
+      rapidjson::Value &req = (*requests)[rapidjson::SizeType(i)];
+      ReplyOnce sub{*this, RequestId{RequestId::kInt, std::to_string(i)}};
+      out.clear();
+      rapidjson::Value::MemberIterator method, params;
+      if (!req.IsObject() ||
+          (method = req.FindMember("method")) == req.MemberEnd() ||
+          !method->value.IsString()) {
+        sub.error(ErrorCode::InvalidRequest, "expected method");
+      } else {
+        std::string name(method->value.GetString(),
+                         method->value.GetStringLength());
+        auto it = method2request.find(name);
+        if (name == "$ccls/batch" || !isReadOnly(name) ||
+            it == method2request.end()) {
+          sub.error(ErrorCode::MethodNotFound,
+                    "not a read-only request " + name);
+        } else {
+          params = req.FindMember("params");
+          JsonReader reader1(params != req.MemberEnd() ? &params->value
+                                                       : &null);
+          try {
+            it->second(reader1, sub);
+          } catch (std::invalid_argument &ex) {
+            sub.error(ErrorCode::InvalidParams,
+                      "invalid params of " + name + ": expected " +
+                          ex.what() + " for " + reader1.getPath());
+          } catch (...) {
+            sub.error(ErrorCode::InternalError, "failed to process " + name);
+          }
+          if (out.empty())
+            sub.error(ErrorCode::InternalError, "no reply to " + name);
+        }
+      }
+      if (token.valid()) {
+        std::lock_guard lock(pending_mutex);
+        if (num_pending++)
+          pending += ',';
+        pending += out;
+        if (num_pending >= kPartialResultSize)
+          flush();
+      } else {
+        replies[i] = out;
+      }
+      if (pipeline::isCancelled(reply.id))
+        cancelled = true;
+    }
+    pipeline::captureReplies(nullptr);
+    overdue = saved_overdue;
+  });
+
+  if (cancelled) {
+    reply.error(ErrorCode::RequestCancelled, "cancelled $ccls/batch");
+    return;
+  }
+  std::string json = "[";
+  if (token.valid()) {
+    if (num_pending)
+      flush();
+  } else {
+    for (size_t i = 0; i < n; i++) {
+      if (i)
+        json += ',';
+      json += replies[i];
+    }
+  }
+  json += ']';
+  reply.rawArray(json);
+}
+} // namespace ccls
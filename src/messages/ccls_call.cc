@@ -6,7 +6,8 @@
 #include "pipeline.hh"
 #include "query.hh"
 
-#include <unordered_set>
+#include <algorithm>
+#include <unordered_map>
 
 namespace ccls {
 
@@ -88,60 +89,26 @@ bool expand(MessageHandler *m, Out_cclsCall *entry, bool callee,
           if (sym.kind == Kind::Func)
             handle(sym, def->file_id, call_type);
     } else {
-      for (Use use : func.uses) {
-        const QueryFile &file1 = m->db->files[use.file_id];
-        Maybe<ExtentRef> best;
-        for (auto [sym, refcnt] : file1.symbol2refcnt)
-          if (refcnt > 0 && sym.extent.valid() && sym.kind == Kind::Func &&
-              sym.extent.start <= use.range.start &&
-              use.range.end <= sym.extent.end &&
-              (!best || best->extent.start < sym.extent.start))
-            best = sym;
-        if (best)
-          handle(*best, use.file_id, call_type);
-      }
+      for (Use use : func.uses)
+        if (auto caller =
+                findEnclosingFunc(m->db->files[use.file_id], use.range))
+          handle(*caller, use.file_id, call_type);
     }
   };
 
-  std::unordered_set<Usr> seen;
-  seen.insert(func.usr);
-  std::vector<const QueryFunc *> stack;
   entry->name = def->name(qualified);
   handle_uses(func, CallType::Direct);
 
-  // Callers/callees of base functions.
-  if (call_type & CallType::Base) {
-    stack.push_back(&func);
-    while (stack.size()) {
-      const QueryFunc &func1 = *stack.back();
-      stack.pop_back();
-      if (auto *def1 = func1.anyDef()) {
-        eachDefinedFunc(m->db, def1->bases, [&](QueryFunc &func2) {
-          if (!seen.count(func2.usr)) {
-            seen.insert(func2.usr);
-            stack.push_back(&func2);
-            handle_uses(func2, CallType::Base);
-          }
-        });
+  // Callers/callees of base and derived functions.
+  EntityId id = &func - m->db->funcs.data();
+  for (CallType type : {CallType::Base, CallType::Derived})
+    if (call_type & type)
+      for (EntityId id1 :
+           getHierarchy(m->db, Kind::Func, id, type == CallType::Derived)) {
+        const QueryFunc &func1 = m->db->funcs[id1];
+        if (func1.anyDef())
+          handle_uses(func1, type);
       }
-    }
-  }
-
-  // Callers/callees of derived functions.
-  if (call_type & CallType::Derived) {
-    stack.push_back(&func);
-    while (stack.size()) {
-      const QueryFunc &func1 = *stack.back();
-      stack.pop_back();
-      eachDefinedFunc(m->db, func1.derived, [&](QueryFunc &func2) {
-        if (!seen.count(func2.usr)) {
-          seen.insert(func2.usr);
-          stack.push_back(&func2);
-          handle_uses(func2, CallType::Derived);
-        }
-      });
-    }
-  }
 
   std::sort(entry->children.begin(), entry->children.end());
   entry->children.erase(
@@ -168,8 +135,157 @@ std::optional<Out_cclsCall> buildInitial(MessageHandler *m, Usr root_usr,
   expand(m, &entry, callee, call_type, qualified, levels);
   return entry;
 }
+
+struct CallHierarchyItem {
+  std::string name;
+  SymbolKind kind;
+  std::string detail;
+  std::string uri;
+  lsRange range, selectionRange;
+  // The USR of the function.
+  std::string data;
+};
+REFLECT_STRUCT(CallHierarchyItem, name, kind, detail, uri, range,
+               selectionRange, data);
+
+struct CallsParam {
+  CallHierarchyItem item;
+  // ccls extension: skip the first |offset| calls. At most xref.maxNum calls
+  // are returned per request.
+  int offset = 0;
+};
+REFLECT_STRUCT(CallsParam, item, offset);
+
+struct CallHierarchyIncomingCall {
+  CallHierarchyItem from;
+  std::vector<lsRange> fromRanges;
+};
+REFLECT_STRUCT(CallHierarchyIncomingCall, from, fromRanges);
+
+struct CallHierarchyOutgoingCall {
+  CallHierarchyItem to;
+  std::vector<lsRange> fromRanges;
+};
+REFLECT_STRUCT(CallHierarchyOutgoingCall, to, fromRanges);
+
+std::optional<CallHierarchyItem> buildItem(MessageHandler *m, Usr usr) {
+  if (!m->db->hasFunc(usr))
+    return {};
+  const QueryFunc::Def *def = m->db->getFunc(usr).anyDef();
+  if (!def || !def->spell)
+    return {};
+  LocationLink link = getLocationLink(m->db, m->wfiles, *def->spell);
+  if (link.targetUri.empty())
+    return {};
+  CallHierarchyItem item;
+  item.name = def->name(false);
+  item.kind = def->kind;
+  item.detail = def->detailed_name;
+  item.uri = std::move(link.targetUri);
+  item.range = link.targetRange;
+  item.selectionRange = link.targetSelectionRange;
+  item.data = std::to_string(usr);
+  return item;
+}
+
+// Callers or callees of a function with the call sites, each in the file of
+// the caller.
+using Calls = std::vector<std::pair<Usr, std::vector<Use>>>;
+
+// Computing the callers of a widely used function is expensive and clients
+// ask for the same node repeatedly while paging, so calls are memoized per
+// function until the index changes. Only used on the main thread.
+const Calls &getCalls(DB *db, Usr usr, bool outgoing) {
+  static uint64_t generation = ~uint64_t(0);
+  static std::unordered_map<Usr, Calls> memo[2];
+  if (generation != db->generation) {
+    generation = db->generation;
+    memo[0].clear();
+    memo[1].clear();
+  }
+  auto [it, inserted] = memo[outgoing].try_emplace(usr);
+  Calls &calls = it->second;
+  if (!inserted || !db->hasFunc(usr))
+    return calls;
+  std::unordered_map<Usr, size_t> usr2idx;
+  auto add = [&](Usr usr1, Use use) {
+    auto [it1, inserted1] = usr2idx.try_emplace(usr1, calls.size());
+    if (inserted1)
+      calls.emplace_back(usr1, std::vector<Use>());
+    calls[it1->second].second.push_back(use);
+  };
+  const QueryFunc &func = db->getFunc(usr);
+  if (outgoing) {
+    if (const QueryFunc::Def *def = func.anyDef())
+      for (SymbolRef sym : def->callees)
+        if (sym.kind == Kind::Func)
+          add(sym.usr, Use{{sym.range, sym.role}, def->file_id});
+  } else {
+    for (Use use : func.uses)
+      if (auto caller = findEnclosingFunc(db->files[use.file_id], use.range))
+        add(caller->usr, use);
+  }
+  return calls;
+}
+
+template <typename Out>
+void replyCalls(MessageHandler *m, JsonReader &reader, ReplyOnce &reply,
+                bool outgoing) {
+  CallsParam param;
+  reflect(reader, param);
+  std::vector<Out> result;
+  Usr usr;
+  try {
+    usr = std::stoull(param.item.data);
+  } catch (...) {
+    reply(result);
+    return;
+  }
+  const Calls &calls = getCalls(m->db, usr, outgoing);
+  size_t i = std::max(param.offset, 0);
+  for (; i < calls.size() && (int)result.size() < g_config->xref.maxNum; i++) {
+    auto &[usr1, uses] = calls[i];
+    std::optional<CallHierarchyItem> item = buildItem(m, usr1);
+    if (!item)
+      continue;
+    Out &call = result.emplace_back();
+    for (Use use : uses)
+      if (auto loc = getLsLocation(m->db, m->wfiles, use))
+        call.fromRanges.push_back(loc->range);
+    if constexpr (std::is_same_v<Out, CallHierarchyOutgoingCall>)
+      call.to = std::move(*item);
+    else
+      call.from = std::move(*item);
+  }
+  reply(result);
+}
 } // namespace
 
+void MessageHandler::callHierarchy_incomingCalls(JsonReader &reader,
+                                                 ReplyOnce &reply) {
+  replyCalls<CallHierarchyIncomingCall>(this, reader, reply, false);
+}
+
+void MessageHandler::callHierarchy_outgoingCalls(JsonReader &reader,
+                                                 ReplyOnce &reply) {
+  replyCalls<CallHierarchyOutgoingCall>(this, reader, reply, true);
+}
+
+void MessageHandler::textDocument_prepareCallHierarchy(
+    TextDocumentPositionParam &param, ReplyOnce &reply) {
+  auto [file, wf] = findOrFail(param.textDocument.uri.getPath(), reply);
+  if (!wf)
+    return;
+  std::vector<CallHierarchyItem> result;
+  for (SymbolRef sym : findSymbolsAtLocation(wf, file, param.position))
+    if (sym.kind == Kind::Func) {
+      if (auto item = buildItem(this, sym.usr))
+        result.push_back(std::move(*item));
+      break;
+    }
+  reply(result);
+}
+
 void MessageHandler::ccls_call(JsonReader &reader, ReplyOnce &reply) {
   Param param;
   reflect(reader, param);
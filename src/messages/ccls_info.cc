@@ -1,15 +1,28 @@
 // Copyright 2017-2018 ccls Authors
 // SPDX-License-Identifier: Apache-2.0
 
+#include "allocator.hh"
 #include "message_handler.hh"
 #include "pipeline.hh"
 #include "project.hh"
 #include "query.hh"
+#include "sema_manager.hh"
+#include "trace.hh"
+#include "working_files.hh"
+
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/Twine.h>
+
+#include <algorithm>
+#include <stdint.h>
+
+using namespace llvm;
 
 namespace ccls {
+REFLECT_STRUCT(ArenaStats, name, allocated, active);
 REFLECT_STRUCT(IndexInclude, line, resolved_path);
 REFLECT_STRUCT(QueryFile::Def, path, args, language, dependencies, includes,
-               skipped_ranges);
+               skipped_ranges, partial);
 
 namespace {
 struct Out_cclsInfo {
@@ -44,6 +57,590 @@ void MessageHandler::ccls_info(EmptyParam &, ReplyOnce &reply) {
   reply(result);
 }
 
+namespace {
+struct StatsParam {
+  // "json" or "prometheus" (text exposition format)
+  std::string format = "json";
+};
+REFLECT_STRUCT(StatsParam, format);
+
+struct Out_cclsStats {
+  struct Histogram {
+    int64_t count;
+    double sum;
+    std::vector<int64_t> buckets;
+  };
+  struct Method {
+    std::string method;
+    Histogram wait, handle;
+  };
+  struct Queues {
+    int64_t onRequest, indexRequest, onIndexed, forStdout;
+  } queues;
+  struct Indexer {
+    int64_t indexed, indexedBytes;
+    // Rates are per second of indexer thread time.
+    double seconds, filesPerSecond, bytesPerSecond;
+    int64_t cacheHits, cacheMisses;
+    double cacheHitRate;
+    // Seconds indexer threads were blocked by a full on_indexed queue.
+    double updateStallSeconds;
+    // Updates composed into a later update of the same file.
+    int64_t updatesMerged;
+    // Removed by cache.gcDays.
+    int64_t cacheGcFiles, cacheGcBytes;
+    // Read from an older cache format and rewritten.
+    int64_t cacheMigrated;
+    // See index.timeout, index.memoryLimit and index.quarantine.
+    int64_t indexAborted, quarantineSkipped;
+    std::vector<std::string> quarantined;
+  } indexer;
+  // Time requests waited in index_request, by priority class.
+  struct IndexWait {
+    std::string priority;
+    int64_t count;
+    double seconds, maxSeconds;
+  };
+  std::vector<IndexWait> indexWait;
+  // Approximate heap usage of DB in bytes, excluding interned strings.
+  struct Memory {
+    int64_t files, funcs, types, vars, usrMaps;
+  } memory;
+  // Sessions of SemaManager and the memory of their preambles in bytes.
+  struct Sema {
+    int64_t sessions, preambleBytes, preambleBudget, evictions;
+  } sema;
+  // Moving average of the diagnostics time and the last didChange debounce
+  // (milliseconds) of each diagnosed file, see diagnostics.onChangeMin.
+  struct Diagnostics {
+    struct File {
+      std::string path;
+      double seconds;
+      int debounce;
+      bool heavy;
+    };
+    std::vector<File> files;
+    // Running tasks of heavy files, see SemaManager::kHeavyDiagMs.
+    int64_t heavy;
+  } diagnostics;
+  // Hardware counters of trace spans by name, with --perf-counters.
+  struct Stage {
+    std::string name;
+    int64_t count;
+    double seconds;
+    int64_t cycles, instructions, llcMisses, branchMisses;
+    // Instructions per cycle.
+    double ipc;
+  };
+  std::vector<Stage> stages;
+  // Arenas of the allocator. See allocator.hh.
+  struct Allocator {
+    std::string name;
+    std::vector<ArenaStats> arenas;
+  } allocator;
+  // Upper bounds of histogram buckets in milliseconds.
+  std::vector<int> bucketBounds;
+  std::vector<Method> methods;
+};
+REFLECT_STRUCT(Out_cclsStats::Histogram, count, sum, buckets);
+REFLECT_STRUCT(Out_cclsStats::Method, method, wait, handle);
+REFLECT_STRUCT(Out_cclsStats::Queues, onRequest, indexRequest, onIndexed,
+               forStdout);
+REFLECT_STRUCT(Out_cclsStats::Indexer, indexed, indexedBytes, seconds,
+               filesPerSecond, bytesPerSecond, cacheHits, cacheMisses,
+               cacheHitRate, updateStallSeconds, updatesMerged, cacheGcFiles,
+               cacheGcBytes, cacheMigrated, indexAborted, quarantineSkipped,
+               quarantined);
+REFLECT_STRUCT(Out_cclsStats::IndexWait, priority, count, seconds, maxSeconds);
+REFLECT_STRUCT(Out_cclsStats::Memory, files, funcs, types, vars, usrMaps);
+REFLECT_STRUCT(Out_cclsStats::Sema, sessions, preambleBytes, preambleBudget,
+               evictions);
+REFLECT_STRUCT(Out_cclsStats::Diagnostics::File, path, seconds, debounce,
+               heavy);
+REFLECT_STRUCT(Out_cclsStats::Diagnostics, files, heavy);
+REFLECT_STRUCT(Out_cclsStats::Stage, name, count, seconds, cycles,
+               instructions, llcMisses, branchMisses, ipc);
+REFLECT_STRUCT(Out_cclsStats::Allocator, name, arenas);
+REFLECT_STRUCT(Out_cclsStats, queues, indexer, indexWait, memory, sema,
+               diagnostics, stages, allocator, bucketBounds, methods);
+
+template <typename T> int64_t bytes(const std::vector<T> &v) {
+  return v.capacity() * sizeof(T);
+}
+template <typename T> int64_t bytes(const Vec<T> &v) {
+  return v.size() * sizeof(T);
+}
+template <typename Def> int64_t bytes(const SmallVector<Def, 1> &v) {
+  return v.size() > 1 ? v.capacity_in_bytes() : 0;
+}
+
+int64_t bytes(const QueryFunc::Def &def) {
+  return bytes(def.bases) + bytes(def.vars) + bytes(def.callees);
+}
+int64_t bytes(const QueryType::Def &def) {
+  return bytes(def.bases) + bytes(def.funcs) + bytes(def.types) +
+         bytes(def.vars);
+}
+int64_t bytes(const QueryVar::Def &) { return 0; }
+
+int64_t bytes(const QueryFunc &func) {
+  return bytes(func.declarations) + bytes(func.derived);
+}
+int64_t bytes(const QueryType &type) {
+  return bytes(type.declarations) + bytes(type.derived) +
+         bytes(type.instances);
+}
+int64_t bytes(const QueryVar &var) { return bytes(var.declarations); }
+
+template <typename Q> int64_t entityBytes(const SmallVectorImpl<Q> &entities) {
+  int64_t ret = entities.capacity_in_bytes();
+  for (const Q &entity : entities) {
+    ret += bytes(entity) + bytes(entity.def) +
+           entity.uses.size() * (sizeof(Range) + sizeof(Role));
+    for (auto &def : entity.def)
+      ret += bytes(def);
+  }
+  return ret;
+}
+
+int64_t bytes(const QueryFile &file) {
+  int64_t ret = file.symbol2refcnt.getMemorySize() +
+                bytes(file.sorted_symbols) + bytes(file.func_extents) +
+                bytes(file.symbol_occurrences);
+  if (auto &def = file.def)
+    ret += def->path.capacity() + bytes(def->includes) +
+           bytes(def->skipped_ranges) + bytes(def->dependencies);
+  return ret;
+}
+
+void fillMemory(DB &db, Out_cclsStats::Memory &m) {
+  m.files = db.files.capacity() * sizeof(QueryFile);
+  for (QueryFile &file : db.files)
+    m.files += bytes(file);
+  m.funcs = entityBytes(db.funcs);
+  m.types = entityBytes(db.types);
+  m.vars = entityBytes(db.vars);
+  m.usrMaps = db.func_usr.getMemorySize() + db.type_usr.getMemorySize() +
+              db.var_usr.getMemorySize();
+}
+
+Out_cclsStats::Histogram toHistogram(const LatencyHistogram &h) {
+  return {h.count, h.sum, {std::begin(h.buckets), std::end(h.buckets)}};
+}
+
+void writeHistogram(std::string &out, const char *name, StringRef method,
+                    const Out_cclsStats::Histogram &h) {
+  int64_t n = 0;
+  for (size_t i = 0; i < h.buckets.size(); i++) {
+    n += h.buckets[i];
+    std::string le = i < std::size(LatencyHistogram::kBounds)
+                         ? std::to_string(LatencyHistogram::kBounds[i])
+                         : "+Inf";
+    out += (Twine(name) + "_bucket{method=\"" + method + "\",le=\"" + le +
+            "\"} " + Twine(n) + "\n")
+               .str();
+  }
+  out += (Twine(name) + "_sum{method=\"" + method + "\"} " +
+          std::to_string(h.sum) + "\n" + name + "_count{method=\"" + method +
+          "\"} " + Twine(h.count) + "\n")
+             .str();
+}
+
+std::string toPrometheus(const Out_cclsStats &r) {
+  std::string out;
+  auto metric = [&](const char *type, const char *name, const char *labels,
+                    const std::string &value) {
+    if (type)
+      out += (Twine("# TYPE ") + name + " " + type + "\n").str();
+    out += (Twine(name) + labels + " " + value + "\n").str();
+  };
+  auto i64 = [](int64_t v) { return std::to_string(v); };
+  out += "# TYPE ccls_request_wait_milliseconds histogram\n";
+  for (auto &m : r.methods)
+    writeHistogram(out, "ccls_request_wait_milliseconds", m.method, m.wait);
+  out += "# TYPE ccls_request_handle_milliseconds histogram\n";
+  for (auto &m : r.methods)
+    writeHistogram(out, "ccls_request_handle_milliseconds", m.method,
+                   m.handle);
+  metric("gauge", "ccls_queue_depth", "{queue=\"on_request\"}",
+         i64(r.queues.onRequest));
+  metric(nullptr, "ccls_queue_depth", "{queue=\"index_request\"}",
+         i64(r.queues.indexRequest));
+  metric(nullptr, "ccls_queue_depth", "{queue=\"on_indexed\"}",
+         i64(r.queues.onIndexed));
+  metric(nullptr, "ccls_queue_depth", "{queue=\"for_stdout\"}",
+         i64(r.queues.forStdout));
+  metric("counter", "ccls_indexed_files_total", "", i64(r.indexer.indexed));
+  metric("counter", "ccls_indexed_bytes_total", "",
+         i64(r.indexer.indexedBytes));
+  metric("counter", "ccls_index_seconds_total", "",
+         std::to_string(r.indexer.seconds));
+  metric("counter", "ccls_index_update_stall_seconds_total", "",
+         std::to_string(r.indexer.updateStallSeconds));
+  metric("counter", "ccls_index_updates_merged_total", "",
+         i64(r.indexer.updatesMerged));
+  metric("counter", "ccls_cache_gc_bytes_total", "",
+         i64(r.indexer.cacheGcBytes));
+  metric("counter", "ccls_index_aborted_total", "",
+         i64(r.indexer.indexAborted));
+  metric("gauge", "ccls_index_quarantined", "",
+         i64(r.indexer.quarantined.size()));
+  out += "# TYPE ccls_index_wait_seconds summary\n";
+  for (auto &w : r.indexWait) {
+    std::string labels = "{priority=\"" + w.priority + "\"}";
+    metric(nullptr, "ccls_index_wait_seconds_sum", labels.c_str(),
+           std::to_string(w.seconds));
+    metric(nullptr, "ccls_index_wait_seconds_count", labels.c_str(),
+           i64(w.count));
+  }
+  const char *type = "gauge";
+  for (auto &w : r.indexWait) {
+    std::string labels = "{priority=\"" + w.priority + "\"}";
+    metric(type, "ccls_index_wait_max_seconds", labels.c_str(),
+           std::to_string(w.maxSeconds));
+    type = nullptr;
+  }
+  metric("counter", "ccls_cache_loads_total", "{result=\"hit\"}",
+         i64(r.indexer.cacheHits));
+  metric(nullptr, "ccls_cache_loads_total", "{result=\"miss\"}",
+         i64(r.indexer.cacheMisses));
+  metric("gauge", "ccls_db_bytes", "{component=\"files\"}",
+         i64(r.memory.files));
+  metric(nullptr, "ccls_db_bytes", "{component=\"funcs\"}",
+         i64(r.memory.funcs));
+  metric(nullptr, "ccls_db_bytes", "{component=\"types\"}",
+         i64(r.memory.types));
+  metric(nullptr, "ccls_db_bytes", "{component=\"vars\"}",
+         i64(r.memory.vars));
+  metric(nullptr, "ccls_db_bytes", "{component=\"usr_maps\"}",
+         i64(r.memory.usrMaps));
+  metric("gauge", "ccls_sema_sessions", "", i64(r.sema.sessions));
+  metric("gauge", "ccls_sema_preamble_bytes", "", i64(r.sema.preambleBytes));
+  metric("gauge", "ccls_sema_preamble_budget_bytes", "",
+         i64(r.sema.preambleBudget));
+  metric("counter", "ccls_sema_evictions_total", "", i64(r.sema.evictions));
+  for (auto [name, field] :
+       {std::pair("ccls_stage_cycles_total", &Out_cclsStats::Stage::cycles),
+        {"ccls_stage_instructions_total", &Out_cclsStats::Stage::instructions},
+        {"ccls_stage_llc_misses_total", &Out_cclsStats::Stage::llcMisses},
+        {"ccls_stage_branch_misses_total",
+         &Out_cclsStats::Stage::branchMisses}}) {
+    type = "counter";
+    for (auto &st : r.stages) {
+      std::string labels = "{stage=\"" + st.name + "\"}";
+      metric(type, name, labels.c_str(), i64(st.*field));
+      type = nullptr;
+    }
+  }
+  type = "gauge";
+  for (auto &a : r.allocator.arenas) {
+    std::string labels = "{arena=\"" + a.name + "\",state=\"";
+    metric(type, "ccls_allocator_bytes", (labels + "allocated\"}").c_str(),
+           i64(a.allocated));
+    metric(nullptr, "ccls_allocator_bytes", (labels + "active\"}").c_str(),
+           i64(a.active));
+    type = nullptr;
+  }
+  return out;
+}
+} // namespace
+
+void MessageHandler::ccls_stats(JsonReader &reader, ReplyOnce &reply) {
+  StatsParam param;
+  reflect(reader, param);
+  Out_cclsStats result;
+  QueueDepths q = pipeline::queueDepths();
+  result.queues = {q.on_request, q.index_request, q.on_indexed, q.for_stdout};
+
+  auto &st = pipeline::stats;
+  Out_cclsStats::Indexer &ix = result.indexer;
+  ix.indexed = st.indexed;
+  ix.indexedBytes = st.indexed_bytes;
+  ix.seconds = st.index_us / 1e6;
+  ix.filesPerSecond = ix.seconds > 0 ? ix.indexed / ix.seconds : 0;
+  ix.bytesPerSecond = ix.seconds > 0 ? ix.indexedBytes / ix.seconds : 0;
+  ix.cacheHits = st.cache_hits;
+  ix.cacheMisses = st.cache_misses;
+  int64_t loads = ix.cacheHits + ix.cacheMisses;
+  ix.cacheHitRate = loads ? double(ix.cacheHits) / loads : 0;
+  ix.updateStallSeconds = st.update_stall_us / 1e6;
+  ix.updatesMerged = st.updates_merged;
+  ix.cacheGcFiles = st.cache_gc_files;
+  ix.cacheGcBytes = st.cache_gc_bytes;
+  ix.cacheMigrated = st.cache_migrated;
+  ix.indexAborted = st.index_aborted;
+  ix.quarantineSkipped = st.quarantine_skipped;
+  ix.quarantined = pipeline::quarantined();
+  const char *priorities[] = {"onChange", "normal", "background"};
+  for (int i = 0; i < 3; i++)
+    result.indexWait.push_back({priorities[i], st.wait_count[i],
+                                st.wait_us[i] / 1e6, st.max_wait_us[i] / 1e6});
+
+  fillMemory(*db, result.memory);
+  {
+    std::lock_guard lock(manager->mutex);
+    auto &sessions = manager->sessions;
+    result.sema = {int64_t(sessions.size()), int64_t(sessions.getWeight()),
+                   int64_t(sessions.getMaxWeight()),
+                   sessions.getWeightEvictions()};
+  }
+  {
+    std::lock_guard lock(manager->diag_mutex);
+    for (auto &[path, cost] : manager->diag_cost)
+      result.diagnostics.files.push_back(
+          {path, cost.ms / 1e3, cost.debounce,
+           cost.ms > SemaManager::kHeavyDiagMs});
+    result.diagnostics.heavy = manager->diag_heavy;
+  }
+  llvm::sort(result.diagnostics.files,
+             [](auto &l, auto &r) { return l.path < r.path; });
+  for (trace::StageCounters &st : trace::stageCounters())
+    result.stages.push_back(
+        {st.name, st.count, st.us / 1e6, st.cycles, st.instructions,
+         st.llc_misses, st.branch_misses,
+         st.cycles ? double(st.instructions) / st.cycles : 0});
+  llvm::sort(result.stages,
+             [](auto &l, auto &r) { return l.name < r.name; });
+  result.allocator = {allocatorName(), getArenaStats()};
+  result.bucketBounds.assign(std::begin(LatencyHistogram::kBounds),
+                             std::end(LatencyHistogram::kBounds));
+  {
+    std::lock_guard lock(method_stats_mutex);
+    for (auto &it : method_stats)
+      result.methods.push_back({it.first().str(), toHistogram(it.second.wait),
+                                toHistogram(it.second.handle)});
+  }
+  llvm::sort(result.methods,
+             [](auto &l, auto &r) { return l.method < r.method; });
+
+  if (param.format == "prometheus") {
+    std::string text = toPrometheus(result);
+    reply(text);
+  } else {
+    reply(result);
+  }
+}
+
+namespace {
+struct MemoryParam {
+  // Number of files and of entities to return.
+  int maxNum = 20;
+};
+REFLECT_STRUCT(MemoryParam, maxNum);
+
+struct Out_cclsMemory {
+  struct Component {
+    std::string name;
+    int64_t bytes;
+  };
+  struct File {
+    std::string path;
+    int64_t bytes;
+    // Symbol occurrences in symbol2refcnt.
+    int64_t symbols;
+  };
+  struct Entity {
+    Usr usr;
+    std::string_view name;
+    Kind kind;
+    int64_t bytes;
+    int64_t uses;
+  };
+  std::vector<Component> components;
+  // The files and entities of DB with the most bytes.
+  std::vector<File> files;
+  std::vector<Entity> entities;
+};
+REFLECT_STRUCT(Out_cclsMemory::Component, name, bytes);
+REFLECT_STRUCT(Out_cclsMemory::File, path, bytes, symbols);
+REFLECT_STRUCT(Out_cclsMemory::Entity, usr, name, kind, bytes, uses);
+REFLECT_STRUCT(Out_cclsMemory, components, files, entities);
+
+template <typename Q>
+void addEntities(const SmallVectorImpl<Q> &entities, Kind kind,
+                 std::vector<Out_cclsMemory::Entity> &out) {
+  for (const Q &entity : entities) {
+    int64_t n = bytes(entity) + bytes(entity.def) +
+                entity.uses.size() * (sizeof(Range) + sizeof(Role));
+    for (auto &def : entity.def)
+      n += bytes(def);
+    std::string_view name;
+    if (auto *def = entity.anyDef())
+      name = def->name(true);
+    out.push_back({entity.usr, name, kind, n, int64_t(entity.uses.size())});
+  }
+}
+} // namespace
+
+// Approximate memory by component, with the largest files and entities of
+// DB, to guide retention and filtering settings.
+void MessageHandler::ccls_memory(JsonReader &reader, ReplyOnce &reply) {
+  MemoryParam param;
+  reflect(reader, param);
+  size_t n = std::max(param.maxNum, 0);
+  Out_cclsMemory result;
+  Out_cclsStats::Memory m;
+  fillMemory(*db, m);
+  result.components = {{"db.files", m.files},
+                       {"db.funcs", m.funcs},
+                       {"db.types", m.types},
+                       {"db.vars", m.vars},
+                       {"db.usrMaps", m.usrMaps}};
+  result.components.push_back({"index", pipeline::inMemoryIndexBytes()});
+  {
+    int64_t wf_bytes = 0;
+    std::lock_guard lock(wfiles->mutex);
+    for (auto &[_, wf] : wfiles->files) {
+      wf_bytes += wf->buffer_content.capacity() + bytes(wf->index_to_buffer) +
+                  bytes(wf->buffer_to_index) + bytes(wf->index_hashes) +
+                  bytes(wf->buffer_hashes) + bytes(wf->line_starts) +
+                  wf->highlight.capacity() + wf->document_symbols.capacity();
+      for (auto &lines : {&wf->index_lines, &wf->buffer_lines})
+        for (auto &line : *lines)
+          wf_bytes += sizeof(line) + line.capacity();
+    }
+    result.components.push_back({"workingFiles", wf_bytes});
+  }
+  {
+    std::lock_guard lock(manager->mutex);
+    result.components.push_back(
+        {"sema.preambles", int64_t(manager->sessions.getWeight())});
+  }
+  result.components.push_back(
+      {"other", [&] {
+         int64_t allocated = 0, accounted = 0;
+         for (ArenaStats &a : getArenaStats())
+           allocated += a.allocated;
+         for (auto &c : result.components)
+           accounted += c.bytes;
+         return std::max(allocated - accounted, int64_t(0));
+       }()});
+
+  for (QueryFile &file : db->files)
+    if (file.def)
+      result.files.push_back(
+          {file.def->path, bytes(file), int64_t(file.symbol2refcnt.size())});
+  auto files_end = result.files.begin() + std::min(n, result.files.size());
+  std::partial_sort(
+      result.files.begin(), files_end, result.files.end(),
+      [](auto &l, auto &r) { return l.bytes > r.bytes; });
+  result.files.erase(files_end, result.files.end());
+
+  addEntities(db->funcs, Kind::Func, result.entities);
+  addEntities(db->types, Kind::Type, result.entities);
+  addEntities(db->vars, Kind::Var, result.entities);
+  auto entities_end =
+      result.entities.begin() + std::min(n, result.entities.size());
+  std::partial_sort(
+      result.entities.begin(), entities_end, result.entities.end(),
+      [](auto &l, auto &r) { return l.bytes > r.bytes; });
+  result.entities.erase(entities_end, result.entities.end());
+  reply(result);
+}
+
+namespace {
+struct IndexReportParam {
+  // Number of translation units and of headers to return.
+  int maxNum = 20;
+  // Translation units are ranked by "wall", "parse", "consumer", "memory",
+  // "bytes" or "headers". Headers are ranked by bytes.
+  std::string sortBy = "wall";
+};
+REFLECT_STRUCT(IndexReportParam, maxNum, sortBy);
+
+struct Out_indexReport {
+  struct TU {
+    std::string path;
+    // Seconds of indexing, of the clang parse, and of the index consumer
+    // during the parse, at the last index, which may be in an earlier session.
+    double wall, parse, consumer;
+    // Estimated bytes used by clang, see index.memoryBudget.
+    int64_t memory;
+    // Bytes of the cache files of the translation unit and its headers.
+    int64_t bytes;
+    int headers;
+  };
+  struct Header {
+    std::string path;
+    // The translation unit it was indexed with.
+    std::string tu;
+    int64_t bytes;
+  };
+  std::vector<TU> translationUnits;
+  std::vector<Header> headers;
+};
+REFLECT_STRUCT(Out_indexReport::TU, path, wall, parse, consumer, memory, bytes,
+               headers);
+REFLECT_STRUCT(Out_indexReport::Header, path, tu, bytes);
+REFLECT_STRUCT(Out_indexReport, translationUnits, headers);
+} // namespace
+
+// The costliest translation units and the largest headers indexed or loaded
+// from the cache in this session, to find pathological includes.
+void MessageHandler::ccls_indexReport(JsonReader &reader, ReplyOnce &reply) {
+  IndexReportParam param;
+  reflect(reader, param);
+  std::vector<std::pair<std::string, TUCost>> tus;
+  std::vector<std::pair<std::string, HeaderCost>> headers;
+  pipeline::indexCosts(tus, headers);
+
+  auto key = [&](const TUCost &c) -> int64_t {
+    if (param.sortBy == "parse")
+      return c.cost.parse_us;
+    if (param.sortBy == "consumer")
+      return c.cost.consumer_us;
+    if (param.sortBy == "memory")
+      return c.memory;
+    if (param.sortBy == "bytes")
+      return c.bytes;
+    if (param.sortBy == "headers")
+      return c.cost.headers;
+    return c.cost.wall_us;
+  };
+  size_t n = std::max(param.maxNum, 0);
+  auto tu_end = tus.begin() + std::min(n, tus.size());
+  std::partial_sort(tus.begin(), tu_end, tus.end(), [&](auto &l, auto &r) {
+    return key(l.second) > key(r.second);
+  });
+  auto header_end = headers.begin() + std::min(n, headers.size());
+  std::partial_sort(headers.begin(), header_end, headers.end(),
+                    [](auto &l, auto &r) {
+                      return l.second.bytes > r.second.bytes;
+                    });
+
+  Out_indexReport result;
+  for (auto it = tus.begin(); it != tu_end; ++it) {
+    const TUCost &c = it->second;
+    result.translationUnits.push_back(
+        {it->first, c.cost.wall_us / 1e6, c.cost.parse_us / 1e6,
+         c.cost.consumer_us / 1e6, c.memory, c.bytes, c.cost.headers});
+  }
+  for (auto it = headers.begin(); it != header_end; ++it)
+    result.headers.push_back({it->first, it->second.tu, it->second.bytes});
+  reply(result);
+}
+
+struct DependentsParam : TextDocumentParam {
+  // If true, only return main files of project entries.
+  bool mainFiles = false;
+};
+REFLECT_STRUCT(DependentsParam, textDocument, mainFiles);
+
+void MessageHandler::ccls_dependents(JsonReader &reader, ReplyOnce &reply) {
+  DependentsParam param;
+  reflect(reader, param);
+  std::vector<std::string> result;
+  int file_id;
+  if (findFile(param.textDocument.uri.getPath(), &file_id))
+    for (int id : db->getDependents(file_id, SIZE_MAX)) {
+      QueryFile &file = db->files[id];
+      if (file.def &&
+          (!param.mainFiles || project->isMainFile(file.def->path)))
+        result.push_back(file.def->path);
+    }
+  reply(result);
+}
+
 struct FileInfoParam : TextDocumentParam {
   bool dependencies = false;
   bool includes = false;
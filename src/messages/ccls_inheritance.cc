@@ -65,7 +65,9 @@ bool expandHelper(MessageHandler *m, Out_cclsInheritance *entry, bool derived,
   std::unordered_set<Usr> seen;
   if (derived) {
     if (levels > 0) {
-      for (auto usr : entity.derived) {
+      for (EntityId id : entity.derived) {
+        Usr usr = entry->kind == Kind::Func ? m->db->funcs[id].usr
+                                            : m->db->types[id].usr;
         if (!seen.insert(usr).second)
           continue;
         Out_cclsInheritance entry1;
@@ -10,6 +10,7 @@
 #include <clang/AST/Type.h>
 #include <llvm/ADT/DenseSet.h>
 
+#include <algorithm>
 #include <unordered_set>
 
 namespace ccls {
@@ -28,10 +29,14 @@ struct Param : TextDocumentPositionParam {
   // member variables.
   Kind kind = Kind::Var;
   bool hierarchy = false;
+  // If limit is positive, only the children [offset, offset+limit) of the
+  // requested node are built, and numChildren of the node is the number of
+  // all of them, so that types with huge member lists can be paged.
+  int offset = 0, limit = 0;
 };
 
 REFLECT_STRUCT(Param, textDocument, position, id, qualified, levels, kind,
-               hierarchy);
+               hierarchy, offset, limit);
 
 struct Out_cclsMember {
   Usr usr;
@@ -48,8 +53,21 @@ struct Out_cclsMember {
 REFLECT_STRUCT(Out_cclsMember, id, name, fieldName, location, numChildren,
                children);
 
+// The children of the requested node to build. See Param::limit.
+struct Window {
+  int offset, limit, n = 0;
+};
+
+// Counts a child and returns true if it should be built.
+bool take(Window *w) {
+  if (!w)
+    return true;
+  int i = w->n++;
+  return w->offset <= i && i < w->offset + w->limit;
+}
+
 bool expand(MessageHandler *m, Out_cclsMember *entry, bool qualified,
-            int levels, Kind memberKind);
+            int levels, Kind memberKind, Window *window = nullptr);
 
 // Add a field to |entry| which is a Func/Type.
 void doField(MessageHandler *m, Out_cclsMember *entry, const QueryVar &var,
@@ -95,7 +113,7 @@ void doField(MessageHandler *m, Out_cclsMember *entry, const QueryVar &var,
 
 // Expand a type node by adding members recursively to it.
 bool expand(MessageHandler *m, Out_cclsMember *entry, bool qualified,
-            int levels, Kind memberKind) {
+            int levels, Kind memberKind, Window *window) {
   if (0 < entry->usr && entry->usr <= BuiltinType::LastKind) {
     entry->name = clangBuiltinTypeName(int(entry->usr));
     return true;
@@ -126,6 +144,8 @@ bool expand(MessageHandler *m, Out_cclsMember *entry, bool qualified,
           }
         }
       if (def->alias_of) {
+        if (!take(window))
+          continue;
         const QueryType::Def *def1 = m->db->getType(def->alias_of).anyDef();
         Out_cclsMember entry1;
         entry1.id = std::to_string(def->alias_of);
@@ -156,7 +176,8 @@ bool expand(MessageHandler *m, Out_cclsMember *entry, bool qualified,
           for (Usr usr : def.funcs)
             if (seen1.insert(usr).second) {
               QueryFunc &func1 = m->db->getFunc(usr);
-              if (const QueryFunc::Def *def1 = func1.anyDef()) {
+              const QueryFunc::Def *def1 = func1.anyDef();
+              if (def1 && take(window)) {
                 Out_cclsMember entry1;
                 entry1.fieldName = def1->name(false);
                 if (def1->spell) {
@@ -176,7 +197,8 @@ bool expand(MessageHandler *m, Out_cclsMember *entry, bool qualified,
           for (Usr usr : def.types)
             if (seen1.insert(usr).second) {
               QueryType &type1 = m->db->getType(usr);
-              if (const QueryType::Def *def1 = type1.anyDef()) {
+              const QueryType::Def *def1 = type1.anyDef();
+              if (def1 && take(window)) {
                 Out_cclsMember entry1;
                 entry1.fieldName = def1->name(false);
                 if (def1->spell) {
@@ -196,12 +218,12 @@ bool expand(MessageHandler *m, Out_cclsMember *entry, bool qualified,
           for (auto it : def.vars)
             if (seen1.insert(it.first).second) {
               QueryVar &var = m->db->getVar(it.first);
-              if (!var.def.empty())
+              if (!var.def.empty() && take(window))
                 doField(m, entry, var, it.second, qualified, levels - 1);
             }
       }
     }
-    entry->numChildren = int(entry->children.size());
+    entry->numChildren = window ? window->n : int(entry->children.size());
   } else
     entry->numChildren = def->alias_of ? 1 : int(def->vars.size());
   return true;
@@ -209,7 +231,8 @@ bool expand(MessageHandler *m, Out_cclsMember *entry, bool qualified,
 
 std::optional<Out_cclsMember> buildInitial(MessageHandler *m, Kind kind,
                                            Usr root_usr, bool qualified,
-                                           int levels, Kind memberKind) {
+                                           int levels, Kind memberKind,
+                                           Window *window) {
   switch (kind) {
   default:
     return {};
@@ -227,9 +250,11 @@ std::optional<Out_cclsMember> buildInitial(MessageHandler *m, Kind kind,
     }
     for (Usr usr : def->vars) {
       auto &var = m->db->getVar(usr);
-      if (var.def.size())
+      if (var.def.size() && take(window))
         doField(m, &entry, var, -1, qualified, levels - 1);
     }
+    if (window)
+      entry.numChildren = window->n;
     return entry;
   }
   case Kind::Type: {
@@ -244,7 +269,7 @@ std::optional<Out_cclsMember> buildInitial(MessageHandler *m, Kind kind,
       if (auto loc = getLsLocation(m->db, m->wfiles, *def->spell))
         entry.location = *loc;
     }
-    expand(m, &entry, qualified, levels, memberKind);
+    expand(m, &entry, qualified, levels, memberKind, window);
     return entry;
   }
   }
@@ -254,6 +279,8 @@ std::optional<Out_cclsMember> buildInitial(MessageHandler *m, Kind kind,
 void MessageHandler::ccls_member(JsonReader &reader, ReplyOnce &reply) {
   Param param;
   reflect(reader, param);
+  Window window{std::max(param.offset, 0), param.limit};
+  Window *w = param.limit > 0 ? &window : nullptr;
   std::optional<Out_cclsMember> result;
   if (param.id.size()) {
     try {
@@ -266,7 +293,8 @@ void MessageHandler::ccls_member(JsonReader &reader, ReplyOnce &reply) {
     result->usr = param.usr;
     // entry.name is empty as it is known by the client.
     if (!(db->hasType(param.usr) &&
-          expand(this, &*result, param.qualified, param.levels, param.kind)))
+          expand(this, &*result, param.qualified, param.levels, param.kind,
+                 w)))
       result.reset();
   } else {
     auto [file, wf] = findOrFail(param.textDocument.uri.getPath(), reply);
@@ -277,13 +305,13 @@ void MessageHandler::ccls_member(JsonReader &reader, ReplyOnce &reply) {
       case Kind::Func:
       case Kind::Type:
         result = buildInitial(this, sym.kind, sym.usr, param.qualified,
-                              param.levels, param.kind);
+                              param.levels, param.kind, w);
         break;
       case Kind::Var: {
         const QueryVar::Def *def = db->getVar(sym).anyDef();
         if (def && def->type)
           result = buildInitial(this, Kind::Type, def->type, param.qualified,
-                                param.levels, param.kind);
+                                param.levels, param.kind, w);
         break;
       }
       default:
@@ -1,31 +1,104 @@
 // Copyright 2017-2018 ccls Authors
 // SPDX-License-Identifier: Apache-2.0
 
+#include "filesystem.hh"
+#include "git.hh"
+#include "log.hh"
 #include "message_handler.hh"
 #include "pipeline.hh"
 #include "project.hh"
 #include "sema_manager.hh"
+#include "utils.hh"
 #include "working_files.hh"
 
 #include <queue>
+#include <set>
 #include <unordered_set>
 
+using namespace llvm;
+
 namespace ccls {
 namespace {
 struct Param {
   bool dependencies = true;
+  // If true, reindex only the files changed by moving HEAD of the workspace
+  // folders since it was last recorded, and the translation units including
+  // them. The DB and caches of other files are kept.
+  bool git = false;
+  // If true, reload the compilation databases and reindex only the entries
+  // which were added or whose arguments changed. Files of removed entries are
+  // dropped from the DB. Otherwise the DB is cleared and everything is
+  // reindexed.
+  bool incremental = false;
   std::vector<std::string> whitelist;
   std::vector<std::string> blacklist;
 };
-REFLECT_STRUCT(Param, dependencies, whitelist, blacklist);
+REFLECT_STRUCT(Param, dependencies, git, incremental, whitelist, blacklist);
 } // namespace
 
 void MessageHandler::ccls_reload(JsonReader &reader) {
   Param param;
   reflect(reader, param);
+  if (param.git) {
+    std::vector<std::string> changed = takeGitChanges();
+    if (changed.empty())
+      return;
+    DidChangeWatchedFilesParam changes;
+    std::set<std::string> mains;
+    for (auto &path : changed) {
+      changes.changes.push_back(
+          {DocumentUri::fromPath(path), sys::fs::exists(path)
+                                            ? FileChangeType::Changed
+                                            : FileChangeType::Deleted});
+      int file_id;
+      if (findFile(path, &file_id))
+        for (int id : db->getDependents(file_id, SIZE_MAX)) {
+          QueryFile &file = db->files[id];
+          if (file.def && project->isMainFile(file.def->path))
+            mains.insert(file.def->path);
+        }
+    }
+    LOG_S(INFO) << "reindex " << changed.size() << " files changed in git and "
+                << mains.size() << " translation units including them";
+    workspace_didChangeWatchedFiles(changes);
+    for (auto &main : mains)
+      pipeline::index(main, {}, IndexMode::Background, true);
+    return;
+  }
+  if (param.incremental) {
+    auto &gi = g_config->index;
+    GroupMatch match(gi.whitelist, gi.blacklist);
+    std::vector<const char *> args, extra_args;
+    for (const std::string &arg : g_config->clang.extraArgs)
+      extra_args.push_back(intern(arg));
+    std::vector<std::string> removed;
+    size_t n = 0;
+    for (auto &[folder, _] : g_config->workspaceFolders)
+      for (Project::Entry &entry : project->reload(folder, removed)) {
+        if (!match.matches(entry.filename))
+          continue;
+        args = entry.args;
+        args.insert(args.end(), extra_args.begin(), extra_args.end());
+        args.push_back(intern("-working-directory=" + entry.directory));
+        bool interactive = wfiles->getFile(entry.filename) != nullptr;
+        pipeline::index(entry.filename, args,
+                        interactive ? IndexMode::Normal : IndexMode::Background,
+                        false);
+        manager->onClose(entry.filename);
+        n++;
+      }
+    LOG_S(INFO) << "reload: " << n << " changed and " << removed.size()
+                << " removed entries";
+    for (auto &path : removed)
+      if (!wfiles->getFile(path))
+        pipeline::index(path, {}, IndexMode::Delete, false);
+    return;
+  }
   // Send index requests for every file.
   if (param.whitelist.empty() && param.blacklist.empty()) {
     vfs->clear();
+    resetFileSystem();
+    recordGitHeads();
     db->clear();
     project->index(wfiles, RequestId());
     manager->clear();
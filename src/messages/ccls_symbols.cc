@@ -0,0 +1,180 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "message_handler.hh"
+#include "pipeline.hh"
+#include "query.hh"
+
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringRef.h>
+
+#include <algorithm>
+#include <stdint.h>
+#include <type_traits>
+
+using namespace llvm;
+
+namespace ccls {
+namespace {
+// Enumerates symbols for tooling, e.g. all classes deriving X under src/net/.
+// Unlike workspace/symbol, names are matched exactly and nothing is ranked.
+struct Param {
+  // Only symbols whose short name, or qualified name if |qualified|, starts
+  // with |prefix|.
+  std::string prefix;
+  bool qualified = false;
+  // If not empty, only symbols of these kinds.
+  std::vector<SymbolKind> kinds;
+  // If not empty, only symbols defined or declared in these folders.
+  std::vector<std::string> folders;
+  // If not 0, only types or functions derived, directly or not, from this
+  // type or function.
+  Usr base = 0;
+  // Only symbols with an occurrence in |folders| that has every role in
+  // |role|, e.g. Definition.
+  Role role = Role::None;
+  // 0: no limit.
+  int maxNum = 0;
+
+  // If set, stream the symbols as $/progress notifications of |pageSize|
+  // symbols each.
+  RequestId partialResultToken;
+  int pageSize = 1000;
+};
+REFLECT_STRUCT(Param, prefix, qualified, kinds, folders, base, role, maxNum,
+               partialResultToken, pageSize);
+
+struct Out {
+  Usr usr;
+  std::string_view name;
+  std::string_view detailedName;
+  SymbolKind kind;
+  Location location;
+};
+REFLECT_STRUCT(Out, usr, name, detailedName, kind, location);
+} // namespace
+
+void MessageHandler::ccls_symbols(JsonReader &reader, ReplyOnce &reply) {
+  Param param;
+  reflect(reader, param);
+  for (auto &folder : param.folders)
+    ensureEndsInSlash(folder);
+  std::shared_ptr<const FileSet> folder_files = db->getFileSet(param.folders);
+  const FileSet &file_set = *folder_files;
+  size_t max_num = param.maxNum > 0 ? size_t(param.maxNum) : SIZE_MAX;
+  size_t page_size = std::max(param.pageSize, 1);
+
+  std::vector<Out> result;
+  // Number of symbols already sent as partial results.
+  size_t sent = 0;
+  bool cancelled = false;
+  auto flush = [&]() {
+    if (param.partialResultToken.valid() && result.size()) {
+      pipeline::partialResult(param.partialResultToken, result);
+      sent += result.size();
+      result.clear();
+      // Bulk queries may run for a while.
+      cancelled = pipeline::isCancelled(reply.id);
+    }
+  };
+
+  // Returns true to stop.
+  auto add = [&](SymbolIdx sym) {
+    Out out;
+    out.usr = sym.usr;
+    Maybe<DeclRef> dr;
+    bool matched = false;
+    withEntity(db, sym, [&](const auto &entity) {
+      const auto *def = entity.anyDef();
+      if (!def)
+        return;
+      if constexpr (std::is_same_v<std::decay_t<decltype(entity)>, QueryVar>)
+        if (def->is_local())
+          return;
+      std::string_view name = def->name(param.qualified);
+      if (name.compare(0, param.prefix.size(), param.prefix) ||
+          (param.kinds.size() && !llvm::is_contained(param.kinds, def->kind)))
+        return;
+      for (auto &def1 : entity.def)
+        if (def1.spell && file_set[def1.spell->file_id]) {
+          dr = def1.spell;
+          break;
+        }
+      if (!dr)
+        for (auto &dr1 : entity.declarations)
+          if (file_set[dr1.file_id]) {
+            dr = dr1;
+            break;
+          }
+      if (!dr)
+        return;
+      if (param.role != Role::None) {
+        auto has = [&](Role role) {
+          return Role(role & param.role) == param.role;
+        };
+        bool found = false;
+        for (auto &def1 : entity.def)
+          if (def1.spell && file_set[def1.spell->file_id] &&
+              has(def1.spell->role))
+            found = true;
+        for (auto &dr1 : entity.declarations)
+          if (file_set[dr1.file_id] && has(dr1.role))
+            found = true;
+        if (!found)
+          entity.uses.filter(file_set, param.role, Role::None,
+                             [&](Use) { found = true; });
+        if (!found)
+          return;
+      }
+      out.name = def->name(true);
+      out.detailedName = def->detailed_name;
+      out.kind = def->kind;
+      matched = true;
+    });
+    if (!matched)
+      return false;
+    if (auto loc = getLsLocation(db, wfiles, *dr)) {
+      out.location = *loc;
+      result.push_back(out);
+      if (result.size() >= page_size)
+        flush();
+    }
+    return cancelled || sent + result.size() >= max_num;
+  };
+
+  if (param.base) {
+    for (Kind kind : {Kind::Type, Kind::Func}) {
+      auto &usr2id = kind == Kind::Type ? db->type_usr : db->func_usr;
+      auto it = usr2id.find(param.base);
+      if (it == usr2id.end())
+        continue;
+      for (EntityId id : getHierarchy(db, kind, it->second, true))
+        if (add({kind == Kind::Type ? db->types[id].usr : db->funcs[id].usr,
+                 kind}))
+          break;
+      break;
+    }
+  } else if (!db->symbol_index.lookup(param.prefix, add)) {
+    // The index has no candidates for a prefix without name characters.
+    [&] {
+      for (auto &func : db->funcs)
+        if (add({func.usr, Kind::Func}))
+          return;
+      for (auto &type : db->types)
+        if (add({type.usr, Kind::Type}))
+          return;
+      for (auto &var : db->vars)
+        if (add({var.usr, Kind::Var}))
+          return;
+    }();
+  }
+
+  if (cancelled) {
+    reply.error(ErrorCode::RequestCancelled, "cancelled $ccls/symbols");
+    return;
+  }
+  if (param.partialResultToken.valid())
+    flush();
+  reply(result);
+}
+} // namespace ccls
@@ -5,6 +5,8 @@
 #include "pipeline.hh"
 #include "query.hh"
 
+#include <algorithm>
+
 namespace ccls {
 namespace {
 struct Param : TextDocumentPositionParam {
@@ -12,8 +14,19 @@ struct Param : TextDocumentPositionParam {
   // 2: local
   // 4: parameter
   unsigned kind = ~0u;
+  // If limit is positive, reply with the variables [offset, offset+limit) of
+  // the instance list, whose order is stable while the index is unchanged,
+  // and their total count, so that types with huge instance lists can be
+  // paged.
+  int offset = 0, limit = 0;
+};
+REFLECT_STRUCT(Param, textDocument, position, kind, offset, limit);
+
+struct Out {
+  int total;
+  std::vector<Location> locations;
 };
-REFLECT_STRUCT(Param, textDocument, position, kind);
+REFLECT_STRUCT(Out, total, locations);
 } // namespace
 
 void MessageHandler::ccls_vars(JsonReader &reader, ReplyOnce &reply) {
@@ -24,7 +37,8 @@ void MessageHandler::ccls_vars(JsonReader &reader, ReplyOnce &reply) {
     return;
   }
 
-  std::vector<Location> result;
+  // Only the locations of the requested page are computed.
+  std::vector<DeclRef> drs;
   for (SymbolRef sym : findSymbolsAtLocation(wf, file, param.position)) {
     Usr usr = sym.usr;
     switch (sym.kind) {
@@ -38,14 +52,25 @@ void MessageHandler::ccls_vars(JsonReader &reader, ReplyOnce &reply) {
       [[fallthrough]];
     }
     case Kind::Type: {
-      for (DeclRef dr :
-           getVarDeclarations(db, db->getType(usr).instances, param.kind))
-        if (auto loc = getLocationLink(db, wfiles, dr))
-          result.push_back(Location(std::move(loc)));
+      std::vector<DeclRef> drs1 =
+          getVarDeclarations(db, db->getType(usr).instances, param.kind);
+      drs.insert(drs.end(), drs1.begin(), drs1.end());
       break;
     }
     }
   }
-  reply(result);
+  size_t begin = 0, end = drs.size();
+  if (param.limit > 0) {
+    begin = std::min(size_t(std::max(param.offset, 0)), drs.size());
+    end = std::min(begin + param.limit, drs.size());
+  }
+  std::vector<Location> result;
+  for (size_t i = begin; i < end; i++)
+    if (auto loc = getLocationLink(db, wfiles, drs[i]))
+      result.push_back(Location(std::move(loc)));
+  if (param.limit > 0)
+    reply(Out{int(drs.size()), std::move(result)});
+  else
+    reply(result);
 }
 } // namespace ccls
@@ -1,7 +1,10 @@
 // Copyright 2017-2018 ccls Authors
 // SPDX-License-Identifier: Apache-2.0
 
+#include "allocator.hh"
+#include "file_watcher.hh"
 #include "filesystem.hh"
+#include "git.hh"
 #include "include_complete.hh"
 #include "log.hh"
 #include "message_handler.hh"
@@ -9,6 +12,7 @@
 #include "platform.hh"
 #include "project.hh"
 #include "sema_manager.hh"
+#include "snapshot.hh"
 #include "working_files.hh"
 
 #include <llvm/ADT/Twine.h>
@@ -18,6 +22,7 @@
 #include <rapidjson/document.h>
 #include <rapidjson/writer.h>
 
+#include <algorithm>
 #include <stdexcept>
 #include <stdlib.h>
 #include <thread>
@@ -84,6 +89,17 @@ struct ServerCap {
     bool resolveProvider = true;
   } documentLinkProvider;
   bool foldingRangeProvider = true;
+  bool callHierarchyProvider = true;
+  struct SemanticTokensOptions {
+    struct Legend {
+      std::vector<const char *> tokenTypes, tokenModifiers;
+    } legend;
+    bool range = true;
+    struct Full {
+      bool delta = true;
+    } full;
+  };
+  std::optional<SemanticTokensOptions> semanticTokensProvider;
   // The server provides execute command support.
   struct ExecuteCommandOptions {
     std::vector<const char *> commands = {ccls_xref};
@@ -97,6 +113,10 @@ REFLECT_STRUCT(ServerCap::CompletionOptions, resolveProvider,
 REFLECT_STRUCT(ServerCap::DocumentLinkOptions, resolveProvider);
 REFLECT_STRUCT(ServerCap::ExecuteCommandOptions, commands);
 REFLECT_STRUCT(ServerCap::SaveOptions, includeText);
+REFLECT_STRUCT(ServerCap::SemanticTokensOptions::Legend, tokenTypes,
+               tokenModifiers);
+REFLECT_STRUCT(ServerCap::SemanticTokensOptions::Full, delta);
+REFLECT_STRUCT(ServerCap::SemanticTokensOptions, legend, range, full);
 REFLECT_STRUCT(ServerCap::SignatureHelpOptions, triggerCharacters);
 REFLECT_STRUCT(ServerCap::TextDocumentSyncOptions, openClose, change, willSave,
                willSaveWaitUntil, save);
@@ -109,6 +129,7 @@ REFLECT_STRUCT(ServerCap, textDocumentSync, hoverProvider, completionProvider,
                documentRangeFormattingProvider,
                documentOnTypeFormattingProvider, renameProvider,
                documentLinkProvider, foldingRangeProvider,
+               callHierarchyProvider, semanticTokensProvider,
                executeCommandProvider, workspace);
 
 struct DynamicReg {
@@ -256,6 +277,7 @@ void *indexer(void *arg_) {
   delete arg;
   std::string name = "indexer" + std::to_string(idx);
   set_thread_name(name.c_str());
+  setThreadArena(Arena::Indexer);
   // Don't lower priority on __APPLE__. getpriority(2) says "When setting a
   // thread into background state the scheduling priority is set to lowest
   // value, disk and network IO are throttled."
@@ -266,6 +288,20 @@ void *indexer(void *arg_) {
   pipeline::threadLeave();
   return nullptr;
 }
+
+void *requestThread(void *arg_) {
+  MessageHandler *h;
+  int idx;
+  auto *arg = static_cast<std::pair<MessageHandler *, int> *>(arg_);
+  std::tie(h, idx) = *arg;
+  delete arg;
+  std::string name = "request" + std::to_string(idx);
+  set_thread_name(name.c_str());
+  setThreadArena(Arena::DB);
+  pipeline::request_Main(h);
+  pipeline::threadLeave();
+  return nullptr;
+}
 } // namespace
 
 void do_initialize(MessageHandler *m, InitializeParam &param,
@@ -296,6 +332,10 @@ void do_initialize(MessageHandler *m, InitializeParam &param,
     reflect(json_writer, *g_config);
     LOG_S(INFO) << "initializationOptions: " << output.GetString();
 
+    if (pipeline::serve_snapshot.size()) {
+      g_config->cache.directory = pipeline::serve_snapshot;
+      g_config->cache.snapshot = true;
+    }
     if (g_config->cache.directory.size()) {
       SmallString<256> path(g_config->cache.directory);
       sys::fs::make_absolute(project_path, path);
@@ -303,6 +343,11 @@ void do_initialize(MessageHandler *m, InitializeParam &param,
       g_config->cache.directory = normalizePath(path.str());
       ensureEndsInSlash(g_config->cache.directory);
     }
+    if (g_config->cache.sharedDirectory.size()) {
+      SmallString<256> path(g_config->cache.sharedDirectory);
+      sys::fs::make_absolute(project_path, path);
+      g_config->cache.sharedDirectory = normalizePath(path.str());
+    }
   }
 
   // Client capabilities
@@ -336,6 +381,9 @@ void do_initialize(MessageHandler *m, InitializeParam &param,
     c.documentOnTypeFormattingProvider =
         g_config->capabilities.documentOnTypeFormattingProvider;
     c.foldingRangeProvider = g_config->capabilities.foldingRangeProvider;
+    if (g_config->capabilities.semanticTokensProvider)
+      c.semanticTokensProvider.emplace().legend = {kSemanticTokenTypes,
+                                                   kSemanticTokenModifiers};
     c.workspace = g_config->capabilities.workspace;
     reply(result);
   }
@@ -361,6 +409,23 @@ void do_initialize(MessageHandler *m, InitializeParam &param,
       LOG_S(INFO) << "workspace folder: " << folder;
     else
       LOG_S(INFO) << "workspace folder: " << folder << " -> " << real;
+  resetFileSystem();
+
+  if (pipeline::serve_snapshot.size()) {
+    // Nothing to index: skip the project, indexers and preambles so that the
+    // server is ready once the snapshot is read.
+    if (!readSnapshot(*m->db, g_config->cache.directory + "ccls.snapshot"))
+      LOG_S(ERROR) << "failed to read the snapshot in "
+                   << g_config->cache.directory;
+    if (g_config->request.threads <= 0)
+      g_config->request.threads =
+          std::max((int)std::thread::hardware_concurrency(), 1);
+    LOG_S(INFO) << "serve " << m->db->files.size() << " files with "
+                << g_config->request.threads << " request threads";
+    for (int i = 0; i < g_config->request.threads; i++)
+      spawnThread(requestThread, new std::pair<MessageHandler *, int>{m, i});
+    return;
+  }
 
   if (g_config->cache.directory.empty())
     g_config->cache.retainInMemory = 1;
@@ -376,6 +441,7 @@ void do_initialize(MessageHandler *m, InitializeParam &param,
   idx::init();
   for (auto &[folder, _] : workspaceFolders)
     m->project->load(folder);
+  pipeline::loadSnapshot(m->db, m->vfs, m->project);
 
   // Start indexer threads. Start this after loading the project, as that
   // may take a long time. Indexer threads will emit status/progress
@@ -386,6 +452,8 @@ void do_initialize(MessageHandler *m, InitializeParam &param,
   LOG_S(INFO) << "start " << g_config->index.threads << " indexers";
   for (int i = 0; i < g_config->index.threads; i++)
     spawnThread(indexer, new std::pair<MessageHandler *, int>{m, i});
+  for (int i = 0; i < g_config->request.threads; i++)
+    spawnThread(requestThread, new std::pair<MessageHandler *, int>{m, i});
 
   // Start scanning include directories before dispatching project
   // files, because that takes a long time.
@@ -393,8 +461,15 @@ void do_initialize(MessageHandler *m, InitializeParam &param,
 
   LOG_S(INFO) << "dispatch initial index requests";
   m->project->index(m->wfiles, reply.id);
+  recordGitHeads();
+  for (auto &[folder, _] : workspaceFolders)
+    watchDirectory(folder);
 
   m->manager->sessions.setCapacity(g_config->session.maxNum);
+  m->manager->sessions.setMaxWeight(size_t(g_config->session.maxPreambleSize)
+                                    << 20);
+  m->manager->setPreambleThreads(g_config->session.preambleThreads);
+  m->manager->setDiagThreads(g_config->diagnostics.threads);
 }
 
 void MessageHandler::initialize(JsonReader &reader, ReplyOnce &reply) {
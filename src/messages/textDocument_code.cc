@@ -79,7 +79,7 @@ struct CommonCodeLensParams {
 };
 } // namespace
 
-void MessageHandler::textDocument_codeLens(TextDocumentParam &param,
+void MessageHandler::textDocument_codeLens(TextDocumentViewParam &param,
                                            ReplyOnce &reply) {
   auto [file, wf] = findOrFail(param.textDocument.uri.getPath(), reply);
   if (!wf)
@@ -104,8 +104,9 @@ void MessageHandler::textDocument_codeLens(TextDocumentParam &param,
   };
 
   std::unordered_set<Range> seen;
-  for (auto [sym, refcnt] : file->symbol2refcnt) {
-    if (refcnt <= 0 || !sym.extent.valid() || !seen.insert(sym.range).second)
+  const lsRange *range = param.range ? &*param.range : nullptr;
+  for (ExtentRef sym : findSymbolsInRange(wf, file, range)) {
+    if (!sym.extent.valid() || !seen.insert(sym.range).second)
       continue;
     switch (sym.kind) {
     case Kind::Func: {
@@ -113,17 +114,17 @@ void MessageHandler::textDocument_codeLens(TextDocumentParam &param,
       const QueryFunc::Def *def = func.anyDef();
       if (!def)
         continue;
-      std::vector<Use> base_uses = getUsesForAllBases(db, func);
-      std::vector<Use> derived_uses = getUsesForAllDerived(db, func);
+      int base_uses = countUsesForAll(db, func, false),
+          derived_uses = countUsesForAll(db, func, true);
       add("ref", {sym.usr, Kind::Func, "uses"}, sym.range, func.uses.size(),
-          base_uses.empty());
-      if (base_uses.size())
+          !base_uses);
+      if (base_uses)
         add("b.ref", {sym.usr, Kind::Func, "bases uses"}, sym.range,
-            base_uses.size());
-      if (derived_uses.size())
+            base_uses);
+      if (derived_uses)
         add("d.ref", {sym.usr, Kind::Func, "derived uses"}, sym.range,
-            derived_uses.size());
-      if (base_uses.empty())
+            derived_uses);
+      if (!base_uses)
         add("base", {sym.usr, Kind::Func, "bases"}, sym.range,
             def->bases.size());
       add("derived", {sym.usr, Kind::Func, "derived"}, sym.range,
@@ -173,7 +174,7 @@ void MessageHandler::workspace_executeCommand(JsonReader &reader,
     reflect(json_reader, cmd);
     std::vector<Location> result;
     auto map = [&](auto &&uses) {
-      for (auto &use : uses)
+      for (const auto &use : uses)
         if (auto loc = getLsLocation(db, wfiles, use))
           result.push_back(std::move(*loc));
     };
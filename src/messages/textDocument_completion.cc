@@ -13,6 +13,13 @@
 #include <clang/Sema/Sema.h>
 #include <llvm/ADT/Twine.h>
 
+#include <llvm/Support/Threading.h>
+
+#include <condition_variable>
+#include <numeric>
+#include <stdint.h>
+#include <thread>
+
 #if LLVM_VERSION_MAJOR < 8
 #include <regex>
 #endif
@@ -96,14 +103,57 @@ ParseIncludeLineResult ParseIncludeLine(const std::string &line) {
 }
 #endif
 
+// A completion result as recorded by CompletionConsumer: only what filtering
+// and ranking need. Its CompletionItems, which take most of the time to build,
+// are materialized if it is among the returned candidates.
+struct Candidate {
+  // Typed text, in CandidateSet::alloc or CandidateSet::items.
+  std::string_view filter_text;
+  // nullptr if the candidate is CandidateSet::items[item].
+  const CodeCompletionString *ccs = nullptr;
+  int item = -1;
+  unsigned priority = 0;
+  CompletionItemKind kind = CompletionItemKind::Text;
+  bool pattern = false;
+  std::vector<TextEdit> fix_its;
+};
+
+struct CandidateSet {
+  // Owns the strings referenced by |candidates|.
+  std::shared_ptr<GlobalCodeCompletionAllocator> alloc;
+  std::vector<Candidate> candidates;
+  // Prebuilt items, e.g. include paths.
+  std::vector<CompletionItem> items;
+};
+
+// Appends the CompletionItems of |cand|, more than one if
+// completion.duplicateOptional expands optional parameters.
+void materialize(const CandidateSet &set, const Candidate &cand,
+                 std::vector<CompletionItem> &out);
+
+// Candidates of the last filterCandidates call that contain the filter text
+// as a subsequence. A filter that extends |filter| can only match a subset of
+// them, so typing one more character only rescans those.
+struct FilterState {
+  std::mutex mutex;
+  std::shared_ptr<const CandidateSet> candidates;
+  std::string filter;
+  std::vector<int> matched;
+};
+
 // Pre-filters completion responses before sending to vscode. This results in a
 // significantly snappier completion experience as vscode is easily overloaded
-// when given 1000+ completion items.
-void filterCandidates(CompletionList &result, const std::string &complete_text,
-                      Position begin_pos, Position end_pos,
-                      const std::string &buffer_line) {
+// when given 1000+ completion items. Only the candidates that are returned are
+// materialized.
+void filterCandidates(CompletionList &result,
+                      const std::shared_ptr<const CandidateSet> &set,
+                      const std::string &complete_text, Position begin_pos,
+                      Position end_pos, const std::string &buffer_line,
+                      FilterState *state = nullptr) {
   assert(begin_pos.line == end_pos.line);
   auto &items = result.items;
+  auto &candidates = set->candidates;
+  int max_num = g_config->completion.maxNum;
 
   // People usually does not want to insert snippets or parenthesis when
   // changing function or type names, e.g. "str.|()" or "std::|<int>".
@@ -116,7 +166,6 @@ void filterCandidates(CompletionList &result, const std::string &complete_text,
   }
 
   auto finalize = [&]() {
-    int max_num = g_config->completion.maxNum;
     if (items.size() > max_num) {
       items.resize(max_num);
       result.isIncomplete = true;
@@ -173,46 +222,88 @@ void filterCandidates(CompletionList &result, const std::string &complete_text,
     }
   };
 
+  // Keep one more than maxNum so that finalize sets isIncomplete.
+  auto keep = [&](size_t n) {
+    return max_num >= 0 ? std::min(n, size_t(max_num) + 1) : n;
+  };
   if (!g_config->completion.filterAndSort) {
+    for (size_t i = 0; i < candidates.size() && items.size() < keep(SIZE_MAX);
+         i++)
+      materialize(*set, candidates[i], items);
     finalize();
     return;
   }
 
-  if (complete_text.size()) {
+  // (score, index into candidates)
+  std::vector<std::pair<int, int>> order;
+  if (complete_text.empty()) {
+    order.reserve(candidates.size());
+    for (int i = 0, n = candidates.size(); i < n; i++)
+      order.emplace_back(0, i);
+    if (state) {
+      std::lock_guard lock(state->mutex);
+      state->candidates.reset();
+    }
+  } else {
+    std::vector<int> scan, matched;
+    bool incremental = false;
+    if (state) {
+      std::lock_guard lock(state->mutex);
+      incremental = state->candidates == set &&
+                    StringRef(complete_text).startswith(state->filter);
+      if (incremental)
+        scan = state->matched;
+    }
+    if (!incremental) {
+      scan.resize(candidates.size());
+      std::iota(scan.begin(), scan.end(), 0);
+    }
+
     // Fuzzy match and remove awful candidates.
     bool sensitive = g_config->completion.caseSensitivity;
     FuzzyMatcher fuzzy(complete_text, sensitive);
-    for (CompletionItem &item : items) {
-      const std::string &filter =
-          item.filterText.size() ? item.filterText : item.label;
-      item.score_ = reverseSubseqMatch(complete_text, filter, sensitive) >= 0
-                        ? fuzzy.match(filter, true)
-                        : FuzzyMatcher::kMinScore;
+    for (int i : scan) {
+      std::string_view filter = candidates[i].filter_text;
+      if (reverseSubseqMatch(complete_text, filter, sensitive) < 0)
+        continue;
+      matched.push_back(i);
+      int score = fuzzy.match(filter, true);
+      if (score > FuzzyMatcher::kMinScore)
+        order.emplace_back(score, i);
+    }
+    if (state) {
+      std::lock_guard lock(state->mutex);
+      state->candidates = set;
+      state->filter = complete_text;
+      state->matched = std::move(matched);
     }
-    items.erase(std::remove_if(items.begin(), items.end(),
-                               [](const CompletionItem &item) {
-                                 return item.score_ <= FuzzyMatcher::kMinScore;
-                               }),
-                items.end());
   }
-  std::sort(items.begin(), items.end(),
-            [](const CompletionItem &lhs, const CompletionItem &rhs) {
-              int t = int(lhs.additionalTextEdits.size() -
-                          rhs.additionalTextEdits.size());
-              if (t)
-                return t < 0;
-              if (lhs.score_ != rhs.score_)
-                return lhs.score_ > rhs.score_;
-              if (lhs.priority_ != rhs.priority_)
-                return lhs.priority_ < rhs.priority_;
-              t = lhs.textEdit.newText.compare(rhs.textEdit.newText);
-              if (t)
-                return t < 0;
-              t = lhs.label.compare(rhs.label);
-              if (t)
-                return t < 0;
-              return lhs.filterText < rhs.filterText;
-            });
+
+  auto less = [&](const std::pair<int, int> &l, const std::pair<int, int> &r) {
+    const Candidate &lhs = candidates[l.second], &rhs = candidates[r.second];
+    int t = int(lhs.fix_its.size() - rhs.fix_its.size());
+    if (t)
+      return t < 0;
+    if (l.first != r.first)
+      return l.first > r.first;
+    if (lhs.priority != rhs.priority)
+      return lhs.priority < rhs.priority;
+    t = lhs.filter_text.compare(rhs.filter_text);
+    if (t)
+      return t < 0;
+    return l.second < r.second;
+  };
+  // Only the first maxNum items are returned, so a partial sort suffices.
+  // Optional parameters may expand a candidate into several items.
+  size_t n = keep(order.size());
+  std::partial_sort(order.begin(), order.begin() + n, order.end(), less);
+  items.reserve(n);
+  for (size_t i = 0; i < n && items.size() < keep(SIZE_MAX); i++) {
+    size_t first = items.size();
+    materialize(*set, candidates[order[i].second], items);
+    for (size_t j = first; j < items.size(); j++)
+      items[j].score_ = order[i].first;
+  }
 
   // Trim result.
   finalize();
@@ -313,7 +404,7 @@ CompletionItemKind getCompletionKind(CodeCompletionContext::Kind k,
   }
 }
 
-void buildItem(const CodeCompletionResult &r, const CodeCompletionString &ccs,
+void buildItem(bool pattern, const CodeCompletionString &ccs,
                std::vector<CompletionItem> &out) {
   assert(!out.empty());
   auto first = out.size() - 1;
@@ -350,7 +441,7 @@ void buildItem(const CodeCompletionResult &r, const CodeCompletionString &ccs,
       // Duplicate last element, the recursive call will complete it.
       if (g_config->completion.duplicateOptional) {
         out.push_back(out.back());
-        buildItem(r, *chunk.Optional, out);
+        buildItem(pattern, *chunk.Optional, out);
       }
       continue;
     }
@@ -366,7 +457,7 @@ void buildItem(const CodeCompletionResult &r, const CodeCompletionString &ccs,
         continue;
 
       if (kind == CodeCompletionString::CK_Placeholder) {
-        if (r.Kind == CodeCompletionResult::RK_Pattern) {
+        if (pattern) {
           ignore = true;
           continue;
         }
@@ -388,15 +479,58 @@ void buildItem(const CodeCompletionResult &r, const CodeCompletionString &ccs,
     }
 }
 
+void materialize(const CandidateSet &set, const Candidate &cand,
+                 std::vector<CompletionItem> &out) {
+  if (!cand.ccs) {
+    out.push_back(set.items[cand.item]);
+    return;
+  }
+  const CodeCompletionString &ccs = *cand.ccs;
+  CompletionItem ls_item;
+  ls_item.kind = cand.kind;
+  if (const char *brief = ccs.getBriefComment())
+    ls_item.documentation = brief;
+  ls_item.detail = ccs.getParentContextName().str();
+
+  size_t first_idx = out.size();
+  out.push_back(ls_item);
+  buildItem(cand.pattern, ccs, out);
+
+  for (size_t j = first_idx; j < out.size(); j++) {
+    std::string &s = out[j].textEdit.newText;
+    if (!g_config->client.snippetSupport) {
+      if (s.size()) {
+        // Delete non-identifier parts.
+        if (s.back() == '(' || s.back() == '<')
+          s.pop_back();
+        else if (s.size() >= 2 && !s.compare(s.size() - 2, 2, "()"))
+          s.resize(s.size() - 2);
+      }
+    } else if (out[j].insertTextFormat == InsertTextFormat::Snippet) {
+      if (!g_config->completion.placeholder) {
+        // foo(${1:int a}, ${2:int b}) -> foo($1)$0
+        auto p = s.find("${"), q = s.rfind('}');
+        s.replace(p, q - p + 1, "$1");
+      }
+      s += "$0";
+    }
+    out[j].priority_ = cand.priority;
+    if (!g_config->completion.detailedLabel) {
+      out[j].detail = out[j].label;
+      out[j].label = out[j].filterText;
+    }
+    out[j].additionalTextEdits = cand.fix_its;
+  }
+}
+
 class CompletionConsumer : public CodeCompleteConsumer {
   std::shared_ptr<clang::GlobalCodeCompletionAllocator> alloc;
   CodeCompletionTUInfo cctu_info;
 
 public:
-  bool from_cache;
-  std::vector<CompletionItem> ls_items;
+  CandidateSet set;
 
-  CompletionConsumer(const CodeCompleteOptions &opts, bool from_cache)
+  CompletionConsumer(const CodeCompleteOptions &opts)
       :
 #if LLVM_VERSION_MAJOR >= 9 // rC358696
         CodeCompleteConsumer(opts),
@@ -404,7 +538,8 @@ public:
         CodeCompleteConsumer(opts, false),
 #endif
         alloc(std::make_shared<clang::GlobalCodeCompletionAllocator>()),
-        cctu_info(alloc), from_cache(from_cache) {
+        cctu_info(alloc) {
+    set.alloc = alloc;
   }
 
   void ProcessCodeCompleteResults(Sema &s, CodeCompletionContext context,
@@ -412,7 +547,7 @@ public:
                                   unsigned numResults) override {
     if (context.getKind() == CodeCompletionContext::CCC_Recovery)
       return;
-    ls_items.reserve(numResults);
+    set.candidates.reserve(numResults);
     for (unsigned i = 0; i != numResults; i++) {
       auto &r = results[i];
       if (r.Availability == CXAvailability_NotAccessible ||
@@ -437,49 +572,22 @@ public:
           continue;
       }
 
+      // The string is allocated in |alloc| and outlives Sema. Building the
+      // CompletionItems is deferred to materialize.
       CodeCompletionString *ccs = r.CreateCodeCompletionString(
           s, context, getAllocator(), getCodeCompletionTUInfo(),
           includeBriefComments());
-      CompletionItem ls_item;
-      ls_item.kind = getCompletionKind(context.getKind(), r);
-      if (const char *brief = ccs->getBriefComment())
-        ls_item.documentation = brief;
-      ls_item.detail = ccs->getParentContextName().str();
-
-      size_t first_idx = ls_items.size();
-      ls_items.push_back(ls_item);
-      buildItem(r, *ccs, ls_items);
-
-      for (size_t j = first_idx; j < ls_items.size(); j++) {
-        std::string &s = ls_items[j].textEdit.newText;
-        if (!g_config->client.snippetSupport) {
-          if (s.size()) {
-            // Delete non-identifier parts.
-            if (s.back() == '(' || s.back() == '<')
-              s.pop_back();
-            else if (s.size() >= 2 && !s.compare(s.size() - 2, 2, "()"))
-              s.resize(s.size() - 2);
-          }
-        } else if (ls_items[j].insertTextFormat == InsertTextFormat::Snippet) {
-          if (!g_config->completion.placeholder) {
-            // foo(${1:int a}, ${2:int b}) -> foo($1)$0
-            auto p = s.find("${"), q = s.rfind('}');
-            s.replace(p, q - p + 1, "$1");
-          }
-          s += "$0";
-        }
-        ls_items[j].priority_ = ccs->getPriority();
-        if (!g_config->completion.detailedLabel) {
-          ls_items[j].detail = ls_items[j].label;
-          ls_items[j].label = ls_items[j].filterText;
-        }
-      }
+      Candidate &cand = set.candidates.emplace_back();
+      if (const char *typed = ccs->getTypedText())
+        cand.filter_text = typed;
+      cand.ccs = ccs;
+      cand.priority = ccs->getPriority();
+      cand.kind = getCompletionKind(context.getKind(), r);
+      cand.pattern = r.Kind == CodeCompletionResult::RK_Pattern;
       for (const FixItHint &fixIt : r.FixIts) {
         auto &ast = s.getASTContext();
-        TextEdit ls_edit =
-            ccls::toTextEdit(ast.getSourceManager(), ast.getLangOpts(), fixIt);
-        for (size_t j = first_idx; j < ls_items.size(); j++)
-          ls_items[j].additionalTextEdits.push_back(ls_edit);
+        cand.fix_its.push_back(
+            ccls::toTextEdit(ast.getSourceManager(), ast.getLangOpts(), fixIt));
       }
     }
   }
@@ -487,11 +595,153 @@ public:
   CodeCompletionAllocator &getAllocator() override { return *alloc; }
   CodeCompletionTUInfo &getCodeCompletionTUInfo() override { return cctu_info; }
 };
+
+using Candidates = std::shared_ptr<const CandidateSet>;
+CompleteConsumerCache<Candidates> cache;
+FilterState filter_state;
+
+// The completion started by prefetchCompletion. A request at its position
+// waits for it instead of starting another parse.
+struct Speculation {
+  std::mutex mutex;
+  bool active = false;
+  int64_t seq = 0;
+  std::string path, line;
+  Position position;
+  int64_t generation;
+  // Called with the candidates, or with nullptr if the parse was dropped.
+  std::vector<std::function<void(const Candidates *)>> waiters;
+  // Set when the first waiter comes. watchSpeculation gives up on the
+  // speculation at |deadline| and releases the waiters with nullptr.
+  std::chrono::steady_clock::time_point deadline;
+  std::condition_variable cv;
+
+  // Requires |mutex|. Like CompleteConsumerCache::get.
+  bool matches(const std::string &path1, const std::string &line1,
+               Position position1, int64_t generation1) const {
+    return active && position == position1 && path == path1 &&
+           generation == generation1 &&
+           line.compare(0, position.character, line1, 0,
+                        position.character) == 0;
+  }
+} speculation;
+
+// How long a request waits for a prefetched completion before it starts its
+// own parse.
+constexpr auto kSpeculationWait = std::chrono::seconds(3);
+
+void watchSpeculation() {
+  set_thread_name("comp watch");
+  std::unique_lock lock(speculation.mutex);
+  while (true) {
+    if (speculation.waiters.empty()) {
+      speculation.cv.wait(lock);
+      continue;
+    }
+    if (std::chrono::steady_clock::now() < speculation.deadline) {
+      speculation.cv.wait_until(lock, speculation.deadline);
+      continue;
+    }
+    // Later requests at the position parse on their own too. The result of
+    // the speculation, if it ever comes, still goes into the cache.
+    speculation.active = false;
+    auto waiters = std::move(speculation.waiters);
+    speculation.waiters.clear();
+    lock.unlock();
+    for (auto &waiter : waiters)
+      waiter(nullptr);
+    lock.lock();
+  }
+}
+
+CodeCompleteOptions getCompleteOptions(const std::string &buffer_line) {
+  CodeCompleteOptions opts;
+  opts.IncludeBriefComments = true;
+  opts.IncludeCodePatterns = StringRef(buffer_line).ltrim().startswith("#");
+  opts.IncludeFixIts = true;
+  opts.IncludeMacros = true;
+  return opts;
+}
 } // namespace
 
+void prefetchCompletion(SemaManager *manager, WorkingFile *wf,
+                        const TextDocumentContentChangeEvent &change) {
+  if (!change.range || change.text.empty() ||
+      change.text.find('\n') != std::string::npos)
+    return;
+  Position position = change.range->start;
+  position.character += change.text.size();
+  if (position.line < 0 || position.line >= wf->buffer_lines.size())
+    return;
+  const std::string &buffer_line = wf->buffer_lines[position.line];
+  int col = position.character;
+  if (col < 1 || col > buffer_line.size())
+    return;
+  StringRef before = StringRef(buffer_line).take_front(col);
+  if (!before.endswith(".") && !before.endswith("->") &&
+      !before.endswith("::"))
+    return;
+
+  // Nothing has been typed after the trigger character, so the completion
+  // position is the cursor.
+  std::string path = wf->filename;
+  Position begin_pos = position;
+  int64_t generation = manager->preambleGeneration(path);
+  Candidates candidates;
+  if (cache.get(path, buffer_line, begin_pos, generation, candidates))
+    return;
+  int64_t seq;
+  // Requests waiting for the speculation being replaced, which the buffer has
+  // moved past, start their own parses.
+  std::vector<std::function<void(const Candidates *)>> waiters;
+  {
+    std::lock_guard lock(speculation.mutex);
+    if (speculation.matches(path, buffer_line, begin_pos, generation))
+      return;
+    waiters = std::move(speculation.waiters);
+    speculation.waiters.clear();
+    speculation.active = true;
+    seq = ++speculation.seq;
+    speculation.path = path;
+    speculation.line = buffer_line;
+    speculation.position = begin_pos;
+    speculation.generation = generation;
+  }
+  for (auto &waiter : waiters)
+    waiter(nullptr);
+
+  CodeCompleteOptions opts = getCompleteOptions(buffer_line);
+  SemaManager::OnComplete callback =
+      [seq, path, begin_pos, buffer_line,
+       generation](CodeCompleteConsumer *optConsumer) {
+        Candidates candidates;
+        if (optConsumer) {
+          auto *consumer = static_cast<CompletionConsumer *>(optConsumer);
+          candidates =
+              std::make_shared<const CandidateSet>(std::move(consumer->set));
+          // Before deactivating, so that a request either finds the entry or
+          // waits.
+          cache.put(path, buffer_line, begin_pos, generation, candidates);
+        }
+        std::vector<std::function<void(const Candidates *)>> waiters;
+        {
+          std::lock_guard lock(speculation.mutex);
+          if (speculation.seq != seq)
+            return;
+          speculation.active = false;
+          waiters = std::move(speculation.waiters);
+          speculation.waiters.clear();
+        }
+        for (auto &waiter : waiters)
+          waiter(candidates ? &candidates : nullptr);
+      };
+  manager->comp_tasks.pushBack(std::make_unique<SemaManager::CompTask>(
+      RequestId(), path, begin_pos, std::make_unique<CompletionConsumer>(opts),
+      opts, callback));
+}
+
 void MessageHandler::textDocument_completion(CompletionParam &param,
                                              ReplyOnce &reply) {
-  static CompleteConsumerCache<std::vector<CompletionItem>> cache;
   std::string path = param.textDocument.uri.getPath();
   WorkingFile *wf = wfiles->getFile(path);
   if (!wf) {
@@ -507,11 +757,7 @@ void MessageHandler::textDocument_completion(CompletionParam &param,
   if (param.position.line >= 0 && param.position.line < wf->buffer_lines.size())
     buffer_line = wf->buffer_lines[param.position.line];
 
-  clang::CodeCompleteOptions ccOpts;
-  ccOpts.IncludeBriefComments = true;
-  ccOpts.IncludeCodePatterns = StringRef(buffer_line).ltrim().startswith("#");
-  ccOpts.IncludeFixIts = true;
-  ccOpts.IncludeMacros = true;
+  clang::CodeCompleteOptions ccOpts = getCompleteOptions(buffer_line);
 
   if (param.context.triggerKind == CompletionTriggerKind::TriggerCharacter &&
       param.context.triggerCharacter) {
@@ -545,6 +791,8 @@ void MessageHandler::textDocument_completion(CompletionParam &param,
   ParseIncludeLineResult preprocess = ParseIncludeLine(buffer_line);
   if (preprocess.ok && preprocess.keyword.compare("include") == 0) {
     CompletionList result;
+    auto set = std::make_shared<CandidateSet>();
+    auto &items = set->items;
     char quote = std::string(preprocess.match[5])[0];
     {
       std::unique_lock<std::mutex> lock(
@@ -554,11 +802,19 @@ void MessageHandler::textDocument_completion(CompletionParam &param,
       for (auto &item : include_complete->completion_items)
         if (quote == '\0' || (item.quote_kind_ & 1 && quote == '"') ||
             (item.quote_kind_ & 2 && quote == '<'))
-          result.items.push_back(item);
+          items.push_back(item);
+    }
+    // |items| is complete, so the views into it stay valid.
+    for (int i = 0, n = items.size(); i < n; i++) {
+      Candidate &cand = set->candidates.emplace_back();
+      cand.filter_text = items[i].filterText.size() ? items[i].filterText
+                                                    : items[i].label;
+      cand.item = i;
+      cand.priority = items[i].priority_;
     }
     begin_pos.character = 0;
     end_pos.character = (int)buffer_line.size();
-    filterCandidates(result, preprocess.pattern, begin_pos, end_pos,
+    filterCandidates(result, set, preprocess.pattern, begin_pos, end_pos,
                      buffer_line);
     decorateIncludePaths(preprocess.match, &result.items, quote);
     reply(result);
@@ -566,35 +822,67 @@ void MessageHandler::textDocument_completion(CompletionParam &param,
   }
 #endif
 
+  // Read before the request is queued, so that a preamble rebuilt in the
+  // meantime makes the entry stale rather than valid.
+  int64_t generation = manager->preambleGeneration(path);
+  auto respond = [filter, begin_pos, end_pos, reply,
+                  buffer_line](const Candidates &candidates) {
+    // Filtering can be slow for large candidate sets. Skip it if the client
+    // has cancelled.
+    if (pipeline::isCancelled(reply.id)) {
+      reply.error(ErrorCode::RequestCancelled, "cancelled completion request");
+      return;
+    }
+    CompletionList result;
+    filterCandidates(result, candidates, filter, begin_pos, end_pos,
+                     buffer_line, &filter_state);
+    reply(result);
+  };
   SemaManager::OnComplete callback =
-      [filter, path, begin_pos, end_pos, reply,
-       buffer_line](CodeCompleteConsumer *optConsumer) {
+      [respond, path, begin_pos, buffer_line,
+       generation](CodeCompleteConsumer *optConsumer) {
         if (!optConsumer)
           return;
         auto *consumer = static_cast<CompletionConsumer *>(optConsumer);
-        CompletionList result;
-        result.items = consumer->ls_items;
-
-        filterCandidates(result, filter, begin_pos, end_pos, buffer_line);
-        reply(result);
-        if (!consumer->from_cache) {
-          cache.withLock([&]() {
-            cache.path = path;
-            cache.line = buffer_line;
-            cache.position = begin_pos;
-            cache.result = consumer->ls_items;
-          });
-        }
+        auto candidates =
+            std::make_shared<const CandidateSet>(std::move(consumer->set));
+        respond(candidates);
+        cache.put(path, buffer_line, begin_pos, generation, candidates);
       };
 
-  if (cache.isCacheValid(path, buffer_line, begin_pos)) {
-    CompletionConsumer consumer(ccOpts, true);
-    cache.withLock([&]() { consumer.ls_items = cache.result; });
-    callback(&consumer);
-  } else {
+  auto enqueue = [manager = manager, id = reply.id, path, begin_pos, ccOpts,
+                  callback]() {
     manager->comp_tasks.pushBack(std::make_unique<SemaManager::CompTask>(
-        reply.id, param.textDocument.uri.getPath(), begin_pos,
-        std::make_unique<CompletionConsumer>(ccOpts, false), ccOpts, callback));
+        id, path, begin_pos, std::make_unique<CompletionConsumer>(ccOpts),
+        ccOpts, callback));
+  };
+
+  // Wait for a prefetched completion at the same position, which may have
+  // been started by the didChange that typed the trigger character.
+  {
+    static std::once_flag watch;
+    std::call_once(watch, [] { std::thread(watchSpeculation).detach(); });
+    std::lock_guard lock(speculation.mutex);
+    if (speculation.matches(path, buffer_line, begin_pos, generation)) {
+      if (speculation.waiters.empty()) {
+        speculation.deadline =
+            std::chrono::steady_clock::now() + kSpeculationWait;
+        speculation.cv.notify_one();
+      }
+      speculation.waiters.push_back(
+          [respond, enqueue](const Candidates *candidates) {
+            if (candidates)
+              respond(*candidates);
+            else
+              enqueue();
+          });
+      return;
+    }
   }
+  Candidates candidates;
+  if (cache.get(path, buffer_line, begin_pos, generation, candidates))
+    respond(candidates);
+  else
+    enqueue();
 }
 } // namespace ccls
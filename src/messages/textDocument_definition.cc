@@ -128,13 +128,8 @@ void MessageHandler::textDocument_definition(TextDocumentPositionParam &param,
           }
         }
       };
-      for (auto &func : db->funcs)
-        fn({func.usr, Kind::Func});
-      for (auto &type : db->types)
-        fn({type.usr, Kind::Type});
-      for (auto &var : db->vars)
-        if (var.def.size() && !var.def[0].is_local())
-          fn({var.usr, Kind::Var});
+      // Only symbols whose short name equals |short_query| can match.
+      db->symbol_index.lookupName(short_query, fn);
 
       if (best_sym.kind != Kind::Invalid) {
         Maybe<DeclRef> dr = getDefinitionSpell(db, best_sym);
@@ -1,27 +1,47 @@
 // Copyright 2017-2018 ccls Authors
 // SPDX-License-Identifier: Apache-2.0
 
+#include "filesystem.hh"
 #include "include_complete.hh"
 #include "message_handler.hh"
 #include "pipeline.hh"
 #include "project.hh"
+#include "query.hh"
 #include "sema_manager.hh"
 #include "working_files.hh"
 
+#include <llvm/Support/Path.h>
+
+#include <algorithm>
+#include <stdint.h>
+
+using namespace llvm;
+
 namespace ccls {
 void MessageHandler::textDocument_didChange(TextDocumentDidChangeParam &param) {
   std::string path = param.textDocument.uri.getPath();
   wfiles->onChange(param);
+  if (pipeline::serve_snapshot.size())
+    return;
+  pipeline::noteEdit();
+  WorkingFile *wf = wfiles->getFile(path);
+  if (wf && wf->highlight_deferred)
+    if (QueryFile *file = findFile(path))
+      emitSemanticHighlight(db, wf, *file);
+  if (wf && g_config->completion.prefetch && param.contentChanges.size())
+    prefetchCompletion(manager, wf, param.contentChanges.back());
   if (g_config->index.onChange)
     pipeline::index(path, {}, IndexMode::OnChange, true);
   manager->onView(path);
   if (g_config->diagnostics.onChange >= 0)
-    manager->scheduleDiag(path, g_config->diagnostics.onChange);
+    manager->scheduleDiag(path, manager->changeDebounce(path));
 }
 
 void MessageHandler::textDocument_didClose(TextDocumentParam &param) {
   std::string path = param.textDocument.uri.getPath();
   wfiles->onClose(path);
+  if (pipeline::serve_snapshot.size())
+    return;
   manager->onClose(path);
   pipeline::removeCache(path);
 }
@@ -29,15 +49,18 @@ void MessageHandler::textDocument_didClose(TextDocumentParam &param) {
 void MessageHandler::textDocument_didOpen(DidOpenTextDocumentParam &param) {
   std::string path = param.textDocument.uri.getPath();
   WorkingFile *wf = wfiles->onOpen(param.textDocument);
+  project->noteOpened(path);
   if (std::optional<std::string> cached_file_contents =
           pipeline::loadIndexedContent(path))
     wf->setIndexContent(*cached_file_contents);
 
   QueryFile *file = findFile(path);
   if (file) {
-    emitSkippedRanges(wf, *file);
+    emitSkippedRanges(db, wf, *file);
     emitSemanticHighlight(db, wf, *file);
   }
+  if (pipeline::serve_snapshot.size())
+    return;
   include_complete->addFile(wf->filename);
 
   // Submit new index request if it is not a header file or there is no
@@ -48,13 +71,48 @@ void MessageHandler::textDocument_didOpen(DidOpenTextDocumentParam &param) {
     pipeline::index(path, {}, IndexMode::Normal, false);
   if (header)
     project->indexRelated(path);
+  pipeline::boostOpened(project, path);
 
   manager->onView(path);
+  if (g_config->session.prewarm) {
+    // Likely edited next: foo.cc for foo.h and foo.h for foo.cc.
+    if (header) {
+      for (const std::string &related : project->relatedEntries(path))
+        manager->prewarm(related);
+    } else if (file && file->def) {
+      StringRef stem = sys::path::stem(path);
+      for (const IndexInclude &include : file->def->includes)
+        if (sys::path::stem(include.resolved_path) == stem)
+          manager->prewarm(include.resolved_path);
+    }
+  }
 }
 
 void MessageHandler::textDocument_didSave(TextDocumentParam &param) {
   const std::string &path = param.textDocument.uri.getPath();
+  invalidateFileSystem(path);
   pipeline::index(path, {}, IndexMode::Normal, false);
   manager->onSave(path);
+
+  int file_id;
+  size_t limit = std::max(g_config->index.reindexDependents, 0);
+  if (!limit || !findFile(path, &file_id))
+    return;
+  std::vector<std::string> mains;
+  for (int id : db->getDependents(file_id, SIZE_MAX)) {
+    QueryFile &file = db->files[id];
+    if (file.def && project->isMainFile(file.def->path))
+      mains.push_back(file.def->path);
+  }
+  std::stable_partition(mains.begin(), mains.end(), [&](auto &main) {
+    return wfiles->getFile(main) != nullptr;
+  });
+  if (mains.size() > limit)
+    mains.resize(limit);
+  for (auto &main : mains)
+    pipeline::index(main, {},
+                    wfiles->getFile(main) ? IndexMode::Normal
+                                          : IndexMode::Background,
+                    true);
 }
 } // namespace ccls
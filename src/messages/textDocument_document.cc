@@ -5,6 +5,9 @@
 #include "pipeline.hh"
 #include "query.hh"
 
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
 #include <algorithm>
 
 MAKE_HASHABLE(ccls::SymbolIdx, t.usr, t.kind);
@@ -40,27 +43,25 @@ void MessageHandler::textDocument_documentHighlight(
   std::vector<DocumentHighlight> result;
   std::vector<SymbolRef> syms =
       findSymbolsAtLocation(wf, file, param.position, true);
-  for (auto [sym, refcnt] : file->symbol2refcnt) {
-    if (refcnt <= 0)
-      continue;
-    Usr usr = sym.usr;
-    Kind kind = sym.kind;
-    if (std::none_of(syms.begin(), syms.end(), [&](auto &sym1) {
-          return usr == sym1.usr && kind == sym1.kind;
-        }))
+  std::sort(syms.begin(), syms.end(), [](auto &l, auto &r) {
+    return SymbolIdx(l) < SymbolIdx(r);
+  });
+  for (size_t i = 0; i < syms.size(); i++) {
+    if (i && SymbolIdx(syms[i]) == SymbolIdx(syms[i - 1]))
       continue;
-    if (auto loc = getLsLocation(db, wfiles, sym, file_id)) {
-      DocumentHighlight highlight;
-      highlight.range = loc->range;
-      if (sym.role & Role::Write)
-        highlight.kind = DocumentHighlight::Write;
-      else if (sym.role & Role::Read)
-        highlight.kind = DocumentHighlight::Read;
-      else
-        highlight.kind = DocumentHighlight::Text;
-      highlight.role = sym.role;
-      result.push_back(highlight);
-    }
+    for (const ExtentRef &sym : findSymbolOccurrences(*file, syms[i]))
+      if (auto loc = getLsLocation(db, wfiles, sym, file_id)) {
+        DocumentHighlight highlight;
+        highlight.range = loc->range;
+        if (sym.role & Role::Write)
+          highlight.kind = DocumentHighlight::Write;
+        else if (sym.role & Role::Read)
+          highlight.kind = DocumentHighlight::Read;
+        else
+          highlight.kind = DocumentHighlight::Text;
+        highlight.role = sym.role;
+        result.push_back(highlight);
+      }
   }
   std::sort(result.begin(), result.end());
   reply(result);
@@ -95,7 +96,7 @@ void MessageHandler::textDocument_documentLink(TextDocumentParam &param,
 } // namespace ccls
 
 namespace {
-struct DocumentSymbolParam : TextDocumentParam {
+struct DocumentSymbolParam : TextDocumentViewParam {
   // Include sym if `!(sym.role & excludeRole)`.
   Role excludeRole = Role((int)Role::All - (int)Role::Definition -
                           (int)Role::Declaration - (int)Role::Dynamic);
@@ -103,8 +104,8 @@ struct DocumentSymbolParam : TextDocumentParam {
   int startLine = -1;
   int endLine = -1;
 };
-REFLECT_STRUCT(DocumentSymbolParam, textDocument, excludeRole, startLine,
-               endLine);
+REFLECT_STRUCT(DocumentSymbolParam, textDocument, range, excludeRole,
+               startLine, endLine);
 
 struct DocumentSymbol {
   std::string name;
@@ -150,12 +151,23 @@ void MessageHandler::textDocument_documentSymbol(JsonReader &reader,
       findOrFail(param.textDocument.uri.getPath(), reply, &file_id, true);
   if (!file)
     return;
+  // Outline views request the hierarchy of the whole file on every cursor
+  // move. Keep it until the DB or the buffer changes.
+  bool cacheable = wf && !param.range && param.startLine < 0 &&
+                   g_config->client.hierarchicalDocumentSymbolSupport;
+  if (cacheable && wf->document_symbols_generation == db->generation &&
+      wf->document_symbols_exclude == int(param.excludeRole)) {
+    reply.rawArray(wf->document_symbols);
+    return;
+  }
   auto allows = [&](SymbolRef sym) { return !(sym.role & param.excludeRole); };
+  std::vector<ExtentRef> syms =
+      findSymbolsInRange(wf, file, param.range ? &*param.range : nullptr);
 
   if (param.startLine >= 0) {
     std::vector<lsRange> result;
-    for (auto [sym, refcnt] : file->symbol2refcnt) {
-      if (refcnt <= 0 || !allows(sym) ||
+    for (ExtentRef sym : syms) {
+      if (!allows(sym) ||
           !(param.startLine <= sym.range.start.line &&
             sym.range.start.line <= param.endLine))
         continue;
@@ -168,8 +180,8 @@ void MessageHandler::textDocument_documentSymbol(JsonReader &reader,
     std::unordered_map<SymbolIdx, std::unique_ptr<DocumentSymbol>> sym2ds;
     std::vector<std::pair<std::vector<const void *>, DocumentSymbol *>> funcs,
         types;
-    for (auto [sym, refcnt] : file->symbol2refcnt) {
-      if (refcnt <= 0 || !sym.extent.valid())
+    for (ExtentRef sym : syms) {
+      if (!sym.extent.valid())
         continue;
       auto r = sym2ds.try_emplace(SymbolIdx{sym.usr, sym.kind});
       auto &ds = r.first->second;
@@ -247,11 +259,22 @@ void MessageHandler::textDocument_documentSymbol(JsonReader &reader,
         result.push_back(std::move(ds));
       }
     uniquify(result);
-    reply(result);
+    if (!cacheable) {
+      reply(result);
+      return;
+    }
+    rapidjson::StringBuffer output;
+    JsonWriter::W w(output);
+    JsonWriter writer(&w);
+    reflect(writer, result);
+    wf->document_symbols = output.GetString();
+    wf->document_symbols_generation = db->generation;
+    wf->document_symbols_exclude = int(param.excludeRole);
+    reply.rawArray(wf->document_symbols);
   } else {
     std::vector<SymbolInformation> result;
-    for (auto [sym, refcnt] : file->symbol2refcnt) {
-      if (refcnt <= 0 || !allows(sym))
+    for (ExtentRef sym : syms) {
+      if (!allows(sym))
         continue;
       if (std::optional<SymbolInformation> info =
               getSymbolInfo(db, sym, false)) {
@@ -7,6 +7,9 @@
 #include "query.hh"
 #include "working_files.hh"
 
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
 namespace ccls {
 namespace {
 struct FoldingRange {
@@ -17,16 +20,24 @@ REFLECT_STRUCT(FoldingRange, startLine, startCharacter, endLine, endCharacter,
                kind);
 } // namespace
 
-void MessageHandler::textDocument_foldingRange(TextDocumentParam &param,
+void MessageHandler::textDocument_foldingRange(TextDocumentViewParam &param,
                                                ReplyOnce &reply) {
   auto [file, wf] = findOrFail(param.textDocument.uri.getPath(), reply);
   if (!wf)
     return;
+  // Editors request the ranges of the whole file after every change. Keep
+  // them until the DB or the buffer changes.
+  bool cacheable = !param.range;
+  if (cacheable && wf->folding_ranges_generation == db->generation) {
+    reply.rawArray(wf->folding_ranges);
+    return;
+  }
   std::vector<FoldingRange> result;
   std::optional<lsRange> ls_range;
 
-  for (auto [sym, refcnt] : file->symbol2refcnt)
-    if (refcnt > 0 && sym.extent.valid() &&
+  const lsRange *range = param.range ? &*param.range : nullptr;
+  for (ExtentRef sym : findSymbolsInRange(wf, file, range))
+    if (sym.extent.valid() &&
         (sym.kind == Kind::Func || sym.kind == Kind::Type) &&
         (ls_range = getLsRange(wf, sym.extent))) {
       FoldingRange &fold = result.emplace_back();
@@ -35,6 +46,16 @@ void MessageHandler::textDocument_foldingRange(TextDocumentParam &param,
       fold.endLine = ls_range->end.line;
       fold.endCharacter = ls_range->end.character;
     }
-  reply(result);
+  if (!cacheable) {
+    reply(result);
+    return;
+  }
+  rapidjson::StringBuffer output;
+  JsonWriter::W w(output);
+  JsonWriter writer(&w);
+  reflect(writer, result);
+  wf->folding_ranges = output.GetString();
+  wf->folding_ranges_generation = db->generation;
+  reply.rawArray(wf->folding_ranges);
 }
 } // namespace ccls
@@ -8,15 +8,20 @@
 #include <clang/Format/Format.h>
 #include <clang/Tooling/Core/Replacement.h>
 
+#include <algorithm>
+
 namespace ccls {
 using namespace clang;
 
 namespace {
 llvm::Expected<tooling::Replacements> formatCode(StringRef code, StringRef file,
-                                                 tooling::Range range) {
+                                                 tooling::Range range,
+                                                 bool sort_includes) {
   auto style = format::getStyle("file", file, "LLVM", code, nullptr);
   if (!style)
     return style.takeError();
+  if (!sort_includes)
+    return format::reformat(*style, code, {range}, file);
   tooling::Replacements includeReplaces =
       format::sortIncludes(*style, code, {range}, file);
   auto changed = tooling::applyAllReplacements(code, includeReplaces);
@@ -28,39 +33,33 @@ llvm::Expected<tooling::Replacements> formatCode(StringRef code, StringRef file,
       file));
 }
 
-std::vector<TextEdit> replacementsToEdits(std::string_view code,
+std::vector<TextEdit> replacementsToEdits(const WorkingFile &wfile,
                                           const tooling::Replacements &repls) {
   std::vector<TextEdit> ret;
-  int i = 0, line = 0, col = 0;
-  auto move = [&](unsigned p) {
-    for (; i < (int)p; i++)
-      if (code[i] == '\n')
-        line++, col = 0;
-      else {
-        if ((uint8_t)code[i] >= 128) {
-          while (128 <= (uint8_t)code[++i] && (uint8_t)code[i] < 192)
-            ;
-          i--;
-        }
-        col++;
-      }
-  };
-  for (const auto &r : repls) {
-    move(r.getOffset());
-    int l = line, c = col;
-    move(r.getOffset() + r.getLength());
-    ret.push_back({{{l, c}, {line, col}}, r.getReplacementText().str()});
-  }
+  for (const auto &r : repls)
+    ret.push_back({{wfile.getPosition(r.getOffset()),
+                    wfile.getPosition(r.getOffset() + r.getLength())},
+                   r.getReplacementText().str()});
   return ret;
 }
 
 void format(ReplyOnce &reply, WorkingFile *wfile, tooling::Range range) {
   std::string_view code = wfile->buffer_content;
+  // Includes are only sorted if |range| touches an #include or #import line,
+  // which saves a pass over the file for on-type and most range formatting.
+  size_t begin = code.rfind('\n', range.getOffset());
+  begin = begin == std::string_view::npos ? 0 : begin;
+  size_t end = code.find('\n', range.getOffset() + range.getLength());
+  std::string_view lines =
+      code.substr(begin, end == std::string_view::npos ? end : end - begin);
+  bool sort_includes = lines.find("#include") != std::string_view::npos ||
+                       lines.find("#import") != std::string_view::npos;
   auto replsOrErr = formatCode(
       StringRef(code.data(), code.size()),
-      StringRef(wfile->filename.data(), wfile->filename.size()), range);
+      StringRef(wfile->filename.data(), wfile->filename.size()), range,
+      sort_includes);
   if (replsOrErr)
-    reply(replacementsToEdits(code, *replsOrErr));
+    reply(replacementsToEdits(*wfile, *replsOrErr));
   else
     reply.error(ErrorCode::UnknownErrorCode,
                 llvm::toString(replsOrErr.takeError()));
@@ -82,7 +81,7 @@ void MessageHandler::textDocument_onTypeFormatting(
     return;
   }
   std::string_view code = wf->buffer_content;
-  int pos = getOffsetForPosition(param.position, code);
+  int pos = wf->getOffset(param.position);
   auto lbrace = code.find_last_of('{', pos);
   if (lbrace == std::string::npos)
     lbrace = pos;
@@ -95,9 +94,8 @@ void MessageHandler::textDocument_rangeFormatting(
   if (!wf) {
     return;
   }
-  std::string_view code = wf->buffer_content;
-  int begin = getOffsetForPosition(param.range.start, code),
-      end = getOffsetForPosition(param.range.end, code);
+  int begin = wf->getOffset(param.range.start),
+      end = wf->getOffset(param.range.end);
   format(reply, wf, {(unsigned)begin, unsigned(end - begin)});
 }
 } // namespace ccls
@@ -2,7 +2,15 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include "message_handler.hh"
+#include "pipeline.hh"
 #include "query.hh"
+#include "sema_manager.hh"
+
+#include <clang/AST/DeclBase.h>
+#include <clang/Index/IndexDataConsumer.h>
+#include <clang/Index/IndexingAction.h>
+#include <clang/Lex/Lexer.h>
+#include <llvm/ADT/StringRef.h>
 
 namespace ccls {
 namespace {
@@ -41,16 +49,122 @@ const char *languageIdentifier(LanguageId lang) {
   }
 }
 
+// Strips the comment markers and the indentation of the lines of |raw|, like
+// IndexDataConsumer::getComment.
+std::string stripComment(llvm::StringRef raw) {
+  std::string ret;
+  llvm::SmallVector<llvm::StringRef, 8> lines;
+  raw.split(lines, '\n');
+  for (llvm::StringRef line : lines) {
+    line = line.ltrim();
+    if (line.startswith("/*"))
+      line = line.drop_front(2);
+    line = line.ltrim("/*").ltrim("!<").rtrim();
+    if (line.endswith("*/"))
+      line = line.drop_back(2).rtrim();
+    if (line.startswith(" "))
+      line = line.drop_front();
+    if (ret.size())
+      ret += '\n';
+    ret += line;
+  }
+  while (ret.size() && isspace(ret.back()))
+    ret.pop_back();
+  return ret;
+}
+
+bool isDoxygen(llvm::StringRef comment) {
+  return (comment.startswith("///") || comment.startswith("//!") ||
+          comment.startswith("/**") || comment.startswith("/*!")) &&
+         !comment.startswith("/**/");
+}
+
+// Extracts the comment of the declaration at |dr| from the indexed content,
+// for index.lazyComments: the comment block right above its extent, or a
+// trailing ///< comment on the line of its name.
+std::string readComment(llvm::StringRef content, const DeclRef &dr) {
+  llvm::SmallVector<llvm::StringRef, 0> lines;
+  content.split(lines, '\n', dr.range.end.line + 1);
+  int start = dr.extent.valid() ? dr.extent.start.line : dr.range.start.line;
+  if (dr.range.end.line < (int)lines.size()) {
+    llvm::StringRef line = lines[dr.range.end.line];
+    line = line.substr(std::min<size_t>(dr.range.end.column, line.size()));
+    for (const char *marker : {"///<", "//!<", "/**<", "/*!<"}) {
+      size_t i = line.find(marker);
+      if (i != llvm::StringRef::npos)
+        return stripComment(line.substr(i).split('\n').first);
+    }
+  }
+  if (start >= (int)lines.size())
+    return "";
+  int i = start;
+  while (i > 0) {
+    llvm::StringRef line = lines[i - 1].trim();
+    if (line.startswith("//")) {
+      i--;
+    } else if (line.endswith("*/") && i == start) {
+      int j = i - 1;
+      while (j >= 0 && !lines[j].contains("/*"))
+        j--;
+      if (j < 0 || !lines[j].trim().startswith("/*"))
+        return "";
+      i = j;
+      break;
+    } else {
+      break;
+    }
+  }
+  if (i == start)
+    return "";
+  llvm::StringRef first = lines[i].ltrim();
+  if (g_config->index.comments == 1 && !isDoxygen(first))
+    return "";
+  return stripComment(llvm::StringRef(
+      first.data(), lines[start - 1].end() - first.data()));
+}
+
+// Returns the comment of |dr| read by readComment, cached by the position
+// until the DB changes.
+std::string lazyComment(DB *db, const DeclRef &dr) {
+  static std::mutex mutex;
+  static LruCache<std::string, std::string> cache;
+  static uint64_t generation = ~uint64_t(0);
+  QueryFile &file = db->files[dr.file_id];
+  if (!file.def)
+    return "";
+  std::string key = file.def->path + ':' + std::to_string(dr.range.start.line) +
+                    ':' + std::to_string(dr.range.start.column);
+  {
+    std::lock_guard lock(mutex);
+    if (generation != db->generation) {
+      cache.clear();
+      cache.setCapacity(256);
+      generation = db->generation;
+    }
+    if (auto comment = cache.get(key))
+      return *comment;
+  }
+  std::string comment;
+  if (std::optional<std::string> content =
+          pipeline::loadIndexedContent(file.def->path))
+    comment = readComment(*content, dr);
+  std::lock_guard lock(mutex);
+  cache.insert(key, std::make_shared<std::string>(comment));
+  return comment;
+}
+
 // Returns the hover or detailed name for `sym`, if any.
 std::pair<std::optional<MarkedString>, std::optional<MarkedString>>
 getHover(DB *db, LanguageId lang, SymbolRef sym, int file_id) {
   const char *comments = nullptr;
+  const DeclRef *comment_decl = nullptr;
   std::optional<MarkedString> ls_comments, hover;
   withEntity(db, sym, [&](const auto &entity) {
     for (auto &d : entity.def) {
       if (!comments && d.comments[0])
         comments = d.comments;
       if (d.spell) {
+        comment_decl = &*d.spell;
         if (d.comments[0])
           comments = d.comments;
         if (const char *s =
@@ -73,16 +187,130 @@ getHover(DB *db, LanguageId lang, SymbolRef sym, int file_id) {
       else if (d.detailed_name[0])
         hover->value = d.detailed_name;
     }
-    if (comments)
+    if (comments) {
       ls_comments = MarkedString{std::nullopt, comments};
+    } else if (g_config->index.lazyComments && g_config->index.comments) {
+      if (!comment_decl && entity.declarations.size())
+        comment_decl = &entity.declarations[0];
+      if (comment_decl) {
+        std::string comment = lazyComment(db, *comment_decl);
+        if (comment.size())
+          ls_comments = MarkedString{std::nullopt, std::move(comment)};
+      }
+    }
   });
   return {hover, ls_comments};
 }
+// Finds the declaration referenced by the token at |offset| of the main file.
+class DeclFinder : public clang::index::IndexDataConsumer {
+  const clang::SourceManager &sm;
+  const clang::LangOptions &lang;
+  unsigned offset;
+
+public:
+  const clang::Decl *decl = nullptr;
+  Range range;
+
+  DeclFinder(const clang::SourceManager &sm, const clang::LangOptions &lang,
+             unsigned offset)
+      : sm(sm), lang(lang), offset(offset) {}
+#if LLVM_VERSION_MAJOR < 10 // llvmorg-10-init-12036-g3b9715cb219
+# define handleDeclOccurrence handleDeclOccurence
+#endif
+  bool handleDeclOccurrence(const clang::Decl *d,
+                            clang::index::SymbolRoleSet roles,
+                            llvm::ArrayRef<clang::index::SymbolRelation>,
+                            clang::SourceLocation loc,
+                            ASTNodeInfo) override {
+    if (decl || roles & uint32_t(clang::index::SymbolRole::Implicit))
+      return true;
+    loc = sm.getFileLoc(loc);
+    auto [fid, off] = sm.getDecomposedLoc(loc);
+    if (fid != sm.getMainFileID() || off > offset ||
+        offset > off + clang::Lexer::MeasureTokenLength(loc, sm, lang))
+      return true;
+    decl = d;
+    range = fromTokenRange(sm, lang, clang::SourceRange(loc, loc));
+    return false;
+  }
+};
+
+// Computes the hover at |offset| from the retained AST of the buffer, for
+// when the index is stale. Returns false if there is no declaration.
+bool hoverFromAST(ParsedAST &ast, LanguageId lang, int offset, Hover &result) {
+  std::lock_guard lock(ast.mutex);
+  clang::CompilerInstance &clang = *ast.clang;
+  if (offset < 0 || !clang.hasASTContext())
+    return false;
+  clang::ASTContext &ctx = clang.getASTContext();
+  clang::SourceManager &sm = clang.getSourceManager();
+  DeclFinder finder(sm, clang.getLangOpts(), offset);
+  clang::index::IndexingOptions opts;
+  opts.SystemSymbolFilter =
+      clang::index::IndexingOptions::SystemSymbolFilterKind::All;
+  opts.IndexFunctionLocals = true;
+  std::vector<clang::Decl *> decls = ast.topLevelDeclsAt(offset);
+  clang::index::indexTopLevelDecls(ctx,
+#if LLVM_VERSION_MAJOR >= 9
+                                   clang.getPreprocessor(),
+#endif
+                                   {decls.data(), decls.size()}, finder, opts);
+  if (!finder.decl)
+    return false;
+
+  const clang::Decl *d = finder.decl;
+  clang::PrintingPolicy pp(ctx.getLangOpts());
+  pp.AnonymousTagLocations = false;
+  pp.TerseOutput = true;
+  pp.PolishForDeclaration = true;
+  pp.ConstantsAsWritten = true;
+  pp.SuppressTagKeyword = true;
+  pp.SuppressInitializers = true;
+  std::string name;
+  llvm::raw_string_ostream os(name);
+  d->print(os, pp);
+  os.flush();
+  // Like IndexDataConsumer::setName.
+  for (std::string::size_type i = 0;
+       (i = name.find("{\n}", i)) != std::string::npos;)
+    name.replace(i, 3, "{}");
+
+  if (g_config->index.comments)
+    if (const clang::RawComment *rc = ctx.getRawCommentForAnyRedecl(d)) {
+      std::string comment = stripComment(rc->getRawText(sm));
+      if (comment.size())
+        result.contents.push_back({std::nullopt, std::move(comment)});
+    }
+  if (name.size())
+    result.contents.push_back({languageIdentifier(lang), std::move(name)});
+  if (result.contents.empty())
+    return false;
+  Range &r = finder.range;
+  result.range = lsRange{{r.start.line, r.start.column},
+                         {r.end.line, r.end.column}};
+  return true;
+}
 } // namespace
 
 void MessageHandler::textDocument_hover(TextDocumentPositionParam &param,
                                         ReplyOnce &reply) {
-  auto [file, wf] = findOrFail(param.textDocument.uri.getPath(), reply);
+  std::string path = param.textDocument.uri.getPath();
+  std::shared_ptr<ParsedAST> ast;
+  if (WorkingFile *wf = wfiles->getFile(path)) {
+    ast = manager->getAST(path, wf->buffer_content);
+    // While the buffer differs from the indexed content, the index may be
+    // stale or miss the symbol.
+    if (ast && wf->index_hashes != wf->buffer_hashes) {
+      Hover result;
+      if (hoverFromAST(*ast, lookupExtension(path).first,
+                       wf->getOffset(param.position), result)) {
+        reply(result);
+        return;
+      }
+      ast.reset();
+    }
+  }
+  auto [file, wf] = findOrFail(path, reply);
   if (!wf)
     return;
 
@@ -103,6 +331,9 @@ void MessageHandler::textDocument_hover(TextDocumentPositionParam &param,
       break;
     }
   }
+  if (result.contents.empty() && ast)
+    hoverFromAST(*ast, file->def->language, wf->getOffset(param.position),
+                 result);
 
   reply(result);
 }
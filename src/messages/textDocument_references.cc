@@ -2,11 +2,14 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include "message_handler.hh"
+#include "pipeline.hh"
 #include "query.hh"
 
-#include <llvm/ADT/iterator_range.h>
-
-#include <unordered_set>
+#include <algorithm>
+#include <atomic>
+#include <ctype.h>
+#include <stdint.h>
+#include <thread>
 
 using namespace llvm;
 
@@ -27,10 +30,57 @@ struct ReferenceParam : public TextDocumentPositionParam {
   Role excludeRole = Role::None;
   // Include references with all |Role| bits set.
   Role role = Role::None;
+
+  // If set, stream the locations as $/progress notifications.
+  RequestId partialResultToken;
 };
 REFLECT_STRUCT(ReferenceParam::Context, includeDeclaration);
 REFLECT_STRUCT(ReferenceParam, textDocument, position, context, folders, base,
-               excludeRole, role);
+               excludeRole, role, partialResultToken);
+
+// Locations per partial result.
+constexpr size_t kPartialResultSize = 1000;
+// Entities of a hierarchy gathered by one thread.
+constexpr size_t kEntitiesPerThread = 16;
+// Uses converted to locations by one thread at a time.
+constexpr size_t kUsesPerChunk = 4096;
+
+// With index.macroUses < 2, a file records only its first expansion of a macro
+// defined outside workspace folders. Calls |fn| with each occurrence of |name|
+// as an identifier in the indexed content of the file, except |def|.
+template <typename Fn>
+void findMacroExpansions(DB *db, int file_id, std::string_view name,
+                         std::optional<Use> def, Fn &&fn) {
+  QueryFile &file = db->files[file_id];
+  if (!file.def || name.empty())
+    return;
+  std::optional<std::string> content =
+      pipeline::loadIndexedContent(file.def->path);
+  if (!content)
+    return;
+  auto isIdent = [](char c) { return isalnum(uint8_t(c)) || c == '_'; };
+  int line = 0;
+  size_t last = 0, line_start = 0;
+  for (size_t i = 0; (i = content->find(name, i)) != std::string::npos;
+       i += name.size()) {
+    size_t end = i + name.size();
+    if ((i && isIdent((*content)[i - 1])) ||
+        (end < content->size() && isIdent((*content)[end])))
+      continue;
+    for (; last < i; last++)
+      if ((*content)[last] == '\n') {
+        line++;
+        line_start = last + 1;
+      }
+    if (line > UINT16_MAX || end - line_start > INT16_MAX)
+      break;
+    Pos start{uint16_t(line), int16_t(i - line_start)},
+        end_pos{uint16_t(line), int16_t(end - line_start)};
+    Use use{{{start, end_pos}, Role::Dynamic}, file_id};
+    if (!(def && def->file_id == file_id && def->range.start == start))
+      fn(use);
+  }
+}
 } // namespace
 
 void MessageHandler::textDocument_references(JsonReader &reader,
@@ -43,57 +93,135 @@ void MessageHandler::textDocument_references(JsonReader &reader,
 
   for (auto &folder : param.folders)
     ensureEndsInSlash(folder);
-  std::vector<uint8_t> file_set = db->getFileSet(param.folders);
-  std::vector<Location> result;
-
-  std::unordered_set<Use> seen_uses;
-  int line = param.position.line;
+  std::shared_ptr<const FileSet> folder_files = db->getFileSet(param.folders);
+  const FileSet &file_set = *folder_files;
+  auto keep = [&](Use use) {
+    return file_set[use.file_id] &&
+           Role(use.role & param.role) == param.role &&
+           !(use.role & param.excludeRole);
+  };
+  // Appends the references of |sym| to |out|. Called concurrently for the
+  // entities of a hierarchy; DB is not modified while a request is handled.
+  auto collect = [&](SymbolRef sym, std::vector<Use> &out) {
+    withEntity(db, sym, [&](const auto &entity) {
+      const auto *any_def = entity.anyDef();
+      bool macro = g_config->index.macroUses < 2 && any_def &&
+                   any_def->kind == SymbolKind::Macro;
+      std::vector<int> macro_files;
+      entity.uses.filter(file_set, param.role, param.excludeRole,
+                         [&](Use use) {
+                           out.push_back(use);
+                           if (macro)
+                             macro_files.push_back(use.file_id);
+                         });
+      std::sort(macro_files.begin(), macro_files.end());
+      macro_files.erase(std::unique(macro_files.begin(), macro_files.end()),
+                        macro_files.end());
+      for (int file_id : macro_files)
+        findMacroExpansions(db, file_id, any_def->name(false),
+                            any_def->spell ? std::optional<Use>(*any_def->spell)
+                                           : std::nullopt,
+                            [&](Use use) {
+                              if (keep(use))
+                                out.push_back(use);
+                            });
+      if (param.context.includeDeclaration) {
+        for (auto &def : entity.def)
+          if (def.spell && keep(*def.spell))
+            out.push_back(*def.spell);
+        for (Use use : entity.declarations)
+          if (keep(use))
+            out.push_back(use);
+      }
+    });
+  };
 
+  size_t max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  std::vector<Use> uses;
   for (SymbolRef sym : findSymbolsAtLocation(wf, file, param.position)) {
     // Found symbol. Return references.
-    std::unordered_set<Usr> seen;
-    seen.insert(sym.usr);
-    std::vector<Usr> stack{sym.usr};
-    if (sym.kind != Kind::Func)
-      param.base = false;
-    while (stack.size()) {
-      sym.usr = stack.back();
-      stack.pop_back();
-      auto fn = [&](Use use, SymbolKind parent_kind) {
-        if (file_set[use.file_id] &&
-            Role(use.role & param.role) == param.role &&
-            !(use.role & param.excludeRole) && seen_uses.insert(use).second)
-          if (auto loc = getLsLocation(db, wfiles, use))
-            result.push_back(*loc);
-      };
-      withEntity(db, sym, [&](const auto &entity) {
-        SymbolKind parent_kind = SymbolKind::Unknown;
-        for (auto &def : entity.def)
-          if (def.spell) {
-            parent_kind = getSymbolKind(db, sym);
-            if (param.base)
-              for (Usr usr : make_range(def.bases_begin(), def.bases_end()))
-                if (!seen.count(usr)) {
-                  seen.insert(usr);
-                  stack.push_back(usr);
-                }
-            break;
-          }
-        for (Use use : entity.uses)
-          fn(use, parent_kind);
-        if (param.context.includeDeclaration) {
-          for (auto &def : entity.def)
-            if (def.spell)
-              fn(*def.spell, parent_kind);
-          for (Use use : entity.declarations)
-            fn(use, parent_kind);
-        }
-      });
-    }
+    std::vector<Usr> usrs{sym.usr};
+    if (sym.kind == Kind::Func && param.base)
+      for (EntityId id : getHierarchy(db, Kind::Func,
+                                      db->func_usr.find(sym.usr)->second,
+                                      false))
+        usrs.push_back(db->funcs[id].usr);
+    // Each thread gathers into its own vector.
+    size_t threads = std::min(
+        (usrs.size() + kEntitiesPerThread - 1) / kEntitiesPerThread,
+        max_threads);
+    std::vector<std::vector<Use>> parts(threads);
+    std::atomic<size_t> next{0};
+    runPooled(int(threads), [&](int w) {
+      SymbolRef sym1 = sym;
+      for (size_t i; (i = next++) < usrs.size();) {
+        sym1.usr = usrs[i];
+        collect(sym1, parts[w]);
+      }
+    });
+    for (auto &part : parts)
+      uses.insert(uses.end(), part.begin(), part.end());
     break;
   }
 
-  if (result.empty()) {
+  // The same use may be reached through several entities of the hierarchy, or
+  // as both a use and a declaration. Sorting by file also groups the
+  // conversion below, as consecutive uses map through the same working file.
+  std::sort(uses.begin(), uses.end(), [](const Use &l, const Use &r) {
+    return l.file_id != r.file_id ? l.file_id < r.file_id : l.range < r.range;
+  });
+  uses.erase(std::unique(uses.begin(), uses.end()), uses.end());
+  size_t max_num = std::max(g_config->xref.maxNum, 0);
+
+  // Convert in parallel, in chunks of whole files. xref.maxNum caps converted
+  // locations, as some uses may not convert. Chunks are taken in order, so
+  // once the taken ones have max_num locations, the first max_num locations
+  // are among them and the remaining chunks are skipped.
+  std::vector<size_t> chunks{0};
+  for (size_t i = 1; i < uses.size(); i++)
+    if (uses[i].file_id != uses[i - 1].file_id &&
+        i - chunks.back() >= kUsesPerChunk)
+      chunks.push_back(i);
+  chunks.push_back(uses.size());
+  std::vector<std::optional<Location>> locs(uses.size());
+  std::atomic<size_t> next_chunk{0}, converted{0};
+  runPooled(int(std::min(chunks.size() - 1, max_threads)), [&](int) {
+    for (size_t c;
+         converted < max_num && (c = next_chunk++) + 1 < chunks.size();) {
+      size_t k = 0;
+      for (size_t i = chunks[c]; i < chunks[c + 1]; i++)
+        k += bool(locs[i] = getLsLocation(db, wfiles, uses[i]));
+      converted += k;
+    }
+  });
+
+  std::vector<Location> result;
+  // Files with only the first reference to each symbol, see
+  // index.largeFileSize.
+  std::vector<int> partial_files;
+  int line = param.position.line;
+  // Number of locations already sent as partial results.
+  size_t sent = 0;
+  auto flush = [&]() {
+    if (param.partialResultToken.valid() && result.size()) {
+      pipeline::partialResult(param.partialResultToken, result);
+      sent += result.size();
+      result.clear();
+    }
+  };
+  for (size_t i = 0; i < uses.size() && sent + result.size() < max_num; i++) {
+    if (!locs[i])
+      continue;
+    QueryFile &file1 = db->files[uses[i].file_id];
+    if (file1.def && file1.def->partial &&
+        (partial_files.empty() || partial_files.back() != file1.id))
+      partial_files.push_back(file1.id);
+    result.push_back(std::move(*locs[i]));
+    if (result.size() >= kPartialResultSize)
+      flush();
+  }
+
+  if (result.empty() && !sent) {
     // |path| is the #include line. If the cursor is not on such line but line
     // = 0,
     // use the current filename.
@@ -118,8 +246,18 @@ void MessageHandler::textDocument_references(JsonReader &reader,
             }
   }
 
-  if ((int)result.size() >= g_config->xref.maxNum)
-    result.resize(g_config->xref.maxNum);
+  if (sent + result.size() > max_num)
+    result.resize(max_num - sent);
+  flush();
   reply(result);
+  // Locations have no room for a flag, so tell the user separately.
+  if (partial_files.size()) {
+    ShowMessageParam param1{MessageType::Info, "references are partial in "};
+    param1.message += db->files[partial_files[0]].def->path;
+    if (partial_files.size() > 1)
+      param1.message +=
+          " and " + std::to_string(partial_files.size() - 1) + " other files";
+    pipeline::notify(window_showMessage, param1);
+  }
 }
 } // namespace ccls
@@ -2,20 +2,44 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include "message_handler.hh"
+#include "pipeline.hh"
 #include "query.hh"
 
 #include <clang/Basic/CharInfo.h>
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
 #include <unordered_set>
 
 using namespace clang;
 
 namespace ccls {
 namespace {
+// Whether |text| is at |range| of |content|, whose line starts are |lines|.
+bool matches(std::string_view content, const std::vector<int> &lines,
+             lsRange range, std::string_view text) {
+  auto offset = [&](Position pos) {
+    if (pos.line < 0 || pos.line >= (int)lines.size())
+      return -1;
+    int start = lines[pos.line];
+    return start + getOffsetForPosition({0, pos.character},
+                                        content.substr(start));
+  };
+  int start = offset(range.start), end = offset(range.end);
+  return start >= 0 && start <= end &&
+         content.compare(start, end - start, text) == 0;
+}
+
 WorkspaceEdit buildWorkspaceEdit(DB *db, WorkingFiles *wfiles, SymbolRef sym,
                                  std::string_view old_text,
                                  const std::string &new_text) {
-  std::unordered_map<int, std::pair<WorkingFile *, TextDocumentEdit>> path2edit;
+  struct FileEdit {
+    std::string path;
+    WorkingFile *wf = nullptr;
+    TextDocumentEdit edit;
+  };
+  std::unordered_map<int, FileEdit> path2edit;
   std::unordered_map<int, std::unordered_set<Range>> edited;
 
   eachOccurrence(db, sym, true, [&](Use use) {
@@ -28,26 +52,54 @@ WorkspaceEdit buildWorkspaceEdit(DB *db, WorkingFiles *wfiles, SymbolRef sym,
       return;
 
     auto [it, inserted] = path2edit.try_emplace(file_id);
-    auto &edit = it->second.second;
+    FileEdit &fe = it->second;
     if (inserted) {
-      const std::string &path = file.def->path;
-      edit.textDocument.uri = DocumentUri::fromPath(path);
-      if ((it->second.first = wfiles->getFile(path)))
-        edit.textDocument.version = it->second.first->version;
-    }
-    // TODO LoadIndexedContent if wf is nullptr.
-    if (WorkingFile *wf = it->second.first) {
-      int start = getOffsetForPosition(loc->range.start, wf->buffer_content),
-          end = getOffsetForPosition(loc->range.end, wf->buffer_content);
-      if (wf->buffer_content.compare(start, end - start, old_text))
-        return;
+      fe.path = file.def->path;
+      fe.edit.textDocument.uri = DocumentUri::fromPath(fe.path);
+      if ((fe.wf = wfiles->getFile(fe.path)))
+        fe.edit.textDocument.version = fe.wf->version;
     }
-    edit.edits.push_back({loc->range, new_text});
+    fe.edit.edits.push_back({loc->range, new_text});
   });
 
+  // Drop edits whose range does not hold |old_text|, checking open files
+  // against their buffers and the others against the indexed content. Files
+  // are loaded and checked in parallel.
+  std::vector<FileEdit *> todo;
+  for (auto &x : path2edit)
+    todo.push_back(&x.second);
+  std::atomic<size_t> next{0};
+  size_t threads = std::max(1u, std::thread::hardware_concurrency());
+  if (todo.size())
+    runPooled(int(std::min(todo.size(), threads)), [&](int) {
+      for (size_t i; (i = next++) < todo.size();) {
+        FileEdit &fe = *todo[i];
+        std::optional<std::string> content;
+        std::string_view buf;
+        if (fe.wf)
+          buf = fe.wf->buffer_content;
+        else if ((content = pipeline::loadIndexedContent(fe.path)))
+          buf = *content;
+        else
+          continue; // Nothing to check against.
+        std::vector<int> lines{0};
+        for (size_t j = 0; j < buf.size(); j++)
+          if (buf[j] == '\n')
+            lines.push_back(int(j + 1));
+        auto &edits = fe.edit.edits;
+        edits.erase(std::remove_if(edits.begin(), edits.end(),
+                                   [&](const TextEdit &edit) {
+                                     return !matches(buf, lines, edit.range,
+                                                     old_text);
+                                   }),
+                    edits.end());
+      }
+    });
+
   WorkspaceEdit ret;
   for (auto &x : path2edit)
-    ret.documentChanges.push_back(std::move(x.second.second));
+    if (x.second.edit.edits.size())
+      ret.documentChanges.push_back(std::move(x.second.edit));
   return ret;
 }
 } // namespace
@@ -0,0 +1,208 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "message_handler.hh"
+#include "query.hh"
+#include "working_files.hh"
+
+#include <algorithm>
+
+namespace ccls {
+const std::vector<const char *> kSemanticTokenTypes = {
+    "namespace", "type", "class", "enum", "interface", "struct",
+    "typeParameter", "parameter", "variable", "property", "enumMember",
+    "function", "method", "macro"};
+const std::vector<const char *> kSemanticTokenModifiers = {"static"};
+
+namespace {
+struct SemanticTokensDeltaParam {
+  TextDocumentIdentifier textDocument;
+  std::string previousResultId;
+};
+REFLECT_STRUCT(SemanticTokensDeltaParam, textDocument, previousResultId);
+
+struct SemanticTokensRangeParam {
+  TextDocumentIdentifier textDocument;
+  lsRange range;
+};
+REFLECT_STRUCT(SemanticTokensRangeParam, textDocument, range);
+
+struct SemanticTokens {
+  std::optional<std::string> resultId;
+  std::vector<int> data;
+};
+REFLECT_STRUCT(SemanticTokens, resultId, data);
+
+struct SemanticTokensEdit {
+  int start, deleteCount;
+  std::vector<int> data;
+};
+REFLECT_STRUCT(SemanticTokensEdit, start, deleteCount, data);
+
+struct SemanticTokensDelta {
+  std::string resultId;
+  std::vector<SemanticTokensEdit> edits;
+};
+REFLECT_STRUCT(SemanticTokensDelta, resultId, edits);
+
+// Returns the index in kSemanticTokenTypes or -1 if |kind| is not highlighted.
+int tokenType(SymbolKind kind) {
+  switch (kind) {
+  case SymbolKind::Namespace:
+    return 0;
+  case SymbolKind::TypeAlias:
+    return 1;
+  case SymbolKind::Class:
+    return 2;
+  case SymbolKind::Enum:
+    return 3;
+  case SymbolKind::Interface:
+    return 4;
+  case SymbolKind::Struct:
+    return 5;
+  case SymbolKind::TypeParameter:
+    return 6;
+  case SymbolKind::Parameter:
+    return 7;
+  case SymbolKind::Variable:
+  case SymbolKind::Constant:
+    return 8;
+  case SymbolKind::Field:
+  case SymbolKind::Property:
+    return 9;
+  case SymbolKind::EnumMember:
+    return 10;
+  case SymbolKind::Function:
+    return 11;
+  case SymbolKind::Method:
+  case SymbolKind::StaticMethod:
+  case SymbolKind::Constructor:
+    return 12;
+  case SymbolKind::Macro:
+    return 13;
+  default:
+    return -1;
+  }
+}
+
+// Encodes the single-line ranges of |symbols| intersecting |range| (all if
+// null) as relative (line, character, length, type, modifiers) tuples.
+std::vector<int> encodeTokens(std::vector<CclsSemanticHighlightSymbol> &symbols,
+                              const lsRange *range) {
+  struct Token {
+    Position start;
+    int length, type, modifiers;
+  };
+  std::vector<Token> tokens;
+  for (auto &symbol : symbols) {
+    int type = tokenType(symbol.kind);
+    if (type < 0)
+      continue;
+    int modifiers = symbol.storage == clang::SC_Static ||
+                    symbol.kind == SymbolKind::StaticMethod;
+    for (lsRange &r : symbol.lsRanges)
+      if (r.start.line == r.end.line &&
+          (!range || (r.start < range->end && range->start < r.end)))
+        tokens.push_back(
+            {r.start, r.end.character - r.start.character, type, modifiers});
+  }
+  std::sort(tokens.begin(), tokens.end(),
+            [](auto &l, auto &r) { return l.start < r.start; });
+
+  std::vector<int> data;
+  data.reserve(tokens.size() * 5);
+  Position last{0, 0};
+  for (Token &t : tokens) {
+    data.push_back(t.start.line - last.line);
+    data.push_back(t.start.line == last.line
+                       ? t.start.character - last.character
+                       : t.start.character);
+    data.push_back(t.length);
+    data.push_back(t.type);
+    data.push_back(t.modifiers);
+    last = t.start;
+  }
+  return data;
+}
+
+// Returns the tokens of the whole file, reusing those of the last full or
+// delta result if the DB and the buffer have not changed since.
+const std::vector<int> &fileTokens(DB *db, WorkingFile *wf, QueryFile &file) {
+  static uint64_t result_id;
+  if (wf->semantic_tokens_generation != db->generation ||
+      wf->semantic_tokens_id.empty()) {
+    std::vector<CclsSemanticHighlightSymbol> symbols;
+    computeSemanticHighlight(db, wf, file, symbols);
+    std::vector<int> data = encodeTokens(symbols, nullptr);
+    wf->semantic_tokens_generation = db->generation;
+    if (data != wf->semantic_tokens || wf->semantic_tokens_id.empty()) {
+      wf->semantic_tokens = std::move(data);
+      wf->semantic_tokens_id = std::to_string(++result_id);
+    }
+  }
+  return wf->semantic_tokens;
+}
+} // namespace
+
+void MessageHandler::textDocument_semanticTokensFull(TextDocumentParam &param,
+                                                     ReplyOnce &reply) {
+  auto [file, wf] = findOrFail(param.textDocument.uri.getPath(), reply);
+  if (!wf)
+    return;
+  SemanticTokens result;
+  result.data = fileTokens(db, wf, *file);
+  result.resultId = wf->semantic_tokens_id;
+  reply(result);
+}
+
+void MessageHandler::textDocument_semanticTokensFullDelta(JsonReader &reader,
+                                                          ReplyOnce &reply) {
+  SemanticTokensDeltaParam param;
+  reflect(reader, param);
+  auto [file, wf] = findOrFail(param.textDocument.uri.getPath(), reply);
+  if (!wf)
+    return;
+  if (param.previousResultId.empty() ||
+      param.previousResultId != wf->semantic_tokens_id) {
+    SemanticTokens result;
+    result.data = fileTokens(db, wf, *file);
+    result.resultId = wf->semantic_tokens_id;
+    reply(result);
+    return;
+  }
+
+  std::vector<int> old = wf->semantic_tokens;
+  const std::vector<int> &data = fileTokens(db, wf, *file);
+  SemanticTokensDelta result;
+  result.resultId = wf->semantic_tokens_id;
+  // A single edit replacing everything between the common prefix and the
+  // common suffix. Edits usually touch a few adjacent tokens.
+  size_t prefix = 0, suffix = 0, n = std::min(old.size(), data.size());
+  while (prefix < n && old[prefix] == data[prefix])
+    prefix++;
+  while (suffix < n - prefix &&
+         old[old.size() - 1 - suffix] == data[data.size() - 1 - suffix])
+    suffix++;
+  if (prefix != old.size() || prefix != data.size()) {
+    SemanticTokensEdit &edit = result.edits.emplace_back();
+    edit.start = prefix;
+    edit.deleteCount = old.size() - prefix - suffix;
+    edit.data.assign(data.begin() + prefix, data.end() - suffix);
+  }
+  reply(result);
+}
+
+void MessageHandler::textDocument_semanticTokensRange(JsonReader &reader,
+                                                      ReplyOnce &reply) {
+  SemanticTokensRangeParam param;
+  reflect(reader, param);
+  auto [file, wf] = findOrFail(param.textDocument.uri.getPath(), reply);
+  if (!wf)
+    return;
+  std::vector<CclsSemanticHighlightSymbol> symbols;
+  computeSemanticHighlight(db, wf, *file, symbols, &param.range);
+  SemanticTokens result;
+  result.data = encodeTokens(symbols, &param.range);
+  reply(result);
+}
+} // namespace ccls
@@ -5,6 +5,8 @@
 #include "pipeline.hh"
 #include "sema_manager.hh"
 
+#include <clang/AST/RecursiveASTVisitor.h>
+#include <clang/Lex/Lexer.h>
 #include <clang/Sema/Sema.h>
 
 namespace ccls {
@@ -139,6 +141,135 @@ public:
   CodeCompletionAllocator &getAllocator() override { return *alloc; }
   CodeCompletionTUInfo &getCodeCompletionTUInfo() override { return cCTUInfo; }
 };
+
+// Finds the innermost call whose parentheses enclose |offset| of the main
+// file, and the overloads it may resolve to.
+class CallFinder : public RecursiveASTVisitor<CallFinder> {
+  const SourceManager &sm;
+  const LangOptions &lang;
+  StringRef content;
+  unsigned offset;
+
+  // Returns the offset of |l| in the main file, or -1.
+  int getOffset(SourceLocation l) const {
+    if (l.isInvalid())
+      return -1;
+    l = sm.getFileLoc(l);
+    auto [fid, off] = sm.getDecomposedLoc(l);
+    return fid == sm.getMainFileID() ? int(off) : -1;
+  }
+  int getEndOffset(SourceLocation l) const {
+    return getOffset(Lexer::getLocForEndOfToken(sm.getFileLoc(l), 0, sm, lang));
+  }
+  // Whether the parentheses at |l| and |rparen| enclose |offset| and are
+  // inside those found so far.
+  bool enclose(int l, SourceLocation rparen) {
+    return l >= 0 && l < (int)content.size() && content[l] == '(' &&
+           l < (int)offset && (int)offset <= getOffset(rparen) && l > lparen;
+  }
+  void setArgs(Expr *const *args, unsigned n) {
+    active = 0;
+    for (unsigned i = 0; i < n; i++) {
+      if (isa<CXXDefaultArgExpr>(args[i]))
+        break;
+      int end = getEndOffset(args[i]->getEndLoc());
+      if (end < 0 || end >= (int)offset)
+        break;
+      active++;
+    }
+  }
+  void add(NamedDecl *nd) {
+    nd = nd->getUnderlyingDecl();
+    if (!seen.insert(nd->getCanonicalDecl()).second)
+      return;
+    if (auto *ftd = dyn_cast<FunctionTemplateDecl>(nd))
+      candidates.emplace_back(ftd);
+    else if (auto *fd = dyn_cast<FunctionDecl>(nd))
+      candidates.emplace_back(fd);
+  }
+  void addOverloads(FunctionDecl *fd) {
+    candidates.clear();
+    seen.clear();
+    if (FunctionTemplateDecl *ftd = fd->getPrimaryTemplate())
+      fd = ftd->getTemplatedDecl();
+    for (NamedDecl *nd : fd->getDeclContext()->lookup(fd->getDeclName()))
+      add(nd);
+    if (candidates.empty())
+      add(fd);
+  }
+
+public:
+  int lparen = -1;
+  unsigned active = 0;
+  std::vector<CodeCompleteConsumer::OverloadCandidate> candidates;
+  llvm::SmallPtrSet<const Decl *, 8> seen;
+
+  CallFinder(const SourceManager &sm, const LangOptions &lang,
+             StringRef content, unsigned offset)
+      : sm(sm), lang(lang), content(content), offset(offset) {}
+
+  bool VisitCallExpr(CallExpr *e) {
+    if (isa<CXXOperatorCallExpr>(e))
+      return true;
+    Expr *callee = e->getCallee();
+    int l = getEndOffset(callee->getEndLoc());
+    while (l >= 0 && l < (int)content.size() && isspace(content[l]))
+      l++;
+    if (!enclose(l, e->getRParenLoc()))
+      return true;
+    if (FunctionDecl *fd = e->getDirectCallee()) {
+      addOverloads(fd);
+    } else if (auto *ovl =
+                   dyn_cast<OverloadExpr>(callee->IgnoreParenImpCasts())) {
+      candidates.clear();
+      seen.clear();
+      for (NamedDecl *nd : ovl->decls())
+        add(nd);
+    } else {
+      return true;
+    }
+    lparen = l;
+    setArgs(e->getArgs(), e->getNumArgs());
+    return true;
+  }
+  bool VisitCXXConstructExpr(CXXConstructExpr *e) {
+    SourceRange r = e->getParenOrBraceRange();
+    int l = getOffset(r.getBegin());
+    if (!enclose(l, r.getEnd()))
+      return true;
+    addOverloads(e->getConstructor());
+    lparen = l;
+    setArgs(e->getArgs(), e->getNumArgs());
+    return true;
+  }
+};
+
+// Computes the signature help at |offset| from the retained AST of the
+// buffer. Returns false if the AST has no call there, e.g. when its
+// arguments do not parse yet.
+bool signatureHelpFromAST(ParsedAST &ast, int offset,
+                          SignatureHelpConsumer &consumer) {
+  std::lock_guard lock(ast.mutex);
+  CompilerInstance &clang = *ast.clang;
+  if (offset < 0 || !clang.hasSema())
+    return false;
+  SourceManager &sm = clang.getSourceManager();
+  CallFinder finder(sm, clang.getLangOpts(), ast.content, offset);
+  for (Decl *d : ast.topLevelDeclsAt(offset))
+    finder.TraverseDecl(d);
+  if (finder.lparen < 0 || finder.candidates.empty())
+    return false;
+  consumer.ProcessOverloadCandidates(clang.getSema(), finder.active,
+                                     finder.candidates.data(),
+                                     finder.candidates.size()
+#if LLVM_VERSION_MAJOR >= 8
+                                         ,
+                                     sm.getLocForStartOfFile(sm.getMainFileID())
+                                         .getLocWithOffset(finder.lparen)
+#endif
+  );
+  return consumer.ls_sighelp.signatures.size();
+}
 } // namespace
 
 void MessageHandler::textDocument_signatureHelp(
@@ -160,35 +291,43 @@ void MessageHandler::textDocument_signatureHelp(
     begin_pos = wf->getCompletionPosition(param.position, &filter, &end_pos);
   }
 
+  int64_t generation = manager->preambleGeneration(path);
   SemaManager::OnComplete callback =
-      [reply, path, begin_pos, buffer_line](CodeCompleteConsumer *optConsumer) {
+      [reply, path, begin_pos, buffer_line,
+       generation](CodeCompleteConsumer *optConsumer) {
         if (!optConsumer)
           return;
         auto *consumer = static_cast<SignatureHelpConsumer *>(optConsumer);
         reply(consumer->ls_sighelp);
-        if (!consumer->from_cache) {
-          cache.withLock([&]() {
-            cache.path = path;
-            cache.line = buffer_line;
-            cache.position = begin_pos;
-            cache.result = consumer->ls_sighelp;
-          });
-        }
+        if (!consumer->from_cache)
+          cache.put(path, buffer_line, begin_pos, generation,
+                    consumer->ls_sighelp);
       };
 
   CodeCompleteOptions ccOpts;
   ccOpts.IncludeGlobals = false;
   ccOpts.IncludeMacros = false;
   ccOpts.IncludeBriefComments = true;
-  if (cache.isCacheValid(path, buffer_line, begin_pos)) {
+  SignatureHelp sighelp;
+  if (cache.get(path, buffer_line, begin_pos, generation, sighelp)) {
     SignatureHelpConsumer consumer(ccOpts, true);
-    cache.withLock([&]() { consumer.ls_sighelp = cache.result; });
+    consumer.ls_sighelp = std::move(sighelp);
     callback(&consumer);
-  } else {
-    manager->comp_tasks.pushBack(std::make_unique<SemaManager::CompTask>(
-        reply.id, param.textDocument.uri.getPath(), param.position,
-        std::make_unique<SignatureHelpConsumer>(ccOpts, false), ccOpts,
-        callback));
+    return;
+  }
+  // The retained AST is up to date unless the buffer has changed since the
+  // last diagnostics run.
+  if (std::shared_ptr<ParsedAST> ast =
+          manager->getAST(path, wf->buffer_content)) {
+    SignatureHelpConsumer consumer(ccOpts, true);
+    if (signatureHelpFromAST(*ast, wf->getOffset(param.position), consumer)) {
+      reply(consumer.ls_sighelp);
+      return;
+    }
   }
+  manager->comp_tasks.pushBack(std::make_unique<SemaManager::CompTask>(
+      reply.id, param.textDocument.uri.getPath(), param.position,
+      std::make_unique<SignatureHelpConsumer>(ccOpts, false), ccOpts,
+      callback));
 }
 } // namespace ccls
@@ -1,6 +1,9 @@
 // Copyright 2017-2018 ccls Authors
 // SPDX-License-Identifier: Apache-2.0
 
+#include "clang_tu.hh"
+#include "file_watcher.hh"
+#include "filesystem.hh"
 #include "fuzzy_match.hh"
 #include "log.hh"
 #include "message_handler.hh"
@@ -14,9 +17,12 @@
 #include <llvm/Support/Path.h>
 
 #include <algorithm>
+#include <array>
 #include <ctype.h>
 #include <functional>
 #include <limits.h>
+#include <set>
+#include <unordered_set>
 using namespace llvm;
 
 namespace ccls {
@@ -32,40 +38,100 @@ void MessageHandler::workspace_didChangeConfiguration(EmptyParam &) {
 
 void MessageHandler::workspace_didChangeWatchedFiles(
     DidChangeWatchedFilesParam &param) {
+  // A branch switch can report thousands of files in one notification. Keep
+  // the last event of each path, in order of first appearance.
+  std::vector<std::pair<std::string, FileChangeType>> changes;
+  StringMap<size_t> path2change;
   for (auto &event : param.changes) {
     std::string path = event.uri.getPath();
-    if ((g_config->cache.directory.size() &&
-         StringRef(path).startswith(g_config->cache.directory)) ||
-        lookupExtension(path).first == LanguageId::Unknown)
-      return;
+    // Cache writes are not read by clang and should not make the indexers
+    // discard their FileManagers.
+    if (g_config->cache.directory.size() &&
+        StringRef(path).startswith(g_config->cache.directory))
+      continue;
+    invalidateFileSystem(path);
+    if (lookupExtension(path).first == LanguageId::Unknown)
+      continue;
+    bool hidden = false;
     for (std::string cur = path; cur.size(); cur = sys::path::parent_path(cur))
       if (cur[0] == '.')
-        return;
-
-    switch (event.type) {
-    case FileChangeType::Created:
-    case FileChangeType::Changed: {
-      IndexMode mode =
-          wfiles->getFile(path) ? IndexMode::Normal : IndexMode::Background;
-      pipeline::index(path, {}, mode, true);
-      if (event.type == FileChangeType::Changed) {
-        if (mode == IndexMode::Normal)
-          manager->onSave(path);
-        else
-          manager->onClose(path);
-      }
-      break;
-    }
-    case FileChangeType::Deleted:
+        hidden = true;
+    if (hidden)
+      continue;
+    auto [it, inserted] = path2change.try_emplace(path, changes.size());
+    if (inserted)
+      changes.emplace_back(path, event.type);
+    else
+      changes[it->second].second = event.type;
+  }
+
+  std::vector<std::string> background;
+  for (auto &[path, type] : changes) {
+    if (type == FileChangeType::Deleted) {
       pipeline::index(path, {}, IndexMode::Delete, false);
       manager->onClose(path);
-      break;
+      continue;
+    }
+    bool open = wfiles->getFile(path);
+    if (open)
+      pipeline::index(path, {}, IndexMode::Normal, true);
+    else
+      background.push_back(path);
+    if (type == FileChangeType::Changed) {
+      if (open)
+        manager->onSave(path);
+      else
+        manager->onClose(path);
+    }
+  }
+
+  // Indexing a file reindexes the translation unit it was last indexed with,
+  // and that reparses every changed file of the unit. So one request per
+  // unit suffices, provided it is for a file the indexer will see as newer
+  // than the VFS; other files are queued as before.
+  std::vector<std::pair<std::string, int>> owners(background.size(),
+                                                  {"", -1});
+  {
+    std::shared_lock lock(project->mtx);
+    for (size_t i = 0; i < background.size(); i++)
+      for (auto &[root, folder] : project->root2folder)
+        if (StringRef(background[i]).startswith(root)) {
+          auto it = folder.path2entry_index.find(background[i]);
+          if (it != folder.path2entry_index.end()) {
+            owners[i] = {root, it->second};
+            break;
+          }
+        }
+  }
+  std::set<std::pair<std::string, int>> queued;
+  size_t coalesced = 0;
+  for (size_t i = 0; i < background.size(); i++) {
+    const std::string &path = background[i];
+    if (owners[i].second >= 0) {
+      std::optional<int64_t> mtime = lastWriteTime(path);
+      bool newer;
+      {
+        std::lock_guard lock(vfs->mutex);
+        auto it = vfs->state.find(path);
+        newer = mtime && it != vfs->state.end() && it->second.timestamp &&
+                it->second.timestamp < *mtime;
+      }
+      if (newer && !queued.insert(owners[i]).second) {
+        coalesced++;
+        continue;
+      }
     }
+    pipeline::index(path, {}, IndexMode::Background, true);
   }
+  if (coalesced)
+    LOG_S(INFO) << "coalesce " << coalesced << " of " << background.size()
+                << " changed files into the translation units that include "
+                   "them";
 }
 
 void MessageHandler::workspace_didChangeWorkspaceFolders(
     DidChangeWorkspaceFoldersParam &param) {
+  std::vector<std::string> removed, added;
   for (const WorkspaceFolder &wf : param.event.removed) {
     std::string root = wf.uri.getPath();
     ensureEndsInSlash(root);
@@ -75,10 +141,11 @@ void MessageHandler::workspace_didChangeWorkspaceFolders(
     if (it != g_config->workspaceFolders.end()) {
       g_config->workspaceFolders.erase(it);
       {
-        // auto &folder = project->root2folder[path];
-        // FIXME delete
+        std::lock_guard lock(project->mtx);
+        project->root2folder.erase(root);
       }
-      project->root2folder.erase(root);
+      unwatchDirectory(root);
+      removed.push_back(root);
     }
   }
   auto &workspaceFolders = g_config->workspaceFolders;
@@ -96,19 +163,62 @@ void MessageHandler::workspace_didChangeWorkspaceFolders(
       *it = it[-1];
     *it = {folder, real};
     project->load(folder);
+    watchDirectory(folder);
+    added.push_back(folder);
   }
+  updateFileSystemRoots();
+  clearPathCache();
 
-  project->index(wfiles, RequestId());
+  // Drop the files of removed folders, unless they are in another folder or
+  // included by a file outside of the removed folders.
+  if (removed.size()) {
+    FileSet gone = *db->getFileSet(removed);
+    std::vector<std::string> folders;
+    for (auto &[folder, _] : workspaceFolders)
+      folders.push_back(folder);
+    FileSet kept =
+        folders.size() ? *db->getFileSet(folders) : FileSet{false, {}};
+    size_t n = 0;
+    for (QueryFile &file : db->files) {
+      if (!gone[file.id] || kept[file.id] || wfiles->getFile(file.def->path))
+        continue;
+      bool used = false;
+      for (int id : db->getDependents(file.id, SIZE_MAX))
+        if (!gone[id]) {
+          used = true;
+          break;
+        }
+      if (!used) {
+        pipeline::index(file.def->path, {}, IndexMode::Delete, false);
+        n++;
+      }
+    }
+    LOG_S(INFO) << "delete " << n << " files of removed workspace folders";
+  }
+  if (added.size())
+    project->index(wfiles, RequestId(), added);
 
-  manager->clear();
+  // Only sessions of files in the changed folders see different arguments.
+  std::vector<std::string> paths;
+  {
+    std::lock_guard lock(wfiles->mutex);
+    for (auto &[path, _] : wfiles->files)
+      for (auto *roots : {&removed, &added})
+        for (auto &root : *roots)
+          if (StringRef(path).startswith(root))
+            paths.push_back(path);
+  }
+  for (auto &path : paths)
+    manager->onClose(path);
 }
 
 namespace {
 // Lookup |symbol| in |db| and insert the value into |result|.
 bool addSymbol(
-    DB *db, WorkingFiles *wfiles, const std::vector<uint8_t> &file_set,
+    DB *db, WorkingFiles *wfiles, const FileSet &file_set,
     SymbolIdx sym, bool use_detailed,
-    std::vector<std::tuple<SymbolInformation, int, SymbolIdx>> *result) {
+    std::vector<std::tuple<SymbolInformation, int,
+                           std::array<std::string_view, 2>>> *result) {
   std::optional<SymbolInformation> info = getSymbolInfo(db, sym, true);
   if (!info)
     return false;
@@ -138,9 +248,26 @@ bool addSymbol(
   if (!ls_location)
     return false;
   info->location = *ls_location;
-  result->emplace_back(*info, int(use_detailed), sym);
+  result->emplace_back(*info, int(use_detailed),
+                       std::array{db->getSymbolName(sym, false),
+                                  db->getSymbolName(sym, true)});
   return true;
 }
+
+// Whether |db| has a definition of the symbol, which has then been considered
+// before the symbol tables.
+bool hasDef(DB *db, Usr usr, Kind kind) {
+  switch (kind) {
+  case Kind::Func:
+    return db->hasFunc(usr) && db->getFunc(usr).anyDef();
+  case Kind::Type:
+    return db->hasType(usr) && db->getType(usr).anyDef();
+  case Kind::Var:
+    return db->hasVar(usr) && db->getVar(usr).anyDef();
+  default:
+    return false;
+  }
+}
 } // namespace
 
 void MessageHandler::workspace_symbol(WorkspaceSymbolParam &param,
@@ -149,11 +276,17 @@ void MessageHandler::workspace_symbol(WorkspaceSymbolParam &param,
   const std::string &query = param.query;
   for (auto &folder : param.folders)
     ensureEndsInSlash(folder);
-  std::vector<uint8_t> file_set = db->getFileSet(param.folders);
+  std::shared_ptr<const FileSet> folder_files = db->getFileSet(param.folders);
+  const FileSet &file_set = *folder_files;
 
-  // {symbol info, matching detailed_name or short_name, index}
-  std::vector<std::tuple<SymbolInformation, int, SymbolIdx>> cands;
+  // {symbol info, matching detailed_name or short_name, {short name,
+  // qualified name}}
+  std::vector<
+      std::tuple<SymbolInformation, int, std::array<std::string_view, 2>>>
+      cands;
   bool sensitive = g_config->workspaceSymbol.caseSensitivity;
+  // Candidates from symbol tables refer to them.
+  std::vector<std::pair<std::string, std::shared_ptr<SymbolTable>>> tables;
 
   // Find subsequence matches.
   std::string query_without_space;
@@ -171,37 +304,95 @@ void MessageHandler::workspace_symbol(WorkspaceSymbolParam &param,
                      &cands) &&
            cands.size() >= g_config->workspaceSymbol.maxNum;
   };
-  for (auto &func : db->funcs)
-    if (add({func.usr, Kind::Func}))
-      goto done_add;
-  for (auto &type : db->types)
-    if (add({type.usr, Kind::Type}))
-      goto done_add;
-  for (auto &var : db->vars)
-    if (var.def.size() && !var.def[0].is_local() && add({var.usr, Kind::Var}))
+  // Use the index to filter out symbols lacking some character of the query.
+  // An empty query lists all symbols. Unless maxNum is reached, the symbol
+  // tables below are searched as well, since the DB lacks the symbols of
+  // deferred caches.
+  if (db->symbol_index.lookup(query_without_space, add)) {
+    if (cands.size() >= g_config->workspaceSymbol.maxNum)
       goto done_add;
+  } else {
+    for (auto &func : db->funcs)
+      if (add({func.usr, Kind::Func}))
+        goto done_add;
+    for (auto &type : db->types)
+      if (add({type.usr, Kind::Type}))
+        goto done_add;
+    for (auto &var : db->vars)
+      if (var.def.size() && !var.def[0].is_local() &&
+          add({var.usr, Kind::Var}))
+        goto done_add;
+  }
+
+  // With index.lazyLoad, files whose caches are not loaded are searched in
+  // their symbol tables. Without the tables, the caches are loaded for later
+  // requests.
+  if (g_config->index.lazyLoad) {
+    if (auto t = pipeline::deferredSymbolTables())
+      tables = std::move(*t);
+    else
+      pipeline::loadDeferred();
+  }
+  {
+    std::unordered_set<Usr> seen;
+    for (auto &[path, table] : tables) {
+      if (param.folders.size() &&
+          llvm::none_of(param.folders, [&](const std::string &folder) {
+            return StringRef(path).startswith(folder);
+          }))
+        continue;
+      DocumentUri uri = DocumentUri::fromPath(path);
+      for (size_t i = 0, n = table->size(); i < n; i++) {
+        SymbolTable::Symbol sym = table->get(i);
+        int pos = reverseSubseqMatch(query_without_space, sym.detailed_name,
+                                     sensitive);
+        if (pos < 0 || hasDef(db, sym.usr, sym.kind) ||
+            !seen.insert(sym.usr).second)
+          continue;
+        SymbolInformation info;
+        info.name = sym.detailed_name;
+        info.kind = sym.symbol_kind;
+        info.location = {uri, *getLsRange(nullptr, sym.range)};
+        cands.emplace_back(
+            info,
+            int(sym.detailed_name.find(':', pos) != std::string::npos),
+            std::array{sym.name(false), sym.name(true)});
+        if (cands.size() >= g_config->workspaceSymbol.maxNum)
+          goto done_add;
+      }
+    }
+  }
 done_add:
 
   if (g_config->workspaceSymbol.sort && query.size() <= FuzzyMatcher::kMaxPat) {
     // Sort results with a fuzzy matching algorithm.
     int longest = 0;
     for (auto &cand : cands)
-      longest = std::max(
-          longest, int(db->getSymbolName(std::get<2>(cand), true).size()));
-    FuzzyMatcher fuzzy(query, g_config->workspaceSymbol.caseSensitivity);
-    for (auto &cand : cands)
-      std::get<1>(cand) = fuzzy.match(
-          db->getSymbolName(std::get<2>(cand), std::get<1>(cand)), false);
-    std::sort(cands.begin(), cands.end(), [](const auto &l, const auto &r) {
+      longest = std::max(longest, int(std::get<2>(cand)[1].size()));
+    // Score in chunks of at least kChunk candidates, one FuzzyMatcher per
+    // thread.
+    const int kChunk = 256;
+    int n = std::clamp(int(cands.size() / kChunk), 1,
+                       int(std::max(std::thread::hardware_concurrency(), 1u)));
+    runPooled(n, [&](int w) {
+      FuzzyMatcher fuzzy(query, g_config->workspaceSymbol.caseSensitivity);
+      for (size_t i = cands.size() * w / n, e = cands.size() * (w + 1) / n;
+           i < e; i++) {
+        auto &cand = cands[i];
+        std::get<1>(cand) =
+            fuzzy.match(std::get<2>(cand)[std::get<1>(cand)], false);
+      }
+    });
+    // Discard awful candidates before sorting.
+    auto last = std::partition(cands.begin(), cands.end(), [](const auto &c) {
+      return std::get<1>(c) > FuzzyMatcher::kMinScore;
+    });
+    std::sort(cands.begin(), last, [](const auto &l, const auto &r) {
       return std::get<1>(l) > std::get<1>(r);
     });
-    result.reserve(cands.size());
-    for (auto &cand : cands) {
-      // Discard awful candidates.
-      if (std::get<1>(cand) <= FuzzyMatcher::kMinScore)
-        break;
-      result.push_back(std::get<0>(cand));
-    }
+    result.reserve(last - cands.begin());
+    for (auto it = cands.begin(); it != last; ++it)
+      result.push_back(std::get<0>(*it));
   } else {
     result.reserve(cands.size());
     for (auto &cand : cands)
@@ -3,8 +3,13 @@
 
 #include "pipeline.hh"
 
+#include "allocator.hh"
+#include "cache_backend.hh"
+#include "cache_pack.hh"
 #include "config.hh"
+#include "filesystem.hh"
 #include "include_complete.hh"
+#include "index_worker.hh"
 #include "log.hh"
 #include "lsp.hh"
 #include "message_handler.hh"
@@ -12,20 +17,38 @@
 #include "platform.hh"
 #include "project.hh"
 #include "query.hh"
+#include "replay.hh"
 #include "sema_manager.hh"
+#include "snapshot.hh"
+#include "symbol_table.hh"
+#include "trace.hh"
 
 #include <rapidjson/document.h>
 #include <rapidjson/writer.h>
 
+#include <clang/Sema/CodeCompleteConsumer.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/Compression.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/Path.h>
 #include <llvm/Support/Process.h>
 #include <llvm/Support/Threading.h>
+#include <llvm/Support/xxhash.h>
 
+#include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <ctype.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <mutex>
+#include <optional>
+#include <random>
 #include <shared_mutex>
+#include <string.h>
 #include <thread>
+#include <unordered_set>
 #ifndef _WIN32
 #include <unistd.h>
 #endif
@@ -77,6 +100,7 @@ std::atomic<bool> g_quit;
 std::atomic<int64_t> loaded_ts{0}, request_id{0};
 IndexStats stats;
 int64_t tick = 0;
+std::string serve_snapshot;
 
 namespace {
 
@@ -87,8 +111,41 @@ struct IndexRequest {
   bool must_exist = false;
   RequestId id;
   int64_t ts = tick++;
+  chrono::steady_clock::time_point queued_at = chrono::steady_clock::now();
 };
 
+// Priority class in index_request: OnChange, Normal/Delete, Background.
+int indexPriority(IndexMode mode) {
+  return mode == IndexMode::OnChange     ? 0
+         : mode == IndexMode::Background ? 2
+                                         : 1;
+}
+
+// Requests without an id are coalesced by path. |request| is the merged
+// request to run. |queued_ts| is the ts of the copy in index_request which
+// will run it; other copies of the path are stale.
+struct PendingIndex {
+  IndexRequest request;
+  int64_t queued_ts;
+};
+std::mutex pending_index_mtx;
+StringMap<PendingIndex> pending_index;
+
+// With index.lazyLoad, background requests whose caches are valid but not
+// loaded, until loadDeferred is called.
+std::mutex deferred_mtx;
+std::vector<IndexRequest> deferred;
+bool deferred_loaded = false;
+// The translation units of |deferred|, and the symbol tables opened for them
+// and their dependencies by deferredSymbolTables, which has visited the first
+// |deferred_scanned| translation units. A missing table is nullptr.
+std::vector<std::string> deferred_tus;
+size_t deferred_scanned = 0;
+StringMap<std::shared_ptr<SymbolTable>> deferred_tables;
+// The translation units queued by loadDeferred whose updates have not been
+// applied. Project-wide requests wait in the backlog until it is empty.
+StringSet<> deferred_loading;
+
 std::mutex thread_mtx;
 std::condition_variable no_active_threads;
 int active_threads;
@@ -96,35 +153,147 @@ int active_threads;
 MultiQueueWaiter *main_waiter;
 MultiQueueWaiter *indexer_waiter;
 MultiQueueWaiter *stdout_waiter;
+MultiQueueWaiter *request_waiter;
 ThreadedQueue<InMessage> *on_request;
-ThreadedQueue<IndexRequest> *index_request;
-ThreadedQueue<IndexUpdate> *on_indexed;
-ThreadedQueue<std::string> *for_stdout;
+// Priority classes: OnChange, Normal/Delete, Background.
+WorkStealingQueue<IndexRequest, 3> *index_request;
+BoundedQueue<IndexUpdate> *on_indexed;
+BoundedQueue<std::string> *for_stdout;
+// Read-only requests for the request threads. See request.threads.
+ThreadedQueue<InMessage> *for_request_threads;
+// Request threads hold it shared while running a handler. The main thread
+// holds it exclusively while running other handlers and applying index
+// updates, so that handlers see DB and WorkingFiles between two batches.
+std::shared_mutex db_mutex;
+// Taken by the main thread while it waits for db_mutex and passed through by
+// request threads before they lock it shared. A steady stream of read-only
+// requests thus cannot keep the main thread from applying updates.
+std::mutex db_turnstile;
+// Requests handed to the request threads and not finished yet. The main
+// thread waits for them to drain before running a notification, so that a
+// request never sees a didChange or didClose sent after it.
+std::mutex in_flight_mutex;
+std::condition_variable in_flight_cv;
+int64_t requests_in_flight = 0;
+
+// Requests from the client that have not been replied to. The value is set
+// by $/cancelRequest.
+std::mutex pending_requests_mtx;
+std::unordered_map<std::string, bool> pending_requests;
+
+std::string requestKey(const RequestId &id) {
+  return (id.type == RequestId::kInt ? 'n' : 's') + id.value;
+}
 
 struct InMemoryIndexFile {
+  // Index-time file content, zlib-compressed if |compressed|. Only kept when
+  // cache.directory is empty; otherwise loadIndexedContent reads the disk.
   std::string content;
-  IndexFile index;
+  size_t content_size = 0;
+  bool compressed = false;
+  // Immutable, so that loadPrevious can share it without a copy.
+  std::shared_ptr<const IndexFile> index;
 };
 std::shared_mutex g_index_mutex;
 std::unordered_map<std::string, InMemoryIndexFile> g_index;
 
+// The content is only read when a file is opened, so trade some CPU for a
+// smaller g_index.
+void setContent(InMemoryIndexFile &file, const std::string &content) {
+  file.content_size = content.size();
+  file.compressed = false;
+#if LLVM_VERSION_MAJOR >= 15 // llvmorg-15-init-15095-gea61750c35a1
+  if (compression::zlib::isAvailable()) {
+    SmallVector<uint8_t, 0> out;
+    compression::zlib::compress(arrayRefFromStringRef(content), out);
+    file.content.assign(out.begin(), out.end());
+    file.compressed = true;
+    return;
+  }
+#else
+  if (zlib::isAvailable()) {
+    SmallVector<char, 0> out;
+    if (!errorToBool(zlib::compress(content, out))) {
+      file.content.assign(out.begin(), out.end());
+      file.compressed = true;
+      return;
+    }
+  }
+#endif
+  file.content = content;
+}
+
+std::optional<std::string> getContent(const InMemoryIndexFile &file) {
+  if (!file.compressed)
+    return file.content;
+#if LLVM_VERSION_MAJOR >= 15
+  SmallVector<uint8_t, 0> out;
+  if (errorToBool(compression::zlib::decompress(
+          arrayRefFromStringRef(file.content), out, file.content_size)))
+    return {};
+#else
+  SmallVector<char, 0> out;
+  if (errorToBool(zlib::uncompress(file.content, out, file.content_size)))
+    return {};
+#endif
+  return std::string(out.begin(), out.end());
+}
+
+std::mutex content_hashes_mtx;
+// path -> (mtime, xxHash64 of the contents at that mtime)
+std::unordered_map<std::string, std::pair<int64_t, uint64_t>> content_hashes;
+
+// Returns the xxHash64 of the contents of |path| with modification time
+// |mtime|. Hashes are memoized by mtime so that a header shared by many
+// translation units is read once.
+std::optional<uint64_t> contentHash(const std::string &path, int64_t mtime) {
+  {
+    std::lock_guard lock(content_hashes_mtx);
+    auto it = content_hashes.find(path);
+    if (it != content_hashes.end() && it->second.first == mtime)
+      return it->second.second;
+  }
+  std::optional<std::string> content = readContent(path);
+  if (!content)
+    return {};
+  uint64_t hash = xxHash64(*content);
+  std::lock_guard lock(content_hashes_mtx);
+  content_hashes[path] = {mtime, hash};
+  return hash;
+}
+
+// Returns true if cache.contentHash is enabled and the contents of |path|
+// with modification time |mtime| still hash to |hash|, i.e. the file was
+// touched (checkout, build system, copy) but not modified.
+bool sameContent(const std::string &path, int64_t mtime, uint64_t hash) {
+  if (!g_config->cache.contentHash || !hash)
+    return false;
+  std::optional<uint64_t> hash1 = contentHash(path, mtime);
+  return hash1 && *hash1 == hash;
+}
+
 bool cacheInvalid(VFS *vfs, IndexFile *prev, const std::string &path,
                   const std::vector<const char *> &args,
                   const std::optional<std::string> &from) {
+  int64_t timestamp;
   {
     std::lock_guard<std::mutex> lock(vfs->mutex);
-    if (prev->mtime < vfs->state[path].timestamp) {
-      LOG_V(1) << "timestamp changed for " << path
-               << (from ? " (via " + *from + ")" : std::string());
-      return true;
-    }
+    timestamp = vfs->state[path].timestamp;
+  }
+  if (prev->mtime < timestamp &&
+      !sameContent(path, timestamp, prev->content_hash)) {
+    LOG_V(1) << "timestamp changed for " << path
+             << (from ? " (via " + *from + ")" : std::string());
+    return true;
   }
 
   // For inferred files, allow -o a a.cc -> -o b b.cc
   StringRef stem = sys::path::stem(path);
   int changed = -1, size = std::min(prev->args.size(), args.size());
+  // Most arguments are interned, so compare pointers before strings.
   for (int i = 0; i < size; i++)
-    if (strcmp(prev->args[i], args[i]) && sys::path::stem(args[i]) != stem) {
+    if (prev->args[i] != args[i] && strcmp(prev->args[i], args[i]) &&
+        sys::path::stem(args[i]) != stem) {
       changed = i;
       break;
     }
@@ -168,40 +337,671 @@ std::string getCachePath(std::string src) {
          '/' + escapeFileName(src);
 }
 
-std::unique_ptr<IndexFile> rawCacheLoad(const std::string &path) {
+// Cache files waiting for the cache writer thread, by source path. A newer
+// write of the same path replaces the pending one. |cache_writing| holds the
+// batch being written so that readers can still see it.
+struct CacheWrite {
+  std::string cache_path;
+  std::string file_contents;
+  std::string serialized;
+  bool deleted = false;
+  // Written to xxx.sym if cache.symbolTable is true.
+  std::string symbols;
+};
+std::mutex cache_write_mtx;
+std::condition_variable cache_write_cv;
+StringMap<CacheWrite> cache_writes, cache_writing;
+const size_t kMaxCacheWrites = 256;
+
+// Returns the pack store if cache.pack is enabled and the pack can be opened
+// and locked.
+CachePack *getCachePack() {
+  static CachePack *pack;
+  static std::once_flag once;
+  std::call_once(once, [] {
+    if (!g_config->cache.pack || g_config->cache.directory.empty())
+      return;
+    pack = new CachePack;
+    if (!pack->open(g_config->cache.directory + "ccls.pack")) {
+      delete pack;
+      pack = nullptr;
+    }
+  });
+  return pack;
+}
+
+// Whether the snapshot may exist. It must agree with the cache, so the cache
+// writer removes it before writing anything, even if cache.snapshot is false.
+std::atomic<bool> snapshot_valid{true};
+
+bool useSnapshot() {
+  return g_config->cache.snapshot && g_config->cache.directory.size();
+}
+
+std::string getSnapshotPath() {
+  return g_config->cache.directory + "ccls.snapshot";
+}
+
+// Requires cache_write_mtx.
+const CacheWrite *findCacheWrite(const std::string &path) {
+  auto it = cache_writes.find(path);
+  if (it != cache_writes.end())
+    return &it->second;
+  it = cache_writing.find(path);
+  return it != cache_writing.end() ? &it->second : nullptr;
+}
+
+// Write to a temporary file and rename it, so that a reader never sees a
+// partially written cache file.
+void writeFileAtomically(const std::string &path, const std::string &content) {
+  std::string tmp = path + ".tmp";
+  writeToFile(tmp, content);
+  if (std::error_code ec = sys::fs::rename(tmp, path))
+    LOG_S(ERROR) << "failed to rename " << tmp << ": " << ec.message();
+}
+
+void cacheWriter() {
+  set_thread_name("cache writer");
+  setThreadArena(Arena::IO);
+  std::unique_lock lock(cache_write_mtx);
+  while (true) {
+    cache_write_cv.wait(lock, [] {
+      return cache_writes.size() || g_quit.load(std::memory_order_relaxed);
+    });
+    if (cache_writes.empty())
+      break;
+    std::swap(cache_writes, cache_writing);
+    lock.unlock();
+    cache_write_cv.notify_all();
+    trace::Span span("cache.write");
+    span.setArg("files", cache_writing.size());
+    if (snapshot_valid.exchange(false))
+      (void)sys::fs::remove(getSnapshotPath());
+    CachePack *pack = getCachePack();
+    for (auto &it : cache_writing) {
+      CacheWrite &w = it.second;
+      if (pack) {
+        if (w.deleted)
+          pack->remove(it.first().str());
+        else
+          pack->put(it.first().str(), w.file_contents, w.serialized);
+        continue;
+      }
+      std::string blob_path = appendSerializationFormat(w.cache_path);
+      std::string sym_path = w.cache_path + ".sym";
+      if (w.deleted) {
+        (void)sys::fs::remove(w.cache_path);
+        (void)sys::fs::remove(blob_path);
+        (void)sys::fs::remove(sym_path);
+        continue;
+      }
+      if (g_config->cache.hierarchicalPath)
+        sys::fs::create_directories(
+            sys::path::parent_path(w.cache_path, sys::path::Style::posix),
+            true);
+      writeFileAtomically(w.cache_path, w.file_contents);
+      writeFileAtomically(blob_path, w.serialized);
+      // A table left by an earlier run with cache.symbolTable would be stale.
+      if (w.symbols.size())
+        writeFileAtomically(sym_path, w.symbols);
+      else
+        (void)sys::fs::remove(sym_path);
+    }
+    lock.lock();
+    cache_writing.clear();
+    cache_write_cv.notify_all();
+  }
+  lock.unlock();
+  threadLeave();
+}
+
+void queueCacheWrite(const std::string &path, CacheWrite &&w) {
+  static std::once_flag once;
+  std::call_once(once, [] {
+    threadEnter();
+    std::thread(cacheWriter).detach();
+  });
+  std::unique_lock lock(cache_write_mtx);
+  cache_write_cv.wait(lock, [&] {
+    return cache_writes.size() < kMaxCacheWrites || cache_writes.count(path) ||
+           g_quit.load(std::memory_order_relaxed);
+  });
+  cache_writes[path] = std::move(w);
+  lock.unlock();
+  cache_write_cv.notify_all();
+}
+
+// Waits until queued cache writes have reached the disk.
+void flushCacheWrites() {
+  std::unique_lock lock(cache_write_mtx);
+  cache_write_cv.wait(lock, [] {
+    return (cache_writes.empty() && cache_writing.empty()) ||
+           g_quit.load(std::memory_order_relaxed);
+  });
+}
+
+// Removes the cache files of paths not indexed in |db| which are older than
+// cache.gcDays, or their entries in the pack, on a background thread.
+void collectCacheGarbage(DB &db) {
+  if (g_config->cache.directory.empty())
+    return;
+  if (g_config->index.lazyLoad) {
+    // The caches of deferred files are not in |db|.
+    std::lock_guard lock(deferred_mtx);
+    if (!deferred_loaded)
+      return;
+  }
+  CachePack *pack = getCachePack();
+  auto live = std::make_shared<StringSet<>>();
+  for (QueryFile &file : db.files)
+    if (file.def)
+      live->insert(pack ? file.def->path : getCachePath(file.def->path));
+  if (pack) {
+    int64_t bytes = pack->removeUnless(
+        [&](StringRef path) { return live->count(path) > 0; });
+    stats.cache_gc_bytes += bytes;
+    if (bytes)
+      LOG_S(INFO) << "cache gc: removed " << (bytes >> 10)
+                  << " KiB from the pack";
+    return;
+  }
+
+  std::string dir = g_config->cache.directory;
+  bool hierarchical = g_config->cache.hierarchicalPath;
+  auto expire = std::chrono::system_clock::now() -
+                std::chrono::hours(24) * g_config->cache.gcDays;
+  threadEnter();
+  std::thread([=]() {
+    set_thread_name("cache gc");
+#if LLVM_ENABLE_THREADS && LLVM_VERSION_MAJOR >= 9 && !defined(__APPLE__)
+    set_thread_priority(ThreadPriority::Background);
+#endif
+    trace::Span span("cache.gc");
+    int64_t files = 0, bytes = 0;
+    std::vector<std::string> dirs;
+    std::error_code ec;
+    for (sys::fs::recursive_directory_iterator it(dir, ec), end;
+         it != end && !ec && !g_quit.load(std::memory_order_relaxed);
+         it.increment(ec)) {
+      StringRef path = it->path();
+      auto st = it->status();
+      if (!st || st->getLastModificationTime() > expire)
+        continue;
+      if (st->type() == sys::fs::file_type::directory_file) {
+        // Cache directories of workspace folders are only created on
+        // initialization unless cache.hierarchicalPath is true.
+        if (hierarchical || it.level() > 0)
+          dirs.push_back(path.str());
+        continue;
+      }
+      // ccls.pack, ccls.snapshot, etc.
+      if (it.level() == 0 && sys::path::filename(path).startswith("ccls."))
+        continue;
+      StringRef key = path;
+      for (const char *suffix : {".blob", ".json", ".sym"})
+        if (key.endswith(suffix)) {
+          key = key.drop_back(strlen(suffix));
+          break;
+        }
+      if (live->count(key) || live->count(path))
+        continue;
+      if (!sys::fs::remove(path)) {
+        files++;
+        bytes += st->getSize();
+      }
+    }
+    // Children come after their parents. Removing a non-empty directory
+    // fails.
+    for (auto i = dirs.size(); i--;)
+      (void)sys::fs::remove(dirs[i]);
+    stats.cache_gc_files += files;
+    stats.cache_gc_bytes += bytes;
+    LOG_S(INFO) << "cache gc: removed " << files << " files, "
+                << (bytes >> 10) << " KiB";
+    threadLeave();
+  }).detach();
+}
+
+std::unique_ptr<IndexFile> loadCache(const std::string &path) {
   if (g_config->cache.retainInMemory) {
     std::shared_lock lock(g_index_mutex);
     auto it = g_index.find(path);
     if (it != g_index.end())
-      return std::make_unique<IndexFile>(it->second.index);
+      return std::make_unique<IndexFile>(*it->second.index);
     if (g_config->cache.directory.empty())
       return nullptr;
   }
 
+  {
+    std::lock_guard lock(cache_write_mtx);
+    if (const CacheWrite *w = findCacheWrite(path)) {
+      if (w->deleted)
+        return nullptr;
+      return ccls::deserialize(g_config->cache.format, path, w->serialized,
+                               w->file_contents, IndexFile::kMajorVersion);
+    }
+  }
+
+  if (CachePack *pack = getCachePack()) {
+    std::string file_content, serialized;
+    if (!pack->get(path, file_content, serialized))
+      return nullptr;
+    return ccls::deserialize(g_config->cache.format, path, serialized,
+                             file_content, IndexFile::kMajorVersion);
+  }
+
   std::string cache_path = getCachePath(path);
   std::optional<std::string> file_content = readContent(cache_path);
-  std::optional<std::string> serialized_indexed_content =
-      readContent(appendSerializationFormat(cache_path));
-  if (!file_content || !serialized_indexed_content)
+  if (!file_content)
+    return nullptr;
+  // Large cache files are memory-mapped and deserialized in place, which
+  // avoids reading the whole file into a temporary string.
+  auto serialized_indexed_content =
+      MemoryBuffer::getFile(appendSerializationFormat(cache_path));
+  if (!serialized_indexed_content)
     return nullptr;
 
+  StringRef buf = (*serialized_indexed_content)->getBuffer();
   return ccls::deserialize(g_config->cache.format, path,
-                           *serialized_indexed_content, *file_content,
-                           IndexFile::kMajorVersion);
+                           std::string_view(buf.data(), buf.size()),
+                           *file_content, IndexFile::kMajorVersion);
+}
+
+// Hints the system to read the cache files of |path|, which are likely to be
+// loaded soon.
+void prefetchCache(const std::string &path) {
+  if (g_config->cache.directory.empty() || getCachePack())
+    return;
+  std::string cache_path = getCachePath(path);
+  prefetchFile(cache_path);
+  prefetchFile(appendSerializationFormat(cache_path));
+}
+
+// Writes a cache file read from an older minor version in the current layout,
+// so that the next load need not migrate it again.
+void rewriteCache(const std::string &path, IndexFile &file) {
+  file.migrated = false;
+  if (g_config->cache.directory.empty())
+    return;
+  LOG_V(1) << "migrate cache of " << path;
+  stats.cache_migrated++;
+  queueCacheWrite(path, {getCachePath(path), file.file_contents,
+                         serialize(g_config->cache.format, file), false,
+                         g_config->cache.symbolTable && !getCachePack()
+                             ? buildSymbolTable(file)
+                             : std::string()});
+}
+
+std::unique_ptr<IndexFile> rawCacheLoad(const std::string &path) {
+  trace::Span span("cache.load");
+  auto start = chrono::steady_clock::now();
+  std::unique_ptr<IndexFile> ret = loadCache(path);
+  if (ret && ret->migrated)
+    rewriteCache(path, *ret);
+  stats.cache_load_us += chrono::duration_cast<chrono::microseconds>(
+                             chrono::steady_clock::now() - start)
+                             .count();
+  (ret ? stats.cache_hits : stats.cache_misses)++;
+  return ret;
+}
+
+// Like rawCacheLoad, for the previous index of a delta, which is not
+// modified. A g_index hit is shared instead of copied.
+std::shared_ptr<const IndexFile> loadPrevious(const std::string &path) {
+  if (g_config->cache.retainInMemory) {
+    std::shared_lock lock(g_index_mutex);
+    auto it = g_index.find(path);
+    if (it != g_index.end()) {
+      stats.cache_hits++;
+      return it->second.index;
+    }
+  }
+  return rawCacheLoad(path);
+}
+
+// Returns the shared cache if cache.sharedDirectory is set.
+CacheBackend *getSharedBackend() {
+  static std::unique_ptr<CacheBackend> backend;
+  static std::once_flag once;
+  std::call_once(once, [] {
+    if (g_config->cache.sharedDirectory.size())
+      backend = makeDirectoryBackend(g_config->cache.sharedDirectory);
+  });
+  return backend.get();
+}
+
+// Everything that determines the index of a translation unit, except the
+// contents of its headers, which fetchShared() verifies.
+uint64_t sharedKey(const std::string &path,
+                   const std::vector<const char *> &args, uint64_t hash) {
+  std::string key = path;
+  for (const char *arg : args)
+    (key += '\0') += arg;
+  key += '\0';
+  for (int64_t x : {int64_t(hash), int64_t(IndexFile::kMajorVersion),
+                    int64_t(IndexFile::kMinorVersion),
+                    int64_t(g_config->cache.format)})
+    key.append(reinterpret_cast<const char *>(&x), sizeof x);
+  return xxHash64(key);
+}
+
+// Returns the indexes of the translation unit |path| from the shared cache,
+// or an empty vector if they are missing, have fewer symbols than requested
+// by |no_linkage|, or any file of the translation unit has different contents
+// here. Modification times are replaced with local
+// ones so that the indexes are accepted by the local cache afterwards.
+std::vector<std::unique_ptr<IndexFile>>
+fetchShared(const std::string &path, const std::vector<const char *> &args,
+            bool no_linkage) {
+  std::vector<std::unique_ptr<IndexFile>> ret;
+  CacheBackend *backend = getSharedBackend();
+  std::optional<int64_t> mtime = lastWriteTime(path);
+  std::optional<uint64_t> hash =
+      backend && mtime ? contentHash(path, *mtime) : std::nullopt;
+  if (!hash)
+    return ret;
+  trace::Span span("cache.shared");
+  std::unique_ptr<MemoryBuffer> data =
+      backend->get(sharedKey(path, args, *hash));
+  std::vector<BundleFile> files;
+  if (!data || !decodeBundle({data->getBufferStart(), data->getBufferSize()},
+                             files))
+    return ret;
+
+  // Every file of the translation unit is listed by every other one.
+  StringMap<std::pair<uint64_t, int64_t>> verified;
+  auto verify = [&](const std::string &path1, uint64_t hash1,
+                    int64_t &mtime1) {
+    auto [it, inserted] = verified.try_emplace(path1);
+    if (inserted) {
+      std::optional<int64_t> m = lastWriteTime(path1);
+      std::optional<uint64_t> h = m ? contentHash(path1, *m) : std::nullopt;
+      it->second = {h.value_or(0), m.value_or(0)};
+    }
+    if (!hash1 || it->second.first != hash1) {
+      LOG_V(1) << "shared cache differs in " << path1;
+      return false;
+    }
+    mtime1 = it->second.second;
+    return true;
+  };
+  for (BundleFile &file : files) {
+    std::unique_ptr<IndexFile> index =
+        ccls::deserialize(g_config->cache.format, file.path, file.index,
+                          file.contents, IndexFile::kMajorVersion);
+    if (!index || index->no_linkage < no_linkage || index->declarations_only ||
+        !verify(index->path, index->content_hash, index->mtime))
+      return {};
+    for (auto &dep : index->dependencies) {
+      auto it = index->dependency_hashes.find(dep.first);
+      if (it == index->dependency_hashes.end() ||
+          !verify(dep.first.val().str(), it->second, dep.second))
+        return {};
+    }
+    ret.push_back(std::move(index));
+  }
+  return ret;
 }
 
+// Set by indexOnly(). Nothing consumes on_indexed, so indexer_Parse only
+// refreshes the cache.
+bool index_only;
+
 std::mutex &getFileMutex(const std::string &path) {
   const int n_MUTEXES = 256;
   static std::mutex mutexes[n_MUTEXES];
   return mutexes[std::hash<std::string>()(path) % n_MUTEXES];
 }
 
+int64_t steadyMs() {
+  return chrono::duration_cast<chrono::milliseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Indexer threads inside indexer_Parse, not counted as other load.
+std::atomic<int> busy_indexers;
+// steadyMs() of the last textDocument/didChange.
+std::atomic<int64_t> last_edit{INT64_MIN / 2};
+
+// Returns the number of priority classes of index_request that indexer |self|
+// may take from: 3 for all, 2 to leave background requests alone. See
+// index.adaptiveThreads and index.pauseAfterEdit.
+int indexerClasses(int self) {
+  const Config::Index &gi = g_config->index;
+  if (gi.pauseAfterEdit > 0 && steadyMs() - last_edit < gi.pauseAfterEdit)
+    return 2;
+  if (!gi.adaptiveThreads)
+    return 3;
+  static std::mutex mtx;
+  static int64_t next_update;
+  static int slots;
+  std::lock_guard lock(mtx);
+  int64_t now = steadyMs();
+  if (now >= next_update) {
+    next_update = now + 1000;
+    int old = slots, cores = std::thread::hardware_concurrency();
+    slots = gi.threads;
+    double load = getLoadAverage();
+    if (load >= 0 && cores > 0) {
+      int others = std::max(int(load + 0.5) - busy_indexers.load(), 0);
+      slots = std::clamp(cores - others, 1, gi.threads);
+    }
+    double available = getAvailableMemory();
+    if (available >= 0 && available < 0.1)
+      slots = 1;
+    if (slots != old)
+      LOG_S(INFO) << slots << " of " << gi.threads
+                  << " indexers take background requests";
+  }
+  return self < slots ? 3 : 2;
+}
+
+// Admission of translation units against index.memoryBudget. Estimates come
+// from the last index of each TU, in this process or in its cache.
+std::mutex memory_mtx;
+std::condition_variable memory_cv;
+int64_t memory_used;
+StringMap<int64_t> memory_estimates;
+
+// Waits until the estimated memory of |path| fits in the budget, or nothing
+// else is being indexed, and returns the bytes reserved.
+int64_t reserveMemory(const std::string &path, int64_t cached) {
+  int64_t budget = int64_t(g_config->index.memoryBudget) << 20;
+  if (budget <= 0)
+    return 0;
+  std::unique_lock lock(memory_mtx);
+  auto it = memory_estimates.find(path);
+  int64_t n = it != memory_estimates.end() ? it->second : cached;
+  if (memory_used && memory_used + n > budget) {
+    LOG_V(1) << "wait for memory to index " << path << " (" << (n >> 20)
+             << " MiB)";
+    memory_cv.wait(lock, [&] {
+      return !memory_used || memory_used + n <= budget ||
+             g_quit.load(std::memory_order_relaxed);
+    });
+  }
+  memory_used += n;
+  return n;
+}
+
+void releaseMemory(const std::string &path, int64_t reserved, int64_t used) {
+  if (g_config->index.memoryBudget <= 0)
+    return;
+  {
+    std::lock_guard lock(memory_mtx);
+    memory_used -= reserved;
+    if (used)
+      memory_estimates[path] = used;
+  }
+  memory_cv.notify_all();
+}
+
+// index.quarantine: strikes of translation units abandoned by index.timeout
+// or index.memoryLimit, persisted in $cache.directory/ccls.quarantine as
+// "<strikes>\t<fingerprint>\t<path>" lines.
+struct Strikes {
+  int n = 0;
+  uint64_t fingerprint = 0;
+};
+std::mutex quarantine_mtx;
+bool quarantine_loaded;
+StringMap<Strikes> quarantine;
+
+std::string quarantinePath() {
+  return g_config->cache.directory + "ccls.quarantine";
+}
+
+// Requires quarantine_mtx.
+void loadQuarantine() {
+  if (quarantine_loaded || g_config->cache.directory.empty())
+    return;
+  quarantine_loaded = true;
+  std::optional<std::string> content = readContent(quarantinePath());
+  if (!content)
+    return;
+  SmallVector<StringRef, 0> lines;
+  StringRef(*content).split(lines, '\n', -1, false);
+  for (StringRef line : lines) {
+    auto [n, rest] = line.split('\t');
+    auto [fingerprint, path] = rest.split('\t');
+    Strikes s;
+    if (!n.getAsInteger(10, s.n) &&
+        !fingerprint.getAsInteger(16, s.fingerprint) && path.size())
+      quarantine[path] = s;
+  }
+}
+
+// Requires quarantine_mtx.
+void saveQuarantine() {
+  if (g_config->cache.directory.empty())
+    return;
+  std::string content;
+  for (auto &it : quarantine)
+    content += (Twine(it.second.n) + "\t" +
+                Twine::utohexstr(it.second.fingerprint) + "\t" + it.first() +
+                "\n")
+                   .str();
+  writeFileAtomically(quarantinePath(), content);
+}
+
+// Hashes the compile arguments and the contents of |path|, so that a
+// quarantined translation unit is retried once either changes.
+uint64_t tuFingerprint(const std::string &path,
+                       const std::vector<const char *> &args) {
+  uint64_t h = 0;
+  for (const char *arg : args)
+    h = hashMix(h, xxHash64(StringRef(arg)));
+  if (std::optional<int64_t> mtime = lastWriteTime(path))
+    if (std::optional<uint64_t> hash = contentHash(path, *mtime))
+      h = hashMix(h, *hash);
+  return h;
+}
+
+bool hasStrikes(const std::string &path) {
+  std::lock_guard lock(quarantine_mtx);
+  loadQuarantine();
+  return quarantine.count(path);
+}
+
+bool isQuarantined(const std::string &path, uint64_t fingerprint) {
+  std::lock_guard lock(quarantine_mtx);
+  loadQuarantine();
+  auto it = quarantine.find(path);
+  return it != quarantine.end() &&
+         it->second.n >= g_config->index.quarantine &&
+         it->second.fingerprint == fingerprint;
+}
+
+// Adds a strike if indexing |path| was abandoned, otherwise clears its
+// strikes.
+void noteAborted(const std::string &path, uint64_t fingerprint, bool aborted) {
+  std::lock_guard lock(quarantine_mtx);
+  loadQuarantine();
+  auto it = quarantine.find(path);
+  if (!aborted) {
+    if (it == quarantine.end())
+      return;
+    quarantine.erase(it);
+  } else {
+    Strikes &s = quarantine[path];
+    if (s.fingerprint != fingerprint)
+      s = {0, fingerprint};
+    if (++s.n == g_config->index.quarantine)
+      LOG_S(WARNING) << "quarantine " << path << " after " << s.n
+                     << " abandoned attempts";
+  }
+  saveQuarantine();
+}
+
+// For $ccls/indexReport, by path.
+std::mutex cost_mtx;
+StringMap<TUCost> tu_costs;
+StringMap<HeaderCost> header_costs;
+
+void recordCost(const std::string &tu, const TUCost &cost,
+                const std::vector<std::pair<std::string, int64_t>> &headers) {
+  std::lock_guard lock(cost_mtx);
+  tu_costs[tu] = cost;
+  for (auto &[path, bytes] : headers)
+    header_costs[path] = {tu, bytes};
+}
+
+// Blocks while on_indexed is over index.maxPendingUpdates or
+// index.maxPendingUpdateMemory.
+void pushUpdate(IndexUpdate &&update, bool priority) {
+  size_t bytes = update.estimateBytes();
+  auto start = chrono::steady_clock::now();
+  on_indexed->pushBack(std::move(update), priority, bytes);
+  stats.update_stall_us += chrono::duration_cast<chrono::microseconds>(
+                               chrono::steady_clock::now() - start)
+                               .count();
+}
+
 bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
-                   Project *project, VFS *vfs, const GroupMatch &matcher) {
-  std::optional<IndexRequest> opt_request = index_request->tryPopFront();
+                   Project *project, VFS *vfs, const GroupMatch &matcher,
+                   int self, int classes) {
+  std::optional<IndexRequest> opt_request =
+      index_request->tryPopFront(self, classes);
   if (!opt_request)
     return false;
   auto &request = *opt_request;
+  int prio = indexPriority(request.mode);
+  auto queued_at = request.queued_at;
+  // Read ahead the caches of the requests that this indexer will take next.
+  // Each call adds one request to the window, so the files of a request are
+  // hinted once.
+  {
+    const size_t kWindow = 8;
+    thread_local bool primed;
+    std::vector<std::string> paths;
+    for (size_t i = primed ? kWindow - 1 : 0; i < kWindow; i++)
+      index_request->peek(self, i, [&](const IndexRequest &r) {
+        if (r.path.size())
+          paths.push_back(r.path);
+      });
+    primed = true;
+    for (auto &path : paths)
+      prefetchCache(path);
+  }
+  if (request.path.size()) {
+    std::lock_guard lock(pending_index_mtx);
+    auto it = pending_index.find(request.path);
+    if (it == pending_index.end() || it->second.queued_ts != request.ts)
+      return false;
+    request = std::move(it->second.request);
+    pending_index.erase(it);
+  }
+  if (request.path.size()) {
+    int64_t us = chrono::duration_cast<chrono::microseconds>(
+                     chrono::steady_clock::now() - queued_at)
+                     .count();
+    stats.wait_count[prio]++;
+    stats.wait_us[prio] += us;
+    for (int64_t max = stats.max_wait_us[prio];
+         us > max && !stats.max_wait_us[prio].compare_exchange_weak(max, us);)
+      ;
+  }
   bool loud = request.mode != IndexMode::OnChange;
 
   // Dummy one to trigger refresh semantic highlight.
@@ -217,13 +1017,16 @@ bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
   } raii;
   if (!matcher.matches(request.path)) {
     LOG_IF_S(INFO, loud) << "skip " << request.path;
+    index_failed->pushBack(std::string(request.path));
     return false;
   }
 
   Project::Entry entry =
       project->findEntry(request.path, true, request.must_exist);
-  if (request.must_exist && entry.filename.empty())
+  if (request.must_exist && entry.filename.empty()) {
+    index_failed->pushBack(std::string(request.path));
     return true;
+  }
   if (request.args.size())
     entry.args = request.args;
   std::string path_to_index = entry.filename;
@@ -268,38 +1071,75 @@ bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
     do {
       std::unique_lock lock(getFileMutex(path_to_index));
       prev = rawCacheLoad(path_to_index);
-      if (!prev || prev->no_linkage < no_linkage ||
+      if (!prev || prev->no_linkage < no_linkage || prev->declarations_only ||
           cacheInvalid(vfs, prev.get(), path_to_index, entry.args,
                        std::nullopt))
         break;
-      if (track)
+      if (track) {
+        std::vector<std::string> dep_paths;
+        dep_paths.reserve(prev->dependencies.size());
+        for (const auto &dep : prev->dependencies)
+          dep_paths.push_back(dep.first.val().str());
+        std::vector<std::optional<int64_t>> mtimes =
+            request.ts < loaded_ts ? startupWriteTimes(dep_paths)
+                                   : lastWriteTimes(dep_paths);
+        size_t i = 0;
         for (const auto &dep : prev->dependencies) {
-          if (auto mtime1 = lastWriteTime(dep.first.val().str())) {
-            if (dep.second < *mtime1) {
+          const std::string &dep_path = dep_paths[i];
+          if (auto mtime1 = mtimes[i++]) {
+            auto it = prev->dependency_hashes.find(dep.first);
+            if (dep.second < *mtime1 &&
+                !(it != prev->dependency_hashes.end() &&
+                  sameContent(dep_path, *mtime1, it->second))) {
               reparse = 2;
               LOG_V(1) << "timestamp changed for " << path_to_index << " via "
-                       << dep.first.val().str();
+                       << dep_path;
               break;
             }
           } else {
             reparse = 2;
             LOG_V(1) << "timestamp changed for " << path_to_index << " via "
-                     << dep.first.val().str();
+                     << dep_path;
             break;
           }
         }
+      }
       if (reparse == 0)
         return true;
       if (reparse == 2)
         break;
+      // The cache is up to date. Stamp the headers so that other translation
+      // units do not rewrite their caches.
+      if (index_only) {
+        for (const auto &dep : prev->dependencies)
+          vfs->stamp(dep.first.val().str(), dep.second, 1);
+        return true;
+      }
 
       if (vfs->loaded(path_to_index))
         return true;
+      if (g_config->index.lazyLoad && request.mode == IndexMode::Background &&
+          !wfiles->getFile(path_to_index)) {
+        std::lock_guard lock1(deferred_mtx);
+        if (!deferred_loaded) {
+          // Unstamp so that the request will not be skipped when it is
+          // resubmitted.
+          {
+            std::lock_guard lock2(vfs->mutex);
+            vfs->state[path_to_index] = {};
+            if (request.path != path_to_index)
+              vfs->state[request.path] = {};
+          }
+          LOG_V(1) << "defer loading cache for " << path_to_index;
+          deferred.push_back(std::move(request));
+          deferred_tus.push_back(path_to_index);
+          return true;
+        }
+      }
       LOG_S(INFO) << "load cache for " << path_to_index;
       auto dependencies = prev->dependencies;
       IndexUpdate update = IndexUpdate::createDelta(nullptr, prev.get());
-      on_indexed->pushBack(std::move(update),
-                           request.mode != IndexMode::Background);
+      pushUpdate(std::move(update), request.mode != IndexMode::Background);
       {
         std::lock_guard lock1(vfs->mutex);
         VFS::State &st = vfs->state[path_to_index];
@@ -309,38 +1149,89 @@ bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
       }
       lock.unlock();
 
+      // Stamping decides which headers this TU loads. Loading and decoding
+      // their caches and computing the deltas are independent, so they are
+      // spread over a few threads for TUs with many headers.
+      std::vector<std::string> to_load;
       for (const auto &dep : dependencies) {
         std::string path = dep.first.val().str();
-        if (!vfs->stamp(path, dep.second, 1))
-          continue;
-        std::lock_guard lock1(getFileMutex(path));
-        prev = rawCacheLoad(path);
-        if (!prev)
-          continue;
-        {
-          std::lock_guard lock2(vfs->mutex);
-          VFS::State &st = vfs->state[path];
-          if (st.loaded)
+        if (vfs->stamp(path, dep.second, 1))
+          to_load.push_back(std::move(path));
+      }
+      std::atomic<size_t> next{0};
+      std::vector<std::pair<std::string, int64_t>> header_bytes(
+          to_load.size());
+      auto loadDeps = [&](int) {
+        for (size_t i; (i = next++) < to_load.size();) {
+          const std::string &path = to_load[i];
+          std::lock_guard lock1(getFileMutex(path));
+          std::unique_ptr<IndexFile> dep = rawCacheLoad(path);
+          if (!dep)
             continue;
-          st.loaded++;
-          st.timestamp = prev->mtime;
-          if (prev->no_linkage)
-            st.step = 3;
-        }
-        IndexUpdate update = IndexUpdate::createDelta(nullptr, prev.get());
-        on_indexed->pushBack(std::move(update),
-                             request.mode != IndexMode::Background);
-        if (entry.id >= 0) {
-          std::lock_guard lock2(project->mtx);
-          project->root2folder[entry.root].path2entry_index[path] = entry.id;
+          header_bytes[i] = {path, dep->blob_size};
+          {
+            std::lock_guard lock2(vfs->mutex);
+            VFS::State &st = vfs->state[path];
+            if (st.loaded)
+              continue;
+            st.loaded++;
+            st.timestamp = dep->mtime;
+            if (dep->no_linkage)
+              st.step = 3;
+          }
+          IndexUpdate update = IndexUpdate::createDelta(nullptr, dep.get());
+          pushUpdate(std::move(update), request.mode != IndexMode::Background);
+          if (entry.id >= 0) {
+            std::lock_guard lock2(project->mtx);
+            project->root2folder[entry.root].path2entry_index[path] = entry.id;
+          }
         }
-      }
+      };
+      size_t threads = std::max(1u, std::thread::hardware_concurrency());
+      runPooled(int(std::min(to_load.size() / 64 + 1, threads)), loadDeps);
+      TUCost tu_cost{prev->cost, prev->memory, prev->blob_size};
+      llvm::erase_if(header_bytes, [](auto &x) { return x.first.empty(); });
+      for (auto &x : header_bytes)
+        tu_cost.bytes += x.second;
+      recordCost(path_to_index, tu_cost, header_bytes);
       return true;
     } while (0);
 
+  // A translation unit never indexed before takes the declarations pass of
+  // index.initialDeclarationsOnly first. The full pass is queued when it is
+  // done and finds the cache incomplete.
+  bool declarations_only =
+      g_config->index.initialDeclarationsOnly &&
+      request.mode == IndexMode::Background && reparse == 1 && !prev &&
+      !deleted && !index_only && request.path == path_to_index;
+  if (declarations_only) {
+    // Stamp below both passes so that the headers and the full pass are not
+    // skipped.
+    std::lock_guard lock(vfs->mutex);
+    vfs->state[path_to_index].step = -2;
+  }
+
+  // A quarantined translation unit is only indexed on request, e.g. when it
+  // is saved. The fingerprint reads the whole file, so skip it unless indexing
+  // can be abandoned or the file has strikes from an earlier configuration.
+  uint64_t fingerprint = 0;
+  if (g_config->index.quarantine > 0 && !deleted &&
+      (g_config->index.timeout > 0 || g_config->index.memoryLimit > 0 ||
+       hasStrikes(path_to_index))) {
+    fingerprint = tuFingerprint(path_to_index, entry.args);
+    if (request.mode == IndexMode::Background &&
+        isQuarantined(path_to_index, fingerprint)) {
+      LOG_IF_S(INFO, loud) << "skip quarantined " << path_to_index;
+      stats.quarantine_skipped++;
+      return true;
+    }
+  }
+
   std::vector<std::unique_ptr<IndexFile>> indexes;
   int n_errs = 0;
   std::string first_error;
+  // Whether the result depends on files only, not unsaved buffers.
+  bool shareable = false, fetched = false;
   if (deleted) {
     indexes.push_back(std::make_unique<IndexFile>(request.path, "", false));
     if (request.path != path_to_index)
@@ -351,14 +1242,62 @@ bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
       std::string content = wfiles->getContent(path_to_index);
       if (content.size())
         remapped.emplace_back(path_to_index, content);
+      // An edited header is indexed through a translation unit including it.
+      // Other headers are stamped and reused.
+      if (request.path != path_to_index) {
+        content = wfiles->getContent(request.path);
+        if (content.size())
+          remapped.emplace_back(request.path, content);
+      }
+    }
+    bool ok = true;
+    shareable = remapped.empty() && !declarations_only;
+    if (shareable)
+      indexes = fetchShared(path_to_index, entry.args, no_linkage);
+    if (indexes.size()) {
+      fetched = true;
+      LOG_S(INFO) << "load shared cache for " << path_to_index;
+      // Like IndexParam::seenFile, leave headers to the first translation
+      // unit that reaches them.
+      indexes.erase(std::remove_if(indexes.begin(), indexes.end(),
+                                   [&](const std::unique_ptr<IndexFile> &f) {
+                                     return f->path != path_to_index &&
+                                            !vfs->stamp(f->path, f->mtime, 1);
+                                   }),
+                    indexes.end());
+    } else {
+      // |prev| is the rejected cache of the TU, if any.
+      int64_t reserved =
+          reserveMemory(path_to_index, prev ? prev->memory : 0);
+      auto start = chrono::steady_clock::now();
+      IndexResult result;
+      if (!(remapped.empty() && request.mode == IndexMode::Background &&
+            indexInWorker(vfs, entry.directory, path_to_index, entry.args,
+                          no_linkage && !declarations_only, declarations_only,
+                          result, ok)))
+        result =
+            idx::index(completion, wfiles, vfs, entry.directory, path_to_index,
+                       entry.args, remapped, no_linkage && !declarations_only,
+                       declarations_only, ok);
+      releaseMemory(path_to_index, reserved, result.memory);
+      int64_t us = chrono::duration_cast<chrono::microseconds>(
+                       chrono::steady_clock::now() - start)
+                       .count();
+      stats.index_us += us;
+      stats.indexed++;
+      indexes = std::move(result.indexes);
+      for (auto &index : indexes)
+        if (index->path == path_to_index)
+          index->cost.wall_us = us;
+      for (auto &index : indexes)
+        stats.indexed_bytes += index->file_contents.size();
+      n_errs = result.n_errs;
+      first_error = std::move(result.first_error);
+      if (result.aborted.size())
+        stats.index_aborted++;
+      if (fingerprint && (ok || result.aborted.size()))
+        noteAborted(path_to_index, fingerprint, result.aborted.size());
     }
-    bool ok;
-    auto result =
-        idx::index(completion, wfiles, vfs, entry.directory, path_to_index,
-                   entry.args, remapped, no_linkage, ok);
-    indexes = std::move(result.indexes);
-    n_errs = result.n_errs;
-    first_error = std::move(result.first_error);
 
     if (!ok) {
       if (request.id.valid()) {
@@ -367,6 +1306,7 @@ bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
         err.message = "failed to index " + path_to_index;
         pipeline::replyError(request.id, err);
       }
+      index_failed->pushBack(std::string(request.path));
       return true;
     }
   }
@@ -386,6 +1326,13 @@ bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
     LOG_S(INFO) << std::string_view(msg.data(), msg.size());
   }
 
+  // A CI job with cache.sharedWrite publishes what it indexes.
+  bool publish = shareable && !fetched && g_config->cache.sharedWrite &&
+                 getSharedBackend();
+  std::vector<BundleFile> bundle;
+  uint64_t main_hash = 0;
+  TUCost tu_cost;
+  std::vector<std::pair<std::string, int64_t>> header_bytes;
   for (std::unique_ptr<IndexFile> &curr : indexes) {
     std::string path = curr->path;
     if (!matcher.matches(path)) {
@@ -399,33 +1346,55 @@ bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
     {
       std::lock_guard lock(getFileMutex(path));
       int loaded = vfs->loaded(path), retain = g_config->cache.retainInMemory;
+      std::shared_ptr<const IndexFile> previous;
       if (loaded)
-        prev = rawCacheLoad(path);
-      else
-        prev.reset();
+        previous = loadPrevious(path);
       if (retain > 0 && retain <= loaded + 1) {
+        auto index = std::make_shared<IndexFile>(*curr);
+        std::string().swap(index->file_contents);
         std::lock_guard lock(g_index_mutex);
         auto it = g_index.insert_or_assign(
-            path, InMemoryIndexFile{curr->file_contents, *curr});
-        std::string().swap(it.first->second.index.file_contents);
+            path, InMemoryIndexFile{{}, 0, false, std::move(index)});
+        if (g_config->cache.directory.empty())
+          setContent(it.first->second, curr->file_contents);
+      }
+      std::string serialized;
+      if (!deleted && (g_config->cache.directory.size() || publish)) {
+        auto start = chrono::steady_clock::now();
+        serialized = serialize(g_config->cache.format, *curr);
+        stats.serialize_us += chrono::duration_cast<chrono::microseconds>(
+                                  chrono::steady_clock::now() - start)
+                                  .count();
+        if (publish) {
+          bundle.push_back({path, curr->file_contents, serialized});
+          if (path == path_to_index)
+            main_hash = curr->content_hash;
+        }
+        if (g_config->cache.directory.size()) {
+          tu_cost.bytes += serialized.size();
+          if (path != path_to_index)
+            header_bytes.emplace_back(path, serialized.size());
+        }
+      }
+      if (path == path_to_index) {
+        tu_cost.cost = curr->cost;
+        tu_cost.memory = curr->memory;
       }
       if (g_config->cache.directory.size()) {
         std::string cache_path = getCachePath(path);
-        if (deleted) {
-          (void)sys::fs::remove(cache_path);
-          (void)sys::fs::remove(appendSerializationFormat(cache_path));
-        } else {
-          if (g_config->cache.hierarchicalPath)
-            sys::fs::create_directories(
-                sys::path::parent_path(cache_path, sys::path::Style::posix),
-                true);
-          writeToFile(cache_path, curr->file_contents);
-          writeToFile(appendSerializationFormat(cache_path),
-                      serialize(g_config->cache.format, *curr));
-        }
+        if (deleted)
+          queueCacheWrite(path, {std::move(cache_path), {}, {}, true});
+        else
+          queueCacheWrite(path,
+                          {std::move(cache_path), curr->file_contents,
+                           std::move(serialized), false,
+                           g_config->cache.symbolTable && !getCachePack()
+                               ? buildSymbolTable(*curr)
+                               : std::string()});
       }
-      on_indexed->pushBack(IndexUpdate::createDelta(prev.get(), curr.get()),
-                           request.mode != IndexMode::Background);
+      if (!index_only)
+        pushUpdate(IndexUpdate::createDelta(previous.get(), curr.get()),
+                   request.mode != IndexMode::Background);
       {
         std::lock_guard lock1(vfs->mutex);
         vfs->state[path].loaded++;
@@ -438,7 +1407,31 @@ bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
       }
     }
   }
+  if (main_hash)
+    getSharedBackend()->put(sharedKey(path_to_index, entry.args, main_hash),
+                            encodeBundle(bundle));
+  if (!deleted)
+    recordCost(path_to_index, tu_cost, header_bytes);
+  if (declarations_only)
+    index(request.path, request.args, IndexMode::Background,
+          request.must_exist);
+
+  return true;
+}
 
+// Saves |db|, which must reflect every index result so far, unless cache
+// writes are pending.
+bool saveSnapshot(DB &db) {
+  if (!useSnapshot())
+    return false;
+  {
+    std::lock_guard lock(cache_write_mtx);
+    if (cache_writes.size() || cache_writing.size())
+      return false;
+  }
+  if (!writeSnapshot(db, getSnapshotPath()))
+    return false;
+  snapshot_valid = true;
   return true;
 }
 
@@ -448,12 +1441,115 @@ void quit(SemaManager &manager) {
 
   { std::lock_guard lock(index_request->mutex_); }
   indexer_waiter->cv.notify_all();
+  { std::lock_guard lock(cache_write_mtx); }
+  cache_write_cv.notify_all();
+  { std::lock_guard lock(memory_mtx); }
+  memory_cv.notify_all();
   { std::lock_guard lock(for_stdout->mutex_); }
   stdout_waiter->cv.notify_one();
+  { std::lock_guard lock(for_request_threads->mutex_); }
+  request_waiter->cv.notify_all();
   std::unique_lock lock(thread_mtx);
   no_active_threads.wait(lock, [] { return !active_threads; });
 }
 
+// If |s| is a notification which is superseded by a later one with the same
+// method and uri, return the part of |s| from the method to the uri.
+std::string_view supersedeKey(const std::string &s) {
+  const std::string_view kPrefix("{\"jsonrpc\":\"2.0\",\"method\":\""),
+      kUri("\",\"params\":{\"uri\":\"");
+  if (s.compare(0, kPrefix.size(), kPrefix.data(), kPrefix.size()))
+    return {};
+  size_t pos = s.find('"', kPrefix.size());
+  if (pos == std::string::npos)
+    return {};
+  std::string_view method(s.data() + kPrefix.size(), pos - kPrefix.size());
+  if (method != "$ccls/publishSemanticHighlight" &&
+      method != "$ccls/publishSkippedRanges" &&
+      method != "textDocument/publishDiagnostics")
+    return {};
+  if (s.compare(pos, kUri.size(), kUri.data(), kUri.size()))
+    return {};
+  pos = s.find('"', pos + kUri.size());
+  if (pos == std::string::npos)
+    return {};
+  return std::string_view(s.data() + kPrefix.size(), pos - kPrefix.size());
+}
+
+// Requests in lower lanes run first: interactive ones the user waits on, then
+// the rest, then bulk requests over whole documents or the workspace.
+int requestLane(std::string_view method) {
+  static const char *const interactive[] = {
+      "textDocument/completion",    "textDocument/declaration",
+      "textDocument/definition",    "textDocument/documentHighlight",
+      "textDocument/hover",         "textDocument/signatureHelp",
+      "textDocument/typeDefinition"};
+  static const char *const bulk[] = {
+      "textDocument/codeLens",       "textDocument/documentLink",
+      "textDocument/documentSymbol", "textDocument/foldingRange",
+      "textDocument/references",     "textDocument/semanticTokens/full",
+      "workspace/symbol"};
+  for (const char *m : interactive)
+    if (method == m)
+      return 0;
+  for (const char *m : bulk)
+    if (method == m)
+      return 2;
+  return 1;
+}
+
+// Returns the document of a request whose result only depends on the latest
+// content of the document, so that a later one supersedes it.
+std::string_view supersedableUri(const InMessage &message) {
+  if (message.method != "textDocument/codeLens" &&
+      message.method != "textDocument/documentLink" &&
+      message.method != "textDocument/documentSymbol" &&
+      message.method != "textDocument/foldingRange" &&
+      message.method != "textDocument/semanticTokens/full")
+    return {};
+  const rapidjson::Value &doc = *message.document;
+  auto params = doc.FindMember("params");
+  if (params == doc.MemberEnd() || !params->value.IsObject())
+    return {};
+  auto td = params->value.FindMember("textDocument");
+  if (td == params->value.MemberEnd() || !td->value.IsObject())
+    return {};
+  auto uri = td->value.FindMember("uri");
+  if (uri == td->value.MemberEnd() || !uri->value.IsString())
+    return {};
+  return {uri->value.GetString(), uri->value.GetStringLength()};
+}
+
+// Answers and removes requests superseded by a later one for the same
+// document, then orders the others by requestLane within each run of
+// requests between two notifications.
+void prioritize(std::vector<InMessage> &messages) {
+  std::unordered_set<std::string> seen;
+  std::vector<bool> superseded(messages.size());
+  for (size_t i = messages.size(); i--;) {
+    InMessage &m = messages[i];
+    std::string_view uri =
+        m.id.valid() ? supersedableUri(m) : std::string_view();
+    if (uri.empty() || seen.insert(m.method + ' ' + std::string(uri)).second)
+      continue;
+    ResponseError err{ErrorCode::ContentModified, "superseded " + m.method};
+    replyError(m.id, err);
+    superseded[i] = true;
+  }
+  size_t n = 0;
+  for (size_t i = 0; i < messages.size(); i++)
+    if (!superseded[i] && n++ != i)
+      messages[n - 1] = std::move(messages[i]);
+  messages.resize(n);
+  for (auto i = messages.begin(); i != messages.end();) {
+    auto j = std::find_if(i, messages.end(),
+                          [](const InMessage &m) { return !m.id.valid(); });
+    std::stable_sort(i, j, [](const InMessage &l, const InMessage &r) {
+      return requestLane(l.method) < requestLane(r.method);
+    });
+    i = j == messages.end() ? j : j + 1;
+  }
+}
 } // namespace
 
 void threadEnter() {
@@ -470,22 +1566,166 @@ void threadLeave() {
 void init() {
   main_waiter = new MultiQueueWaiter;
   on_request = new ThreadedQueue<InMessage>(main_waiter);
-  on_indexed = new ThreadedQueue<IndexUpdate>(main_waiter);
+  // See index.maxPendingUpdates.
+  on_indexed = new BoundedQueue<IndexUpdate>(main_waiter, 1024, g_quit);
+  index_failed = new ThreadedQueue<std::string>(main_waiter);
 
   indexer_waiter = new MultiQueueWaiter;
-  index_request = new ThreadedQueue<IndexRequest>(indexer_waiter);
+  index_request = new WorkStealingQueue<IndexRequest, 3>(
+      indexer_waiter, std::thread::hardware_concurrency());
 
   stdout_waiter = new MultiQueueWaiter;
-  for_stdout = new ThreadedQueue<std::string>(stdout_waiter);
+  for_stdout = new BoundedQueue<std::string>(stdout_waiter, 4096, g_quit);
+
+  request_waiter = new MultiQueueWaiter;
+  for_request_threads = new ThreadedQueue<InMessage>(request_waiter);
+}
+
+QueueDepths queueDepths() {
+  return {int64_t(on_request->size()), int64_t(index_request->size()),
+          int64_t(on_indexed->size()), int64_t(for_stdout->size())};
+}
+
+void loadSnapshot(DB *db, VFS *vfs, Project *project) {
+  if (!useSnapshot() || !readSnapshot(*db, getSnapshotPath()))
+    return;
+  // Mark files as loaded from their indexed mtime, so that unchanged files are
+  // skipped and changed ones are re-indexed against the cache, as if the cache
+  // had been loaded.
+  {
+    std::lock_guard lock(vfs->mutex);
+    for (QueryFile &file : db->files)
+      if (file.def) {
+        VFS::State &st = vfs->state[file.def->path];
+        st.timestamp = file.def->mtime;
+        st.loaded = 1;
+      }
+  }
+  // Loading the cache of a main file maps its dependencies to its entry.
+  std::lock_guard lock(project->mtx);
+  for (auto &[root, folder] : project->root2folder) {
+    std::vector<std::pair<std::string, int>> mains(
+        folder.path2entry_index.begin(), folder.path2entry_index.end());
+    for (auto &[path, idx] : mains) {
+      auto it = db->name2file_id.find(lowerPathIfInsensitive(path));
+      if (it == db->name2file_id.end() || !db->files[it->second].def)
+        continue;
+      for (const char *dep : db->files[it->second].def->dependencies)
+        folder.path2entry_index.try_emplace(dep, idx);
+    }
+  }
 }
 
 void indexer_Main(SemaManager *manager, VFS *vfs, Project *project,
                   WorkingFiles *wfiles) {
+  static std::atomic<int> n_indexers;
+  int self = n_indexers++;
+  if (g_config->index.numa) {
+    static int nodes = numaNodeCount();
+    int threads = std::max(g_config->index.threads, self + 1);
+    int node = int(int64_t(self) * nodes / threads);
+    if (nodes > 1 && pinThreadToNumaNode(node)) {
+      index_request->setNode(self, node);
+      setThreadArena(Arena::Indexer, node);
+    }
+  }
+  static std::once_flag once;
+  std::call_once(once, [] {
+    on_indexed->setLimits(
+        std::max(g_config->index.maxPendingUpdates, 0),
+        size_t(std::max(g_config->index.maxPendingUpdateMemory, 0)) << 20);
+    index_request->setAging(std::max(g_config->index.aging, 0));
+  });
   GroupMatch matcher(g_config->index.whitelist, g_config->index.blacklist);
-  while (true)
-    if (!indexer_Parse(manager, wfiles, project, vfs, matcher))
-      if (indexer_waiter->wait(g_quit, index_request))
+  while (true) {
+    int classes = indexerClasses(self);
+    busy_indexers++;
+    bool parsed =
+        indexer_Parse(manager, wfiles, project, vfs, matcher, self, classes);
+    busy_indexers--;
+    if (parsed)
+      continue;
+    // Background requests are left for later. Poll, as nothing notifies
+    // when throttling ends.
+    if (classes < 3 && index_request->size()) {
+      if (g_quit.load(std::memory_order_relaxed))
+        break;
+      indexer_waiter->sleepUntil(chrono::steady_clock::now() +
+                                     chrono::milliseconds(200),
+                                 index_request);
+      continue;
+    }
+    if (indexer_waiter->wait(g_quit, index_request))
+      break;
+  }
+}
+
+void request_Main(MessageHandler *handler) {
+  while (true) {
+    std::optional<InMessage> message = for_request_threads->tryPopFront();
+    if (!message) {
+      if (request_waiter->wait(g_quit, for_request_threads))
         break;
+      continue;
+    }
+    {
+      { std::lock_guard turnstile(db_turnstile); }
+      std::shared_lock lock(db_mutex);
+      try {
+        handler->run(*message);
+      } catch (NotIndexed &ex) {
+        // Send it back for the main thread to put it into the backlog.
+        message->backlog_path = ex.path;
+        on_request->pushBack(std::move(*message));
+      }
+    }
+    std::lock_guard lock(in_flight_mutex);
+    if (!--requests_in_flight)
+      in_flight_cv.notify_all();
+  }
+}
+
+void main_OnApplied(DB *db, WorkingFiles *wfiles, IndexUpdate *update);
+
+// Composes each update into a later update of the same file in |updates|, so
+// that a file re-indexed several times in a batch is applied once. An update
+// moves to the position of the later one; a refresh is never crossed.
+void coalesceUpdates(std::vector<IndexUpdate> &updates) {
+  if (updates.size() < 2)
+    return;
+  StringMap<size_t> last;
+  std::vector<bool> merged(updates.size());
+  size_t n = 0;
+  for (size_t i = 0; i < updates.size(); i++) {
+    IndexUpdate &u = updates[i];
+    if (u.refresh) {
+      last.clear();
+      continue;
+    }
+    if (!u.files_def_update)
+      continue;
+    auto [it, inserted] = last.try_emplace(u.files_def_update->first.path, i);
+    if (inserted)
+      continue;
+    IndexUpdate &prev = updates[it->second];
+    if (prev.compose(std::move(u))) {
+      u = std::move(prev);
+      merged[it->second] = true;
+      n++;
+    }
+    it->second = i;
+  }
+  if (!n)
+    return;
+  stats.updates_merged += n;
+  size_t j = 0;
+  for (size_t i = 0; i < updates.size(); i++)
+    if (!merged[i]) {
+      if (i != j)
+        updates[j] = std::move(updates[i]);
+      j++;
+    }
+  updates.resize(j);
 }
 
 void main_OnIndexed(DB *db, WorkingFiles *wfiles, IndexUpdate *update) {
@@ -493,18 +1733,36 @@ void main_OnIndexed(DB *db, WorkingFiles *wfiles, IndexUpdate *update) {
     LOG_S(INFO)
         << "loaded project. Refresh semantic highlight for all working file.";
     std::lock_guard lock(wfiles->mutex);
+    std::vector<std::pair<WorkingFile *, QueryFile *>> todo;
     for (auto &[f, wf] : wfiles->files) {
-      std::string path = lowerPathIfInsensitive(f);
-      if (db->name2file_id.find(path) == db->name2file_id.end())
-        continue;
-      QueryFile &file = db->files[db->name2file_id[path]];
-      emitSemanticHighlight(db, wf.get(), file);
+      auto it = db->name2file_id.find(lowerPathIfInsensitive(f));
+      if (it != db->name2file_id.end())
+        todo.emplace_back(wf.get(), &db->files[it->second]);
     }
-    return;
+    // Highlight the most recently viewed files, which are likely visible, in
+    // parallel. The others are highlighted when they are viewed again.
+    std::sort(todo.begin(), todo.end(), [](auto &l, auto &r) {
+      return l.first->viewed > r.first->viewed;
+    });
+    size_t n = std::min(todo.size(), size_t(g_config->highlight.refreshFiles));
+    for (size_t i = n; i < todo.size(); i++)
+      todo[i].first->highlight_deferred = true;
+    if (n) {
+      std::atomic<size_t> next{0};
+      size_t threads = std::max(1u, std::thread::hardware_concurrency());
+      runPooled(int(std::min(n, threads)), [&](int) {
+        for (size_t i; (i = next++) < n;)
+          emitSemanticHighlight(db, todo[i].first, *todo[i].second);
+      });
+    }
+    return;
   }
 
   db->applyIndexUpdate(update);
+  main_OnApplied(db, wfiles, update);
+}
 
+void main_OnApplied(DB *db, WorkingFiles *wfiles, IndexUpdate *update) {
   // Update indexed content, skipped ranges, and semantic highlighting.
   if (update->files_def_update) {
     auto &def_u = *update->files_def_update;
@@ -514,49 +1772,97 @@ void main_OnIndexed(DB *db, WorkingFiles *wfiles, IndexUpdate *update) {
       wfile->setIndexContent(g_config->index.onChange ? wfile->buffer_content
                                                       : def_u.second);
       QueryFile &file = db->files[update->file_id];
-      emitSkippedRanges(wfile, file);
+      emitSkippedRanges(db, wfile, file);
       emitSemanticHighlight(db, wfile, file);
     }
   }
 }
 
+void pushNotification(std::string_view str) {
+  MessagePtr message = allocMessage(str.size() + 1);
+  std::copy(str.begin(), str.end(), message.get());
+  message[str.size()] = '\0';
+  DocumentPtr document = allocDocument();
+  document->ParseInsitu(message.get());
+  if (document->HasParseError())
+    return;
+  std::string method;
+  JsonReader reader{document.get()};
+  reflectMember(reader, "method", method);
+  auto now = chrono::steady_clock::now();
+  on_request->pushBack({RequestId(), std::move(method), std::move(message),
+                        std::move(document),
+                        now + chrono::milliseconds(g_config->request.timeout),
+                        now});
+}
+
+namespace {
+// Reads the body of a message into |message|, null-terminated, so that it can
+// be parsed in place. Returns false at EOF.
+bool readMessage(FILE *in, MessagePtr &message, size_t &len) {
+  const std::string_view kContentLength("Content-Length: ");
+  std::string str;
+  len = 0;
+  while (true) {
+    int c = getc(in);
+    if (c == EOF)
+      return false;
+    if (c == '\n') {
+      if (str.empty())
+        break;
+      if (!str.compare(0, kContentLength.size(), kContentLength))
+        len = atoi(str.c_str() + kContentLength.size());
+      str.clear();
+    } else if (c != '\r') {
+      str += c;
+    }
+  }
+  message = allocMessage(len + 1);
+  if (fread(message.get(), 1, len, in) != len)
+    return false;
+  message[len] = '\0';
+  return true;
+}
+
+// Queues a message read from the client for the main thread.
+void pushMessage(const RequestId &id, std::string method, MessagePtr message,
+                 DocumentPtr document) {
+  if (id.valid()) {
+    std::lock_guard lock(pending_requests_mtx);
+    pending_requests[requestKey(id)] = false;
+  }
+  // g_config is not available before "initialize". Use 0 in that case.
+  auto now = chrono::steady_clock::now();
+  on_request->pushBack(
+      {id, std::move(method), std::move(message), std::move(document),
+       now + chrono::milliseconds(g_config ? g_config->request.timeout : 0),
+       now});
+}
+} // namespace
+
 void launchStdin() {
   threadEnter();
   std::thread([]() {
     set_thread_name("stdin");
-    std::string str;
-    const std::string_view kContentLength("Content-Length: ");
+    setThreadArena(Arena::IO);
     bool received_exit = false;
     while (true) {
-      int len = 0;
-      str.clear();
-      while (true) {
-        int c = getchar();
-        if (c == EOF)
+      MessagePtr message;
+      size_t len = 0;
+      if (replay::replaying) {
+        if (!replay::next(message, len))
           goto quit;
-        if (c == '\n') {
-          if (str.empty())
-            break;
-          if (!str.compare(0, kContentLength.size(), kContentLength))
-            len = atoi(str.c_str() + kContentLength.size());
-          str.clear();
-        } else if (c != '\r') {
-          str += c;
-        }
-      }
-
-      str.resize(len);
-      for (int i = 0; i < len; ++i) {
-        int c = getchar();
-        if (c == EOF)
+      } else {
+        if (!readMessage(stdin, message, len))
           goto quit;
-        str[i] = c;
+        if (replay::recording)
+          replay::record(std::string_view(message.get(), len));
+      }
+      DocumentPtr document = allocDocument();
+      {
+        trace::Span span("stdin.parse");
+        document->ParseInsitu(message.get());
       }
-
-      auto message = std::make_unique<char[]>(len);
-      std::copy(str.begin(), str.end(), message.get());
-      auto document = std::make_unique<rapidjson::Document>();
-      document->Parse(message.get(), len);
       assert(!document->HasParseError());
 
       JsonReader reader{document.get()};
@@ -573,13 +1879,17 @@ void launchStdin() {
         LOG_V(2) << "receive NotificationMessage " << method;
       if (method.empty())
         continue;
+      if (method == "$/cancelRequest") {
+        // Handled here so that it is not queued behind the request it cancels.
+        RequestId cancelled;
+        reader.member("params",
+                      [&]() { reflectMember(reader, "id", cancelled); });
+        cancel(cancelled);
+        continue;
+      }
       received_exit = method == "exit";
-      // g_config is not available before "initialize". Use 0 in that case.
-      on_request->pushBack(
-          {id, std::move(method), std::move(message), std::move(document),
-           chrono::steady_clock::now() +
-               chrono::milliseconds(g_config ? g_config->request.timeout : 0)});
-
+      pushMessage(id, std::move(method), std::move(message),
+                  std::move(document));
       if (received_exit)
         break;
     }
@@ -587,27 +1897,351 @@ void launchStdin() {
   quit:
     if (!received_exit) {
       const std::string_view str("{\"jsonrpc\":\"2.0\",\"method\":\"exit\"}");
-      auto message = std::make_unique<char[]>(str.size());
+      MessagePtr message = allocMessage(str.size());
       std::copy(str.begin(), str.end(), message.get());
-      auto document = std::make_unique<rapidjson::Document>();
+      DocumentPtr document = allocDocument();
       document->Parse(message.get(), str.size());
+      auto now = chrono::steady_clock::now();
       on_request->pushBack({RequestId(), std::string("exit"),
-                            std::move(message), std::move(document),
-                            chrono::steady_clock::now()});
+                            std::move(message), std::move(document), now,
+                            now});
     }
     threadLeave();
   }).detach();
 }
 
+#ifndef _WIN32
+namespace {
+// A client connected to the socket of launchSocket.
+struct SocketClient {
+  int id;
+  int fd;
+  // Whether the client sent the "initialize" which the server has run.
+  bool initializer = false;
+  // URIs of the documents opened by the client. Guarded by clients_mtx.
+  std::unordered_set<std::string> opened;
+  // Guards |fd| against concurrent writes and close.
+  std::mutex write_mtx;
+
+  void write(std::string_view s) {
+    std::string header =
+        "Content-Length: " + std::to_string(s.size()) + "\r\n\r\n";
+    std::lock_guard lock(write_mtx);
+    if (fd >= 0)
+      (void)(writeAll(fd, header.data(), header.size()) &&
+             writeAll(fd, s.data(), s.size()));
+  }
+};
+
+std::atomic<bool> socket_mode{false};
+std::mutex clients_mtx;
+std::unordered_map<int, std::shared_ptr<SocketClient>> clients;
+// Number of clients which have each document open. The server sees a
+// document closed when the last of them closes it or disconnects.
+std::unordered_map<std::string, int> open_count;
+
+// Clients share the session started by the first "initialize". Later clients
+// are given its result without running the handler again.
+std::mutex init_mtx;
+std::condition_variable init_cv;
+bool initialize_forwarded = false;
+// The JSON-escaped id of the forwarded "initialize".
+std::string initialize_key;
+std::optional<std::string> initialize_result;
+
+std::string escapeJson(std::string_view s) {
+  rapidjson::StringBuffer output;
+  rapidjson::Writer<rapidjson::StringBuffer> w(output);
+  w.String(s.data(), s.size());
+  return std::string(output.GetString() + 1, output.GetSize() - 2);
+}
+
+// The ids of requests from client |client| become "<client>:" followed by
+// requestKey of the original id, so that ids of different clients do not
+// clash. routeMessage restores them in replies.
+void tagId(int client, RequestId &id) {
+  if (id.valid()) {
+    id.value = std::to_string(client) + ':' + requestKey(id);
+    id.type = RequestId::kString;
+  }
+}
+
+std::string makeReply(const RequestId &id, std::string_view result) {
+  rapidjson::StringBuffer output;
+  rapidjson::Writer<rapidjson::StringBuffer> w(output);
+  w.StartObject();
+  w.Key("jsonrpc");
+  w.String("2.0");
+  w.Key("id");
+  if (id.type == RequestId::kInt)
+    w.Int64(atoll(id.value.c_str()));
+  else
+    w.String(id.value.c_str(), id.value.size());
+  w.Key("result");
+  w.RawValue(result.data(), result.size(), rapidjson::kObjectType);
+  w.EndObject();
+  return std::string(output.GetString(), output.GetSize());
+}
+
+// Sends a reply to the client whose request it answers, with the original
+// id, and anything else to every client.
+void routeMessage(const std::string &s) {
+  const std::string_view kPrefix("{\"jsonrpc\":\"2.0\",\"id\":\"");
+  if (!s.compare(0, kPrefix.size(), kPrefix.data(), kPrefix.size())) {
+    size_t colon = s.find(':', kPrefix.size()), end = colon;
+    if (colon != std::string::npos)
+      for (end = colon + 1; end < s.size() && s[end] != '"'; end++)
+        if (s[end] == '\\')
+          end++;
+    if (end < s.size() && colon + 1 < end) {
+      int client = atoi(s.c_str() + kPrefix.size());
+      std::string_view value(s.data() + colon + 2, end - colon - 2);
+      std::string out(s, 0, kPrefix.size() - 1);
+      if (s[colon + 1] == 'n') {
+        out += value;
+      } else {
+        out += '"';
+        out += value;
+        out += '"';
+      }
+      out.append(s, end + 1);
+      {
+        std::lock_guard lock(init_mtx);
+        if (!initialize_result &&
+            !s.compare(kPrefix.size(), end - kPrefix.size(), initialize_key)) {
+          const std::string_view kResult(",\"result\":");
+          size_t pos = out.find(kResult);
+          if (pos != std::string::npos) {
+            pos += kResult.size();
+            initialize_result = out.substr(pos, out.size() - 1 - pos);
+          } else {
+            // Let the next client try.
+            initialize_forwarded = false;
+          }
+          init_cv.notify_all();
+        }
+      }
+      std::shared_ptr<SocketClient> c;
+      {
+        std::lock_guard lock(clients_mtx);
+        auto it = clients.find(client);
+        if (it != clients.end())
+          c = it->second;
+      }
+      if (c)
+        c->write(out);
+      return;
+    }
+  }
+  std::vector<std::shared_ptr<SocketClient>> all;
+  {
+    std::lock_guard lock(clients_mtx);
+    for (auto &it : clients)
+      all.push_back(it.second);
+  }
+  for (auto &c : all)
+    c->write(s);
+}
+
+void socketReader(std::shared_ptr<SocketClient> c) {
+  set_thread_name("client");
+  setThreadArena(Arena::IO);
+  FILE *in = fdopen(dup(c->fd), "rb");
+  MessagePtr message;
+  size_t len;
+  while (in && readMessage(in, message, len)) {
+    DocumentPtr document = allocDocument();
+    document->ParseInsitu(message.get());
+    if (document->HasParseError() || !document->IsObject())
+      break;
+    JsonReader reader{document.get()};
+    RequestId id;
+    std::string method;
+    reflectMember(reader, "id", id);
+    reflectMember(reader, "method", method);
+    if (method.empty())
+      continue;
+    RequestId orig = id;
+    tagId(c->id, id);
+    if (method == "initialize") {
+      std::unique_lock lock(init_mtx);
+      if (initialize_forwarded) {
+        init_cv.wait(lock, [] {
+          return initialize_result || g_quit.load(std::memory_order_relaxed);
+        });
+        if (initialize_result)
+          c->write(makeReply(orig, *initialize_result));
+        continue;
+      }
+      initialize_forwarded = true;
+      initialize_key = escapeJson(id.value);
+      c->initializer = true;
+    } else if (method == "initialized") {
+      if (!c->initializer)
+        continue;
+    } else if (method == "shutdown") {
+      // The server outlives its clients.
+      c->write(makeReply(orig, "null"));
+      continue;
+    } else if (method == "exit") {
+      break;
+    } else if (method == "$/cancelRequest") {
+      RequestId cancelled;
+      reader.member("params",
+                    [&]() { reflectMember(reader, "id", cancelled); });
+      tagId(c->id, cancelled);
+      cancel(cancelled);
+      continue;
+    } else if (method == "textDocument/didOpen" ||
+               method == "textDocument/didClose") {
+      std::string uri;
+      reader.member("params", [&]() {
+        reader.member("textDocument",
+                      [&]() { reflectMember(reader, "uri", uri); });
+      });
+      std::lock_guard lock(clients_mtx);
+      if (method == "textDocument/didOpen") {
+        if (c->opened.insert(uri).second)
+          open_count[uri]++;
+      } else if (!c->opened.erase(uri) || --open_count[uri]) {
+        // Not opened by this client, or still open in another.
+        continue;
+      } else {
+        open_count.erase(uri);
+      }
+    }
+    pushMessage(id, std::move(method), std::move(message),
+                std::move(document));
+  }
+  if (in)
+    fclose(in);
+
+  std::vector<std::string> to_close;
+  {
+    std::lock_guard lock(clients_mtx);
+    clients.erase(c->id);
+    for (auto &uri : c->opened)
+      if (!--open_count[uri]) {
+        open_count.erase(uri);
+        to_close.push_back(uri);
+      }
+  }
+  for (auto &uri : to_close) {
+    rapidjson::StringBuffer output;
+    rapidjson::Writer<rapidjson::StringBuffer> w(output);
+    w.StartObject();
+    w.Key("jsonrpc");
+    w.String("2.0");
+    w.Key("method");
+    w.String("textDocument/didClose");
+    w.Key("params");
+    w.StartObject();
+    w.Key("textDocument");
+    w.StartObject();
+    w.Key("uri");
+    w.String(uri.c_str(), uri.size());
+    w.EndObject();
+    w.EndObject();
+    w.EndObject();
+    pushNotification(std::string_view(output.GetString(), output.GetSize()));
+  }
+  {
+    std::lock_guard lock(c->write_mtx);
+    close(c->fd);
+    c->fd = -1;
+  }
+  LOG_S(INFO) << "client " << c->id << " disconnected";
+}
+} // namespace
+
+bool launchSocket(const std::string &path) {
+  int fd = listenUnixSocket(path);
+  if (fd < 0)
+    return false;
+  socket_mode = true;
+  // The threads below are not counted by threadEnter as they block in accept
+  // and read, and the server is stopped by a signal rather than by "exit".
+  std::thread([fd]() {
+    set_thread_name("accept");
+    for (int next_id = 0;; next_id++) {
+      int conn = acceptConnection(fd);
+      if (conn < 0) {
+        LOG_S(ERROR) << "failed to accept: " << strerror(errno);
+        break;
+      }
+      auto c = std::make_shared<SocketClient>();
+      c->id = next_id;
+      c->fd = conn;
+      {
+        std::lock_guard lock(clients_mtx);
+        clients[c->id] = c;
+      }
+      LOG_S(INFO) << "client " << c->id << " connected";
+      std::thread(socketReader, std::move(c)).detach();
+    }
+  }).detach();
+  return true;
+}
+
+int relay(const std::string &path) {
+  int fd = connectUnixSocket(path);
+  if (fd < 0) {
+    fprintf(stderr, "failed to connect to %s: %s\n", path.c_str(),
+            strerror(errno));
+    return 1;
+  }
+  std::thread([fd]() {
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof buf)) > 0)
+      if (!writeAll(STDOUT_FILENO, buf, n))
+        break;
+    // The server has gone away.
+    _exit(0);
+  }).detach();
+  char buf[65536];
+  ssize_t n;
+  while ((n = read(STDIN_FILENO, buf, sizeof buf)) > 0)
+    if (!writeAll(fd, buf, n))
+      break;
+  return 0;
+}
+#else
+bool launchSocket(const std::string &) { return false; }
+int relay(const std::string &) { return 1; }
+#endif
+
 void launchStdout() {
   threadEnter();
   std::thread([]() {
     set_thread_name("stdout");
+    setThreadArena(Arena::IO);
 
     while (true) {
       std::vector<std::string> messages = for_stdout->dequeueAll();
-      for (auto &s : messages) {
-        llvm::outs() << "Content-Length: " << s.size() << "\r\n\r\n" << s;
+      // Drop notifications superseded by a later one in the same batch.
+      std::unordered_set<std::string_view> seen;
+      for (auto it = messages.rbegin(); it != messages.rend(); ++it) {
+        std::string_view key = supersedeKey(*it);
+        if (key.size() && !seen.insert(key).second)
+          it->clear();
+      }
+      // Write the whole batch with one flush.
+      if (replay::replaying) {
+        for (auto &s : messages)
+          if (s.size())
+            replay::onOutput(s);
+#ifndef _WIN32
+      } else if (socket_mode) {
+        for (auto &s : messages)
+          if (s.size())
+            routeMessage(s);
+#endif
+      } else {
+        for (auto &s : messages)
+          if (s.size())
+            llvm::outs() << "Content-Length: " << s.size() << "\r\n\r\n"
+                         << s;
         llvm::outs().flush();
       }
       if (stdout_waiter->wait(g_quit, for_stdout))
@@ -617,7 +2251,42 @@ void launchStdout() {
   }).detach();
 }
 
+namespace {
+// With --serve-snapshot, lifecycle messages and the document synchronization
+// needed to map positions of open files are handled besides read-only
+// requests.
+bool servesSnapshot(std::string_view method) {
+  static const char *const methods[] = {
+      "exit",
+      "initialize",
+      "initialized",
+      "shutdown",
+      "textDocument/didChange",
+      "textDocument/didClose",
+      "textDocument/didOpen",
+  };
+  for (const char *m : methods)
+    if (method == m)
+      return true;
+  return isReadOnly(method);
+}
+
+// Removes |path|, or every path if it is empty, from deferred_loading. Returns
+// true if that has emptied it.
+bool finishDeferred(const std::string &path) {
+  std::lock_guard lock(deferred_mtx);
+  if (deferred_loading.empty())
+    return false;
+  if (path.empty())
+    deferred_loading.clear();
+  else
+    deferred_loading.erase(path);
+  return deferred_loading.empty();
+}
+} // namespace
+
 void mainLoop() {
+  setThreadArena(Arena::DB);
   Project project;
   WorkingFiles wfiles;
   VFS vfs;
@@ -633,8 +2302,13 @@ void mainLoop() {
       [](const RequestId &id) {
         if (id.valid()) {
           ResponseError err;
-          err.code = ErrorCode::InternalError;
-          err.message = "drop older completion request";
+          if (isCancelled(id)) {
+            err.code = ErrorCode::RequestCancelled;
+            err.message = "cancelled completion request";
+          } else {
+            err.code = ErrorCode::InternalError;
+            err.message = "drop older completion request";
+          }
           replyError(id, err);
         }
       });
@@ -652,11 +2326,44 @@ void mainLoop() {
   handler.include_complete = &include_complete;
 
   bool work_done_created = false, in_progress = false;
-  bool has_indexed = false;
+  bool has_indexed = false, snapshot_dirty = false;
   int64_t last_completed = 0;
+  auto last_snapshot = chrono::steady_clock::now() - chrono::minutes(10);
+  auto last_gc = chrono::steady_clock::now() - chrono::hours(24);
   std::deque<InMessage> backlog;
   StringMap<std::deque<InMessage *>> path2backlog;
+  auto toBacklog = [&](InMessage &message, std::string path) {
+    backlog.push_back(std::move(message));
+    backlog.back().backlog_path = path;
+    auto &waiting = path2backlog[path];
+    if (waiting.empty())
+      boostIndex(path);
+    waiting.push_back(&backlog.back());
+  };
+  // Runs the requests waiting for |path|. If |overdue|, the path will not be
+  // indexed soon and they reply an error instead of waiting again.
+  auto runWaiting = [&](const std::string &path, bool overdue) {
+    auto it = path2backlog.find(path);
+    if (it == path2backlog.end())
+      return;
+    std::deque<InMessage *> waiting = std::move(it->second);
+    path2backlog.erase(it);
+    handler.overdue = overdue;
+    for (InMessage *message : waiting) {
+      // A request released by the deferred caches may still wait for its file.
+      try {
+        handler.run(*message);
+      } catch (NotIndexed &ex) {
+        toBacklog(*message, ex.path);
+      }
+      message->backlog_path.clear();
+    }
+    handler.overdue = false;
+  };
   while (true) {
+    std::unique_lock turnstile(db_turnstile);
+    std::unique_lock lock(db_mutex);
+    turnstile.unlock();
     if (backlog.size()) {
       auto now = chrono::steady_clock::now();
       handler.overdue = true;
@@ -672,36 +2379,130 @@ void mainLoop() {
       handler.overdue = false;
     }
 
+    for (std::string &path : index_failed->dequeueAll()) {
+      runWaiting(path, true);
+      if (finishDeferred(path))
+        runWaiting(NotIndexed::kDeferred, false);
+    }
+    // A deferred cache whose update has not come, e.g. one of a file removed
+    // from the project, must not hold requests once indexing is idle.
+    if (path2backlog.count(NotIndexed::kDeferred) &&
+        stats.completed.load(std::memory_order_relaxed) ==
+            stats.enqueued.load(std::memory_order_relaxed) &&
+        on_indexed->isEmpty() && finishDeferred({}))
+      runWaiting(NotIndexed::kDeferred, false);
+
     std::vector<InMessage> messages = on_request->dequeueAll();
     bool did_work = messages.size();
-    for (InMessage &message : messages)
+    bool request_threads = g_config && g_config->request.threads > 0;
+    if (g_config && g_config->request.prioritize && messages.size() > 1)
+      prioritize(messages);
+    for (InMessage &message : messages) {
+      if (serve_snapshot.size() && !servesSnapshot(message.method)) {
+        if (message.id.valid()) {
+          ResponseError err;
+          err.code = ErrorCode::MethodNotFound;
+          err.message = message.method + " is not supported by --serve-snapshot";
+          replyError(message.id, err);
+        }
+        continue;
+      }
+      // A request thread got NotIndexed. Retry if the file (or the deferred
+      // caches) has been indexed since then.
+      if (message.backlog_path.size()) {
+        if (message.backlog_path == NotIndexed::kDeferred
+                ? loadDeferred()
+                : !handler.findFile(message.backlog_path)) {
+          toBacklog(message, message.backlog_path);
+          continue;
+        }
+        message.backlog_path.clear();
+      }
+      if (request_threads && isReadOnly(message.method)) {
+        {
+          std::lock_guard lock1(in_flight_mutex);
+          requests_in_flight++;
+        }
+        for_request_threads->pushBack(std::move(message));
+        continue;
+      }
+      // Requests handed off earlier run once the exclusive lock is released.
+      // Let them finish before a notification changes what they refer to.
+      if (!message.id.valid()) {
+        std::unique_lock lock1(in_flight_mutex);
+        if (requests_in_flight) {
+          lock.unlock();
+          while (requests_in_flight && !g_quit.load(std::memory_order_relaxed))
+            in_flight_cv.wait_for(lock1, chrono::milliseconds(100));
+          lock1.unlock();
+          std::lock_guard turnstile(db_turnstile);
+          lock.lock();
+        }
+      }
       try {
         handler.run(message);
       } catch (NotIndexed &ex) {
-        backlog.push_back(std::move(message));
-        backlog.back().backlog_path = ex.path;
-        path2backlog[ex.path].push_back(&backlog.back());
+        toBacklog(message, ex.path);
       }
+    }
 
     bool indexed = false;
-    for (int i = 20; i--;) {
-      std::optional<IndexUpdate> update = on_indexed->tryPopFront();
-      if (!update)
-        break;
-      did_work = true;
-      indexed = true;
-      main_OnIndexed(&db, &wfiles, &*update);
-      if (update->files_def_update) {
-        auto it = path2backlog.find(update->files_def_update->first.path);
-        if (it != path2backlog.end()) {
-          for (auto &message : it->second) {
-            handler.run(*message);
-            message->backlog_path.clear();
-          }
-          path2backlog.erase(it);
+    auto runBacklog = [&](IndexUpdate &update) {
+      if (update.files_def_update) {
+        runWaiting(update.files_def_update->first.path, false);
+        if (finishDeferred(update.files_def_update->first.path))
+          runWaiting(NotIndexed::kDeferred, false);
+      } else if (update.files_removed) {
+        runWaiting(*update.files_removed, true);
+      }
+    };
+    int update_threads = g_config ? g_config->index.updateThreads : 0;
+    if (update_threads > 1) {
+      // Merge a larger batch and apply it in parallel. A refresh request ends
+      // the batch as it must observe all preceding updates.
+      std::vector<IndexUpdate> updates;
+      for (int i = 20 * update_threads; i--;) {
+        std::optional<IndexUpdate> update = on_indexed->tryPopFront();
+        if (!update)
+          break;
+        updates.push_back(std::move(*update));
+        if (updates.back().refresh)
+          break;
+      }
+      coalesceUpdates(updates);
+      if (updates.size()) {
+        did_work = true;
+        indexed = true;
+        std::vector<IndexUpdate *> to_apply;
+        for (IndexUpdate &update : updates)
+          if (!update.refresh)
+            to_apply.push_back(&update);
+        db.applyIndexUpdates(to_apply, update_threads);
+        for (IndexUpdate &update : updates) {
+          if (update.refresh)
+            main_OnIndexed(&db, &wfiles, &update);
+          else
+            main_OnApplied(&db, &wfiles, &update);
+          runBacklog(update);
         }
       }
+    } else {
+      std::vector<IndexUpdate> updates;
+      for (int i = 20; i--;) {
+        std::optional<IndexUpdate> update = on_indexed->tryPopFront();
+        if (!update)
+          break;
+        updates.push_back(std::move(*update));
+      }
+      coalesceUpdates(updates);
+      for (IndexUpdate &update : updates) {
+        did_work = true;
+        indexed = true;
+        main_OnIndexed(&db, &wfiles, &update);
+        runBacklog(update);
+      }
     }
+    lock.unlock();
 
     int64_t completed = stats.completed.load(std::memory_order_relaxed);
     if (completed != last_completed) {
@@ -743,23 +2544,239 @@ void mainLoop() {
 
     if (did_work) {
       has_indexed |= indexed;
+      snapshot_dirty |= indexed;
       if (g_quit.load(std::memory_order_relaxed))
         break;
     } else {
       if (has_indexed) {
+        // Compact one kind per pass so that requests are served in between.
+        // Request threads may be reading DB, so lock it exclusively again.
+        {
+          std::lock_guard turnstile(db_turnstile);
+          lock.lock();
+        }
+        bool compacted = db.compact(g_config->index.compactPercent);
+        lock.unlock();
+        if (compacted)
+          continue;
         freeUnusedMemory();
         has_indexed = false;
       }
+      // Save the first time indexing settles, then at most every 10 minutes.
+      auto now = chrono::steady_clock::now();
+      if (snapshot_dirty && now - last_snapshot >= chrono::minutes(10) &&
+          stats.completed.load(std::memory_order_relaxed) ==
+              stats.enqueued.load(std::memory_order_relaxed) &&
+          on_indexed->isEmpty() && saveSnapshot(db)) {
+        snapshot_dirty = false;
+        last_snapshot = now;
+      }
+      if (g_config && g_config->cache.gcDays > 0 &&
+          now - last_gc >= chrono::hours(24) &&
+          stats.completed.load(std::memory_order_relaxed) ==
+              stats.enqueued.load(std::memory_order_relaxed) &&
+          on_indexed->isEmpty()) {
+        last_gc = now;
+        collectCacheGarbage(db);
+      }
       if (backlog.empty())
-        main_waiter->wait(g_quit, on_indexed, on_request);
+        main_waiter->wait(g_quit, on_indexed, on_request, index_failed);
       else
-        main_waiter->waitUntil(backlog[0].deadline, on_indexed, on_request);
+        main_waiter->waitUntil(backlog[0].deadline, on_indexed, on_request,
+                               index_failed);
     }
   }
 
   quit(manager);
+  if (useSnapshot()) {
+    // Indexers have stopped and the cache writer has drained its queue.
+    for (IndexUpdate &update : on_indexed->dequeueAll())
+      if (!update.refresh) {
+        db.applyIndexUpdate(&update);
+        snapshot_dirty = true;
+      }
+    if (snapshot_dirty || !snapshot_valid)
+      saveSnapshot(db);
+  }
 }
 
+namespace {
+// Waits until all enqueued index requests are completed. Updates are applied
+// to |db| if it is non-null and dropped otherwise. Returns the time spent
+// applying updates in microseconds.
+int64_t waitIndexed(DB *db, bool tty) {
+  int64_t apply_us = 0;
+  while (1) {
+    std::vector<IndexUpdate> updates = on_indexed->dequeueAll();
+    if (db) {
+      auto start = chrono::steady_clock::now();
+      for (IndexUpdate &update : updates)
+        if (!update.refresh)
+          db->applyIndexUpdate(&update);
+      apply_us += chrono::duration_cast<chrono::microseconds>(
+                      chrono::steady_clock::now() - start)
+                      .count();
+    }
+    int64_t enqueued = stats.enqueued, completed = stats.completed;
+    if (tty) {
+      printf("\rcompleted: %4" PRId64 "/%" PRId64, completed, enqueued);
+      fflush(stdout);
+    }
+    // Updates pushed before the last requests completed are still queued.
+    if (completed == enqueued) {
+      if (!db || !on_indexed->size())
+        break;
+      continue;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  if (tty)
+    puts("");
+  return apply_us;
+}
+
+struct BenchPhases {
+  // Summed over indexer threads, in seconds.
+  double parse = 0, cache_load = 0, serialize = 0;
+  // On the main thread, in seconds.
+  double apply = 0;
+};
+REFLECT_STRUCT(BenchPhases, parse, cache_load, serialize, apply);
+
+struct BenchResult {
+  std::string root;
+  std::string cache;
+  int threads = 0;
+  SerializeFormat format = SerializeFormat::Binary;
+  int64_t files = 0;
+  double wall = 0, user = 0, sys = 0;
+  int64_t peak_rss = 0;
+  double files_per_second = 0;
+  int64_t indexed = 0, indexed_bytes = 0, cache_hits = 0, cache_misses = 0;
+  BenchPhases phases;
+};
+REFLECT_STRUCT(BenchResult, root, cache, threads, format, files, wall, user,
+               sys, peak_rss, files_per_second, indexed, indexed_bytes,
+               cache_hits, cache_misses, phases);
+
+// Latencies of one phase of --bench-sema, in milliseconds.
+struct SemaLatency {
+  int64_t count = 0;
+  double p50 = 0, p99 = 0, max = 0;
+};
+REFLECT_STRUCT(SemaLatency, count, p50, p99, max);
+
+struct SemaBenchResult {
+  std::string root;
+  bool share_preambles = false;
+  int64_t files = 0, edits = 0, completions = 0;
+  // Diagnostics or completions not done within kSemaBenchTimeout.
+  int64_t timeouts = 0;
+  // Time spent in buildPreamble, and from an edit or a completion request to
+  // its result.
+  SemaLatency preamble_build, preamble_reuse, diagnostics, completion;
+};
+REFLECT_STRUCT(SemaBenchResult, root, share_preambles, files, edits,
+               completions, timeouts, preamble_build, preamble_reuse,
+               diagnostics, completion);
+
+constexpr chrono::seconds kSemaBenchTimeout(60);
+
+SemaLatency summarize(std::vector<double> &ms) {
+  SemaLatency ret;
+  ret.count = ms.size();
+  if (ms.empty())
+    return ret;
+  std::sort(ms.begin(), ms.end());
+  auto at = [&](double q) {
+    return ms[std::min(ms.size() - 1, size_t(q * ms.size()))];
+  };
+  ret.p50 = at(0.5);
+  ret.p99 = at(0.99);
+  ret.max = ms.back();
+  return ret;
+}
+
+// Only counts the results; --bench-sema measures the time to get them.
+class CountingConsumer : public clang::CodeCompleteConsumer {
+  std::shared_ptr<clang::GlobalCodeCompletionAllocator> alloc;
+  clang::CodeCompletionTUInfo cctu_info;
+
+public:
+  CountingConsumer(const clang::CodeCompleteOptions &opts)
+      :
+#if LLVM_VERSION_MAJOR >= 9 // rC358696
+        clang::CodeCompleteConsumer(opts),
+#else
+        clang::CodeCompleteConsumer(opts, false),
+#endif
+        alloc(std::make_shared<clang::GlobalCodeCompletionAllocator>()),
+        cctu_info(alloc) {
+  }
+  void ProcessCodeCompleteResults(clang::Sema &, clang::CodeCompletionContext,
+                                  clang::CodeCompletionResult *,
+                                  unsigned) override {}
+  clang::CodeCompletionAllocator &getAllocator() override { return *alloc; }
+  clang::CodeCompletionTUInfo &getCodeCompletionTUInfo() override {
+    return cctu_info;
+  }
+};
+
+// Offsets after the last preprocessor directive of |text| where an edit goes
+// into a function body (the line after one ending with ") {") and where
+// completion follows a member access ("a." or "p->").
+void editPoints(const std::string &text, std::vector<size_t> &bodies,
+                std::vector<size_t> &members) {
+  bodies.clear();
+  members.clear();
+  size_t start = 0;
+  for (size_t pos = 0; pos < text.size();) {
+    size_t eol = std::min(text.find('\n', pos), text.size());
+    size_t i = text.find_first_not_of(" \t", pos);
+    if (i < eol && text[i] == '#')
+      start = eol;
+    pos = eol + 1;
+  }
+  for (size_t pos = start; pos < text.size();) {
+    size_t eol = std::min(text.find('\n', pos), text.size());
+    StringRef line = StringRef(text).slice(pos, eol).rtrim();
+    if (line.endswith("{") && line.find(')') != StringRef::npos &&
+        eol < text.size())
+      bodies.push_back(eol + 1);
+    pos = eol + 1;
+  }
+  auto ident = [](char c) { return isalnum(uint8_t(c)) || c == '_'; };
+  for (size_t j = start + 1; j + 1 < text.size(); j++) {
+    size_t op = j;
+    if (text[j] == '>' && text[j - 1] == '-')
+      op = j - 1;
+    else if (text[j] != '.')
+      continue;
+    char next = text[j + 1];
+    if (!(isalpha(uint8_t(next)) || next == '_') || op == 0)
+      continue;
+    char prev = text[op - 1];
+    if (prev == ')' || prev == ']') {
+      members.push_back(j + 1);
+      continue;
+    }
+    // Skip numbers such as 1.f.
+    size_t b = op;
+    while (b > 0 && ident(text[b - 1]))
+      b--;
+    if (b < op && !isdigit(uint8_t(text[b])))
+      members.push_back(j + 1);
+  }
+}
+
+Position positionOf(const std::string &text, size_t offset) {
+  size_t bol = text.rfind('\n', offset ? offset - 1 : 0);
+  bol = bol == std::string::npos || !offset ? 0 : bol + 1;
+  return {int(std::count(text.begin(), text.begin() + bol, '\n')),
+          int(offset - bol)};
+}
+} // namespace
+
 void standalone(const std::string &root) {
   Project project;
   WorkingFiles wfiles;
@@ -786,30 +2803,375 @@ void standalone(const std::string &root) {
       entries += folder.entries.size();
     printf("entries:   %4d\n", entries);
   }
-  while (1) {
-    (void)on_indexed->dequeueAll();
-    int64_t enqueued = stats.enqueued, completed = stats.completed;
-    if (tty) {
-      printf("\rcompleted: %4" PRId64 "/%" PRId64, completed, enqueued);
-      fflush(stdout);
+  waitIndexed(nullptr, tty);
+  quit(manager);
+}
+
+void indexOnly(const std::string &root) {
+  index_only = true;
+  auto start = chrono::steady_clock::now();
+  standalone(root);
+  double wall = chrono::duration<double>(chrono::steady_clock::now() - start)
+                    .count();
+  int64_t indexed = stats.indexed, hits = stats.cache_hits;
+  printf("indexed:   %" PRId64 " files in %.1fs (%.1f files/s), %.1f MiB\n",
+         indexed, wall, wall > 0 ? indexed / wall : 0.,
+         stats.indexed_bytes / 1048576.);
+  printf("cache hit: %" PRId64 " files\n", hits);
+  printf("cache:     %s\n", g_config->cache.directory.c_str());
+  fflush(stdout);
+}
+
+void benchIndex(const std::string &root, const std::string &cache, bool warm) {
+  Project project;
+  WorkingFiles wfiles;
+  VFS vfs;
+  DB db;
+  SemaManager manager(
+      nullptr, nullptr,
+      [](const std::string &, const std::vector<Diagnostic> &) {},
+      [](const RequestId &id) {});
+  IncludeComplete complete(&project);
+
+  MessageHandler handler;
+  handler.db = &db;
+  handler.project = &project;
+  handler.wfiles = &wfiles;
+  handler.vfs = &vfs;
+  handler.manager = &manager;
+  handler.include_complete = &complete;
+
+  struct Counters {
+    int64_t indexed, indexed_bytes, index_us, cache_hits, cache_misses,
+        cache_load_us, serialize_us;
+  } base;
+  chrono::steady_clock::time_point start;
+  chrono::nanoseconds user0, sys0;
+  auto begin = [&] {
+    base = {stats.indexed,    stats.indexed_bytes, stats.index_us,
+            stats.cache_hits, stats.cache_misses,  stats.cache_load_us,
+            stats.serialize_us};
+    sys::TimePoint<> now;
+    sys::Process::GetTimeUsage(now, user0, sys0);
+    start = chrono::steady_clock::now();
+  };
+  begin();
+  standaloneInitialize(handler, root);
+  int64_t apply_us = waitIndexed(&db, false);
+  if (warm) {
+    // Updates loaded from the cache are applied to an empty DB, as on a
+    // restart.
+    flushCacheWrites();
+    vfs.clear();
+    db.clear();
+    begin();
+    project.index(&wfiles, RequestId());
+    apply_us = waitIndexed(&db, false);
+  }
+  flushCacheWrites();
+  double wall = chrono::duration<double>(chrono::steady_clock::now() - start)
+                    .count();
+  sys::TimePoint<> now;
+  chrono::nanoseconds user1, sys1;
+  sys::Process::GetTimeUsage(now, user1, sys1);
+
+  BenchResult result;
+  result.root = root;
+  result.cache = cache;
+  result.threads = g_config->index.threads;
+  result.format = g_config->cache.format;
+  for (auto &[_, folder] : project.root2folder)
+    result.files += folder.entries.size();
+  result.wall = wall;
+  result.user = chrono::duration<double>(user1 - user0).count();
+  result.sys = chrono::duration<double>(sys1 - sys0).count();
+  result.peak_rss = getPeakMemory();
+  result.files_per_second = wall > 0 ? result.files / wall : 0;
+  result.indexed = stats.indexed - base.indexed;
+  result.indexed_bytes = stats.indexed_bytes - base.indexed_bytes;
+  result.cache_hits = stats.cache_hits - base.cache_hits;
+  result.cache_misses = stats.cache_misses - base.cache_misses;
+  result.phases.parse = (stats.index_us - base.index_us) / 1e6;
+  result.phases.cache_load = (stats.cache_load_us - base.cache_load_us) / 1e6;
+  result.phases.serialize = (stats.serialize_us - base.serialize_us) / 1e6;
+  result.phases.apply = apply_us / 1e6;
+  quit(manager);
+
+  rapidjson::StringBuffer output;
+  rapidjson::Writer<rapidjson::StringBuffer> w(output);
+  JsonWriter writer(&w);
+  reflect(writer, result);
+  puts(output.GetString());
+  fflush(stdout);
+}
+
+void benchSema(const std::string &root, int num_files, int num_edits) {
+  Project project;
+  WorkingFiles wfiles;
+  VFS vfs;
+  DB db;
+  SemaManager manager(
+      &project, &wfiles,
+      [](const std::string &, const std::vector<Diagnostic> &) {},
+      [](const RequestId &id) {});
+  IncludeComplete complete(&project);
+
+  MessageHandler handler;
+  handler.db = &db;
+  handler.project = &project;
+  handler.wfiles = &wfiles;
+  handler.vfs = &vfs;
+  handler.manager = &manager;
+  handler.include_complete = &complete;
+
+  // Occurrences of each phase so far, and the samples timed by SemaManager.
+  std::mutex mtx;
+  std::condition_variable cv;
+  StringMap<int64_t> events;
+  std::vector<double> build_ms, reuse_ms, diag_ms, comp_ms;
+  manager.on_timing = [&](const char *phase, const std::string &,
+                          int64_t us) {
+    std::lock_guard lock(mtx);
+    events[phase]++;
+    if (StringRef(phase).startswith("preamble."))
+      events["preamble"]++;
+    if (!strcmp(phase, "preamble.build"))
+      build_ms.push_back(us / 1e3);
+    else if (!strcmp(phase, "preamble.reuse"))
+      reuse_ms.push_back(us / 1e3);
+    cv.notify_all();
+  };
+  SemaBenchResult result;
+  auto count = [&](const char *phase) {
+    std::lock_guard lock(mtx);
+    return events[phase];
+  };
+  // Waits until |phase| has occurred |n| times and returns the milliseconds
+  // since |start|, or -1 on timeout.
+  auto waitFor = [&](const char *phase, int64_t n,
+                     chrono::steady_clock::time_point start) {
+    std::unique_lock lock(mtx);
+    if (!cv.wait_for(lock, kSemaBenchTimeout,
+                     [&] { return events[phase] >= n; })) {
+      result.timeouts++;
+      return -1.0;
     }
-    if (completed == enqueued)
-      break;
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    return chrono::duration<double, std::milli>(chrono::steady_clock::now() -
+                                                start)
+        .count();
+  };
+
+  standaloneInitialize(handler, root);
+  waitIndexed(nullptr, false);
+  std::vector<std::string> paths;
+  for (auto &[_, folder] : project.root2folder)
+    for (auto &entry : folder.entries)
+      paths.push_back(entry.filename);
+  std::sort(paths.begin(), paths.end());
+  // Files spread over the project, and edits at pseudo-random but
+  // reproducible places.
+  size_t stride = std::max(paths.size() / std::max(num_files, 1), size_t(1));
+  std::mt19937 rng(0);
+  std::vector<size_t> bodies, members;
+  for (size_t i = 0; i < paths.size() && result.files < num_files;
+       i += stride) {
+    const std::string &path = paths[i];
+    std::optional<std::string> content = readContent(path);
+    if (!content)
+      continue;
+    result.files++;
+    TextDocumentItem item{DocumentUri::fromPath(path), "cpp", 0, *content};
+    wfiles.onOpen(item);
+    int64_t n = count("diagnostics");
+    manager.onView(path);
+    waitFor("diagnostics", n + 1, chrono::steady_clock::now());
+
+    std::string text = *content;
+    for (int e = 0; e < num_edits; e++) {
+      editPoints(text, bodies, members);
+      if (bodies.empty())
+        break;
+      text.insert(bodies[rng() % bodies.size()],
+                  "  int ccls_bench_edit" + std::to_string(e) + " = 0;\n");
+      TextDocumentDidChangeParam change;
+      change.textDocument.uri = item.uri;
+      change.textDocument.version = e + 1;
+      change.contentChanges.push_back({std::nullopt, std::nullopt, text});
+      wfiles.onChange(change);
+      result.edits++;
+      n = count("diagnostics");
+      auto start = chrono::steady_clock::now();
+      manager.scheduleDiag(path, 0);
+      if (double ms = waitFor("diagnostics", n + 1, start); ms >= 0)
+        diag_ms.push_back(ms);
+
+      editPoints(text, bodies, members);
+      if (members.size()) {
+        Position pos = positionOf(text, members[rng() % members.size()]);
+        clang::CodeCompleteOptions opts;
+        n = count("completion");
+        start = chrono::steady_clock::now();
+        manager.comp_tasks.pushBack(std::make_unique<SemaManager::CompTask>(
+            RequestId(), path, pos, std::make_unique<CountingConsumer>(opts),
+            opts, [&](clang::CodeCompleteConsumer *) {
+              std::lock_guard lock(mtx);
+              events["completion"]++;
+              cv.notify_all();
+            }));
+        result.completions++;
+        if (double ms = waitFor("completion", n + 1, start); ms >= 0)
+          comp_ms.push_back(ms);
+      }
+
+      // As on didSave, check whether the preamble is still valid.
+      n = count("preamble");
+      manager.onSave(path);
+      waitFor("preamble", n + 1, chrono::steady_clock::now());
+    }
+    wfiles.onClose(path);
+    manager.onClose(path);
   }
-  if (tty)
-    puts("");
   quit(manager);
+
+  result.root = root;
+  result.share_preambles = g_config->session.sharePreambles;
+  result.preamble_build = summarize(build_ms);
+  result.preamble_reuse = summarize(reuse_ms);
+  result.diagnostics = summarize(diag_ms);
+  result.completion = summarize(comp_ms);
+  rapidjson::StringBuffer output;
+  rapidjson::Writer<rapidjson::StringBuffer> w(output);
+  JsonWriter writer(&w);
+  reflect(writer, result);
+  puts(output.GetString());
+  fflush(stdout);
+}
+
+bool loadDeferred() {
+  std::vector<IndexRequest> requests;
+  {
+    std::lock_guard lock(deferred_mtx);
+    if (deferred_loaded)
+      return deferred_loading.size();
+    deferred_loaded = true;
+    requests.swap(deferred);
+    for (std::string &path : deferred_tus)
+      deferred_loading.insert(path);
+    deferred_tus.clear();
+    deferred_tables.clear();
+  }
+  if (requests.size())
+    LOG_S(INFO) << "load " << requests.size() << " deferred caches";
+  for (IndexRequest &request : requests)
+    index(request.path, request.args, IndexMode::Background,
+          request.must_exist);
+  return requests.size();
+}
+
+std::optional<std::vector<std::pair<std::string, std::shared_ptr<SymbolTable>>>>
+deferredSymbolTables() {
+  if (!g_config->cache.symbolTable || g_config->cache.directory.empty() ||
+      getCachePack())
+    return std::nullopt;
+  std::lock_guard lock(deferred_mtx);
+  auto open = [](const std::string &path) {
+    auto [it, inserted] = deferred_tables.try_emplace(path);
+    if (inserted)
+      it->second = SymbolTable::open(getCachePath(path) + ".sym");
+    return it->second.get();
+  };
+  for (; deferred_scanned < deferred_tus.size(); deferred_scanned++) {
+    SymbolTable *table = open(deferred_tus[deferred_scanned]);
+    if (!table)
+      return std::nullopt;
+    // A header without a table, e.g. one not indexed, has no symbols.
+    for (std::string_view dep : table->dependencies())
+      open(std::string(dep));
+  }
+  std::vector<std::pair<std::string, std::shared_ptr<SymbolTable>>> ret;
+  for (auto &it : deferred_tables)
+    if (it.second)
+      ret.emplace_back(it.first().str(), it.second);
+  return ret;
 }
 
 void index(const std::string &path, const std::vector<const char *> &args,
            IndexMode mode, bool must_exist, RequestId id) {
-  if (!path.empty())
+  int prio = indexPriority(mode);
+  if (path.empty()) {
+    index_request->pushBack({path, args, mode, must_exist, std::move(id)},
+                            prio);
+    return;
+  }
+
+  // Coalesce with a pending request of the same path, keeping the latest args
+  // and the mode with the highest priority. If the priority is raised, queue a
+  // new copy in the higher class; the old copy becomes stale. The requests of
+  // Project::index carry an id too, so that boostIndex can move them.
+  std::lock_guard lock(pending_index_mtx);
+  auto [it, inserted] = pending_index.try_emplace(path);
+  PendingIndex &pending = it->second;
+  if (!id.valid())
+    id = std::move(pending.request.id);
+  if (inserted) {
     stats.enqueued++;
-  index_request->pushBack({path, args, mode, must_exist, std::move(id)},
-                          mode != IndexMode::Background);
+  } else {
+    int prio0 = indexPriority(pending.request.mode);
+    if (prio > prio0) {
+      pending.request.args = args;
+      pending.request.id = std::move(id);
+      return;
+    }
+    if (prio == prio0) {
+      pending.request = {path, args, mode, must_exist, std::move(id)};
+      return;
+    }
+  }
+  pending.request = {path, args, mode, must_exist, std::move(id)};
+  pending.queued_ts = pending.request.ts;
+  index_request->pushBack({path, {}, mode, must_exist, RequestId(),
+                           pending.queued_ts},
+                          prio);
 }
 
+void boostIndex(const std::string &path) {
+  // Queue a new copy in the Normal/Delete class, like raising the priority in
+  // index(), but keep the mode so that the result is the same.
+  std::lock_guard lock(pending_index_mtx);
+  auto it = pending_index.find(path);
+  if (it == pending_index.end() ||
+      indexPriority(it->second.request.mode) <= 1)
+    return;
+  PendingIndex &pending = it->second;
+  pending.queued_ts = tick++;
+  index_request->pushBack({path, {}, pending.request.mode,
+                           pending.request.must_exist, RequestId(),
+                           pending.queued_ts},
+                          1);
+}
+
+void boostOpened(Project *project, const std::string &path) {
+  if (stats.completed >= stats.enqueued)
+    return;
+  // The translation unit of |path|, that which indexed it last time, and
+  // related files. Loading the cache of a translation unit loads those of its
+  // headers.
+  std::vector<std::string> paths{path};
+  paths.push_back(project->findEntry(path, false, false).filename);
+  if (lookupExtension(path).second && g_config->cache.directory.size()) {
+    std::lock_guard lock(getFileMutex(path));
+    if (std::unique_ptr<IndexFile> file = loadCache(path))
+      paths.push_back(std::move(file->import_file));
+  }
+  for (std::string &related : project->relatedEntries(path))
+    paths.push_back(std::move(related));
+  for (auto &path1 : paths)
+    if (path1.size())
+      boostIndex(path1);
+}
+
+void noteEdit() { last_edit = steadyMs(); }
+
 void removeCache(const std::string &path) {
   if (g_config->cache.directory.size()) {
     std::lock_guard lock(g_index_mutex);
@@ -817,24 +3179,100 @@ void removeCache(const std::string &path) {
   }
 }
 
+void indexCosts(std::vector<std::pair<std::string, TUCost>> &tus,
+                std::vector<std::pair<std::string, HeaderCost>> &headers) {
+  std::lock_guard lock(cost_mtx);
+  for (auto &it : tu_costs)
+    tus.emplace_back(it.first().str(), it.second);
+  for (auto &it : header_costs)
+    headers.emplace_back(it.first().str(), it.second);
+}
+
+int64_t inMemoryIndexBytes() {
+  auto vec = [](const auto &v) { return int64_t(v.capacity() * sizeof(v[0])); };
+  auto entity = [&](const auto &e) {
+    return int64_t(sizeof(e)) + vec(e.declarations) + vec(e.uses);
+  };
+  std::shared_lock lock(g_index_mutex);
+  int64_t ret = 0;
+  for (auto &[path, file] : g_index) {
+    ret += path.capacity() + file.content.capacity();
+    if (const IndexFile *index = file.index.get()) {
+      ret += sizeof(IndexFile) + vec(index->skipped_ranges) +
+             vec(index->lid2path);
+      for (auto &[_, func] : index->usr2func)
+        ret += entity(func) + vec(func.derived);
+      for (auto &[_, type] : index->usr2type)
+        ret += entity(type) + vec(type.derived) + vec(type.instances);
+      for (auto &[_, var] : index->usr2var)
+        ret += entity(var);
+    }
+  }
+  return ret;
+}
+
+std::vector<std::string> quarantined() {
+  std::vector<std::string> ret;
+  if (g_config->index.quarantine <= 0)
+    return ret;
+  std::lock_guard lock(quarantine_mtx);
+  loadQuarantine();
+  for (auto &it : quarantine)
+    if (it.second.n >= g_config->index.quarantine)
+      ret.push_back(it.first().str());
+  std::sort(ret.begin(), ret.end());
+  return ret;
+}
+
 std::optional<std::string> loadIndexedContent(const std::string &path) {
   if (g_config->cache.directory.empty()) {
     std::shared_lock lock(g_index_mutex);
     auto it = g_index.find(path);
     if (it == g_index.end())
       return {};
-    return it->second.content;
+    return getContent(it->second);
+  }
+  {
+    std::lock_guard lock(cache_write_mtx);
+    if (const CacheWrite *w = findCacheWrite(path)) {
+      if (w->deleted)
+        return {};
+      return w->file_contents;
+    }
   }
+  if (CachePack *pack = getCachePack())
+    return pack->getContents(path);
   return readContent(getCachePath(path));
 }
 
-void notifyOrRequest(const char *method, bool request,
-                     const std::function<void(JsonWriter &)> &fn) {
+namespace {
+// The output buffer of the calling thread, reused across messages so that
+// building one does not grow a fresh buffer from scratch.
+struct OutputBuffer {
   rapidjson::StringBuffer output;
-  rapidjson::Writer<rapidjson::StringBuffer> w(output);
-  w.StartObject();
-  w.Key("jsonrpc");
-  w.String("2.0");
+  JsonWriter::W w{output};
+  JsonWriter writer{&w};
+  // See captureReplies. |captured| is set if the current message is a reply
+  // to be captured.
+  std::string *capture = nullptr;
+  bool captured = false;
+};
+thread_local OutputBuffer output_buffer;
+
+JsonWriter::W &beginObject() {
+  OutputBuffer &b = output_buffer;
+  b.output.Clear();
+  b.w.Reset(b.output);
+  b.w.StartObject();
+  b.w.Key("jsonrpc");
+  b.w.String("2.0");
+  b.captured = false;
+  return b.w;
+}
+} // namespace
+
+JsonWriter &beginMessage(const char *method, bool request) {
+  JsonWriter::W &w = beginObject();
   w.Key("method");
   w.String(method);
   if (request) {
@@ -842,21 +3280,13 @@ void notifyOrRequest(const char *method, bool request,
     w.Int64(request_id.fetch_add(1, std::memory_order_relaxed));
   }
   w.Key("params");
-  JsonWriter writer(&w);
-  fn(writer);
-  w.EndObject();
   LOG_V(2) << (request ? "RequestMessage: " : "NotificationMessage: ")
            << method;
-  for_stdout->pushBack(output.GetString());
+  return output_buffer.writer;
 }
 
-static void reply(const RequestId &id, const char *key,
-                  const std::function<void(JsonWriter &)> &fn) {
-  rapidjson::StringBuffer output;
-  rapidjson::Writer<rapidjson::StringBuffer> w(output);
-  w.StartObject();
-  w.Key("jsonrpc");
-  w.String("2.0");
+JsonWriter &beginReply(const RequestId &id, const char *key) {
+  JsonWriter::W &w = beginObject();
   w.Key("id");
   switch (id.type) {
   case RequestId::kNone:
@@ -870,21 +3300,48 @@ static void reply(const RequestId &id, const char *key,
     break;
   }
   w.Key(key);
-  JsonWriter writer(&w);
-  fn(writer);
-  w.EndObject();
-  if (id.valid())
+  output_buffer.captured = output_buffer.capture != nullptr;
+  if (output_buffer.captured)
+    return output_buffer.writer;
+  if (id.valid()) {
     LOG_V(2) << "respond to RequestMessage: " << id.value;
-  for_stdout->pushBack(output.GetString());
+    std::lock_guard lock(pending_requests_mtx);
+    pending_requests.erase(requestKey(id));
+  }
+  return output_buffer.writer;
+}
+
+void endMessage() {
+  OutputBuffer &b = output_buffer;
+  b.w.EndObject();
+  if (b.captured)
+    b.capture->append(b.output.GetString(), b.output.GetSize());
+  else
+    for_stdout->pushBack(
+        std::string(b.output.GetString(), b.output.GetSize()));
+  // Do not keep the memory of an exceptionally large message.
+  if (b.output.GetSize() > (1 << 20)) {
+    b.output.Clear();
+    b.output.ShrinkToFit();
+  }
 }
 
-void reply(const RequestId &id, const std::function<void(JsonWriter &)> &fn) {
-  reply(id, "result", fn);
+void captureReplies(std::string *out) { output_buffer.capture = out; }
+
+void cancel(const RequestId &id) {
+  std::lock_guard lock(pending_requests_mtx);
+  auto it = pending_requests.find(requestKey(id));
+  if (it != pending_requests.end())
+    it->second = true;
 }
 
-void replyError(const RequestId &id,
-                const std::function<void(JsonWriter &)> &fn) {
-  reply(id, "error", fn);
+bool isCancelled(const RequestId &id) {
+  if (!id.valid())
+    return false;
+  std::lock_guard lock(pending_requests_mtx);
+  auto it = pending_requests.find(requestKey(id));
+  return it != pending_requests.end() && it->second;
 }
+
 } // namespace pipeline
 } // namespace ccls
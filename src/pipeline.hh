@@ -5,16 +5,21 @@
 
 #include "lsp.hh"
 #include "query.hh"
+#include "symbol_table.hh"
 
 #include <atomic>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
 namespace ccls {
 struct SemaManager;
 struct GroupMatch;
+struct MessageHandler;
 struct Project;
 struct WorkingFiles;
 
@@ -41,6 +46,48 @@ enum class IndexMode {
 
 struct IndexStats {
   std::atomic<int64_t> last_idle, completed, enqueued;
+  // Files parsed by idx::index, the bytes of their indexes and the time spent.
+  std::atomic<int64_t> indexed, indexed_bytes, index_us;
+  // Results of loading cache files and the time spent.
+  std::atomic<int64_t> cache_hits, cache_misses, cache_load_us;
+  // Time spent serializing indexes for cache writes.
+  std::atomic<int64_t> serialize_us;
+  // Time indexers spent blocked because on_indexed was full.
+  std::atomic<int64_t> update_stall_us;
+  // Updates composed into a later update of the same file before applying.
+  std::atomic<int64_t> updates_merged;
+  // Cache files and bytes removed by cache.gcDays.
+  std::atomic<int64_t> cache_gc_files, cache_gc_bytes;
+  // Cache files rewritten from an older minor version.
+  std::atomic<int64_t> cache_migrated;
+  // Translation units abandoned because of index.timeout or
+  // index.memoryLimit, and background requests skipped by index.quarantine.
+  std::atomic<int64_t> index_aborted, quarantine_skipped;
+  // Requests taken from index_request by priority class (OnChange,
+  // Normal/Delete, Background), and their total and maximum time in the
+  // queue. See index.aging.
+  std::atomic<int64_t> wait_count[3], wait_us[3], max_wait_us[3];
+};
+
+// What a translation unit indexed or loaded from the cache in this session
+// cost. See $ccls/indexReport.
+struct TUCost {
+  IndexCost cost;
+  // See IndexFile::memory.
+  int64_t memory = 0;
+  // Bytes of the cache files of the translation unit and the headers indexed
+  // with it. 0 without cache.directory.
+  int64_t bytes = 0;
+};
+struct HeaderCost {
+  // The translation unit the header was indexed with.
+  std::string tu;
+  // Bytes of its cache file.
+  int64_t bytes = 0;
+};
+
+struct QueueDepths {
+  int64_t on_request, index_request, on_indexed, for_stdout;
 };
 
 namespace pipeline {
@@ -48,37 +95,128 @@ extern std::atomic<bool> g_quit;
 extern std::atomic<int64_t> loaded_ts;
 extern IndexStats stats;
 extern int64_t tick;
+// The directory of --serve-snapshot, or empty. If set, the DB is restored from
+// its snapshot and only read-only requests are answered; nothing is indexed.
+extern std::string serve_snapshot;
 
 void threadEnter();
 void threadLeave();
 void init();
+QueueDepths queueDepths();
+// Restores |db| from the snapshot if cache.snapshot is enabled. Call after the
+// project is loaded and before indexing starts.
+void loadSnapshot(DB *db, VFS *vfs, Project *project);
 void launchStdin();
+// Queues |message|, a JSON-RPC notification, as if it was read from stdin.
+void pushNotification(std::string_view message);
 void launchStdout();
+// Serves LSP clients connecting to the UNIX domain socket |path| instead of
+// stdin. The clients share the DB, the indexers and the session started by the
+// first "initialize"; a document stays open while any client has it open.
+// Returns false if the socket cannot be created.
+bool launchSocket(const std::string &path);
+// Relays stdin and stdout to the socket of a server started with --listen, for
+// clients which can only launch a server. Returns the exit status.
+int relay(const std::string &path);
 void indexer_Main(SemaManager *manager, VFS *vfs, Project *project,
                   WorkingFiles *wfiles);
+// Runs read-only requests dispatched by mainLoop. See request.threads.
+void request_Main(MessageHandler *handler);
 void mainLoop();
 void standalone(const std::string &root);
+// Like standalone, but only brings the cache up to date without building a
+// DB or computing index deltas, then prints a summary. Used to pre-warm
+// caches, e.g. nightly in CI.
+void indexOnly(const std::string &root);
+// Indexes |root| like standalone and prints a JSON report to stdout. With
+// |warm|, the project is indexed once to fill the cache, then the VFS is reset
+// and the measured pass loads every file from the cache.
+void benchIndex(const std::string &root, const std::string &cache, bool warm);
+// Opens |files| translation units of |root| one at a time in SemaManager,
+// makes |edits| edits in function bodies of each, each followed by
+// diagnostics, a completion at a member access and a save, and prints the
+// latencies as JSON to stdout.
+void benchSema(const std::string &root, int files, int edits);
 
 void index(const std::string &path, const std::vector<const char *> &args,
            IndexMode mode, bool must_exist, RequestId id = {});
+// Moves the pending background request of |path|, if any, ahead of other
+// background requests. Called when a request waits for |path|.
+void boostIndex(const std::string &path);
+// While the requests of the initial Project::index are pending, boosts those
+// which load |path|, a file just opened, and the files related to it, so that
+// they are loaded before unrelated caches.
+void boostOpened(Project *project, const std::string &path);
+// Loads caches deferred by index.lazyLoad. Later requests are not deferred.
+// Returns whether some of the caches it has queued are not applied yet.
+bool loadDeferred();
+// Returns the symbol tables (cache.symbolTable) of the files whose caches have
+// been deferred by index.lazyLoad, by source path, or std::nullopt if a
+// translation unit has no table.
+std::optional<std::vector<std::pair<std::string, std::shared_ptr<SymbolTable>>>>
+deferredSymbolTables();
+// Records a textDocument/didChange for index.pauseAfterEdit.
+void noteEdit();
 void removeCache(const std::string &path);
 std::optional<std::string> loadIndexedContent(const std::string &path);
+// Copies the costs of the translation units and headers seen in this session.
+void indexCosts(std::vector<std::pair<std::string, TUCost>> &tus,
+                std::vector<std::pair<std::string, HeaderCost>> &headers);
+// Approximate bytes of the indexes kept in memory to compute deltas, and of
+// their file contents when cache.directory is empty.
+int64_t inMemoryIndexBytes();
+// Returns the translation units quarantined by index.quarantine.
+std::vector<std::string> quarantined();
 
-void notifyOrRequest(const char *method, bool request,
-                     const std::function<void(JsonWriter &)> &fn);
+// Outgoing messages are built in a buffer of the calling thread. beginMessage
+// and beginReply open the envelope and return the writer for the params,
+// result or error; endMessage closes it and queues the text for stdout.
+JsonWriter &beginMessage(const char *method, bool request);
+JsonWriter &beginReply(const RequestId &id, const char *key);
+void endMessage();
+// While |out| is not null, replies built on the calling thread are appended
+// to |*out| instead of being queued for stdout, and do not settle a pending
+// request. Used by $ccls/batch to collect the replies of its sub-requests.
+void captureReplies(std::string *out);
+
+template <typename Fn>
+void notifyOrRequest(const char *method, bool request, Fn &&fn) {
+  fn(beginMessage(method, request));
+  endMessage();
+}
 template <typename T> void notify(const char *method, T &result) {
-  notifyOrRequest(method, false, [&](JsonWriter &w) { reflect(w, result); });
+  reflect(beginMessage(method, false), result);
+  endMessage();
 }
 template <typename T> void request(const char *method, T &result) {
-  notifyOrRequest(method, true, [&](JsonWriter &w) { reflect(w, result); });
+  reflect(beginMessage(method, true), result);
+  endMessage();
+}
+// Sends |result| as a $/progress notification of a partialResultToken. The
+// final reply of the request should then be empty.
+template <typename T> void partialResult(RequestId &token, T &result) {
+  notifyOrRequest("$/progress", false, [&](JsonWriter &w) {
+    w.startObject();
+    w.key("token");
+    reflect(w, token);
+    w.key("value");
+    reflect(w, result);
+    w.endObject();
+  });
 }
 
-void reply(const RequestId &id, const std::function<void(JsonWriter &)> &fn);
+// Marks a request that has not been replied to as cancelled by the client.
+// Long-running work polls isCancelled and replies RequestCancelled.
+void cancel(const RequestId &id);
+bool isCancelled(const RequestId &id);
 
-void replyError(const RequestId &id,
-                const std::function<void(JsonWriter &)> &fn);
+template <typename T> void reply(const RequestId &id, T &result) {
+  reflect(beginReply(id, "result"), result);
+  endMessage();
+}
 template <typename T> void replyError(const RequestId &id, T &result) {
-  replyError(id, [&](JsonWriter &w) { reflect(w, result); });
+  reflect(beginReply(id, "error"), result);
+  endMessage();
 }
 } // namespace pipeline
 } // namespace ccls
@@ -5,6 +5,8 @@
 
 #include <llvm/ADT/StringRef.h>
 
+#include <stdint.h>
+#include <stdio.h>
 #include <string>
 
 namespace ccls {
@@ -13,8 +15,51 @@ std::string normalizePath(llvm::StringRef path);
 // Free any unused memory and return it to the system.
 void freeUnusedMemory();
 
+// Peak resident set size of the process in bytes, or 0 if unknown.
+int64_t getPeakMemory();
+
+// One-minute system load average, or a negative value if unknown.
+double getLoadAverage();
+
+// Available physical memory as a fraction of the total, or a negative value if
+// unknown.
+double getAvailableMemory();
+
+// Hints the system to read |path| into the page cache in the background. This
+// is a no-op where unsupported.
+void prefetchFile(const std::string &path);
+
+// Number of NUMA nodes, or 1 if unknown.
+int numaNodeCount();
+
+// Restricts the calling thread to the CPUs of NUMA node |node|. Returns false
+// if unsupported or failed.
+bool pinThreadToNumaNode(int node);
+
+// Reads the hardware counters of the calling thread, opened on first use:
+// cycles, instructions, last level cache misses and branch misses, counted in
+// user space. Returns false if unsupported or not permitted, e.g. by
+// kernel.perf_event_paranoid. Linux only.
+bool readPerfCounters(int64_t (&values)[4]);
+
 // Stop self and wait for SIGCONT.
 void traceMe();
 
 void spawnThread(void *(*fn)(void *), void *arg);
+
+// Listens on the UNIX domain socket |path|, replacing a stale socket file.
+// Returns the listening descriptor, or -1 if unsupported or failed.
+int listenUnixSocket(const std::string &path);
+// Waits for a connection on |fd|. Returns the connected descriptor, or -1.
+int acceptConnection(int fd);
+// Connects to the UNIX domain socket |path|. Returns the descriptor, or -1.
+int connectUnixSocket(const std::string &path);
+// Writes all of |data| to |fd|. Returns false on error.
+bool writeAll(int fd, const char *data, size_t size);
+
+// Flushes |fp| and truncates its file to |size| bytes. Returns false on error.
+bool truncateFile(FILE *fp, uint64_t size);
+// Takes an exclusive advisory lock on the file of |fp| without blocking. It is
+// released when |fp| is closed. Returns false if another process holds it.
+bool tryLockFile(FILE *fp);
 } // namespace ccls
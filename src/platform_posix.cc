@@ -4,6 +4,7 @@
 #if defined(__unix__) || defined(__APPLE__)
 #include "platform.hh"
 
+#include "allocator.hh"
 #include "utils.hh"
 
 #include <assert.h>
@@ -17,10 +18,18 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
 #include <signal.h>
+#include <sys/file.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h> // required for stat.h
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #ifdef __GLIBC__
@@ -28,8 +37,10 @@
 #endif
 
 #include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
 #include <llvm/Support/Path.h>
 
+#include <algorithm>
 #include <atomic>
 #include <condition_variable>
 #include <mutex>
@@ -47,11 +58,164 @@ std::string normalizePath(llvm::StringRef path) {
 }
 
 void freeUnusedMemory() {
+  if (purgeArenas())
+    return;
 #ifdef __GLIBC__
   malloc_trim(4 * 1024 * 1024);
 #endif
 }
 
+int64_t getPeakMemory() {
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru))
+    return 0;
+#ifdef __APPLE__
+  return ru.ru_maxrss;
+#else
+  // Linux and the BSDs report kilobytes.
+  return int64_t(ru.ru_maxrss) * 1024;
+#endif
+}
+
+double getLoadAverage() {
+  double load;
+  return getloadavg(&load, 1) == 1 ? load : -1;
+}
+
+void prefetchFile(const std::string &path) {
+#ifdef POSIX_FADV_WILLNEED
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  (void)posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  close(fd);
+#elif defined(F_RDADVISE)
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    struct radvisory ra{0, st.st_size > INT_MAX ? INT_MAX : int(st.st_size)};
+    (void)fcntl(fd, F_RDADVISE, &ra);
+  }
+  close(fd);
+#else
+  (void)path;
+#endif
+}
+
+double getAvailableMemory() {
+#ifdef __linux__
+  FILE *fp = fopen("/proc/meminfo", "r");
+  if (!fp)
+    return -1;
+  char line[128];
+  long long total = -1, available = -1, n;
+  while (fgets(line, sizeof line, fp))
+    if (sscanf(line, "MemTotal: %lld", &n) == 1)
+      total = n;
+    else if (sscanf(line, "MemAvailable: %lld", &n) == 1)
+      available = n;
+  fclose(fp);
+  return total > 0 && available >= 0 ? double(available) / total : -1;
+#else
+  return -1;
+#endif
+}
+
+int numaNodeCount() {
+#ifdef __linux__
+  int n = 0;
+  while (llvm::sys::fs::is_directory("/sys/devices/system/node/node" +
+                                     std::to_string(n)))
+    n++;
+  return std::max(n, 1);
+#else
+  return 1;
+#endif
+}
+
+bool pinThreadToNumaNode(int node) {
+#ifdef __linux__
+  std::string path =
+      "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+  FILE *fp = fopen(path.c_str(), "r");
+  if (!fp)
+    return false;
+  // e.g. 0-15,32-47
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  int lo, hi, count = 0;
+  while (fscanf(fp, "%d", &lo) == 1) {
+    hi = lo;
+    int c = fgetc(fp);
+    if (c == '-') {
+      if (fscanf(fp, "%d", &hi) != 1)
+        break;
+      c = fgetc(fp);
+    }
+    for (int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++, count++)
+      CPU_SET(cpu, &set);
+    if (c != ',')
+      break;
+  }
+  fclose(fp);
+  return count && !sched_setaffinity(0, sizeof set, &set);
+#else
+  return false;
+#endif
+}
+
+bool readPerfCounters(int64_t (&values)[4]) {
+#ifdef __linux__
+  // The group leader's descriptor, -1 if not opened yet, -2 if unavailable.
+  thread_local int leader = -1;
+  if (leader == -1) {
+    const std::pair<uint32_t, uint64_t> events[] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+                                 PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                                 PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}};
+    int fds[4], n = 0;
+    for (auto [type, config] : events) {
+      struct perf_event_attr attr{};
+      attr.size = sizeof attr;
+      attr.type = type;
+      attr.config = config;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP;
+      int fd = syscall(SYS_perf_event_open, &attr, 0, -1, n ? fds[0] : -1,
+                       PERF_FLAG_FD_CLOEXEC);
+      if (fd < 0)
+        break;
+      fds[n++] = fd;
+    }
+    if (n == 4) {
+      leader = fds[0];
+    } else {
+      while (n)
+        close(fds[--n]);
+      leader = -2;
+    }
+  }
+  if (leader < 0)
+    return false;
+  // u64 nr, then the values in the order of creation.
+  uint64_t buf[5];
+  if (read(leader, buf, sizeof buf) != ssize_t(sizeof buf) || buf[0] != 4)
+    return false;
+  for (int i = 0; i < 4; i++)
+    values[i] = int64_t(buf[i + 1]);
+  return true;
+#else
+  (void)values;
+  return false;
+#endif
+}
+
 void traceMe() {
   // If the environment variable is defined, wait for a debugger.
   // In gdb, you need to invoke `signal SIGCONT` if you want ccls to continue
@@ -75,6 +239,82 @@ void spawnThread(void *(*fn)(void *), void *arg) {
   pthread_create(&thd, &attr, fn, arg);
   pthread_attr_destroy(&attr);
 }
+
+namespace {
+bool makeAddress(const std::string &path, sockaddr_un &addr) {
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof addr.sun_path)
+    return false;
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  return true;
+}
+} // namespace
+
+int listenUnixSocket(const std::string &path) {
+  sockaddr_un addr;
+  if (!makeAddress(path, addr))
+    return -1;
+  // A client that goes away must not kill the server.
+  signal(SIGPIPE, SIG_IGN);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  unlink(path.c_str());
+  if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof addr) < 0 ||
+      listen(fd, 16) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int acceptConnection(int fd) {
+  int conn;
+  while ((conn = accept(fd, nullptr, nullptr)) < 0 && errno == EINTR)
+    ;
+  if (conn >= 0)
+    fcntl(conn, F_SETFD, FD_CLOEXEC);
+  return conn;
+}
+
+int connectUnixSocket(const std::string &path) {
+  sockaddr_un addr;
+  if (!makeAddress(path, addr))
+    return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof addr) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool writeAll(int fd, const char *data, size_t size) {
+  while (size) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool truncateFile(FILE *fp, uint64_t size) {
+  fflush(fp);
+  clearerr(fp);
+  return ftruncate(fileno(fp), off_t(size)) == 0;
+}
+
+bool tryLockFile(FILE *fp) { return flock(fileno(fp), LOCK_EX | LOCK_NB) == 0; }
 } // namespace ccls
 
 #endif
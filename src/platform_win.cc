@@ -4,9 +4,11 @@
 #if defined(_WIN32)
 #include "platform.hh"
 
+#include "allocator.hh"
 #include "utils.hh"
 
 #include <Windows.h>
+#include <psapi.h>
 #include <direct.h>
 #include <fcntl.h>
 #include <io.h>
@@ -35,7 +37,32 @@ std::string normalizePath(llvm::StringRef path) {
   return result;
 }
 
-void freeUnusedMemory() {}
+void freeUnusedMemory() { purgeArenas(); }
+
+int64_t getPeakMemory() {
+  PROCESS_MEMORY_COUNTERS pmc;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof pmc))
+    return 0;
+  return pmc.PeakWorkingSetSize;
+}
+
+double getLoadAverage() { return -1; }
+
+void prefetchFile(const std::string &) {}
+
+int numaNodeCount() { return 1; }
+
+bool pinThreadToNumaNode(int) { return false; }
+
+bool readPerfCounters(int64_t (&)[4]) { return false; }
+
+double getAvailableMemory() {
+  MEMORYSTATUSEX ms;
+  ms.dwLength = sizeof ms;
+  if (!GlobalMemoryStatusEx(&ms) || !ms.ullTotalPhys)
+    return -1;
+  return double(ms.ullAvailPhys) / ms.ullTotalPhys;
+}
 
 // TODO Wait for debugger to attach
 void traceMe() {}
@@ -43,6 +70,24 @@ void traceMe() {}
 void spawnThread(void *(*fn)(void *), void *arg) {
   std::thread(fn, arg).detach();
 }
+
+int listenUnixSocket(const std::string &) { return -1; }
+int acceptConnection(int) { return -1; }
+int connectUnixSocket(const std::string &) { return -1; }
+bool writeAll(int, const char *, size_t) { return false; }
+
+bool truncateFile(FILE *fp, uint64_t size) {
+  fflush(fp);
+  clearerr(fp);
+  return _chsize_s(_fileno(fp), __int64(size)) == 0;
+}
+
+bool tryLockFile(FILE *fp) {
+  OVERLAPPED ov = {};
+  return LockFileEx(HANDLE(_get_osfhandle(_fileno(fp))),
+                    LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1,
+                    0, &ov);
+}
 } // namespace ccls
 
 #endif
@@ -14,8 +14,8 @@
 #include <stdlib.h>
 
 namespace ccls {
-Pos Pos::fromString(const std::string &encoded) {
-  char *p = const_cast<char *>(encoded.c_str());
+Pos Pos::fromString(const char *encoded) {
+  char *p = const_cast<char *>(encoded);
   uint16_t line = uint16_t(strtoul(p, &p, 10) - 1);
   assert(*p == ':');
   p++;
@@ -29,9 +29,9 @@ std::string Pos::toString() {
   return buf;
 }
 
-Range Range::fromString(const std::string &encoded) {
+Range Range::fromString(const char *encoded) {
   Pos start, end;
-  char *p = const_cast<char *>(encoded.c_str());
+  char *p = const_cast<char *>(encoded);
   start.line = uint16_t(strtoul(p, &p, 10) - 1);
   assert(*p == ':');
   p++;
@@ -60,9 +60,18 @@ std::string Range::toString() {
   return buf;
 }
 
-void reflect(JsonReader &vis, Pos &v) { v = Pos::fromString(vis.getString()); }
+void reflect(JsonReader &vis, Pos &v) {
+  v = Pos::fromString(vis.getString().c_str());
+}
 void reflect(JsonReader &vis, Range &v) {
-  v = Range::fromString(vis.getString());
+  v = Range::fromString(vis.getString().c_str());
+}
+// Strings of JsonSaxReader are null terminated.
+void reflect(JsonSaxReader &vis, Pos &v) {
+  v = Pos::fromString(vis.getString().data());
+}
+void reflect(JsonSaxReader &vis, Range &v) {
+  v = Range::fromString(vis.getString().data());
 }
 
 void reflect(JsonWriter &vis, Pos &v) {
@@ -78,11 +87,17 @@ void reflect(BinaryReader &visitor, Pos &value) {
   reflect(visitor, value.line);
   reflect(visitor, value.column);
 }
+// The end is stored relative to the start, usually (0, small). It was absolute
+// before minor version 5.
 void reflect(BinaryReader &visitor, Range &value) {
   reflect(visitor, value.start.line);
   reflect(visitor, value.start.column);
-  reflect(visitor, value.end.line);
-  reflect(visitor, value.end.column);
+  if (visitor.minor < 5) {
+    reflect(visitor, value.end);
+    return;
+  }
+  value.end.line = value.start.line + visitor.varInt();
+  value.end.column = value.start.column + visitor.varInt();
 }
 
 void reflect(BinaryWriter &vis, Pos &v) {
@@ -92,7 +107,7 @@ void reflect(BinaryWriter &vis, Pos &v) {
 void reflect(BinaryWriter &vis, Range &v) {
   reflect(vis, v.start.line);
   reflect(vis, v.start.column);
-  reflect(vis, v.end.line);
-  reflect(vis, v.end.column);
+  vis.varInt(v.end.line - v.start.line);
+  vis.varInt(v.end.column - v.start.column);
 }
 } // namespace ccls
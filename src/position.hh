@@ -13,10 +13,12 @@ struct Pos {
   uint16_t line = 0;
   int16_t column = -1;
 
-  static Pos fromString(const std::string &encoded);
+  static Pos fromString(const char *encoded);
 
   bool valid() const { return column >= 0; }
   std::string toString();
+  // Packed (line, column), ordered like operator<.
+  uint32_t key() const { return uint32_t(line) << 16 | uint16_t(column + 1); }
 
   // Compare two Positions and check if they are equal. Ignores the value of
   // |interesting|.
@@ -35,12 +37,14 @@ struct Range {
   Pos start;
   Pos end;
 
-  static Range fromString(const std::string &encoded);
+  static Range fromString(const char *encoded);
 
   bool valid() const { return start.valid(); }
   bool contains(int line, int column) const;
 
   std::string toString();
+  // Packed (start, end), used as a hash key.
+  uint64_t key() const { return uint64_t(start.key()) << 32 | end.key(); }
 
   bool operator==(const Range &o) const {
     return start == o.start && end == o.end;
@@ -52,12 +56,15 @@ struct Range {
 
 // reflection
 struct JsonReader;
+struct JsonSaxReader;
 struct JsonWriter;
 struct BinaryReader;
 struct BinaryWriter;
 
 void reflect(JsonReader &visitor, Pos &value);
 void reflect(JsonReader &visitor, Range &value);
+void reflect(JsonSaxReader &visitor, Pos &value);
+void reflect(JsonSaxReader &visitor, Range &value);
 void reflect(JsonWriter &visitor, Pos &value);
 void reflect(JsonWriter &visitor, Range &value);
 void reflect(BinaryReader &visitor, Pos &value);
@@ -67,16 +74,15 @@ void reflect(BinaryWriter &visitor, Range &value);
 } // namespace ccls
 
 namespace std {
+template <> struct hash<ccls::Pos> {
+  std::size_t operator()(ccls::Pos x) const {
+    return hash<uint32_t>()(x.key());
+  }
+};
 template <> struct hash<ccls::Range> {
   std::size_t operator()(ccls::Range x) const {
-    union {
-      ccls::Range range;
-      uint64_t u64;
-    } u{x};
     static_assert(sizeof(ccls::Range) == 8);
-    return hash<uint64_t>()(u.u64);
+    return hash<uint64_t>()(x.key());
   }
 };
 } // namespace std
-
-MAKE_HASHABLE(ccls::Pos, t.line, t.column);
@@ -18,10 +18,14 @@
 #include <clang/Tooling/CompilationDatabase.h>
 #include <llvm/ADT/STLExtras.h>
 #include <llvm/ADT/StringSet.h>
+#include <llvm/Support/CommandLine.h>
 #include <llvm/Support/GlobPattern.h>
 #include <llvm/Support/LineIterator.h>
 #include <llvm/Support/Program.h>
+#include <llvm/Support/StringSaver.h>
 
+#include <rapidjson/filereadstream.h>
+#include <rapidjson/reader.h>
 #include <rapidjson/writer.h>
 
 #ifdef _WIN32
@@ -30,8 +34,11 @@
 #include <unistd.h>
 #endif
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <limits.h>
+#include <numeric>
 #include <unordered_set>
 #include <vector>
 
@@ -245,6 +252,104 @@ std::vector<const char *> getFallback(const std::string &path) {
   return argv;
 }
 
+// A compile_commands.json entry. |args| comes from "arguments" or from
+// splitting "command".
+struct CompileCommand {
+  std::string directory, file;
+  std::vector<std::string> args;
+};
+
+// Reads compile_commands.json with a SAX parser, without building the
+// document of a large database. Returns false for input it does not handle,
+// e.g. response files, and the caller falls back to clang's
+// JSONCompilationDatabase.
+bool readCompileCommands(const char *path, std::vector<CompileCommand> &cmds) {
+  struct Handler
+      : rapidjson::BaseReaderHandler<rapidjson::UTF8<>, Handler> {
+    std::vector<CompileCommand> &cmds;
+    enum { Top, Array, Object, Arguments } state = Top;
+    std::string key, command;
+    BumpPtrAllocator alloc;
+
+    Handler(std::vector<CompileCommand> &cmds) : cmds(cmds) {}
+    bool Default() { return false; }
+    bool StartArray() {
+      if (state == Top)
+        state = Array;
+      else if (state == Object && key == "arguments")
+        state = Arguments;
+      else
+        return false;
+      return true;
+    }
+    bool EndArray(rapidjson::SizeType) {
+      state = state == Arguments ? Object : Top;
+      return true;
+    }
+    bool StartObject() {
+      if (state != Array)
+        return false;
+      state = Object;
+      cmds.emplace_back();
+      command.clear();
+      return true;
+    }
+    bool Key(const char *str, rapidjson::SizeType len, bool) {
+      key.assign(str, len);
+      return true;
+    }
+    bool String(const char *str, rapidjson::SizeType len, bool) {
+      if (state != Object && state != Arguments)
+        return false;
+      CompileCommand &cmd = cmds.back();
+      if (state == Arguments)
+        cmd.args.emplace_back(str, len);
+      else if (key == "directory")
+        cmd.directory.assign(str, len);
+      else if (key == "file")
+        cmd.file.assign(str, len);
+      else if (key == "command")
+        command.assign(str, len);
+      return true;
+    }
+    bool EndObject(rapidjson::SizeType) {
+      CompileCommand &cmd = cmds.back();
+      if (cmd.args.empty()) {
+        StringSaver saver(alloc);
+        SmallVector<const char *, 0> argv;
+#ifdef _WIN32
+        cl::TokenizeWindowsCommandLine(command, saver, argv);
+#else
+        cl::TokenizeGNUCommandLine(command, saver, argv);
+#endif
+        cmd.args.assign(argv.begin(), argv.end());
+        alloc.Reset();
+      }
+      state = Array;
+      if (cmd.directory.empty() || cmd.file.empty() || cmd.args.empty())
+        return false;
+      for (auto &arg : cmd.args)
+        if (arg.size() && arg[0] == '@')
+          return false;
+      return true;
+    }
+  };
+
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    return false;
+  char buf[65536];
+  rapidjson::FileReadStream is(fp, buf, sizeof buf);
+  Handler handler(cmds);
+  rapidjson::Reader reader;
+  bool ok =
+      !reader.Parse(is, handler).IsError() && handler.state == Handler::Top;
+  fclose(fp);
+  if (!ok)
+    cmds.clear();
+  return ok;
+}
+
 void loadDirectoryListing(ProjectProcessor &proc, const std::string &root,
                           const StringSet<> &seen) {
   Project::Folder &folder = proc.folder;
@@ -354,7 +459,14 @@ int computeGuessScore(std::string_view a, std::string_view b) {
 void Project::loadDirectory(const std::string &root, Project::Folder &folder) {
   SmallString<256> cdbDir, path, stdinPath;
   std::string err_msg;
+  // Entries of the previous load by compdb_hash, reused when the
+  // compile_commands.json entry is unchanged.
+  std::vector<Project::Entry> old_entries = std::move(folder.entries);
   folder.entries.clear();
+  std::unordered_map<uint64_t, const Project::Entry *> old;
+  for (const Project::Entry &entry : old_entries)
+    if (entry.compdb_hash)
+      old.emplace(entry.compdb_hash, &entry);
   if (g_config->compilationDatabaseCommand.empty()) {
     cdbDir = root;
     if (g_config->compilationDatabaseDirectory.size()) {
@@ -402,8 +514,11 @@ void Project::loadDirectory(const std::string &root, Project::Folder &folder) {
     }
   }
 
-  std::unique_ptr<tooling::CompilationDatabase> cdb =
-      tooling::CompilationDatabase::loadFromDirectory(cdbDir, err_msg);
+  std::vector<CompileCommand> cmds;
+  std::unique_ptr<tooling::CompilationDatabase> cdb;
+  bool streamed = readCompileCommands(path.c_str(), cmds);
+  if (!streamed)
+    cdb = tooling::CompilationDatabase::loadFromDirectory(cdbDir, err_msg);
   if (!g_config->compilationDatabaseCommand.empty()) {
 #ifdef _WIN32
     DeleteFileA(stdinPath.c_str());
@@ -419,30 +534,53 @@ void Project::loadDirectory(const std::string &root, Project::Folder &folder) {
   ProjectProcessor proc(folder);
   StringSet<> seen;
   std::vector<Project::Entry> result;
-  if (!cdb) {
+  if (!streamed && !cdb) {
     if (g_config->compilationDatabaseCommand.size() || sys::fs::exists(path))
       LOG_S(ERROR) << "failed to load " << path.c_str();
   } else {
-    LOG_S(INFO) << "loaded " << path.c_str();
-    for (tooling::CompileCommand &cmd : cdb->getAllCompileCommands()) {
-      static bool once;
-      Project::Entry entry;
+    if (cdb)
+      for (tooling::CompileCommand &cmd : cdb->getAllCompileCommands())
+        cmds.push_back({std::move(cmd.Directory), std::move(cmd.Filename),
+                        std::move(cmd.CommandLine)});
+    // Normalizing depends on the raw entry, the root and these options.
+    std::string salt = root;
+    for (auto *opts : {&g_config->clang.excludeArgs,
+                       &g_config->clang.pathMappings})
+      for (const std::string &opt : *opts)
+        (salt += '\0') += opt;
+    std::vector<Project::Entry> entries(cmds.size());
+    std::atomic<size_t> reused{0};
+    auto normalize = [&](size_t idx) {
+      CompileCommand &cmd = cmds[idx];
+      Project::Entry &entry = entries[idx];
+      std::string buf = salt;
+      for (auto *s : {&cmd.directory, &cmd.file})
+        (buf += '\0') += *s;
+      for (const std::string &arg : cmd.args)
+        (buf += '\0') += arg;
+      uint64_t hash = hashUsr(buf);
+      if (auto it = old.find(hash); it != old.end()) {
+        entry = *it->second;
+        reused.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      entry.compdb_hash = hash;
       entry.root = root;
       doPathMapping(entry.root);
 
       // If workspace folder is real/ but entries use symlink/, convert to
       // real/.
-      entry.directory = realPath(cmd.Directory);
+      entry.directory = realPath(cmd.directory);
       entry.directory.push_back('/');
       normalizeFolder(entry.directory);
       entry.directory.pop_back();
       doPathMapping(entry.directory);
       entry.filename =
-          realPath(resolveIfRelative(entry.directory, cmd.Filename));
+          realPath(resolveIfRelative(entry.directory, cmd.file));
       normalizeFolder(entry.filename);
       doPathMapping(entry.filename);
 
-      std::vector<std::string> args = std::move(cmd.CommandLine);
+      std::vector<std::string> args = std::move(cmd.args);
       entry.args.reserve(args.size());
       for (int i = 0; i < args.size(); i++) {
         doPathMapping(args[i]);
@@ -450,20 +588,42 @@ void Project::loadDirectory(const std::string &root, Project::Folder &folder) {
           entry.args.push_back(intern(args[i]));
       }
       entry.compdb_size = entry.args.size();
+    };
 
+    if (cmds.size()) {
+      normalize(0);
       // Work around relative --sysroot= as it isn't affected by
       // -working-directory=. chdir is thread hostile but this function runs
       // before indexers do actual work and it works when there is only one
       // workspace folder.
+      static bool once;
       if (!once) {
         once = true;
         llvm::vfs::getRealFileSystem()->setCurrentWorkingDirectory(
-            entry.directory);
+            entries[0].directory);
       }
-      proc.getSearchDirs(entry);
 
+      // Normalizing the other entries (realpath calls, path mappings and
+      // interning arguments) is independent per entry. Do it in chunks on
+      // several threads.
+      const size_t chunk = 256;
+      std::atomic<size_t> next{1};
+      runParallel(
+          std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u),
+                           (cmds.size() + chunk - 1) / chunk),
+          [&](int) {
+            for (size_t i; (i = next.fetch_add(chunk)) < cmds.size();)
+              for (size_t j = i; j < std::min(i + chunk, cmds.size()); j++)
+                normalize(j);
+          });
+    }
+
+    LOG_S(INFO) << "loaded " << path.c_str() << ", " << reused.load() << " of "
+                << entries.size() << " entries unchanged";
+    for (Project::Entry &entry : entries) {
+      proc.getSearchDirs(entry);
       if (seen.insert(entry.filename).second)
-        folder.entries.push_back(entry);
+        folder.entries.push_back(std::move(entry));
     }
   }
 
@@ -480,16 +640,65 @@ void Project::load(const std::string &root) {
   std::lock_guard lock(mtx);
   Folder &folder = root2folder[root];
 
+  clearCompilerInvocationCache();
   loadDirectory(root, folder);
   for (auto &[path, kind] : folder.search_dir2kind)
     LOG_S(INFO) << "search directory: " << path << ' ' << " \"< "[kind];
 
   // Setup project entries.
+  folder.path2entry_index.clear();
   folder.path2entry_index.reserve(folder.entries.size());
+  folder.sorted_entries.clear();
+  folder.stem2entries.clear();
+  extra_args.clear();
+  for (const std::string &arg : g_config->clang.extraArgs)
+    extra_args.push_back(intern(arg));
   for (size_t i = 0; i < folder.entries.size(); ++i) {
     folder.entries[i].id = i;
+    folder.entries[i].working_dir_arg =
+        intern("-working-directory=" + folder.entries[i].directory);
     folder.path2entry_index[folder.entries[i].filename] = i;
+    folder.stem2entries[sys::path::stem(folder.entries[i].filename).str()]
+        .push_back(i);
+    if (folder.entries[i].compdb_size)
+      folder.sorted_entries.push_back(i);
+  }
+  std::sort(folder.sorted_entries.begin(), folder.sorted_entries.end(),
+            [&](int l, int r) {
+              return folder.entries[l].filename < folder.entries[r].filename;
+            });
+  std::lock_guard lock1(inferred_mtx);
+  inferred.clear();
+}
+
+std::vector<Project::Entry> Project::reload(const std::string &root,
+                                            std::vector<std::string> &removed) {
+  // Arguments are interned, so equal arguments are equal pointers.
+  std::unordered_map<std::string, const Entry *> old;
+  std::vector<Entry> old_entries;
+  {
+    std::lock_guard lock(mtx);
+    auto it = root2folder.find(root);
+    if (it != root2folder.end())
+      old_entries = it->second.entries;
+  }
+  for (Entry &entry : old_entries)
+    old[entry.filename] = &entry;
+  load(root);
+
+  std::vector<Entry> changed;
+  std::lock_guard lock(mtx);
+  for (Entry &entry : root2folder[root].entries) {
+    auto it = old.find(entry.filename);
+    if (it == old.end() || it->second->args != entry.args ||
+        it->second->directory != entry.directory)
+      changed.push_back(entry);
+    if (it != old.end())
+      old.erase(it);
   }
+  for (auto &[path, _] : old)
+    removed.push_back(path);
+  return changed;
 }
 
 Project::Entry Project::findEntry(const std::string &path, bool can_redirect,
@@ -504,19 +713,30 @@ Project::Entry Project::findEntry(const std::string &path, bool can_redirect,
   Project::Folder *best_compdb_folder = nullptr;
 
   Project::Entry ret;
+#if LLVM_VERSION_MAJOR < 8
+  // ProjectProcessor records search directories in the folder.
   std::lock_guard lock(mtx);
+#else
+  std::shared_lock lock(mtx);
+#endif
 
   for (auto &[root, folder] : root2folder)
     if (StringRef(path).startswith(root)) {
-      // Find the best-fit .ccls
-      for (auto &[dir, args] : folder.dot_ccls)
-        if (StringRef(path).startswith(dir) &&
-            dir.length() > best_dot_ccls_dir.length()) {
-          best_dot_ccls_root = root;
-          best_dot_ccls_folder = &folder;
-          best_dot_ccls_dir = dir;
-          best_dot_ccls_args = &args;
+      // Find the best-fit .ccls, the deepest ancestor directory with one.
+      for (size_t i = path.rfind('/');
+           i != std::string::npos && i + 1 >= root.size();
+           i = i ? path.rfind('/', i - 1) : std::string::npos) {
+        auto it = folder.dot_ccls.find(path.substr(0, i + 1));
+        if (it != folder.dot_ccls.end()) {
+          if (it->first.size() > best_dot_ccls_dir.size()) {
+            best_dot_ccls_root = root;
+            best_dot_ccls_folder = &folder;
+            best_dot_ccls_dir = it->first;
+            best_dot_ccls_args = &it->second;
+          }
+          break;
         }
+      }
 
       if (!match) {
         auto it = folder.path2entry_index.find(path);
@@ -552,13 +772,41 @@ Project::Entry Project::findEntry(const std::string &path, bool can_redirect,
     if (must_exist && !match && !(best_dot_ccls_args && !append))
       return ret;
     if (!best) {
-      // Infer args from a similar path.
-      int best_score = INT_MIN;
-      auto [lang, header] = lookupExtension(path);
-      for (auto &[root, folder] : root2folder)
-        if (StringRef(path).startswith(root))
-          for (const Entry &e : folder.entries)
-            if (e.compdb_size) {
+      ret.is_inferred = true;
+      {
+        std::lock_guard lock1(inferred_mtx);
+        if (auto it = inferred.find(path); it != inferred.end()) {
+          auto it1 = root2folder.find(it->second.first);
+          if (it1 != root2folder.end() &&
+              it->second.second < (int)it1->second.entries.size()) {
+            best_compdb_folder = &it1->second;
+            best = &it1->second.entries[it->second.second];
+          }
+        }
+      }
+      if (!best) {
+        // Infer args from a similar path. Only the entries under the deepest
+        // ancestor directory having any are scored.
+        const std::string *best_root = nullptr;
+        int best_score = INT_MIN;
+        auto [lang, header] = lookupExtension(path);
+        for (auto &[root, folder] : root2folder) {
+          if (!StringRef(path).startswith(root))
+            continue;
+          auto &sorted = folder.sorted_entries;
+          for (size_t i = path.rfind('/');
+               i != std::string::npos && i + 1 >= root.size();
+               i = i ? path.rfind('/', i - 1) : std::string::npos) {
+            StringRef dir(path.data(), i + 1);
+            auto lo = std::lower_bound(
+                sorted.begin(), sorted.end(), dir, [&](int e, StringRef d) {
+                  return StringRef(folder.entries[e].filename) < d;
+                });
+            auto hi = std::partition_point(lo, sorted.end(), [&](int e) {
+              return StringRef(folder.entries[e].filename).startswith(dir);
+            });
+            for (auto it = lo; it != hi; ++it) {
+              const Entry &e = folder.entries[*it];
               int score = computeGuessScore(path, e.filename);
               // Decrease score if .c is matched against .hh
               auto [lang1, header1] = lookupExtension(e.filename);
@@ -566,11 +814,20 @@ Project::Entry Project::findEntry(const std::string &path, bool can_redirect,
                 score -= 30;
               if (score > best_score) {
                 best_score = score;
+                best_root = &root;
                 best_compdb_folder = &folder;
                 best = &e;
               }
             }
-      ret.is_inferred = true;
+            if (lo != hi)
+              break;
+          }
+        }
+        if (best) {
+          std::lock_guard lock1(inferred_mtx);
+          inferred[path] = {*best_root, best->id};
+        }
+      }
     }
     if (!best) {
       ret.root = ret.directory = g_config->fallbackFolder;
@@ -603,34 +860,132 @@ Project::Entry Project::findEntry(const std::string &path, bool can_redirect,
   return ret;
 }
 
-void Project::index(WorkingFiles *wfiles, const RequestId &id) {
+namespace {
+std::string historyPath() {
+  return g_config->cache.directory + "ccls.history";
+}
+
+// Requires Project::mtx.
+void loadHistory(Project &project) {
+  if (project.history_loaded || g_config->cache.directory.empty())
+    return;
+  project.history_loaded = true;
+  std::optional<std::string> content = readContent(historyPath());
+  if (!content)
+    return;
+  SmallVector<StringRef, 0> lines;
+  StringRef(*content).split(lines, '\n', g_config->index.recentFiles, false);
+  for (StringRef line : lines)
+    if (project.history.size() < size_t(g_config->index.recentFiles))
+      project.history.push_back(line.str());
+}
+} // namespace
+
+void Project::noteOpened(const std::string &path) {
+  int n = g_config->index.recentFiles;
+  if (n <= 0 || g_config->cache.directory.empty())
+    return;
+  std::lock_guard lock(mtx);
+  loadHistory(*this);
+  auto it = std::find(history.begin(), history.end(), path);
+  if (it == history.begin() && history.size())
+    return;
+  if (it != history.end())
+    history.erase(it);
+  history.insert(history.begin(), path);
+  if (history.size() > size_t(n))
+    history.resize(n);
+  std::string content;
+  for (auto &path1 : history)
+    (content += path1) += '\n';
+  writeToFile(historyPath(), content);
+}
+
+void Project::index(WorkingFiles *wfiles, const RequestId &id,
+                    const std::vector<std::string> &roots) {
   auto &gi = g_config->index;
   GroupMatch match(gi.whitelist, gi.blacklist),
       match_i(gi.initialWhitelist, gi.initialBlacklist);
-  std::vector<const char *> args, extra_args;
-  for (const std::string &arg : g_config->clang.extraArgs)
-    extra_args.push_back(intern(arg));
-  {
+  // Requests are queued from a snapshot, so that findEntry on indexer threads
+  // and didOpen are not blocked while a large project is enqueued.
+  std::vector<std::pair<std::string, std::vector<Entry>>> folders;
+  std::vector<std::string> history1;
+  std::vector<const char *> extra_args1;
+  if (gi.recentFiles > 0) {
     std::lock_guard lock(mtx);
-    for (auto &[root, folder] : root2folder) {
-      int i = 0;
-      for (const Project::Entry &entry : folder.entries) {
-        std::string reason;
-        if (match.matches(entry.filename, &reason) &&
-            match_i.matches(entry.filename, &reason)) {
-          bool interactive = wfiles->getFile(entry.filename) != nullptr;
-          args = entry.args;
-          args.insert(args.end(), extra_args.begin(), extra_args.end());
-          args.push_back(intern("-working-directory=" + entry.directory));
-          pipeline::index(entry.filename, args,
-                          interactive ? IndexMode::Normal
-                                      : IndexMode::Background,
-                          false, id);
-        } else {
-          LOG_V(1) << "[" << i << "/" << folder.entries.size()
-                   << "]: " << reason << "; skip " << entry.filename;
-        }
-        i++;
+    loadHistory(*this);
+    history1 = history;
+  }
+  {
+    std::shared_lock lock(mtx);
+    extra_args1 = extra_args;
+    for (auto &[root, folder] : root2folder)
+      if (roots.empty() || llvm::is_contained(roots, root))
+        folders.emplace_back(root, folder.entries);
+  }
+
+  // Queue entries the user is likely to need first: recently opened files,
+  // then files in the directories of open and recently opened files.
+  // Otherwise keep the order of the compilation database.
+  StringMap<int> scores;
+  if (gi.recentFiles > 0) {
+    int n = history1.size();
+    for (int i = 0; i < n; i++) {
+      scores[history1[i]] = std::max(scores.lookup(history1[i]), 2 * n - i);
+      StringRef dir = sys::path::parent_path(history1[i]);
+      scores[dir] = std::max(scores.lookup(dir), 1);
+    }
+    std::lock_guard lock1(wfiles->mutex);
+    for (auto &[path, _] : wfiles->files)
+      scores[sys::path::parent_path(path)] = n + 1;
+  }
+  auto score = [&](const std::string &path) {
+    return std::max(scores.lookup(path),
+                    scores.lookup(sys::path::parent_path(path)));
+  };
+  std::vector<std::vector<int>> orders;
+  for (auto &[root, entries] : folders) {
+    std::vector<int> &order = orders.emplace_back(entries.size());
+    std::iota(order.begin(), order.end(), 0);
+    if (scores.size()) {
+      std::vector<int> entry_scores(order.size());
+      for (int i : order)
+        entry_scores[i] = score(entries[i].filename);
+      std::stable_sort(order.begin(), order.end(), [&](int l, int r) {
+        return entry_scores[l] > entry_scores[r];
+      });
+    }
+  }
+  // Interleave the workspace folders, so that a large folder does not delay
+  // the others until it is fully indexed.
+  std::vector<const char *> args;
+  for (size_t k = 0, left = folders.size(); left; k++) {
+    left = 0;
+    for (size_t f = 0; f < folders.size(); f++) {
+      std::vector<Entry> &entries = folders[f].second;
+      if (k >= orders[f].size())
+        continue;
+      left++;
+      int i = orders[f][k];
+      Project::Entry &entry = entries[i];
+      std::string reason;
+      if (gi.shards > 1 &&
+          hashUsr(entry.filename) % gi.shards != uint64_t(gi.shard)) {
+        LOG_V(1) << "[" << i << "/" << entries.size()
+                 << "]: in another shard; skip " << entry.filename;
+      } else if (match.matches(entry.filename, &reason) &&
+                 match_i.matches(entry.filename, &reason)) {
+        bool interactive = wfiles->getFile(entry.filename) != nullptr;
+        args = std::move(entry.args);
+        args.insert(args.end(), extra_args1.begin(), extra_args1.end());
+        args.push_back(entry.working_dir_arg);
+        pipeline::index(entry.filename, args,
+                        interactive ? IndexMode::Normal
+                                    : IndexMode::Background,
+                        false, id);
+      } else {
+        LOG_V(1) << "[" << i << "/" << entries.size() << "]: " << reason
+                 << "; skip " << entry.filename;
       }
     }
   }
@@ -641,26 +996,60 @@ void Project::index(WorkingFiles *wfiles, const RequestId &id) {
   pipeline::index("", {}, IndexMode::Background, false);
 }
 
+bool Project::isMainFile(const std::string &path) {
+  std::shared_lock lock(mtx);
+  for (auto &[root, folder] : root2folder)
+    if (StringRef(path).startswith(root)) {
+      auto it = folder.path2entry_index.find(path);
+      if (it != folder.path2entry_index.end() &&
+          folder.entries[it->second].filename == path)
+        return true;
+    }
+  return false;
+}
+
 void Project::indexRelated(const std::string &path) {
   auto &gi = g_config->index;
   GroupMatch match(gi.whitelist, gi.blacklist);
-  StringRef stem = sys::path::stem(path);
-  std::vector<const char *> args, extra_args;
-  for (const std::string &arg : g_config->clang.extraArgs)
-    extra_args.push_back(intern(arg));
-  std::lock_guard lock(mtx);
+  std::string stem = sys::path::stem(path).str();
+  std::vector<std::pair<std::string, std::vector<const char *>>> related;
+  {
+    std::shared_lock lock(mtx);
+    for (auto &[root, folder] : root2folder)
+      if (StringRef(path).startswith(root)) {
+        auto it = folder.stem2entries.find(stem);
+        if (it != folder.stem2entries.end())
+          for (int i : it->second) {
+            const Project::Entry &entry = folder.entries[i];
+            std::string reason;
+            if (entry.filename == path ||
+                !match.matches(entry.filename, &reason))
+              continue;
+            auto &args =
+                related.emplace_back(entry.filename, entry.args).second;
+            args.insert(args.end(), extra_args.begin(), extra_args.end());
+            args.push_back(entry.working_dir_arg);
+          }
+        break;
+      }
+  }
+  for (auto &[filename, args] : related)
+    pipeline::index(filename, args, IndexMode::Background, true);
+}
+
+std::vector<std::string> Project::relatedEntries(const std::string &path) {
+  std::string stem = sys::path::stem(path).str();
+  std::vector<std::string> ret;
+  std::shared_lock lock(mtx);
   for (auto &[root, folder] : root2folder)
     if (StringRef(path).startswith(root)) {
-      for (const Project::Entry &entry : folder.entries) {
-        std::string reason;
-        args = entry.args;
-        args.insert(args.end(), extra_args.begin(), extra_args.end());
-        args.push_back(intern("-working-directory=" + entry.directory));
-        if (sys::path::stem(entry.filename) == stem && entry.filename != path &&
-            match.matches(entry.filename, &reason))
-          pipeline::index(entry.filename, args, IndexMode::Background, true);
-      }
+      auto it = folder.stem2entries.find(stem);
+      if (it != folder.stem2entries.end())
+        for (int i : it->second)
+          if (folder.entries[i].filename != path)
+            ret.push_back(folder.entries[i].filename);
       break;
     }
+  return ret;
 }
 } // namespace ccls
@@ -8,6 +8,7 @@
 
 #include <functional>
 #include <mutex>
+#include <shared_mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -27,7 +28,13 @@ struct Project {
     bool is_inferred = false;
     // 0 unless coming from a compile_commands.json entry.
     int compdb_size = 0;
+    // Hash of the compile_commands.json entry, so that Project::load reuses
+    // the normalized entry if it is unchanged. 0 if not from one.
+    uint64_t compdb_hash = 0;
     int id = -1;
+    // Interned "-working-directory=" + directory, appended with extra_args
+    // when the entry is indexed. Set by load.
+    const char *working_dir_arg = nullptr;
   };
 
   struct Folder {
@@ -35,11 +42,29 @@ struct Project {
     std::unordered_map<std::string, int> search_dir2kind;
     std::vector<Entry> entries;
     std::unordered_map<std::string, int> path2entry_index;
+    // Indices of compile_commands.json entries sorted by filename, so that
+    // the entries under a directory are a range.
+    std::vector<int> sorted_entries;
+    // Indices of entries by the stem of their filename, for foo.h <-> foo.cc
+    // in indexRelated and relatedEntries.
+    std::unordered_map<std::string, std::vector<int>> stem2entries;
     std::unordered_map<std::string, std::vector<const char *>> dot_ccls;
   };
 
-  std::mutex mtx;
+  // Exclusive to modify root2folder, shared to look up entries, so that
+  // findEntry on indexer threads and didOpen do not serialize.
+  std::shared_mutex mtx;
   std::unordered_map<std::string, Folder> root2folder;
+  // Interned clang.extraArgs. Set by load.
+  std::vector<const char *> extra_args;
+  // Memoized findEntry inference: path => (root, index in entries). Cleared
+  // by load. Guarded by inferred_mtx, as findEntry holds mtx shared.
+  std::mutex inferred_mtx;
+  std::unordered_map<std::string, std::pair<std::string, int>> inferred;
+  // Files opened recently, most recent first, persisted as
+  // $cache.directory/ccls.history to order the initial index. Guarded by mtx.
+  std::vector<std::string> history;
+  bool history_loaded = false;
 
   // Loads a project for the given |directory|.
   //
@@ -53,18 +78,32 @@ struct Project {
   // are indexed.
   void load(const std::string &root);
   void loadDirectory(const std::string &root, Folder &folder);
+  // Like load, then returns the entries which are new or whose arguments
+  // changed, and adds the files of removed entries to |removed|.
+  std::vector<Entry> reload(const std::string &root,
+                            std::vector<std::string> &removed);
 
   // Lookup the CompilationEntry for |filename|. If no entry was found this
   // will infer one based on existing project structure.
   Entry findEntry(const std::string &path, bool can_redirect, bool must_exist);
 
+  // Returns whether |path| is the main file of a project entry.
+  bool isMainFile(const std::string &path);
+
   // If the client has overridden the flags, or specified them for a file
   // that is not in the compilation_database.json make sure those changes
   // are permanent.
   void setArgsForFile(const std::vector<const char *> &args,
                       const std::string &path);
 
-  void index(WorkingFiles *wfiles, const RequestId &id);
+  // Records that |path| was opened. See index.recentFiles.
+  void noteOpened(const std::string &path);
+
+  // Queues the entries of |roots|, or of all folders if empty.
+  void index(WorkingFiles *wfiles, const RequestId &id,
+             const std::vector<std::string> &roots = {});
   void indexRelated(const std::string &path);
+  // Returns the entries of the folder of |path| with the same stem.
+  std::vector<std::string> relatedEntries(const std::string &path);
 };
 } // namespace ccls
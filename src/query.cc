@@ -4,14 +4,21 @@
 #include "query.hh"
 
 #include "indexer.hh"
+#include "log.hh"
 #include "pipeline.hh"
 #include "serializer.hh"
+#include "trace.hh"
+
+#include <llvm/ADT/DenseSet.h>
 
 #include <rapidjson/document.h>
 
+#include <algorithm>
 #include <assert.h>
+#include <ctype.h>
 #include <functional>
 #include <limits.h>
+#include <mutex>
 #include <optional>
 #include <stdint.h>
 #include <string>
@@ -28,12 +35,12 @@ void assignFileId(const Lid2file_id &lid2file_id, int file_id, Use &use) {
 }
 
 template <typename T>
-void addRange(std::vector<T> &into, const std::vector<T> &from) {
+void addRange(std::vector<T> &into, llvm::ArrayRef<T> from) {
   into.insert(into.end(), from.begin(), from.end());
 }
 
 template <typename T>
-void removeRange(std::vector<T> &from, const std::vector<T> &to_remove) {
+void removeRange(std::vector<T> &from, llvm::ArrayRef<T> to_remove) {
   if (to_remove.size()) {
     std::unordered_set<T> to_remove_set(to_remove.begin(), to_remove.end());
     from.erase(
@@ -43,16 +50,79 @@ void removeRange(std::vector<T> &from, const std::vector<T> &to_remove) {
   }
 }
 
+bool sameItem(Usr l, Usr r) { return l == r; }
+// Use::operator== ignores the role, which is stored in the DB.
+bool sameItem(const Use &l, const Use &r) {
+  return l.range == r.range && l.role == r.role && l.file_id == r.file_id;
+}
+bool sameItem(const DeclRef &l, const DeclRef &r) {
+  return sameItem(static_cast<const Use &>(l), r) && l.extent == r.extent;
+}
+
+// Collects the elements of each entity of the previous and the current
+// IndexFile, then lays them out in an Update<T>.
+//
+// If |prune| is set (the lids of both IndexFiles refer to the same files), an
+// entity whose elements are unchanged gets no entry, so that a no-op
+// re-index leaves the DB alone.
+template <typename T> struct UpdateBuilder {
+  struct Source {
+    Usr usr;
+    bool added;
+    const std::vector<T> *items;
+  };
+  std::vector<Source> sources;
+  bool prune = false;
+
+  void add(Usr usr, bool added, const std::vector<T> &items) {
+    sources.push_back({usr, added, &items});
+  }
+  void build(Update<T> &u) {
+    std::sort(sources.begin(), sources.end(),
+              [](const Source &l, const Source &r) {
+                return l.usr < r.usr || (l.usr == r.usr && l.added < r.added);
+              });
+    size_t n = 0;
+    for (const Source &src : sources)
+      n += src.items->size();
+    u.entries.reserve(sources.size());
+    u.items.reserve(n);
+    auto append = [&](const Source &src) {
+      u.items.insert(u.items.end(), src.items->begin(), src.items->end());
+    };
+    for (size_t i = 0; i < sources.size();) {
+      Usr usr = sources[i].usr;
+      if (prune && !sources[i].added && i + 1 < sources.size() &&
+          sources[i + 1].usr == usr &&
+          std::equal(sources[i].items->begin(), sources[i].items->end(),
+                     sources[i + 1].items->begin(), sources[i + 1].items->end(),
+                     [](const T &l, const T &r) { return sameItem(l, r); })) {
+        i += 2;
+        continue;
+      }
+      uint32_t begin = u.items.size();
+      if (!sources[i].added)
+        append(sources[i++]);
+      uint32_t mid = u.items.size();
+      if (i < sources.size() && sources[i].usr == usr)
+        append(sources[i++]);
+      u.entries.push_back({usr, begin, mid, uint32_t(u.items.size())});
+    }
+  }
+};
+
 QueryFile::DefUpdate buildFileDefUpdate(IndexFile &&indexed) {
   QueryFile::Def def;
   def.path = std::move(indexed.path);
-  def.args = std::move(indexed.args);
+  def.args = internArgs(indexed.args);
   def.includes = std::move(indexed.includes);
   def.skipped_ranges = std::move(indexed.skipped_ranges);
   def.dependencies.reserve(indexed.dependencies.size());
   for (auto &dep : indexed.dependencies)
     def.dependencies.push_back(dep.first.val().data()); // llvm 8 -> data()
   def.language = indexed.language;
+  def.mtime = indexed.mtime;
+  def.partial = indexed.partial;
   return {std::move(def), std::move(indexed.file_contents)};
 }
 
@@ -67,6 +137,40 @@ bool tryReplaceDef(llvm::SmallVectorImpl<Q> &def_list, Q &&def) {
   return false;
 }
 
+// A pending change to QueryFile::symbol2refcnt, produced by a USR shard and
+// consumed by a file_id shard.
+struct RefcntDelta {
+  int file_id;
+  int delta;
+  ExtentRef sym;
+};
+
+template <typename Q>
+EntityId allocEntity(llvm::DenseMap<Usr, int, DenseMapInfoForUsr> &entity_usr,
+                     llvm::SmallVectorImpl<Q> &entities, Usr usr) {
+  auto r = entity_usr.try_emplace(usr, entity_usr.size());
+  if (r.second) {
+    entities.emplace_back();
+    entities.back().usr = usr;
+  }
+  return r.first->second;
+}
+
+// See SymbolIndex.
+uint64_t charMask(std::string_view name) {
+  uint64_t mask = 0;
+  for (unsigned char c : name)
+    if (isalpha(c))
+      mask |= uint64_t(1) << (tolower(c) - 'a');
+    else if (isdigit(c))
+      mask |= uint64_t(1) << (26 + c - '0');
+    else if (c == '_')
+      mask |= uint64_t(1) << 36;
+    else if (c >= 128)
+      mask |= uint64_t(1) << 37;
+  return mask;
+}
+
 } // namespace
 
 template <typename T> Vec<T> convert(const std::vector<T> &o) {
@@ -114,74 +218,422 @@ QueryType::Def convert(const IndexType::Def &o) {
   return r;
 }
 
-IndexUpdate IndexUpdate::createDelta(IndexFile *previous, IndexFile *current) {
+namespace {
+template <typename T> size_t bytes(const std::vector<T> &v) {
+  return v.capacity() * sizeof(T);
+}
+template <typename T> size_t bytes(const Update<T> &u) {
+  return bytes(u.entries) + bytes(u.items);
+}
+
+// Keeps the removed elements of |u| and takes the added elements of |next|.
+// An entity missing from one side is unchanged by it (or absent from both of
+// its IndexFiles), so the other side's entry is taken as is.
+template <typename T> void composeUpdate(Update<T> &u, Update<T> &next) {
+  Update<T> r;
+  r.entries.reserve(u.entries.size() + next.entries.size());
+  r.items.reserve(u.items.size() + next.items.size());
+  auto i = u.entries.begin(), ie = u.entries.end();
+  auto j = next.entries.begin(), je = next.entries.end();
+  while (i != ie || j != je) {
+    Usr usr = j == je || (i != ie && i->usr < j->usr) ? i->usr : j->usr;
+    bool in_u = i != ie && i->usr == usr, in_next = j != je && j->usr == usr;
+    uint32_t begin = r.items.size();
+    if (in_u)
+      r.items.insert(r.items.end(), u.items.begin() + i->begin,
+                     u.items.begin() + i->mid);
+    else
+      r.items.insert(r.items.end(), next.items.begin() + j->begin,
+                     next.items.begin() + j->mid);
+    uint32_t mid = r.items.size();
+    if (in_next)
+      r.items.insert(r.items.end(), next.items.begin() + j->mid,
+                     next.items.begin() + j->end);
+    else
+      r.items.insert(r.items.end(), u.items.begin() + i->mid,
+                     u.items.begin() + i->end);
+    r.entries.push_back({usr, begin, mid, uint32_t(r.items.size())});
+    i += in_u;
+    j += in_next;
+  }
+  u = std::move(r);
+}
+
+// Whether each entity in both |u| and |next| has as many elements added by |u|
+// as removed by |next|.
+template <typename T>
+bool composeCounts(const Update<T> &u, const Update<T> &next) {
+  auto i = u.entries.begin(), ie = u.entries.end();
+  auto j = next.entries.begin(), je = next.entries.end();
+  while (i != ie && j != je)
+    if (i->usr < j->usr)
+      ++i;
+    else if (j->usr < i->usr)
+      ++j;
+    else if (i->end - i->mid != j->mid - j->begin)
+      return false;
+    else
+      ++i, ++j;
+  return true;
+}
+} // namespace
+
+bool IndexUpdate::compose(IndexUpdate &&next) {
+  if (refresh || next.refresh || files_removed || next.files_removed ||
+      !files_def_update || !next.files_def_update ||
+      files_def_update->first.path != next.files_def_update->first.path)
+    return false;
+  // |next| must have been computed against the result of this update, which
+  // holds when both come from consecutive cache writes of the file.
+  if (lid2path != next.prev_lid2path ||
+      funcs_def_update.size() != next.funcs_removed.size() ||
+      types_def_update.size() != next.types_removed.size() ||
+      vars_def_update.size() != next.vars_removed.size())
+    return false;
+  auto counts = {composeCounts(funcs_declarations, next.funcs_declarations),
+                 composeCounts(funcs_uses, next.funcs_uses),
+                 composeCounts(funcs_derived, next.funcs_derived),
+                 composeCounts(types_declarations, next.types_declarations),
+                 composeCounts(types_uses, next.types_uses),
+                 composeCounts(types_derived, next.types_derived),
+                 composeCounts(types_instances, next.types_instances),
+                 composeCounts(vars_declarations, next.vars_declarations),
+                 composeCounts(vars_uses, next.vars_uses)};
+  for (bool c : counts)
+    if (!c)
+      return false;
+
+  lid2path = std::move(next.lid2path);
+  files_def_update = std::move(next.files_def_update);
+
+  funcs_hint += next.funcs_hint;
+  funcs_def_update = std::move(next.funcs_def_update);
+  composeUpdate(funcs_declarations, next.funcs_declarations);
+  composeUpdate(funcs_uses, next.funcs_uses);
+  composeUpdate(funcs_derived, next.funcs_derived);
+
+  types_hint += next.types_hint;
+  types_def_update = std::move(next.types_def_update);
+  composeUpdate(types_declarations, next.types_declarations);
+  composeUpdate(types_uses, next.types_uses);
+  composeUpdate(types_derived, next.types_derived);
+  composeUpdate(types_instances, next.types_instances);
+
+  vars_hint += next.vars_hint;
+  vars_def_update = std::move(next.vars_def_update);
+  composeUpdate(vars_declarations, next.vars_declarations);
+  composeUpdate(vars_uses, next.vars_uses);
+  return true;
+}
+
+size_t IndexUpdate::estimateBytes() const {
+  size_t n = sizeof(*this) + bytes(prev_lid2path) + bytes(lid2path);
+  if (files_def_update)
+    n += files_def_update->second.size();
+  n += bytes(funcs_removed) + bytes(funcs_def_update) +
+       bytes(funcs_declarations) + bytes(funcs_uses) + bytes(funcs_derived);
+  n += bytes(types_removed) + bytes(types_def_update) +
+       bytes(types_declarations) + bytes(types_uses) + bytes(types_derived) +
+       bytes(types_instances);
+  n += bytes(vars_removed) + bytes(vars_def_update) +
+       bytes(vars_declarations) + bytes(vars_uses);
+  return n;
+}
+
+IndexUpdate IndexUpdate::createDelta(const IndexFile *previous,
+                                     IndexFile *current) {
+  trace::Span span("createDelta");
   IndexUpdate r;
   static IndexFile empty(current->path, "<empty>", false);
+  // |previous| may be shared with g_index; copy rather than move from it.
   if (previous)
-    r.prev_lid2path = std::move(previous->lid2path);
+    r.prev_lid2path = previous->lid2path;
   else
     previous = &empty;
   r.lid2path = std::move(current->lid2path);
 
+  UpdateBuilder<DeclRef> funcs_declarations, types_declarations,
+      vars_declarations;
+  UpdateBuilder<Use> funcs_uses, types_uses, vars_uses;
+  UpdateBuilder<Usr> funcs_derived, types_derived, types_instances;
+  bool prune = r.prev_lid2path == r.lid2path;
+  for (auto *b : {&funcs_declarations, &types_declarations, &vars_declarations})
+    b->prune = prune;
+  for (auto *b : {&funcs_uses, &types_uses, &vars_uses})
+    b->prune = prune;
+  for (auto *b : {&funcs_derived, &types_derived, &types_instances})
+    b->prune = prune;
+
   r.funcs_hint = int(current->usr2func.size() - previous->usr2func.size());
   for (auto &it : previous->usr2func) {
     auto &func = it.second;
     if (func.def.detailed_name[0])
       r.funcs_removed.emplace_back(func.usr, convert(func.def));
-    r.funcs_declarations[func.usr].first = std::move(func.declarations);
-    r.funcs_uses[func.usr].first = std::move(func.uses);
-    r.funcs_derived[func.usr].first = std::move(func.derived);
+    funcs_declarations.add(func.usr, false, func.declarations);
+    funcs_uses.add(func.usr, false, func.uses);
+    funcs_derived.add(func.usr, false, func.derived);
   }
   for (auto &it : current->usr2func) {
     auto &func = it.second;
     if (func.def.detailed_name[0])
       r.funcs_def_update.emplace_back(it.first, convert(func.def));
-    r.funcs_declarations[func.usr].second = std::move(func.declarations);
-    r.funcs_uses[func.usr].second = std::move(func.uses);
-    r.funcs_derived[func.usr].second = std::move(func.derived);
+    funcs_declarations.add(func.usr, true, func.declarations);
+    funcs_uses.add(func.usr, true, func.uses);
+    funcs_derived.add(func.usr, true, func.derived);
   }
+  funcs_declarations.build(r.funcs_declarations);
+  funcs_uses.build(r.funcs_uses);
+  funcs_derived.build(r.funcs_derived);
 
   r.types_hint = int(current->usr2type.size() - previous->usr2type.size());
   for (auto &it : previous->usr2type) {
     auto &type = it.second;
     if (type.def.detailed_name[0])
       r.types_removed.emplace_back(type.usr, convert(type.def));
-    r.types_declarations[type.usr].first = std::move(type.declarations);
-    r.types_uses[type.usr].first = std::move(type.uses);
-    r.types_derived[type.usr].first = std::move(type.derived);
-    r.types_instances[type.usr].first = std::move(type.instances);
+    types_declarations.add(type.usr, false, type.declarations);
+    types_uses.add(type.usr, false, type.uses);
+    types_derived.add(type.usr, false, type.derived);
+    types_instances.add(type.usr, false, type.instances);
   };
   for (auto &it : current->usr2type) {
     auto &type = it.second;
     if (type.def.detailed_name[0])
       r.types_def_update.emplace_back(it.first, convert(type.def));
-    r.types_declarations[type.usr].second = std::move(type.declarations);
-    r.types_uses[type.usr].second = std::move(type.uses);
-    r.types_derived[type.usr].second = std::move(type.derived);
-    r.types_instances[type.usr].second = std::move(type.instances);
+    types_declarations.add(type.usr, true, type.declarations);
+    types_uses.add(type.usr, true, type.uses);
+    types_derived.add(type.usr, true, type.derived);
+    types_instances.add(type.usr, true, type.instances);
   };
+  types_declarations.build(r.types_declarations);
+  types_uses.build(r.types_uses);
+  types_derived.build(r.types_derived);
+  types_instances.build(r.types_instances);
 
   r.vars_hint = int(current->usr2var.size() - previous->usr2var.size());
   for (auto &it : previous->usr2var) {
     auto &var = it.second;
     if (var.def.detailed_name[0])
       r.vars_removed.emplace_back(var.usr, var.def);
-    r.vars_declarations[var.usr].first = std::move(var.declarations);
-    r.vars_uses[var.usr].first = std::move(var.uses);
+    vars_declarations.add(var.usr, false, var.declarations);
+    vars_uses.add(var.usr, false, var.uses);
   }
   for (auto &it : current->usr2var) {
     auto &var = it.second;
     if (var.def.detailed_name[0])
       r.vars_def_update.emplace_back(it.first, var.def);
-    r.vars_declarations[var.usr].second = std::move(var.declarations);
-    r.vars_uses[var.usr].second = std::move(var.uses);
+    vars_declarations.add(var.usr, true, var.declarations);
+    vars_uses.add(var.usr, true, var.uses);
   }
+  vars_declarations.build(r.vars_declarations);
+  vars_uses.build(r.vars_uses);
 
   r.files_def_update = buildFileDefUpdate(std::move(*current));
   return r;
 }
 
+std::vector<UseList::Group>::iterator UseList::lowerBound(int file_id) {
+  return std::lower_bound(
+      groups.begin(), groups.end(), file_id,
+      [](const Group &g, int file_id) { return g.file_id < file_id; });
+}
+
+void UseList::add(llvm::ArrayRef<Use> uses) {
+  Group *g = nullptr;
+  for (const Use &use : uses) {
+    if (!g || g->file_id != use.file_id) {
+      auto it = lowerBound(use.file_id);
+      if (it == groups.end() || it->file_id != use.file_id)
+        it = groups.insert(it, {use.file_id, {}, {}});
+      g = &*it;
+    }
+    g->ranges.push_back(use.range);
+    g->roles.push_back(use.role);
+  }
+  n += uses.size();
+}
+
+void UseList::remove(llvm::ArrayRef<Use> uses) {
+  if (uses.empty())
+    return;
+  std::unordered_set<Use> to_remove(uses.begin(), uses.end());
+  std::vector<int> file_ids;
+  for (const Use &use : uses)
+    file_ids.push_back(use.file_id);
+  std::sort(file_ids.begin(), file_ids.end());
+  file_ids.erase(std::unique(file_ids.begin(), file_ids.end()), file_ids.end());
+  for (int file_id : file_ids) {
+    auto it = lowerBound(file_id);
+    if (it == groups.end() || it->file_id != file_id)
+      continue;
+    auto &ranges = it->ranges;
+    auto &roles = it->roles;
+    size_t j = 0;
+    for (size_t i = 0; i < ranges.size(); i++)
+      if (!to_remove.count(Use{{ranges[i], roles[i]}, file_id})) {
+        ranges[j] = ranges[i];
+        roles[j++] = roles[i];
+      }
+    n -= ranges.size() - j;
+    if (!j) {
+      groups.erase(it);
+    } else {
+      ranges.resize(j);
+      roles.resize(j);
+    }
+  }
+}
+
+void SymbolIndex::clear() {
+  entries.clear();
+  for (auto &p : postings)
+    p.clear();
+  for (auto &m : state)
+    m.clear();
+  names.clear();
+  n_live = n_dead = 0;
+}
+
+void SymbolIndex::insert(SymbolIdx sym, std::string_view qualified,
+                         std::string_view short_name) {
+  uint64_t mask = charMask(qualified);
+  llvm::StringRef name(short_name.data(), short_name.size());
+  auto &m = state[int(sym.kind) - int(Kind::Type)];
+  auto it = m.find(sym.usr);
+  if (it != m.end() && entries[it->second].sym.kind != Kind::Invalid) {
+    Entry &e = entries[it->second];
+    auto it1 = names.find(name);
+    if (e.mask == mask && it1 != names.end() &&
+        llvm::is_contained(it1->second, it->second))
+      return;
+    // The names have changed. Postings are append-only, so replace the entry
+    // rather than editing it; this also leaves the old |names| bucket.
+    kill(e);
+  }
+  uint32_t i = entries.size();
+  m[sym.usr] = i;
+  entries.push_back({sym, mask});
+  for (int c = 0; c < kChars; c++)
+    if (mask >> c & 1)
+      postings[c].push_back(i);
+  names[name].push_back(i);
+  n_live++;
+  if (n_dead > std::max(n_live, size_t(1024)))
+    compact();
+}
+
+void SymbolIndex::kill(Entry &e) {
+  e.sym.kind = Kind::Invalid;
+  n_live--;
+  n_dead++;
+}
+
+void SymbolIndex::erase(SymbolIdx sym) {
+  auto &m = state[int(sym.kind) - int(Kind::Type)];
+  auto it = m.find(sym.usr);
+  if (it == m.end() || entries[it->second].sym.kind == Kind::Invalid)
+    return;
+  kill(entries[it->second]);
+  if (n_dead > std::max(n_live, size_t(1024)))
+    compact();
+}
+
+void SymbolIndex::compact() {
+  std::vector<uint32_t> remap(entries.size(), UINT32_MAX);
+  for (auto &m : state)
+    m.clear();
+  for (auto &p : postings)
+    p.clear();
+  uint32_t j = 0;
+  for (uint32_t i = 0; i < entries.size(); i++) {
+    Entry e = entries[i];
+    if (e.sym.kind == Kind::Invalid)
+      continue;
+    remap[i] = j;
+    state[int(e.sym.kind) - int(Kind::Type)][e.sym.usr] = j;
+    for (int c = 0; c < kChars; c++)
+      if (e.mask >> c & 1)
+        postings[c].push_back(j);
+    entries[j++] = e;
+  }
+  entries.resize(j);
+  for (auto it = names.begin(); it != names.end();) {
+    auto cur = it++;
+    auto &ids = cur->second;
+    size_t k = 0;
+    for (uint32_t i : ids)
+      if (remap[i] != UINT32_MAX)
+        ids[k++] = remap[i];
+    ids.resize(k);
+    if (ids.empty())
+      names.erase(cur);
+  }
+  n_dead = 0;
+}
+
+bool SymbolIndex::lookup(std::string_view query,
+                         llvm::function_ref<bool(SymbolIdx)> fn) const {
+  uint64_t mask = charMask(query);
+  if (!mask)
+    return false;
+  // Intersect the posting lists by walking the rarest one and testing the
+  // others through the masks.
+  const std::vector<uint32_t> *rarest = nullptr;
+  for (int c = 0; c < kChars; c++)
+    if (mask >> c & 1 && (!rarest || postings[c].size() < rarest->size()))
+      rarest = &postings[c];
+  for (uint32_t i : *rarest) {
+    const Entry &e = entries[i];
+    if ((e.mask & mask) == mask && e.sym.kind != Kind::Invalid && fn(e.sym))
+      break;
+  }
+  return true;
+}
+
+void SymbolIndex::lookupName(std::string_view short_name,
+                             llvm::function_ref<void(SymbolIdx)> fn) const {
+  auto it = names.find(llvm::StringRef(short_name.data(), short_name.size()));
+  if (it == names.end())
+    return;
+  for (uint32_t i : it->second)
+    if (entries[i].sym.kind != Kind::Invalid)
+      fn(entries[i].sym);
+}
+
+bool SymbolRefcnt::commit() {
+  if (pending.empty())
+    return false;
+  std::sort(pending.begin(), pending.end(),
+            [](auto &l, auto &r) { return less(l.first, r.first); });
+  std::vector<value_type> merged;
+  merged.reserve(items.size() + pending.size());
+  auto it = items.begin();
+  for (size_t i = 0; i < pending.size();) {
+    const ExtentRef &sym = pending[i].first;
+    int cnt = 0;
+    for (; i < pending.size() && pending[i].first == sym; i++)
+      cnt += pending[i].second;
+    for (; it != items.end() && less(it->first, sym); ++it)
+      merged.push_back(*it);
+    if (it != items.end() && it->first == sym)
+      cnt += (it++)->second;
+    assert(cnt >= 0);
+    if (cnt > 0)
+      merged.push_back({sym, cnt});
+  }
+  merged.insert(merged.end(), it, items.end());
+  items = std::move(merged);
+  std::vector<value_type>().swap(pending);
+  return true;
+}
+
 void DB::clear() {
+  generation++;
+  clearHierarchy();
+  symbol_index.clear();
+  {
+    std::lock_guard lock(*file_sets_mutex);
+    file_sets.clear();
+  }
   files.clear();
   name2file_id.clear();
   func_usr.clear();
@@ -192,71 +644,131 @@ void DB::clear() {
   vars.clear();
 }
 
-template <typename Def>
-void DB::removeUsrs(Kind kind, int file_id,
-                    const std::vector<std::pair<Usr, Def>> &to_remove) {
-  switch (kind) {
-  case Kind::Func: {
-    for (auto &[usr, _] : to_remove) {
-      // FIXME
-      if (!hasFunc(usr))
-        continue;
-      QueryFunc &func = getFunc(usr);
-      auto it = llvm::find_if(func.def, [=](const QueryFunc::Def &def) {
-        return def.file_id == file_id;
-      });
-      if (it != func.def.end())
-        func.def.erase(it);
+namespace {
+bool unused(const QueryFunc &e) {
+  return e.def.empty() && e.declarations.empty() && e.uses.empty() &&
+         e.derived.empty();
+}
+bool unused(const QueryType &e) {
+  return e.def.empty() && e.declarations.empty() && e.uses.empty() &&
+         e.derived.empty() && e.instances.empty();
+}
+bool unused(const QueryVar &e) {
+  return e.def.empty() && e.declarations.empty() && e.uses.empty();
+}
+
+// Marks the unused entities which no relation refers to. Returns how many.
+template <typename Q>
+size_t findGarbage(const llvm::SmallVectorImpl<Q> &entities,
+                   const std::vector<bool> &referenced,
+                   std::vector<bool> &garbage) {
+  garbage.assign(entities.size(), false);
+  size_t n = 0;
+  for (size_t i = 0; i < entities.size(); i++)
+    if (!referenced[i] && unused(entities[i])) {
+      garbage[i] = true;
+      n++;
     }
-    break;
-  }
-  case Kind::Type: {
-    for (auto &[usr, _] : to_remove) {
-      // FIXME
-      if (!hasType(usr))
-        continue;
-      QueryType &type = getType(usr);
-      auto it = llvm::find_if(type.def, [=](const QueryType::Def &def) {
-        return def.file_id == file_id;
-      });
-      if (it != type.def.end())
-        type.def.erase(it);
+  return n;
+}
+
+// Moves the entities not in |garbage| into a new array and rebuilds
+// |entity_usr|. Returns old id => new id.
+template <typename Q>
+std::vector<EntityId>
+compactEntities(llvm::DenseMap<Usr, int, DenseMapInfoForUsr> &entity_usr,
+                llvm::SmallVector<Q, 0> &entities,
+                const std::vector<bool> &garbage, size_t n_garbage) {
+  std::vector<EntityId> remap(entities.size(), EntityId(-1));
+  llvm::SmallVector<Q, 0> live;
+  live.reserve(entities.size() - n_garbage);
+  for (size_t i = 0; i < entities.size(); i++)
+    if (!garbage[i]) {
+      remap[i] = live.size();
+      live.push_back(std::move(entities[i]));
     }
-    break;
+  entities = std::move(live);
+  entity_usr.clear();
+  entity_usr.reserve(entities.size());
+  for (size_t i = 0; i < entities.size(); i++)
+    entity_usr[entities[i].usr] = i;
+  return remap;
+}
+
+void remapIds(std::vector<EntityId> &ids, const std::vector<EntityId> &remap) {
+  for (EntityId &id : ids)
+    id = remap[id];
+}
+} // namespace
+
+bool DB::compact(int percent) {
+  if (percent <= 0)
+    return false;
+  // Files which were deleted keep their ids, which are referenced everywhere,
+  // but not their memory.
+  for (QueryFile &file : files)
+    if (!file.def && file.symbol2refcnt.empty() &&
+        file.symbol2refcnt.getMemorySize()) {
+      file.symbol2refcnt.shrink_and_clear();
+      file.clearSorted();
+      file.sorted_symbols.shrink_to_fit();
+      file.func_extents.shrink_to_fit();
+      file.symbol_occurrences.shrink_to_fit();
+    }
+
+  auto exceeds = [&](size_t n, size_t total) {
+    return n && n * 100 >= total * size_t(percent);
+  };
+  std::vector<bool> referenced, garbage;
+  const char *kind = nullptr;
+  size_t n, total;
+  referenced.assign(funcs.size(), false);
+  for (QueryFunc &func : funcs)
+    for (EntityId id : func.derived)
+      referenced[id] = true;
+  if (exceeds(n = findGarbage(funcs, referenced, garbage),
+              total = funcs.size())) {
+    auto remap = compactEntities(func_usr, funcs, garbage, n);
+    for (QueryFunc &func : funcs)
+      remapIds(func.derived, remap);
+    kind = "funcs";
   }
-  case Kind::Var: {
-    for (auto &[usr, _] : to_remove) {
-      // FIXME
-      if (!hasVar(usr))
-        continue;
-      QueryVar &var = getVar(usr);
-      auto it = llvm::find_if(var.def, [=](const QueryVar::Def &def) {
-        return def.file_id == file_id;
-      });
-      if (it != var.def.end())
-        var.def.erase(it);
+  if (!kind) {
+    referenced.assign(types.size(), false);
+    for (QueryType &type : types)
+      for (EntityId id : type.derived)
+        referenced[id] = true;
+    if (exceeds(n = findGarbage(types, referenced, garbage),
+                total = types.size())) {
+      auto remap = compactEntities(type_usr, types, garbage, n);
+      for (QueryType &type : types)
+        remapIds(type.derived, remap);
+      kind = "types";
     }
-    break;
   }
-  default:
-    break;
+  if (!kind) {
+    referenced.assign(vars.size(), false);
+    for (QueryType &type : types)
+      for (EntityId id : type.instances)
+        referenced[id] = true;
+    if (exceeds(n = findGarbage(vars, referenced, garbage),
+                total = vars.size())) {
+      auto remap = compactEntities(var_usr, vars, garbage, n);
+      for (QueryType &type : types)
+        remapIds(type.instances, remap);
+      kind = "vars";
+    }
   }
+  if (!kind)
+    return false;
+  LOG_S(INFO) << "compacted " << n << " of " << total << " " << kind;
+  clearHierarchy();
+  generation++;
+  return true;
 }
 
-void DB::applyIndexUpdate(IndexUpdate *u) {
-#define REMOVE_ADD(C, F)                                                       \
-  for (auto &it : u->C##s_##F) {                                               \
-    auto r = C##_usr.try_emplace({it.first}, C##_usr.size());                  \
-    if (r.second) {                                                            \
-      C##s.emplace_back();                                                     \
-      C##s.back().usr = it.first;                                              \
-    }                                                                          \
-    auto &entity = C##s[r.first->second];                                      \
-    removeRange(entity.F, it.second.first);                                    \
-    addRange(entity.F, it.second.second);                                      \
-  }
-
-  std::unordered_map<int, int> prev_lid2file_id, lid2file_id;
+void DB::assignFileIds(IndexUpdate *u, Lid2file_id &prev_lid2file_id,
+                       Lid2file_id &lid2file_id) {
   for (auto &[lid, path] : u->prev_lid2path)
     prev_lid2file_id[lid] = getFileId(path);
   for (auto &[lid, path] : u->lid2path) {
@@ -265,222 +777,418 @@ void DB::applyIndexUpdate(IndexUpdate *u) {
     if (!files[file_id].def) {
       files[file_id].def = QueryFile::Def();
       files[file_id].def->path = path;
+      updateFileSets(file_id);
     }
   }
-
-  // References (Use &use) in this function are important to update file_id.
-  auto ref = [&](std::unordered_map<int, int> &lid2fid, Usr usr, Kind kind,
-                 Use &use, int delta) {
-    use.file_id =
-        use.file_id == -1 ? u->file_id : lid2fid.find(use.file_id)->second;
-    ExtentRef sym{{use.range, usr, kind, use.role}};
-    int &v = files[use.file_id].symbol2refcnt[sym];
-    v += delta;
-    assert(v >= 0);
-    if (!v)
-      files[use.file_id].symbol2refcnt.erase(sym);
-  };
-  auto refDecl = [&](std::unordered_map<int, int> &lid2fid, Usr usr, Kind kind,
-                     DeclRef &dr, int delta) {
-    dr.file_id =
-        dr.file_id == -1 ? u->file_id : lid2fid.find(dr.file_id)->second;
-    ExtentRef sym{{dr.range, usr, kind, dr.role}, dr.extent};
-    int &v = files[dr.file_id].symbol2refcnt[sym];
-    v += delta;
-    assert(v >= 0);
-    if (!v)
-      files[dr.file_id].symbol2refcnt.erase(sym);
-  };
-
-  auto updateUses =
-      [&](Usr usr, Kind kind,
-          llvm::DenseMap<Usr, int, DenseMapInfoForUsr> &entity_usr,
-          auto &entities, auto &p, bool hint_implicit) {
-        auto r = entity_usr.try_emplace(usr, entity_usr.size());
-        if (r.second) {
-          entities.emplace_back();
-          entities.back().usr = usr;
-        }
-        auto &entity = entities[r.first->second];
-        for (Use &use : p.first) {
-          if (hint_implicit && use.role & Role::Implicit) {
-            // Make ranges of implicit function calls larger (spanning one more
-            // column to the left/right). This is hacky but useful. e.g.
-            // textDocument/definition on the space/semicolon in `A a;` or `
-            // 42;` will take you to the constructor.
-            if (use.range.start.column > 0)
-              use.range.start.column--;
-            use.range.end.column++;
-          }
-          ref(prev_lid2file_id, usr, kind, use, -1);
-        }
-        removeRange(entity.uses, p.first);
-        for (Use &use : p.second) {
-          if (hint_implicit && use.role & Role::Implicit) {
-            if (use.range.start.column > 0)
-              use.range.start.column--;
-            use.range.end.column++;
-          }
-          ref(lid2file_id, usr, kind, use, 1);
-        }
-        addRange(entity.uses, p.second);
-      };
-
-  if (u->files_removed)
-    files[name2file_id[lowerPathIfInsensitive(*u->files_removed)]].def =
-        std::nullopt;
+  if (u->files_removed) {
+    int file_id = name2file_id[lowerPathIfInsensitive(*u->files_removed)];
+    setFileDef(file_id, std::nullopt);
+    updateFileSets(file_id);
+  }
   u->file_id =
       u->files_def_update ? update(std::move(*u->files_def_update)) : -1;
+}
 
+void DB::reserveEntities(int funcs_hint, int types_hint, int vars_hint) {
+  // Grow geometrically, as updates are mostly applied one at a time.
   const double grow = 1.3;
   size_t t;
-
-  if ((t = funcs.size() + u->funcs_hint) > funcs.capacity()) {
+  if ((t = funcs.size() + std::max(funcs_hint, 0)) > funcs.capacity()) {
     t = size_t(t * grow);
     funcs.reserve(t);
     func_usr.reserve(t);
   }
-  for (auto &[usr, def] : u->funcs_removed)
-    if (def.spell)
-      refDecl(prev_lid2file_id, usr, Kind::Func, *def.spell, -1);
-  removeUsrs(Kind::Func, u->file_id, u->funcs_removed);
-  update(lid2file_id, u->file_id, std::move(u->funcs_def_update));
-  for (auto &[usr, del_add] : u->funcs_declarations) {
-    for (DeclRef &dr : del_add.first)
-      refDecl(prev_lid2file_id, usr, Kind::Func, dr, -1);
-    for (DeclRef &dr : del_add.second)
-      refDecl(lid2file_id, usr, Kind::Func, dr, 1);
-  }
-  REMOVE_ADD(func, declarations);
-  REMOVE_ADD(func, derived);
-  for (auto &[usr, p] : u->funcs_uses)
-    updateUses(usr, Kind::Func, func_usr, funcs, p, true);
-
-  if ((t = types.size() + u->types_hint) > types.capacity()) {
+  if ((t = types.size() + std::max(types_hint, 0)) > types.capacity()) {
     t = size_t(t * grow);
     types.reserve(t);
     type_usr.reserve(t);
   }
-  for (auto &[usr, def] : u->types_removed)
-    if (def.spell)
-      refDecl(prev_lid2file_id, usr, Kind::Type, *def.spell, -1);
-  removeUsrs(Kind::Type, u->file_id, u->types_removed);
-  update(lid2file_id, u->file_id, std::move(u->types_def_update));
-  for (auto &[usr, del_add] : u->types_declarations) {
-    for (DeclRef &dr : del_add.first)
-      refDecl(prev_lid2file_id, usr, Kind::Type, dr, -1);
-    for (DeclRef &dr : del_add.second)
-      refDecl(lid2file_id, usr, Kind::Type, dr, 1);
-  }
-  REMOVE_ADD(type, declarations);
-  REMOVE_ADD(type, derived);
-  REMOVE_ADD(type, instances);
-  for (auto &[usr, p] : u->types_uses)
-    updateUses(usr, Kind::Type, type_usr, types, p, false);
-
-  if ((t = vars.size() + u->vars_hint) > vars.capacity()) {
+  if ((t = vars.size() + std::max(vars_hint, 0)) > vars.capacity()) {
     t = size_t(t * grow);
     vars.reserve(t);
     var_usr.reserve(t);
   }
-  for (auto &[usr, def] : u->vars_removed)
-    if (def.spell)
-      refDecl(prev_lid2file_id, usr, Kind::Var, *def.spell, -1);
-  removeUsrs(Kind::Var, u->file_id, u->vars_removed);
-  update(lid2file_id, u->file_id, std::move(u->vars_def_update));
-  for (auto &[usr, del_add] : u->vars_declarations) {
-    for (DeclRef &dr : del_add.first)
-      refDecl(prev_lid2file_id, usr, Kind::Var, dr, -1);
-    for (DeclRef &dr : del_add.second)
-      refDecl(lid2file_id, usr, Kind::Var, dr, 1);
+}
+
+void DB::allocEntities(IndexUpdate *u) {
+  for (auto &[usr, _] : u->funcs_def_update)
+    allocEntity(func_usr, funcs, usr);
+  for (auto &e : u->funcs_declarations.entries)
+    allocEntity(func_usr, funcs, e.usr);
+  for (auto &e : u->funcs_derived.entries)
+    allocEntity(func_usr, funcs, e.usr);
+  for (auto &e : u->funcs_uses.entries)
+    allocEntity(func_usr, funcs, e.usr);
+  for (auto &[usr, _] : u->types_def_update)
+    allocEntity(type_usr, types, usr);
+  for (auto &e : u->types_declarations.entries)
+    allocEntity(type_usr, types, e.usr);
+  for (auto &e : u->types_derived.entries)
+    allocEntity(type_usr, types, e.usr);
+  for (auto &e : u->types_instances.entries)
+    allocEntity(type_usr, types, e.usr);
+  for (auto &e : u->types_uses.entries)
+    allocEntity(type_usr, types, e.usr);
+  for (auto &[usr, _] : u->vars_def_update)
+    allocEntity(var_usr, vars, usr);
+  for (auto &e : u->vars_declarations.entries)
+    allocEntity(var_usr, vars, e.usr);
+  for (auto &e : u->vars_uses.entries)
+    allocEntity(var_usr, vars, e.usr);
+  // Targets of relations stored as ids.
+  for (Usr usr : u->funcs_derived.items)
+    allocEntity(func_usr, funcs, usr);
+  for (Usr usr : u->types_derived.items)
+    allocEntity(type_usr, types, usr);
+  for (Usr usr : u->types_instances.items)
+    allocEntity(var_usr, vars, usr);
+}
+
+template <typename Mine, typename Emit>
+void DB::applyEntities(IndexUpdate *u, const Lid2file_id &prev_lid2file_id,
+                       const Lid2file_id &lid2file_id, Mine mine, Emit emit) {
+  const int file_id = u->file_id;
+  auto emitUse = [&](Usr usr, Kind kind, const Use &use, Range extent,
+                     int delta) {
+    emit(use.file_id, ExtentRef{{use.range, usr, kind, use.role}, extent},
+         delta);
+  };
+  auto implicit = [](Use &use) {
+    // Make ranges of implicit function calls larger (spanning one more column
+    // to the left/right). This is hacky but useful. e.g.
+    // textDocument/definition on the space/semicolon in `A a;` or ` 42;` will
+    // take you to the constructor.
+    if (use.role & Role::Implicit) {
+      if (use.range.start.column > 0)
+        use.range.start.column--;
+      use.range.end.column++;
+    }
+  };
+
+  auto apply = [&](Kind kind, auto &entity_usr, auto &entities, auto &removed,
+                   auto &def_update, auto &declarations, auto &uses,
+                   bool hint_implicit) {
+    auto get = [&](Usr usr) -> auto & {
+      return entities[entity_usr.find(usr)->second];
+    };
+    for (auto &[usr, def] : removed)
+      if (mine(usr)) {
+        if (def.spell) {
+          assignFileId(prev_lid2file_id, file_id, *def.spell);
+          emitUse(usr, kind, *def.spell, def.spell->extent, -1);
+        }
+        auto it = entity_usr.find(usr);
+        if (it == entity_usr.end())
+          continue;
+        auto &entity = entities[it->second];
+        auto it1 = llvm::find_if(entity.def, [&](const auto &def1) {
+          return def1.file_id == file_id;
+        });
+        if (it1 != entity.def.end())
+          entity.def.erase(it1);
+      }
+    for (auto &[usr, def] : def_update)
+      if (mine(usr)) {
+        assert(def.detailed_name[0]);
+        def.file_id = file_id;
+        if (def.spell) {
+          assignFileId(lid2file_id, file_id, *def.spell);
+          emitUse(usr, kind, *def.spell, def.spell->extent, 1);
+        }
+        auto &entity = get(usr);
+        if (!tryReplaceDef(entity.def, std::move(def)))
+          entity.def.push_back(std::move(def));
+      }
+    for (auto [usr, removed, added] : declarations)
+      if (mine(usr)) {
+        for (DeclRef &dr : removed) {
+          assignFileId(prev_lid2file_id, file_id, dr);
+          emitUse(usr, kind, dr, dr.extent, -1);
+        }
+        for (DeclRef &dr : added) {
+          assignFileId(lid2file_id, file_id, dr);
+          emitUse(usr, kind, dr, dr.extent, 1);
+        }
+        auto &entity = get(usr);
+        removeRange(entity.declarations, removed);
+        addRange(entity.declarations, added);
+      }
+    for (auto [usr, removed, added] : uses)
+      if (mine(usr)) {
+        for (Use &use : removed) {
+          if (hint_implicit)
+            implicit(use);
+          assignFileId(prev_lid2file_id, file_id, use);
+          emitUse(usr, kind, use, Range(), -1);
+        }
+        for (Use &use : added) {
+          if (hint_implicit)
+            implicit(use);
+          assignFileId(lid2file_id, file_id, use);
+          emitUse(usr, kind, use, Range(), 1);
+        }
+        auto &entity = get(usr);
+        entity.uses.remove(removed);
+        entity.uses.add(added);
+      }
+  };
+  // |target_usr| maps the USRs in |upd| to ids, all allocated by
+  // allocEntities.
+  auto removeAdd = [&](auto &entity_usr, auto &entities, auto &target_usr,
+                       auto &upd, auto field) {
+    std::vector<EntityId> ids;
+    auto toIds = [&](llvm::ArrayRef<Usr> usrs) {
+      ids.clear();
+      for (Usr usr : usrs)
+        ids.push_back(target_usr.find(usr)->second);
+      return llvm::ArrayRef<EntityId>(ids);
+    };
+    for (auto [usr, removed, added] : upd)
+      if (mine(usr)) {
+        auto &entity = entities[entity_usr.find(usr)->second];
+        removeRange(entity.*field, toIds(removed));
+        addRange(entity.*field, toIds(added));
+      }
+  };
+
+  apply(Kind::Func, func_usr, funcs, u->funcs_removed, u->funcs_def_update,
+        u->funcs_declarations, u->funcs_uses, true);
+  removeAdd(func_usr, funcs, func_usr, u->funcs_derived, &QueryFunc::derived);
+  apply(Kind::Type, type_usr, types, u->types_removed, u->types_def_update,
+        u->types_declarations, u->types_uses, false);
+  removeAdd(type_usr, types, type_usr, u->types_derived, &QueryType::derived);
+  removeAdd(type_usr, types, var_usr, u->types_instances,
+            &QueryType::instances);
+  apply(Kind::Var, var_usr, vars, u->vars_removed, u->vars_def_update,
+        u->vars_declarations, u->vars_uses, false);
+}
+
+void DB::applyIndexUpdate(IndexUpdate *u) {
+  trace::Span span("applyIndexUpdate");
+  generation++;
+  if (u->funcs_derived.items.size() || u->types_derived.items.size())
+    clearHierarchy();
+  Lid2file_id prev_lid2file_id, lid2file_id;
+  assignFileIds(u, prev_lid2file_id, lid2file_id);
+
+  // A first-time load only adds. Reserve the staged symbol2refcnt changes of
+  // each file instead of growing them one insertion at a time.
+  if (u->prev_lid2path.empty() && u->funcs_removed.empty() &&
+      u->types_removed.empty() && u->vars_removed.empty()) {
+    llvm::DenseMap<int, size_t> adds;
+    auto count = [&](int lid) {
+      adds[lid == -1 ? u->file_id : lid2file_id.find(lid)->second]++;
+    };
+    auto countDefs = [&](auto &defs) {
+      for (auto &[usr, def] : defs)
+        if (def.spell)
+          count(def.spell->file_id);
+    };
+    countDefs(u->funcs_def_update);
+    countDefs(u->types_def_update);
+    countDefs(u->vars_def_update);
+    for (auto *upd : {&u->funcs_declarations, &u->types_declarations,
+                      &u->vars_declarations})
+      for (auto [usr, removed, added] : *upd)
+        for (DeclRef &dr : added)
+          count(dr.file_id);
+    for (auto *upd : {&u->funcs_uses, &u->types_uses, &u->vars_uses})
+      for (auto [usr, removed, added] : *upd)
+        for (Use &use : added)
+          count(use.file_id);
+    for (auto &[file_id, n] : adds)
+      if (file_id >= 0)
+        files[file_id].symbol2refcnt.reserve(n);
+  }
+
+  reserveEntities(u->funcs_hint, u->types_hint, u->vars_hint);
+  allocEntities(u);
+  applyEntities(
+      u, prev_lid2file_id, lid2file_id, [](Usr) { return true; },
+      [&](int file_id, const ExtentRef &sym, int delta) {
+        addRefcnt(file_id, sym, delta);
+      });
+  updateSymbolIndex(u);
+  commitRefcnts();
+}
+
+void DB::applyIndexUpdates(const std::vector<IndexUpdate *> &us, int n) {
+  trace::Span span("applyIndexUpdates");
+  span.setArg("updates", us.size());
+  if (n <= 1 || us.size() <= 1) {
+    for (IndexUpdate *u : us)
+      applyIndexUpdate(u);
+    return;
+  }
+  generation++;
+  for (IndexUpdate *u : us)
+    if (u->funcs_derived.items.size() || u->types_derived.items.size())
+      clearHierarchy();
+
+  // Serially assign file IDs and allocate entities, so that the parallel
+  // phases below do not change the layout of |files|, |funcs|, |types| and
+  // |vars|.
+  std::vector<std::pair<Lid2file_id, Lid2file_id>> lid2file_ids(us.size());
+  int funcs_hint = 0, types_hint = 0, vars_hint = 0;
+  for (IndexUpdate *u : us) {
+    funcs_hint += std::max(u->funcs_hint, 0);
+    types_hint += std::max(u->types_hint, 0);
+    vars_hint += std::max(u->vars_hint, 0);
   }
-  REMOVE_ADD(var, declarations);
-  for (auto &[usr, p] : u->vars_uses)
-    updateUses(usr, Kind::Var, var_usr, vars, p, false);
+  reserveEntities(funcs_hint, types_hint, vars_hint);
+  for (size_t i = 0; i < us.size(); i++) {
+    assignFileIds(us[i], lid2file_ids[i].first, lid2file_ids[i].second);
+    allocEntities(us[i]);
+  }
+
+  // Apply entity updates sharded by USR. Updates of one entity are applied in
+  // the order of |us|. symbol2refcnt changes are recorded in
+  // deltas[usr_shard][file_shard].
+  std::vector<std::vector<std::vector<RefcntDelta>>> deltas(
+      n, std::vector<std::vector<RefcntDelta>>(n));
+  runPooled(n, [&](int w) {
+    auto &out = deltas[w];
+    for (size_t i = 0; i < us.size(); i++)
+      applyEntities(
+          us[i], lid2file_ids[i].first, lid2file_ids[i].second,
+          [&](Usr usr) { return int(usr % n) == w; },
+          [&](int file_id, const ExtentRef &sym, int delta) {
+            out[file_id % n].push_back({file_id, delta, sym});
+          });
+  });
+  for (IndexUpdate *u : us)
+    updateSymbolIndex(u);
+
+  // Apply symbol2refcnt changes sharded by file_id. Changes of one symbol come
+  // from one USR shard and are therefore still applied in order.
+  runPooled(n, [&](int s) {
+    // Stage the changes of each file, then merge them once.
+    llvm::DenseMap<int, size_t> counts;
+    for (int w = 0; w < n; w++)
+      for (RefcntDelta &d : deltas[w][s])
+        counts[d.file_id]++;
+    for (auto &[file_id, k] : counts)
+      files[file_id].symbol2refcnt.reserve(k);
+    for (int w = 0; w < n; w++)
+      for (RefcntDelta &d : deltas[w][s])
+        files[d.file_id].symbol2refcnt.add(d.sym, d.delta);
+    for (auto &[file_id, k] : counts)
+      if (files[file_id].symbol2refcnt.commit())
+        files[file_id].clearSorted();
+  });
+}
+
+void DB::addRefcnt(int file_id, const ExtentRef &sym, int delta) {
+  if (files[file_id].symbol2refcnt.add(sym, delta))
+    refcnt_dirty.push_back(file_id);
+}
 
-#undef REMOVE_ADD
+void DB::commitRefcnts() {
+  for (int file_id : refcnt_dirty)
+    if (files[file_id].symbol2refcnt.commit())
+      files[file_id].clearSorted();
+  refcnt_dirty.clear();
 }
 
 int DB::getFileId(const std::string &path) {
   auto it = name2file_id.try_emplace(lowerPathIfInsensitive(path));
   if (it.second) {
     int id = files.size();
-    it.first->second = files.emplace_back().id = id;
+    QueryFile &file = files.emplace_back();
+    it.first->second = file.id = id;
+    file.uri = DocumentUri::fromPath(path).raw_uri;
   }
   return it.first->second;
 }
 
+void DB::setFileDef(int file_id, std::optional<QueryFile::Def> def) {
+  // getFileId may grow |files|, so index it afresh after each call.
+  if (files[file_id].def)
+    for (size_t i = 0; i < files[file_id].def->includes.size(); i++) {
+      int id = getFileId(files[file_id].def->includes[i].resolved_path);
+      auto &v = files[id].includers;
+      auto it = std::find(v.begin(), v.end(), file_id);
+      if (it != v.end())
+        v.erase(it);
+    }
+  files[file_id].def = std::move(def);
+  if (files[file_id].def)
+    for (size_t i = 0; i < files[file_id].def->includes.size(); i++) {
+      int id = getFileId(files[file_id].def->includes[i].resolved_path);
+      files[id].includers.push_back(file_id);
+    }
+}
+
+std::vector<int> DB::getDependents(int file_id, size_t limit) {
+  std::vector<int> ret;
+  std::vector<bool> seen(files.size());
+  seen[file_id] = true;
+  for (size_t i = 0, cur = file_id; ret.size() < limit;) {
+    for (int id : files[cur].includers)
+      if (!seen[id] && ret.size() < limit) {
+        seen[id] = true;
+        ret.push_back(id);
+      }
+    if (i == ret.size())
+      break;
+    cur = ret[i++];
+  }
+  return ret;
+}
+
 int DB::update(QueryFile::DefUpdate &&u) {
   int file_id = getFileId(u.first.path);
-  files[file_id].def = u.first;
+  setFileDef(file_id, u.first);
+  updateFileSets(file_id);
   return file_id;
 }
 
-void DB::update(const Lid2file_id &lid2file_id, int file_id,
-                std::vector<std::pair<Usr, QueryFunc::Def>> &&us) {
-  for (auto &u : us) {
-    auto &def = u.second;
-    assert(def.detailed_name[0]);
-    u.second.file_id = file_id;
-    if (def.spell) {
-      assignFileId(lid2file_id, file_id, *def.spell);
-      files[def.spell->file_id].symbol2refcnt[{
-          {def.spell->range, u.first, Kind::Func, def.spell->role},
-          def.spell->extent}]++;
-    }
-
-    auto r = func_usr.try_emplace({u.first}, func_usr.size());
-    if (r.second)
-      funcs.emplace_back();
-    QueryFunc &existing = funcs[r.first->second];
-    existing.usr = u.first;
-    if (!tryReplaceDef(existing.def, std::move(def)))
-      existing.def.push_back(std::move(def));
-  }
-}
-
-void DB::update(const Lid2file_id &lid2file_id, int file_id,
-                std::vector<std::pair<Usr, QueryType::Def>> &&us) {
-  for (auto &u : us) {
-    auto &def = u.second;
-    assert(def.detailed_name[0]);
-    u.second.file_id = file_id;
-    if (def.spell) {
-      assignFileId(lid2file_id, file_id, *def.spell);
-      files[def.spell->file_id].symbol2refcnt[{
-          {def.spell->range, u.first, Kind::Type, def.spell->role},
-          def.spell->extent}]++;
-    }
-    auto r = type_usr.try_emplace({u.first}, type_usr.size());
-    if (r.second)
-      types.emplace_back();
-    QueryType &existing = types[r.first->second];
-    existing.usr = u.first;
-    if (!tryReplaceDef(existing.def, std::move(def)))
-      existing.def.push_back(std::move(def));
-  }
-}
-
-void DB::update(const Lid2file_id &lid2file_id, int file_id,
-                std::vector<std::pair<Usr, QueryVar::Def>> &&us) {
-  for (auto &u : us) {
-    auto &def = u.second;
-    assert(def.detailed_name[0]);
-    u.second.file_id = file_id;
-    if (def.spell) {
-      assignFileId(lid2file_id, file_id, *def.spell);
-      files[def.spell->file_id].symbol2refcnt[{
-          {def.spell->range, u.first, Kind::Var, def.spell->role},
-          def.spell->extent}]++;
+void DB::updateSymbolIndex(SymbolIdx sym) {
+  const QueryFunc::Def *func = nullptr;
+  const QueryType::Def *type = nullptr;
+  const QueryVar::Def *var = nullptr;
+  switch (sym.kind) {
+  case Kind::Func:
+    if (hasFunc(sym.usr))
+      func = getFunc(sym.usr).anyDef();
+    break;
+  case Kind::Type:
+    if (hasType(sym.usr))
+      type = getType(sym.usr).anyDef();
+    break;
+  case Kind::Var:
+    if (hasVar(sym.usr)) {
+      QueryVar &v = getVar(sym.usr);
+      if (v.def.size() && !v.def[0].is_local())
+        var = v.anyDef();
     }
-    auto r = var_usr.try_emplace({u.first}, var_usr.size());
-    if (r.second)
-      vars.emplace_back();
-    QueryVar &existing = vars[r.first->second];
-    existing.usr = u.first;
-    if (!tryReplaceDef(existing.def, std::move(def)))
-      existing.def.push_back(std::move(def));
+    break;
+  default:
+    return;
   }
+  if (func)
+    symbol_index.insert(sym, func->name(true), func->name(false));
+  else if (type)
+    symbol_index.insert(sym, type->name(true), type->name(false));
+  else if (var)
+    symbol_index.insert(sym, var->name(true), var->name(false));
+  else
+    symbol_index.erase(sym);
+}
+
+void DB::updateSymbolIndex(IndexUpdate *u) {
+  for (auto &[usr, _] : u->funcs_removed)
+    updateSymbolIndex({usr, Kind::Func});
+  for (auto &[usr, _] : u->funcs_def_update)
+    updateSymbolIndex({usr, Kind::Func});
+  for (auto &[usr, _] : u->types_removed)
+    updateSymbolIndex({usr, Kind::Type});
+  for (auto &[usr, _] : u->types_def_update)
+    updateSymbolIndex({usr, Kind::Type});
+  for (auto &[usr, _] : u->vars_removed)
+    updateSymbolIndex({usr, Kind::Var});
+  for (auto &[usr, _] : u->vars_def_update)
+    updateSymbolIndex({usr, Kind::Var});
 }
 
 std::string_view DB::getSymbolName(SymbolIdx sym, bool qualified) {
@@ -508,24 +1216,59 @@ std::string_view DB::getSymbolName(SymbolIdx sym, bool qualified) {
   return "";
 }
 
-std::vector<uint8_t> DB::getFileSet(const std::vector<std::string> &folders) {
+void FileSet::set(int file_id, bool value) {
+  size_t i = file_id / 64;
+  if (i >= bits.size()) {
+    if (!value)
+      return;
+    bits.resize(i + 1);
+  }
+  if (value)
+    bits[i] |= uint64_t(1) << (file_id % 64);
+  else
+    bits[i] &= ~(uint64_t(1) << (file_id % 64));
+}
+
+static bool inFolders(const QueryFile &file,
+                      const std::vector<std::string> &folders) {
+  if (file.def)
+    for (auto &folder : folders)
+      if (llvm::StringRef(file.def->path).startswith(folder))
+        return true;
+  return false;
+}
+
+std::shared_ptr<const FileSet>
+DB::getFileSet(const std::vector<std::string> &folders) {
+  static const auto all_files =
+      std::make_shared<const FileSet>(FileSet{true, {}});
   if (folders.empty())
-    return std::vector<uint8_t>(files.size(), 1);
-  std::vector<uint8_t> file_set(files.size());
+    return all_files;
+  std::lock_guard lock(*file_sets_mutex);
+  for (auto &[folders1, file_set] : file_sets)
+    if (folders1 == folders)
+      return file_set;
+
+  // Keep a few folder lists, usually one per client. An evicted set lives on
+  // while a handler holds it.
+  const size_t kMaxFileSets = 8;
+  if (file_sets.size() >= kMaxFileSets)
+    file_sets.erase(file_sets.begin());
+  auto file_set = std::make_shared<FileSet>();
+  file_set->bits.resize((files.size() + 63) / 64);
   for (QueryFile &file : files)
-    if (file.def) {
-      bool ok = false;
-      for (auto &folder : folders)
-        if (llvm::StringRef(file.def->path).startswith(folder)) {
-          ok = true;
-          break;
-        }
-      if (ok)
-        file_set[file.id] = 1;
-    }
+    if (inFolders(file, folders))
+      file_set->set(file.id, true);
+  file_sets.emplace_back(folders, file_set);
   return file_set;
 }
 
+void DB::updateFileSets(int file_id) {
+  std::lock_guard lock(*file_sets_mutex);
+  for (auto &[folders, file_set] : file_sets)
+    file_set->set(file_id, inFolders(files[file_id], folders));
+}
+
 namespace {
 // Computes roughly how long |range| is.
 int computeRangeSize(const Range &range) {
@@ -534,14 +1277,13 @@ int computeRangeSize(const Range &range) {
   return range.end.column - range.start.column;
 }
 
-template <typename Q, typename C>
-std::vector<Use>
-getDeclarations(llvm::DenseMap<Usr, int, DenseMapInfoForUsr> &entity_usr,
-                llvm::SmallVectorImpl<Q> &entities, const C &usrs) {
+// |get| maps an element of |keys|, a USR or an EntityId, to its entity.
+template <typename C, typename Get>
+std::vector<Use> getDeclarations(const C &keys, Get &&get) {
   std::vector<Use> ret;
-  ret.reserve(usrs.size());
-  for (Usr usr : usrs) {
-    Q &entity = entities[entity_usr[{usr}]];
+  ret.reserve(keys.size());
+  for (auto key : keys) {
+    auto &entity = get(key);
     bool has_def = false;
     for (auto &def : entity.def)
       if (def.spell) {
@@ -554,29 +1296,13 @@ getDeclarations(llvm::DenseMap<Usr, int, DenseMapInfoForUsr> &entity_usr,
   }
   return ret;
 }
-} // namespace
 
-Maybe<DeclRef> getDefinitionSpell(DB *db, SymbolIdx sym) {
-  Maybe<DeclRef> ret;
-  eachEntityDef(db, sym, [&](const auto &def) { return !(ret = def.spell); });
-  return ret;
-}
-
-std::vector<Use> getFuncDeclarations(DB *db, const std::vector<Usr> &usrs) {
-  return getDeclarations(db->func_usr, db->funcs, usrs);
-}
-std::vector<Use> getFuncDeclarations(DB *db, const Vec<Usr> &usrs) {
-  return getDeclarations(db->func_usr, db->funcs, usrs);
-}
-std::vector<Use> getTypeDeclarations(DB *db, const std::vector<Usr> &usrs) {
-  return getDeclarations(db->type_usr, db->types, usrs);
-}
-std::vector<DeclRef> getVarDeclarations(DB *db, const std::vector<Usr> &usrs,
-                                        unsigned kind) {
+template <typename C, typename Get>
+std::vector<DeclRef> varDeclarations(const C &keys, unsigned kind, Get &&get) {
   std::vector<DeclRef> ret;
-  ret.reserve(usrs.size());
-  for (Usr usr : usrs) {
-    QueryVar &var = db->getVar(usr);
+  ret.reserve(keys.size());
+  for (auto key : keys) {
+    QueryVar &var = get(key);
     bool has_def = false;
     for (auto &def : var.def)
       if (def.spell) {
@@ -600,6 +1326,105 @@ std::vector<DeclRef> getVarDeclarations(DB *db, const std::vector<Usr> &usrs,
   }
   return ret;
 }
+} // namespace
+
+namespace {
+// Request threads share DB::hierarchy.
+std::mutex hierarchy_mutex;
+
+template <typename Q, typename EntityUsr>
+std::vector<EntityId> computeHierarchy(llvm::SmallVector<Q, 0> &entities,
+                                       EntityUsr &entity_usr, EntityId root,
+                                       bool derived) {
+  std::vector<EntityId> ret;
+  llvm::DenseSet<EntityId> seen;
+  seen.insert(root);
+  auto visit = [&](EntityId id) {
+    if (seen.insert(id).second)
+      ret.push_back(id);
+  };
+  // |ret| doubles as the BFS queue.
+  for (size_t i = 0; i <= ret.size(); i++) {
+    Q &entity = entities[i ? ret[i - 1] : root];
+    if (derived) {
+      for (EntityId id : entity.derived)
+        visit(id);
+    } else if (auto *def = entity.anyDef()) {
+      for (Usr usr : def->bases) {
+        auto it = entity_usr.find(usr);
+        if (it != entity_usr.end())
+          visit(it->second);
+      }
+    }
+  }
+  return ret;
+}
+} // namespace
+
+std::vector<EntityId> getHierarchy(DB *db, Kind kind, EntityId id,
+                                   bool derived) {
+  auto &cache = db->hierarchy[kind == Kind::Type][derived];
+  {
+    std::lock_guard lock(hierarchy_mutex);
+    auto it = cache.find(id);
+    if (it != cache.end())
+      return it->second;
+  }
+  std::vector<EntityId> ret =
+      kind == Kind::Type
+          ? computeHierarchy(db->types, db->type_usr, id, derived)
+          : computeHierarchy(db->funcs, db->func_usr, id, derived);
+  std::lock_guard lock(hierarchy_mutex);
+  cache.try_emplace(id, ret);
+  return ret;
+}
+
+Maybe<DeclRef> getDefinitionSpell(DB *db, SymbolIdx sym) {
+  Maybe<DeclRef> ret;
+  eachEntityDef(db, sym, [&](const auto &def) { return !(ret = def.spell); });
+  return ret;
+}
+
+std::vector<Use> getFuncDeclarations(DB *db, const std::vector<Usr> &usrs) {
+  return getDeclarations(usrs, [&](Usr usr) -> auto & {
+    return db->getFunc(usr);
+  });
+}
+std::vector<Use> getFuncDeclarations(DB *db, const Vec<Usr> &usrs) {
+  return getDeclarations(usrs, [&](Usr usr) -> auto & {
+    return db->getFunc(usr);
+  });
+}
+std::vector<Use> getFuncDeclarations(DB *db,
+                                     const std::vector<EntityId> &ids) {
+  return getDeclarations(ids, [&](EntityId id) -> auto & {
+    return db->funcs[id];
+  });
+}
+std::vector<Use> getTypeDeclarations(DB *db, const std::vector<Usr> &usrs) {
+  return getDeclarations(usrs, [&](Usr usr) -> auto & {
+    return db->getType(usr);
+  });
+}
+std::vector<Use> getTypeDeclarations(DB *db,
+                                     const std::vector<EntityId> &ids) {
+  return getDeclarations(ids, [&](EntityId id) -> auto & {
+    return db->types[id];
+  });
+}
+std::vector<DeclRef> getVarDeclarations(DB *db, const std::vector<Usr> &usrs,
+                                        unsigned kind) {
+  return varDeclarations(usrs, kind, [&](Usr usr) -> auto & {
+    return db->getVar(usr);
+  });
+}
+std::vector<DeclRef> getVarDeclarations(DB *db,
+                                        const std::vector<EntityId> &ids,
+                                        unsigned kind) {
+  return varDeclarations(ids, kind, [&](EntityId id) -> auto & {
+    return db->vars[id];
+  });
+}
 
 std::vector<DeclRef> &getNonDefDeclarations(DB *db, SymbolIdx sym) {
   static std::vector<DeclRef> empty;
@@ -616,45 +1441,35 @@ std::vector<DeclRef> &getNonDefDeclarations(DB *db, SymbolIdx sym) {
   return empty;
 }
 
-std::vector<Use> getUsesForAllBases(DB *db, QueryFunc &root) {
+namespace {
+std::vector<Use> getUsesForAll(DB *db, QueryFunc &root, bool derived) {
   std::vector<Use> ret;
-  std::vector<QueryFunc *> stack{&root};
-  std::unordered_set<Usr> seen;
-  seen.insert(root.usr);
-  while (!stack.empty()) {
-    QueryFunc &func = *stack.back();
-    stack.pop_back();
-    if (auto *def = func.anyDef()) {
-      eachDefinedFunc(db, def->bases, [&](QueryFunc &func1) {
-        if (!seen.count(func1.usr)) {
-          seen.insert(func1.usr);
-          stack.push_back(&func1);
-          ret.insert(ret.end(), func1.uses.begin(), func1.uses.end());
-        }
-      });
-    }
+  EntityId root_id = &root - db->funcs.data();
+  for (EntityId id : getHierarchy(db, Kind::Func, root_id, derived)) {
+    QueryFunc &func = db->funcs[id];
+    if (func.anyDef())
+      ret.insert(ret.end(), func.uses.begin(), func.uses.end());
   }
-
   return ret;
 }
+} // namespace
+
+std::vector<Use> getUsesForAllBases(DB *db, QueryFunc &root) {
+  return getUsesForAll(db, root, false);
+}
 
 std::vector<Use> getUsesForAllDerived(DB *db, QueryFunc &root) {
-  std::vector<Use> ret;
-  std::vector<QueryFunc *> stack{&root};
-  std::unordered_set<Usr> seen;
-  seen.insert(root.usr);
-  while (!stack.empty()) {
-    QueryFunc &func = *stack.back();
-    stack.pop_back();
-    eachDefinedFunc(db, func.derived, [&](QueryFunc &func1) {
-      if (!seen.count(func1.usr)) {
-        seen.insert(func1.usr);
-        stack.push_back(&func1);
-        ret.insert(ret.end(), func1.uses.begin(), func1.uses.end());
-      }
-    });
-  }
+  return getUsesForAll(db, root, true);
+}
 
+size_t countUsesForAll(DB *db, QueryFunc &root, bool derived) {
+  size_t ret = 0;
+  EntityId root_id = &root - db->funcs.data();
+  for (EntityId id : getHierarchy(db, Kind::Func, root_id, derived)) {
+    QueryFunc &func = db->funcs[id];
+    if (func.anyDef())
+      ret += func.uses.size();
+  }
   return ret;
 }
 
@@ -689,7 +1504,7 @@ DocumentUri getLsDocumentUri(DB *db, int file_id, std::string *path) {
   QueryFile &file = db->files[file_id];
   if (file.def) {
     *path = file.def->path;
-    return DocumentUri::fromPath(*path);
+    return DocumentUri{file.uri};
   } else {
     *path = "";
     return DocumentUri::fromPath("");
@@ -699,19 +1514,44 @@ DocumentUri getLsDocumentUri(DB *db, int file_id, std::string *path) {
 DocumentUri getLsDocumentUri(DB *db, int file_id) {
   QueryFile &file = db->files[file_id];
   if (file.def) {
-    return DocumentUri::fromPath(file.def->path);
+    return DocumentUri{file.uri};
   } else {
     return DocumentUri::fromPath("");
   }
 }
 
+namespace {
+// Like wfiles->getFile(file.def->path), remembering the last lookup of the
+// thread as consecutive locations are usually in the same file. DB::clear
+// reassigns file IDs, so the hint is also keyed by DB::generation.
+WorkingFile *getWorkingFile(DB *db, WorkingFiles *wfiles,
+                            const QueryFile &file) {
+  thread_local struct {
+    DB *db = nullptr;
+    WorkingFiles *wfiles = nullptr;
+    uint64_t db_generation;
+    uint32_t generation;
+    int file_id;
+    WorkingFile *wf;
+  } last;
+  uint32_t generation = wfiles->generation.load(std::memory_order_acquire);
+  if (last.db == db && last.wfiles == wfiles &&
+      last.db_generation == db->generation && last.generation == generation &&
+      last.file_id == file.id)
+    return last.wf;
+  WorkingFile *wf = file.def ? wfiles->getFile(file.def->path) : nullptr;
+  last = {db, wfiles, db->generation, generation, file.id, wf};
+  return wf;
+}
+} // namespace
+
 std::optional<Location> getLsLocation(DB *db, WorkingFiles *wfiles, Use use) {
-  std::string path;
-  DocumentUri uri = getLsDocumentUri(db, use.file_id, &path);
-  std::optional<lsRange> range = getLsRange(wfiles->getFile(path), use.range);
+  QueryFile &file = db->files[use.file_id];
+  std::optional<lsRange> range =
+      getLsRange(getWorkingFile(db, wfiles, file), use.range);
   if (!range)
     return std::nullopt;
-  return Location{uri, *range};
+  return Location{getLsDocumentUri(db, use.file_id), *range};
 }
 
 std::optional<Location> getLsLocation(DB *db, WorkingFiles *wfiles,
@@ -720,12 +1560,11 @@ std::optional<Location> getLsLocation(DB *db, WorkingFiles *wfiles,
 }
 
 LocationLink getLocationLink(DB *db, WorkingFiles *wfiles, DeclRef dr) {
-  std::string path;
-  DocumentUri uri = getLsDocumentUri(db, dr.file_id, &path);
-  if (auto range = getLsRange(wfiles->getFile(path), dr.range))
-    if (auto extent = getLsRange(wfiles->getFile(path), dr.extent)) {
+  WorkingFile *wf = getWorkingFile(db, wfiles, db->files[dr.file_id]);
+  if (auto range = getLsRange(wf, dr.range))
+    if (auto extent = getLsRange(wf, dr.extent)) {
       LocationLink ret;
-      ret.targetUri = uri.raw_uri;
+      ret.targetUri = getLsDocumentUri(db, dr.file_id).raw_uri;
       ret.targetSelectionRange = *range;
       ret.targetRange = extent->includes(*range) ? *extent : *range;
       return ret;
@@ -781,9 +1620,31 @@ std::optional<SymbolInformation> getSymbolInfo(DB *db, SymbolIdx sym,
   return std::nullopt;
 }
 
+namespace {
+// Request threads may build the sorted indexes concurrently for the same file.
+std::mutex sorted_mutex;
+
+const std::vector<std::pair<ExtentRef, Pos>> &
+getSortedSymbols(QueryFile *file) {
+  auto &sorted = file->sorted_symbols;
+  std::lock_guard lock(sorted_mutex);
+  if (sorted.empty() && file->symbol2refcnt.size()) {
+    // symbol2refcnt is already sorted by range.
+    sorted.reserve(file->symbol2refcnt.size());
+    for (auto [sym, refcnt] : file->symbol2refcnt)
+      sorted.emplace_back(sym, sym.range.end);
+    for (size_t i = 1; i < sorted.size(); i++)
+      if (sorted[i].second < sorted[i - 1].second)
+        sorted[i].second = sorted[i - 1].second;
+  }
+  return sorted;
+}
+} // namespace
+
 std::vector<SymbolRef> findSymbolsAtLocation(WorkingFile *wfile,
                                              QueryFile *file, Position &ls_pos,
                                              bool smallest) {
+  trace::Span span("findSymbolsAtLocation");
   std::vector<SymbolRef> symbols;
   // If multiVersion > 0, index may not exist and thus index_lines is empty.
   if (wfile && wfile->index_lines.size()) {
@@ -796,9 +1657,20 @@ std::vector<SymbolRef> findSymbolsAtLocation(WorkingFile *wfile,
     }
   }
 
-  for (auto [sym, refcnt] : file->symbol2refcnt)
-    if (refcnt > 0 && sym.range.contains(ls_pos.line, ls_pos.character))
-      symbols.push_back(sym);
+  auto &sorted = getSortedSymbols(file);
+  // Candidates start at or before the position. Walk backwards until no
+  // earlier symbol can end after the position.
+  if (ls_pos.line <= UINT16_MAX) {
+    // Same as Range::contains.
+    Pos pos{uint16_t(ls_pos.line),
+            int16_t(std::min<int>(ls_pos.character, INT16_MAX))};
+    auto it = std::upper_bound(
+        sorted.begin(), sorted.end(), pos,
+        [](Pos pos, auto &x) { return pos < x.first.range.start; });
+    while (it != sorted.begin() && pos < (--it)->second)
+      if (it->first.range.contains(ls_pos.line, ls_pos.character))
+        symbols.push_back(it->first);
+  }
 
   // Order shorter ranges first, since they are more detailed/precise. This is
   // important for macros which generate code so that we can resolving the
@@ -839,4 +1711,98 @@ std::vector<SymbolRef> findSymbolsAtLocation(WorkingFile *wfile,
 
   return symbols;
 }
+
+std::vector<ExtentRef> findSymbolsInRange(WorkingFile *wfile, QueryFile *file,
+                                          const lsRange *ls_range) {
+  std::vector<ExtentRef> symbols;
+  if (!ls_range) {
+    for (auto [sym, refcnt] : file->symbol2refcnt)
+      symbols.push_back(sym);
+    return symbols;
+  }
+  Position start = ls_range->start, end = ls_range->end;
+  if (wfile && wfile->index_lines.size()) {
+    // Lines outside the buffer widen the range to the whole index.
+    auto line = wfile->getIndexPosFromBufferPos(start.line, &start.character,
+                                                false);
+    start = line ? Position{*line, start.character} : Position{0, 0};
+    line = wfile->getIndexPosFromBufferPos(end.line, &end.character, true);
+    end = line ? Position{*line, end.character} : Position{UINT16_MAX, 0};
+  }
+  auto toPos = [](Position p) {
+    return Pos{uint16_t(std::clamp(p.line, 0, UINT16_MAX)),
+               int16_t(std::clamp(p.character, 0, INT16_MAX))};
+  };
+  Pos lo = toPos(start), hi = toPos(end);
+
+  // Candidates start before |hi|. Walk backwards until no earlier symbol can
+  // end after |lo|.
+  auto &sorted = getSortedSymbols(file);
+  auto it = std::lower_bound(
+      sorted.begin(), sorted.end(), hi,
+      [](auto &x, Pos pos) { return x.first.range.start < pos; });
+  while (it != sorted.begin() && lo < (--it)->second)
+    if (lo < it->first.range.end)
+      symbols.push_back(it->first);
+  return symbols;
+}
+
+std::optional<ExtentRef> findEnclosingFunc(QueryFile &file, Range range) {
+  auto &sorted = file.func_extents;
+  {
+    std::lock_guard lock(sorted_mutex);
+    if (sorted.empty() && file.symbol2refcnt.size()) {
+      for (auto [sym, refcnt] : file.symbol2refcnt)
+        if (refcnt > 0 && sym.kind == Kind::Func && sym.extent.valid())
+          sorted.emplace_back(sym, -1);
+      std::sort(sorted.begin(), sorted.end(), [](auto &l, auto &r) {
+        auto &a = l.first.extent, &b = r.first.extent;
+        return a.start != b.start ? a.start < b.start : b.end < a.end;
+      });
+      // Extents nest, so a stack of the open ones yields the parents.
+      std::vector<int> open;
+      for (int i = 0; i < (int)sorted.size(); i++) {
+        Pos start = sorted[i].first.extent.start;
+        while (open.size() && !(start < sorted[open.back()].first.extent.end))
+          open.pop_back();
+        sorted[i].second = open.empty() ? -1 : open.back();
+        open.push_back(i);
+      }
+    }
+  }
+  // The last extent starting at or before |range| either contains it or is
+  // nested in every extent that does.
+  auto it = std::upper_bound(
+      sorted.begin(), sorted.end(), range.start,
+      [](Pos pos, auto &x) { return pos < x.first.extent.start; });
+  int i = int(it - sorted.begin()) - 1;
+  while (i >= 0 && sorted[i].first.extent.end < range.end)
+    i = sorted[i].second;
+  if (i < 0)
+    return std::nullopt;
+  return sorted[i].first;
+}
+
+llvm::ArrayRef<ExtentRef> findSymbolOccurrences(QueryFile &file,
+                                                SymbolIdx sym) {
+  auto &sorted = file.symbol_occurrences;
+  {
+    std::lock_guard lock(sorted_mutex);
+    if (sorted.empty() && file.symbol2refcnt.size()) {
+      for (auto [sym1, refcnt] : file.symbol2refcnt)
+        if (refcnt > 0)
+          sorted.push_back(sym1);
+      std::sort(sorted.begin(), sorted.end(), [](auto &l, auto &r) {
+        SymbolIdx a = l, b = r;
+        return !(a == b) ? a < b : l.range.start < r.range.start;
+      });
+    }
+  }
+  auto [first, last] = std::equal_range(
+      sorted.begin(), sorted.end(), sym, [](auto &l, auto &r) {
+        return SymbolIdx(l) < SymbolIdx(r);
+      });
+  return llvm::ArrayRef<ExtentRef>(sorted).slice(first - sorted.begin(),
+                                                 last - first);
+}
 } // namespace ccls
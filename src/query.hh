@@ -7,43 +7,101 @@
 #include "serializer.hh"
 #include "working_files.hh"
 
+#include <llvm/ADT/ArrayRef.h>
 #include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/STLExtras.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/ADT/StringMap.h>
 
-namespace llvm {
-template <> struct DenseMapInfo<ccls::ExtentRef> {
-  static inline ccls::ExtentRef getEmptyKey() { return {}; }
-  static inline ccls::ExtentRef getTombstoneKey() {
-    return {{ccls::Range(), ccls::Usr(-1)}};
+#include <memory>
+#include <mutex>
+
+namespace ccls {
+// Symbols of a file with their reference counts, sorted by range (then usr,
+// kind, role and extent). Changes are staged by add and merged by commit,
+// once per index update, so readers iterate a sorted vector.
+struct SymbolRefcnt {
+  using value_type = std::pair<ExtentRef, int>;
+  using const_iterator = std::vector<value_type>::const_iterator;
+
+  static bool less(const ExtentRef &l, const ExtentRef &r) {
+    return l.toTuple() < r.toTuple();
+  }
+
+  const_iterator begin() const { return items.begin(); }
+  const_iterator end() const { return items.end(); }
+  size_t size() const { return items.size(); }
+  bool empty() const { return items.empty(); }
+
+  // Returns true if this is the first change staged since commit.
+  bool add(const ExtentRef &sym, int delta) {
+    pending.push_back({sym, delta});
+    return pending.size() == 1;
+  }
+  void reserve(size_t n) { pending.reserve(n); }
+  // Applies the staged changes and drops symbols whose count becomes 0.
+  // Returns whether there were any.
+  bool commit();
+
+  size_t getMemorySize() const {
+    return (items.capacity() + pending.capacity()) * sizeof(value_type);
   }
-  static unsigned getHashValue(ccls::ExtentRef sym) {
-    return std::hash<ccls::ExtentRef>()(sym);
+  void shrink_and_clear() {
+    std::vector<value_type>().swap(items);
+    std::vector<value_type>().swap(pending);
   }
-  static bool isEqual(ccls::ExtentRef l, ccls::ExtentRef r) { return l == r; }
+
+private:
+  std::vector<value_type> items, pending;
 };
-} // namespace llvm
 
-namespace ccls {
 struct QueryFile {
   struct Def {
     std::string path;
-    std::vector<const char *> args;
+    // Shared by files with the same arguments. See internArgs.
+    llvm::ArrayRef<const char *> args;
     LanguageId language;
+    // Modification time of the indexed content.
+    int64_t mtime = 0;
     // Includes in the file.
     std::vector<IndexInclude> includes;
     // Parts of the file which are disabled.
     std::vector<Range> skipped_ranges;
     // Used by |$ccls/reload|.
     std::vector<const char *> dependencies;
+    // See IndexFile::partial.
+    bool partial = false;
   };
 
   using DefUpdate = std::pair<Def, std::string>;
 
   int id = -1;
   std::optional<Def> def;
+  // DocumentUri::fromPath of the path, encoded once by DB::getFileId.
+  std::string uri;
+  // Files whose def->includes has this file, once per include directive.
+  std::vector<int> includers;
   // `extent` is valid => declaration; invalid => regular reference
-  llvm::DenseMap<ExtentRef, int> symbol2refcnt;
+  SymbolRefcnt symbol2refcnt;
+  // Symbols of symbol2refcnt sorted by range.start, each with the maximum
+  // range.end of itself and its predecessors. Used by findSymbolsAtLocation
+  // and findSymbolsInRange.
+  std::vector<std::pair<ExtentRef, Pos>> sorted_symbols;
+  // Func symbols with an extent sorted by extent.start (outer first on ties),
+  // each with the index of the innermost preceding extent containing its
+  // start, or -1. Used by findEnclosingFunc.
+  std::vector<std::pair<ExtentRef, int>> func_extents;
+  // Symbols of symbol2refcnt grouped by (usr, kind). Used by
+  // findSymbolOccurrences.
+  std::vector<ExtentRef> symbol_occurrences;
+
+  // The sorted indexes are rebuilt on demand; clear them whenever
+  // symbol2refcnt changes.
+  void clearSorted() {
+    sorted_symbols.clear();
+    func_extents.clear();
+    symbol_occurrences.clear();
+  }
 };
 
 template <typename Q, typename QDef> struct QueryEntity {
@@ -62,38 +120,165 @@ template <typename Q, typename QDef> struct QueryEntity {
   }
 };
 
-template <typename T>
-using Update =
-    std::unordered_map<Usr, std::pair<std::vector<T>, std::vector<T>>>;
+// Removed and added elements of each entity, sorted by USR. Elements of all
+// entities are stored contiguously, so an update is two allocations and is
+// cheap to move through a queue.
+template <typename T> struct Update {
+  struct Entry {
+    Usr usr;
+    // items[begin, mid) are removed and items[mid, end) are added.
+    uint32_t begin, mid, end;
+  };
+  struct Delta {
+    Usr usr;
+    llvm::MutableArrayRef<T> removed, added;
+  };
+  struct iterator {
+    Update *u;
+    const Entry *e;
+    Delta operator*() const {
+      T *items = u->items.data();
+      return {e->usr, {items + e->begin, items + e->mid},
+              {items + e->mid, items + e->end}};
+    }
+    iterator &operator++() {
+      ++e;
+      return *this;
+    }
+    bool operator!=(const iterator &o) const { return e != o.e; }
+  };
+
+  std::vector<Entry> entries;
+  std::vector<T> items;
+
+  iterator begin() { return {this, entries.data()}; }
+  iterator end() { return {this, entries.data() + entries.size()}; }
+};
+
+// A compact set of file IDs. See DB::getFileSet.
+struct FileSet {
+  // If true, every file is in the set and |bits| is unused.
+  bool all = false;
+  std::vector<uint64_t> bits;
+
+  bool operator[](int file_id) const {
+    if (all)
+      return true;
+    size_t i = file_id / 64;
+    return i < bits.size() && bits[i] >> (file_id % 64) & 1;
+  }
+  void set(int file_id, bool value);
+};
+
+// Uses of an entity grouped by file, so that re-indexing a file only touches
+// the uses in that file. Groups are sorted by file_id and never empty. Within a
+// group ranges and roles are parallel arrays, which drops the per-use file_id
+// and padding and lets filters scan roles without touching ranges.
+struct UseList {
+  struct Group {
+    int file_id;
+    std::vector<Range> ranges;
+    std::vector<Role> roles;
+  };
+  struct iterator {
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Use;
+    using difference_type = ptrdiff_t;
+    using pointer = void;
+    using reference = Use;
+
+    const Group *g = nullptr;
+    size_t i = 0;
+    Use operator*() const { return {{g->ranges[i], g->roles[i]}, g->file_id}; }
+    iterator &operator++() {
+      if (++i == g->ranges.size()) {
+        ++g;
+        i = 0;
+      }
+      return *this;
+    }
+    iterator operator++(int) {
+      iterator ret = *this;
+      ++*this;
+      return ret;
+    }
+    bool operator==(const iterator &o) const { return g == o.g && i == o.i; }
+    bool operator!=(const iterator &o) const { return !(*this == o); }
+  };
+
+  iterator begin() const { return {groups.data(), 0}; }
+  iterator end() const { return {groups.data() + groups.size(), 0}; }
+  bool empty() const { return !n; }
+  size_t size() const { return n; }
+  // Uses must have their file_id assigned.
+  void add(llvm::ArrayRef<Use> uses);
+  void remove(llvm::ArrayRef<Use> uses);
+
+  // Calls fn(use) for each use in a file of |file_set| that has every role in
+  // |role| and none in |exclude|. Files are skipped as a whole.
+  template <typename Fn>
+  void filter(const FileSet &file_set, Role role, Role exclude,
+              Fn &&fn) const {
+    for (const Group &g : groups) {
+      if (!file_set[g.file_id])
+        continue;
+      const Role *roles = g.roles.data();
+      for (size_t i = 0, e = g.roles.size(); i != e; i++)
+        if (Role(roles[i] & role) == role && !(roles[i] & exclude))
+          fn(Use{{g.ranges[i], roles[i]}, g.file_id});
+    }
+  }
+
+private:
+  std::vector<Group> groups;
+  size_t n = 0;
+
+  std::vector<Group>::iterator lowerBound(int file_id);
+};
+
+// Index of an entity in DB::funcs, DB::types or DB::vars. Ids are stable
+// between DB::compact calls, so relations between entities can refer to each
+// other without a USR lookup.
+using EntityId = uint32_t;
 
 struct QueryFunc : QueryEntity<QueryFunc, FuncDef<Vec>> {
   Usr usr;
   llvm::SmallVector<Def, 1> def;
   std::vector<DeclRef> declarations;
-  std::vector<Usr> derived;
-  std::vector<Use> uses;
+  // Ids in DB::funcs.
+  std::vector<EntityId> derived;
+  UseList uses;
 };
 
 struct QueryType : QueryEntity<QueryType, TypeDef<Vec>> {
   Usr usr;
   llvm::SmallVector<Def, 1> def;
   std::vector<DeclRef> declarations;
-  std::vector<Usr> derived;
-  std::vector<Usr> instances;
-  std::vector<Use> uses;
+  // Ids in DB::types.
+  std::vector<EntityId> derived;
+  // Ids in DB::vars.
+  std::vector<EntityId> instances;
+  UseList uses;
 };
 
 struct QueryVar : QueryEntity<QueryVar, VarDef> {
   Usr usr;
   llvm::SmallVector<Def, 1> def;
   std::vector<DeclRef> declarations;
-  std::vector<Use> uses;
+  UseList uses;
 };
 
 struct IndexUpdate {
   // Creates a new IndexUpdate based on the delta from previous to current. If
   // no delta computation should be done just pass null for previous.
-  static IndexUpdate createDelta(IndexFile *previous, IndexFile *current);
+  static IndexUpdate createDelta(const IndexFile *previous,
+                                 IndexFile *current);
+  // Approximate heap usage in bytes, for index.maxPendingUpdateMemory.
+  size_t estimateBytes() const;
+  // If |next| updates the same file from the state this update leads to,
+  // replaces this update with one from the state before this update to the
+  // state after |next| and returns true. Otherwise leaves both unchanged.
+  bool compose(IndexUpdate &&next);
 
   int file_id;
 
@@ -141,6 +326,52 @@ struct DenseMapInfoForUsr {
 
 using Lid2file_id = std::unordered_map<int, int>;
 
+// An index of symbols for workspace/symbol and $ccls/symbols, so that they
+// need not look up every entity. Each symbol keeps a mask of the characters
+// (lowercased letters, digits, '_' and non-ASCII bytes) of its qualified name
+// and is posted under each of them. A query can only match, as a subsequence
+// or a prefix, names having all of its characters, so a lookup walks the
+// shortest posting list of the query's characters, checks the masks, and
+// never loses a match. Short names are also kept verbatim for exact lookups.
+//
+// erase() only marks an entry dead, as does an insert() which changes the
+// names of a symbol; dead entries are dropped lazily.
+struct SymbolIndex {
+  void clear();
+  void insert(SymbolIdx sym, std::string_view qualified,
+              std::string_view short_name);
+  void erase(SymbolIdx sym);
+  // Calls |fn| on live symbols whose qualified names have every character of
+  // |query| until it returns true. Every symbol whose qualified name has
+  // |query| as a subsequence is visited. Returns false without visiting
+  // anything if |query| has no such character.
+  bool lookup(std::string_view query,
+              llvm::function_ref<bool(SymbolIdx)> fn) const;
+  // Calls |fn| on live symbols whose short name is exactly |short_name|.
+  void lookupName(std::string_view short_name,
+                  llvm::function_ref<void(SymbolIdx)> fn) const;
+
+private:
+  // Bits of the mask, see charMask.
+  static constexpr int kChars = 38;
+  struct Entry {
+    // kind is Kind::Invalid once dead.
+    SymbolIdx sym;
+    uint64_t mask;
+  };
+  std::vector<Entry> entries;
+  // Indexes in |entries|, ascending, by character.
+  std::vector<uint32_t> postings[kChars];
+  // Per kind, USR => index in |entries| of the latest entry.
+  llvm::DenseMap<Usr, uint32_t, DenseMapInfoForUsr> state[3];
+  // Short name => indexes in |entries|.
+  llvm::StringMap<std::vector<uint32_t>> names;
+  size_t n_live = 0, n_dead = 0;
+
+  void kill(Entry &e);
+  void compact();
+};
+
 // The query database is heavily optimized for fast queries. It is stored
 // in-memory.
 struct DB {
@@ -150,24 +381,77 @@ struct DB {
   llvm::SmallVector<QueryFunc, 0> funcs;
   llvm::SmallVector<QueryType, 0> types;
   llvm::SmallVector<QueryVar, 0> vars;
+  SymbolIndex symbol_index;
+  // Cached results of getFileSet, kept up to date by updateFileSets. Guarded
+  // by file_sets_mutex, as request threads call getFileSet concurrently. The
+  // mutex is boxed so that DB stays movable, see loadSnapshot.
+  std::unique_ptr<std::mutex> file_sets_mutex = std::make_unique<std::mutex>();
+  std::vector<std::pair<std::vector<std::string>, std::shared_ptr<FileSet>>>
+      file_sets;
+  // Incremented whenever the contents change, for caches of derived results.
+  uint64_t generation = 0;
+  // Transitive bases and derived entities by [kind == Kind::Type][derived]
+  // and id, filled by getHierarchy. Cleared when a derived relation changes,
+  // since bases and derived are updated together.
+  llvm::DenseMap<EntityId, std::vector<EntityId>> hierarchy[2][2];
+  // Files with staged symbol2refcnt changes, see addRefcnt.
+  std::vector<int> refcnt_dirty;
 
   void clear();
+  // Drops the unused entities of the first of funcs, types and vars in which
+  // they are at least |percent| percent, and renumbers the rest. Returns true
+  // if a kind was compacted; call again for the next one.
+  bool compact(int percent);
+  void clearHierarchy() {
+    for (auto &caches : hierarchy)
+      for (auto &cache : caches)
+        cache.clear();
+  }
 
-  template <typename Def>
-  void removeUsrs(Kind kind, int file_id,
-                  const std::vector<std::pair<Usr, Def>> &to_remove);
   // Insert the contents of |update| into |db|.
   void applyIndexUpdate(IndexUpdate *update);
+  // Insert the contents of |updates| (in order) into |db|, using |n_threads|
+  // threads of the runPooled pool. Entity updates are sharded by USR and
+  // symbol2refcnt updates are sharded by file_id.
+  void applyIndexUpdates(const std::vector<IndexUpdate *> &updates,
+                         int n_threads);
+  // Steps shared by applyIndexUpdate and applyIndexUpdates. assignFileIds
+  // maps the local file ids of |u| and applies its file changes;
+  // allocEntities allocates every entity |u| refers to, so that applyEntities
+  // only changes entities in place. applyEntities applies the changes of the
+  // entities whose USRs satisfy |mine| and reports the symbol2refcnt changes
+  // to |emit|(file_id, sym, delta).
+  void assignFileIds(IndexUpdate *u, Lid2file_id &prev_lid2file_id,
+                     Lid2file_id &lid2file_id);
+  void reserveEntities(int funcs_hint, int types_hint, int vars_hint);
+  void allocEntities(IndexUpdate *u);
+  template <typename Mine, typename Emit>
+  void applyEntities(IndexUpdate *u, const Lid2file_id &prev_lid2file_id,
+                     const Lid2file_id &lid2file_id, Mine mine, Emit emit);
   int getFileId(const std::string &path);
+  // Sets files[file_id].def, keeping |includers| of the included files in
+  // sync.
+  void setFileDef(int file_id, std::optional<QueryFile::Def> def);
+  // Returns the files that include |file_id| directly or transitively,
+  // nearest first, up to |limit| of them.
+  std::vector<int> getDependents(int file_id, size_t limit);
   int update(QueryFile::DefUpdate &&u);
-  void update(const Lid2file_id &, int file_id,
-              std::vector<std::pair<Usr, QueryType::Def>> &&us);
-  void update(const Lid2file_id &, int file_id,
-              std::vector<std::pair<Usr, QueryFunc::Def>> &&us);
-  void update(const Lid2file_id &, int file_id,
-              std::vector<std::pair<Usr, QueryVar::Def>> &&us);
+  // Add |sym| to or remove it from |symbol_index| depending on whether it has
+  // a definition.
+  void updateSymbolIndex(SymbolIdx sym);
+  // Calls updateSymbolIndex on the symbols whose definitions |u| changes.
+  void updateSymbolIndex(IndexUpdate *u);
+  // Stages a symbol2refcnt change of applyIndexUpdate, committed by
+  // commitRefcnts at its end.
+  void addRefcnt(int file_id, const ExtentRef &sym, int delta);
+  void commitRefcnts();
   std::string_view getSymbolName(SymbolIdx sym, bool qualified);
-  std::vector<uint8_t> getFileSet(const std::vector<std::string> &folders);
+  // Returns the set of files under |folders| (all files if empty). Safe to
+  // call from request threads; the set stays valid while DB is locked.
+  std::shared_ptr<const FileSet>
+  getFileSet(const std::vector<std::string> &folders);
+  // Call after files[file_id].def has been set or reset.
+  void updateFileSets(int file_id);
 
   bool hasFunc(Usr usr) const { return func_usr.count(usr); }
   bool hasType(Usr usr) const { return type_usr.count(usr); }
@@ -185,19 +469,30 @@ struct DB {
 
 Maybe<DeclRef> getDefinitionSpell(DB *db, SymbolIdx sym);
 
+// Returns the transitive bases (!derived) or derived entities of the func or
+// type |id|, excluding itself, nearest first. Repeated queries are O(result).
+std::vector<EntityId> getHierarchy(DB *db, Kind kind, EntityId id,
+                                   bool derived);
+
 // Get defining declaration (if exists) or an arbitrary declaration (otherwise)
 // for each id.
 std::vector<Use> getFuncDeclarations(DB *, const std::vector<Usr> &);
 std::vector<Use> getFuncDeclarations(DB *, const Vec<Usr> &);
+std::vector<Use> getFuncDeclarations(DB *, const std::vector<EntityId> &);
 std::vector<Use> getTypeDeclarations(DB *, const std::vector<Usr> &);
+std::vector<Use> getTypeDeclarations(DB *, const std::vector<EntityId> &);
 std::vector<DeclRef> getVarDeclarations(DB *, const std::vector<Usr> &,
                                         unsigned);
+std::vector<DeclRef> getVarDeclarations(DB *, const std::vector<EntityId> &,
+                                        unsigned);
 
 // Get non-defining declarations.
 std::vector<DeclRef> &getNonDefDeclarations(DB *db, SymbolIdx sym);
 
 std::vector<Use> getUsesForAllBases(DB *db, QueryFunc &root);
 std::vector<Use> getUsesForAllDerived(DB *db, QueryFunc &root);
+// Same as getUsesForAll{Derived,Bases}(db, root).size() without copying.
+size_t countUsesForAll(DB *db, QueryFunc &root, bool derived);
 std::optional<lsRange> getLsRange(WorkingFile *working_file,
                                   const Range &location);
 DocumentUri getLsDocumentUri(DB *db, int file_id, std::string *path);
@@ -215,6 +510,17 @@ std::optional<SymbolInformation> getSymbolInfo(DB *db, SymbolIdx sym,
 std::vector<SymbolRef> findSymbolsAtLocation(WorkingFile *working_file,
                                              QueryFile *file, Position &ls_pos,
                                              bool smallest = false);
+// Returns the symbols of |file| intersecting the buffer range |ls_range|, or
+// all of them if it is null, in no particular order.
+std::vector<ExtentRef> findSymbolsInRange(WorkingFile *working_file,
+                                          QueryFile *file,
+                                          const lsRange *ls_range);
+// Returns the innermost Func symbol of |file| whose extent contains |range|,
+// i.e. the caller of a use at |range|. O(log n) plus the nesting depth.
+std::optional<ExtentRef> findEnclosingFunc(QueryFile &file, Range range);
+// Returns the occurrences of |sym| in |file|, ordered by range.
+llvm::ArrayRef<ExtentRef> findSymbolOccurrences(QueryFile &file,
+                                                SymbolIdx sym);
 
 template <typename Fn> void withEntity(DB *db, SymbolIdx sym, Fn &&fn) {
   switch (sym.kind) {
@@ -266,4 +572,12 @@ void eachDefinedFunc(DB *db, const C &usrs, Fn &&fn) {
       fn(obj);
   }
 }
+template <typename Fn>
+void eachDefinedFunc(DB *db, const std::vector<EntityId> &ids, Fn &&fn) {
+  for (EntityId id : ids) {
+    auto &obj = db->funcs[id];
+    if (!obj.def.empty())
+      fn(obj);
+  }
+}
 } // namespace ccls
@@ -0,0 +1,237 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "replay.hh"
+
+#include "log.hh"
+#include "pipeline.hh"
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <rapidjson/document.h>
+#include <rapidjson/writer.h>
+
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace llvm;
+namespace chrono = std::chrono;
+
+namespace ccls::replay {
+bool recording, replaying;
+
+namespace {
+FILE *record_file;
+chrono::steady_clock::time_point record_start;
+
+struct Entry {
+  int64_t ms;
+  std::string message, method, id, uri;
+};
+std::vector<Entry> entries;
+size_t next_entry;
+bool wait_idle;
+chrono::steady_clock::time_point base;
+int64_t base_ms;
+
+std::mutex mutex;
+// Requests waiting for a response, by id.
+std::unordered_map<std::string,
+                   std::pair<std::string, chrono::steady_clock::time_point>>
+    pending;
+// Documents changed since their last semantic highlight, by uri.
+StringMap<chrono::steady_clock::time_point> changed;
+StringMap<std::vector<double>> samples;
+
+const char kSemanticHighlight[] = "$ccls/publishSemanticHighlight";
+
+std::string idKey(const rapidjson::Value &id) {
+  if (id.IsInt64())
+    return "n" + std::to_string(id.GetInt64());
+  if (id.IsString())
+    return "s" + std::string(id.GetString(), id.GetStringLength());
+  return {};
+}
+
+const rapidjson::Value *member(const rapidjson::Value &v, const char *key) {
+  if (!v.IsObject())
+    return nullptr;
+  auto it = v.FindMember(key);
+  return it != v.MemberEnd() ? &it->value : nullptr;
+}
+
+std::string getString(const rapidjson::Value *v) {
+  return v && v->IsString() ? std::string(v->GetString(), v->GetStringLength())
+                            : std::string();
+}
+
+double percentile(const std::vector<double> &v, double p) {
+  size_t i = size_t(p * v.size());
+  return v[std::min(i, v.size() - 1)];
+}
+} // namespace
+
+bool startRecording(const std::string &path) {
+  if (!(record_file = fopen(path.c_str(), "wb"))) {
+    LOG_S(ERROR) << "failed to open " << path << ' ' << strerror(errno);
+    return false;
+  }
+  record_start = chrono::steady_clock::now();
+  recording = true;
+  return true;
+}
+
+void record(std::string_view message) {
+  int64_t ms = chrono::duration_cast<chrono::milliseconds>(
+                   chrono::steady_clock::now() - record_start)
+                   .count();
+  // Line breaks can only be whitespace between JSON tokens.
+  std::string line(message);
+  std::replace(line.begin(), line.end(), '\n', ' ');
+  std::replace(line.begin(), line.end(), '\r', ' ');
+  fprintf(record_file, "{\"ms\":%lld,\"message\":%s}\n", (long long)ms,
+          line.c_str());
+  fflush(record_file);
+}
+
+bool startReplay(const std::string &path) {
+  auto buf = MemoryBuffer::getFile(path);
+  if (!buf) {
+    LOG_S(ERROR) << "failed to read " << path;
+    return false;
+  }
+  SmallVector<StringRef, 0> lines;
+  (*buf)->getBuffer().split(lines, '\n', -1, false);
+  for (StringRef line : lines) {
+    rapidjson::Document doc;
+    doc.Parse(line.data(), line.size());
+    const rapidjson::Value *ms = doc.HasParseError() ? nullptr
+                                                     : member(doc, "ms");
+    const rapidjson::Value *msg = ms ? member(doc, "message") : nullptr;
+    if (!ms || !ms->IsInt64() || !msg || !msg->IsObject()) {
+      LOG_S(WARNING) << "skip invalid line in " << path;
+      continue;
+    }
+    Entry &e = entries.emplace_back();
+    e.ms = ms->GetInt64();
+    rapidjson::StringBuffer output;
+    rapidjson::Writer<rapidjson::StringBuffer> w(output);
+    msg->Accept(w);
+    e.message = output.GetString();
+    e.method = getString(member(*msg, "method"));
+    if (const rapidjson::Value *id = member(*msg, "id"))
+      e.id = idKey(*id);
+    const rapidjson::Value *params = member(*msg, "params"),
+                           *doc1 = params ? member(*params, "textDocument")
+                                          : nullptr;
+    e.uri = getString(doc1 ? member(*doc1, "uri") : nullptr);
+  }
+  LOG_S(INFO) << "replay " << entries.size() << " messages from " << path;
+  base = chrono::steady_clock::now();
+  replaying = true;
+  return true;
+}
+
+bool next(MessagePtr &message, size_t &len) {
+  if (next_entry == entries.size())
+    return false;
+  Entry &e = entries[next_entry++];
+  if (wait_idle) {
+    wait_idle = false;
+    while (true) {
+      std::this_thread::sleep_for(chrono::milliseconds(100));
+      QueueDepths depths = queueDepths();
+      if (pipeline::stats.completed == pipeline::stats.enqueued &&
+          !depths.on_indexed && !depths.on_request)
+        break;
+    }
+    base = chrono::steady_clock::now();
+    base_ms = e.ms;
+  } else {
+    std::this_thread::sleep_until(base + chrono::milliseconds(e.ms - base_ms));
+  }
+  wait_idle = e.method == "initialized";
+
+  len = e.message.size();
+  message = allocMessage(len + 1);
+  memcpy(message.get(), e.message.c_str(), len + 1);
+
+  auto now = chrono::steady_clock::now();
+  std::lock_guard lock(mutex);
+  if (e.id.size() && e.method.size())
+    pending[e.id] = {e.method, now};
+  else if (e.uri.size() && (e.method == "textDocument/didOpen" ||
+                            e.method == "textDocument/didChange"))
+    changed[e.uri] = now;
+  return true;
+}
+
+void onOutput(std::string_view message) {
+  auto now = chrono::steady_clock::now();
+  rapidjson::Document doc;
+  doc.Parse(message.data(), message.size());
+  if (doc.HasParseError())
+    return;
+  const rapidjson::Value *method = member(doc, "method"), *id;
+  std::lock_guard lock(mutex);
+  if (method) {
+    if (getString(method) != kSemanticHighlight)
+      return;
+    const rapidjson::Value *params = member(doc, "params");
+    auto it =
+        changed.find(getString(params ? member(*params, "uri") : nullptr));
+    if (it == changed.end())
+      return;
+    samples[kSemanticHighlight].push_back(
+        chrono::duration<double, std::milli>(now - it->second).count());
+    changed.erase(it);
+  } else if ((id = member(doc, "id"))) {
+    auto it = pending.find(idKey(*id));
+    if (it == pending.end())
+      return;
+    samples[it->second.first].push_back(
+        chrono::duration<double, std::milli>(now - it->second.second).count());
+    pending.erase(it);
+  }
+}
+
+void report() {
+  std::lock_guard lock(mutex);
+  std::vector<StringRef> methods;
+  for (auto &it : samples)
+    methods.push_back(it.first());
+  std::sort(methods.begin(), methods.end());
+
+  rapidjson::StringBuffer output;
+  rapidjson::Writer<rapidjson::StringBuffer> w(output);
+  w.StartObject();
+  for (StringRef method : methods) {
+    std::vector<double> &v = samples[method];
+    std::sort(v.begin(), v.end());
+    w.Key(method.data(), method.size());
+    w.StartObject();
+    w.Key("count");
+    w.Int64(v.size());
+    w.Key("p50");
+    w.Double(percentile(v, 0.5));
+    w.Key("p99");
+    w.Double(percentile(v, 0.99));
+    w.Key("max");
+    w.Double(v.back());
+    w.EndObject();
+  }
+  w.Key("unanswered");
+  w.Int64(pending.size());
+  w.EndObject();
+  puts(output.GetString());
+  fflush(stdout);
+}
+} // namespace ccls::replay
@@ -0,0 +1,38 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "lsp.hh"
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace ccls::replay {
+// A recording has one JSON object per line: {"ms":<time since the first
+// message>,"message":<JSON-RPC message from the client>}.
+
+// Set by startRecording() and startReplay() before the stdin thread starts.
+extern bool recording, replaying;
+
+bool startRecording(const std::string &path);
+// Appends a client message. Called by the stdin thread.
+void record(std::string_view message);
+
+// Loads a recording. The stdin thread then reads messages with next()
+// instead of stdin, and the stdout thread passes server messages to
+// onOutput() instead of writing them.
+bool startReplay(const std::string &path);
+// Waits until the recorded time of the next message and returns it, or
+// returns false at the end of the recording. Once the client has sent
+// "initialized", waits for indexing (or loading the snapshot) to settle
+// before replaying the rest, so that handlers run against a loaded DB.
+bool next(MessagePtr &message, size_t &len);
+// Matches responses to requests and semantic highlight notifications to the
+// last change of the document.
+void onOutput(std::string_view message);
+// Prints count, p50, p99 and max latency in milliseconds per method as JSON
+// to stdout.
+void report();
+} // namespace ccls::replay
@@ -3,11 +3,14 @@
 
 #include "sema_manager.hh"
 
+#include "allocator.hh"
 #include "clang_tu.hh"
 #include "filesystem.hh"
 #include "log.hh"
 #include "pipeline.hh"
 #include "platform.hh"
+#include "trace.hh"
+#include "utils.hh"
 
 #include <clang/Basic/TargetInfo.h>
 #include <clang/Lex/PreprocessorOptions.h>
@@ -80,6 +83,14 @@ struct PreambleStatCache {
     cache.try_emplace(path.str(), std::move(s));
   }
 
+  size_t memorySize() const {
+    size_t ret = cache.getNumBuckets() * sizeof(void *);
+    for (auto &e : cache)
+      ret += sizeof(e) + e.first().size() +
+             (e.second ? e.second->getName().size() : 0);
+    return ret;
+  }
+
   IntrusiveRefCntPtr<llvm::vfs::FileSystem>
   producer(IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs) {
     struct VFS : llvm::vfs::ProxyFileSystem {
@@ -133,6 +144,12 @@ struct PreambleData {
   IncludeStructure includes;
   std::vector<Diag> diags;
   std::unique_ptr<PreambleStatCache> stat_cache;
+
+  // Memory held by the preamble, counted towards session.maxPreambleSize.
+  size_t memorySize() const {
+    return (g_config->session.preambleInMemory ? preamble.getSize() : 0) +
+           (stat_cache ? stat_cache->memorySize() : 0);
+  }
 };
 
 namespace {
@@ -325,8 +342,35 @@ buildCompilerInstance(Session &session, std::unique_ptr<CompilerInvocation> ci,
   return clang;
 }
 
-bool parse(CompilerInstance &clang) {
-  SyntaxOnlyAction action;
+class ParseAction : public SyntaxOnlyAction {
+public:
+  // If set, parsing stops at the next top-level declaration once it returns
+  // true.
+  std::function<bool()> cancelled;
+  // If set, top-level declarations are appended to it.
+  std::vector<Decl *> *top_level = nullptr;
+
+  std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &ci,
+                                                 StringRef inFile) override {
+    if (!cancelled && !top_level)
+      return SyntaxOnlyAction::CreateASTConsumer(ci, inFile);
+    struct Consumer : ASTConsumer {
+      ParseAction &action;
+      Consumer(ParseAction &action) : action(action) {}
+      bool HandleTopLevelDecl(DeclGroupRef dg) override {
+        if (action.top_level)
+          action.top_level->insert(action.top_level->end(), dg.begin(),
+                                   dg.end());
+        return !action.cancelled || !action.cancelled();
+      }
+    };
+    return std::make_unique<Consumer>(*this);
+  }
+};
+
+// If |end| is false, the source file is left open so that the AST can be
+// used afterwards, see ParsedAST.
+bool parse(CompilerInstance &clang, ParseAction &action, bool end = true) {
   if (!action.BeginSourceFile(clang, clang.getFrontendOpts().Inputs[0]))
     return false;
 #if LLVM_VERSION_MAJOR >= 9 // rL364464
@@ -338,22 +382,88 @@ bool parse(CompilerInstance &clang) {
   if (!action.Execute())
     return false;
 #endif
-  action.EndSourceFile();
+  if (end)
+    action.EndSourceFile();
   return true;
 }
 
-void buildPreamble(Session &session, CompilerInvocation &ci,
+bool parse(CompilerInstance &clang,
+           const std::function<bool()> &cancelled = nullptr) {
+  ParseAction action;
+  action.cancelled = cancelled;
+  return parse(clang, action);
+}
+
+// Identifies the preambles which may be shared: same arguments other than the
+// main file and the output, same directory (for #include "...") and same
+// preamble bytes. CanReuse still has the final say.
+uint64_t sharedPreambleKey(const Session &session, StringRef path,
+                           StringRef preamble) {
+  std::string buf(sys::path::parent_path(path));
+  buf += '\0';
+  buf += session.file.directory;
+  buf += '\0';
+  StringRef name = sys::path::filename(path);
+  auto &args = session.file.args;
+  for (size_t i = 0; i < args.size(); i++) {
+    StringRef arg = args[i];
+    if (arg == "-o")
+      i++;
+    else if (sys::path::filename(arg) != name)
+      buf.append(arg.data(), arg.size() + 1);
+  }
+  buf += preamble;
+  return hashUsr(buf);
+}
+
+void buildPreamble(SemaManager &manager, Session &session,
+                   CompilerInvocation &ci,
                    IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs,
                    const SemaManager::PreambleTask &task,
                    std::unique_ptr<PreambleStatCache> stat_cache) {
+  auto start = chrono::steady_clock::now();
+  auto report = [&](const char *phase) {
+    if (manager.on_timing)
+      manager.on_timing(phase, task.path,
+                        chrono::duration_cast<chrono::microseconds>(
+                            chrono::steady_clock::now() - start)
+                            .count());
+  };
   std::shared_ptr<PreambleData> oldP = session.getPreamble();
   std::string content = session.wfiles->getContent(task.path);
+  if (task.prewarm && content.empty())
+    content = readContent(task.path).value_or("");
   std::unique_ptr<llvm::MemoryBuffer> buf =
       llvm::MemoryBuffer::getMemBuffer(content);
   auto bounds = ComputePreambleBounds(*ci.getLangOpts(), buf.get(), 0);
   if (!task.from_diag && oldP &&
-      oldP->preamble.CanReuse(ci, buf.get(), bounds, fs.get()))
+      oldP->preamble.CanReuse(ci, buf.get(), bounds, fs.get())) {
+    report("preamble.reuse");
     return;
+  }
+  uint64_t key = 0;
+  if (g_config->session.sharePreambles) {
+    key = sharedPreambleKey(session, task.path,
+                            StringRef(content).take_front(bounds.Size));
+    std::shared_ptr<PreambleData> shared;
+    {
+      std::lock_guard lock(manager.mutex);
+      auto it = manager.shared_preambles.find(key);
+      if (it != manager.shared_preambles.end())
+        shared = it->second.lock();
+    }
+    // A rebuild for diagnostics wants a fresh preamble, not one that may be
+    // as stale as ours.
+    if (shared && shared != oldP && !task.from_diag &&
+        shared->preamble.CanReuse(ci, buf.get(), bounds, fs.get())) {
+      {
+        std::lock_guard lock(session.mutex);
+        session.preamble = std::move(shared);
+      }
+      report("preamble.reuse");
+      return;
+    }
+  }
   // -Werror makes warnings issued as errors, which stops parsing
   // prematurely because of -ferror-limit=. This also works around the issue
   // of -Werror + -Wunused-parameter in interaction with SkipFunctionBodies.
@@ -367,18 +477,17 @@ void buildPreamble(Session &session, CompilerInvocation &ci,
   StoreDiags dc(task.path);
   IntrusiveRefCntPtr<DiagnosticsEngine> de =
       CompilerInstance::createDiagnostics(&ci.getDiagnosticOpts(), &dc, false);
-  if (oldP) {
-    std::lock_guard lock(session.wfiles->mutex);
+  if (oldP)
     for (auto &include : oldP->includes)
-      if (WorkingFile *wf = session.wfiles->getFileUnlocked(include.first))
+      if (auto snapshot = session.wfiles->getSnapshot(include.first))
         ci.getPreprocessorOpts().addRemappedFile(
             include.first,
-            llvm::MemoryBuffer::getMemBufferCopy(wf->buffer_content).release());
-  }
+            llvm::MemoryBuffer::getMemBufferCopy(snapshot->content).release());
 
   CclsPreambleCallbacks pc;
   if (auto newPreamble = PrecompiledPreamble::Build(
-          ci, buf.get(), bounds, *de, fs, session.pch, true, pc)) {
+          ci, buf.get(), bounds, *de, fs, session.pch,
+          g_config->session.preambleInMemory, pc)) {
     assert(!ci.getPreprocessorOpts().RetainRemappedFileBuffers);
     if (oldP) {
       auto &old_includes = oldP->includes;
@@ -394,41 +503,113 @@ void buildPreamble(Session &session, CompilerInvocation &ci,
         }
     }
 
-    std::lock_guard lock(session.mutex);
-    session.preamble = std::make_shared<PreambleData>(
+    auto preamble = std::make_shared<PreambleData>(
         std::move(*newPreamble), std::move(pc.includes), dc.take(),
         std::move(stat_cache));
+    if (key) {
+      std::lock_guard lock(manager.mutex);
+      auto &shared = manager.shared_preambles;
+      for (auto it = shared.begin(); it != shared.end();)
+        if (it->second.expired())
+          it = shared.erase(it);
+        else
+          ++it;
+      shared[key] = preamble;
+    }
+    {
+      std::lock_guard lock(session.mutex);
+      session.preamble = std::move(preamble);
+    }
+    report("preamble.build");
   }
 }
 
 void *preambleMain(void *manager_) {
   auto *manager = static_cast<SemaManager *>(manager_);
   set_thread_name("preamble");
+  setThreadArena(Arena::Sema);
   while (true) {
     SemaManager::PreambleTask task = manager->preamble_tasks.dequeue();
     if (pipeline::g_quit.load(std::memory_order_relaxed))
       break;
 
+    if (task.prewarm) {
+      // Don't evict a session for a speculative build.
+      std::lock_guard lock(manager->mutex);
+      auto &sessions = manager->sessions;
+      if (sessions.get(task.path) ||
+          int(sessions.size()) >= sessions.getCapacity() ||
+          (sessions.getMaxWeight() &&
+           sessions.getWeight() >= sessions.getMaxWeight()))
+        continue;
+    }
     bool created = false;
     std::shared_ptr<Session> session =
         manager->ensureSession(task.path, &created);
+    if (task.prewarm)
+      session->prewarmed = true;
+    else if (session->prewarmed.exchange(false))
+      // First view of a prewarmed file.
+      created = true;
 
-    auto stat_cache = std::make_unique<PreambleStatCache>();
-    IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs =
-        stat_cache->producer(session->fs);
-    if (std::unique_ptr<CompilerInvocation> ci =
-            buildCompilerInvocation(task.path, session->file.args, fs))
-      buildPreamble(*session, *ci, fs, task, std::move(stat_cache));
-
-    if (task.comp_task) {
-      manager->comp_tasks.pushBack(std::move(task.comp_task));
-    } else if (task.from_diag) {
-      manager->scheduleDiag(task.path, 0);
-    } else {
-      int debounce =
-          created ? g_config->diagnostics.onOpen : g_config->diagnostics.onSave;
-      if (debounce >= 0)
-        manager->scheduleDiag(task.path, debounce);
+    std::string path = task.path;
+    std::vector<std::pair<SemaManager::PreambleTask, bool>> tasks;
+    {
+      std::lock_guard lock(manager->mutex);
+      auto [it, inserted] = manager->preamble_building.try_emplace(path);
+      if (!inserted) {
+        it->second.emplace_back(std::move(task), created);
+        continue;
+      }
+    }
+    tasks.emplace_back(std::move(task), created);
+    for (size_t i = 0; i < tasks.size();) {
+      // One build for the tasks left since the last one.
+      SemaManager::PreambleTask merged{path};
+      merged.prewarm = true;
+      for (size_t j = i; j < tasks.size(); j++) {
+        merged.from_diag |= tasks[j].first.from_diag;
+        merged.prewarm &= tasks[j].first.prewarm;
+      }
+      auto stat_cache = std::make_unique<PreambleStatCache>();
+      IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs =
+          stat_cache->producer(session->fs);
+      if (std::unique_ptr<CompilerInvocation> ci =
+              buildCompilerInvocation(path, session->file.args, fs)) {
+        trace::Span span("preamble.build");
+        buildPreamble(*manager, *session, *ci, fs, merged,
+                      std::move(stat_cache));
+      }
+      bool built = !!session->getPreamble();
+      size_t weight = session->memorySize();
+      std::lock_guard lock(manager->mutex);
+      if (built) {
+        manager->sessions.setWeight(path, weight);
+        manager->preamble_generation[path]++;
+      }
+      i = tasks.size();
+      auto it = manager->preamble_building.find(path);
+      for (auto &t : it->second)
+        tasks.push_back(std::move(t));
+      if (i == tasks.size())
+        manager->preamble_building.erase(it);
+      else
+        it->second.clear();
+    }
+
+    for (auto &[task1, created1] : tasks) {
+      if (task1.comp_task) {
+        manager->comp_tasks.pushBack(std::move(task1.comp_task));
+      } else if (task1.prewarm) {
+        // Not open, diagnostics are emitted when it is viewed.
+      } else if (task1.from_diag) {
+        manager->scheduleDiag(path, 0);
+      } else {
+        int debounce = created1 ? g_config->diagnostics.onOpen
+                                : g_config->diagnostics.onSave;
+        if (debounce >= 0)
+          manager->scheduleDiag(path, debounce);
+      }
     }
   }
   pipeline::threadLeave();
@@ -438,6 +619,7 @@ void *preambleMain(void *manager_) {
 void *completionMain(void *manager_) {
   auto *manager = static_cast<SemaManager *>(manager_);
   set_thread_name("comp");
+  setThreadArena(Arena::Sema);
   while (true) {
     std::unique_ptr<SemaManager::CompTask> task = manager->comp_tasks.dequeue();
     if (pipeline::g_quit.load(std::memory_order_relaxed))
@@ -454,14 +636,26 @@ void *completionMain(void *manager_) {
         break;
     }
 
+    if (pipeline::isCancelled(task->id)) {
+      manager->on_dropped_(task->id);
+      task->consumer.reset();
+      task->on_complete(nullptr);
+      continue;
+    }
+
+    trace::Span span("completion");
     std::shared_ptr<Session> session = manager->ensureSession(task->path);
     std::shared_ptr<PreambleData> preamble = session->getPreamble();
     IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs =
         preamble ? preamble->stat_cache->consumer(session->fs) : session->fs;
     std::unique_ptr<CompilerInvocation> ci =
         buildCompilerInvocation(task->path, session->file.args, fs);
-    if (!ci)
+    // Every exit calls on_complete, so that requests waiting for a prefetched
+    // completion are not left waiting.
+    if (!ci) {
+      task->on_complete(nullptr);
       continue;
+    }
     auto &fOpts = ci->getFrontendOpts();
     fOpts.CodeCompleteOpts = task->cc_opts;
     fOpts.CodeCompletionAt.FileName = task->path;
@@ -480,19 +674,37 @@ void *completionMain(void *manager_) {
     if (in_preamble) {
       preamble.reset();
     } else if (preamble && bounds.Size != preamble->preamble.getBounds().Size) {
-      manager->preamble_tasks.pushBack({task->path, std::move(task), false},
-                                       true);
+      manager->preamble_tasks.pushFront({task->path, std::move(task), false},
+                                        true);
       continue;
     }
     auto clang = buildCompilerInstance(*session, std::move(ci), fs, dc,
                                        preamble.get(), task->path, buf);
-    if (!clang)
+    if (!clang) {
+      task->on_complete(nullptr);
       continue;
+    }
 
     clang->getPreprocessorOpts().SingleFileParseMode = in_preamble;
     clang->setCodeCompletionConsumer(task->consumer.release());
-    if (!parse(*clang))
+    // Stop parsing if the client cancels the request, or if a newer request
+    // would drop this one.
+    bool stopped = false;
+    std::function<bool()> cancelled = [&]() {
+      return stopped = pipeline::isCancelled(task->id) ||
+                       (g_config->completion.dropOldRequests &&
+                        !manager->comp_tasks.isEmpty());
+    };
+    bool ok = parse(*clang, cancelled);
+    if (stopped) {
+      manager->on_dropped_(task->id);
+      task->on_complete(nullptr);
+      continue;
+    }
+    if (!ok) {
+      task->on_complete(nullptr);
       continue;
+    }
 
     task->on_complete(&clang->getCodeCompletionConsumer());
   }
@@ -528,20 +740,116 @@ void printDiag(llvm::raw_string_ostream &os, const DiagBase &d) {
   os << diagLeveltoString(d.level) << ": " << d.message;
 }
 
+// Hashes everything that is published or used by code actions.
+uint64_t hashDiags(const std::vector<Diagnostic> &diags) {
+  std::string buf;
+  auto addRange = [&](const lsRange &r) {
+    for (int x : {r.start.line, r.start.character, r.end.line, r.end.character})
+      buf.append((const char *)&x, sizeof x);
+  };
+  auto addString = [&](const std::string &s) {
+    buf += s;
+    buf += '\0';
+  };
+  for (const Diagnostic &d : diags) {
+    addRange(d.range);
+    buf.append((const char *)&d.severity, sizeof d.severity);
+    buf.append((const char *)&d.code, sizeof d.code);
+    addString(d.source);
+    addString(d.message);
+    for (const DiagnosticRelatedInformation &info : d.relatedInformation) {
+      addString(info.location.uri.raw_uri);
+      addRange(info.location.range);
+      addString(info.message);
+    }
+    for (const TextEdit &edit : d.fixits_) {
+      addRange(edit.range);
+      addString(edit.newText);
+    }
+    buf += '\1';
+  }
+  return hashUsr(buf);
+}
+
+bool laterDiag(const SemaManager::DiagTask &l,
+               const SemaManager::DiagTask &r) {
+  return l.wait_until > r.wait_until;
+}
+
+// Waits until a task of diag_heap is due and takes it, preferring the viewed
+// file. |task| is the previous task of the thread. Returns false on quit.
+bool takeDiagTask(SemaManager *manager, SemaManager::DiagTask &task) {
+  std::unique_lock lock(manager->diag_mutex);
+  if (task.heavy) {
+    manager->diag_heavy--;
+    manager->diag_cv.notify_all();
+  }
+  auto &heap = manager->diag_heap;
+  int max_heavy = std::max(g_config->diagnostics.threads - 1, 1);
+  while (!manager->diag_quit) {
+    if (heap.empty()) {
+      manager->diag_cv.wait(lock);
+      continue;
+    }
+    int64_t now = chrono::duration_cast<chrono::milliseconds>(
+                      chrono::high_resolution_clock::now().time_since_epoch())
+                      .count();
+    if (heap[0].wait_until > now) {
+      manager->diag_cv.wait_for(
+          lock, chrono::milliseconds(heap[0].wait_until - now));
+      continue;
+    }
+    auto isHeavy = [&](const SemaManager::DiagTask &t) {
+      auto it = manager->diag_cost.find(t.path);
+      return it != manager->diag_cost.end() &&
+             it->second.ms > SemaManager::kHeavyDiagMs;
+    };
+    // The due task of the viewed file, or else the earliest due task, which
+    // is not heavy if there are max_heavy heavy tasks running.
+    size_t i = heap.size();
+    int64_t wake = INT64_MAX;
+    for (size_t j = 0; j < heap.size(); j++) {
+      if (heap[j].wait_until > now) {
+        wake = std::min(wake, heap[j].wait_until);
+        continue;
+      }
+      if (manager->diag_heavy >= max_heavy && isHeavy(heap[j]))
+        continue;
+      if (i == heap.size() || heap[j].wait_until < heap[i].wait_until)
+        i = j;
+      if (heap[j].path == manager->diag_viewed) {
+        i = j;
+        break;
+      }
+    }
+    if (i == heap.size()) {
+      if (wake == INT64_MAX)
+        manager->diag_cv.wait(lock);
+      else
+        manager->diag_cv.wait_for(lock, chrono::milliseconds(wake - now));
+      continue;
+    }
+    task = std::move(heap[i]);
+    if (i + 1 < heap.size())
+      heap[i] = std::move(heap.back());
+    heap.pop_back();
+    std::make_heap(heap.begin(), heap.end(), laterDiag);
+    if ((task.heavy = isHeavy(task)))
+      manager->diag_heavy++;
+    return true;
+  }
+  return false;
+}
+
 void *diagnosticMain(void *manager_) {
   auto *manager = static_cast<SemaManager *>(manager_);
   set_thread_name("diag");
-  while (true) {
-    SemaManager::DiagTask task = manager->diag_tasks.dequeue();
+  setThreadArena(Arena::Sema);
+  SemaManager::DiagTask task;
+  while (takeDiagTask(manager, task)) {
     if (pipeline::g_quit.load(std::memory_order_relaxed))
       break;
-    int64_t wait = task.wait_until -
-                   chrono::duration_cast<chrono::milliseconds>(
-                       chrono::high_resolution_clock::now().time_since_epoch())
-                       .count();
-    if (wait > 0)
-      std::this_thread::sleep_for(
-          chrono::duration<int64_t, std::milli>(std::min(wait, task.debounce)));
+    auto start = chrono::steady_clock::now();
 
     std::shared_ptr<Session> session = manager->ensureSession(task.path);
     std::shared_ptr<PreambleData> preamble = session->getPreamble();
@@ -559,7 +867,7 @@ void *diagnosticMain(void *manager_) {
           }
       }
       if (rebuild) {
-        manager->preamble_tasks.pushBack({task.path, nullptr, true}, true);
+        manager->preamble_tasks.pushBack({task.path, nullptr, true});
         continue;
       }
     }
@@ -574,15 +882,56 @@ void *diagnosticMain(void *manager_) {
     ci->getDiagnosticOpts().IgnoreWarnings = false;
     ci->getFrontendOpts().SkipFunctionBodies = false;
     ci->getLangOpts()->SpellChecking = g_config->diagnostics.spellChecking;
+    bool retain = g_config->session.retainAST;
+    if (retain)
+      ci->getLangOpts()->CommentOpts.ParseAllComments =
+          g_config->index.comments > 1;
     StoreDiags dc(task.path);
-    std::string content = manager->wfiles->getContent(task.path);
-    auto buf = llvm::MemoryBuffer::getMemBuffer(content);
-    auto clang = buildCompilerInstance(*session, std::move(ci), fs, dc,
-                                       preamble.get(), task.path, buf);
-    if (!clang)
+    // The buffer and the compiler instance are owned by |ast| so that they
+    // can be retained together.
+    auto ast = std::make_shared<ParsedAST>();
+    ast->content = manager->wfiles->getContent(task.path);
+    ast->buf = llvm::MemoryBuffer::getMemBuffer(ast->content);
+    ast->preamble = preamble;
+    ast->clang = buildCompilerInstance(*session, std::move(ci), fs, dc,
+                                       preamble.get(), task.path, ast->buf);
+    if (!ast->clang)
       continue;
-    if (!parse(*clang))
+    auto action = std::make_unique<ParseAction>();
+    ParseAction &parse_action = *action;
+    ast->action = std::move(action);
+    // A later edit has scheduled another task. Stop instead of finishing
+    // diagnostics for stale content.
+    parse_action.cancelled = [&] {
+      std::lock_guard lock(manager->diag_mutex);
+      return manager->diag_generation[task.path] != task.generation;
+    };
+    if (retain)
+      parse_action.top_level = &ast->top_level;
+    bool ok = parse(*ast->clang, parse_action, !retain);
+    if (retain) {
+      // |dc| is about to go away. Flush it as EndSourceFile would, and ignore
+      // diagnostics emitted by later uses of the AST.
+      dc.EndSourceFile();
+      ast->clang->getDiagnostics().setClient(new IgnoringDiagConsumer, true);
+    }
+    if (!ok || parse_action.cancelled())
       continue;
+    parse_action.cancelled = nullptr;
+    parse_action.top_level = nullptr;
+    if (retain) {
+      ASTContext &ctx = ast->clang->getASTContext();
+      ast->memory_size = ast->content.size() + ctx.getASTAllocatedMemory() +
+                         ctx.getSideTableAllocatedMemory() +
+                         ast->clang->getPreprocessor().getTotalMemory();
+      {
+        std::lock_guard lock(session->mutex);
+        session->ast = ast;
+      }
+      size_t weight = session->memorySize();
+      std::lock_guard lock(manager->mutex);
+      manager->sessions.setWeight(task.path, weight);
+    }
 
     auto fill = [](const DiagBase &d, Diagnostic &ret) {
       ret.range = lsRange{{d.range.start.line, d.range.start.column},
@@ -658,6 +1007,22 @@ void *diagnosticMain(void *manager_) {
       if (WorkingFile *wf = manager->wfiles->getFileUnlocked(task.path))
         wf->diagnostics = ls_diags;
     }
+    int64_t us = chrono::duration_cast<chrono::microseconds>(
+                     chrono::steady_clock::now() - start)
+                     .count();
+    if (manager->on_timing)
+      manager->on_timing("diagnostics", task.path, us);
+    uint64_t hash = hashDiags(ls_diags);
+    {
+      std::lock_guard lock(manager->diag_mutex);
+      auto [cost, first] = manager->diag_cost.try_emplace(task.path);
+      double &ms = cost->second.ms;
+      ms = first ? us / 1e3 : ms * 0.7 + us / 1e3 * 0.3;
+      auto [it, inserted] = manager->published_diags.try_emplace(task.path);
+      if (!inserted && it->second == hash)
+        continue;
+      it->second = hash;
+    }
     manager->on_diagnostic_(task.path, ls_diags);
   }
   pipeline::threadLeave();
@@ -666,11 +1031,43 @@ void *diagnosticMain(void *manager_) {
 
 } // namespace
 
+ParsedAST::~ParsedAST() {
+  if (action && !action->getCurrentInput().isEmpty())
+    action->EndSourceFile();
+}
+
+std::vector<Decl *> ParsedAST::topLevelDeclsAt(unsigned offset) const {
+  std::vector<Decl *> ret;
+  SourceManager &sm = clang->getSourceManager();
+  FileID main = sm.getMainFileID();
+  for (Decl *d : top_level) {
+    SourceRange r = sm.getExpansionRange(d->getSourceRange()).getAsRange();
+    auto [bfid, b] = sm.getDecomposedLoc(r.getBegin());
+    auto [efid, e] = sm.getDecomposedLoc(
+        Lexer::getLocForEndOfToken(r.getEnd(), 0, sm, clang->getLangOpts()));
+    if (bfid == main && efid == main && b <= offset && offset <= e)
+      ret.push_back(d);
+  }
+  return ret;
+}
+
 std::shared_ptr<PreambleData> Session::getPreamble() {
   std::lock_guard<std::mutex> lock(mutex);
   return preamble;
 }
 
+std::shared_ptr<ParsedAST> Session::getAST() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return ast;
+}
+
+size_t Session::memorySize() {
+  std::shared_ptr<PreambleData> preamble = getPreamble();
+  std::shared_ptr<ParsedAST> ast = getAST();
+  return (preamble ? preamble->memorySize() : 0) +
+         (ast ? ast->memory_size : 0);
+}
+
 SemaManager::SemaManager(Project *project, WorkingFiles *wfiles,
                          OnDiagnostic on_diagnostic, OnDropped on_dropped)
     : project_(project), wfiles(wfiles),
@@ -691,6 +1088,7 @@ void SemaManager::scheduleDiag(const std::string &path, int debounce) {
                     chrono::high_resolution_clock::now().time_since_epoch())
                     .count();
   bool flag = false;
+  int64_t generation = 0;
   {
     std::lock_guard lock(diag_mutex);
     int64_t &next = next_diag[path];
@@ -699,23 +1097,80 @@ void SemaManager::scheduleDiag(const std::string &path, int debounce) {
         now - next > std::max(d.onChange, std::max(d.onChange, d.onSave))) {
       next = now + debounce;
       flag = true;
+      generation = ++diag_generation[path];
     }
   }
-  if (flag)
-    diag_tasks.pushBack({path, now + debounce, debounce}, false);
+  if (flag) {
+    {
+      std::lock_guard lock(diag_mutex);
+      // A queued task of |path| is superseded by this one.
+      auto it = std::remove_if(diag_heap.begin(), diag_heap.end(),
+                               [&](auto &task) { return task.path == path; });
+      bool removed = it != diag_heap.end();
+      diag_heap.erase(it, diag_heap.end());
+      diag_heap.push_back({path, now + debounce, generation});
+      if (removed)
+        std::make_heap(diag_heap.begin(), diag_heap.end(), laterDiag);
+      else
+        std::push_heap(diag_heap.begin(), diag_heap.end(), laterDiag);
+    }
+    diag_cv.notify_one();
+  }
+}
+
+int SemaManager::changeDebounce(const std::string &path) {
+  auto &d = g_config->diagnostics;
+  std::lock_guard lock(diag_mutex);
+  auto it = diag_cost.find(path);
+  if (d.onChangeMin <= 0 || d.onChange <= 0 || it == diag_cost.end())
+    return d.onChange;
+  int hi = std::max(d.onChange * 4, d.onChangeMin);
+  return it->second.debounce =
+             std::clamp(int(it->second.ms * 2), d.onChangeMin, hi);
+}
+
+void SemaManager::setPreambleThreads(int n) {
+  for (; preamble_threads < n; preamble_threads++)
+    spawnThread(ccls::preambleMain, this);
+}
+
+void SemaManager::setDiagThreads(int n) {
+  for (; diag_threads < n; diag_threads++)
+    spawnThread(ccls::diagnosticMain, this);
 }
 
 void SemaManager::onView(const std::string &path) {
+  {
+    std::lock_guard lock(diag_mutex);
+    diag_viewed = path;
+  }
   std::lock_guard lock(mutex);
-  if (!sessions.get(path))
+  std::shared_ptr<Session> session = sessions.get(path);
+  if (!session || session->prewarmed)
     preamble_tasks.pushBack(PreambleTask{path}, true);
 }
 
+void SemaManager::prewarm(const std::string &path) {
+  {
+    std::lock_guard lock(mutex);
+    if (sessions.get(path))
+      return;
+  }
+  PreambleTask task{path};
+  task.prewarm = true;
+  preamble_tasks.pushBack(std::move(task));
+}
+
 void SemaManager::onSave(const std::string &path) {
   preamble_tasks.pushBack(PreambleTask{path}, true);
 }
 
 void SemaManager::onClose(const std::string &path) {
+  {
+    std::lock_guard lock(diag_mutex);
+    published_diags.erase(path);
+    diag_cost.erase(path);
+  }
   std::lock_guard lock(mutex);
   sessions.take(path);
 }
@@ -741,6 +1196,23 @@ SemaManager::ensureSession(const std::string &path, bool *created) {
   return session;
 }
 
+std::shared_ptr<ParsedAST> SemaManager::getAST(const std::string &path,
+                                               const std::string &content) {
+  std::shared_ptr<ccls::Session> session;
+  {
+    std::lock_guard lock(mutex);
+    session = sessions.get(path);
+  }
+  std::shared_ptr<ParsedAST> ast = session ? session->getAST() : nullptr;
+  return ast && ast->content == content ? ast : nullptr;
+}
+
+int64_t SemaManager::preambleGeneration(const std::string &path) {
+  std::lock_guard lock(mutex);
+  auto it = preamble_generation.find(path);
+  return it != preamble_generation.end() ? it->second : 0;
+}
+
 void SemaManager::clear() {
   LOG_S(INFO) << "clear all sessions";
   std::lock_guard lock(mutex);
@@ -749,7 +1221,12 @@ void SemaManager::clear() {
 
 void SemaManager::quit() {
   comp_tasks.pushBack(nullptr);
-  diag_tasks.pushBack({});
-  preamble_tasks.pushBack({});
+  {
+    std::lock_guard lock(diag_mutex);
+    diag_quit = true;
+  }
+  diag_cv.notify_all();
+  for (int i = preamble_threads; i--;)
+    preamble_tasks.pushBack({});
 }
 } // namespace ccls
@@ -4,9 +4,11 @@
 #pragma once
 
 #include "clang_tu.hh"
+#include "filesystem.hh"
 #include "lsp.hh"
 #include "project.hh"
 #include "threaded_queue.hh"
+#include "utils.hh"
 #include "working_files.hh"
 
 #include <clang/Frontend/CompilerInstance.h>
@@ -14,15 +16,42 @@
 #include <clang/Sema/CodeCompleteOptions.h>
 
 #include <algorithm>
+#include <condition_variable>
 #include <functional>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace ccls {
 struct PreambleData;
 
+// The AST of the main file built by the last complete diagnostics run,
+// retained for requests which are answered without a parse, see
+// session.retainAST. It is only meaningful for the buffer |content| it was
+// built from.
+struct ParsedAST {
+  // Guards any use of the AST, which is not thread-safe.
+  std::mutex mutex;
+  std::string content;
+  std::unique_ptr<llvm::MemoryBuffer> buf;
+  // Keeps the preamble, from which declarations are lazily deserialized.
+  std::shared_ptr<PreambleData> preamble;
+  std::unique_ptr<clang::CompilerInstance> clang;
+  // Its source file is left open, so that clang's Sema is still available.
+  std::unique_ptr<clang::FrontendAction> action;
+  // Top-level declarations of the main file, not including the preamble.
+  std::vector<clang::Decl *> top_level;
+  // Measured once built, as the AST may be in use on another thread later.
+  size_t memory_size = 0;
+
+  ~ParsedAST();
+  // Returns the top-level declarations whose range contains |offset| of the
+  // main file. The caller holds |mutex|.
+  std::vector<clang::Decl *> topLevelDeclsAt(unsigned offset) const;
+};
+
 struct DiagBase {
   Range range;
   std::string message;
@@ -40,50 +69,18 @@ struct Diag : DiagBase {
 TextEdit toTextEdit(const clang::SourceManager &SM, const clang::LangOptions &L,
                     const clang::FixItHint &FixIt);
 
-template <typename K, typename V> struct LruCache {
-  std::shared_ptr<V> get(const K &key) {
-    for (auto it = items.begin(); it != items.end(); ++it)
-      if (it->first == key) {
-        auto x = std::move(*it);
-        std::move_backward(items.begin(), it, it + 1);
-        items[0] = std::move(x);
-        return items[0].second;
-      }
-    return nullptr;
-  }
-  std::shared_ptr<V> take(const K &key) {
-    for (auto it = items.begin(); it != items.end(); ++it)
-      if (it->first == key) {
-        auto x = std::move(it->second);
-        items.erase(it);
-        return x;
-      }
-    return nullptr;
-  }
-  void insert(const K &key, std::shared_ptr<V> value) {
-    if ((int)items.size() >= capacity)
-      items.pop_back();
-    items.emplace(items.begin(), key, std::move(value));
-  }
-  void clear() { items.clear(); }
-  void setCapacity(int cap) { capacity = cap; }
-
-private:
-  std::vector<std::pair<K, std::shared_ptr<V>>> items;
-  int capacity = 1;
-};
-
 struct Session {
   std::mutex mutex;
   std::shared_ptr<PreambleData> preamble;
+  std::shared_ptr<ParsedAST> ast;
 
   Project::Entry file;
   WorkingFiles *wfiles;
   bool inferred = false;
+  // Created by SemaManager::prewarm and not viewed since.
+  std::atomic<bool> prewarmed{false};
 
-  // TODO share
-  llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs =
-      llvm::vfs::getRealFileSystem();
+  llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs = getFileSystem();
   std::shared_ptr<clang::PCHContainerOperations> pch;
 
   Session(const Project::Entry &file, WorkingFiles *wfiles,
@@ -91,6 +88,9 @@ struct Session {
       : file(file), wfiles(wfiles), pch(pch) {}
 
   std::shared_ptr<PreambleData> getPreamble();
+  std::shared_ptr<ParsedAST> getAST();
+  // Memory counted towards session.maxPreambleSize.
+  size_t memorySize();
 };
 
 struct SemaManager {
@@ -119,23 +119,50 @@ struct SemaManager {
   struct DiagTask {
     std::string path;
     int64_t wait_until;
-    int64_t debounce;
+    // The task is stale once diag_generation[path] has moved past it.
+    int64_t generation = 0;
+    // Set when taken if the file is heavy, see diag_heavy.
+    bool heavy = false;
+  };
+  struct DiagCost {
+    // Moving average of the diagnostics time in milliseconds.
+    double ms = 0;
+    // The last debounce chosen by changeDebounce, 0 if none.
+    int debounce = 0;
   };
   struct PreambleTask {
     std::string path;
     std::unique_ptr<CompTask> comp_task;
     bool from_diag = false;
+    // Speculative build of a file which is not open, see prewarm.
+    bool prewarm = false;
   };
 
   SemaManager(Project *project, WorkingFiles *wfiles,
               OnDiagnostic on_diagnostic, OnDropped on_dropped);
 
+  // Starts preamble threads until there are |n|. There is one initially.
+  void setPreambleThreads(int n);
+  // Likewise for diagnostics threads.
+  void setDiagThreads(int n);
   void scheduleDiag(const std::string &path, int debounce);
+  // The debounce of diagnostics after |path| is changed, adapted to its
+  // diagnostics time if diagnostics.onChangeMin is positive.
+  int changeDebounce(const std::string &path);
   void onView(const std::string &path);
+  // Queues a low priority preamble build for |path|, which is likely to be
+  // opened soon, unless it has a session. See session.prewarm.
+  void prewarm(const std::string &path);
   void onSave(const std::string &path);
   void onClose(const std::string &path);
   std::shared_ptr<ccls::Session> ensureSession(const std::string &path,
                                                bool *created = nullptr);
+  // Returns the retained AST of |path| if it was built from |content|. Does
+  // not create a session.
+  std::shared_ptr<ParsedAST> getAST(const std::string &path,
+                                    const std::string &content);
+  // Incremented whenever the preamble of |path| is rebuilt.
+  int64_t preambleGeneration(const std::string &path);
   void clear();
   void quit();
 
@@ -147,37 +174,98 @@ struct SemaManager {
 
   std::mutex mutex;
   LruCache<std::string, ccls::Session> sessions;
+  std::unordered_map<std::string, int64_t> preamble_generation;
+  // Preambles of live sessions by sharedPreambleKey, see
+  // session.sharePreambles.
+  std::unordered_map<uint64_t, std::weak_ptr<PreambleData>> shared_preambles;
+  // Paths whose preamble is being built. Other preamble threads leave their
+  // tasks for such a path (and whether each created the session) to the
+  // building thread, which rebuilds once for all of them.
+  std::unordered_map<std::string,
+                     std::vector<std::pair<PreambleTask, bool>>>
+      preamble_building;
 
   std::mutex diag_mutex;
   std::unordered_map<std::string, int64_t> next_diag;
+  std::unordered_map<std::string, int64_t> diag_generation;
+  // Hash of the diagnostics last published for each path. A rebuild yielding
+  // the same set (e.g. an edit inside a comment) is not published again.
+  std::unordered_map<std::string, uint64_t> published_diags;
+  // Pending diagnostics, a min-heap on wait_until with at most one task per
+  // path, guarded by diag_mutex. Due tasks of |diag_viewed|, the file last
+  // passed to onView, run first.
+  std::vector<DiagTask> diag_heap;
+  std::string diag_viewed;
+  std::condition_variable diag_cv;
+  bool diag_quit = false;
+  // Diagnostics cost of each open file that has been diagnosed.
+  std::unordered_map<std::string, DiagCost> diag_cost;
+  // Files whose diagnostics take longer than this are heavy. Up to
+  // diagnostics.threads - 1 heavy tasks run at once, leaving a thread to the
+  // others.
+  static constexpr double kHeavyDiagMs = 1000;
+  int diag_heavy = 0;
+  int diag_threads = 1;
 
   ThreadedQueue<std::unique_ptr<CompTask>> comp_tasks;
-  ThreadedQueue<DiagTask> diag_tasks;
   ThreadedQueue<PreambleTask> preamble_tasks;
+  int preamble_threads = 1;
 
   std::shared_ptr<clang::PCHContainerOperations> pch;
+
+  // If set, called with the microseconds spent when a preamble is built
+  // ("preamble.build") or found reusable ("preamble.reuse"), and when the
+  // diagnostics of a file have been computed ("diagnostics"), whether or not
+  // they are published. See --bench-sema.
+  std::function<void(const char *phase, const std::string &path, int64_t us)>
+      on_timing;
 };
 
 // Cached completion information, so we can give fast completion results when
-// the user erases a character. vscode will resend the completion request if
-// that happens.
+// the user erases a character or returns to an earlier completion point.
+// vscode will resend the completion request if that happens. Entries are
+// keyed by the completion position and the line up to it, and are stale once
+// the preamble of the file has been rebuilt.
 template <typename T> struct CompleteConsumerCache {
+  struct Entry {
+    std::string path;
+    std::string line;
+    Position position;
+    int64_t preamble_generation;
+    T result;
+  };
+  static constexpr size_t kMaxEntries = 8;
   std::mutex mutex;
-  std::string path;
-  std::string line;
-  Position position;
-  T result;
+  // Most recently used last.
+  std::vector<Entry> entries;
 
-  template <typename Fn> void withLock(Fn &&fn) {
+  bool get(const std::string &path, const std::string &line, Position position,
+           int64_t preamble_generation, T &result) {
     std::lock_guard lock(mutex);
-    fn();
+    for (auto it = entries.end(); it != entries.begin();) {
+      --it;
+      if (it->position == position && it->path == path &&
+          it->preamble_generation == preamble_generation &&
+          it->line.compare(0, position.character, line, 0,
+                           position.character) == 0) {
+        std::rotate(it, it + 1, entries.end());
+        result = entries.back().result;
+        return true;
+      }
+    }
+    return false;
   }
-  bool isCacheValid(const std::string &path, const std::string &line,
-                    Position position) {
+  void put(const std::string &path, const std::string &line, Position position,
+           int64_t preamble_generation, const T &result) {
     std::lock_guard lock(mutex);
-    return this->position == position && this->path == path &&
-           this->line.compare(0, position.character, line, 0,
-                              position.character) == 0;
+    auto it = std::find_if(entries.begin(), entries.end(), [&](Entry &e) {
+      return e.position == position && e.path == path;
+    });
+    if (it != entries.end())
+      entries.erase(it);
+    else if (entries.size() == kMaxEntries)
+      entries.erase(entries.begin());
+    entries.push_back({path, line, position, preamble_generation, result});
   }
 };
 } // namespace ccls
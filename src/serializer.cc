@@ -7,17 +7,23 @@
 #include "indexer.hh"
 #include "log.hh"
 #include "message_handler.hh"
+#include "trace.hh"
 
 #include <rapidjson/document.h>
 #include <rapidjson/prettywriter.h>
 
+#include <llvm/ADT/ArrayRef.h>
 #include <llvm/ADT/CachedHashString.h>
 #include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/Hashing.h>
 #include <llvm/ADT/STLExtras.h>
+#include <llvm/Config/llvm-config.h>
 #include <llvm/Support/Allocator.h>
+#include <llvm/Support/Compression.h>
 
 #include <mutex>
 #include <stdexcept>
+#include <unordered_set>
 
 using namespace llvm;
 
@@ -28,39 +34,159 @@ namespace ccls {
 void JsonReader::iterArray(llvm::function_ref<void()> fn) {
   if (!m->IsArray())
     throw std::invalid_argument("array");
-  // Use "0" to indicate any element for now.
-  path_.push_back("0");
+  rapidjson::Value *saved = m;
   for (auto &entry : m->GetArray()) {
-    auto saved = m;
     m = &entry;
-    fn();
-    m = saved;
+    try {
+      fn();
+    } catch (...) {
+      // Use "0" to indicate any element for now.
+      path_.push_back("0");
+      throw;
+    }
   }
-  path_.pop_back();
+  m = saved;
 }
-void JsonReader::member(const char *name, llvm::function_ref<void()> fn) {
-  path_.push_back(name);
+rapidjson::Value *JsonReader::findMember(const char *name) {
   auto it = m->FindMember(name);
-  if (it != m->MemberEnd()) {
-    auto saved = m;
-    m = &it->value;
-    fn();
-    m = saved;
-  }
-  path_.pop_back();
+  return it != m->MemberEnd() ? &it->value : nullptr;
 }
 bool JsonReader::isNull() { return m->IsNull(); }
-std::string JsonReader::getString() { return m->GetString(); }
+std::string JsonReader::getString() {
+  return std::string(m->GetString(), m->GetStringLength());
+}
 std::string JsonReader::getPath() const {
   std::string ret;
-  for (auto &t : path_)
-    if (t[0] == '0') {
+  for (auto it = path_.rbegin(); it != path_.rend(); ++it)
+    if ((*it)[0] == '0') {
       ret += '[';
-      ret += t;
+      ret += *it;
       ret += ']';
     } else {
       ret += '/';
-      ret += t;
+      ret += *it;
+    }
+  return ret;
+}
+
+namespace {
+struct SaxHandler {
+  using Token = JsonSaxReader::Token;
+  std::vector<Token> &tokens;
+
+  bool add(Token::Type type) {
+    tokens.emplace_back().type = type;
+    return true;
+  }
+  bool Null() { return add(Token::Null); }
+  bool Bool(bool b) {
+    add(Token::Bool);
+    tokens.back().b = b;
+    return true;
+  }
+  bool Int(int i) { return Int64(i); }
+  bool Uint(unsigned u) { return Uint64(u); }
+  bool Int64(int64_t i) {
+    if (i >= 0)
+      return Uint64(i);
+    add(Token::Int);
+    tokens.back().i = i;
+    return true;
+  }
+  bool Uint64(uint64_t u) {
+    add(Token::Uint);
+    tokens.back().u = u;
+    return true;
+  }
+  bool Double(double d) {
+    add(Token::Double);
+    tokens.back().d = d;
+    return true;
+  }
+  bool RawNumber(const char *, rapidjson::SizeType, bool) { return false; }
+  bool String(const char *s, rapidjson::SizeType n, bool) {
+    add(Token::String);
+    tokens.back().s = s;
+    tokens.back().n = n;
+    return true;
+  }
+  bool Key(const char *s, rapidjson::SizeType n, bool copy) {
+    String(s, n, copy);
+    tokens.back().type = Token::Key;
+    return true;
+  }
+  bool StartObject() { return add(Token::StartObject); }
+  bool EndObject(rapidjson::SizeType) { return add(Token::EndObject); }
+  bool StartArray() { return add(Token::StartArray); }
+  bool EndArray(rapidjson::SizeType) { return add(Token::EndArray); }
+};
+} // namespace
+
+bool JsonSaxReader::parse(char *json) {
+  tokens.clear();
+  pos = 0;
+  SaxHandler handler{tokens};
+  rapidjson::InsituStringStream is(json);
+  rapidjson::Reader reader;
+  if (reader.Parse<rapidjson::kParseInsituFlag>(is, handler).IsError())
+    return false;
+  // A sentinel, so that lookahead never goes out of bounds.
+  tokens.emplace_back().type = Token::EndArray;
+  return true;
+}
+const JsonSaxReader::Token &JsonSaxReader::next(Token::Type type,
+                                                const char *expected) {
+  if (tokens[pos].type != type)
+    throw std::invalid_argument(expected);
+  return tokens[pos++];
+}
+void JsonSaxReader::iterArray(llvm::function_ref<void()> fn) {
+  next(Token::StartArray, "array");
+  while (tokens[pos].type != Token::EndArray)
+    try {
+      fn();
+    } catch (...) {
+      path_.push_back("0");
+      throw;
+    }
+  pos++;
+}
+bool JsonSaxReader::takeNull() {
+  if (tokens[pos].type != Token::Null)
+    return false;
+  pos++;
+  return true;
+}
+bool JsonSaxReader::getBool() { return next(Token::Bool, "bool").b; }
+int64_t JsonSaxReader::getInt64() {
+  const Token &t = tokens[pos];
+  if (t.type == Token::Uint && t.u <= uint64_t(INT64_MAX))
+    return int64_t(tokens[pos++].u);
+  return next(Token::Int, "integer").i;
+}
+uint64_t JsonSaxReader::getUint64() { return next(Token::Uint, "unsigned").u; }
+double JsonSaxReader::getDouble() {
+  const Token &t = tokens[pos];
+  if (t.type == Token::Int)
+    return double(tokens[pos++].i);
+  if (t.type == Token::Uint)
+    return double(tokens[pos++].u);
+  return next(Token::Double, "double").d;
+}
+std::string_view JsonSaxReader::getString() {
+  const Token &t = next(Token::String, "string");
+  return {t.s, t.n};
+}
+std::string JsonSaxReader::getPath() const {
+  std::string ret;
+  for (auto it = path_.rbegin(); it != path_.rend(); ++it)
+    if ((*it)[0] == '0') {
+      ret += '[';
+      ret += *it;
+      ret += ']';
+    } else {
+      ret += '/';
+      ret += *it;
     }
   return ret;
 }
@@ -88,7 +214,21 @@ void reflect(JsonReader &vis, long long &v         ) { if (!vis.m->IsInt64())  t
 void reflect(JsonReader &vis, unsigned long long &v) { if (!vis.m->IsUint64()) throw std::invalid_argument("unsigned long long"); v = vis.m->GetUint64(); }
 void reflect(JsonReader &vis, double &v            ) { if (!vis.m->IsDouble()) throw std::invalid_argument("double");             v = vis.m->GetDouble(); }
 void reflect(JsonReader &vis, const char *&v       ) { if (!vis.m->IsString()) throw std::invalid_argument("string");             v = intern(vis.getString()); }
-void reflect(JsonReader &vis, std::string &v       ) { if (!vis.m->IsString()) throw std::invalid_argument("string");             v = vis.getString(); }
+void reflect(JsonReader &vis, std::string &v       ) { if (!vis.m->IsString()) throw std::invalid_argument("string");             v.assign(vis.m->GetString(), vis.m->GetStringLength()); }
+
+void reflect(JsonSaxReader &vis, bool &v              ) { v = vis.getBool(); }
+void reflect(JsonSaxReader &vis, unsigned char &v     ) { v = (uint8_t)vis.getInt64(); }
+void reflect(JsonSaxReader &vis, short &v             ) { v = (short)vis.getInt64(); }
+void reflect(JsonSaxReader &vis, unsigned short &v    ) { v = (unsigned short)vis.getInt64(); }
+void reflect(JsonSaxReader &vis, int &v               ) { v = (int)vis.getInt64(); }
+void reflect(JsonSaxReader &vis, unsigned &v          ) { v = (unsigned)vis.getUint64(); }
+void reflect(JsonSaxReader &vis, long &v              ) { v = (long)vis.getInt64(); }
+void reflect(JsonSaxReader &vis, unsigned long &v     ) { v = (unsigned long)vis.getUint64(); }
+void reflect(JsonSaxReader &vis, long long &v         ) { v = vis.getInt64(); }
+void reflect(JsonSaxReader &vis, unsigned long long &v) { v = vis.getUint64(); }
+void reflect(JsonSaxReader &vis, double &v            ) { v = vis.getDouble(); }
+void reflect(JsonSaxReader &vis, const char *&v       ) { auto s = vis.getString(); v = intern(StringRef(s.data(), s.size())); }
+void reflect(JsonSaxReader &vis, std::string &v       ) { v = vis.getString(); }
 
 void reflect(JsonWriter &vis, bool &v              ) { vis.m->Bool(v); }
 void reflect(JsonWriter &vis, unsigned char &v     ) { vis.m->Int(v); }
@@ -152,6 +292,14 @@ void reflect(JsonReader &vis, std::unordered_map<Usr, V> &v) {
   });
 }
 template <typename V>
+void reflect(JsonSaxReader &vis, std::unordered_map<Usr, V> &v) {
+  vis.iterArray([&]() {
+    V val;
+    reflect(vis, val);
+    v[val.usr] = std::move(val);
+  });
+}
+template <typename V>
 void reflect(JsonWriter &vis, std::unordered_map<Usr, V> &v) {
   // Determinism
   std::vector<std::pair<uint64_t, V>> xs(v.begin(), v.end());
@@ -177,28 +325,56 @@ void reflect(BinaryWriter &vis, std::unordered_map<Usr, V> &v) {
     reflect(vis, it.second);
 }
 
-// Used by IndexFile::dependencies.
-void reflect(JsonReader &vis, DenseMap<CachedHashStringRef, int64_t> &v) {
-  std::string name;
+void reflect(BinaryReader &vis, std::vector<uint64_t> &v) {
+  if (vis.minor < 1) {
+    for (auto n = vis.varUInt(); n; n--)
+      v.push_back(vis.varUInt());
+    return;
+  }
+  size_t n = vis.varUInt(), i = v.size();
+  v.resize(i + n);
+  memcpy(v.data() + i, vis.p_, n * sizeof(uint64_t));
+  vis.p_ += n * sizeof(uint64_t);
+}
+void reflect(BinaryWriter &vis, std::vector<uint64_t> &v) {
+  vis.varUInt(v.size());
+  vis.bytes(v.data(), v.size() * sizeof(uint64_t));
+}
+
+// Used by IndexFile::dependencies and IndexFile::dependency_hashes.
+template <typename T>
+void reflect(JsonReader &vis, DenseMap<CachedHashStringRef, T> &v) {
   for (auto it = vis.m->MemberBegin(); it != vis.m->MemberEnd(); ++it)
-    v[internH(it->name.GetString())] = it->value.GetInt64();
+    v[internH(it->name.GetString())] = it->value.template Get<T>();
 }
-void reflect(JsonWriter &vis, DenseMap<CachedHashStringRef, int64_t> &v) {
+template <typename T>
+void reflect(JsonSaxReader &vis, DenseMap<CachedHashStringRef, T> &v) {
+  reflectMemberStart(vis);
+  while (vis.peek().type == JsonSaxReader::Token::Key) {
+    const char *name = vis.tokens[vis.pos++].s;
+    reflect(vis, v[internH(name)]);
+  }
+  reflectMemberEnd(vis);
+}
+template <typename T>
+void reflect(JsonWriter &vis, DenseMap<CachedHashStringRef, T> &v) {
   vis.startObject();
   for (auto &it : v) {
     vis.m->Key(it.first.val().data()); // llvm 8 -> data()
-    vis.m->Int64(it.second);
+    reflect(vis, it.second);
   }
   vis.endObject();
 }
-void reflect(BinaryReader &vis, DenseMap<CachedHashStringRef, int64_t> &v) {
+template <typename T>
+void reflect(BinaryReader &vis, DenseMap<CachedHashStringRef, T> &v) {
   std::string name;
   for (auto n = vis.varUInt(); n; n--) {
     reflect(vis, name);
     reflect(vis, v[internH(name)]);
   }
 }
-void reflect(BinaryWriter &vis, DenseMap<CachedHashStringRef, int64_t> &v) {
+template <typename T>
+void reflect(BinaryWriter &vis, DenseMap<CachedHashStringRef, T> &v) {
   std::string key;
   vis.varUInt(v.size());
   for (auto &it : v) {
@@ -234,6 +410,11 @@ void reflectHoverAndComments(JsonReader &vis, Def &def) {
   reflectMember(vis, "comments", def.comments);
 }
 template <typename Def>
+void reflectHoverAndComments(JsonSaxReader &vis, Def &def) {
+  reflectMember(vis, "hover", def.hover);
+  reflectMember(vis, "comments", def.comments);
+}
+template <typename Def>
 void reflectHoverAndComments(JsonWriter &vis, Def &def) {
   // Don't emit empty hover and comments in JSON test mode.
   if (!gTestOutputMode || def.hover[0])
@@ -252,7 +433,8 @@ void reflectHoverAndComments(BinaryWriter &vis, Def &def) {
   reflect(vis, def.comments);
 }
 
-template <typename Def> void reflectShortName(JsonReader &vis, Def &def) {
+template <typename Vis, typename Def>
+void readShortName(Vis &vis, Def &def) {
   if (gTestOutputMode) {
     std::string short_name;
     reflectMember(vis, "short_name", short_name);
@@ -265,6 +447,12 @@ template <typename Def> void reflectShortName(JsonReader &vis, Def &def) {
     reflectMember(vis, "short_name_size", def.short_name_size);
   }
 }
+template <typename Def> void reflectShortName(JsonReader &vis, Def &def) {
+  readShortName(vis, def);
+}
+template <typename Def> void reflectShortName(JsonSaxReader &vis, Def &def) {
+  readShortName(vis, def);
+}
 template <typename Def> void reflectShortName(JsonWriter &vis, Def &def) {
   if (gTestOutputMode) {
     std::string_view short_name(def.detailed_name + def.short_name_offset,
@@ -305,6 +493,7 @@ template <typename TVisitor> void reflect1(TVisitor &vis, IndexFunc &v) {
   reflectMemberEnd(vis);
 }
 void reflect(JsonReader &vis, IndexFunc &v) { reflect1(vis, v); }
+void reflect(JsonSaxReader &vis, IndexFunc &v) { reflect1(vis, v); }
 void reflect(JsonWriter &vis, IndexFunc &v) { reflect1(vis, v); }
 void reflect(BinaryReader &vis, IndexFunc &v) { reflect1(vis, v); }
 void reflect(BinaryWriter &vis, IndexFunc &v) { reflect1(vis, v); }
@@ -332,6 +521,7 @@ template <typename Vis> void reflect1(Vis &vis, IndexType &v) {
   reflectMemberEnd(vis);
 }
 void reflect(JsonReader &vis, IndexType &v) { reflect1(vis, v); }
+void reflect(JsonSaxReader &vis, IndexType &v) { reflect1(vis, v); }
 void reflect(JsonWriter &vis, IndexType &v) { reflect1(vis, v); }
 void reflect(BinaryReader &vis, IndexType &v) { reflect1(vis, v); }
 void reflect(BinaryWriter &vis, IndexType &v) { reflect1(vis, v); }
@@ -354,21 +544,39 @@ template <typename TVisitor> void reflect1(TVisitor &vis, IndexVar &v) {
   reflectMemberEnd(vis);
 }
 void reflect(JsonReader &vis, IndexVar &v) { reflect1(vis, v); }
+void reflect(JsonSaxReader &vis, IndexVar &v) { reflect1(vis, v); }
 void reflect(JsonWriter &vis, IndexVar &v) { reflect1(vis, v); }
 void reflect(BinaryReader &vis, IndexVar &v) { reflect1(vis, v); }
 void reflect(BinaryWriter &vis, IndexVar &v) { reflect1(vis, v); }
 
 // IndexFile
+// Whether a member added in minor version |minor| is present. Older binary
+// cache files leave it default initialized.
+template <typename TVisitor> bool since(TVisitor &, int) { return true; }
+bool since(BinaryReader &vis, int minor) { return vis.minor >= minor; }
+
 template <typename TVisitor> void reflect1(TVisitor &vis, IndexFile &v) {
   reflectMemberStart(vis);
   if (!gTestOutputMode) {
     REFLECT_MEMBER(mtime);
+    if (since(vis, 2))
+      REFLECT_MEMBER(content_hash);
+    if (since(vis, 3))
+      REFLECT_MEMBER(memory);
+    if (since(vis, 6))
+      REFLECT_MEMBER(cost);
     REFLECT_MEMBER(language);
     REFLECT_MEMBER(no_linkage);
+    if (since(vis, 4))
+      REFLECT_MEMBER(declarations_only);
+    if (since(vis, 7))
+      REFLECT_MEMBER(partial);
     REFLECT_MEMBER(lid2path);
     REFLECT_MEMBER(import_file);
     REFLECT_MEMBER(args);
     REFLECT_MEMBER(dependencies);
+    if (since(vis, 2))
+      REFLECT_MEMBER(dependency_hashes);
   }
   REFLECT_MEMBER(includes);
   REFLECT_MEMBER(skipped_ranges);
@@ -378,6 +586,7 @@ template <typename TVisitor> void reflect1(TVisitor &vis, IndexFile &v) {
   reflectMemberEnd(vis);
 }
 void reflectFile(JsonReader &vis, IndexFile &v) { reflect1(vis, v); }
+void reflectFile(JsonSaxReader &vis, IndexFile &v) { reflect1(vis, v); }
 void reflectFile(JsonWriter &vis, IndexFile &v) { reflect1(vis, v); }
 void reflectFile(BinaryReader &vis, IndexFile &v) { reflect1(vis, v); }
 void reflectFile(BinaryWriter &vis, IndexFile &v) { reflect1(vis, v); }
@@ -403,18 +612,31 @@ void reflectMemberStart(JsonReader &vis) {
     throw std::invalid_argument("object");
 }
 
-static BumpPtrAllocator alloc;
-static DenseSet<CachedHashStringRef> strings;
-static std::mutex allocMutex;
+namespace {
+// Interned strings are sharded by hash, each shard with its own lock and
+// arena, so that threads loading caches rarely contend. Strings are never
+// freed.
+struct InternShard {
+  std::mutex mutex;
+  BumpPtrAllocator alloc;
+  DenseSet<CachedHashStringRef> strings;
+};
+constexpr unsigned kInternShards = 64;
+InternShard intern_shards[kInternShards];
+} // namespace
 
 CachedHashStringRef internH(StringRef s) {
   if (s.empty())
     s = "";
-  CachedHashString hs(s);
-  std::lock_guard lock(allocMutex);
-  auto r = strings.insert(hs);
+  // Hash outside of the lock. |hs| refers to the caller's buffer and is
+  // replaced by an arena copy if |s| is new. DenseSet uses the low bits of
+  // the hash, so pick the shard with the high bits.
+  CachedHashStringRef hs(s);
+  InternShard &shard = intern_shards[(hs.hash() >> 26) % kInternShards];
+  std::lock_guard lock(shard.mutex);
+  auto r = shard.strings.insert(hs);
   if (r.second) {
-    char *p = alloc.Allocate<char>(s.size() + 1);
+    char *p = shard.alloc.Allocate<char>(s.size() + 1);
     memcpy(p, s.data(), s.size());
     p[s.size()] = '\0';
     *r.first = CachedHashStringRef(StringRef(p, s.size()), hs.hash());
@@ -424,7 +646,82 @@ CachedHashStringRef internH(StringRef s) {
 
 const char *intern(StringRef s) { return internH(s).val().data(); }
 
+namespace {
+struct ArgsHash {
+  size_t operator()(const std::vector<const char *> &args) const {
+    return hash_combine_range(args.begin(), args.end());
+  }
+};
+} // namespace
+
+static std::unordered_set<std::vector<const char *>, ArgsHash> arg_vectors;
+static std::mutex argsMutex;
+
+ArrayRef<const char *> internArgs(const std::vector<const char *> &args) {
+  if (args.empty())
+    return {};
+  // Arguments are mostly interned, so comparing pointers finds most of the
+  // sharing. Nodes of |arg_vectors| are never moved.
+  std::lock_guard lock(argsMutex);
+  return *arg_vectors.insert(args).first;
+}
+
+namespace {
+// A compressed cache file is the magic, the uncompressed size and the zstd
+// frame. Neither format can start with 0xff.
+const char kZstdMagic[4] = {'\xff', 'z', 's', 't'};
+
+std::string maybeCompress(std::string data) {
+  int level = g_config ? g_config->cache.compress : 0;
+  if (level <= 0)
+    return data;
+#if LLVM_VERSION_MAJOR >= 15
+  if (compression::zstd::isAvailable()) {
+    SmallVector<uint8_t, 0> out;
+    compression::zstd::compress(arrayRefFromStringRef(data), out, level);
+    uint64_t size = data.size();
+    std::string ret(kZstdMagic, sizeof kZstdMagic);
+    ret.append(reinterpret_cast<const char *>(&size), sizeof size);
+    ret.append(out.begin(), out.end());
+    return ret;
+  }
+#endif
+  static std::once_flag once;
+  std::call_once(once, [] {
+    LOG_S(WARNING) << "cache.compress is ignored as zstd is unavailable";
+  });
+  return data;
+}
+
+// Returns false if |in| is compressed but cannot be decompressed. Otherwise
+// |in| is either left unchanged or points to |buf|.
+bool maybeDecompress(std::string_view &in, std::string &buf) {
+  if (in.size() < sizeof kZstdMagic ||
+      memcmp(in.data(), kZstdMagic, sizeof kZstdMagic))
+    return true;
+  uint64_t size;
+  if (in.size() < sizeof kZstdMagic + sizeof size)
+    return false;
+  memcpy(&size, in.data() + sizeof kZstdMagic, sizeof size);
+#if LLVM_VERSION_MAJOR >= 15
+  if (compression::zstd::isAvailable()) {
+    std::string_view frame = in.substr(sizeof kZstdMagic + sizeof size);
+    SmallVector<uint8_t, 0> out;
+    if (errorToBool(compression::zstd::decompress(
+            arrayRefFromStringRef(StringRef(frame.data(), frame.size())),
+            out, size)))
+      return false;
+    buf.assign(out.begin(), out.end());
+    in = buf;
+    return true;
+  }
+#endif
+  return false;
+}
+} // namespace
+
 std::string serialize(SerializeFormat format, IndexFile &file) {
+  trace::Span span("serialize");
   switch (format) {
   case SerializeFormat::Binary: {
     BinaryWriter writer;
@@ -433,7 +730,7 @@ std::string serialize(SerializeFormat format, IndexFile &file) {
     reflect(writer, major);
     reflect(writer, minor);
     reflectFile(writer, file);
-    return writer.take();
+    return maybeCompress(writer.take());
   }
   case SerializeFormat::Json: {
     rapidjson::StringBuffer output;
@@ -449,7 +746,7 @@ std::string serialize(SerializeFormat format, IndexFile &file) {
       output.Put('\n');
     }
     reflectFile(json_writer, file);
-    return output.GetString();
+    return maybeCompress(output.GetString());
   }
   }
   return "";
@@ -457,12 +754,19 @@ std::string serialize(SerializeFormat format, IndexFile &file) {
 
 std::unique_ptr<IndexFile>
 deserialize(SerializeFormat format, const std::string &path,
-            const std::string &serialized_index_content,
+            std::string_view serialized_index_content,
             const std::string &file_content,
             std::optional<int> expected_version) {
   if (serialized_index_content.empty())
     return nullptr;
 
+  trace::Span span("deserialize");
+  size_t blob_size = serialized_index_content.size();
+  std::string decompressed;
+  if (!maybeDecompress(serialized_index_content, decompressed)) {
+    LOG_S(INFO) << "failed to decompress '" << path << "'";
+    return nullptr;
+  }
   std::unique_ptr<IndexFile> file;
   switch (format) {
   case SerializeFormat::Binary: {
@@ -473,11 +777,16 @@ deserialize(SerializeFormat format, const std::string &path,
       BinaryReader reader(serialized_index_content);
       reflect(reader, major);
       reflect(reader, minor);
+      // USRs and the layout of everything may change with the major version,
+      // but older minor versions can still be read.
       if (major != IndexFile::kMajorVersion ||
-          minor != IndexFile::kMinorVersion)
+          minor < IndexFile::kOldestMinorVersion ||
+          minor > IndexFile::kMinorVersion)
         throw std::invalid_argument("Invalid version");
+      reader.minor = minor;
       file = std::make_unique<IndexFile>(path, file_content, false);
       reflectFile(reader, *file);
+      file->migrated = minor != IndexFile::kMinorVersion;
     } catch (std::invalid_argument &e) {
       LOG_S(INFO) << "failed to deserialize '" << path << "': " << e.what();
       return nullptr;
@@ -485,20 +794,36 @@ deserialize(SerializeFormat format, const std::string &path,
     break;
   }
   case SerializeFormat::Json: {
-    rapidjson::Document reader;
-    if (gTestOutputMode || !expected_version) {
-      reader.Parse(serialized_index_content.c_str());
-    } else {
-      const char *p = strchr(serialized_index_content.c_str(), '\n');
-      if (!p)
+    std::string_view json = serialized_index_content;
+    if (!gTestOutputMode && expected_version) {
+      size_t p = json.find('\n');
+      if (p == std::string_view::npos)
         return nullptr;
-      if (atoi(serialized_index_content.c_str()) != *expected_version)
+      if (atoi(std::string(json.substr(0, p)).c_str()) != *expected_version)
         return nullptr;
-      reader.Parse(p + 1);
+      json.remove_prefix(p + 1);
     }
-    if (reader.HasParseError())
+
+    // The SAX reader parses a copy in place and needs no DOM. Files whose
+    // members are not in the order written by serialize are read by
+    // JsonReader.
+    std::string buf(json);
+    JsonSaxReader sax_reader;
+    if (!sax_reader.parse(buf.data()))
       return nullptr;
+    file = std::make_unique<IndexFile>(path, file_content, false);
+    try {
+      reflectFile(sax_reader, *file);
+      break;
+    } catch (std::invalid_argument &e) {
+      LOG_V(1) << "'" << path << "': failed to stream "
+               << sax_reader.getPath() << "." << e.what();
+    }
 
+    rapidjson::Document reader;
+    reader.Parse(json.data(), json.size());
+    if (reader.HasParseError())
+      return nullptr;
     file = std::make_unique<IndexFile>(path, file_content, false);
     JsonReader json_reader{&reader};
     try {
@@ -514,6 +839,7 @@ deserialize(SerializeFormat format, const std::string &path,
 
   // Restore non-serialized state.
   file->path = path;
+  file->blob_size = blob_size;
   if (g_config->clang.pathMappings.size()) {
     doPathMapping(file->import_file);
     std::vector<const char *> args;
@@ -537,6 +863,13 @@ deserialize(SerializeFormat format, const std::string &path,
       dependencies[internH(path)] = it.second;
     }
     file->dependencies = std::move(dependencies);
+    decltype(file->dependency_hashes) dependency_hashes;
+    for (auto &it : file->dependency_hashes) {
+      std::string path = it.first.val().str();
+      doPathMapping(path);
+      dependency_hashes[internH(path)] = it.second;
+    }
+    file->dependency_hashes = std::move(dependency_hashes);
   }
   return file;
 }
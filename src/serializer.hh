@@ -11,6 +11,8 @@
 #include <rapidjson/fwd.h>
 
 #include <cassert>
+#include <climits>
+#include <cstring>
 #include <functional>
 #include <memory>
 #include <optional>
@@ -20,6 +22,7 @@
 #include <vector>
 
 namespace llvm {
+template <typename T> class ArrayRef;
 class CachedHashStringRef;
 class StringRef;
 template <typename Fn> class function_ref;
@@ -32,18 +35,98 @@ struct JsonNull {};
 
 struct JsonReader {
   rapidjson::Value *m;
+  // Members and elements enclosing the value that failed to parse, innermost
+  // first. Only filled while the exception propagates, see getPath.
   std::vector<const char *> path_;
 
   JsonReader(rapidjson::Value *m) : m(m) {}
   void startObject() {}
   void endObject() {}
   void iterArray(llvm::function_ref<void()> fn);
-  void member(const char *name, llvm::function_ref<void()> fn);
+  template <typename Fn> void member(const char *name, Fn &&fn) {
+    if (rapidjson::Value *v = findMember(name)) {
+      rapidjson::Value *saved = m;
+      m = v;
+      try {
+        fn();
+      } catch (...) {
+        path_.push_back(name);
+        throw;
+      }
+      m = saved;
+    }
+  }
+  rapidjson::Value *findMember(const char *name);
   bool isNull();
   std::string getString();
   std::string getPath() const;
 };
 
+// Reads a JSON cache file without a rapidjson::Document. The SAX parser
+// records the values in document order as a flat array of tokens, with
+// strings parsed in place, and reflect consumes the tokens one by one.
+// Members must appear in the order written by JsonWriter: reflectMemberEnd
+// throws if an object has members left, and deserialize then falls back to
+// JsonReader.
+struct JsonSaxReader {
+  struct Token {
+    enum Type : uint8_t {
+      Null,
+      Bool,
+      Int,
+      Uint,
+      Double,
+      String,
+      Key,
+      StartObject,
+      EndObject,
+      StartArray,
+      EndArray
+    } type;
+    // Length of String and Key.
+    uint32_t n;
+    union {
+      bool b;
+      int64_t i;
+      uint64_t u;
+      double d;
+      // Null terminated, in the parsed buffer.
+      const char *s;
+    };
+  };
+  std::vector<Token> tokens;
+  size_t pos = 0;
+  // See JsonReader::path_.
+  std::vector<const char *> path_;
+
+  // Parses |json|, which is modified in place and must outlive the reader.
+  // Returns false on a syntax error.
+  bool parse(char *json);
+  const Token &peek() const { return tokens[pos]; }
+  const Token &next(Token::Type type, const char *expected);
+  template <typename Fn> void member(const char *name, Fn &&fn) {
+    const Token &t = tokens[pos];
+    if (t.type != Token::Key || strcmp(t.s, name))
+      return;
+    pos++;
+    try {
+      fn();
+    } catch (...) {
+      path_.push_back(name);
+      throw;
+    }
+  }
+  void iterArray(llvm::function_ref<void()> fn);
+  // Consumes the value if it is null.
+  bool takeNull();
+  bool getBool();
+  int64_t getInt64();
+  uint64_t getUint64();
+  double getDouble();
+  std::string_view getString();
+  std::string getPath() const;
+};
+
 struct JsonWriter {
   using W =
       rapidjson::Writer<rapidjson::StringBuffer, rapidjson::UTF8<char>,
@@ -65,6 +148,10 @@ struct JsonWriter {
 
 struct BinaryReader {
   const char *p_;
+  // IndexFile::kMinorVersion of the data. Readers of members whose layout has
+  // changed consult it to read older cache files; INT_MAX is the current
+  // layout.
+  int minor = INT_MAX;
 
   BinaryReader(std::string_view buf) : p_(buf.data()) {}
   template <typename T> T get() {
@@ -100,9 +187,7 @@ struct BinaryWriter {
   std::string buf_;
 
   template <typename T> void pack(T x) {
-    auto i = buf_.size();
-    buf_.resize(i + sizeof(x));
-    memcpy(buf_.data() + i, &x, sizeof(x));
+    buf_.append(reinterpret_cast<const char *>(&x), sizeof(x));
   }
 
   void varUInt(uint64_t n) {
@@ -124,9 +209,11 @@ struct BinaryWriter {
 
   void string(const char *x) { string(x, strlen(x)); }
   void string(const char *x, size_t len) {
-    auto i = buf_.size();
-    buf_.resize(i + len + 1);
-    memcpy(buf_.data() + i, x, len);
+    buf_.append(x, len);
+    buf_.push_back('\0');
+  }
+  void bytes(const void *x, size_t len) {
+    buf_.append(static_cast<const char *>(x), len);
   }
 };
 
@@ -156,6 +243,11 @@ struct IndexFile;
   LLVM_ATTRIBUTE_UNUSED inline void reflect(BinaryWriter &vis, T &v) {         \
     auto v0 = static_cast<std::underlying_type_t<T>>(v);                       \
     ::ccls::reflect(vis, v0);                                                  \
+  }                                                                            \
+  LLVM_ATTRIBUTE_UNUSED inline void reflect(JsonSaxReader &vis, T &v) {        \
+    std::underlying_type_t<T> v0;                                              \
+    ::ccls::reflect(vis, v0);                                                  \
+    v = static_cast<T>(v0);                                                    \
   }
 
 #define _MAPPABLE_REFLECT_MEMBER(name) REFLECT_MEMBER(name);
@@ -211,6 +303,20 @@ void reflect(BinaryReader &vis, double &v);
 void reflect(BinaryReader &vis, const char *&v);
 void reflect(BinaryReader &vis, std::string &v);
 
+void reflect(JsonSaxReader &vis, bool &v);
+void reflect(JsonSaxReader &vis, unsigned char &v);
+void reflect(JsonSaxReader &vis, short &v);
+void reflect(JsonSaxReader &vis, unsigned short &v);
+void reflect(JsonSaxReader &vis, int &v);
+void reflect(JsonSaxReader &vis, unsigned &v);
+void reflect(JsonSaxReader &vis, long &v);
+void reflect(JsonSaxReader &vis, unsigned long &v);
+void reflect(JsonSaxReader &vis, long long &v);
+void reflect(JsonSaxReader &vis, unsigned long long &v);
+void reflect(JsonSaxReader &vis, double &v);
+void reflect(JsonSaxReader &vis, const char *&v);
+void reflect(JsonSaxReader &vis, std::string &v);
+
 void reflect(BinaryWriter &vis, bool &v);
 void reflect(BinaryWriter &vis, unsigned char &v);
 void reflect(BinaryWriter &vis, short &v);
@@ -251,6 +357,12 @@ template <typename T> void reflect(JsonWriter &vis, std::optional<T> &v) {
   else
     vis.null_();
 }
+template <typename T> void reflect(JsonSaxReader &vis, std::optional<T> &v) {
+  if (!vis.takeNull()) {
+    v.emplace();
+    reflect(vis, *v);
+  }
+}
 template <typename T> void reflect(BinaryReader &vis, std::optional<T> &v) {
   if (*vis.p_++) {
     v.emplace();
@@ -277,6 +389,10 @@ template <typename T> void reflect(JsonWriter &vis, Maybe<T> &v) {
   else
     vis.null_();
 }
+template <typename T> void reflect(JsonSaxReader &vis, Maybe<T> &v) {
+  if (!vis.takeNull())
+    reflect(vis, *v);
+}
 template <typename T> void reflect(BinaryReader &vis, Maybe<T> &v) {
   if (*vis.p_++)
     reflect(vis, *v);
@@ -331,6 +447,13 @@ void reflect(JsonWriter &vis, std::pair<L, R> &v) {
   vis.endObject();
 }
 template <typename L, typename R>
+void reflect(JsonSaxReader &vis, std::pair<L, R> &v) {
+  vis.next(JsonSaxReader::Token::StartObject, "object");
+  vis.member("L", [&]() { reflect(vis, v.first); });
+  vis.member("R", [&]() { reflect(vis, v.second); });
+  vis.next(JsonSaxReader::Token::EndObject, "member order");
+}
+template <typename L, typename R>
 void reflect(BinaryReader &vis, std::pair<L, R> &v) {
   reflect(vis, v.first);
   reflect(vis, v.second);
@@ -354,6 +477,12 @@ template <typename T> void reflect(JsonWriter &vis, std::vector<T> &v) {
     reflect(vis, it);
   vis.endArray();
 }
+template <typename T> void reflect(JsonSaxReader &vis, std::vector<T> &v) {
+  vis.iterArray([&]() {
+    v.emplace_back();
+    reflect(vis, v.back());
+  });
+}
 template <typename T> void reflect(BinaryReader &vis, std::vector<T> &v) {
   for (auto n = vis.varUInt(); n; n--) {
     v.emplace_back();
@@ -365,6 +494,17 @@ template <typename T> void reflect(BinaryWriter &vis, std::vector<T> &v) {
   for (auto &it : v)
     reflect(vis, it);
 }
+// USRs are hashes which don't compress with varUInt. Copy them as a block.
+void reflect(BinaryReader &vis, std::vector<uint64_t> &v);
+void reflect(BinaryWriter &vis, std::vector<uint64_t> &v);
+
+// llvm::ArrayRef, write only
+template <typename T> void reflect(JsonWriter &vis, llvm::ArrayRef<T> &v) {
+  vis.startArray();
+  for (T it : v)
+    reflect(vis, it);
+  vis.endArray();
+}
 
 // reflectMember
 
@@ -375,11 +515,22 @@ inline void reflectMemberStart(JsonWriter &vis) { vis.startObject(); }
 template <typename T> void reflectMemberEnd(T &) {}
 inline void reflectMemberEnd(JsonWriter &vis) { vis.endObject(); }
 
+inline void reflectMemberStart(JsonSaxReader &vis) {
+  vis.next(JsonSaxReader::Token::StartObject, "object");
+}
+inline void reflectMemberEnd(JsonSaxReader &vis) {
+  vis.next(JsonSaxReader::Token::EndObject, "member order");
+}
+
 template <typename T>
 void reflectMember(JsonReader &vis, const char *name, T &v) {
   vis.member(name, [&]() { reflect(vis, v); });
 }
 template <typename T>
+void reflectMember(JsonSaxReader &vis, const char *name, T &v) {
+  vis.member(name, [&]() { reflect(vis, v); });
+}
+template <typename T>
 void reflectMember(JsonWriter &vis, const char *name, T &v) {
   vis.key(name);
   reflect(vis, v);
@@ -397,10 +548,15 @@ void reflectMember(BinaryWriter &vis, const char *, T &v) {
 
 const char *intern(llvm::StringRef str);
 llvm::CachedHashStringRef internH(llvm::StringRef str);
+// Returns a copy of |args| which is never freed. Equal argument vectors share
+// storage.
+llvm::ArrayRef<const char *> internArgs(const std::vector<const char *> &args);
 std::string serialize(SerializeFormat format, IndexFile &file);
+// |serialized_index_content| may point into a memory-mapped cache file. The
+// returned IndexFile does not reference it.
 std::unique_ptr<IndexFile>
 deserialize(SerializeFormat format, const std::string &path,
-            const std::string &serialized_index_content,
+            std::string_view serialized_index_content,
             const std::string &file_content,
             std::optional<int> expected_version);
 } // namespace ccls
@@ -0,0 +1,313 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "snapshot.hh"
+
+#include "log.hh"
+#include "message_handler.hh"
+#include "query.hh"
+#include "serializer.hh"
+
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/xxhash.h>
+
+#include <errno.h>
+#include <string.h>
+#include <type_traits>
+
+using namespace llvm;
+
+namespace ccls {
+namespace {
+const char kMagic[8] = {'c', 'c', 'l', 's', 's', 'n', 'a', 'p'};
+// Bump when the layout below changes. Index struct changes are covered by
+// IndexFile::kMajorVersion and kMinorVersion.
+const int kVersion = 3;
+
+template <typename Vis>
+constexpr bool kRead = std::is_same_v<Vis, BinaryReader>;
+
+// The same code reads and writes a snapshot. |n| is the size of a container
+// being written; the returned size is the one read or written.
+size_t count(BinaryReader &vis, size_t) { return vis.varUInt(); }
+size_t count(BinaryWriter &vis, size_t n) {
+  vis.varUInt(n);
+  return n;
+}
+
+// Leaves are defined before containers so that the overloads are visible from
+// the templates using them.
+template <typename Vis, typename T>
+std::enable_if_t<std::is_arithmetic_v<T> || std::is_enum_v<T>> snap(Vis &vis,
+                                                                     T &v) {
+  reflect(vis, v);
+}
+template <typename Vis> void snap(Vis &vis, const char *&v) { reflect(vis, v); }
+template <typename Vis> void snap(Vis &vis, std::string &v) { reflect(vis, v); }
+template <typename Vis> void snap(Vis &vis, Range &v) { reflect(vis, v); }
+
+template <typename Vis> void snap(Vis &vis, Use &v) { reflect(vis, v); }
+template <typename Vis> void snap(Vis &vis, DeclRef &v) { reflect(vis, v); }
+template <typename Vis> void snap(Vis &vis, SymbolRef &v) { reflect(vis, v); }
+template <typename Vis> void snap(Vis &vis, ExtentRef &v) {
+  snap(vis, static_cast<SymbolRef &>(v));
+  snap(vis, v.extent);
+}
+template <typename Vis> void snap(Vis &vis, IndexInclude &v) {
+  snap(vis, v.line);
+  snap(vis, v.resolved_path);
+}
+
+template <typename Vis, typename L, typename R>
+void snap(Vis &vis, std::pair<L, R> &v) {
+  snap(vis, v.first);
+  snap(vis, v.second);
+}
+template <typename Vis> void snap(Vis &vis, Maybe<DeclRef> &v) {
+  if (count(vis, v.valid()))
+    snap(vis, *v);
+}
+template <typename Vis, typename T> void snap(Vis &vis, std::vector<T> &v) {
+  v.resize(count(vis, v.size()));
+  for (T &x : v)
+    snap(vis, x);
+}
+template <typename Vis, typename T> void snap(Vis &vis, Vec<T> &v) {
+  size_t n = count(vis, v.size());
+  if (n != size_t(v.size()))
+    v = {std::make_unique<T[]>(n), int(n)};
+  for (T &x : v)
+    snap(vis, x);
+}
+template <typename Vis> void snap(Vis &vis, UseList &v) {
+  if constexpr (kRead<Vis>) {
+    std::vector<Use> uses;
+    snap(vis, uses);
+    v.add(uses);
+  } else {
+    count(vis, v.size());
+    for (Use use : v)
+      snap(vis, use);
+  }
+}
+
+// Fields shared by FuncDef, TypeDef and VarDef. Unlike the index, file_id is
+// saved.
+template <typename Vis, typename Def> void snapCommon(Vis &vis, Def &v) {
+  snap(vis, v.detailed_name);
+  snap(vis, v.hover);
+  snap(vis, v.comments);
+  snap(vis, v.spell);
+  snap(vis, v.file_id);
+  snap(vis, v.qual_name_offset);
+  snap(vis, v.short_name_offset);
+  snap(vis, v.short_name_size);
+  snap(vis, v.kind);
+  snap(vis, v.parent_kind);
+}
+template <typename Vis> void snap(Vis &vis, QueryFunc::Def &v) {
+  snapCommon(vis, v);
+  snap(vis, v.bases);
+  snap(vis, v.vars);
+  snap(vis, v.callees);
+  snap(vis, v.storage);
+}
+template <typename Vis> void snap(Vis &vis, QueryType::Def &v) {
+  snapCommon(vis, v);
+  snap(vis, v.bases);
+  snap(vis, v.funcs);
+  snap(vis, v.types);
+  snap(vis, v.vars);
+  snap(vis, v.alias_of);
+}
+template <typename Vis> void snap(Vis &vis, QueryVar::Def &v) {
+  snapCommon(vis, v);
+  snap(vis, v.type);
+  snap(vis, v.storage);
+}
+template <typename Vis, typename Def>
+void snap(Vis &vis, SmallVector<Def, 1> &v) {
+  v.resize(count(vis, v.size()));
+  for (Def &def : v)
+    snap(vis, def);
+}
+
+template <typename Vis> void snap(Vis &vis, QueryFile &v) {
+  if (count(vis, v.def.has_value())) {
+    if constexpr (kRead<Vis>)
+      v.def.emplace();
+    QueryFile::Def &def = *v.def;
+    snap(vis, def.path);
+    std::vector<const char *> args(def.args.begin(), def.args.end());
+    snap(vis, args);
+    if constexpr (kRead<Vis>)
+      def.args = internArgs(args);
+    snap(vis, def.language);
+    snap(vis, def.mtime);
+    snap(vis, def.includes);
+    snap(vis, def.skipped_ranges);
+    snap(vis, def.dependencies);
+    snap(vis, def.partial);
+  }
+  if constexpr (kRead<Vis>) {
+    for (size_t n = count(vis, 0); n; n--) {
+      std::pair<ExtentRef, int> p;
+      snap(vis, p);
+      v.symbol2refcnt.add(p.first, p.second);
+    }
+    v.symbol2refcnt.commit();
+  } else {
+    count(vis, v.symbol2refcnt.size());
+    for (auto &it : v.symbol2refcnt) {
+      std::pair<ExtentRef, int> p = it;
+      snap(vis, p);
+    }
+  }
+}
+
+template <typename Vis> void snap(Vis &vis, DB &db) {
+  db.files.resize(count(vis, db.files.size()));
+  for (size_t i = 0; i < db.files.size(); i++) {
+    db.files[i].id = i;
+    snap(vis, db.files[i]);
+  }
+  if constexpr (kRead<Vis>) {
+    for (size_t n = count(vis, 0); n; n--) {
+      std::string name;
+      int id;
+      snap(vis, name);
+      snap(vis, id);
+      db.name2file_id[name] = id;
+    }
+  } else {
+    count(vis, db.name2file_id.size());
+    for (auto &it : db.name2file_id) {
+      std::string name = it.first().str();
+      snap(vis, name);
+      snap(vis, it.second);
+    }
+  }
+
+  db.funcs.resize(count(vis, db.funcs.size()));
+  for (QueryFunc &func : db.funcs) {
+    snap(vis, func.usr);
+    snap(vis, func.def);
+    snap(vis, func.declarations);
+    snap(vis, func.derived);
+    snap(vis, func.uses);
+  }
+  db.types.resize(count(vis, db.types.size()));
+  for (QueryType &type : db.types) {
+    snap(vis, type.usr);
+    snap(vis, type.def);
+    snap(vis, type.declarations);
+    snap(vis, type.derived);
+    snap(vis, type.instances);
+    snap(vis, type.uses);
+  }
+  db.vars.resize(count(vis, db.vars.size()));
+  for (QueryVar &var : db.vars) {
+    snap(vis, var.usr);
+    snap(vis, var.def);
+    snap(vis, var.declarations);
+    snap(vis, var.uses);
+  }
+}
+
+void writeVersion(BinaryWriter &vis) {
+  vis.varUInt(kVersion);
+  vis.varUInt(IndexFile::kMajorVersion);
+  vis.varUInt(IndexFile::kMinorVersion);
+}
+bool readVersion(BinaryReader &vis) {
+  return vis.varUInt() == uint64_t(kVersion) &&
+         vis.varUInt() == uint64_t(IndexFile::kMajorVersion) &&
+         vis.varUInt() == uint64_t(IndexFile::kMinorVersion);
+}
+} // namespace
+
+bool writeSnapshot(DB &db, const std::string &path) {
+  BinaryWriter vis;
+  writeVersion(vis);
+  snap(vis, db);
+  std::string payload = vis.take();
+  uint64_t hash = xxHash64(payload);
+
+  std::string tmp = path + ".tmp";
+  FILE *fp = fopen(tmp.c_str(), "wb");
+  bool ok = fp && fwrite(kMagic, sizeof kMagic, 1, fp) == 1 &&
+            fwrite(&hash, sizeof hash, 1, fp) == 1 &&
+            fwrite(payload.data(), payload.size(), 1, fp) == 1;
+  if (fp)
+    ok = fclose(fp) == 0 && ok;
+  if (!ok) {
+    LOG_S(ERROR) << "failed to write " << tmp << ' ' << strerror(errno);
+    (void)sys::fs::remove(tmp);
+    return false;
+  }
+  if (std::error_code ec = sys::fs::rename(tmp, path)) {
+    LOG_S(ERROR) << "failed to rename " << tmp << ": " << ec.message();
+    (void)sys::fs::remove(tmp);
+    return false;
+  }
+  LOG_S(INFO) << "wrote snapshot " << path << " (" << payload.size()
+              << " bytes)";
+  return true;
+}
+
+bool readSnapshot(DB &db, const std::string &path) {
+  auto buf = MemoryBuffer::getFile(path);
+  if (!buf)
+    return false;
+  StringRef data = (*buf)->getBuffer();
+  uint64_t hash;
+  if (data.size() < sizeof kMagic + sizeof hash ||
+      memcmp(data.data(), kMagic, sizeof kMagic)) {
+    LOG_S(WARNING) << "discard invalid snapshot " << path;
+    return false;
+  }
+  memcpy(&hash, data.data() + sizeof kMagic, sizeof hash);
+  StringRef payload = data.drop_front(sizeof kMagic + sizeof hash);
+  if (xxHash64(payload) != hash) {
+    LOG_S(WARNING) << "discard corrupted snapshot " << path;
+    return false;
+  }
+  BinaryReader vis(std::string_view(payload.data(), payload.size()));
+  if (!readVersion(vis)) {
+    LOG_S(INFO) << "discard snapshot of a different version " << path;
+    return false;
+  }
+
+  DB db1;
+  snap(vis, db1);
+  if (vis.p_ != payload.end()) {
+    LOG_S(WARNING) << "discard invalid snapshot " << path;
+    return false;
+  }
+  for (int i = 0; i < (int)db1.funcs.size(); i++) {
+    db1.func_usr[db1.funcs[i].usr] = i;
+    db1.updateSymbolIndex({db1.funcs[i].usr, Kind::Func});
+  }
+  for (int i = 0; i < (int)db1.types.size(); i++) {
+    db1.type_usr[db1.types[i].usr] = i;
+    db1.updateSymbolIndex({db1.types[i].usr, Kind::Type});
+  }
+  for (int i = 0; i < (int)db1.vars.size(); i++) {
+    db1.var_usr[db1.vars[i].usr] = i;
+    db1.updateSymbolIndex({db1.vars[i].usr, Kind::Var});
+  }
+  // |includers| is derived from the includes of each file.
+  for (int i = 0, n = db1.files.size(); i < n; i++)
+    if (db1.files[i].def)
+      for (size_t j = 0; j < db1.files[i].def->includes.size(); j++) {
+        int id = db1.getFileId(db1.files[i].def->includes[j].resolved_path);
+        db1.files[id].includers.push_back(i);
+      }
+  db1.generation = db.generation + 1;
+  db = std::move(db1);
+  LOG_S(INFO) << "loaded snapshot " << path << " with " << db.files.size()
+              << " files";
+  return true;
+}
+} // namespace ccls
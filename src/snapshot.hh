@@ -0,0 +1,20 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <string>
+
+namespace ccls {
+struct DB;
+
+// A snapshot is the whole query database in one file: a magic, the xxHash64 of
+// the payload, and the payload with a version header followed by files, the
+// path map and entities in DB order. Loading it restores |db| directly, without
+// replaying cache files through IndexUpdate.
+//
+// readSnapshot leaves |db| untouched if the file is missing, corrupted or has
+// a different version.
+bool writeSnapshot(DB &db, const std::string &path);
+bool readSnapshot(DB &db, const std::string &path);
+} // namespace ccls
@@ -0,0 +1,211 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "symbol_table.hh"
+
+#include <algorithm>
+#include <string.h>
+#include <type_traits>
+
+using namespace llvm;
+
+namespace ccls {
+namespace {
+const char kMagic[8] = {'c', 'c', 'l', 's', 's', 'y', 'm', '1'};
+
+struct Header {
+  char magic[8];
+  uint32_t num_deps, num_records, strtab_size, reserved;
+};
+static_assert(sizeof(Header) == 24, "");
+
+struct Dep {
+  uint32_t offset, size;
+};
+} // namespace
+
+struct SymbolTable::Record {
+  uint64_t usr;
+  uint32_t name_offset;
+  uint16_t name_size, qual_name_offset, short_name_offset, short_name_size;
+  uint8_t kind, symbol_kind;
+  uint16_t start_line, end_line;
+  int16_t start_column, end_column;
+  uint16_t reserved;
+};
+static_assert(sizeof(SymbolTable::Record) == 32, "");
+
+std::unique_ptr<SymbolTable> SymbolTable::open(const std::string &path) {
+  auto buf_or = MemoryBuffer::getFile(path);
+  if (!buf_or)
+    return nullptr;
+  std::unique_ptr<MemoryBuffer> buf = std::move(*buf_or);
+  if (buf->getBufferSize() < sizeof(Header))
+    return nullptr;
+  Header h;
+  memcpy(&h, buf->getBufferStart(), sizeof h);
+  if (memcmp(h.magic, kMagic, sizeof kMagic) ||
+      buf->getBufferSize() != sizeof(Header) +
+                                  uint64_t(h.num_deps) * sizeof(Dep) +
+                                  uint64_t(h.num_records) * sizeof(Record) +
+                                  h.strtab_size)
+    return nullptr;
+
+  auto ret = std::make_unique<SymbolTable>();
+  const char *p = buf->getBufferStart() + sizeof(Header);
+  ret->records =
+      reinterpret_cast<const Record *>(p + h.num_deps * sizeof(Dep));
+  ret->strtab = reinterpret_cast<const char *>(ret->records + h.num_records);
+  ret->num_deps = h.num_deps;
+  ret->num_records = h.num_records;
+  ret->strtab_size = h.strtab_size;
+  // Reject out-of-bounds strings once, so that readers need not check.
+  for (uint32_t i = 0; i < h.num_deps; i++) {
+    Dep dep;
+    memcpy(&dep, p + i * sizeof(Dep), sizeof dep);
+    if (uint64_t(dep.offset) + dep.size > h.strtab_size)
+      return nullptr;
+  }
+  for (uint32_t i = 0; i < h.num_records; i++) {
+    const Record &r = ret->records[i];
+    if (uint64_t(r.name_offset) + r.name_size > h.strtab_size ||
+        r.qual_name_offset > r.short_name_offset ||
+        r.short_name_offset + r.short_name_size > r.name_size)
+      return nullptr;
+  }
+  ret->buf = std::move(buf);
+  return ret;
+}
+
+SymbolTable::Symbol SymbolTable::get(size_t i) const {
+  const Record &r = records[i];
+  Symbol sym;
+  sym.usr = r.usr;
+  sym.kind = Kind(r.kind);
+  sym.symbol_kind = SymbolKind(r.symbol_kind);
+  sym.detailed_name = std::string_view(strtab + r.name_offset, r.name_size);
+  sym.range = {{r.start_line, r.start_column}, {r.end_line, r.end_column}};
+  sym.qual_name_offset = r.qual_name_offset;
+  sym.short_name_offset = r.short_name_offset;
+  sym.short_name_size = r.short_name_size;
+  return sym;
+}
+
+std::string_view SymbolTable::shortName(size_t i) const {
+  const Record &r = records[i];
+  return std::string_view(strtab + r.name_offset + r.short_name_offset,
+                          r.short_name_size);
+}
+
+size_t SymbolTable::lowerBound(std::string_view name) const {
+  size_t lo = 0, hi = num_records;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (shortName(mid) < name)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+std::vector<std::string_view> SymbolTable::dependencies() const {
+  std::vector<std::string_view> ret;
+  ret.reserve(num_deps);
+  const char *p = buf->getBufferStart() + sizeof(Header);
+  for (uint32_t i = 0; i < num_deps; i++) {
+    Dep dep;
+    memcpy(&dep, p + i * sizeof(Dep), sizeof dep);
+    ret.emplace_back(strtab + dep.offset, dep.size);
+  }
+  return ret;
+}
+
+namespace {
+struct Builder {
+  std::vector<SymbolTable::Record> records;
+  std::string strtab;
+
+  template <typename E>
+  void add(Kind kind, const std::unordered_map<Usr, E> &usr2entity) {
+    for (auto &[usr, entity] : usr2entity) {
+      auto &def = entity.def;
+      size_t name_size = strlen(def.detailed_name);
+      if (!name_size || name_size > UINT16_MAX)
+        continue;
+      if constexpr (std::is_same_v<E, IndexVar>)
+        if (def.is_local())
+          continue;
+      // Only symbols spelled in this file. The file ID of an index file's own
+      // references is -1.
+      const DeclRef *dr = nullptr;
+      if (def.spell && def.spell->file_id == -1)
+        dr = &*def.spell;
+      else
+        for (auto &decl : entity.declarations)
+          if (decl.file_id == -1) {
+            dr = &decl;
+            break;
+          }
+      if (!dr)
+        continue;
+      SymbolTable::Record r{};
+      r.usr = usr;
+      r.name_offset = strtab.size();
+      r.name_size = name_size;
+      r.qual_name_offset = def.qual_name_offset;
+      r.short_name_offset = def.short_name_offset;
+      r.short_name_size = def.short_name_size;
+      r.kind = uint8_t(kind);
+      r.symbol_kind = uint8_t(def.kind);
+      r.start_line = dr->range.start.line;
+      r.start_column = dr->range.start.column;
+      r.end_line = dr->range.end.line;
+      r.end_column = dr->range.end.column;
+      if (r.qual_name_offset > r.short_name_offset ||
+          r.short_name_offset + r.short_name_size > r.name_size)
+        continue;
+      strtab.append(def.detailed_name, name_size);
+      records.push_back(r);
+    }
+  }
+};
+} // namespace
+
+std::string buildSymbolTable(const IndexFile &file) {
+  Builder b;
+  std::vector<Dep> deps;
+  for (auto &dep : file.dependencies) {
+    StringRef path = dep.first.val();
+    deps.push_back({uint32_t(b.strtab.size()), uint32_t(path.size())});
+    b.strtab += path;
+  }
+  b.add(Kind::Func, file.usr2func);
+  b.add(Kind::Type, file.usr2type);
+  b.add(Kind::Var, file.usr2var);
+  auto shortName = [&](const SymbolTable::Record &r) {
+    return std::string_view(b.strtab).substr(
+        r.name_offset + r.short_name_offset, r.short_name_size);
+  };
+  std::sort(b.records.begin(), b.records.end(),
+            [&](const auto &l, const auto &r) {
+              return shortName(l) < shortName(r);
+            });
+
+  Header h{};
+  memcpy(h.magic, kMagic, sizeof kMagic);
+  h.num_deps = deps.size();
+  h.num_records = b.records.size();
+  h.strtab_size = b.strtab.size();
+  std::string ret;
+  ret.reserve(sizeof h + deps.size() * sizeof(Dep) +
+              b.records.size() * sizeof(SymbolTable::Record) + b.strtab.size());
+  ret.append(reinterpret_cast<const char *>(&h), sizeof h);
+  ret.append(reinterpret_cast<const char *>(deps.data()),
+             deps.size() * sizeof(Dep));
+  ret.append(reinterpret_cast<const char *>(b.records.data()),
+             b.records.size() * sizeof(SymbolTable::Record));
+  ret += b.strtab;
+  return ret;
+}
+} // namespace ccls
@@ -0,0 +1,75 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "indexer.hh"
+
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ccls {
+// The symbols declared in one indexed file, stored next to its cache file as
+// xxx.sym if cache.symbolTable is true. workspace/symbol reads the tables of
+// files whose caches have not been loaded (index.lazyLoad) instead of loading
+// the caches. The file is
+//
+//   magic, u32 #dependencies, u32 #records, u32 string table size,
+//   (u32 offset, u32 size) of each dependency path in the string table,
+//   records sorted by short name, string table
+//
+// and is memory-mapped when read.
+class SymbolTable {
+public:
+  struct Symbol {
+    Usr usr;
+    Kind kind;
+    SymbolKind symbol_kind;
+    std::string_view detailed_name;
+    // Spelling of the definition, or of a declaration if the file has no
+    // definition.
+    Range range;
+
+    std::string_view name(bool qualified) const {
+      return qualified ? detailed_name.substr(qual_name_offset,
+                                              short_name_offset -
+                                                  qual_name_offset +
+                                                  short_name_size)
+                       : detailed_name.substr(short_name_offset,
+                                              short_name_size);
+    }
+
+    uint16_t qual_name_offset, short_name_offset, short_name_size;
+  };
+  // The on-disk layout of a symbol.
+  struct Record;
+
+  // Returns nullptr if |path| does not exist or is not a valid table.
+  static std::unique_ptr<SymbolTable> open(const std::string &path);
+
+  size_t size() const { return num_records; }
+  Symbol get(size_t i) const;
+  // Returns the index of the first symbol whose short name is not less than
+  // |name|.
+  size_t lowerBound(std::string_view name) const;
+  // Paths of the files included by a translation unit. Empty for headers.
+  std::vector<std::string_view> dependencies() const;
+
+private:
+  std::unique_ptr<llvm::MemoryBuffer> buf;
+  const Record *records = nullptr;
+  const char *strtab = nullptr;
+  uint32_t num_deps = 0, num_records = 0, strtab_size = 0;
+
+  std::string_view shortName(size_t i) const;
+};
+
+// Serializes the table of |file|.
+std::string buildSymbolTable(const IndexFile &file);
+} // namespace ccls
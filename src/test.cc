@@ -19,15 +19,13 @@
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <fstream>
 #include <stdio.h>
 #include <stdlib.h>
-
-// The 'diff' utility is available and we can use dprintf(3).
-#if _POSIX_C_SOURCE >= 200809L
-#include <sys/wait.h>
-#include <unistd.h>
-#endif
+#include <thread>
 
 using namespace llvm;
 
@@ -79,24 +77,6 @@ void trimInPlace(std::string &s) {
   s.erase(std::find_if(s.rbegin(), s.rend(), f).base(), s.end());
 }
 
-std::vector<std::string> splitString(const std::string &str,
-                                     const std::string &delimiter) {
-  // http://stackoverflow.com/a/13172514
-  std::vector<std::string> strings;
-
-  std::string::size_type pos = 0;
-  std::string::size_type prev = 0;
-  while ((pos = str.find(delimiter, prev)) != std::string::npos) {
-    strings.push_back(str.substr(prev, pos - prev));
-    prev = pos + 1;
-  }
-
-  // To get the last substring (or only, if delimiter is not found)
-  strings.push_back(str.substr(prev));
-
-  return strings;
-}
-
 void parseTestExpectation(
     const std::string &filename,
     const std::vector<std::string> &lines_with_endings, TextReplacer *replacer,
@@ -180,44 +160,54 @@ void updateTestExpectation(const std::string &filename,
   writeToFile(filename, str);
 }
 
-void diffDocuments(std::string path, std::string path_section,
-                   rapidjson::Document &expected, rapidjson::Document &actual) {
-  std::string joined_actual_output = toString(actual);
-  std::string joined_expected_output = toString(expected);
-  printf("[FAILED] %s (section %s)\n", path.c_str(), path_section.c_str());
-
-#if _POSIX_C_SOURCE >= 200809L
-  char expected_file[] = "/tmp/ccls.expected.XXXXXX";
-  char actual_file[] = "/tmp/ccls.actual.XXXXXX";
-  int expected_fd = mkstemp(expected_file);
-  int actual_fd = mkstemp(actual_file);
-  dprintf(expected_fd, "%s", joined_expected_output.c_str());
-  dprintf(actual_fd, "%s", joined_actual_output.c_str());
-  close(expected_fd);
-  close(actual_fd);
-  pid_t child = fork();
-  if (child == 0) {
-    execlp("diff", "diff", "-U", "3", expected_file, actual_file, NULL);
-    _Exit(127);
+std::string toCompactString(const rapidjson::Value &v) {
+  rapidjson::StringBuffer buffer;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+  v.Accept(writer);
+  std::string ret = buffer.GetString();
+  if (ret.size() > 80)
+    ret = ret.substr(0, 77) + "...";
+  return ret;
+}
+
+// Appends the differences between |expected| and |actual| at |path|, at most
+// kMaxDiffs in total.
+constexpr size_t kMaxDiffs = 20;
+void diffValues(const rapidjson::Value &expected,
+                const rapidjson::Value &actual, const std::string &path,
+                std::vector<std::string> &out) {
+  if (out.size() >= kMaxDiffs || expected == actual)
+    return;
+  if (expected.IsObject() && actual.IsObject()) {
+    for (auto &m : expected.GetObject()) {
+      std::string path1 = path + '.' + m.name.GetString();
+      auto it = actual.FindMember(m.name);
+      if (it == actual.MemberEnd())
+        out.push_back(path1 + ": missing " + toCompactString(m.value));
+      else
+        diffValues(m.value, it->value, path1, out);
+    }
+    for (auto &m : actual.GetObject())
+      if (!expected.HasMember(m.name) && out.size() < kMaxDiffs)
+        out.push_back(path + '.' + m.name.GetString() + ": unexpected " +
+                      toCompactString(m.value));
+  } else if (expected.IsArray() && actual.IsArray()) {
+    rapidjson::SizeType n = std::min(expected.Size(), actual.Size());
+    for (rapidjson::SizeType i = 0; i < n; i++)
+      diffValues(expected[i], actual[i], path + '[' + std::to_string(i) + ']',
+                 out);
+    for (rapidjson::SizeType i = n; i < expected.Size(); i++)
+      if (out.size() < kMaxDiffs)
+        out.push_back(path + '[' + std::to_string(i) + "]: missing " +
+                      toCompactString(expected[i]));
+    for (rapidjson::SizeType i = n; i < actual.Size(); i++)
+      if (out.size() < kMaxDiffs)
+        out.push_back(path + '[' + std::to_string(i) + "]: unexpected " +
+                      toCompactString(actual[i]));
   } else {
-    int status;
-    waitpid(child, &status, 0);
-    unlink(expected_file);
-    unlink(actual_file);
-    // 'diff' returns 0 or 1 if exitted normaly.
-    if (WEXITSTATUS(status) <= 1)
-      return;
+    out.push_back(path + ": expected " + toCompactString(expected) +
+                  ", actual " + toCompactString(actual));
   }
-#endif
-  std::vector<std::string> actual_output =
-      splitString(joined_actual_output, "\n");
-  std::vector<std::string> expected_output =
-      splitString(joined_expected_output, "\n");
-
-  printf("Expected output for %s (section %s)\n:%s\n", path.c_str(),
-         path_section.c_str(), joined_expected_output.c_str());
-  printf("Actual output for %s (section %s)\n:%s\n", path.c_str(),
-         path_section.c_str(), joined_actual_output.c_str());
 }
 
 void verifySerializeToFrom(IndexFile *file) {
@@ -257,7 +247,94 @@ findDbForPathEnding(const std::string &path,
   return nullptr;
 }
 
-bool runIndexTests(const std::string &filter_path, bool enable_update) {
+namespace {
+struct TestResult {
+  struct Failure {
+    std::string section;
+    // The expectation as written in the test, to be replaced by |actual|.
+    std::string raw_expected;
+    std::string actual;
+    std::vector<std::string> diffs;
+  };
+  std::string path;
+  std::vector<Failure> failures;
+  double ms = 0;
+};
+
+// Times each test this many times with --bench and reports the fastest.
+constexpr int kBenchRuns = 3;
+
+void runTest(SemaManager &manager, TestResult &test, bool bench) {
+  const std::string &path = test.path;
+  // Parse expected output from the test, parse it into JSON document.
+  std::vector<std::string> lines_with_endings;
+  {
+    std::ifstream fin(path);
+    for (std::string line; std::getline(fin, line);)
+      lines_with_endings.push_back(line);
+  }
+  TextReplacer text_replacer;
+  std::vector<std::string> flags;
+  std::unordered_map<std::string, std::string> all_expected_output;
+  parseTestExpectation(path, lines_with_endings, &text_replacer, &flags,
+                       &all_expected_output);
+
+  // Build flags.
+  flags.push_back("-resource-dir=" + getDefaultResourceDirectory());
+  flags.push_back(path);
+
+  // Run test.
+  std::vector<const char *> cargs;
+  for (auto &arg : flags)
+    cargs.push_back(arg.c_str());
+  IndexResult result;
+  for (int run = 0; run < (bench ? kBenchRuns : 1); run++) {
+    VFS vfs;
+    WorkingFiles wfiles;
+    bool ok;
+    auto start = std::chrono::steady_clock::now();
+    result = ccls::idx::index(&manager, &wfiles, &vfs, "", path, cargs, {},
+                              true, false, ok);
+    double ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    test.ms = run ? std::min(test.ms, ms) : ms;
+  }
+
+  for (const auto &entry : all_expected_output) {
+    const std::string &expected_path = entry.first;
+    std::string expected_output = text_replacer.apply(entry.second);
+
+    // Get output from index operation.
+    IndexFile *db = findDbForPathEnding(expected_path, result.indexes);
+    std::string actual_output = "{}";
+    if (db) {
+      verifySerializeToFrom(db);
+      actual_output = db->toString();
+    }
+    actual_output = text_replacer.apply(actual_output);
+
+    // Compare output via rapidjson::Document to ignore any formatting
+    // differences.
+    rapidjson::Document actual;
+    actual.Parse(actual_output.c_str());
+    rapidjson::Document expected;
+    expected.Parse(expected_output.c_str());
+    if (actual != expected) {
+      TestResult::Failure &failure = test.failures.emplace_back();
+      failure.section = expected_path;
+      // Note: we use |entry.second| instead of |expected_output| because
+      // |expected_output| has had text replacements applied.
+      failure.raw_expected = entry.second;
+      failure.actual = toString(actual);
+      diffValues(expected, actual, "$", failure.diffs);
+    }
+  }
+}
+} // namespace
+
+bool runIndexTests(const std::string &filter_path, bool enable_update,
+                   bool bench) {
   gTestOutputMode = true;
   std::string version = LLVM_VERSION_STRING;
 
@@ -272,103 +349,88 @@ bool runIndexTests(const std::string &filter_path, bool enable_update) {
     return false;
   }
 
+  std::vector<TestResult> tests;
+  getFilesInFolder("index_tests", true /*recursive*/,
+                   true /*add_folder_to_path*/, [&](const std::string &path) {
+                     if (path.find(filter_path) != std::string::npos)
+                       tests.emplace_back().path = path;
+                   });
+  std::sort(tests.begin(), tests.end(),
+            [](auto &l, auto &r) { return l.path < r.path; });
+  g_config = new Config;
+
+  // Tests are sharded dynamically. Each thread has its own SemaManager, and
+  // each test its own VFS and WorkingFiles.
+  auto start = std::chrono::steady_clock::now();
+  std::atomic<size_t> next{0};
+  int threads = std::max(
+      1, int(std::min<size_t>(std::thread::hardware_concurrency(),
+                              tests.size())));
+  // Timing is more stable without concurrent tests.
+  if (bench)
+    threads = 1;
+  runParallel(threads, [&](int) {
+    // FIXME: show diagnostics in STL/headers when running tests.
+    SemaManager manager(
+        nullptr, nullptr, [&](std::string, std::vector<Diagnostic>) {},
+        [](RequestId id) {});
+    for (size_t i; (i = next++) < tests.size();)
+      runTest(manager, tests[i], bench);
+  });
+  double total_ms = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+
   bool success = true;
   bool update_all = false;
-  // FIXME: show diagnostics in STL/headers when running tests. At the moment
-  // this can be done by conRequestIdex index(1, 1);
-  SemaManager completion(
-      nullptr, nullptr, [&](std::string, std::vector<Diagnostic>) {},
-      [](RequestId id) {});
-  getFilesInFolder(
-      "index_tests", true /*recursive*/, true /*add_folder_to_path*/,
-      [&](const std::string &path) {
-        bool is_fail_allowed = false;
-
-        if (path.find(filter_path) == std::string::npos)
-          return;
-
-        if (!filter_path.empty())
-          printf("Running %s\n", path.c_str());
-
-        // Parse expected output from the test, parse it into JSON document.
-        std::vector<std::string> lines_with_endings;
-        {
-          std::ifstream fin(path);
-          for (std::string line; std::getline(fin, line);)
-            lines_with_endings.push_back(line);
-        }
-        TextReplacer text_replacer;
-        std::vector<std::string> flags;
-        std::unordered_map<std::string, std::string> all_expected_output;
-        parseTestExpectation(path, lines_with_endings, &text_replacer, &flags,
-                             &all_expected_output);
-
-        // Build flags.
-        flags.push_back("-resource-dir=" + getDefaultResourceDirectory());
-        flags.push_back(path);
-
-        // Run test.
-        g_config = new Config;
-        VFS vfs;
-        WorkingFiles wfiles;
-        std::vector<const char *> cargs;
-        for (auto &arg : flags)
-          cargs.push_back(arg.c_str());
-        bool ok;
-        auto result = ccls::idx::index(&completion, &wfiles, &vfs, "", path,
-                                       cargs, {}, true, ok);
-
-        for (const auto &entry : all_expected_output) {
-          const std::string &expected_path = entry.first;
-          std::string expected_output = text_replacer.apply(entry.second);
-
-          // Get output from index operation.
-          IndexFile *db = findDbForPathEnding(expected_path, result.indexes);
-          std::string actual_output = "{}";
-          if (db) {
-            verifySerializeToFrom(db);
-            actual_output = db->toString();
-          }
-          actual_output = text_replacer.apply(actual_output);
-
-          // Compare output via rapidjson::Document to ignore any formatting
-          // differences.
-          rapidjson::Document actual;
-          actual.Parse(actual_output.c_str());
-          rapidjson::Document expected;
-          expected.Parse(expected_output.c_str());
-
-          if (actual == expected) {
-            // std::cout << "[PASSED] " << path << std::endl;
-          } else {
-            if (!is_fail_allowed)
-              success = false;
-            diffDocuments(path, expected_path, expected, actual);
-            puts("\n");
-            if (enable_update) {
-              printf("[Enter to continue - type u to update test, a to update "
-                     "all]");
-              char c = 'u';
-              if (!update_all) {
-                c = getchar();
-                getchar();
-              }
-
-              if (c == 'a')
-                update_all = true;
-
-              if (update_all || c == 'u') {
-                // Note: we use |entry.second| instead of |expected_output|
-                // because
-                // |expected_output| has had text replacements applied.
-                updateTestExpectation(path, entry.second,
-                                      toString(actual) + "\n");
-              }
-            }
-          }
+  size_t failed = 0;
+  for (TestResult &test : tests) {
+    if (!filter_path.empty() && !bench)
+      printf("Ran %s (%.1f ms)\n", test.path.c_str(), test.ms);
+    failed += test.failures.size() > 0;
+    for (TestResult::Failure &failure : test.failures) {
+      success = false;
+      printf("[FAILED] %s (section %s)\n", test.path.c_str(),
+             failure.section.c_str());
+      for (const std::string &diff : failure.diffs)
+        printf("  %s\n", diff.c_str());
+      if (failure.diffs.size() == kMaxDiffs)
+        printf("  ...\n");
+      puts("");
+      if (enable_update) {
+        printf("[Enter to continue - type u to update test, a to update "
+               "all]");
+        char c = 'u';
+        if (!update_all) {
+          c = getchar();
+          getchar();
         }
-      });
 
+        if (c == 'a')
+          update_all = true;
+
+        if (update_all || c == 'u')
+          updateTestExpectation(test.path, failure.raw_expected,
+                                failure.actual + "\n");
+      }
+    }
+  }
+
+  if (bench) {
+    // Indexing time of each test, the fastest of kBenchRuns.
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> w(buffer);
+    w.StartObject();
+    for (TestResult &test : tests) {
+      w.Key(test.path.c_str());
+      w.Double(test.ms);
+    }
+    w.EndObject();
+    puts(buffer.GetString());
+  } else {
+    printf("%zu tests, %zu failed, %.0f ms on %d threads\n", tests.size(),
+           failed, total_ms, threads);
+  }
   return success;
 }
 } // namespace ccls
@@ -6,5 +6,8 @@
 #include <string>
 
 namespace ccls {
-bool runIndexTests(const std::string &filter_path, bool enable_update);
+// Runs the index_tests whose paths contain |filter_path| in parallel. With
+// |bench|, prints the indexing time of each test as JSON.
+bool runIndexTests(const std::string &filter_path, bool enable_update,
+                   bool bench);
 }
@@ -5,14 +5,17 @@
 
 #include "utils.hh"
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <deque>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <tuple>
 #include <utility>
+#include <vector>
 
 // std::lock accepts two or more arguments. We define an overload for one
 // argument.
@@ -73,6 +76,15 @@ struct MultiQueueWaiter {
     if (!hasState({queues...}))
       cv.wait_until(l, t);
   }
+
+  // Waits until |t| or a notification, for consumers that leave some
+  // elements in the queues alone.
+  template <typename... BaseThreadQueue>
+  void sleepUntil(std::chrono::steady_clock::time_point t,
+                  BaseThreadQueue... queues) {
+    MultiQueueLock<BaseThreadQueue...> l(queues...);
+    cv.wait_until(l, t);
+  }
 };
 
 // A threadsafe-queue. http://stackoverflow.com/a/16075550
@@ -102,6 +114,10 @@ public:
     push<&std::deque<T>::push_back>(std::move(t), priority);
   }
 
+  void pushFront(T &&t, bool priority = false) {
+    push<&std::deque<T>::push_front>(std::move(t), priority);
+  }
+
   // Return all elements in the queue.
   std::vector<T> dequeueAll() {
     std::lock_guard<std::mutex> lock(mutex_);
@@ -176,4 +192,303 @@ private:
   MultiQueueWaiter *waiter_;
   std::unique_ptr<MultiQueueWaiter> owned_waiter_;
 };
+
+// A bounded lock-free multi-producer multi-consumer queue with the interface
+// of ThreadedQueue, after Dmitry Vyukov's bounded MPMC queue. Each of the two
+// classes (priority and normal) is a ring of cells whose sequence numbers
+// tell producers and consumers whether a cell is free or filled.
+//
+// pushBack blocks while its class is full or the queue exceeds the limits of
+// setLimits, so that producers cannot run unboundedly ahead of the consumer,
+// unless |quit| is set, in which case the element is dropped. The limits are
+// checked before claiming a cell and may be exceeded by one element per
+// producer. |mutex_| is only taken by MultiQueueWaiter and by pushBack when
+// the queue was empty, so that the notification cannot be lost.
+template <class T> struct BoundedQueue : public BaseThreadQueue {
+public:
+  BoundedQueue(MultiQueueWaiter *waiter, size_t capacity,
+               std::atomic<bool> &quit)
+      : waiter_(waiter), quit_(quit) {
+    size_t n = 1;
+    while (n < capacity)
+      n *= 2;
+    for (Ring &r : rings_)
+      r.init(n);
+  }
+
+  // Limits the number of elements (at most the capacity) and the sum of the
+  // |bytes| passed to pushBack. 0 means no limit.
+  void setLimits(size_t max_count, size_t max_bytes) {
+    max_count_ = max_count;
+    max_bytes_ = max_bytes;
+  }
+
+  // Returns the number of elements in the queue. This is lock-free.
+  size_t size() const { return std::max(total_count_.load(), 0); }
+
+  // Returns true if the queue is empty. This is lock-free.
+  bool isEmpty() { return total_count_ <= 0; }
+
+  void pushBack(T &&t, bool priority = false, size_t bytes = 0) {
+    Ring &r = rings_[priority ? 0 : 1];
+    while (!(hasRoom(bytes) && r.tryPush(t, bytes))) {
+      if (quit_.load(std::memory_order_relaxed))
+        return;
+      std::unique_lock<std::mutex> lock(space_mutex_);
+      ++blocked_;
+      // Consumers notify without the lock; the timeout covers a race.
+      space_cv_.wait_for(lock, std::chrono::milliseconds(10));
+      --blocked_;
+    }
+    total_bytes_ += bytes;
+    // A consumer that has popped this element before the increment sees a
+    // negative count; only the transition from empty needs a notification.
+    if (total_count_.fetch_add(1) <= 0) {
+      { std::lock_guard<std::mutex> lock(mutex_); }
+      waiter_->cv.notify_one();
+    }
+  }
+
+  // Get the first element from the queue without blocking. Returns a null
+  // value if the queue is empty.
+  std::optional<T> tryPopFront() {
+    size_t bytes;
+    for (Ring &r : rings_)
+      if (std::optional<T> ret = r.tryPop(bytes)) {
+        --total_count_;
+        total_bytes_ -= bytes;
+        if (blocked_.load(std::memory_order_relaxed))
+          space_cv_.notify_all();
+        return ret;
+      }
+    return std::nullopt;
+  }
+
+  // Return all elements in the queue.
+  std::vector<T> dequeueAll() {
+    std::vector<T> result;
+    while (std::optional<T> t = tryPopFront())
+      result.push_back(std::move(*t));
+    return result;
+  }
+
+  mutable std::mutex mutex_;
+
+private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    std::optional<T> value;
+    size_t bytes;
+  };
+  struct Ring {
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+
+    void init(size_t n) {
+      cells.reset(new Cell[n]);
+      mask = n - 1;
+      for (size_t i = 0; i < n; i++)
+        cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    // Moves from |t| only on success.
+    bool tryPush(T &t, size_t bytes) {
+      size_t pos = head.load(std::memory_order_relaxed);
+      while (true) {
+        Cell &c = cells[pos & mask];
+        size_t seq = c.seq.load(std::memory_order_acquire);
+        intptr_t dif = intptr_t(seq) - intptr_t(pos);
+        if (dif == 0) {
+          if (head.compare_exchange_weak(pos, pos + 1,
+                                         std::memory_order_relaxed)) {
+            c.value.emplace(std::move(t));
+            c.bytes = bytes;
+            c.seq.store(pos + 1, std::memory_order_release);
+            return true;
+          }
+        } else if (dif < 0) {
+          return false;
+        } else {
+          pos = head.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    std::optional<T> tryPop(size_t &bytes) {
+      size_t pos = tail.load(std::memory_order_relaxed);
+      while (true) {
+        Cell &c = cells[pos & mask];
+        size_t seq = c.seq.load(std::memory_order_acquire);
+        intptr_t dif = intptr_t(seq) - intptr_t(pos + 1);
+        if (dif == 0) {
+          if (tail.compare_exchange_weak(pos, pos + 1,
+                                         std::memory_order_relaxed)) {
+            std::optional<T> ret(std::move(c.value));
+            c.value.reset();
+            bytes = c.bytes;
+            c.seq.store(pos + mask + 1, std::memory_order_release);
+            return ret;
+          }
+        } else if (dif < 0) {
+          return std::nullopt;
+        } else {
+          pos = tail.load(std::memory_order_relaxed);
+        }
+      }
+    }
+  };
+
+  bool hasRoom(size_t bytes) const {
+    int64_t used = total_bytes_;
+    return !(max_count_ && total_count_ >= int64_t(max_count_)) &&
+           !(max_bytes_ && used > 0 && used + bytes > max_bytes_);
+  }
+
+  Ring rings_[2];
+  std::atomic<int> total_count_{0};
+  std::atomic<int64_t> total_bytes_{0};
+  std::atomic<size_t> max_count_{0}, max_bytes_{0};
+  std::atomic<int> blocked_{0};
+  std::mutex space_mutex_;
+  std::condition_variable space_cv_;
+  MultiQueueWaiter *waiter_;
+  std::atomic<bool> &quit_;
+};
+
+// A work-stealing queue with |N| priority classes, 0 being the most urgent.
+// Each worker owns a set of deques guarded by its own mutex. pushBack
+// distributes elements round-robin. tryPopFront(self) returns the element of
+// the most urgent non-empty class, taken from the front of worker |self|'s
+// deque or, if that's empty, stolen from the back of another worker's deque.
+// Only the first |classes| classes are considered. With setAging(n), a class
+// other than 0 that has been passed over n times while non-empty is served
+// before the more urgent ones.
+//
+// |mutex_| is only taken by pushBack for notification and by
+// MultiQueueWaiter, so that consumers don't contend on one lock.
+template <class T, int N> struct WorkStealingQueue : public BaseThreadQueue {
+public:
+  WorkStealingQueue(MultiQueueWaiter *waiter, int n_workers)
+      : workers_(std::max(n_workers, 1)), waiter_(waiter) {}
+
+  // Returns the number of elements in the queue. This is lock-free.
+  size_t size() const { return total_count_; }
+
+  // Returns true if the queue is empty. This is lock-free.
+  bool isEmpty() { return total_count_ == 0; }
+
+  void pushBack(T &&t, int prio) {
+    Worker &w = workers_[next_.fetch_add(1, std::memory_order_relaxed) %
+                         workers_.size()];
+    {
+      std::lock_guard<std::mutex> lock(w.mutex);
+      w.q[prio].push_back(std::move(t));
+      ++count_[prio];
+      ++total_count_;
+    }
+    // Pairs with the isEmpty() check in MultiQueueWaiter::wait, which is done
+    // with |mutex_| held, so that the notification cannot be lost.
+    std::lock_guard<std::mutex> lock(mutex_);
+    waiter_->cv.notify_one();
+  }
+
+  // Calls |fn| on the element at |offset| of worker |self|'s deques, in the
+  // order tryPopFront(self) would return them without aging, if there is one.
+  template <typename Fn> void peek(int self, size_t offset, Fn fn) {
+    Worker &w = workers_[self % workers_.size()];
+    std::lock_guard<std::mutex> lock(w.mutex);
+    for (std::deque<T> &q : w.q) {
+      if (offset < q.size()) {
+        fn(q[offset]);
+        return;
+      }
+      offset -= q.size();
+    }
+  }
+
+  // Places worker |self| on NUMA node |node|. tryPopFront then steals from
+  // workers of the same node before the others.
+  void setNode(int self, int node) {
+    workers_[self % workers_.size()].node = node;
+    numa_ = true;
+  }
+
+  // 0 disables aging.
+  void setAging(int n) { aging_ = n; }
+
+  std::optional<T> tryPopFront(int self, int classes = N) {
+    int aging = aging_.load(std::memory_order_relaxed), first = 0;
+    if (aging > 0)
+      for (int prio = classes - 1; prio > 0; prio--)
+        if (count_[prio].load(std::memory_order_relaxed) &&
+            passed_[prio].load(std::memory_order_relaxed) >= aging) {
+          first = prio;
+          break;
+        }
+    for (int k = 0; k < classes; k++) {
+      int prio = k == 0 ? first : k <= first ? k - 1 : k;
+      if (std::optional<T> ret = pop(self, prio)) {
+        passed_[prio] = 0;
+        if (aging > 0)
+          for (int p = 1; p < classes; p++)
+            if (p != prio && count_[p].load(std::memory_order_relaxed))
+              ++passed_[p];
+        return ret;
+      }
+    }
+    return std::nullopt;
+  }
+
+  mutable std::mutex mutex_;
+
+private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<T> q[N];
+    std::atomic<int> node{0};
+  };
+
+  std::optional<T> pop(int self, int prio) {
+    if (!count_[prio].load(std::memory_order_relaxed))
+      return std::nullopt;
+    int n = workers_.size();
+    self %= n;
+    bool numa = numa_;
+    int home = workers_[self].node;
+    for (int i = 0; i < (numa ? 2 * n : n); i++) {
+      Worker &w = workers_[(self + i) % n];
+      // With NUMA nodes, the first round only visits the home node.
+      if (numa && (w.node == home) != (i < n))
+        continue;
+      std::lock_guard<std::mutex> lock(w.mutex);
+      std::deque<T> &q = w.q[prio];
+      if (q.empty())
+        continue;
+      std::optional<T> ret;
+      if (i == 0) {
+        ret.emplace(std::move(q.front()));
+        q.pop_front();
+      } else {
+        ret.emplace(std::move(q.back()));
+        q.pop_back();
+      }
+      --count_[prio];
+      --total_count_;
+      return ret;
+    }
+    return std::nullopt;
+  }
+
+  std::vector<Worker> workers_;
+  std::atomic<bool> numa_{false};
+  std::atomic<int> count_[N] = {};
+  // Elements taken from other classes while the class was non-empty.
+  std::atomic<int> passed_[N] = {};
+  std::atomic<int> aging_{0};
+  std::atomic<int> total_count_{0};
+  std::atomic<unsigned> next_{0};
+  MultiQueueWaiter *waiter_;
+};
 } // namespace ccls
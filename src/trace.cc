@@ -0,0 +1,186 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "trace.hh"
+
+#include "log.hh"
+#include "platform.hh"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/Threading.h>
+
+#include <chrono>
+#include <errno.h>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+namespace chrono = std::chrono;
+
+namespace ccls::trace {
+bool enabled;
+bool counting;
+
+namespace {
+struct Event {
+  const char *name, *arg_name;
+  int64_t begin, dur, arg;
+};
+
+// Events of a thread. The mutex is only contended when stop() reads it.
+struct Buffer {
+  std::mutex mutex;
+  int tid;
+  std::string thread_name;
+  std::vector<Event> events;
+  // Position of the oldest event once |events| is full.
+  size_t next = 0;
+};
+const size_t kCapacity = 1 << 16;
+
+chrono::steady_clock::time_point start_time;
+std::string trace_path;
+std::mutex buffers_mutex;
+// Never freed, as threads may exit before stop().
+std::vector<std::unique_ptr<Buffer>> buffers;
+thread_local Buffer *tls_buffer;
+
+std::mutex stages_mutex;
+llvm::StringMap<StageCounters> stages;
+
+Buffer &getBuffer() {
+  if (!tls_buffer) {
+    auto b = std::make_unique<Buffer>();
+    llvm::SmallString<64> name;
+    llvm::get_thread_name(name);
+    b->thread_name = name.str().str();
+    std::lock_guard lock(buffers_mutex);
+    b->tid = buffers.size() + 1;
+    tls_buffer = b.get();
+    buffers.push_back(std::move(b));
+  }
+  return *tls_buffer;
+}
+
+void writeString(FILE *fp, const char *s) {
+  fputc('"', fp);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fputc('\\', fp);
+    if ((unsigned char)*s >= 0x20)
+      fputc(*s, fp);
+  }
+  fputc('"', fp);
+}
+} // namespace
+
+int64_t now() {
+  return chrono::duration_cast<chrono::microseconds>(
+             chrono::steady_clock::now() - start_time)
+      .count();
+}
+
+void record(const char *name, int64_t begin, int64_t end,
+            const char *arg_name, int64_t arg) {
+  Buffer &b = getBuffer();
+  Event e{name, arg_name, begin, end - begin, arg};
+  std::lock_guard lock(b.mutex);
+  if (b.events.size() < kCapacity) {
+    b.events.push_back(e);
+  } else {
+    b.events[b.next] = e;
+    b.next = (b.next + 1) % kCapacity;
+  }
+}
+
+void Span::open() {
+  begin = now();
+  counted = counting && readPerfCounters(counters);
+}
+
+void Span::close() {
+  int64_t end = now();
+  if (enabled)
+    record(name, begin, end, arg_name, arg);
+  int64_t values[4];
+  if (!counted || !readPerfCounters(values))
+    return;
+  std::lock_guard lock(stages_mutex);
+  StageCounters &st = stages[name];
+  st.count++;
+  st.us += end - begin;
+  st.cycles += values[0] - counters[0];
+  st.instructions += values[1] - counters[1];
+  st.llc_misses += values[2] - counters[2];
+  st.branch_misses += values[3] - counters[3];
+}
+
+bool startCounters() {
+  int64_t values[4];
+  if (!readPerfCounters(values)) {
+    LOG_S(WARNING) << "hardware counters are unavailable";
+    return false;
+  }
+  if (start_time == chrono::steady_clock::time_point())
+    start_time = chrono::steady_clock::now();
+  counting = true;
+  return true;
+}
+
+std::vector<StageCounters> stageCounters() {
+  std::vector<StageCounters> ret;
+  std::lock_guard lock(stages_mutex);
+  for (auto &it : stages) {
+    ret.push_back(it.second);
+    ret.back().name = it.first().str();
+  }
+  return ret;
+}
+
+void start(const std::string &path) {
+  trace_path = path;
+  start_time = chrono::steady_clock::now();
+  enabled = true;
+}
+
+void stop() {
+  if (!enabled)
+    return;
+  enabled = false;
+  FILE *fp = fopen(trace_path.c_str(), "wb");
+  if (!fp) {
+    LOG_S(ERROR) << "failed to open " << trace_path << ' ' << strerror(errno);
+    return;
+  }
+  fputs("{\"traceEvents\":[", fp);
+  bool first = true;
+  std::lock_guard lock(buffers_mutex);
+  for (auto &b : buffers) {
+    std::lock_guard lock1(b->mutex);
+    fprintf(fp,
+            "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+            "\"args\":{\"name\":",
+            first ? "" : ",", b->tid);
+    writeString(fp, b->thread_name.c_str());
+    fputs("}}", fp);
+    first = false;
+    for (const Event &e : b->events) {
+      fputs(",\n{\"name\":", fp);
+      writeString(fp, e.name);
+      fprintf(fp, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%lld,\"dur\":%lld",
+              b->tid, (long long)e.begin, (long long)e.dur);
+      if (e.arg_name) {
+        fputs(",\"args\":{", fp);
+        writeString(fp, e.arg_name);
+        fprintf(fp, ":%lld}", (long long)e.arg);
+      }
+      fputc('}', fp);
+    }
+  }
+  fputs("\n]}\n", fp);
+  fclose(fp);
+}
+} // namespace ccls::trace
@@ -0,0 +1,85 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace ccls::trace {
+// Set by start() before other threads are spawned.
+extern bool enabled;
+// Set by startCounters() before other threads are spawned.
+extern bool counting;
+
+// Microseconds since start().
+int64_t now();
+// |name| and |arg_name| must outlive the trace, e.g. string literals or
+// interned strings.
+void record(const char *name, int64_t begin, int64_t end,
+            const char *arg_name = nullptr, int64_t arg = 0);
+// Starts recording. Events are kept in per-thread ring buffers; when a buffer
+// is full, the oldest events of that thread are overwritten.
+void start(const std::string &path);
+// Writes the recorded events as Chrome trace event JSON.
+void stop();
+
+// Aggregates hardware counters of spans by name, for tuning data layouts where
+// wall time is too coarse. Returns false if the counters cannot be read, e.g.
+// outside Linux or if forbidden by kernel.perf_event_paranoid.
+bool startCounters();
+
+// Totals of the spans of one name. The counters of a span include those of
+// the spans nested in it.
+struct StageCounters {
+  std::string name;
+  int64_t count = 0, us = 0, cycles = 0, instructions = 0, llc_misses = 0,
+          branch_misses = 0;
+};
+std::vector<StageCounters> stageCounters();
+
+// Records a complete event for its scope if tracing is enabled, and adds its
+// counters to its stage if counting. A disabled span does not read the clock.
+struct Span {
+  const char *name;
+  const char *arg_name = nullptr;
+  int64_t begin = 0, arg = 0;
+  // Counter values at the start, if read.
+  int64_t counters[4];
+  bool counted = false;
+
+  explicit Span(const char *name)
+      : name(enabled || counting ? name : nullptr) {
+    if (this->name)
+      open();
+  }
+  ~Span() {
+    if (name)
+      close();
+  }
+  void open();
+  void close();
+  void setArg(const char *key, int64_t value) {
+    arg_name = key;
+    arg = value;
+  }
+};
+
+// Adds the duration of its scope to |*sum| if tracing is enabled. Used for
+// work interleaved with other work of a span, e.g. IndexDataConsumer
+// callbacks during parsing.
+struct Accumulate {
+  int64_t *sum;
+  int64_t begin = 0;
+
+  explicit Accumulate(int64_t &sum) : sum(enabled ? &sum : nullptr) {
+    if (this->sum)
+      begin = now();
+  }
+  ~Accumulate() {
+    if (sum)
+      *sum += now() - begin;
+  }
+};
+} // namespace ccls::trace
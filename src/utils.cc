@@ -3,6 +3,7 @@
 
 #include "utils.hh"
 
+#include "allocator.hh"
 #include "log.hh"
 #include "message_handler.hh"
 #include "pipeline.hh"
@@ -10,15 +11,25 @@
 
 #include <siphash.h>
 
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/ADT/StringRef.h>
+#include <llvm/Config/llvm-config.h>
 #include <llvm/Support/FileSystem.h>
 #include <llvm/Support/Path.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/xxhash.h>
 
 #include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <condition_variable>
 #include <ctype.h>
+#include <deque>
 #include <errno.h>
 #include <functional>
+#include <mutex>
 #include <regex>
 #include <string.h>
 #include <unordered_map>
@@ -27,24 +38,88 @@ using namespace llvm;
 
 namespace ccls {
 struct Matcher::Impl {
-  std::regex regex;
+  enum Kind { Regex, Contains, Prefix, Suffix, Exact } kind = Regex;
+  // Lowercased, for kinds other than Regex.
+  std::string literal;
+  std::optional<std::regex> regex;
+
+  // |lower| is |text| lowercased.
+  bool matches(const std::string &text, StringRef lower) const {
+    switch (kind) {
+    case Contains:
+      return lower.contains(literal);
+    case Prefix:
+      return lower.startswith(literal);
+    case Suffix:
+      return lower.endswith(literal);
+    case Exact:
+      return lower == literal;
+    default:
+      return std::regex_search(text, *regex, std::regex_constants::match_any);
+    }
+  }
 };
 
+namespace {
+// Recognizes [^](.*)?literal(.*)?[$] where literal may contain escaped
+// punctuation, e.g. "/third_party/", "^/usr/include/" and "\.pb\.h$".
+bool parseLiteral(StringRef pat, Matcher::Impl &impl) {
+  bool prefix = pat.consume_front("^"), suffix = false;
+  if (!prefix)
+    pat.consume_front(".*");
+  if (pat.endswith("$") && !pat.endswith("\\$")) {
+    pat = pat.drop_back();
+    suffix = true;
+  } else {
+    pat.consume_back(".*");
+  }
+  std::string literal;
+  for (size_t i = 0; i < pat.size(); i++) {
+    char c = pat[i];
+    if (c == '\\') {
+      if (++i == pat.size() || isalnum((unsigned char)pat[i]))
+        return false;
+      c = pat[i];
+    } else if (strchr("^$.|?*+()[]{}", c)) {
+      return false;
+    }
+    literal += toLower(c);
+  }
+  impl.kind = prefix ? suffix ? Matcher::Impl::Exact : Matcher::Impl::Prefix
+                     : suffix ? Matcher::Impl::Suffix
+                              : Matcher::Impl::Contains;
+  impl.literal = std::move(literal);
+  return true;
+}
+} // namespace
+
 Matcher::Matcher(const std::string &pattern)
     : impl(std::make_unique<Impl>()), pattern(pattern) {
-  impl->regex = std::regex(pattern, std::regex_constants::ECMAScript |
-                                        std::regex_constants::icase |
-                                        std::regex_constants::optimize);
+  if (!parseLiteral(pattern, *impl))
+    impl->regex.emplace(pattern, std::regex_constants::ECMAScript |
+                                     std::regex_constants::icase |
+                                     std::regex_constants::optimize);
 }
 
 Matcher::~Matcher() {}
 
 bool Matcher::matches(const std::string &text) const {
-  return std::regex_search(text, impl->regex, std::regex_constants::match_any);
+  std::string lower_text =
+      impl->kind == Impl::Regex ? std::string() : StringRef(text).lower();
+  return impl->matches(text, lower_text);
 }
 
+struct GroupMatch::Cache {
+  // Bounded, cleared when full.
+  static constexpr size_t kMaxSize = 1 << 16;
+  std::mutex mutex;
+  // -1 if accepted, else the index of the first matching blacklist pattern.
+  StringMap<int> result;
+};
+
 GroupMatch::GroupMatch(const std::vector<std::string> &whitelist,
-                       const std::vector<std::string> &blacklist) {
+                       const std::vector<std::string> &blacklist)
+    : cache(std::make_unique<Cache>()) {
   auto err = [](const std::string &pattern, const char *what) {
     ShowMessageParam params;
     params.type = MessageType::Error;
@@ -68,20 +143,53 @@ GroupMatch::GroupMatch(const std::vector<std::string> &whitelist,
   }
 }
 
+GroupMatch::~GroupMatch() {}
+
 bool GroupMatch::matches(const std::string &text,
                          std::string *blacklist_pattern) const {
-  for (const Matcher &m : whitelist)
-    if (m.matches(text))
-      return true;
-  for (const Matcher &m : blacklist)
-    if (m.matches(text)) {
-      if (blacklist_pattern)
-        *blacklist_pattern = m.pattern;
-      return false;
-    }
-  return true;
+  if (blacklist.empty())
+    return true;
+  std::optional<int> cached;
+  {
+    std::lock_guard lock(cache->mutex);
+    auto it = cache->result.find(text);
+    if (it != cache->result.end())
+      cached = it->second;
+  }
+  int result = -1;
+  if (cached) {
+    result = *cached;
+  } else {
+    std::string lower_text = StringRef(text).lower();
+    if (llvm::none_of(whitelist, [&](const Matcher &m) {
+          return m.impl->matches(text, lower_text);
+        }))
+      for (size_t i = 0; i < blacklist.size(); i++)
+        if (blacklist[i].impl->matches(text, lower_text)) {
+          result = i;
+          break;
+        }
+    std::lock_guard lock(cache->mutex);
+    if (cache->result.size() >= Cache::kMaxSize)
+      cache->result.clear();
+    cache->result.try_emplace(text, result);
+  }
+  if (result < 0)
+    return true;
+  if (blacklist_pattern)
+    *blacklist_pattern = blacklist[result].pattern;
+  return false;
 }
 
+#if CCLS_USR_XXHASH
+uint64_t hashUsr(llvm::StringRef s) {
+#if LLVM_VERSION_MAJOR >= 17
+  return llvm::xxh3_64bits(llvm::arrayRefFromStringRef(s));
+#else
+  return llvm::xxHash64(s);
+#endif
+}
+#else
 uint64_t hashUsr(llvm::StringRef s) {
   union {
     uint64_t ret;
@@ -94,6 +202,7 @@ uint64_t hashUsr(llvm::StringRef s) {
                 8);
   return ret;
 }
+#endif
 
 std::string lowerPathIfInsensitive(const std::string &path) {
 #if defined(_WIN32)
@@ -157,6 +266,89 @@ std::optional<int64_t> lastWriteTime(const std::string &path) {
   return sys::toTimeT(status.getLastModificationTime());
 }
 
+namespace {
+// See runPooled. Threads are started when more tasks are queued than threads
+// are idle, up to the number of cores, and never exit.
+struct ThreadPool {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::function<void()>> tasks;
+  int threads = 0, idle = 0;
+
+  void push(std::function<void()> task) {
+    std::lock_guard lock(mutex);
+    tasks.push_back(std::move(task));
+    if (int(tasks.size()) > idle &&
+        threads < int(std::max(std::thread::hardware_concurrency(), 1u))) {
+      threads++;
+      std::thread(&ThreadPool::work, this).detach();
+    }
+    cv.notify_one();
+  }
+
+  void work() {
+    set_thread_name("pool");
+    setThreadArena(Arena::DB);
+    std::unique_lock lock(mutex);
+    while (true) {
+      idle++;
+      cv.wait(lock, [&] { return tasks.size(); });
+      idle--;
+      std::function<void()> task = std::move(tasks.front());
+      tasks.pop_front();
+      lock.unlock();
+      task();
+      lock.lock();
+    }
+  }
+};
+} // namespace
+
+void runPooled(int n, const std::function<void(int)> &fn) {
+  if (n <= 1) {
+    fn(0);
+    return;
+  }
+  // Shared with the tasks, which may be popped after this call returns.
+  struct State {
+    std::atomic<int> next{1};
+    int done = 0;
+    std::mutex mutex;
+    std::condition_variable cv;
+  };
+  auto state = std::make_shared<State>();
+  auto run = [state, &fn, n]() {
+    int k = 0;
+    for (int i; (i = state->next++) < n; k++)
+      fn(i);
+    if (k) {
+      std::lock_guard lock(state->mutex);
+      if ((state->done += k) == n - 1)
+        state->cv.notify_all();
+    }
+  };
+  static ThreadPool *pool = new ThreadPool;
+  for (int i = 1; i < n; i++)
+    pool->push(run);
+  fn(0);
+  run();
+  std::unique_lock lock(state->mutex);
+  state->cv.wait(lock, [&] { return state->done == n - 1; });
+}
+
+std::vector<std::optional<int64_t>>
+lastWriteTimes(const std::vector<std::string> &paths) {
+  std::vector<std::optional<int64_t>> ret(paths.size());
+  std::atomic<size_t> next{0};
+  size_t threads = std::clamp(size_t(std::thread::hardware_concurrency()),
+                              size_t(1), size_t(8));
+  runParallel(int(std::min(paths.size() / 256 + 1, threads)), [&](int) {
+    for (size_t i; (i = next++) < paths.size();)
+      ret[i] = lastWriteTime(paths[i]);
+  });
+  return ret;
+}
+
 std::optional<std::string> readContent(const std::string &filename) {
   char buf[4096];
   std::string ret;
@@ -6,9 +6,13 @@
 #include <optional>
 #include <string_view>
 
+#include <functional>
 #include <iterator>
+#include <list>
 #include <memory>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -17,6 +21,8 @@ class StringRef;
 }
 
 namespace ccls {
+// Case-insensitive ECMAScript regex search. Literal patterns, optionally
+// anchored and surrounded by .*, are matched without std::regex.
 struct Matcher {
   struct Impl;
   std::unique_ptr<Impl> impl;
@@ -28,15 +34,22 @@ struct Matcher {
   bool matches(const std::string &text) const;
 };
 
+// Thread-safe. Results are cached by text.
 struct GroupMatch {
+  struct Cache;
   std::vector<Matcher> whitelist, blacklist;
+  std::unique_ptr<Cache> cache;
 
   GroupMatch(const std::vector<std::string> &whitelist,
              const std::vector<std::string> &blacklist);
+  ~GroupMatch();
   bool matches(const std::string &text,
                std::string *blacklist_pattern = nullptr) const;
 };
 
+// SipHash-2-4, or XXH3 (xxHash64 before LLVM 17) if built with
+// -DUSE_XXHASH_USR=ON. Hash values are stored in cache files, see
+// IndexFile::kMajorVersion.
 uint64_t hashUsr(llvm::StringRef s);
 
 std::string lowerPathIfInsensitive(const std::string &path);
@@ -54,12 +67,34 @@ std::string realPath(const std::string &path);
 bool normalizeFolder(std::string &path);
 
 std::optional<int64_t> lastWriteTime(const std::string &path);
+// lastWriteTime of each of |paths|. Large batches are stat'ed on a few threads
+// to overlap the syscalls, which matters on network file systems.
+std::vector<std::optional<int64_t>>
+lastWriteTimes(const std::vector<std::string> &paths);
 std::optional<std::string> readContent(const std::string &filename);
 void writeToFile(const std::string &filename, const std::string &content);
 
 int reverseSubseqMatch(std::string_view pat, std::string_view text,
                        int case_sensitivity);
 
+// Run fn(0), ..., fn(n-1) on |n| threads, fn(0) on the calling thread, and wait
+// for all of them.
+template <typename Fn> void runParallel(int n, Fn &&fn) {
+  std::vector<std::thread> threads;
+  threads.reserve(n - 1);
+  for (int i = 1; i < n; i++)
+    threads.emplace_back(fn, i);
+  fn(0);
+  for (auto &thread : threads)
+    thread.join();
+}
+
+// Like runParallel, for work done per request or per batch of index updates.
+// fn(1), ..., fn(n-1) run on a process-wide pool whose threads use Arena::DB
+// and are kept for later calls. Indexes not yet taken by a pool thread are
+// run by the caller, so concurrent and nested calls cannot deadlock.
+void runPooled(int n, const std::function<void(int)> &fn);
+
 // http://stackoverflow.com/a/38140932
 //
 //  struct SomeHashKey {
@@ -152,4 +187,79 @@ template <typename T> struct Vec {
   const T &operator[](size_t i) const { return a.get()[i]; }
   T &operator[](size_t i) { return a.get()[i]; }
 };
+
+// A least recently used cache. Each item has a weight, e.g. its memory size,
+// and items are evicted while there are more than |capacity| items or the
+// total weight exceeds |max_weight| (if non-zero). The most recently used
+// item is never evicted for its weight.
+template <typename K, typename V> struct LruCache {
+  std::shared_ptr<V> get(const K &key) {
+    auto it = index.find(key);
+    if (it == index.end())
+      return nullptr;
+    items.splice(items.begin(), items, it->second);
+    return it->second->value;
+  }
+  std::shared_ptr<V> take(const K &key) {
+    auto it = index.find(key);
+    if (it == index.end())
+      return nullptr;
+    auto x = std::move(it->second->value);
+    weight -= it->second->weight;
+    items.erase(it->second);
+    index.erase(it);
+    return x;
+  }
+  void insert(const K &key, std::shared_ptr<V> value) {
+    take(key);
+    items.push_front({key, std::move(value), 0});
+    index[key] = items.begin();
+    evict();
+  }
+  // Updates the weight of |key| if it is present.
+  void setWeight(const K &key, size_t w) {
+    auto it = index.find(key);
+    if (it == index.end())
+      return;
+    weight += w - it->second->weight;
+    it->second->weight = w;
+    evict();
+  }
+  void clear() {
+    items.clear();
+    index.clear();
+    weight = 0;
+  }
+  void setCapacity(int cap) { capacity = cap; }
+  int getCapacity() const { return capacity; }
+  void setMaxWeight(size_t w) { max_weight = w; }
+  size_t size() const { return items.size(); }
+  size_t getWeight() const { return weight; }
+  size_t getMaxWeight() const { return max_weight; }
+  // Number of items evicted because of the weight limit.
+  int64_t getWeightEvictions() const { return weight_evictions; }
+
+private:
+  struct Item {
+    K key;
+    std::shared_ptr<V> value;
+    size_t weight;
+  };
+  void evict() {
+    while ((int)items.size() > capacity ||
+           (max_weight && weight > max_weight && items.size() > 1)) {
+      if ((int)items.size() <= capacity)
+        weight_evictions++;
+      weight -= items.back().weight;
+      index.erase(items.back().key);
+      items.pop_back();
+    }
+  }
+
+  std::list<Item> items;
+  std::unordered_map<K, typename std::list<Item>::iterator> index;
+  int capacity = 1;
+  size_t weight = 0, max_weight = 0;
+  int64_t weight_evictions = 0;
+};
 } // namespace ccls
@@ -12,6 +12,7 @@
 #include <chrono>
 #include <climits>
 #include <numeric>
+#include <string.h>
 namespace chrono = std::chrono;
 
 using namespace clang;
@@ -27,31 +28,52 @@ constexpr int kMaxDiff = 20;
 // |kMaxColumnAlignSize|.
 constexpr int kMaxColumnAlignSize = 200;
 
-Position getPositionForOffset(const std::string &content, int offset) {
-  if (offset >= content.size())
-    offset = (int)content.size() - 1;
+// Text is scanned a word at a time. A byte of a word is ASCII if its bit 7 is
+// clear and is a UTF-8 continuation byte if its bits 7 and 6 are 10.
+constexpr uint64_t kOnes = 0x0101010101010101, kHighBits = 0x8080808080808080;
 
-  int line = 0, col = 0;
-  int i = 0;
-  for (; i < offset; i++) {
-    if (content[i] == '\n')
-      line++, col = 0;
-    else
-      col++;
+uint64_t load64(const char *p) {
+  uint64_t w;
+  memcpy(&w, p, sizeof w);
+  return w;
+}
+
+// Whether a byte of |w| is '\n'.
+bool hasNewline(uint64_t w) {
+  uint64_t x = w ^ (kOnes * '\n');
+  return (x - kOnes) & ~x & kHighBits;
+}
+
+bool isAscii(std::string_view s) {
+  const char *p = s.data();
+  size_t n = s.size(), i = 0;
+  uint64_t acc = 0;
+  for (; i + 8 <= n; i += 8)
+    acc |= load64(p + i);
+  for (; i < n; i++)
+    acc |= uint8_t(p[i]);
+  return !(acc & kHighBits);
+}
+
+// Appends the lines ending in '\n' in [from, to) of |c| to |lines|, without
+// the line terminator, and the offset after each '\n' to |starts|.
+void splitLines(const std::string &c, int from, int to,
+                std::vector<std::string> &lines, std::vector<int> &starts) {
+  const char *base = c.data(), *p = base + from, *e = base + to;
+  while (const char *nl =
+             static_cast<const char *>(memchr(p, '\n', e - p))) {
+    lines.emplace_back(p, nl - p - (nl > p && nl[-1] == '\r'));
+    starts.push_back(int(nl + 1 - base));
+    p = nl + 1;
   }
-  return {line, col};
 }
 
 std::vector<std::string> toLines(const std::string &c) {
   std::vector<std::string> ret;
-  int last = 0, e = c.size();
-  for (int i = 0; i < e; i++)
-    if (c[i] == '\n') {
-      ret.emplace_back(&c[last], i - last - (i && c[i - 1] == '\r'));
-      last = i + 1;
-    }
-  if (last < e)
-    ret.emplace_back(&c[last], e - last);
+  std::vector<int> starts{0};
+  splitLines(c, 0, c.size(), ret, starts);
+  if (starts.back() < (int)c.size())
+    ret.emplace_back(c, starts.back(), std::string::npos);
   return ret;
 }
 
@@ -216,19 +238,155 @@ WorkingFile::WorkingFile(const std::string &filename,
 }
 
 void WorkingFile::setIndexContent(const std::string &index_content) {
+  highlight_generation = semantic_tokens_generation =
+      document_symbols_generation = folding_ranges_generation =
+          skipped_ranges_generation = ~uint64_t(0);
   index_lines = toLines(index_content);
+  index_hashes.resize(index_lines.size());
+  for (size_t i = 0; i < index_lines.size(); i++)
+    index_hashes[i] = hashUsr(index_lines[i]);
 
   index_to_buffer.clear();
   buffer_to_index.clear();
 }
 
 void WorkingFile::onBufferContentUpdated() {
-  buffer_lines = toLines(buffer_content);
+  highlight_generation = semantic_tokens_generation =
+      document_symbols_generation = folding_ranges_generation =
+          skipped_ranges_generation = ~uint64_t(0);
+  buffer_lines.clear();
+  line_starts.assign(1, 0);
+  splitLines(buffer_content, 0, buffer_content.size(), buffer_lines,
+             line_starts);
+  if (line_starts.back() < (int)buffer_content.size())
+    buffer_lines.emplace_back(buffer_content, line_starts.back(),
+                              std::string::npos);
+  buffer_hashes.resize(buffer_lines.size());
+  buffer_ascii.resize(buffer_lines.size());
+  for (size_t i = 0; i < buffer_lines.size(); i++) {
+    buffer_hashes[i] = hashUsr(buffer_lines[i]);
+    buffer_ascii[i] = isAscii(buffer_lines[i]);
+  }
 
   index_to_buffer.clear();
   buffer_to_index.clear();
 }
 
+int WorkingFile::getOffset(Position pos) const {
+  if (pos.line >= (int)line_starts.size())
+    return (int)buffer_content.size();
+  int line = std::max(pos.line, 0), start = line_starts[line];
+  if (line < (int)buffer_ascii.size() && buffer_ascii[line]) {
+    // Columns are bytes. The line ends before its '\n'.
+    int end = line + 1 < (int)line_starts.size() ? line_starts[line + 1] - 1
+                                                 : (int)buffer_content.size();
+    return start + std::clamp(pos.character, 0, end - start);
+  }
+  return start + getOffsetForPosition(
+                     {0, pos.character},
+                     std::string_view(buffer_content).substr(start));
+}
+
+void WorkingFile::applyChange(lsRange range, const std::string &text) {
+  highlight_generation = semantic_tokens_generation =
+      document_symbols_generation = folding_ranges_generation =
+          skipped_ranges_generation = ~uint64_t(0);
+  int start = getOffset(range.start),
+      end = std::max(start, getOffset(range.end));
+  // Lines here end with '\n' or the end of the buffer, so a trailing newline
+  // is followed by an empty line, which toLines omits. [l0, l1] are the lines
+  // touched by the edit.
+  auto lineOf = [&](int offset) {
+    return size_t(std::upper_bound(line_starts.begin(), line_starts.end(),
+                                   offset) -
+                  line_starts.begin() - 1);
+  };
+  size_t l0 = lineOf(start), l1 = lineOf(end);
+  bool last = l1 + 1 == line_starts.size();
+  int delta = int(text.size()) - (end - start);
+  buffer_content.replace(start, end - start, text);
+
+  // Split the new content of lines [l0, l1] like toLines.
+  int from = line_starts[l0],
+      to = last ? (int)buffer_content.size() : line_starts[l1 + 1] + delta;
+  std::vector<int> starts{from};
+  std::vector<std::string> lines;
+  splitLines(buffer_content, from, to, lines, starts);
+  if (last)
+    lines.emplace_back(buffer_content, starts.back(), std::string::npos);
+  else
+    starts.pop_back();
+
+  std::vector<uint64_t> hashes(lines.size());
+  std::vector<uint8_t> ascii(lines.size());
+  for (size_t i = 0; i < lines.size(); i++) {
+    hashes[i] = hashUsr(lines[i]);
+    ascii[i] = isAscii(lines[i]);
+  }
+
+  // Splice the per-line vectors as if they had an entry for the omitted empty
+  // line, then drop it again.
+  size_t old_size = line_starts.size();
+  auto splice = [&](auto &v, auto begin, auto end, auto pad) {
+    if (v.size() < old_size)
+      v.push_back(pad);
+    v.erase(v.begin() + l0, v.begin() + l1 + 1);
+    v.insert(v.begin() + l0, begin, end);
+  };
+  for (size_t i = l1 + 1; i < line_starts.size(); i++)
+    line_starts[i] += delta;
+  splice(line_starts, starts.begin(), starts.end(), 0);
+  splice(buffer_lines, std::make_move_iterator(lines.begin()),
+         std::make_move_iterator(lines.end()), std::string());
+  splice(buffer_hashes, hashes.begin(), hashes.end(), uint64_t(0));
+  splice(buffer_ascii, ascii.begin(), ascii.end(), uint8_t(1));
+  bool trailing = line_starts.back() == (int)buffer_content.size();
+  if (trailing) {
+    buffer_lines.pop_back();
+    buffer_hashes.pop_back();
+    buffer_ascii.pop_back();
+  }
+
+  // Repair the mappings instead of recomputing them: lines below the edit
+  // move by the change in line count and the replaced lines are no longer
+  // confident, so findMatchingLine resolves them from their neighbors.
+  std::lock_guard lock(mapping_mutex);
+  if (index_to_buffer.empty() || buffer_to_index.empty()) {
+    index_to_buffer.clear();
+    buffer_to_index.clear();
+    return;
+  }
+  std::vector<int> none(starts.size(), -1);
+  splice(buffer_to_index, none.begin(), none.end(), -1);
+  if (trailing)
+    buffer_to_index.pop_back();
+  int line_delta = int(starts.size()) - int(l1 - l0 + 1);
+  for (int &j : index_to_buffer)
+    if (j > (int)l1)
+      j += line_delta;
+    else if (j >= (int)l0)
+      j = -1;
+}
+
+void WorkingFile::applyEdits(
+    const std::vector<std::tuple<int, int, const std::string *>> &edits) {
+  std::string content;
+  size_t size = buffer_content.size();
+  for (auto &[start, end, text] : edits)
+    size += text->size() - (end - start);
+  content.reserve(size);
+  int pos = 0;
+  for (auto it = edits.rbegin(); it != edits.rend(); ++it) {
+    auto &[start, end, text] = *it;
+    content.append(buffer_content, pos, start - pos);
+    content += *text;
+    pos = end;
+  }
+  content.append(buffer_content, pos, std::string::npos);
+  buffer_content = std::move(content);
+  onBufferContentUpdated();
+}
+
 // Variant of Paul Heckel's diff algorithm to compute |index_to_buffer| and
 // |buffer_to_index|.
 // The core idea is that if a line is unique in both index and buffer,
@@ -237,8 +395,6 @@ void WorkingFile::onBufferContentUpdated() {
 // to align other identical lines (but not unique).
 void WorkingFile::computeLineMapping() {
   std::unordered_map<uint64_t, int> hash_to_unique;
-  std::vector<uint64_t> index_hashes(index_lines.size());
-  std::vector<uint64_t> buffer_hashes(buffer_lines.size());
   index_to_buffer.resize(index_lines.size());
   buffer_to_index.resize(buffer_lines.size());
   hash_to_unique.reserve(
@@ -246,8 +402,7 @@ void WorkingFile::computeLineMapping() {
 
   // For index line i, set index_to_buffer[i] to -1 if line i is duplicated.
   int i = 0;
-  for (StringRef line : index_lines) {
-    uint64_t h = hashUsr(line);
+  for (uint64_t h : index_hashes) {
     auto it = hash_to_unique.find(h);
     if (it == hash_to_unique.end()) {
       hash_to_unique[h] = i;
@@ -257,14 +412,13 @@ void WorkingFile::computeLineMapping() {
         index_to_buffer[it->second] = -1;
       index_to_buffer[i] = it->second = -1;
     }
-    index_hashes[i++] = h;
+    i++;
   }
 
   // For buffer line i, set buffer_to_index[i] to -1 if line i is duplicated.
   i = 0;
   hash_to_unique.clear();
-  for (StringRef line : buffer_lines) {
-    uint64_t h = hashUsr(line);
+  for (uint64_t h : buffer_hashes) {
     auto it = hash_to_unique.find(h);
     if (it == hash_to_unique.end()) {
       hash_to_unique[h] = i;
@@ -274,7 +428,7 @@ void WorkingFile::computeLineMapping() {
         buffer_to_index[it->second] = -1;
       buffer_to_index[i] = it->second = -1;
     }
-    buffer_hashes[i++] = h;
+    i++;
   }
 
   // If index line i is the identical to buffer line j, and they are both
@@ -322,8 +476,11 @@ std::optional<int> WorkingFile::getBufferPosFromIndexPos(int line, int *column,
     return std::nullopt;
   }
 
-  if (index_to_buffer.empty())
-    computeLineMapping();
+  {
+    std::lock_guard lock(mapping_mutex);
+    if (index_to_buffer.empty())
+      computeLineMapping();
+  }
   return findMatchingLine(index_lines, index_to_buffer, line, column,
                           buffer_lines, is_end);
 }
@@ -333,15 +490,18 @@ std::optional<int> WorkingFile::getIndexPosFromBufferPos(int line, int *column,
   if (line < 0 || line >= (int)buffer_lines.size())
     return std::nullopt;
 
-  if (buffer_to_index.empty())
-    computeLineMapping();
+  {
+    std::lock_guard lock(mapping_mutex);
+    if (buffer_to_index.empty())
+      computeLineMapping();
+  }
   return findMatchingLine(buffer_lines, buffer_to_index, line, column,
                           index_lines, is_end);
 }
 
 Position WorkingFile::getCompletionPosition(Position pos, std::string *filter,
                                             Position *replace_end_pos) const {
-  int start = getOffsetForPosition(pos, buffer_content);
+  int start = getOffset(pos);
   int i = start;
   while (i > 0 && isIdentifierBody(buffer_content[i - 1]))
     --i;
@@ -352,12 +512,25 @@ Position WorkingFile::getCompletionPosition(Position pos, std::string *filter,
     replace_end_pos->character++;
 
   *filter = buffer_content.substr(i, start - i);
-  return getPositionForOffset(buffer_content, i);
+  return getPosition(i);
+}
+
+Position WorkingFile::getPosition(int offset) const {
+  int line = int(std::upper_bound(line_starts.begin(), line_starts.end(),
+                                  offset) -
+                 line_starts.begin()) -
+             1;
+  int start = line_starts[line];
+  if (line < (int)buffer_ascii.size() && buffer_ascii[line])
+    return {line, offset - start};
+  return {line, countColumns(std::string_view(buffer_content)
+                                 .substr(start, offset - start))};
 }
 
 WorkingFile *WorkingFiles::getFile(const std::string &path) {
-  std::lock_guard lock(mutex);
-  return getFileUnlocked(path);
+  auto e = std::atomic_load(&entries);
+  auto it = e->find(path);
+  return it != e->end() ? it->second.wf : nullptr;
 }
 
 WorkingFile *WorkingFiles::getFileUnlocked(const std::string &path) {
@@ -365,10 +538,28 @@ WorkingFile *WorkingFiles::getFileUnlocked(const std::string &path) {
   return it != files.end() ? it->second.get() : nullptr;
 }
 
+std::shared_ptr<const WorkingFiles::Snapshot>
+WorkingFiles::getSnapshot(const std::string &path) {
+  auto e = std::atomic_load(&entries);
+  auto it = e->find(path);
+  return it != e->end() ? it->second.snapshot : nullptr;
+}
+
 std::string WorkingFiles::getContent(const std::string &path) {
-  std::lock_guard lock(mutex);
-  auto it = files.find(path);
-  return it != files.end() ? it->second->buffer_content : "";
+  auto snapshot = getSnapshot(path);
+  return snapshot ? snapshot->content : "";
+}
+
+void WorkingFiles::publish(const std::string &path, WorkingFile *wf) {
+  // Only the entry of |path| is copied deeply. The other snapshots are shared
+  // with the previous map.
+  auto e = std::make_shared<Entries>(*std::atomic_load(&entries));
+  if (wf)
+    (*e)[path] = {wf, std::make_shared<const Snapshot>(Snapshot{
+                          wf->buffer_content, wf->line_starts, wf->version})};
+  else
+    e->erase(path);
+  std::atomic_store(&entries, std::shared_ptr<const Entries>(std::move(e)));
 }
 
 WorkingFile *WorkingFiles::onOpen(const TextDocumentItem &open) {
@@ -385,6 +576,9 @@ WorkingFile *WorkingFiles::onOpen(const TextDocumentItem &open) {
   } else {
     wf = std::make_unique<WorkingFile>(path, content);
   }
+  wf->viewed = ++views;
+  publish(path, wf.get());
+  generation++;
   return wf.get();
 }
 
@@ -401,35 +595,56 @@ void WorkingFiles::onChange(const TextDocumentDidChangeParam &change) {
   file->timestamp = chrono::duration_cast<chrono::seconds>(
                         chrono::high_resolution_clock::now().time_since_epoch())
                         .count();
+  file->viewed = ++views;
 
   // version: number | null
   if (change.textDocument.version)
     file->version = *change.textDocument.version;
 
+  // Multi-cursor edits and "replace all" send many changes, usually last to
+  // first so that each range is also a range of the buffer before the
+  // message. Such a run is applied in one pass, instead of splicing the lines
+  // once per change.
+  std::vector<const TextDocumentContentChangeEvent *> run;
+  std::vector<std::tuple<int, int, const std::string *>> edits;
+  auto flush = [&]() {
+    if (run.size() == 1)
+      file->applyChange(*run[0]->range, run[0]->text);
+    else if (run.size())
+      file->applyEdits(edits);
+    run.clear();
+    edits.clear();
+  };
   for (const TextDocumentContentChangeEvent &diff : change.contentChanges) {
     // Per the spec replace everything if the rangeLength and range are not set.
     // See https://github.com/Microsoft/language-server-protocol/issues/9.
     if (!diff.range) {
+      flush();
       file->buffer_content = diff.text;
       file->onBufferContentUpdated();
-    } else {
-      int start_offset =
-          getOffsetForPosition(diff.range->start, file->buffer_content);
-      // Ignore TextDocumentContentChangeEvent.rangeLength which causes trouble
-      // when UTF-16 surrogate pairs are used.
-      int end_offset =
-          getOffsetForPosition(diff.range->end, file->buffer_content);
-      file->buffer_content.replace(file->buffer_content.begin() + start_offset,
-                                   file->buffer_content.begin() + end_offset,
-                                   diff.text);
-      file->onBufferContentUpdated();
+      continue;
     }
+    // Ignore TextDocumentContentChangeEvent.rangeLength which causes trouble
+    // when UTF-16 surrogate pairs are used.
+    int start = file->getOffset(diff.range->start),
+        end = std::max(start, file->getOffset(diff.range->end));
+    if (edits.size() && end > std::get<0>(edits.back())) {
+      flush();
+      start = file->getOffset(diff.range->start);
+      end = std::max(start, file->getOffset(diff.range->end));
+    }
+    run.push_back(&diff);
+    edits.emplace_back(start, end, &diff.text);
   }
+  flush();
+  publish(path, file);
 }
 
 void WorkingFiles::onClose(const std::string &path) {
   std::lock_guard lock(mutex);
+  publish(path, nullptr);
   files.erase(path);
+  generation++;
 }
 
 // VSCode (UTF-16) disagrees with Emacs lsp-mode (UTF-8) on how to represent
@@ -437,11 +652,18 @@ void WorkingFiles::onClose(const std::string &path) {
 // We use a UTF-8 iterator to approximate UTF-16 in the specification (weird).
 // This is good enough and fails only for UTF-16 surrogate pairs.
 int getOffsetForPosition(Position pos, std::string_view content) {
-  size_t i = 0;
-  for (; pos.line > 0 && i < content.size(); i++)
-    if (content[i] == '\n')
-      pos.line--;
-  for (; pos.character > 0 && i < content.size() && content[i] != '\n';
+  size_t i = 0, n = content.size();
+  for (; pos.line > 0 && i < n; pos.line--) {
+    const void *nl = memchr(content.data() + i, '\n', n - i);
+    i = nl ? static_cast<const char *>(nl) - content.data() + 1 : n;
+  }
+  // Skip runs of 8 ASCII characters without a newline.
+  for (uint64_t w; pos.character >= 8 && i + 8 <= n &&
+                   !((w = load64(content.data() + i)) & kHighBits) &&
+                   !hasNewline(w);
+       i += 8)
+    pos.character -= 8;
+  for (; pos.character > 0 && i < n && content[i] != '\n';
        pos.character--)
     if (uint8_t(content[i++]) >= 128) {
       // Skip 0b10xxxxxx
@@ -452,6 +674,20 @@ int getOffsetForPosition(Position pos, std::string_view content) {
   return int(i);
 }
 
+int countColumns(std::string_view text) {
+  const char *p = text.data();
+  size_t n = text.size(), i = 0, cont = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t w = load64(p + i);
+    // Bit 7 of each continuation byte, then their number in the top byte.
+    uint64_t c = w & ~(w << 1) & kHighBits;
+    cont += (c >> 7) * kOnes >> 56;
+  }
+  for (; i < n; i++)
+    cont += (uint8_t(p[i]) & 0xc0) == 0x80;
+  return int(n - cont);
+}
+
 std::string_view lexIdentifierAroundPos(Position position,
                                         std::string_view content) {
   int start = getOffsetForPosition(position, content), end = start + 1;
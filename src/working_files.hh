@@ -6,9 +6,12 @@
 #include "lsp.hh"
 #include "utils.hh"
 
+#include <atomic>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <string>
+#include <tuple>
 #include <unordered_map>
 
 namespace ccls {
@@ -30,8 +33,42 @@ struct WorkingFile {
   // confident lines to resolve its line number.
   std::vector<int> index_to_buffer;
   std::vector<int> buffer_to_index;
+  // hashUsr of each line of |index_lines| and |buffer_lines|.
+  std::vector<uint64_t> index_hashes;
+  std::vector<uint64_t> buffer_hashes;
+  // Whether each line of |buffer_lines| is ASCII, so that its columns are
+  // byte offsets.
+  std::vector<uint8_t> buffer_ascii;
+  // Offsets in |buffer_content| of each line start, including the empty line
+  // after a trailing newline.
+  std::vector<int> line_starts;
   // A set of diagnostics that have been reported for this file.
   std::vector<Diagnostic> diagnostics;
+  // The params of the last $ccls/publishSemanticHighlight and the
+  // DB::generation they were computed at. Reset when the buffer or the indexed
+  // content changes.
+  std::string highlight;
+  uint64_t highlight_generation = ~uint64_t(0);
+  // Likewise for the data of the last textDocument/semanticTokens result.
+  std::vector<int> semantic_tokens;
+  std::string semantic_tokens_id;
+  uint64_t semantic_tokens_generation = ~uint64_t(0);
+  // Likewise for the serialized hierarchical textDocument/documentSymbol
+  // result of the whole file with excludeRole |document_symbols_exclude|.
+  std::string document_symbols;
+  uint64_t document_symbols_generation = ~uint64_t(0);
+  int document_symbols_exclude = 0;
+  // Likewise for the textDocument/foldingRange result of the whole file.
+  std::string folding_ranges;
+  uint64_t folding_ranges_generation = ~uint64_t(0);
+  // Likewise for the params of the last $ccls/publishSkippedRanges.
+  std::string skipped_ranges;
+  uint64_t skipped_ranges_generation = ~uint64_t(0);
+  // Set when a refresh skipped the highlight of this file because it was not
+  // recently viewed. The highlight is sent when the file is viewed again.
+  bool highlight_deferred = false;
+  // WorkingFiles::views when the file was last opened or changed.
+  int64_t viewed = 0;
 
   WorkingFile(const std::string &filename, const std::string &buffer_content);
 
@@ -39,6 +76,19 @@ struct WorkingFile {
   void setIndexContent(const std::string &index_content);
   // This should be called whenever |buffer_content| has changed.
   void onBufferContentUpdated();
+  // Replaces |range| of the buffer with |text| and updates |buffer_lines|,
+  // |buffer_hashes| and the line mappings for the touched lines only.
+  void applyChange(lsRange range, const std::string &text);
+  // Replaces the byte ranges [start, end) of the buffer with the texts, in
+  // one pass with a single rebuild of the lines. The ranges are in the
+  // current buffer, last to first and not overlapping.
+  void applyEdits(
+      const std::vector<std::tuple<int, int, const std::string *>> &edits);
+  // Like getOffsetForPosition(pos, buffer_content), without scanning the lines
+  // before |pos|.
+  int getOffset(Position pos) const;
+  // The inverse of getOffset.
+  Position getPosition(int offset) const;
 
   // Finds the buffer line number which maps to index line number |line|.
   // Also resolves |column| if not NULL.
@@ -56,13 +106,29 @@ struct WorkingFile {
                                  Position *replace_end_pos) const;
 
 private:
+  // Guards the lazy computation of the mappings, which may happen on several
+  // request threads.
+  std::mutex mapping_mutex;
   // Compute index_to_buffer and buffer_to_index.
   void computeLineMapping();
 };
 
 struct WorkingFiles {
+  // An immutable copy of a buffer, which stays valid after the file is
+  // changed or closed.
+  struct Snapshot {
+    std::string content;
+    // See WorkingFile::line_starts.
+    std::vector<int> line_starts;
+    int version;
+  };
+
+  // Does not lock |mutex|, so that lookups by requests, indexers and sema
+  // threads do not wait for edits.
   WorkingFile *getFile(const std::string &path);
   WorkingFile *getFileUnlocked(const std::string &path);
+  // Returns nullptr if |path| is not open. Does not lock |mutex|.
+  std::shared_ptr<const Snapshot> getSnapshot(const std::string &path);
   std::string getContent(const std::string &path);
 
   template <typename Fn> void withLock(Fn &&fn) {
@@ -76,9 +142,31 @@ struct WorkingFiles {
 
   std::mutex mutex;
   std::unordered_map<std::string, std::unique_ptr<WorkingFile>> files;
+  // Incremented by onOpen and onChange. Files viewed most recently are likely
+  // visible in the editor.
+  int64_t views = 0;
+  // Incremented by onOpen and onClose, invalidating cached WorkingFile
+  // pointers. See getLsLocation.
+  std::atomic<uint32_t> generation{0};
+
+private:
+  struct Entry {
+    WorkingFile *wf;
+    std::shared_ptr<const Snapshot> snapshot;
+  };
+  using Entries = std::unordered_map<std::string, Entry>;
+  // Copy-on-write view of |files|, replaced under |mutex| by onOpen, onChange
+  // and onClose and read with std::atomic_load.
+  std::shared_ptr<const Entries> entries = std::make_shared<Entries>();
+
+  // Publishes the buffer of |wf|, or removes |path| if |wf| is null.
+  void publish(const std::string &path, WorkingFile *wf);
 };
 
 int getOffsetForPosition(Position pos, std::string_view content);
+// Returns the column after |text| on a line, counting UTF-8 sequences like
+// getOffsetForPosition.
+int countColumns(std::string_view text);
 
 std::string_view lexIdentifierAroundPos(Position position,
                                         std::string_view content);